@@ -31,6 +31,9 @@
 #include <htslib/hts.h>
 #include "HMM.h"
 
+// Number of cached transition matrices for long gaps, see _set_tprob()
+#define HMM_TPROB_CACHE 256
+
 typedef struct
 {
     int nstates;            // number of hmm's states
@@ -57,6 +60,8 @@ struct _hmm_t
     double *tprob_arr;          // Array of transition matrices, precalculated to ntprob_arr
                                 //  positions. The first matrix is the initial tprob matrix
                                 //  set by hmm_init() or hmm_set_tprob()
+    int *tprob_cache_key;       // Transition matrices for gaps longer than ntprob_arr, direct-mapped
+    double *tprob_cache;        //  by pos_diff % HMM_TPROB_CACHE; the key is pos_diff or -1 if empty
     set_tprob_f set_tprob;      // Optional user function to set / modify transition probabilities
                                 //  at each site (one step of Viterbi algorithm)
     void *set_tprob_data;
@@ -164,6 +169,7 @@ void *hmm_snapshot(hmm_t *hmm, void *_snapshot, uint32_t pos)
 void hmm_restore(hmm_t *hmm, void *_snapshot)
 {
     snapshot_t *snapshot = (snapshot_t*) _snapshot;
+    hmm->snapshot = NULL;   // a new snapshot must be requested by hmm_snapshot() after restore
     if ( !snapshot || !snapshot->snap_at_pos ) 
     {
         hmm->state.snap_at_pos = 0;
@@ -199,6 +205,16 @@ void hmm_set_tprob(hmm_t *hmm, double *tprob, int ntprob)
     int i;
     for (i=1; i<ntprob; i++)
         multiply_matrix(hmm->nstates, hmm->tprob_arr, hmm->tprob_arr+(i-1)*hmm->nstates*hmm->nstates, hmm->tprob_arr+i*hmm->nstates*hmm->nstates, hmm->tmp);
+
+    if ( hmm->ntprob_arr > 0 )
+    {
+        if ( !hmm->tprob_cache )
+        {
+            hmm->tprob_cache_key = (int*) malloc(sizeof(int)*HMM_TPROB_CACHE);
+            hmm->tprob_cache = (double*) malloc(sizeof(double)*hmm->nstates*hmm->nstates*HMM_TPROB_CACHE);
+        }
+        for (i=0; i<HMM_TPROB_CACHE; i++) hmm->tprob_cache_key[i] = -1;
+    }
 }
 
 void hmm_set_tprob_func(hmm_t *hmm, set_tprob_f set_tprob, void *data)
@@ -211,17 +227,33 @@ static void _set_tprob(hmm_t *hmm, int pos_diff)
 {
     assert( pos_diff>=0 );
 
-    int i, n;
+    int i, n, nn = hmm->nstates*hmm->nstates;
 
     n = hmm->ntprob_arr ? pos_diff % hmm->ntprob_arr : 0;  // n-th precalculated matrix
-    memcpy(hmm->curr_tprob, hmm->tprob_arr+n*hmm->nstates*hmm->nstates, sizeof(*hmm->curr_tprob)*hmm->nstates*hmm->nstates);
+    if ( hmm->ntprob_arr <= 0 || pos_diff < hmm->ntprob_arr )
+    {
+        memcpy(hmm->curr_tprob, hmm->tprob_arr+n*nn, sizeof(*hmm->curr_tprob)*nn);
+        return;
+    }
 
-    if ( hmm->ntprob_arr > 0  )
+    // Long gaps require a series of matrix multiplications. The same gaps
+    // recur frequently (fixed array spacing, the fwd and bwd passes, repeated
+    // runs over the same sites), so reuse the result when possible
+    int islot = pos_diff % HMM_TPROB_CACHE;
+    double *cached = hmm->tprob_cache + islot*nn;
+    if ( hmm->tprob_cache_key[islot]==pos_diff )
     {
-        n = pos_diff / hmm->ntprob_arr;  // number of full blocks to jump
-        for (i=0; i<n; i++)
-            multiply_matrix(hmm->nstates, hmm->tprob_arr+(hmm->ntprob_arr-1)*hmm->nstates*hmm->nstates, hmm->curr_tprob, hmm->curr_tprob, hmm->tmp);
+        memcpy(hmm->curr_tprob, cached, sizeof(*hmm->curr_tprob)*nn);
+        return;
     }
+
+    memcpy(hmm->curr_tprob, hmm->tprob_arr+n*nn, sizeof(*hmm->curr_tprob)*nn);
+    n = pos_diff / hmm->ntprob_arr;  // number of full blocks to jump
+    for (i=0; i<n; i++)
+        multiply_matrix(hmm->nstates, hmm->tprob_arr+(hmm->ntprob_arr-1)*nn, hmm->curr_tprob, hmm->curr_tprob, hmm->tmp);
+
+    hmm->tprob_cache_key[islot] = pos_diff;
+    memcpy(cached, hmm->curr_tprob, sizeof(*hmm->curr_tprob)*nn);
 }
 
 void hmm_run_viterbi(hmm_t *hmm, int n, double *eprobs, uint32_t *sites)
@@ -257,11 +289,11 @@ void hmm_run_viterbi(hmm_t *hmm, int n, double *eprobs, uint32_t *sites)
         double vnorm = 0;
         for (j=0; j<nstates; j++)
         {
-            double vmax = 0;
+            double vmax = 0, *tprob = &MAT(hmm->curr_tprob,nstates,j,0);
             int k, k_vmax = 0;
             for (k=0; k<nstates; k++)
             {
-                double pval = hmm->vprob[k] * MAT(hmm->curr_tprob,hmm->nstates,j,k);
+                double pval = hmm->vprob[k] * tprob[k];
                 if ( vmax < pval ) { vmax = pval; k_vmax = k; }
             }
             vpath[j] = k_vmax;
@@ -325,9 +357,9 @@ void hmm_run_fwd_bwd(hmm_t *hmm, int n, double *eprobs, uint32_t *sites)
         double norm = 0;
         for (j=0; j<nstates; j++)
         {
-            double pval = 0;
+            double pval = 0, *tprob = &MAT(hmm->curr_tprob,nstates,j,0);
             for (k=0; k<nstates; k++)
-                pval += fwd_prev[k] * MAT(hmm->curr_tprob,hmm->nstates,j,k);
+                pval += fwd_prev[k] * tprob[k];
             fwd[j] = pval * eprob[j];
             norm += fwd[j];
         }
@@ -351,15 +383,16 @@ void hmm_run_fwd_bwd(hmm_t *hmm, int n, double *eprobs, uint32_t *sites)
         if ( hmm->set_tprob ) hmm->set_tprob(hmm, sites[n-i-1], prev_pos, hmm->set_tprob_data, hmm->curr_tprob);
         prev_pos = sites[n-i-1];
 
-        double bwd_norm = 0;
-        for (j=0; j<nstates; j++)
+        // Iterate over the rows of the transition matrix so that the inner
+        // loop accesses the memory contiguously
+        for (j=0; j<nstates; j++) bwd_tmp[j] = 0;
+        for (k=0; k<nstates; k++)
         {
-            double pval = 0;
-            for (k=0; k<nstates; k++)
-                pval += bwd[k] * eprob[k] * MAT(hmm->curr_tprob,hmm->nstates,k,j);
-            bwd_tmp[j] = pval;
-            bwd_norm += pval;
+            double pval = bwd[k] * eprob[k], *tprob = &MAT(hmm->curr_tprob,nstates,k,0);
+            for (j=0; j<nstates; j++) bwd_tmp[j] += pval * tprob[j];
         }
+        double bwd_norm = 0;
+        for (j=0; j<nstates; j++) bwd_norm += bwd_tmp[j];
         double norm = 0;
         for (j=0; j<nstates; j++)
         {
@@ -413,9 +446,9 @@ double *hmm_run_baum_welch(hmm_t *hmm, int n, double *eprobs, uint32_t *sites)
         double norm = 0;
         for (j=0; j<nstates; j++)
         {
-            double pval = 0;
+            double pval = 0, *tprob = &MAT(hmm->curr_tprob,nstates,j,0);
             for (k=0; k<nstates; k++)
-                pval += fwd_prev[k] * MAT(hmm->curr_tprob,hmm->nstates,j,k);
+                pval += fwd_prev[k] * tprob[k];
             fwd[j] = pval * eprob[j];
             norm += fwd[j];
         }
@@ -436,15 +469,16 @@ double *hmm_run_baum_welch(hmm_t *hmm, int n, double *eprobs, uint32_t *sites)
         if ( hmm->set_tprob ) hmm->set_tprob(hmm, sites[n-i-1], prev_pos, hmm->set_tprob_data, hmm->curr_tprob);
         prev_pos = sites[n-i-1];
 
-        double bwd_norm = 0;
-        for (j=0; j<nstates; j++)
+        // Iterate over the rows of the transition matrix so that the inner
+        // loop accesses the memory contiguously
+        for (j=0; j<nstates; j++) bwd_tmp[j] = 0;
+        for (k=0; k<nstates; k++)
         {
-            double pval = 0;
-            for (k=0; k<nstates; k++)
-                pval += bwd[k] * eprob[k] * MAT(hmm->curr_tprob,hmm->nstates,k,j);
-            bwd_tmp[j] = pval;
-            bwd_norm += pval;
+            double pval = bwd[k] * eprob[k], *tprob = &MAT(hmm->curr_tprob,nstates,k,0);
+            for (j=0; j<nstates; j++) bwd_tmp[j] += pval * tprob[j];
         }
+        double bwd_norm = 0;
+        for (j=0; j<nstates; j++) bwd_norm += bwd_tmp[j];
         double norm = 0;
         for (j=0; j<nstates; j++)
         {
@@ -458,9 +492,9 @@ double *hmm_run_baum_welch(hmm_t *hmm, int n, double *eprobs, uint32_t *sites)
             tmp_gamma[j] += fwd_bwd[j];
         }
 
-        for (j=0; j<nstates; j++)
+        for (k=0; k<nstates; k++)
         {
-            for (k=0; k<nstates; k++)
+            for (j=0; j<nstates; j++)
             {
                 MAT(tmp_xi,nstates,k,j) += fwd[j]*bwd[k]*MAT(hmm->tprob_arr,hmm->nstates,k,j)*eprob[k] / norm;
             }
@@ -501,6 +535,8 @@ void hmm_destroy(hmm_t *hmm)
     free(hmm->curr_tprob);
     free(hmm->tmp);
     free(hmm->tprob_arr);
+    free(hmm->tprob_cache_key);
+    free(hmm->tprob_cache);
     free(hmm->fwd);
     free(hmm->bwd);
     free(hmm->bwd_tmp);
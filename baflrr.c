@@ -0,0 +1,321 @@
+/* The MIT License
+
+   Copyright (c) 2017 Genome Research Ltd.
+
+   Author: Petr Danecek <pd3@sanger.ac.uk>
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <sys/stat.h>
+#include <htslib/vcf.h>
+#include <htslib/kstring.h>
+#include <htslib/khash_str2int.h>
+#include "bcftools.h"
+#include "baflrr.h"
+#include "cache.h"
+
+/*
+    The cache layout, see cache.h:
+        baflrr_hdr_t
+        chunks      .. up to BAFLRR_CHUNK sites of one sequence: uint32_t positions [nsite],
+                       uint16_t BAF [nsmpl][nsite], int16_t LRR [nsmpl][nsite] if has_lrr,
+                       padded to 8 bytes. The values of one sample are contiguous.
+        index       .. baflrr_chunk_t [nchunk]
+        sequences   .. uint64_t index of the first chunk of each sequence [nseq+1],
+                       followed by NUL-terminated sequence names
+        samples     .. NUL-terminated sample names
+    The offsets are from the beginning of the file. The stamp covers the size
+    and mtime of the VCF.
+*/
+#define BAFLRR_MAGIC "BCFBAF\2"
+#define BAFLRR_CHUNK 16384
+#define BAF_MISSING  UINT16_MAX
+#define LRR_MISSING  INT16_MIN
+#define LRR_SCALE    1000.
+
+typedef struct
+{
+    uint64_t nsmpl, nseq, nchunk, has_lrr;
+    uint64_t chunk_off, seq_off, smpl_off;
+}
+baflrr_hdr_t;
+
+typedef struct
+{
+    uint64_t off;
+    uint32_t nsite, unused;
+}
+baflrr_chunk_t;
+
+struct _baflrr_t
+{
+    cache_t *cache;
+    uint8_t *map;
+    baflrr_hdr_t *hdr;
+    baflrr_chunk_t *chunk;
+    uint64_t *seq_beg;
+    char **seq_names, **smpl_names;
+    void *smpl2id;
+};
+
+static inline uint16_t baf_to_u16(float baf)
+{
+    if ( bcf_float_is_missing(baf) || isnan(baf) ) return BAF_MISSING;
+    if ( baf < 0 ) baf = 0;
+    if ( baf > 1 ) baf = 1;
+    return baf*(BAF_MISSING-1) + 0.5;
+}
+static inline float u16_to_baf(uint16_t val)
+{
+    return val==BAF_MISSING ? NAN : (float)val/(BAF_MISSING-1);
+}
+static inline int16_t lrr_to_i16(float lrr)
+{
+    if ( bcf_float_is_missing(lrr) || isnan(lrr) ) return LRR_MISSING;
+    lrr *= LRR_SCALE;
+    if ( lrr < -INT16_MAX ) return -INT16_MAX;
+    if ( lrr > INT16_MAX ) return INT16_MAX;
+    return lrr<0 ? lrr - 0.5 : lrr + 0.5;
+}
+static inline float i16_to_lrr(int16_t val)
+{
+    return val==LRR_MISSING ? NAN : val/LRR_SCALE;
+}
+
+static void flush_chunk(cache_t *out, baflrr_chunk_t *chunk, int nsmpl, int has_lrr, uint32_t *pos, uint16_t *baf, int16_t *lrr)
+{
+    int i;
+    chunk->off = out->off;
+    cache_write(out, pos, sizeof(*pos)*chunk->nsite);
+    for (i=0; i<nsmpl; i++) cache_write(out, baf + i*BAFLRR_CHUNK, sizeof(*baf)*chunk->nsite);
+    if ( has_lrr )
+        for (i=0; i<nsmpl; i++) cache_write(out, lrr + i*BAFLRR_CHUNK, sizeof(*lrr)*chunk->nsite);
+    cache_pad(out, 8);
+}
+
+// Read the VCF and write the cache
+static void baflrr_build(const char *vcf_fname, const char *cache_fname, uint64_t stamp)
+{
+    htsFile *fp = hts_open(vcf_fname, "r");
+    if ( !fp ) error("Failed to read %s\n", vcf_fname);
+    bcf_hdr_t *hdr = bcf_hdr_read(fp);
+    if ( !hdr ) error("Failed to read the header of %s\n", vcf_fname);
+    if ( !bcf_hdr_idinfo_exists(hdr,BCF_HL_FMT,bcf_hdr_id2int(hdr,BCF_DT_ID,"BAF")) )
+        error("The tag FORMAT/BAF is not present in the VCF: %s\n", vcf_fname);
+
+    cache_t *out = cache_create(cache_fname, BAFLRR_MAGIC, stamp);
+    baflrr_hdr_t bhdr;
+    memset(&bhdr, 0, sizeof(bhdr));
+    bhdr.nsmpl   = bcf_hdr_nsamples(hdr);
+    bhdr.has_lrr = bcf_hdr_idinfo_exists(hdr,BCF_HL_FMT,bcf_hdr_id2int(hdr,BCF_DT_ID,"LRR")) ? 1 : 0;
+    uint64_t hdr_off = out->off;
+    cache_write(out, &bhdr, sizeof(bhdr));       // rewritten with the counts at the end
+
+    int nsmpl = bhdr.nsmpl, mseen = 0;
+    uint8_t *seen = NULL;
+    uint32_t *pos = (uint32_t*) malloc(sizeof(*pos)*BAFLRR_CHUNK);
+    uint16_t *baf = (uint16_t*) malloc(sizeof(*baf)*BAFLRR_CHUNK*nsmpl);
+    int16_t  *lrr = bhdr.has_lrr ? (int16_t*) malloc(sizeof(*lrr)*BAFLRR_CHUNK*nsmpl) : NULL;
+    int i, nseq = 0, mseq = 0, nchunk = 0, mchunk = 0, prev_rid = -1, prev_pos = -1;
+    baflrr_chunk_t *chunk = NULL;
+    uint64_t *seq_beg = NULL;
+    kstring_t seq_names = {0,0,0};
+    bcf1_t *rec = bcf_init1();
+    while ( bcf_read1(fp, hdr, rec)==0 )
+    {
+        bcf_unpack(rec, BCF_UN_FMT);
+        bcf_fmt_t *baf_fmt = bcf_get_fmt(hdr, rec, "BAF");
+        if ( !baf_fmt ) continue;
+        bcf_fmt_t *lrr_fmt = bhdr.has_lrr ? bcf_get_fmt(hdr, rec, "LRR") : NULL;
+        if ( baf_fmt->type!=BCF_BT_FLOAT || (lrr_fmt && lrr_fmt->type!=BCF_BT_FLOAT) )
+            error("Expected Float FORMAT/BAF and FORMAT/LRR at %s:%d\n", bcf_seqname(hdr,rec), rec->pos+1);
+
+        if ( rec->rid!=prev_rid || (nchunk && chunk[nchunk-1].nsite==BAFLRR_CHUNK) )
+        {
+            if ( nchunk ) flush_chunk(out, &chunk[nchunk-1], nsmpl, bhdr.has_lrr, pos, baf, lrr);
+            if ( rec->rid!=prev_rid )
+            {
+                if ( cache_seq_seen(&seen, &mseen, rec->rid) ) error("The file is not sorted: %s\n", vcf_fname);
+                hts_expand(uint64_t, nseq+2, mseq, seq_beg);
+                seq_beg[nseq++] = nchunk;
+                kputs(bcf_seqname(hdr,rec), &seq_names);
+                kputc(0, &seq_names);
+                prev_rid = rec->rid;
+                prev_pos = -1;
+            }
+            hts_expand(baflrr_chunk_t, nchunk+1, mchunk, chunk);
+            memset(&chunk[nchunk++], 0, sizeof(*chunk));
+        }
+        if ( rec->pos < prev_pos ) error("The file is not sorted: %s\n", vcf_fname);
+        prev_pos = rec->pos;
+
+        baflrr_chunk_t *ck = &chunk[nchunk-1];
+        pos[ck->nsite] = rec->pos;
+        for (i=0; i<nsmpl; i++)
+            baf[i*BAFLRR_CHUNK + ck->nsite] = baf_to_u16(((float*)(baf_fmt->p + baf_fmt->size*i))[0]);
+        if ( lrr )
+            for (i=0; i<nsmpl; i++)
+                lrr[i*BAFLRR_CHUNK + ck->nsite] = lrr_fmt ? lrr_to_i16(((float*)(lrr_fmt->p + lrr_fmt->size*i))[0]) : LRR_MISSING;
+        ck->nsite++;
+    }
+    if ( nchunk ) flush_chunk(out, &chunk[nchunk-1], nsmpl, bhdr.has_lrr, pos, baf, lrr);
+    if ( nseq ) seq_beg[nseq] = nchunk;
+
+    bhdr.nseq      = nseq;
+    bhdr.nchunk    = nchunk;
+    bhdr.chunk_off = out->off;
+    cache_write(out, chunk, sizeof(*chunk)*nchunk);
+    bhdr.seq_off   = out->off;
+    cache_write(out, seq_beg, nseq ? sizeof(*seq_beg)*(nseq+1) : 0);
+    cache_write(out, seq_names.s, seq_names.l);
+    bhdr.smpl_off  = out->off;
+    for (i=0; i<nsmpl; i++) cache_write(out, hdr->samples[i], strlen(hdr->samples[i])+1);
+    cache_write_at(out, hdr_off, &bhdr, sizeof(bhdr));
+    cache_commit(out);
+
+    bcf_destroy1(rec);
+    bcf_hdr_destroy(hdr);
+    if ( hts_close(fp)!=0 ) error("Close failed: %s\n", vcf_fname);
+    free(seen);
+    free(pos);
+    free(baf);
+    free(lrr);
+    free(chunk);
+    free(seq_beg);
+    free(seq_names.s);
+}
+
+// Returns NULL if the cache does not exist or is outdated
+static baflrr_t *baflrr_load(const char *cache_fname, uint64_t stamp)
+{
+    cache_t *cache = cache_open(cache_fname, BAFLRR_MAGIC, stamp, "BAF/LRR cache");
+    if ( !cache ) return NULL;
+
+    baflrr_t *baflrr = (baflrr_t*) calloc(1, sizeof(baflrr_t));
+    baflrr->cache   = cache;
+    baflrr->map     = cache->map;
+    baflrr->hdr     = (baflrr_hdr_t*) cache_ptr(cache, cache->off, sizeof(baflrr_hdr_t));
+    baflrr->chunk   = (baflrr_chunk_t*) cache_ptr(cache, baflrr->hdr->chunk_off, sizeof(baflrr_chunk_t)*baflrr->hdr->nchunk);
+    baflrr->seq_beg = (uint64_t*) cache_ptr(cache, baflrr->hdr->seq_off, baflrr->hdr->nseq ? sizeof(uint64_t)*(baflrr->hdr->nseq+1) : 0);
+    cache_ptr(cache, baflrr->hdr->smpl_off, 0);
+
+    uint64_t i;
+    baflrr->seq_names = (char**) malloc(sizeof(char*)*baflrr->hdr->nseq);
+    char *name = (char*) (baflrr->seq_beg + (baflrr->hdr->nseq ? baflrr->hdr->nseq + 1 : 0));
+    for (i=0; i<baflrr->hdr->nseq; i++)
+    {
+        baflrr->seq_names[i] = name;
+        name += strlen(name) + 1;
+    }
+    baflrr->smpl2id    = khash_str2int_init();
+    baflrr->smpl_names = (char**) malloc(sizeof(char*)*baflrr->hdr->nsmpl);
+    name = (char*) (baflrr->map + baflrr->hdr->smpl_off);
+    for (i=0; i<baflrr->hdr->nsmpl; i++)
+    {
+        baflrr->smpl_names[i] = name;
+        khash_str2int_set(baflrr->smpl2id, name, i);
+        name += strlen(name) + 1;
+    }
+    return baflrr;
+}
+
+baflrr_t *baflrr_open(const char *vcf_fname, const char *cache_fname)
+{
+    struct stat st;
+    if ( stat(vcf_fname, &st)!=0 ) error("Failed to stat %s: %s\n", vcf_fname, strerror(errno));
+    uint64_t stamp = cache_stamp_file(CACHE_STAMP_INIT, vcf_fname);
+    baflrr_t *baflrr = baflrr_load(cache_fname, stamp);
+    if ( baflrr ) return baflrr;
+    baflrr_build(vcf_fname, cache_fname, stamp);
+    baflrr = baflrr_load(cache_fname, stamp);
+    if ( !baflrr ) error("Failed to load %s\n", cache_fname);
+    return baflrr;
+}
+
+void baflrr_destroy(baflrr_t *baflrr)
+{
+    if ( !baflrr ) return;
+    cache_close(baflrr->cache);
+    khash_str2int_destroy(baflrr->smpl2id);
+    free(baflrr->seq_names);
+    free(baflrr->smpl_names);
+    free(baflrr);
+}
+
+int baflrr_has_lrr(baflrr_t *baflrr) { return baflrr->hdr->has_lrr ? 1 : 0; }
+int baflrr_nsamples(baflrr_t *baflrr) { return baflrr->hdr->nsmpl; }
+const char *baflrr_sample_name(baflrr_t *baflrr, int ismpl) { return baflrr->smpl_names[ismpl]; }
+int baflrr_nseqs(baflrr_t *baflrr) { return baflrr->hdr->nseq; }
+const char *baflrr_seq_name(baflrr_t *baflrr, int iseq) { return baflrr->seq_names[iseq]; }
+
+int baflrr_sample_idx(baflrr_t *baflrr, const char *name)
+{
+    int id;
+    if ( khash_str2int_get(baflrr->smpl2id, name, &id)!=0 ) return -1;
+    return id;
+}
+
+int baflrr_get_sites(baflrr_t *baflrr, int iseq, uint32_t **pos, int *mpos)
+{
+    uint64_t i;
+    int n = 0;
+    for (i=baflrr->seq_beg[iseq]; i<baflrr->seq_beg[iseq+1]; i++)
+    {
+        baflrr_chunk_t *ck = &baflrr->chunk[i];
+        hts_expand(uint32_t, n + ck->nsite, *mpos, *pos);
+        memcpy(*pos + n, baflrr->map + ck->off, sizeof(uint32_t)*ck->nsite);
+        n += ck->nsite;
+    }
+    return n;
+}
+
+int baflrr_get_values(baflrr_t *baflrr, int iseq, int ismpl, float **baf, float **lrr, int *mvals)
+{
+    uint64_t i, nsmpl = baflrr->hdr->nsmpl;
+    int j, n = 0;
+    for (i=baflrr->seq_beg[iseq]; i<baflrr->seq_beg[iseq+1]; i++)
+    {
+        baflrr_chunk_t *ck = &baflrr->chunk[i];
+        if ( n + ck->nsite > *mvals )
+        {
+            hts_expand(float, n + ck->nsite, *mvals, *baf);
+            if ( lrr ) *lrr = (float*) realloc(*lrr, sizeof(float)*(*mvals));
+        }
+        uint8_t *ptr = baflrr->map + ck->off + sizeof(uint32_t)*ck->nsite;
+        uint16_t *baf_ptr = (uint16_t*) ptr + ismpl*ck->nsite;
+        for (j=0; j<ck->nsite; j++) (*baf)[n+j] = u16_to_baf(baf_ptr[j]);
+        if ( lrr && baflrr->hdr->has_lrr )
+        {
+            int16_t *lrr_ptr = (int16_t*) (ptr + sizeof(uint16_t)*nsmpl*ck->nsite) + ismpl*ck->nsite;
+            for (j=0; j<ck->nsite; j++) (*lrr)[n+j] = i16_to_lrr(lrr_ptr[j]);
+        }
+        else if ( lrr )
+            for (j=0; j<ck->nsite; j++) (*lrr)[n+j] = NAN;
+        n += ck->nsite;
+    }
+    return n;
+}
+
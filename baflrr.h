@@ -0,0 +1,88 @@
+/* The MIT License
+
+   Copyright (c) 2017 Genome Research Ltd.
+
+   Author: Petr Danecek <pd3@sanger.ac.uk>
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+
+ */
+
+/*
+    Memory-mapped cache of FORMAT/BAF and FORMAT/LRR values, built once from
+    a VCF and then read one sequence and one sample at a time. The values are
+    quantized to 16 bits, BAF with the resolution of 1/65534 and LRR of 1e-3.
+*/
+
+#ifndef __BAFLRR_H__
+#define __BAFLRR_H__
+
+#include <stdint.h>
+
+typedef struct _baflrr_t baflrr_t;
+
+/*
+ *  baflrr_open() - open the cache of a VCF, building it first if it does not
+ *      exist or if the VCF has changed since
+ *  @vcf_fname:     the VCF/BCF with FORMAT/BAF and, optionally, FORMAT/LRR
+ *  @cache_fname:   the cache file
+ */
+baflrr_t *baflrr_open(const char *vcf_fname, const char *cache_fname);
+void baflrr_destroy(baflrr_t *baflrr);
+
+/*
+ *  baflrr_has_lrr() - returns 1 if the VCF has FORMAT/LRR, 0 otherwise
+ */
+int baflrr_has_lrr(baflrr_t *baflrr);
+
+/*
+ *  baflrr_nsamples(), baflrr_sample_name() - the samples of the VCF
+ *  baflrr_sample_idx() - returns the index of the sample or -1 if not present
+ */
+int baflrr_nsamples(baflrr_t *baflrr);
+const char *baflrr_sample_name(baflrr_t *baflrr, int ismpl);
+int baflrr_sample_idx(baflrr_t *baflrr, const char *name);
+
+/*
+ *  baflrr_nseqs(), baflrr_seq_name() - the sequences in the order of the VCF
+ */
+int baflrr_nseqs(baflrr_t *baflrr);
+const char *baflrr_seq_name(baflrr_t *baflrr, int iseq);
+
+/*
+ *  baflrr_get_sites() - 0-based positions of all sites on the sequence
+ *  @pos,mpos:  the array to fill, reallocated as needed
+ *
+ *  Returns the number of sites.
+ */
+int baflrr_get_sites(baflrr_t *baflrr, int iseq, uint32_t **pos, int *mpos);
+
+/*
+ *  baflrr_get_values() - BAF and LRR values of one sample on the sequence,
+ *      in the same order as baflrr_get_sites() positions
+ *  @baf,lrr:   the arrays to fill, reallocated as needed. Missing values are
+ *              set to NAN. Pass lrr=NULL when LRR is not needed.
+ *  @mvals:     the allocated size of both arrays
+ *
+ *  Returns the number of sites.
+ */
+int baflrr_get_values(baflrr_t *baflrr, int iseq, int ismpl, float **baf, float **lrr, int *mvals);
+
+#endif
+
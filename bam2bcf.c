@@ -73,6 +73,7 @@ void bcf_call_destroy(bcf_callaux_t *bca)
     free(bca->ref_mq); free(bca->alt_mq); free(bca->ref_bq); free(bca->alt_bq);
     free(bca->fwd_mqs); free(bca->rev_mqs);
     bca->nqual = 0;
+    free(bca->ref2); free(bca->score1); free(bca->score2); free(bca->rd); free(bca->rdseq);
     free(bca->bases); free(bca->inscns); free(bca);
 }
 
@@ -712,7 +713,6 @@ int bcf_call_combine(int n, const bcf_callret1_t *calls, bcf_callaux_t *bca, int
 
 int bcf_call2bcf(bcf_call_t *bc, bcf1_t *rec, bcf_callret1_t *bcr, int fmt_flag, const bcf_callaux_t *bca, const char *ref)
 {
-    extern double kt_fisher_exact(int n11, int n12, int n21, int n22, double *_left, double *_right, double *two);
     int i, j, nals = 1;
 
     bcf_hdr_t *hdr = bc->bcf_hdr;
@@ -829,8 +829,7 @@ int bcf_call2bcf(bcf_call_t *bc, bcf1_t *rec, bcf_callret1_t *bcr, int fmt_flag,
                 ptr[i] = 0;
             else
             {
-                double left, right, two;
-                kt_fisher_exact(fwd_ref, rev_ref, fwd_alt, rev_alt, &left, &right, &two);
+                double two = fisher_exact(bc->fisher, fwd_ref, rev_ref, fwd_alt, rev_alt, NULL, NULL);
                 int32_t x = (int)(-4.343 * log(two) + .499);
                 if (x > 255) x = 255;
                 ptr[i] = x;
@@ -29,6 +29,7 @@ DEALINGS IN THE SOFTWARE.  */
 #include <stdint.h>
 #include <htslib/hts.h>
 #include <htslib/vcf.h>
+#include "fisher.h"
 
 /**
  *  A simplified version of Mann-Whitney U-test is calculated
@@ -72,6 +73,12 @@ typedef struct __bcf_callaux_t {
     int maxins, indelreg;
     int read_len;
     char *inscns;
+    // scratch buffers of bcf_call_gap_prep(), kept across positions
+    char *ref2;             // the reference with the candidate indel inserted
+    int *score1, *score2;   // per read and indel type realignment scores
+    int *rd;                // per read realignment boundaries, see gap_prep_reads()
+    uint8_t *rdseq;         // per read query sequence and base qualities
+    int mref2, mscore, mrd, mrdseq;
     uint16_t *bases;        // 5bit: unused, 6:quality, 1:is_rev, 4:2-bit base or indel allele (index to bcf_callaux_t.indel_types)
     errmod_t *e;
     void *rghash;
@@ -116,6 +123,7 @@ typedef struct {
 #endif
     float seg_bias;
     kstring_t tmp;
+    fisher_cache_t *fisher;     // the FMT/SP strand bias tests
 } bcf_call_t;
 
 #ifdef __cplusplus
@@ -96,11 +96,58 @@ static inline int est_indelreg(int pos, const char *ref, int l, char *ins4)
             - 8: estimated sequence quality                     .. (aux>>8)&0xff
             - 8: indel quality                                  .. aux&0xff
  */
+/*
+ * Set the realignment input of each read, which does not depend on the indel
+ * type and so is prepared only once for all types: five values per read in
+ * bca->rd (qbeg, qend, tbeg, tend, offset to bca->rdseq; qbeg is -1 for reads
+ * not to be realigned) and the query sequence followed by the capped base
+ * qualities in bca->rdseq.
+ */
+static void gap_prep_reads(bcf_callaux_t *bca, int n, int *n_plp, bam_pileup1_t **plp, int N, int left, int right)
+{
+    int s, i, K, kk, l, nseq = 0;
+    hts_expand(int, 5*N, bca->mrd, bca->rd);
+    for (s = K = 0; s < n; ++s) {
+        for (i = 0; i < n_plp[s]; ++i, ++K) {
+            bam_pileup1_t *p = plp[s] + i;
+            int *rd = bca->rd + 5*K, qbeg, qend, tbeg, tend;
+            uint8_t *seq = bam_get_seq(p->b);
+            uint32_t *cigar = bam_get_cigar(p->b);
+            rd[0] = -1;
+            if (p->b->core.flag&4) continue; // unmapped reads
+            for (kk = 0; kk < p->b->core.n_cigar; ++kk)
+                if ((cigar[kk]&BAM_CIGAR_MASK) == BAM_CREF_SKIP) break;
+            if (kk < p->b->core.n_cigar) continue;
+            // FIXME: the following skips soft clips, but using them may be more sensitive.
+            // determine the start and end of sequences for alignment
+            qbeg = tpos2qpos(&p->b->core, bam_get_cigar(p->b), left,  0, &tbeg);
+            qend = tpos2qpos(&p->b->core, bam_get_cigar(p->b), right, 1, &tend);
+            rd[0] = qbeg; rd[1] = qend; rd[2] = tbeg; rd[3] = tend; rd[4] = nseq;
+            if (qend <= qbeg) continue;
+            hts_expand(uint8_t, nseq + 2*(qend - qbeg), bca->mrdseq, bca->rdseq);
+            // write the query sequence
+            uint8_t *query = bca->rdseq + nseq, *qq = query + (qend - qbeg);
+            for (l = qbeg; l < qend; ++l)
+                query[l - qbeg] = seq_nt16_int[bam_seqi(seq, l)];
+            // and the base qualities
+            const uint8_t *qual = bam_get_qual(p->b), *bq;
+            bq = (uint8_t*)bam_aux_get(p->b, "ZQ");
+            if (bq) ++bq; // skip type
+            for (l = qbeg; l < qend; ++l) {
+                qq[l - qbeg] = bq? qual[l] + (bq[l] - 64) : qual[l];
+                if (qq[l - qbeg] > 30) qq[l - qbeg] = 30;
+                if (qq[l - qbeg] < 7) qq[l - qbeg] = 7;
+            }
+            nseq += 2*(qend - qbeg);
+        }
+    }
+}
+
 int bcf_call_gap_prep(int n, int *n_plp, bam_pileup1_t **plp, int pos, bcf_callaux_t *bca, const char *ref)
 {
     int i, s, j, k, t, n_types, *types, max_rd_len, left, right, max_ins, *score1, *score2, max_ref2;
-    int N, K, l_run, ref_type, n_alt;
-    char *inscns = 0, *ref2, *query, **ref_sample;
+    int N, K, l_run, ref_type, n_alt, rd_right;
+    char *inscns = 0, *ref2, **ref_sample;
     if (ref == 0 || bca == 0) return -1;
 
     // determine if there is a gap
@@ -283,10 +330,18 @@ int bcf_call_gap_prep(int n, int *n_plp, bam_pileup1_t **plp, int pos, bcf_calla
     }
     // compute the likelihood given each type of indel for each read
     max_ref2 = right - left + 2 + 2 * (max_ins > -types[0]? max_ins : -types[0]);
-    ref2  = (char*) calloc(max_ref2, 1);
-    query = (char*) calloc(right - left + max_rd_len + max_ins + 2, 1);
-    score1 = (int*) calloc(N * n_types, sizeof(int));
-    score2 = (int*) calloc(N * n_types, sizeof(int));
+    hts_expand(char, max_ref2, bca->mref2, bca->ref2);
+    if (N * n_types > bca->mscore) {
+        bca->mscore = N * n_types;
+        kroundup32(bca->mscore);
+        bca->score1 = (int*) realloc(bca->score1, bca->mscore * sizeof(int));
+        bca->score2 = (int*) realloc(bca->score2, bca->mscore * sizeof(int));
+    }
+    ref2 = bca->ref2; score1 = bca->score1; score2 = bca->score2;
+    memset(score1, 0, N * n_types * sizeof(int));
+    memset(score2, 0, N * n_types * sizeof(int));
+    gap_prep_reads(bca, n, n_plp, plp, N, left, right);
+    rd_right = right;
     bca->indelreg = 0;
     for (t = 0; t < n_types; ++t) {
         int l, ir;
@@ -310,39 +365,21 @@ int bcf_call_gap_prep(int n, int *n_plp, bam_pileup1_t **plp, int pos, bcf_calla
                 ref2[k++] = seq_nt16_int[(int)ref_sample[s][j-left]];
             for (; k < max_ref2; ++k) ref2[k] = 4;
             if (j < right) right = j;
+            if (right != rd_right) { // the window was trimmed at the end of the reference
+                gap_prep_reads(bca, n, n_plp, plp, N, left, right);
+                rd_right = right;
+            }
             // align each read to ref2
             for (i = 0; i < n_plp[s]; ++i, ++K) {
-                bam_pileup1_t *p = plp[s] + i;
-                int qbeg, qend, tbeg, tend, sc, kk;
-                uint8_t *seq = bam_get_seq(p->b);
-                uint32_t *cigar = bam_get_cigar(p->b);
-                if (p->b->core.flag&4) continue; // unmapped reads
-                // FIXME: the following loop should be better moved outside; nonetheless, realignment should be much slower anyway.
-                for (kk = 0; kk < p->b->core.n_cigar; ++kk)
-                    if ((cigar[kk]&BAM_CIGAR_MASK) == BAM_CREF_SKIP) break;
-                if (kk < p->b->core.n_cigar) continue;
-                // FIXME: the following skips soft clips, but using them may be more sensitive.
-                // determine the start and end of sequences for alignment
-                qbeg = tpos2qpos(&p->b->core, bam_get_cigar(p->b), left,  0, &tbeg);
-                qend = tpos2qpos(&p->b->core, bam_get_cigar(p->b), right, 1, &tend);
+                int *rd = bca->rd + 5*K;
+                int qbeg = rd[0], qend = rd[1], tbeg = rd[2], tend = rd[3], sc;
+                if (qbeg < 0) continue; // unmapped or spliced reads
                 if (types[t] < 0) {
                     int l = -types[t];
                     tbeg = tbeg - l > left?  tbeg - l : left;
                 }
-                // write the query sequence
-                for (l = qbeg; l < qend; ++l)
-                    query[l - qbeg] = seq_nt16_int[bam_seqi(seq, l)];
                 { // do realignment; this is the bottleneck
-                    const uint8_t *qual = bam_get_qual(p->b), *bq;
-                    uint8_t *qq;
-                    qq = (uint8_t*) calloc(qend - qbeg, 1);
-                    bq = (uint8_t*)bam_aux_get(p->b, "ZQ");
-                    if (bq) ++bq; // skip type
-                    for (l = qbeg; l < qend; ++l) {
-                        qq[l - qbeg] = bq? qual[l] + (bq[l] - 64) : qual[l];
-                        if (qq[l - qbeg] > 30) qq[l - qbeg] = 30;
-                        if (qq[l - qbeg] < 7) qq[l - qbeg] = 7;
-                    }
+                    uint8_t *query = bca->rdseq + rd[4], *qq = query + (qend - qbeg);
                     sc = probaln_glocal((uint8_t*)ref2 + tbeg - left, tend - tbeg + abs(types[t]),
                                         (uint8_t*)query, qend - qbeg, qq, &apf1, 0, 0);
                     l = (int)(100. * sc / (qend - qbeg) + .499); // used for adjusting indelQ below
@@ -355,7 +392,6 @@ int bcf_call_gap_prep(int n, int *n_plp, bam_pileup1_t **plp, int pos, bcf_calla
                         if (l > 255) l = 255;
                         score2[K*n_types + t] = sc<<8 | l;
                     }
-                    free(qq);
                 }
 /*
                 for (l = 0; l < tend - tbeg + abs(types[t]); ++l)
@@ -368,7 +404,6 @@ int bcf_call_gap_prep(int n, int *n_plp, bam_pileup1_t **plp, int pos, bcf_calla
             }
         }
     }
-    free(ref2); free(query);
     { // compute indelQ
         int sc_a[16], sumq_a[16];
         int tmp, *sc = sc_a, *sumq = sumq_a;
@@ -461,7 +496,6 @@ int bcf_call_gap_prep(int n, int *n_plp, bam_pileup1_t **plp, int pos, bcf_calla
         if (sc   != sc_a)   free(sc);
         if (sumq != sumq_a) free(sumq);
     }
-    free(score1); free(score2);
     // free
     for (i = 0; i < n; ++i) free(ref_sample[i]);
     free(ref_sample);
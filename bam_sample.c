@@ -255,6 +255,14 @@ const char **bam_smpl_get_samples(bam_smpl_t *bsmpl, int *nsmpl)
     return (const char**)bsmpl->smpl;
 }
 
+static int bsmpl_rg2idx(file_t *file, const char *aux_rg)
+{
+    int rg_id;
+    if ( khash_str2int_get(file->rg2idx, aux_rg, &rg_id)==0 ) return rg_id;
+    if ( khash_str2int_get(file->rg2idx, "?", &rg_id)==0 ) return rg_id;
+    return -1;
+}
+
 int bam_smpl_get_sample_id(bam_smpl_t *bsmpl, int bam_id, bam1_t *bam_rec)
 {
     file_t *file = &bsmpl->files[bam_id];
@@ -263,10 +271,28 @@ int bam_smpl_get_sample_id(bam_smpl_t *bsmpl, int bam_id, bam1_t *bam_rec)
     char *aux_rg = (char*) bam_aux_get(bam_rec, "RG");
     aux_rg = aux_rg ? aux_rg+1 : "?";
 
-    int rg_id;
-    if ( khash_str2int_get(file->rg2idx, aux_rg, &rg_id)==0 ) return rg_id;
-    if ( khash_str2int_get(file->rg2idx, "?", &rg_id)==0 ) return rg_id;
-    return -1;
+    return bsmpl_rg2idx(file, aux_rg);
+}
+
+int bam_smpl_get_sample_id_cached(bam_smpl_t *bsmpl, int bam_id, bam1_t *bam_rec, bam_smpl_cache_t *cache)
+{
+    file_t *file = &bsmpl->files[bam_id];
+    if ( file->default_idx >= 0 ) return file->default_idx;
+
+    char *aux_rg = (char*) bam_aux_get(bam_rec, "RG");
+    aux_rg = aux_rg ? aux_rg+1 : "?";
+    if ( cache->rg.l && !strcmp(cache->rg.s, aux_rg) ) return cache->idx;
+
+    cache->rg.l = 0;
+    kputs(aux_rg, &cache->rg);
+    cache->idx = bsmpl_rg2idx(file, aux_rg);
+    return cache->idx;
+}
+
+void bam_smpl_cache_destroy(bam_smpl_cache_t *cache)
+{
+    free(cache->rg.s);
+    memset(cache, 0, sizeof(*cache));
 }
 
 int bam_smpl_add_samples(bam_smpl_t *bsmpl, char *list, int is_file)
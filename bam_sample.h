@@ -27,6 +27,7 @@ DEALINGS IN THE SOFTWARE.  */
 #define BAM_SAMPLE_H
 
 #include <htslib/sam.h>
+#include <htslib/kstring.h>
 
 typedef struct _bam_smpl_t bam_smpl_t;
 
@@ -45,6 +46,20 @@ int bam_smpl_add_bam(bam_smpl_t *bsmpl, char *bam_hdr, const char *fname);
 const char **bam_smpl_get_samples(bam_smpl_t *bsmpl, int *nsmpl);
 int bam_smpl_get_sample_id(bam_smpl_t *bsmpl, int bam_id, bam1_t *bam_rec);
 
+// The same as bam_smpl_get_sample_id() but the read group of the last read is
+// remembered: consecutive reads mostly come from the same read group and the
+// hash lookup can be skipped. Each file and thread must use its own cache,
+// zero-initialized and released with bam_smpl_cache_destroy().
+//
+typedef struct
+{
+    kstring_t rg;
+    int idx;
+}
+bam_smpl_cache_t;
+int bam_smpl_get_sample_id_cached(bam_smpl_t *bsmpl, int bam_id, bam1_t *bam_rec, bam_smpl_cache_t *cache);
+void bam_smpl_cache_destroy(bam_smpl_cache_t *cache);
+
 void bam_smpl_destroy(bam_smpl_t *bsmpl);
 
 #endif
@@ -0,0 +1,174 @@
+/* The MIT License
+
+   Copyright (c) 2017 Genome Research Ltd.
+
+   Author: Petr Danecek <pd3@sanger.ac.uk>
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "bcftools.h"
+#include "profile.h"
+#include "batch.h"
+
+#define BATCH_EMPTY     0
+#define BATCH_READY     1
+#define BATCH_DONE      2
+
+typedef struct
+{
+    batch_pool_t *pool;
+    void *state;
+}
+worker_t;
+
+struct _batch_pool_t
+{
+    void **batch;
+    int *state, nbatch;
+    int iread, iwork, iwrite, eof;   // batch sequence numbers: submitted, taken by a worker, written
+    batch_work_f work;
+    batch_write_f write;
+    void *data;
+    int nthreads;
+    worker_t *workers;
+    pthread_t *threads;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+static void *batch_worker(void *arg)
+{
+    worker_t *worker = (worker_t*) arg;
+    batch_pool_t *pool = worker->pool;
+    while (1)
+    {
+        pthread_mutex_lock(&pool->lock);
+        while ( pool->iwork==pool->iread && !pool->eof ) pthread_cond_wait(&pool->cond, &pool->lock);
+        if ( pool->iwork==pool->iread ) { pthread_mutex_unlock(&pool->lock); break; }
+        int i = pool->iwork++ % pool->nbatch;
+        pthread_mutex_unlock(&pool->lock);
+
+        pool->work(worker->state, pool->batch[i]);
+
+        pthread_mutex_lock(&pool->lock);
+        pool->state[i] = BATCH_DONE;
+        pthread_cond_broadcast(&pool->cond);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return NULL;
+}
+
+// Write out finished batches in order. With wait set, block until the oldest batch is written
+static void batch_pool_flush(batch_pool_t *pool, int wait)
+{
+    pthread_mutex_lock(&pool->lock);
+    while ( pool->iwrite < pool->iread )
+    {
+        int i = pool->iwrite % pool->nbatch;
+        if ( pool->state[i]!=BATCH_DONE )
+        {
+            if ( !wait ) break;
+            pthread_cond_wait(&pool->cond, &pool->lock);
+            continue;
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        pool->write(pool->data, pool->batch[i]);
+
+        pthread_mutex_lock(&pool->lock);
+        pool->state[i] = BATCH_EMPTY;
+        pool->iwrite++;
+        wait = 0;
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+batch_pool_t *batch_pool_init(int nthreads, void **workers, void **batches, int nbatches, batch_work_f work, batch_write_f write, void *data)
+{
+    batch_pool_t *pool = (batch_pool_t*) calloc(1, sizeof(batch_pool_t));
+    pool->nbatch = nbatches;
+    pool->batch  = (void**) malloc(sizeof(void*)*nbatches);
+    memcpy(pool->batch, batches, sizeof(void*)*nbatches);
+    pool->state  = (int*) calloc(nbatches, sizeof(int));
+    pool->work   = work;
+    pool->write  = write;
+    pool->data   = data;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+
+    int i;
+    pool->nthreads = nthreads;
+    pool->workers  = (worker_t*) malloc(sizeof(worker_t)*nthreads);
+    pool->threads  = (pthread_t*) malloc(sizeof(pthread_t)*nthreads);
+    for (i=0; i<nthreads; i++)
+    {
+        pool->workers[i].pool  = pool;
+        pool->workers[i].state = workers[i];
+        if ( pthread_create(&pool->threads[i], NULL, batch_worker, &pool->workers[i]) ) error("Failed to create threads\n");
+    }
+    return pool;
+}
+
+void *batch_pool_get(batch_pool_t *pool)
+{
+    profile_queue(PROFQ_BATCHES, pool->iread - pool->iwrite);
+    if ( pool->iread - pool->iwrite == pool->nbatch ) batch_pool_flush(pool, 1);
+    return pool->batch[pool->iread % pool->nbatch];
+}
+
+void batch_pool_submit(batch_pool_t *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->state[pool->iread % pool->nbatch] = BATCH_READY;
+    pool->iread++;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    batch_pool_flush(pool, 0);
+}
+
+void batch_pool_sync(batch_pool_t *pool)
+{
+    while ( pool->iwrite < pool->iread ) batch_pool_flush(pool, 1);
+}
+
+void batch_pool_destroy(batch_pool_t *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->eof = 1;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    int i;
+    for (i=0; i<pool->nthreads; i++) pthread_join(pool->threads[i], NULL);
+    batch_pool_flush(pool, 1);
+
+    free(pool->threads);
+    free(pool->workers);
+    free(pool->batch);
+    free(pool->state);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->cond);
+    free(pool);
+}
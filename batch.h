@@ -0,0 +1,92 @@
+/* The MIT License
+
+   Copyright (c) 2017 Genome Research Ltd.
+
+   Author: Petr Danecek <pd3@sanger.ac.uk>
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+
+ */
+
+/*
+    Ordered processing of record batches on worker threads, as used by the
+    --record-threads options. The main thread fills batches, the workers
+    process them, each with its own state, and the batches are handed back to
+    the main thread for output in the original order. The batches themselves
+    are owned by the caller, the pool only cycles through them, which bounds
+    the number of batches in flight.
+
+        batch_pool_t *pool = batch_pool_init(nthreads, workers, batches, nbatches, work, write, args);
+        while ( !eof )
+        {
+            my_batch_t *batch = batch_pool_get(pool);
+            ... fill the batch ...
+            if ( batch->nrec ) batch_pool_submit(pool);
+        }
+        batch_pool_destroy(pool);
+*/
+
+#ifndef __BATCH_H__
+#define __BATCH_H__
+
+typedef struct _batch_pool_t batch_pool_t;
+
+/*
+ *  batch_work_f  - process the batch on a worker thread, @worker is the state
+ *                  of the thread as passed to batch_pool_init()
+ *  batch_write_f - called on the main thread with the processed batches in the
+ *                  order of submission
+ */
+typedef void (*batch_work_f)(void *worker, void *batch);
+typedef void (*batch_write_f)(void *data, void *batch);
+
+/*
+ *  batch_pool_init() - start the worker threads
+ *  @nthreads:  the number of threads, one state in @workers for each
+ *  @batches:   the batches to cycle through, the pointers are copied
+ *  @data:      passed to @write
+ */
+batch_pool_t *batch_pool_init(int nthreads, void **workers, void **batches, int nbatches, batch_work_f work, batch_write_f write, void *data);
+
+/*
+ *  batch_pool_get() - the next batch to fill, waiting for a free one and
+ *      writing out the finished ones in the meantime. Until submitted, the same
+ *      batch is returned again.
+ */
+void *batch_pool_get(batch_pool_t *pool);
+
+/*
+ *  batch_pool_submit() - pass the batch returned by batch_pool_get() to the
+ *      workers and write out the batches finished so far, without waiting
+ */
+void batch_pool_submit(batch_pool_t *pool);
+
+/*
+ *  batch_pool_sync() - wait for all submitted batches and write them out, the
+ *      threads keep running for more batches
+ */
+void batch_pool_sync(batch_pool_t *pool);
+
+/*
+ *  batch_pool_destroy() - wait for the submitted batches, write them out and
+ *      stop the threads. The worker states and batches are left to the caller.
+ */
+void batch_pool_destroy(batch_pool_t *pool);
+
+#endif
@@ -45,6 +45,21 @@ const char *hts_bcf_wmode(int file_type);
 
 void *smalloc(size_t size);     // safe malloc
 
+/*
+ *  Indexing of compressed VCF/BCF output while it is being written (--write-index),
+ *  so that a separate pass of bcftools index is not needed. A CSI index is
+ *  written to FILE.csi.
+ *  out_idx_init()  - call right after the header was written
+ *  out_idx_write() - bcf_write() the record and add it to the index; with
+ *                    a NULL index this is just bcf_write()
+ *  out_idx_close() - hts_close() the file and save the index; with a NULL
+ *                    index this is just hts_close()
+ */
+typedef struct _out_idx_t out_idx_t;
+out_idx_t *out_idx_init(htsFile *fh, bcf_hdr_t *hdr, const char *fname);
+int out_idx_write(out_idx_t *oi, htsFile *fh, bcf_hdr_t *hdr, bcf1_t *rec);
+int out_idx_close(out_idx_t *oi, htsFile *fh);
+
 static inline char gt2iupac(char a, char b)
 {
     static const char iupac[4][4] = { {'A','M','R','W'},{'M','C','S','Y'},{'R','S','G','K'},{'W','Y','K','T'} };
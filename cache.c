@@ -0,0 +1,218 @@
+/* The MIT License
+
+   Copyright (c) 2017 Genome Research Ltd.
+
+   Author: Petr Danecek <pd3@sanger.ac.uk>
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <htslib/hts.h>
+#include <htslib/kstring.h>
+#include "bcftools.h"
+#include "cache.h"
+
+typedef struct
+{
+    char magic[8];
+    uint64_t stamp;
+}
+cache_hdr_t;
+
+uint64_t cache_stamp(uint64_t stamp, const void *data, size_t size)
+{
+    // FNV-1a
+    const uint8_t *ptr = (const uint8_t*) data;
+    size_t i;
+    for (i=0; i<size; i++)
+    {
+        stamp ^= ptr[i];
+        stamp *= 1099511628211ULL;
+    }
+    return stamp;
+}
+
+uint64_t cache_stamp_str(uint64_t stamp, const char *str)
+{
+    static const uint8_t null = 0xff;
+    if ( !str ) return cache_stamp(stamp, &null, 1);
+    return cache_stamp(stamp, str, strlen(str) + 1);    // the NUL terminates the string
+}
+
+uint64_t cache_stamp_file(uint64_t stamp, const char *fname)
+{
+    struct stat st;
+    if ( !fname || stat(fname, &st)!=0 ) return stamp;
+    uint64_t size  = st.st_size;
+    int64_t  mtime = st.st_mtime;
+    stamp = cache_stamp(stamp, &size, sizeof(size));
+    return cache_stamp(stamp, &mtime, sizeof(mtime));
+}
+
+cache_t *cache_create(const char *fname, const char *magic, uint64_t stamp)
+{
+    cache_t *cache = (cache_t*) calloc(1, sizeof(cache_t));
+    cache->fname = strdup(fname);
+
+    kstring_t tmp = {0,0,0};
+    ksprintf(&tmp, "%s.XXXXXX", fname);
+    int fd = mkstemp(tmp.s);
+    if ( fd<0 ) error("Failed to create %s: %s\n", tmp.s, strerror(errno));
+    cache->tmp_fname = tmp.s;
+
+    // mkstemp creates the file readable by the owner only, make the cache
+    // readable like the other outputs so that it can be shared between users
+    static int mode = -1;
+    if ( mode<0 )
+    {
+        mode_t mask = umask(0);
+        umask(mask);
+        mode = 0666 & ~mask;
+    }
+    if ( fchmod(fd, mode)!=0 ) error("Failed to set the permissions of %s: %s\n", tmp.s, strerror(errno));
+    cache->fp = fdopen(fd, "w");
+    if ( !cache->fp ) error("Failed to open %s: %s\n", tmp.s, strerror(errno));
+
+    cache_hdr_t hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, magic, 8);
+    hdr.stamp = stamp;
+    cache_write(cache, &hdr, sizeof(hdr));
+    return cache;
+}
+
+void cache_write(cache_t *cache, const void *ptr, size_t size)
+{
+    if ( !size ) return;
+    if ( fwrite(ptr, size, 1, cache->fp)!=1 ) error("Failed to write %s: %s\n", cache->tmp_fname, strerror(errno));
+    cache->off += size;
+}
+
+void cache_write_str(cache_t *cache, const char *str)
+{
+    uint32_t len = str ? strlen(str) + 1 : 0;     // 0 for NULL
+    cache_write(cache, &len, sizeof(len));
+    cache_write(cache, str, len);
+}
+
+void cache_pad(cache_t *cache, size_t align)
+{
+    static const uint8_t zero[64] = {0};
+    size_t pad = (align - cache->off % align) % align;
+    while ( pad )
+    {
+        size_t n = pad < sizeof(zero) ? pad : sizeof(zero);
+        cache_write(cache, zero, n);
+        pad -= n;
+    }
+}
+
+void cache_write_at(cache_t *cache, uint64_t off, const void *ptr, size_t size)
+{
+    if ( off + size > cache->off ) error("Failed to write %s: offset out of range\n", cache->tmp_fname);
+    if ( fseek(cache->fp, off, SEEK_SET)!=0 || fwrite(ptr, size, 1, cache->fp)!=1 || fseek(cache->fp, cache->off, SEEK_SET)!=0 )
+        error("Failed to write %s: %s\n", cache->tmp_fname, strerror(errno));
+}
+
+void cache_commit(cache_t *cache)
+{
+    if ( fclose(cache->fp)!=0 ) error("Failed to write %s: %s\n", cache->tmp_fname, strerror(errno));
+
+    // the rename is atomic, concurrent runs never see a partially written cache
+    if ( rename(cache->tmp_fname, cache->fname)!=0 )
+        error("Failed to rename %s to %s: %s\n", cache->tmp_fname, cache->fname, strerror(errno));
+
+    free(cache->tmp_fname);
+    free(cache->fname);
+    free(cache);
+}
+
+cache_t *cache_open(const char *fname, const char *magic, uint64_t stamp, const char *desc)
+{
+    int fd = open(fname, O_RDONLY);
+    if ( fd<0 ) return NULL;
+
+    cache_hdr_t hdr;
+    struct stat st;
+    if ( fstat(fd, &st)!=0 || read(fd, &hdr, sizeof(hdr))!=sizeof(hdr) || memcmp(hdr.magic,magic,8)
+        || (stamp && hdr.stamp!=stamp) )
+    {
+        if ( desc ) fprintf(stderr,"The %s %s is outdated or incompatible, rebuilding\n", desc, fname);
+        close(fd);
+        return NULL;
+    }
+
+    cache_t *cache = (cache_t*) calloc(1, sizeof(cache_t));
+    cache->fname = strdup(fname);
+    cache->size  = st.st_size;
+    cache->map   = (uint8_t*) mmap(NULL, cache->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if ( cache->map==MAP_FAILED ) error("Failed to mmap %s: %s\n", fname, strerror(errno));
+    cache->off = sizeof(hdr);
+    return cache;
+}
+
+void *cache_ptr(cache_t *cache, uint64_t off, uint64_t size)
+{
+    if ( off > cache->size || size > cache->size - off ) error("Failed to read %s, the file is truncated?\n", cache->fname);
+    return cache->map + off;
+}
+
+void cache_read(cache_t *cache, void *ptr, size_t size)
+{
+    memcpy(ptr, cache_ptr(cache, cache->off, size), size);
+    cache->off += size;
+}
+
+char *cache_read_str(cache_t *cache)
+{
+    uint32_t len;
+    cache_read(cache, &len, sizeof(len));
+    if ( !len ) return NULL;
+    char *str = (char*) malloc(len);
+    cache_read(cache, str, len);
+    if ( str[len-1] ) error("Failed to read %s, the file is corrupted?\n", cache->fname);
+    return str;
+}
+
+void cache_close(cache_t *cache)
+{
+    if ( !cache ) return;
+    munmap(cache->map, cache->size);
+    free(cache->fname);
+    free(cache);
+}
+
+int cache_seq_seen(uint8_t **seen, int *mseen, int rid)
+{
+    hts_expand0(uint8_t, rid+1, *mseen, *seen);
+    if ( (*seen)[rid] ) return 1;
+    (*seen)[rid] = 1;
+    return 0;
+}
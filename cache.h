@@ -0,0 +1,126 @@
+/* The MIT License
+
+   Copyright (c) 2017 Genome Research Ltd.
+
+   Author: Petr Danecek <pd3@sanger.ac.uk>
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+
+ */
+
+/*
+    Binary caches of parsed input files, such as the --gff-cache of csq or the
+    --gt-cache of gtcheck. Every cache starts with an 8-byte magic string and
+    a stamp identifying the source files and the options the cache was built
+    with, the rest of the layout is up to the caller. The cache is written to
+    a temporary file which is renamed when complete, so concurrent runs never
+    see a partially written cache, and read back memory-mapped.
+
+        uint64_t stamp = cache_stamp_file(CACHE_STAMP_INIT, src_fname);
+        cache_t *cache = cache_open(fname, MAGIC, stamp, "genotypes cache");
+        if ( !cache )
+        {
+            cache = cache_create(fname, MAGIC, stamp);
+            ... cache_write() ...
+            cache_commit(cache);
+            cache = cache_open(fname, MAGIC, stamp, NULL);
+        }
+        ... cache_read() or cache_ptr() ...
+        cache_close(cache);
+
+    The numbers are in the host byte order, the caches are not meant to be
+    portable.
+*/
+
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#define CACHE_STAMP_INIT 14695981039346656037ULL
+
+typedef struct
+{
+    char *fname;
+    uint8_t *map;       // reading: the whole file
+    size_t size;
+    uint64_t off;       // reading: the position of cache_read(); writing: the bytes written so far
+    FILE *fp;           // writing
+    char *tmp_fname;
+}
+cache_t;
+
+/*
+ *  cache_stamp()      - mix the data into the stamp
+ *  cache_stamp_str()  - mix the string into the stamp, NULL is distinct from ""
+ *  cache_stamp_file() - mix the size and modification time of the file into the
+ *                       stamp, the stamp is left unchanged if the file does not exist
+ */
+uint64_t cache_stamp(uint64_t stamp, const void *data, size_t size);
+uint64_t cache_stamp_str(uint64_t stamp, const char *str);
+uint64_t cache_stamp_file(uint64_t stamp, const char *fname);
+
+/*
+ *  cache_create() - start writing the cache to a temporary file next to
+ *      @fname, the magic and the stamp are written first
+ *  cache_write()  - append to the cache
+ *  cache_write_str() - append the string with its length, NULL is allowed
+ *  cache_pad()    - pad the cache with zeros to a multiple of @align bytes
+ *  cache_write_at() - overwrite the bytes at the offset @off, which must have
+ *      been written already, for example a header with the final counts
+ *  cache_commit() - close the temporary file and rename it to the cache.
+ *      The cache_t is freed.
+ */
+cache_t *cache_create(const char *fname, const char *magic, uint64_t stamp);
+void cache_write(cache_t *cache, const void *ptr, size_t size);
+void cache_write_str(cache_t *cache, const char *str);
+void cache_pad(cache_t *cache, size_t align);
+void cache_write_at(cache_t *cache, uint64_t off, const void *ptr, size_t size);
+void cache_commit(cache_t *cache);
+
+/*
+ *  cache_open() - memory-map the cache if it exists and was built with the
+ *      same magic and stamp, NULL otherwise. A zero stamp accepts any stamp.
+ *      When @desc is given and the cache exists but cannot be used, a message
+ *      "The <desc> <fname> is outdated or incompatible, rebuilding" is printed.
+ *      The read position is set after the magic and the stamp.
+ *  cache_read()     - copy the next bytes, exit on a truncated cache
+ *  cache_read_str() - the next string written by cache_write_str(), malloc-ed
+ *  cache_ptr()      - a pointer into the mapped cache, exit if off+size is
+ *      beyond the end
+ *  cache_close()    - unmap the cache, pointers returned by cache_ptr() are
+ *      invalid afterwards
+ */
+cache_t *cache_open(const char *fname, const char *magic, uint64_t stamp, const char *desc);
+void cache_read(cache_t *cache, void *ptr, size_t size);
+char *cache_read_str(cache_t *cache);
+void *cache_ptr(cache_t *cache, uint64_t off, uint64_t size);
+void cache_close(cache_t *cache);
+
+/*
+ *  cache_seq_seen() - mark the sequence @rid as seen while building a cache
+ *      from a sorted file, return 1 if it was seen before, meaning the file is
+ *      not sorted. The array @seen with @mseen elements grows as needed, the
+ *      VCF reader adds contigs missing from the header on the fly.
+ */
+int cache_seq_seen(uint8_t **seen, int *mseen, int rid);
+
+#endif
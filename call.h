@@ -118,6 +118,16 @@ void mcall_destroy(call_t *call);
 void ccall_destroy(call_t *call);
 void qcall_destroy(call_t *call);
 
+/*
+ *  mcall_init_worker() - initialize @call as a copy of @src, an mcall_init()-ed
+ *      instance, for use by a worker thread. The settings, header and trio tables
+ *      are shared with @src, the per-site buffers are private. The caller sets
+ *      call->unseen and call->ploidy for each site.
+ *  mcall_destroy_worker() - free the private buffers only
+ */
+void mcall_init_worker(call_t *call, const call_t *src);
+void mcall_destroy_worker(call_t *call);
+
 void call_init_pl2p(call_t *call);
 uint32_t *call_trio_prep(int is_x, int is_son);
 
@@ -53,12 +53,31 @@ typedef struct
 chain_t;
 
 
+// One consensus sequence being built. All of them buffer the same window of
+// the original sequence, only the applied variants differ
 typedef struct
 {
     kstring_t fa_buf;   // buffered reference sequence
     int fa_ori_pos;     // start position of the fa_buffer (wrt original sequence)
     int fa_frz_pos;     // protected position to avoid conflicting variants (last pos for SNPs/ins)
     int fa_mod_off;     // position difference of fa_frz_pos in the ori and modified sequence (ins positive)
+    int isample;        // sample to apply, -1 for all ALT variants
+    FILE *fp_out;
+    char *fname;
+
+    int chain_id;       // chain_id, to provide a unique ID to each chain in the chain output
+    chain_t *chain;     // chain structure to store the sequence of ungapped blocks between the ref and alt sequences
+                        // Note that the chain is re-initialised for each chromosome/seq_region
+    FILE *fp_chain;
+    char *chain_fname;
+}
+cns_t;
+
+typedef struct
+{
+    cns_t *cns;         // one per output sequence, more than one with --prefix
+    int ncns;
+    kstring_t tmp;      // modified ALT allele, the records are shared by all outputs
     int fa_end_pos;     // region's end position in the original sequence
     int fa_length;      // region's length in the original sequence (in case end_pos not provided in the FASTA header)
     int fa_case;        // output upper case or lower case?
@@ -71,17 +90,11 @@ typedef struct
     regidx_t *mask;
     regitr_t *itr;
 
-    int chain_id;       // chain_id, to provide a unique ID to each chain in the chain output
-    chain_t *chain;     // chain structure to store the sequence of ungapped blocks between the ref and alt sequences
-                        // Note that the chain is re-initialised for each chromosome/seq_region
-
     bcf_srs_t *files;
     bcf_hdr_t *hdr;
-    FILE *fp_out;
-    FILE *fp_chain;
     char **argv;
-    int argc, output_iupac, haplotype, isample;
-    char *fname, *ref_fname, *sample, *output_fname, *mask_fname, *chain_fname;
+    int argc, output_iupac, haplotype, sample_is_file;
+    char *fname, *ref_fname, *sample, *output_fname, *mask_fname, *chain_fname, *prefix;
 }
 args_t;
 
@@ -99,17 +112,17 @@ static chain_t* init_chain(chain_t *chain, int ref_ori_pos)
     return chain;
 }
 
-static void destroy_chain(args_t *args)
+static void destroy_chain(cns_t *cns)
 {
-    chain_t *chain = args->chain;
+    chain_t *chain = cns->chain;
     free(chain->ref_gaps);
     free(chain->alt_gaps);
     free(chain->block_lengths);
     free(chain);
-    chain = NULL;
+    cns->chain = NULL;
 }
 
-static void print_chain(args_t *args)
+static void print_chain(args_t *args, cns_t *cns)
 {
     /*
         Example chain format (see: https://genome.ucsc.edu/goldenPath/help/chain.html):
@@ -138,7 +151,7 @@ static void print_chain(args_t *args)
         - gap on the ref sequence between this and the next block (all but the last line)
         - gap on the alt sequence between this and the next block (all but the last line)
     */
-    chain_t *chain = args->chain;
+    chain_t *chain = cns->chain;
     int n = chain->num;
     int ref_end_pos = args->fa_length + chain->ori_pos;
     int last_block_size = ref_end_pos - chain->ref_last_block_ori;
@@ -148,11 +161,11 @@ static void print_chain(args_t *args)
         score += chain->block_lengths[n];
     }
     score += last_block_size;
-    fprintf(args->fp_chain, "chain %d %s %d + %d %d %s %d + %d %d %d\n", score, bcf_hdr_id2name(args->hdr,args->rid), ref_end_pos, chain->ori_pos, ref_end_pos, bcf_hdr_id2name(args->hdr,args->rid), alt_end_pos, chain->ori_pos, alt_end_pos, ++args->chain_id);
+    fprintf(cns->fp_chain, "chain %d %s %d + %d %d %s %d + %d %d %d\n", score, bcf_hdr_id2name(args->hdr,args->rid), ref_end_pos, chain->ori_pos, ref_end_pos, bcf_hdr_id2name(args->hdr,args->rid), alt_end_pos, chain->ori_pos, alt_end_pos, ++cns->chain_id);
     for (n=0; n<chain->num; n++) {
-        fprintf(args->fp_chain, "%d %d %d\n", chain->block_lengths[n], chain->ref_gaps[n], chain->alt_gaps[n]);
+        fprintf(cns->fp_chain, "%d %d %d\n", chain->block_lengths[n], chain->ref_gaps[n], chain->alt_gaps[n]);
     }
-    fprintf(args->fp_chain, "%d\n\n", last_block_size);
+    fprintf(cns->fp_chain, "%d\n\n", last_block_size);
 }
 
 static void push_chain_gap(chain_t *chain, int ref_start, int ref_len, int alt_start, int alt_len)
@@ -189,16 +202,44 @@ static void init_data(args_t *args)
     args->files->require_index = 1;
     if ( !bcf_sr_add_reader(args->files,args->fname) ) error("Failed to open %s: %s\n", args->fname, bcf_sr_strerror(args->files->errnum));
     args->hdr = args->files->readers[0].header;
-    args->isample = -1;
+    int i;
     if ( args->sample )
     {
-        args->isample = bcf_hdr_id2int(args->hdr,BCF_DT_SAMPLE,args->sample);
-        if ( args->isample<0 ) error("No such sample: %s\n", args->sample);
+        char **smpl = hts_readlist(args->sample, args->sample_is_file, &args->ncns);
+        if ( !smpl || !args->ncns ) error("Could not read the list: %s\n", args->sample);
+        if ( args->ncns>1 && !args->prefix ) error("The --prefix option is required with multiple samples\n");
+        args->cns = (cns_t*) calloc(args->ncns,sizeof(cns_t));
+        for (i=0; i<args->ncns; i++)
+        {
+            args->cns[i].isample = bcf_hdr_id2int(args->hdr,BCF_DT_SAMPLE,smpl[i]);
+            if ( args->cns[i].isample<0 ) error("No such sample: %s\n", smpl[i]);
+            if ( args->prefix )
+            {
+                kstring_t str = {0,0,0};
+                ksprintf(&str,"%s%s.fa",args->prefix,smpl[i]);
+                args->cns[i].fname = str.s;
+                if ( args->chain_fname )
+                {
+                    str.s = NULL; str.l = str.m = 0;
+                    ksprintf(&str,"%s%s.chain",args->chain_fname,smpl[i]);
+                    args->cns[i].chain_fname = str.s;
+                }
+            }
+            free(smpl[i]);
+        }
+        free(smpl);
+    }
+    else
+    {
+        if ( args->prefix ) error("The --prefix option requires --sample or --samples-file\n");
+        args->ncns = 1;
+        args->cns  = (cns_t*) calloc(1,sizeof(cns_t));
+        args->cns[0].isample = -1;
     }
-    if ( args->haplotype && args->isample<0 )
+    if ( args->haplotype && args->cns[0].isample<0 )
     {
         if ( bcf_hdr_nsamples(args->hdr) > 1 ) error("The --sample option is expected with --haplotype\n");
-        args->isample = 0;
+        args->cns[0].isample = 0;
     }
     if ( args->mask_fname )
     {
@@ -206,20 +247,31 @@ static void init_data(args_t *args)
         if ( !args->mask ) error("Failed to initialize mask regions\n");
         args->itr = regitr_init(args->mask);
     }
-    // In case we want to store the chains
-    if ( args->chain_fname )
-    {
-        args->fp_chain = fopen(args->chain_fname,"w");
-        if ( ! args->fp_chain ) error("Failed to create %s: %s\n", args->chain_fname, strerror(errno));
-        args->chain_id = 0;
-    }
     rbuf_init(&args->vcf_rbuf, 100);
     args->vcf_buf = (bcf1_t**) calloc(args->vcf_rbuf.m, sizeof(bcf1_t*));
-    if ( args->output_fname ) {
-        args->fp_out = fopen(args->output_fname,"w");
-        if ( ! args->fp_out ) error("Failed to create %s: %s\n", args->output_fname, strerror(errno));
+    if ( !args->prefix )
+    {
+        args->cns[0].fname = args->output_fname ? strdup(args->output_fname) : NULL;
+        args->cns[0].chain_fname = args->chain_fname ? strdup(args->chain_fname) : NULL;
+    }
+    for (i=0; i<args->ncns; i++)
+    {
+        cns_t *cns = &args->cns[i];
+        if ( cns->fname )
+        {
+            cns->fp_out = fopen(cns->fname,"w");
+            if ( ! cns->fp_out ) error("Failed to create %s: %s\n", cns->fname, strerror(errno));
+        }
+        else cns->fp_out = stdout;
+
+        // In case we want to store the chains
+        if ( cns->chain_fname )
+        {
+            cns->fp_chain = fopen(cns->chain_fname,"w");
+            if ( ! cns->fp_chain ) error("Failed to create %s: %s\n", cns->chain_fname, strerror(errno));
+            cns->chain_id = 0;
+        }
     }
-    else args->fp_out = stdout;
 }
 
 static void destroy_data(args_t *args)
@@ -229,12 +281,20 @@ static void destroy_data(args_t *args)
     for (i=0; i<args->vcf_rbuf.m; i++)
         if ( args->vcf_buf[i] ) bcf_destroy1(args->vcf_buf[i]);
     free(args->vcf_buf);
-    free(args->fa_buf.s);
+    for (i=0; i<args->ncns; i++)
+    {
+        cns_t *cns = &args->cns[i];
+        free(cns->fa_buf.s);
+        if ( fclose(cns->fp_out) ) error("Close failed: %s\n", cns->fname ? cns->fname : "-");
+        free(cns->fname);
+        if ( cns->chain_fname )
+            if ( fclose(cns->fp_chain) ) error("Close failed: %s\n", cns->chain_fname);
+        free(cns->chain_fname);
+    }
+    free(args->cns);
+    free(args->tmp.s);
     if ( args->mask ) regidx_destroy(args->mask);
     if ( args->itr ) regitr_destroy(args->itr);
-    if ( args->chain_fname )
-        if ( fclose(args->fp_chain) ) error("Close failed: %s\n", args->chain_fname);
-    if ( fclose(args->fp_out) ) error("Close failed: %s\n", args->output_fname);
 }
 
 static void init_region(args_t *args, char *line)
@@ -260,23 +320,27 @@ static void init_region(args_t *args, char *line)
     }
     args->rid = bcf_hdr_name2id(args->hdr,line);
     if ( args->rid<0 ) fprintf(stderr,"Warning: Sequence \"%s\" not in %s\n", line,args->fname);
-    args->fa_buf.l = 0;
+    int i;
+    for (i=0; i<args->ncns; i++)
+    {
+        cns_t *cns = &args->cns[i];
+        cns->fa_buf.l = 0;
+        cns->fa_ori_pos = from;
+        cns->fa_mod_off = 0;
+        cns->fa_frz_pos = -1;
+    }
     args->fa_length = 0;
     args->fa_end_pos = to;
-    args->fa_ori_pos = from;
     args->fa_src_pos = from;
-    args->fa_mod_off = 0;
-    args->fa_frz_pos = -1;
     args->fa_case    = -1;
     args->vcf_rbuf.n = 0;
-    bcf_sr_seek(args->files,line,args->fa_ori_pos);
+    bcf_sr_seek(args->files,line,from);
     if ( tmp_ptr ) *tmp_ptr = tmp;
-    fprintf(args->fp_out,">%s\n",line);
-    if (args->chain_fname )
+    for (i=0; i<args->ncns; i++)
     {
-        args->chain = init_chain(args->chain, args->fa_ori_pos);
-    } else {
-        args->chain = NULL;
+        cns_t *cns = &args->cns[i];
+        fprintf(cns->fp_out,">%s\n",line);
+        cns->chain = cns->chain_fname ? init_chain(cns->chain, from) : NULL;
     }
 }
 
@@ -305,44 +369,44 @@ static void unread_vcf_line(args_t *args, bcf1_t **rec_ptr)
     if ( !args->vcf_buf[i] ) args->vcf_buf[i] = bcf_init1();
     bcf1_t *tmp = rec; *rec_ptr = args->vcf_buf[i]; args->vcf_buf[i] = tmp;
 }
-static void flush_fa_buffer(args_t *args, int len)
+static void flush_fa_buffer(cns_t *cns, int len)
 {
-    if ( !args->fa_buf.l ) return;
+    if ( !cns->fa_buf.l ) return;
 
     int nwr = 0;
-    while ( nwr + 60 <= args->fa_buf.l )
+    while ( nwr + 60 <= cns->fa_buf.l )
     {
-        if ( fwrite(args->fa_buf.s+nwr,1,60,args->fp_out) != 60 ) error("Could not write: %s\n", args->output_fname);
-        if ( fwrite("\n",1,1,args->fp_out) != 1 ) error("Could not write: %s\n", args->output_fname);
+        if ( fwrite(cns->fa_buf.s+nwr,1,60,cns->fp_out) != 60 ) error("Could not write: %s\n", cns->fname ? cns->fname : "-");
+        if ( fwrite("\n",1,1,cns->fp_out) != 1 ) error("Could not write: %s\n", cns->fname ? cns->fname : "-");
         nwr += 60;
     }
     if ( nwr )
-        args->fa_ori_pos += nwr;
+        cns->fa_ori_pos += nwr;
 
     if ( len )
     {
         // not finished on this chr yet and the buffer cannot be emptied completely
-        if ( nwr && nwr < args->fa_buf.l )
-            memmove(args->fa_buf.s,args->fa_buf.s+nwr,args->fa_buf.l-nwr);
-        args->fa_buf.l -= nwr;
+        if ( nwr && nwr < cns->fa_buf.l )
+            memmove(cns->fa_buf.s,cns->fa_buf.s+nwr,cns->fa_buf.l-nwr);
+        cns->fa_buf.l -= nwr;
         return;
     }
 
     // empty the whole buffer
-    if ( nwr == args->fa_buf.l ) { args->fa_buf.l = 0; return; }
+    if ( nwr == cns->fa_buf.l ) { cns->fa_buf.l = 0; return; }
 
-    if ( fwrite(args->fa_buf.s+nwr,1,args->fa_buf.l - nwr,args->fp_out) != args->fa_buf.l - nwr ) error("Could not write: %s\n", args->output_fname);
-    if ( fwrite("\n",1,1,args->fp_out) != 1 ) error("Could not write: %s\n", args->output_fname);
+    if ( fwrite(cns->fa_buf.s+nwr,1,cns->fa_buf.l - nwr,cns->fp_out) != cns->fa_buf.l - nwr ) error("Could not write: %s\n", cns->fname ? cns->fname : "-");
+    if ( fwrite("\n",1,1,cns->fp_out) != 1 ) error("Could not write: %s\n", cns->fname ? cns->fname : "-");
 
-    args->fa_ori_pos += args->fa_buf.l - nwr - args->fa_mod_off;
-    args->fa_mod_off = 0;
-    args->fa_buf.l = 0;
+    cns->fa_ori_pos += cns->fa_buf.l - nwr - cns->fa_mod_off;
+    cns->fa_mod_off = 0;
+    cns->fa_buf.l = 0;
 }
-static void apply_variant(args_t *args, bcf1_t *rec)
+static void apply_variant(args_t *args, cns_t *cns, bcf1_t *rec)
 {
     if ( rec->n_allele==1 ) return;
 
-    if ( rec->pos <= args->fa_frz_pos )
+    if ( rec->pos <= cns->fa_frz_pos )
     {
         fprintf(stderr,"The site %s:%d overlaps with another variant, skipping...\n", bcf_seqname(args->hdr,rec),rec->pos+1);
         return;
@@ -356,21 +420,22 @@ static void apply_variant(args_t *args, bcf1_t *rec)
     }
 
     int i, ialt = 1;
-    if ( args->isample >= 0 )
+    char iupac = 0;
+    if ( cns->isample >= 0 )
     {
         bcf_fmt_t *fmt = bcf_get_fmt(args->hdr, rec, "GT");
         if ( !fmt ) return;
         if ( args->haplotype )
         {
             if ( args->haplotype > fmt->n ) error("Can't apply %d-th haplotype at %s:%d\n", args->haplotype,bcf_seqname(args->hdr,rec),rec->pos+1);
-            uint8_t *ignore, *ptr = fmt->p + fmt->size*args->isample + args->haplotype - 1;
+            uint8_t *ignore, *ptr = fmt->p + fmt->size*cns->isample + args->haplotype - 1;
             ialt = bcf_dec_int1(ptr, fmt->type, &ignore);
             if ( bcf_gt_is_missing(ialt) || ialt==bcf_int32_vector_end ) return;
             ialt = bcf_gt_allele(ialt);
         }
         else if ( args->output_iupac ) 
         {
-            uint8_t *ignore, *ptr = fmt->p + fmt->size*args->isample;
+            uint8_t *ignore, *ptr = fmt->p + fmt->size*cns->isample;
             ialt = bcf_dec_int1(ptr, fmt->type, &ignore);
             if ( bcf_gt_is_missing(ialt) || ialt==bcf_int32_vector_end ) return;
             ialt = bcf_gt_allele(ialt);
@@ -378,7 +443,7 @@ static void apply_variant(args_t *args, bcf1_t *rec)
             int jalt;
             if ( fmt->n>1 )
             {
-                ptr = fmt->p + fmt->size*args->isample + 1;
+                ptr = fmt->p + fmt->size*cns->isample + 1;
                 jalt = bcf_dec_int1(ptr, fmt->type, &ignore);
                 if ( bcf_gt_is_missing(jalt) || jalt==bcf_int32_vector_end ) jalt = ialt;
                 else jalt = bcf_gt_allele(jalt);
@@ -389,14 +454,14 @@ static void apply_variant(args_t *args, bcf1_t *rec)
             {
                 char ial = rec->d.allele[ialt][0];
                 char jal = rec->d.allele[jalt][0];
-                rec->d.allele[ialt][0] = gt2iupac(ial,jal);
+                iupac = gt2iupac(ial,jal);
             }
         }
         else
         {
             for (i=0; i<fmt->n; i++)
             {
-                uint8_t *ignore, *ptr = fmt->p + fmt->size*args->isample + i;
+                uint8_t *ignore, *ptr = fmt->p + fmt->size*cns->isample + i;
                 ialt = bcf_dec_int1(ptr, fmt->type, &ignore);
                 if ( bcf_gt_is_missing(ialt) || ialt==bcf_int32_vector_end ) return;
                 ialt = bcf_gt_allele(ialt);
@@ -410,101 +475,117 @@ static void apply_variant(args_t *args, bcf1_t *rec)
     {
         char ial = rec->d.allele[0][0];
         char jal = rec->d.allele[1][0];
-        rec->d.allele[1][0] = gt2iupac(ial,jal);
+        iupac = gt2iupac(ial,jal);
     }
 
-    int len_diff = 0, alen = 0;
-    int idx = rec->pos - args->fa_ori_pos + args->fa_mod_off;
+    // the record is shared by all outputs, the ALT is modified in a copy
+    char *alt = rec->d.allele[ialt];
+    if ( iupac )
+    {
+        args->tmp.l = 0;
+        kputs(alt, &args->tmp);
+        alt = args->tmp.s;
+        alt[0] = iupac;
+    }
+
+    int len_diff = 0, alen = 0, rlen = rec->rlen;
+    int idx = rec->pos - cns->fa_ori_pos + cns->fa_mod_off;
     if ( idx<0 )
     {
         fprintf(stderr,"Warning: ignoring overlapping variant starting at %s:%d\n", bcf_seqname(args->hdr,rec),rec->pos+1);
         return;
     }
-    if ( rec->rlen > args->fa_buf.l - idx )
+    if ( rlen > cns->fa_buf.l - idx )
     {
-        rec->rlen = args->fa_buf.l - idx;
-        alen = strlen(rec->d.allele[ialt]);
-        if ( alen > rec->rlen )
+        rlen = cns->fa_buf.l - idx;
+        alen = strlen(alt);
+        if ( alen > rlen )
         {
-            rec->d.allele[ialt][rec->rlen] = 0;
+            if ( alt!=args->tmp.s )
+            {
+                args->tmp.l = 0;
+                kputs(alt, &args->tmp);
+                alt = args->tmp.s;
+            }
+            alt[rlen] = 0;
             fprintf(stderr,"Warning: trimming variant starting at %s:%d\n", bcf_seqname(args->hdr,rec),rec->pos+1);
         }
     }
-    if ( idx>=args->fa_buf.l ) 
-        error("FIXME: %s:%d .. idx=%d, ori_pos=%d, len=%d, off=%d\n",bcf_seqname(args->hdr,rec),rec->pos+1,idx,args->fa_ori_pos,args->fa_buf.l,args->fa_mod_off);
+    if ( idx>=cns->fa_buf.l ) 
+        error("FIXME: %s:%d .. idx=%d, ori_pos=%d, len=%d, off=%d\n",bcf_seqname(args->hdr,rec),rec->pos+1,idx,cns->fa_ori_pos,cns->fa_buf.l,cns->fa_mod_off);
 
     // sanity check the reference base
-    if ( rec->d.allele[ialt][0]=='<' )
+    if ( alt[0]=='<' )
     {
-        if ( strcasecmp(rec->d.allele[ialt], "<DEL>") )
-            error("Symbolic alleles other than <DEL> are currently not supported: %s at %s:%d\n",rec->d.allele[ialt],bcf_seqname(args->hdr,rec),rec->pos+1);
+        if ( strcasecmp(alt, "<DEL>") )
+            error("Symbolic alleles other than <DEL> are currently not supported: %s at %s:%d\n",alt,bcf_seqname(args->hdr,rec),rec->pos+1);
         assert( rec->d.allele[0][1]==0 );           // todo: for now expecting strlen(REF) = 1
-        len_diff = 1-rec->rlen;
-        rec->d.allele[ialt] = rec->d.allele[0];     // according to VCF spec, REF must precede the event
-        alen = strlen(rec->d.allele[ialt]);
+        len_diff = 1-rlen;
+        alt = rec->d.allele[0];     // according to VCF spec, REF must precede the event
+        alen = strlen(alt);
     }
-    else if ( strncasecmp(rec->d.allele[0],args->fa_buf.s+idx,rec->rlen) )
+    else if ( strncasecmp(rec->d.allele[0],cns->fa_buf.s+idx,rlen) )
     {
-        // fprintf(stderr,"%d .. [%s], idx=%d ori=%d off=%d\n",args->fa_ori_pos,args->fa_buf.s,idx,args->fa_ori_pos,args->fa_mod_off);
+        // fprintf(stderr,"%d .. [%s], idx=%d ori=%d off=%d\n",cns->fa_ori_pos,cns->fa_buf.s,idx,cns->fa_ori_pos,cns->fa_mod_off);
         char tmp = 0;
-        if ( args->fa_buf.l - idx > rec->rlen ) 
+        if ( cns->fa_buf.l - idx > rlen ) 
         { 
-            tmp = args->fa_buf.s[idx+rec->rlen];
-            args->fa_buf.s[idx+rec->rlen] = 0;
+            tmp = cns->fa_buf.s[idx+rlen];
+            cns->fa_buf.s[idx+rlen] = 0;
         }
         error(
             "The fasta sequence does not match the REF allele at %s:%d:\n"
             "   .vcf: [%s]\n" 
             "   .vcf: [%s] <- (ALT)\n" 
             "   .fa:  [%s]%c%s\n",
-            bcf_seqname(args->hdr,rec),rec->pos+1, rec->d.allele[0], rec->d.allele[ialt], args->fa_buf.s+idx, 
-            tmp?tmp:' ',tmp?args->fa_buf.s+idx+rec->rlen+1:""
+            bcf_seqname(args->hdr,rec),rec->pos+1, rec->d.allele[0], alt, cns->fa_buf.s+idx, 
+            tmp?tmp:' ',tmp?cns->fa_buf.s+idx+rlen+1:""
             );
     }
     else
     {
-        alen = strlen(rec->d.allele[ialt]);
-        len_diff = alen - rec->rlen;
+        alen = strlen(alt);
+        len_diff = alen - rlen;
     }
 
     if ( args->fa_case )
-        for (i=0; i<alen; i++) rec->d.allele[ialt][i] = toupper(rec->d.allele[ialt][i]);
+        for (i=0; i<alen; i++) alt[i] = toupper(alt[i]);
     else
-        for (i=0; i<alen; i++) rec->d.allele[ialt][i] = tolower(rec->d.allele[ialt][i]);
+        for (i=0; i<alen; i++) alt[i] = tolower(alt[i]);
 
     if ( len_diff <= 0 )
     {
         // deletion or same size event
         for (i=0; i<alen; i++)
-            args->fa_buf.s[idx+i] = rec->d.allele[ialt][i];
+            cns->fa_buf.s[idx+i] = alt[i];
         if ( len_diff )
-            memmove(args->fa_buf.s+idx+alen,args->fa_buf.s+idx+rec->rlen,args->fa_buf.l-idx-rec->rlen);
+            memmove(cns->fa_buf.s+idx+alen,cns->fa_buf.s+idx+rlen,cns->fa_buf.l-idx-rlen);
     }
     else
     {
         // insertion
-        ks_resize(&args->fa_buf, args->fa_buf.l + len_diff);
-        memmove(args->fa_buf.s + idx + rec->rlen + len_diff, args->fa_buf.s + idx + rec->rlen, args->fa_buf.l - idx - rec->rlen);
+        ks_resize(&cns->fa_buf, cns->fa_buf.l + len_diff);
+        memmove(cns->fa_buf.s + idx + rlen + len_diff, cns->fa_buf.s + idx + rlen, cns->fa_buf.l - idx - rlen);
         for (i=0; i<alen; i++)
-            args->fa_buf.s[idx+i] = rec->d.allele[ialt][i];
+            cns->fa_buf.s[idx+i] = alt[i];
     }
-    if (args->chain && len_diff != 0)
+    if (cns->chain && len_diff != 0)
     {
         // If first nucleotide of both REF and ALT are the same... (indels typically include the nucleotide before the variant)
-        if ( strncasecmp(rec->d.allele[0],rec->d.allele[ialt],1) == 0)
+        if ( strncasecmp(rec->d.allele[0],alt,1) == 0)
         {
             // ...extend the block by 1 bp: start is 1 bp further and alleles are 1 bp shorter
-            push_chain_gap(args->chain, rec->pos + 1, rec->rlen - 1, rec->pos + 1 + args->fa_mod_off, alen - 1);
+            push_chain_gap(cns->chain, rec->pos + 1, rlen - 1, rec->pos + 1 + cns->fa_mod_off, alen - 1);
         }
         else
         {
             // otherwise, just the coordinates of the variant as given
-            push_chain_gap(args->chain, rec->pos, rec->rlen, rec->pos + args->fa_mod_off, alen);
+            push_chain_gap(cns->chain, rec->pos, rlen, rec->pos + cns->fa_mod_off, alen);
         }
     }
-    args->fa_buf.l += len_diff;
-    args->fa_mod_off += len_diff;
-    args->fa_frz_pos  = rec->pos + rec->rlen - 1;
+    cns->fa_buf.l += len_diff;
+    cns->fa_mod_off += len_diff;
+    cns->fa_frz_pos  = rec->pos + rlen - 1;
 }
 
 
@@ -527,6 +608,33 @@ static void mask_region(args_t *args, char *seq, int len)
     }
 }
 
+// end of the buffered window in original coordinates, the same for all outputs
+static inline int buf_ori_end(args_t *args)
+{
+    cns_t *cns = &args->cns[0];
+    return cns->fa_ori_pos + cns->fa_buf.l - cns->fa_mod_off;
+}
+static void apply_variants(args_t *args, bcf1_t *rec)
+{
+    int i;
+    for (i=0; i<args->ncns; i++) apply_variant(args, &args->cns[i], rec);
+}
+static void print_chains(args_t *args)
+{
+    int i;
+    for (i=0; i<args->ncns; i++)
+    {
+        if ( !args->cns[i].chain ) continue;
+        print_chain(args, &args->cns[i]);
+        destroy_chain(&args->cns[i]);
+    }
+}
+static void flush_fa_buffers(args_t *args, int len)
+{
+    int i;
+    for (i=0; i<args->ncns; i++) flush_fa_buffer(&args->cns[i], len);
+}
+
 static void consensus(args_t *args)
 {
     htsFile *fasta = hts_open(args->ref_fname, "rb");
@@ -537,19 +645,16 @@ static void consensus(args_t *args)
         if ( str.s[0]=='>' )
         {
             // new sequence encountered
-            if (args->chain) {
-                print_chain(args);
-                destroy_chain(args);
-            }
+            print_chains(args);
             // apply all cached variants
             while ( args->vcf_rbuf.n )
             {
                 bcf1_t *rec = args->vcf_buf[args->vcf_rbuf.f];
                 if ( rec->rid!=args->rid || ( args->fa_end_pos && rec->pos > args->fa_end_pos ) ) break;
                 int i = rbuf_shift(&args->vcf_rbuf);
-                apply_variant(args, args->vcf_buf[i]);
+                apply_variants(args, args->vcf_buf[i]);
             }
-            flush_fa_buffer(args, 0);
+            flush_fa_buffers(args, 0);
             init_region(args, str.s+1);
             continue;
         }
@@ -560,7 +665,8 @@ static void consensus(args_t *args)
         if ( args->fa_case==-1 ) args->fa_case = toupper(str.s[0])==str.s[0] ? 1 : 0;
 
         if ( args->mask && args->rid>=0) mask_region(args, str.s, str.l);
-        kputs(str.s, &args->fa_buf);
+        int i;
+        for (i=0; i<args->ncns; i++) kputs(str.s, &args->cns[i].fa_buf);
 
         bcf1_t **rec_ptr = NULL;
         while ( args->rid>=0 && (rec_ptr = next_vcf_line(args)) )
@@ -577,7 +683,7 @@ static void consensus(args_t *args)
             }
 
             // is the vcf record well beyond cached fasta buffer? if yes, the buf can be flushed
-            if ( args->fa_ori_pos + args->fa_buf.l - args->fa_mod_off <= rec->pos )
+            if ( buf_ori_end(args) <= rec->pos )
             {
                 unread_vcf_line(args, rec_ptr);
                 rec_ptr = NULL;
@@ -585,14 +691,14 @@ static void consensus(args_t *args)
             }
 
             // is the cached fasta buffer full enough? if not, read more fasta, no flushing
-            if ( args->fa_ori_pos + args->fa_buf.l - args->fa_mod_off < rec->pos + rec->rlen )
+            if ( buf_ori_end(args) < rec->pos + rec->rlen )
             {
                 unread_vcf_line(args, rec_ptr);
                 break;
             }
-            apply_variant(args, rec);
+            apply_variants(args, rec);
         }
-        if ( !rec_ptr ) flush_fa_buffer(args, 60);
+        if ( !rec_ptr ) flush_fa_buffers(args, 60);
     }
     bcf1_t **rec_ptr = NULL;
     while ( args->rid>=0 && (rec_ptr = next_vcf_line(args)) )
@@ -600,15 +706,11 @@ static void consensus(args_t *args)
         bcf1_t *rec = *rec_ptr;
         if ( rec->rid!=args->rid ) break;
         if ( args->fa_end_pos && rec->pos > args->fa_end_pos ) break;
-        if ( args->fa_ori_pos + args->fa_buf.l - args->fa_mod_off <= rec->pos ) break;
-        apply_variant(args, rec);
+        if ( buf_ori_end(args) <= rec->pos ) break;
+        apply_variants(args, rec);
     }
-    if (args->chain)
-    {
-        print_chain(args);
-        destroy_chain(args);
-    }
-    flush_fa_buffer(args, 0);
+    print_chains(args);
+    flush_fa_buffers(args, 0);
     hts_close(fasta);
     free(str.s);
 }
@@ -628,13 +730,18 @@ static void usage(args_t *args)
     fprintf(stderr, "    -i, --iupac-codes          output variants in the form of IUPAC ambiguity codes\n");
     fprintf(stderr, "    -m, --mask <file>          replace regions with N\n");
     fprintf(stderr, "    -o, --output <file>        write output to a file [standard output]\n");
-    fprintf(stderr, "    -c, --chain <file>         write a chain file for liftover\n");
-    fprintf(stderr, "    -s, --sample <name>        apply variants of the given sample\n");
+    fprintf(stderr, "    -p, --prefix <string>      write one consensus per sample to <string><sample>.fa\n");
+    fprintf(stderr, "    -c, --chain <file>         write a chain file for liftover, a prefix of <file><sample>.chain with -p\n");
+    fprintf(stderr, "    -s, --sample <list>        apply variants of the given sample, more than one requires -p\n");
+    fprintf(stderr, "    -S, --samples-file <file>  file of samples to apply, one per line, more than one requires -p\n");
     fprintf(stderr, "Examples:\n");
     fprintf(stderr, "   # Get the consensus for one region. The fasta header lines are then expected\n");
     fprintf(stderr, "   # in the form \">chr:from-to\".\n");
     fprintf(stderr, "   samtools faidx ref.fa 8:11870-11890 | bcftools consensus in.vcf.gz > out.fa\n");
     fprintf(stderr, "\n");
+    fprintf(stderr, "   # Create the consensus of haplotype 1 for all samples in one pass, out.A.fa, out.B.fa, ...\n");
+    fprintf(stderr, "   bcftools consensus -H 1 -S samples.txt -p out. -f ref.fa in.vcf.gz\n");
+    fprintf(stderr, "\n");
     exit(1);
 }
 
@@ -646,6 +753,8 @@ int main_consensus(int argc, char *argv[])
     static struct option loptions[] = 
     {
         {"sample",1,0,'s'},
+        {"samples-file",1,0,'S'},
+        {"prefix",1,0,'p'},
         {"iupac-codes",0,0,'i'},
         {"haplotype",1,0,'H'},
         {"output",1,0,'o'},
@@ -655,11 +764,13 @@ int main_consensus(int argc, char *argv[])
         {0,0,0,0}
     };
     int c;
-    while ((c = getopt_long(argc, argv, "h?s:1iH:f:o:m:c:",loptions,NULL)) >= 0) 
+    while ((c = getopt_long(argc, argv, "h?s:S:p:1iH:f:o:m:c:",loptions,NULL)) >= 0) 
     {
         switch (c) 
         {
             case 's': args->sample = optarg; break;
+            case 'S': args->sample = optarg; args->sample_is_file = 1; break;
+            case 'p': args->prefix = optarg; break;
             case 'o': args->output_fname = optarg; break;
             case 'i': args->output_iupac = 1; break;
             case 'f': args->ref_fname = optarg; break;
@@ -677,6 +788,7 @@ int main_consensus(int argc, char *argv[])
 
     if ( !args->ref_fname && !isatty(fileno((FILE *)stdin)) ) args->ref_fname = "-";
     if ( !args->ref_fname ) usage(args);
+    if ( args->prefix && args->output_fname ) error("The options --prefix and --output cannot be combined\n");
 
     init_data(args);
     consensus(args);
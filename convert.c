@@ -34,8 +34,11 @@ THE SOFTWARE.  */
 #include <htslib/vcf.h>
 #include <htslib/synced_bcf_reader.h>
 #include <htslib/vcfutils.h>
+#include <htslib/khash_str2int.h>
 #include "bcftools.h"
 #include "convert.h"
+#include "profile.h"
+#include "batch.h"
 
 #define T_CHROM   1
 #define T_POS     2
@@ -74,6 +77,7 @@ typedef struct _fmt_t
     bcf_fmt_t *fmt;
     void *usr;                  // user data (optional)
     void (*handler)(convert_t *, bcf1_t *, struct _fmt_t *, int, kstring_t *);
+    void (*rec_handler)(convert_t *, bcf1_t *, struct _fmt_t *, int, kstring_t *);  // the handler specialised for the current record, see init_rec_handlers()
     void (*destroy)(void*);     // clean user data (optional)
 }
 fmt_t;
@@ -92,13 +96,30 @@ struct _convert_t
     int ndat;
     char *undef_info_tag;
     int allow_undef_tags;
+    int nthreads;
+    struct _convert_t **clones;     // private copies for the worker threads of convert_lines()
+    struct _convert_job_t *jobs;    // the chunks of a block, the batches of the pool
+    kstring_t *out;                 // the output of the current convert_blocks() call
+    batch_pool_t *pool;
+    struct _col_t *cols;            // the columns of convert_columns(), see col_init()
+    int ncols;
 };
 
+typedef struct
+{
+    uint64_t hash;
+    int key, out, len;  // offsets of the bitmask in bcsq_t.keys and of its text in bcsq_t.out, the text length
+}
+tbcsq_memo_t;
+
 typedef struct
 {
     kstring_t hap1,hap2;
     char **str;
     int n, m;
+    tbcsq_memo_t *memo;     // the distinct bitmasks of the current record, see tbcsq_memo_get()
+    int nmemo, mmemo, *hash, mhash;
+    kstring_t keys, out;
 }
 bcsq_t;
 
@@ -305,6 +326,70 @@ static void process_gt(convert_t *convert, bcf1_t *line, fmt_t *fmt, int isample
     }
     bcf_format_gt(fmt->fmt, isample, str);
 }
+
+/*
+ *  Specialised handlers of the most common shapes of FORMAT fields, selected
+ *  for each record by init_rec_handlers() once the BCF type of the field is
+ *  known, so that the type checks are not repeated for each sample. The output
+ *  is the same as of process_format() and process_gt().
+ */
+#define FMT_SCALAR(name, type_t, is_missing, is_vector_end, kprint) \
+static void name(convert_t *convert, bcf1_t *line, fmt_t *fmt, int isample, kstring_t *str) \
+{ \
+    type_t val = ((type_t*)fmt->fmt->p)[isample]; \
+    if ( is_vector_end ) return; \
+    if ( is_missing ) kputc('.', str); \
+    else kprint; \
+}
+FMT_SCALAR(process_format_int8,  int8_t,  val==bcf_int8_missing,  val==bcf_int8_vector_end,  kputw(val, str))
+FMT_SCALAR(process_format_int16, int16_t, val==bcf_int16_missing, val==bcf_int16_vector_end, kputw(val, str))
+FMT_SCALAR(process_format_int32, int32_t, val==bcf_int32_missing, val==bcf_int32_vector_end, kputw(val, str))
+FMT_SCALAR(process_format_float, float,   bcf_float_is_missing(val), bcf_float_is_vector_end(val), ksprintf(str, "%g", val))
+#undef FMT_SCALAR
+
+static inline void kput_allele(int8_t val, kstring_t *str)
+{
+    int ial = val>>1;
+    if ( !ial ) kputc('.', str);
+    else if ( ial>0 && ial<=10 ) kputc('0'+ial-1, str);
+    else kputw(ial-1, str);
+}
+static void process_gt_int8_diploid(convert_t *convert, bcf1_t *line, fmt_t *fmt, int isample, kstring_t *str)
+{
+    int8_t *ptr = (int8_t*)(fmt->fmt->p + 2*isample);
+    if ( ptr[0]==bcf_int8_vector_end ) { kputc('.', str); return; }
+    kput_allele(ptr[0], str);
+    if ( ptr[1]==bcf_int8_vector_end ) return;
+    kputc("/|"[ptr[1]&1], str);
+    kput_allele(ptr[1], str);
+}
+
+static void init_rec_handlers(convert_t *convert, bcf1_t *line, int beg, int end)
+{
+    int i;
+    for (i=beg; i<end; i++)
+    {
+        fmt_t *fmt = &convert->fmt[i];
+        fmt->rec_handler = fmt->handler;
+        if ( fmt->type!=T_FORMAT && fmt->type!=T_GT ) continue;
+        init_format(convert, line, fmt);
+        if ( !fmt->fmt ) continue;
+        if ( fmt->type==T_GT )
+        {
+            if ( fmt->fmt->type==BCF_BT_INT8 && fmt->fmt->n==2 ) fmt->rec_handler = process_gt_int8_diploid;
+            continue;
+        }
+        if ( fmt->subscript>=0 || fmt->fmt->n!=1 ) continue;
+        switch (fmt->fmt->type)
+        {
+            case BCF_BT_INT8:  fmt->rec_handler = process_format_int8; break;
+            case BCF_BT_INT16: fmt->rec_handler = process_format_int16; break;
+            case BCF_BT_INT32: fmt->rec_handler = process_format_int32; break;
+            case BCF_BT_FLOAT: fmt->rec_handler = process_format_float; break;
+        }
+    }
+}
+
 static void process_tgt(convert_t *convert, bcf1_t *line, fmt_t *fmt, int isample, kstring_t *str)
 {
     if ( !fmt->ready )
@@ -342,55 +427,23 @@ static void destroy_tbcsq(void *usr)
     if ( csq->n )
         free(csq->str[0]);
     free(csq->str);
+    free(csq->keys.s);
+    free(csq->out.s);
+    free(csq->memo);
+    free(csq->hash);
     free(csq);
 }
-static void process_tbcsq(convert_t *convert, bcf1_t *line, fmt_t *fmt, int isample, kstring_t *str)
-{
-    if ( !fmt->ready )
-    {
-        init_format(convert, line, fmt);
-
-        bcsq_t *csq;
-        if ( fmt->usr )
-        {
-            csq = (bcsq_t*) fmt->usr;
-            if ( csq->n )
-                free(csq->str[0]);
-            csq->n = 0;
-        }
-        else
-            csq = (bcsq_t*) calloc(1,sizeof(bcsq_t));
-        fmt->usr = csq;
-
-        int i=0, len = 0;
-        char *tmp = NULL;
-        if ( bcf_get_info_string(convert->header,line,fmt->key,&tmp,&len)<0 )
-        {
-            csq->n = 0;
-            return;
-        }
-        do
-        {
-            csq->n++;
-            hts_expand(char*, csq->n, csq->m, csq->str);
-            csq->str[ csq->n-1 ] = tmp + i;
-            while ( i<len && tmp[i]!=',' ) i++;
-            if ( i<len && tmp[i]==',' ) tmp[i++] = 0;
-        }
-        while ( i<len );
-    }
-
-    bcsq_t *csq = (bcsq_t*)fmt->usr;
-
-    if ( fmt->fmt==NULL || !csq->n ) return;
 
+// Renders the consequences of one sample's FORMAT/BCSQ bitmask, adds nothing if there are none
+static void tbcsq_render(fmt_t *fmt, bcsq_t *csq, uint8_t *ptr, kstring_t *str)
+{
     csq->hap1.l = 0;
     csq->hap2.l = 0;
 
     int mask = fmt->subscript==0 ? 3 : 1;   // merge both haplotypes if subscript==0
 
     #define BRANCH(type_t, nbits) { \
-        type_t *x = (type_t*)(fmt->fmt->p + isample*fmt->fmt->size); \
+        type_t *x = (type_t*)ptr; \
         int i,j; \
         if ( fmt->subscript<=0 || fmt->subscript==1 ) \
         { \
@@ -438,6 +491,117 @@ static void process_tbcsq(convert_t *convert, bcf1_t *line, fmt_t *fmt, int isam
     else
         kputs(csq->hap2.l?csq->hap2.s:".", str);
 }
+
+/*
+ *  Samples with the same bitmask print the same consequences, so the text of
+ *  each distinct bitmask is rendered once per record and looked up in the
+ *  open-addressing table csq->hash by the raw bytes of the vector. The table
+ *  is emptied with each new record.
+ */
+static void tbcsq_memo_reset(bcsq_t *csq)
+{
+    csq->nmemo = 0;
+    csq->keys.l = 0;
+    csq->out.l  = 0;
+    if ( csq->mhash ) memset(csq->hash, 0xff, sizeof(*csq->hash)*csq->mhash);
+}
+static inline uint64_t tbcsq_hash(const uint8_t *key, int len)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    int i;
+    for (i=0; i<len; i++) hash = (hash ^ key[i]) * 0x100000001b3ULL;
+    return hash;
+}
+static void tbcsq_memo_grow(bcsq_t *csq)
+{
+    int i;
+    csq->mhash = csq->mhash ? csq->mhash*2 : 64;
+    csq->hash  = (int*) realloc(csq->hash, sizeof(*csq->hash)*csq->mhash);
+    memset(csq->hash, 0xff, sizeof(*csq->hash)*csq->mhash);
+    for (i=0; i<csq->nmemo; i++)
+    {
+        uint32_t k = csq->memo[i].hash & (csq->mhash - 1);
+        while ( csq->hash[k]>=0 ) k = (k+1) & (csq->mhash - 1);
+        csq->hash[k] = i;
+    }
+}
+static tbcsq_memo_t *tbcsq_memo_get(fmt_t *fmt, bcsq_t *csq, uint8_t *key)
+{
+    int len = fmt->fmt->size;
+    uint64_t hash = tbcsq_hash(key, len);
+    if ( 2*(csq->nmemo+1) > csq->mhash ) tbcsq_memo_grow(csq);
+
+    uint32_t k = hash & (csq->mhash - 1);
+    while ( csq->hash[k]>=0 )
+    {
+        tbcsq_memo_t *memo = &csq->memo[csq->hash[k]];
+        if ( memo->hash==hash && !memcmp(csq->keys.s + memo->key, key, len) ) return memo;
+        k = (k+1) & (csq->mhash - 1);
+    }
+
+    hts_expand(tbcsq_memo_t, csq->nmemo+1, csq->mmemo, csq->memo);
+    tbcsq_memo_t *memo = &csq->memo[csq->nmemo];
+    csq->hash[k] = csq->nmemo++;
+    memo->hash = hash;
+    memo->key  = csq->keys.l;
+    kputsn((char*)key, len, &csq->keys);
+    memo->out  = csq->out.l;
+    tbcsq_render(fmt, csq, key, &csq->out);
+    memo->len  = csq->out.l - memo->out;
+    return memo;
+}
+
+static void process_tbcsq(convert_t *convert, bcf1_t *line, fmt_t *fmt, int isample, kstring_t *str)
+{
+    if ( !fmt->ready )
+    {
+        init_format(convert, line, fmt);
+
+        bcsq_t *csq;
+        if ( fmt->usr )
+        {
+            csq = (bcsq_t*) fmt->usr;
+            if ( csq->n )
+                free(csq->str[0]);
+            csq->n = 0;
+        }
+        else
+            csq = (bcsq_t*) calloc(1,sizeof(bcsq_t));
+        fmt->usr = csq;
+        tbcsq_memo_reset(csq);
+
+        int i=0, len = 0;
+        char *tmp = NULL;
+        if ( bcf_get_info_string(convert->header,line,fmt->key,&tmp,&len)<0 )
+        {
+            csq->n = 0;
+            return;
+        }
+        do
+        {
+            csq->n++;
+            hts_expand(char*, csq->n, csq->m, csq->str);
+            csq->str[ csq->n-1 ] = tmp + i;
+            while ( i<len && tmp[i]!=',' ) i++;
+            if ( i<len && tmp[i]==',' ) tmp[i++] = 0;
+        }
+        while ( i<len );
+    }
+
+    bcsq_t *csq = (bcsq_t*)fmt->usr;
+
+    if ( fmt->fmt==NULL || !csq->n ) return;
+
+    // most samples have no consequence at all
+    uint8_t *ptr = fmt->fmt->p + isample*fmt->fmt->size;
+    int i;
+    for (i=0; i<fmt->fmt->size; i++)
+        if ( ptr[i] ) break;
+    if ( i==fmt->fmt->size ) return;
+
+    tbcsq_memo_t *memo = tbcsq_memo_get(fmt, csq, ptr);
+    if ( memo->len ) kputsn(csq->out.s + memo->out, memo->len, str);
+}
 static void init_format_iupac(convert_t *convert, bcf1_t *line, fmt_t *fmt)
 {
     init_format(convert, line, fmt);
@@ -1224,14 +1388,29 @@ convert_t *convert_init(bcf_hdr_t *hdr, int *samples, int nsamples, const char *
     return convert;
 }
 
+static void col_destroy(convert_t *convert);
+
 void convert_destroy(convert_t *convert)
 {
     int i;
+    col_destroy(convert);
     for (i=0; i<convert->nfmt; i++)
     {
         if ( convert->fmt[i].destroy ) convert->fmt[i].destroy(convert->fmt[i].usr);
         free(convert->fmt[i].key);
     }
+    if ( convert->pool )
+    {
+        batch_pool_destroy(convert->pool);
+        for (i=0; i<convert->nthreads; i++)
+        {
+            convert_destroy(convert->clones[i]);
+            free(convert->jobs[i].str.s);
+            free(convert->jobs[i].tmp.s);
+        }
+        free(convert->clones);
+        free(convert->jobs);
+    }
     free(convert->fmt);
     free(convert->undef_info_tag);
     free(convert->dat);
@@ -1289,7 +1468,7 @@ int convert_header(convert_t *convert, kstring_t *str)
     return str->l - l_ori;
 }
 
-int convert_line(convert_t *convert, bcf1_t *line, kstring_t *str)
+static int _convert_line(convert_t *convert, bcf1_t *line, kstring_t *str)
 {
     if ( !convert->allow_undef_tags && convert->undef_info_tag )
         error("Error: no such tag defined in the VCF header: INFO/%s. FORMAT fields must be in square brackets, e.g. \"[ %s]\"\n", convert->undef_info_tag,convert->undef_info_tag);
@@ -1310,6 +1489,7 @@ int convert_line(convert_t *convert, bcf1_t *line, kstring_t *str)
                 convert->fmt[j].ready = 0;
                 j++;
             }
+            if ( convert->nsamples ) init_rec_handlers(convert, line, i, j);
             for (js=0; js<convert->nsamples; js++)
             {
                 // Here comes a hack designed for TBCSQ. When running on large files,
@@ -1327,10 +1507,10 @@ int convert_line(convert_t *convert, bcf1_t *line, kstring_t *str)
                         for (ir=0; ir<convert->nreaders; ir++)
                             kputc(bcf_sr_has_line(convert->readers,ir)?'1':'0', str);
                     }
-                    else if ( convert->fmt[k].handler )
+                    else if ( convert->fmt[k].rec_handler )
                     {
                         size_t l = str->l;
-                        convert->fmt[k].handler(convert, line, &convert->fmt[k], ks, str);
+                        convert->fmt[k].rec_handler(convert, line, &convert->fmt[k], ks, str);
                         if ( l==str->l ) { str->l = l_start; break; }  // only TBCSQ does this
                     }
                 }
@@ -1351,6 +1531,564 @@ int convert_line(convert_t *convert, bcf1_t *line, kstring_t *str)
     return str->l - l_ori;
 }
 
+int convert_line(convert_t *convert, bcf1_t *line, kstring_t *str)
+{
+    uint64_t t0 = profile_begin();
+    int ret = _convert_line(convert, line, str);
+    profile_end_bytes(PROF_FORMAT, t0, ret>0 ? ret : 0);
+    return ret;
+}
+
+/*
+ *  The columnar output of convert_columns(). Each %TAG of the format string
+ *  is one column, the tags in square brackets are columns with one cell per
+ *  sample, in the order of the samples. The separators and %SAMPLE do not
+ *  produce columns.
+ *
+ *  All integers are little-endian and each block is padded to a multiple of
+ *  8 bytes so that the columns of a memory-mapped file are aligned.
+ *
+ *  The header:
+ *      char[8]     "BCFCOL\1\0"
+ *      uint64      the size of the rest of the header
+ *      uint32      nsamples, ncols
+ *      nsamples x  NUL-terminated sample names
+ *      ncols x     uint8 type (COL_INT, COL_FLOAT, COL_STR, COL_GT), uint8 is
+ *                  per-sample, NUL-terminated name such as INFO/DP{0} or FORMAT/GQ
+ *
+ *  Followed by chunks of rows, each:
+ *      uint64      the size of the rest of the chunk
+ *      uint32      nrows, ncols
+ *      ncols x     uint64 size of the column, then the column data
+ *
+ *  There are nrows cells in a column, or nrows*nsamples with the sample
+ *  changing fastest in per-sample columns. The column data by type:
+ *
+ *      COL_INT, COL_FLOAT
+ *          uint32 width, the maximum number of values in the chunk; ncells x
+ *          width int32 or float values, padded with the BCF vector_end value.
+ *          Missing values and tags use the BCF missing value.
+ *      COL_STR
+ *          the dictionary of the chunk: uint32 ndict, (ndict+1) x uint32
+ *          offsets of the NUL-terminated strings which follow, padded to 4
+ *          bytes; then ncells x uint32 indexes to the dictionary, 0xffffffff
+ *          for missing tags
+ *      COL_GT
+ *          uint32 ploidy, the maximum in the chunk, and uint32 nbits; ncells x
+ *          ploidy values of nbits bits, packed from the lowest bit of each
+ *          byte. The values are the BCF encoding of the alleles,
+ *          (allele+1)<<1|phased, with 0 for missing, and all bits set for
+ *          vector_end.
+ *
+ *  The fields without a native type, such as %TGT or %TYPE, are stored as
+ *  strings formatted as in the text output.
+ */
+#define COL_INT   1
+#define COL_FLOAT 2
+#define COL_STR   3
+#define COL_GT    4
+
+typedef struct _col_t
+{
+    fmt_t *fmt;
+    int type, per_sample, id;   // id: the header id of INFO and FORMAT tags, -1 if formatted as text
+    kstring_t name;
+    int32_t *vals;              // the values of the current chunk and the number of values in each cell
+    int nvals, mvals, *nval, mnval;
+    void *dict;                 // the strings of the current chunk, khash_str2int
+    kstring_t dict_str;
+    uint32_t *dict_off, *codes;
+    int ndict, mdict_off, mcodes;
+}
+col_t;
+
+static void col_destroy(convert_t *convert)
+{
+    int i;
+    for (i=0; i<convert->ncols; i++)
+    {
+        col_t *col = &convert->cols[i];
+        free(col->name.s);
+        free(col->vals);
+        free(col->nval);
+        if ( col->dict ) khash_str2int_destroy_free(col->dict);
+        free(col->dict_str.s);
+        free(col->dict_off);
+        free(col->codes);
+    }
+    free(convert->cols);
+    convert->cols  = NULL;
+    convert->ncols = 0;
+}
+
+static void col_init(convert_t *convert)
+{
+    int i;
+    convert->cols = (col_t*) calloc(convert->nfmt, sizeof(col_t));
+    for (i=0; i<convert->nfmt; i++)
+    {
+        fmt_t *fmt = &convert->fmt[i];
+        if ( fmt->type==T_SEP || fmt->type==T_SAMPLE ) continue;
+        if ( fmt->type==T_MASK ) error("The %%MASK field is not supported in the columnar output\n");
+
+        col_t *col = &convert->cols[convert->ncols++];
+        col->fmt  = fmt;
+        col->id   = -1;
+        col->type = COL_STR;
+        col->per_sample = fmt->is_gt_field;
+        switch (fmt->type)
+        {
+            case T_POS: case T_POS0: case T_END: case T_END0: col->type = COL_INT; break;
+            case T_QUAL: col->type = COL_FLOAT; break;
+            case T_GT: col->type = COL_GT; break;
+            case T_INFO:
+            case T_FORMAT:
+            {
+                int hl = fmt->type==T_INFO ? BCF_HL_INFO : BCF_HL_FMT;
+                int id = bcf_hdr_id2int(convert->header, BCF_DT_ID, fmt->key);
+                if ( !bcf_hdr_idinfo_exists(convert->header,hl,id) )
+                {
+                    if ( !convert->allow_undef_tags )
+                        error("Error: no such tag defined in the VCF header: %s/%s\n", fmt->type==T_INFO ? "INFO" : "FORMAT", fmt->key);
+                    break;  // printed as "." by the text handler
+                }
+                col->id = id;
+                int type = bcf_hdr_id2type(convert->header,hl,id);
+                if ( type==BCF_HT_INT || type==BCF_HT_FLAG ) col->type = COL_INT;
+                else if ( type==BCF_HT_REAL ) col->type = COL_FLOAT;
+                break;
+            }
+        }
+        if ( fmt->type==T_INFO ) kputs("INFO/", &col->name);
+        else if ( fmt->type==T_FORMAT || fmt->type==T_GT ) kputs("FORMAT/", &col->name);
+        kputs(fmt->key ? fmt->key : "", &col->name);
+        if ( fmt->subscript>=0 && (fmt->type==T_INFO || fmt->type==T_FORMAT || fmt->type==T_ALT) )
+            ksprintf(&col->name, "{%d}", fmt->subscript);
+    }
+}
+
+static inline void col_put_u32(kstring_t *str, uint32_t val)
+{
+    uint8_t buf[4] = { val, val>>8, val>>16, val>>24 };
+    kputsn((char*)buf, 4, str);
+}
+static inline void col_put_u64(kstring_t *str, uint64_t val)
+{
+    col_put_u32(str, val);
+    col_put_u32(str, val>>32);
+}
+static inline void col_set_u64(kstring_t *str, size_t pos, uint64_t val)
+{
+    int i;
+    for (i=0; i<8; i++) str->s[pos+i] = (val >> (8*i)) & 0xff;
+}
+static inline void col_pad(kstring_t *str, int align)
+{
+    while ( str->l % align ) kputc(0, str);
+}
+
+// The values of one cell of a numeric column, missing values are left out
+static int col_cell_values(convert_t *convert, col_t *col, bcf1_t *rec, int ks, int32_t *buf, int mbuf)
+{
+    fmt_t *fmt = col->fmt;
+    union { float f; int32_t i; } u;
+    switch (fmt->type)
+    {
+        case T_POS:  buf[0] = rec->pos+1; return 1;
+        case T_POS0: buf[0] = rec->pos; return 1;
+        case T_END:  buf[0] = rec->pos+rec->rlen; return 1;
+        case T_END0: buf[0] = rec->pos+rec->rlen-1; return 1;
+        case T_QUAL:
+            if ( bcf_float_is_missing(rec->qual) ) return 0;
+            u.f = rec->qual; buf[0] = u.i;
+            return 1;
+    }
+    if ( col->id<0 ) return 0;
+
+    void *dat;
+    int n, type, i, beg = 0;
+    if ( fmt->type==T_INFO )
+    {
+        bcf_info_t *info = bcf_get_info_id(rec, col->id);
+        if ( !info )
+        {
+            if ( bcf_hdr_id2type(convert->header,BCF_HL_INFO,col->id)!=BCF_HT_FLAG ) return 0;
+            buf[0] = 0;
+            return 1;
+        }
+        if ( info->len<=0 ) { buf[0] = 1; return 1; }   // flag
+        dat = info->vptr; n = info->len; type = info->type;
+    }
+    else
+    {
+        bcf_fmt_t *f = bcf_get_fmt_id(rec, col->id);
+        if ( !f ) return 0;
+        dat = f->p + ks*f->size; n = f->n; type = f->type;
+    }
+    if ( fmt->subscript>=0 )
+    {
+        if ( fmt->subscript >= n ) return 0;
+        beg = fmt->subscript; n = beg + 1;
+    }
+    int nout = 0;
+    for (i=beg; i<n && nout<mbuf; i++)
+    {
+        if ( type==BCF_BT_FLOAT )
+        {
+            u.f = ((float*)dat)[i];
+            if ( bcf_float_is_vector_end(u.f) ) break;
+            buf[nout++] = u.i;
+        }
+        else
+        {
+            int32_t val = bcf_array_ivalue(dat, type, i);
+            if ( val==bcf_int32_vector_end ) break;
+            buf[nout++] = val;
+        }
+    }
+    return nout;
+}
+
+static void col_encode_num(convert_t *convert, col_t *col, bcf1_t **recs, int nrecs, kstring_t *str)
+{
+    int nsmpl = col->per_sample ? convert->nsamples : 1;
+    int ncells = nrecs*nsmpl, i, j, k, width = 1;
+    hts_expand(int, ncells, col->mnval, col->nval);
+    col->nvals = 0;
+    for (i=0; i<nrecs; i++)
+    {
+        int n = 0;
+        if ( col->id>=0 )
+        {
+            if ( col->fmt->type==T_INFO )
+            {
+                bcf_info_t *info = bcf_get_info_id(recs[i], col->id);
+                n = info && info->len>0 ? info->len : 1;
+            }
+            else
+            {
+                bcf_fmt_t *f = bcf_get_fmt_id(recs[i], col->id);
+                n = f ? f->n : 1;
+            }
+        }
+        if ( n < 1 || col->fmt->subscript>=0 ) n = 1;
+        hts_expand(int32_t, col->nvals + n*nsmpl, col->mvals, col->vals);
+        for (j=0; j<nsmpl; j++)
+        {
+            int ks = col->per_sample ? convert->samples[j] : -1;
+            int nv = col_cell_values(convert, col, recs[i], ks, col->vals + col->nvals, n);
+            col->nval[i*nsmpl+j] = nv;
+            col->nvals += nv;
+            if ( width < nv ) width = nv;
+        }
+    }
+
+    int32_t missing, vector_end;
+    if ( col->type==COL_FLOAT ) { missing = bcf_float_missing; vector_end = bcf_float_vector_end; }
+    else { missing = bcf_int32_missing; vector_end = bcf_int32_vector_end; }
+
+    col_put_u32(str, width);
+    ks_resize(str, str->l + (size_t)ncells*width*4 + 8);
+    int32_t *val = col->vals;
+    for (i=0; i<ncells; i++)
+    {
+        int nv = col->nval[i];
+        if ( !nv ) { col_put_u32(str, missing); k = 1; }
+        else
+        {
+            for (k=0; k<nv; k++) col_put_u32(str, val[k]);
+            val += nv;
+        }
+        for (; k<width; k++) col_put_u32(str, vector_end);
+    }
+}
+
+static void col_encode_str(convert_t *convert, col_t *col, bcf1_t **recs, int nrecs, kstring_t *str)
+{
+    int nsmpl = col->per_sample ? convert->nsamples : 1;
+    int ncells = nrecs*nsmpl, i, j, code;
+    if ( col->dict ) khash_str2int_destroy_free(col->dict);
+    col->dict = khash_str2int_init();
+    col->dict_str.l = 0;
+    col->ndict = 0;
+    hts_expand(uint32_t, ncells, col->mcodes, col->codes);
+
+    kstring_t tmp = {0,0,0};
+    fmt_t *fmt = col->fmt;
+    for (i=0; i<nrecs; i++)
+    {
+        if ( col->per_sample ) fmt->ready = 0;
+        for (j=0; j<nsmpl; j++)
+        {
+            int ks = col->per_sample ? convert->samples[j] : -1;
+            tmp.l = 0;
+            int missing = 0;
+            if ( col->id>=0 && fmt->type==T_INFO )
+            {
+                bcf_info_t *info = bcf_get_info_id(recs[i], col->id);
+                if ( !info ) missing = 1;
+                else kputsn((char*)info->vptr, info->len>0 ? strnlen((char*)info->vptr, info->len) : 0, &tmp);
+            }
+            else if ( col->id>=0 )
+            {
+                bcf_fmt_t *f = bcf_get_fmt_id(recs[i], col->id);
+                if ( !f ) missing = 1;
+                else
+                {
+                    char *p = (char*)(f->p + ks*f->size);
+                    kputsn(p, strnlen(p, f->size), &tmp);
+                }
+            }
+            else
+                fmt->handler(convert, recs[i], fmt, ks, &tmp);
+            if ( missing ) { col->codes[i*nsmpl+j] = UINT32_MAX; continue; }
+            if ( !tmp.s ) kputs("", &tmp);
+
+            if ( khash_str2int_get(col->dict, tmp.s, &code)!=0 )
+            {
+                code = col->ndict++;
+                khash_str2int_set(col->dict, strdup(tmp.s), code);
+                hts_expand(uint32_t, col->ndict+1, col->mdict_off, col->dict_off);
+                col->dict_off[code] = col->dict_str.l;
+                kputsn(tmp.s, tmp.l+1, &col->dict_str);
+            }
+            col->codes[i*nsmpl+j] = code;
+        }
+    }
+    free(tmp.s);
+
+    hts_expand(uint32_t, col->ndict+1, col->mdict_off, col->dict_off);
+    col->dict_off[col->ndict] = col->dict_str.l;
+    col_put_u32(str, col->ndict);
+    for (i=0; i<=col->ndict; i++) col_put_u32(str, col->dict_off[i]);
+    kputsn(col->dict_str.s ? col->dict_str.s : "", col->dict_str.l, str);
+    col_pad(str, 4);
+    ks_resize(str, str->l + (size_t)ncells*4 + 8);
+    for (i=0; i<ncells; i++) col_put_u32(str, col->codes[i]);
+}
+
+static void col_encode_gt(convert_t *convert, col_t *col, bcf1_t **recs, int nrecs, kstring_t *str)
+{
+    int nsmpl = col->per_sample ? convert->nsamples : 1;
+    int ncells = nrecs*nsmpl, i, j, k, ploidy = 1;
+    int gt_id = bcf_hdr_id2int(convert->header, BCF_DT_ID, "GT");
+    int32_t max = 0;
+
+    // the ploidy and the largest allele of the chunk
+    for (i=0; i<nrecs; i++)
+    {
+        bcf_fmt_t *f = gt_id>=0 ? bcf_get_fmt_id(recs[i], gt_id) : NULL;
+        if ( !f ) continue;
+        if ( ploidy < f->n ) ploidy = f->n;
+        for (j=0; j<nsmpl; j++)
+        {
+            int ks = col->per_sample ? convert->samples[j] : 0;
+            for (k=0; k<f->n; k++)
+            {
+                int32_t val = bcf_array_ivalue(f->p + ks*f->size, f->type, k);
+                if ( val==bcf_int32_vector_end ) break;
+                if ( val!=bcf_int32_missing && max < val ) max = val;
+            }
+        }
+    }
+    int nbits = 1;
+    while ( (1<<nbits) - 1 <= max ) nbits++;
+    uint32_t vector_end = (1<<nbits) - 1;
+
+    col_put_u32(str, ploidy);
+    col_put_u32(str, nbits);
+    size_t nbytes = ((uint64_t)ncells*ploidy*nbits + 7) / 8;
+    ks_resize(str, str->l + nbytes + 8);
+    uint8_t *out = (uint8_t*) str->s + str->l;
+    memset(out, 0, nbytes);
+    uint64_t ibit = 0;
+    for (i=0; i<nrecs; i++)
+    {
+        bcf_fmt_t *f = gt_id>=0 ? bcf_get_fmt_id(recs[i], gt_id) : NULL;
+        for (j=0; j<nsmpl; j++)
+        {
+            int ks = col->per_sample ? convert->samples[j] : 0;
+            for (k=0; k<ploidy; k++)
+            {
+                uint32_t val;
+                if ( !f ) val = k ? vector_end : 0;
+                else if ( k >= f->n ) val = vector_end;
+                else
+                {
+                    int32_t gt = bcf_array_ivalue(f->p + ks*f->size, f->type, k);
+                    if ( gt==bcf_int32_vector_end ) val = vector_end;
+                    else if ( gt==bcf_int32_missing ) val = 0;
+                    else val = gt;
+                }
+                int b;
+                for (b=0; b<nbits; b++, ibit++)
+                    if ( val & (1<<b) ) out[ibit>>3] |= 1<<(ibit&7);
+            }
+        }
+    }
+    str->l += nbytes;
+}
+
+/*
+ *  col_encode() - encode a block of records as one chunk of the columnar output
+ */
+static void col_encode(convert_t *convert, bcf1_t **recs, int nrecs, kstring_t *str)
+{
+    if ( !convert->cols ) col_init(convert);
+    int i;
+    for (i=0; i<nrecs; i++) bcf_unpack(recs[i], convert->max_unpack);
+
+    size_t beg = str->l;
+    col_put_u64(str, 0);
+    col_put_u32(str, nrecs);
+    col_put_u32(str, convert->ncols);
+    for (i=0; i<convert->ncols; i++)
+    {
+        col_t *col = &convert->cols[i];
+        size_t col_beg = str->l;
+        col_put_u64(str, 0);
+        switch (col->type)
+        {
+            case COL_INT:
+            case COL_FLOAT: col_encode_num(convert, col, recs, nrecs, str); break;
+            case COL_GT:    col_encode_gt(convert, col, recs, nrecs, str); break;
+            default:        col_encode_str(convert, col, recs, nrecs, str); break;
+        }
+        col_pad(str, 8);
+        col_set_u64(str, col_beg, str->l - col_beg - 8);
+    }
+    col_set_u64(str, beg, str->l - beg - 8);
+}
+
+int convert_columns_header(convert_t *convert, kstring_t *str)
+{
+    if ( !convert->cols ) col_init(convert);
+    int i, l_ori = str->l;
+    kputsn("BCFCOL\1\0", 8, str);
+    size_t beg = str->l;
+    col_put_u64(str, 0);
+    col_put_u32(str, convert->nsamples);
+    col_put_u32(str, convert->ncols);
+    for (i=0; i<convert->nsamples; i++)
+        kputsn(convert->header->samples[convert->samples[i]], strlen(convert->header->samples[convert->samples[i]])+1, str);
+    for (i=0; i<convert->ncols; i++)
+    {
+        kputc(convert->cols[i].type, str);
+        kputc(convert->cols[i].per_sample, str);
+        kputsn(convert->cols[i].name.s, convert->cols[i].name.l+1, str);
+    }
+    col_pad(str, 8);
+    col_set_u64(str, beg, str->l - beg - 8);
+    return str->l - l_ori;
+}
+
+typedef struct _convert_job_t
+{
+    bcf1_t **recs;
+    int nrecs, columns;
+    kstring_t str, tmp;
+}
+convert_job_t;
+
+static void convert_worker(void *worker, void *data)
+{
+    convert_t *convert = (convert_t*) worker;
+    convert_job_t *job = (convert_job_t*) data;
+    job->str.l = 0;
+    if ( job->columns )
+    {
+        if ( job->nrecs ) col_encode(convert, job->recs, job->nrecs, &job->str);
+        return;
+    }
+    int i;
+    for (i=0; i<job->nrecs; i++)
+    {
+        convert_line(convert, job->recs[i], &job->tmp);
+        kputsn(job->tmp.s, job->tmp.l, &job->str);
+    }
+}
+
+static void convert_worker_write(void *data, void *job)
+{
+    convert_t *convert = (convert_t*) data;
+    kstring_t *str = &((convert_job_t*) job)->str;
+    kputsn(str->s, str->l, convert->out);
+}
+
+/*
+ *  convert_blocks() - format a block of records as text, or as chunks of the
+ *  columnar output, appending to str
+ *
+ *  With the "threads" option set, the block is split into consecutive chunks
+ *  which are formatted in parallel by the workers of a batch pool, started on
+ *  the first call and kept until convert_destroy(). Each worker has a private
+ *  copy of the convert_t object and the chunks are concatenated in the
+ *  original order. In the columnar output each thread's part of the block is
+ *  a chunk of its own. The records must not be shared with other threads for
+ *  the duration of the call. Returns the number of bytes appended.
+ */
+static int convert_blocks(convert_t *convert, bcf1_t **recs, int nrecs, kstring_t *str, int columns)
+{
+    int i, l_ori = str->l, nthreads = convert->nthreads;
+    if ( nthreads > nrecs ) nthreads = nrecs;
+    if ( nthreads <= 1 )
+    {
+        if ( columns )
+        {
+            if ( nrecs ) col_encode(convert, recs, nrecs, str);
+            return str->l - l_ori;
+        }
+        kstring_t tmp = {0,0,0};
+        for (i=0; i<nrecs; i++)
+        {
+            convert_line(convert, recs[i], &tmp);
+            kputsn(tmp.s, tmp.l, str);
+        }
+        free(tmp.s);
+        return str->l - l_ori;
+    }
+
+    if ( !convert->pool )
+    {
+        int n = convert->nthreads;
+        convert->clones = (convert_t**) malloc(sizeof(convert_t*)*n);
+        convert->jobs   = (convert_job_t*) calloc(n, sizeof(convert_job_t));
+        void **jobs = (void**) malloc(sizeof(void*)*n);
+        for (i=0; i<n; i++)
+        {
+            convert->clones[i] = convert_init(convert->header, convert->samples, convert->nsamples, convert->format_str);
+            convert->clones[i]->allow_undef_tags = convert->allow_undef_tags;
+            jobs[i] = &convert->jobs[i];
+        }
+        convert->pool = batch_pool_init(n, (void**)convert->clones, jobs, n, convert_worker, convert_worker_write, convert);
+        free(jobs);
+    }
+    convert->out = str;
+    int irec = 0;
+    for (i=0; i<nthreads; i++)
+    {
+        convert_job_t *job = (convert_job_t*) batch_pool_get(convert->pool);
+        job->columns = columns;
+        job->recs    = recs + irec;
+        job->nrecs   = (nrecs - irec) / (nthreads - i);
+        irec += job->nrecs;
+        batch_pool_submit(convert->pool);
+    }
+    batch_pool_sync(convert->pool);
+    convert->out = NULL;
+    return str->l - l_ori;
+}
+
+int convert_lines(convert_t *convert, bcf1_t **recs, int nrecs, kstring_t *str)
+{
+    return convert_blocks(convert, recs, nrecs, str, 0);
+}
+
+int convert_columns(convert_t *convert, bcf1_t **recs, int nrecs, kstring_t *str)
+{
+    return convert_blocks(convert, recs, nrecs, str, 1);
+}
+
 int convert_set_option(convert_t *convert, enum convert_option opt, ...)
 {
     int ret = 0;
@@ -1362,6 +2100,10 @@ int convert_set_option(convert_t *convert, enum convert_option opt, ...)
         case allow_undef_tags:
             convert->allow_undef_tags = va_arg(args, int);
             break;
+        case threads:
+            if ( convert->pool ) { ret = -1; break; }    // the pool is already running
+            convert->nthreads = va_arg(args, int);
+            break;
         default:
             ret = -1;
     }
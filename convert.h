@@ -30,7 +30,8 @@ THE SOFTWARE.  */
 typedef struct _convert_t convert_t;
 enum convert_option
 {
-    allow_undef_tags
+    allow_undef_tags,
+    threads             // number of threads used by convert_lines()
 };
 
 convert_t *convert_init(bcf_hdr_t *hdr, int *samples, int nsamples, const char *str);
@@ -38,6 +39,16 @@ void convert_destroy(convert_t *convert);
 int convert_set_option(convert_t *convert, enum convert_option opt, ...);
 int convert_header(convert_t *convert, kstring_t *str);
 int convert_line(convert_t *convert, bcf1_t *rec, kstring_t *str);
+int convert_lines(convert_t *convert, bcf1_t **recs, int nrecs, kstring_t *str);
+
+/*
+ *  convert_columns_header() - the header of the columnar binary output
+ *  convert_columns() - encode a block of records as chunks of the columnar
+ *      output, in parallel with the "threads" option as convert_lines(). See
+ *      convert.c for the description of the format.
+ */
+int convert_columns_header(convert_t *convert, kstring_t *str);
+int convert_columns(convert_t *convert, bcf1_t **recs, int nrecs, kstring_t *str);
 int convert_max_unpack(convert_t *convert);
 
 #endif
@@ -143,18 +143,26 @@
 #include <errno.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <ctype.h>
+#include <sys/stat.h>
+#include <pthread.h>
 #include "bcftools.h"
 #include "filter.h"
 #include "regidx.h"
 #include "kheap.h"
 #include "smpl_ilist.h"
 #include "rbuf.h"
+#include "profile.h"
+#include "cache.h"
 
 #ifndef __FUNCTION__
 #  define __FUNCTION__ __func__
 #endif
 
+// With --tscript-threads, the maximum number of finished transcripts waiting for hap_finalize()
+#define TSCRIPT_BATCH 256
+
 // Logic of the filters: include or exclude sites which match the filters?
 #define FLT_INCLUDE 1
 #define FLT_EXCLUDE 2
@@ -395,6 +403,7 @@ struct _vcsq_t
              type:31;   // one of CSQ_* types
     uint32_t trid;
     uint32_t biotype;   // one of GF_* types
+    uint32_t ref_pos;   // position of ref, kept as the record may be flushed before this one
     char *gene;         // gene name
     bcf1_t *ref;        // if type&CSQ_PRINTED_UPSTREAM, ref consequence "@1234"
     kstring_t vstr;     // variant string, eg 5TY>5I|121ACG>A+124TA>T
@@ -438,6 +447,14 @@ KHASH_MAP_INIT_INT(pos2vbuf, vbuf_t*)
         consequences into independent parts
 */
 typedef struct _hap_node_t hap_node_t;
+typedef struct
+{
+    hap_node_t *node;               // the other end of the translated segment
+    uint32_t sbeg, rbeg, rend;      // the cds_translate() arguments
+    int fill, slen, smax;
+    kstring_t tseq, tref;           // translated haplotype and reference
+}
+tr_memo_t;
 struct _hap_node_t
 {
     char *seq;          // cds segment [parent_node,this_node)
@@ -456,11 +473,13 @@ struct _hap_node_t
     int *cur_child, mcur_child; // mapping from the allele to the currently active child
     csq_t *csq_list;            // list of haplotype's consequences, broken by position
     int ncsq_list, mcsq_list;
+    tr_memo_t *memo;            // translation of the segment ending in this node, shared by all haplotypes passing through
 };
 struct _tscript_t
 {
     uint32_t id;        // transcript id
     uint32_t beg,end;   // transcript's beg and end coordinate (ref strand, 0-based, inclusive)
+    uint32_t vbeg;      // position of the first VCF record in the haplotype tree, the records before can be flushed
     uint32_t strand:1,  // STRAND_REV or STRAND_FWD
              ncds:31,   // number of exons
              mcds;
@@ -489,6 +508,13 @@ typedef struct
 }
 hstack_t;
 typedef struct
+{
+    hap_node_t *node;   // the node of the consequence, node->csq_list[icsq]
+    int icsq;
+    bcf1_t *rec;
+}
+hap_push_t;
+typedef struct
 {
     int mstack;
     hstack_t *stack;
@@ -498,8 +524,19 @@ typedef struct
     kstring_t tref;     // the variable part of translated reference transcript, coding strand
     uint32_t sbeg;      // stack's sbeg, for cases first node's type is HAP_SSS
     int upstream_stop;
+    int defer_push;     // with --tscript-threads, the csq_push() calls are recorded and replayed later
+    hap_push_t *push;
+    int npush, mpush;
+    uint64_t nmemo_hit, nmemo_miss;     // translation cache statistics
 }
 hap_t;
+typedef struct
+{
+    tscript_t *tr;
+    hap_t *hap;         // the hap_t of the worker which processed the transcript
+    int beg, end;       // range of the transcript's deferred csq_push() calls in hap->push
+}
+tr_job_t;
 
 
 /*
@@ -574,9 +611,11 @@ typedef struct _args_t
     smpl_ilist_t *smpl;
 
     char *outdir, **argv, *fa_fname, *gff_fname, *output_fname;
+    char *gff_cache_fname;      // binary cache of the parsed GFF
+    cache_t *gff_cache;         // the cache being written
     char *bcsq_tag;
     int argc, output_type;
-    int phase, quiet, local_csq;
+    int phase, quiet, verbose, local_csq;
     int ncsq_max, nfmt_bcsq;    // maximum number of csq per site that can be accessed from FORMAT/BCSQ
     int ncsq_small_warned;
     
@@ -590,6 +629,15 @@ typedef struct _args_t
     int nrm_tr, mrm_tr;
     csq_t *csq_buf;             // pool of csq not managed by hap_node_t, i.e. non-CDS csqs
     int ncsq_buf, mcsq_buf;
+    int nvbuf_rec, nvbuf_rec_max;   // number of buffered VCF lines and the peak
+    int max_buffered;           // the hard limit of buffered VCF lines, 0 for no limit
+
+    // parallel evaluation of transcript haplotypes, see hap_flush()
+    int tscript_threads;
+    hap_t **tr_hap;             // private hap_t for each worker thread
+    tr_job_t *tr_job;           // transcripts waiting for hap_finalize(), in the order of flushing
+    int ntr_job, mtr_job, itr_job;
+    pthread_mutex_t tr_job_lock;
 
     faidx_t *fai;
     kstring_t str, str2;
@@ -856,6 +904,39 @@ static inline int gff_ignored_biotype(args_t *args, char *ss)
     *se = tmp;
     return 1;
 }
+/*
+    Binary cache of the parsed GFF (--gff-cache). The parser's calls are recorded
+    in the order they were made so that replaying them reconstructs exactly the
+    same transcripts, genes and features without parsing the text again. The
+    stamp covers the size and mtime of the GFF file and sizeof(ftr_t):
+        'G'      .. gene: id, iseq, name
+        'T'      .. transcript: id, gene id, strand, biotype, beg, end
+        'F'      .. feature: ftr_t
+        'E'      .. end: ENSID_FMT, list of sequence names, the ignored biotypes
+                    and their counts
+    The strings are stored with their length, see cache_write_str().
+*/
+#define GFF_CACHE_MAGIC "BCSQGFF\2"
+
+static void gff_cache_write_tscript(args_t *args, uint32_t trid, uint32_t gene_id, tscript_t *tr)
+{
+    uint8_t strand = tr->strand;
+    int32_t biotype = tr->type;
+    cache_write(args->gff_cache, "T", 1);
+    cache_write(args->gff_cache, &trid, sizeof(trid));
+    cache_write(args->gff_cache, &gene_id, sizeof(gene_id));
+    cache_write(args->gff_cache, &strand, sizeof(strand));
+    cache_write(args->gff_cache, &biotype, sizeof(biotype));
+    cache_write(args->gff_cache, &tr->beg, sizeof(tr->beg));
+    cache_write(args->gff_cache, &tr->end, sizeof(tr->end));
+}
+static void gff_cache_write_gene(args_t *args, uint32_t gene_id, gf_gene_t *gene)
+{
+    cache_write(args->gff_cache, "G", 1);
+    cache_write(args->gff_cache, &gene_id, sizeof(gene_id));
+    cache_write(args->gff_cache, &gene->iseq, sizeof(gene->iseq));
+    cache_write_str(args->gff_cache, gene->name);
+}
 gf_gene_t *gene_init(aux_t *aux, uint32_t gene_id)
 {
     khint_t k = kh_get(int2gene, aux->gid2gene, (int)gene_id);
@@ -897,6 +978,8 @@ void gff_parse_transcript(args_t *args, const char *line, char *ss, ftr_t *ftr)
     int ret;
     k = kh_put(int2tscript, aux->id2tr, (int)trid, &ret);
     kh_val(aux->id2tr,k) = tr;
+
+    if ( args->gff_cache ) gff_cache_write_tscript(args, trid, gene_id, tr);
 }
 void gff_parse_gene(args_t *args, const char *line, char *ss, char *chr_beg, char *chr_end, ftr_t *ftr)
 {
@@ -925,6 +1008,8 @@ void gff_parse_gene(args_t *args, const char *line, char *ss, char *chr_beg, cha
     gene->name = (char*) malloc(se-ss+1);
     memcpy(gene->name,ss,se-ss);
     gene->name[se-ss] = 0;
+
+    if ( args->gff_cache ) gff_cache_write_gene(args, gene_id, gene);
 }
 int gff_parse(args_t *args, char *line, ftr_t *ftr)
 {
@@ -1197,6 +1282,98 @@ void tscript_init_cds(args_t *args)
 void regidx_free_gf(void *payload) { free(*((gf_cds_t**)payload)); }
 void regidx_free_tscript(void *payload) { tscript_t *tr = *((tscript_t**)payload); free(tr->cds); free(tr); }
 
+static void gff_cache_close(args_t *args)
+{
+    aux_t *aux = &args->init;
+    cache_t *cache = args->gff_cache;
+    uint32_t i, nseq = aux->nseq, nign = khash_str2int_size(aux->ignored_biotypes);
+    cache_write(cache, "E", 1);
+    cache_write_str(cache, ENSID_FMT);
+    cache_write(cache, &nseq, sizeof(nseq));
+    for (i=0; i<nseq; i++) cache_write_str(cache, aux->seq[i]);
+
+    // the summary of ignored biotypes is printed also when replaying the cache
+    khash_t(str2int) *ign = (khash_t(str2int)*)aux->ignored_biotypes;
+    khint_t k;
+    cache_write(cache, &nign, sizeof(nign));
+    for (k = kh_begin(ign); k < kh_end(ign); k++)
+    {
+        if ( !kh_exist(ign,k) ) continue;
+        int32_t n = kh_value(ign,k);
+        cache_write_str(cache, kh_key(ign,k));
+        cache_write(cache, &n, sizeof(n));
+    }
+    cache_commit(cache);
+    args->gff_cache = NULL;
+}
+// Returns 1 if the cache exists and is up to date with the GFF file, 0 otherwise
+static int gff_cache_load(args_t *args, uint64_t stamp)
+{
+    cache_t *cache = cache_open(args->gff_cache_fname, GFF_CACHE_MAGIC, stamp, args->quiet<2 ? "GFF cache" : NULL);
+    if ( !cache ) return 0;
+
+    aux_t *aux = &args->init;
+    int ret;
+    char type;
+    uint32_t i, id, gene_id, nseq, nign;
+    while ( 1 )
+    {
+        cache_read(cache, &type, 1);
+        if ( type=='E' ) break;
+        if ( type=='F' )
+        {
+            hts_expand(ftr_t, aux->nftr+1, aux->mftr, aux->ftr);
+            cache_read(cache, &aux->ftr[aux->nftr++], sizeof(ftr_t));
+        }
+        else if ( type=='G' )
+        {
+            cache_read(cache, &gene_id, sizeof(gene_id));
+            gf_gene_t *gene = gene_init(aux, gene_id);
+            cache_read(cache, &gene->iseq, sizeof(gene->iseq));
+            gene->name = cache_read_str(cache);
+        }
+        else if ( type=='T' )
+        {
+            uint8_t strand;
+            int32_t biotype;
+            tscript_t *tr = (tscript_t*) calloc(1,sizeof(tscript_t));
+            cache_read(cache, &id, sizeof(id));
+            cache_read(cache, &gene_id, sizeof(gene_id));
+            cache_read(cache, &strand, sizeof(strand));
+            cache_read(cache, &biotype, sizeof(biotype));
+            cache_read(cache, &tr->beg, sizeof(tr->beg));
+            cache_read(cache, &tr->end, sizeof(tr->end));
+            tr->id     = id;
+            tr->strand = strand;
+            tr->type   = biotype;
+            tr->gene   = gene_init(aux, gene_id);
+            khint_t k = kh_put(int2tscript, aux->id2tr, (int)id, &ret);
+            kh_val(aux->id2tr,k) = tr;
+        }
+        else
+            error("Failed to read %s, the file is corrupted?\n", args->gff_cache_fname);
+    }
+    ENSID_FMT = cache_read_str(cache);
+    cache_read(cache, &nseq, sizeof(nseq));
+    for (i=0; i<nseq; i++)
+    {
+        hts_expand(char*, aux->nseq+1, aux->mseq, aux->seq);
+        aux->seq[aux->nseq] = cache_read_str(cache);
+        khash_str2int_inc(aux->seq2int, aux->seq[aux->nseq]);
+        aux->nseq++;
+    }
+    cache_read(cache, &nign, sizeof(nign));
+    for (i=0; i<nign; i++)
+    {
+        int32_t n;
+        char *biotype = cache_read_str(cache);
+        cache_read(cache, &n, sizeof(n));
+        khash_str2int_set(aux->ignored_biotypes, biotype, n);
+    }
+    cache_close(cache);
+    return 1;
+}
+
 void init_gff(args_t *args)
 {
     aux_t *aux = &args->init;
@@ -1206,18 +1383,38 @@ void init_gff(args_t *args)
     args->idx_tscript = regidx_init(NULL, NULL, regidx_free_tscript, sizeof(tscript_t*), NULL);
     aux->ignored_biotypes = khash_str2int_init();
 
-    // parse gff
-    kstring_t str = {0,0,0};
-    htsFile *fp = hts_open(args->gff_fname,"r");
-    if ( !fp ) error("Failed to read %s\n", args->gff_fname);
-    while ( hts_getline(fp, KS_SEP_LINE, &str) > 0 )
+    // parse gff or load the parsed data from the cache
+    uint64_t stamp = 0;
+    if ( args->gff_cache_fname )
     {
-        hts_expand(ftr_t, aux->nftr+1, aux->mftr, aux->ftr);
-        int ret = gff_parse(args, str.s, aux->ftr + aux->nftr);
-        if ( !ret ) aux->nftr++;
+        uint32_t ftr_size = sizeof(ftr_t);
+        struct stat st;
+        if ( stat(args->gff_fname, &st)!=0 ) error("Failed to stat %s: %s\n", args->gff_fname, strerror(errno));
+        stamp = cache_stamp_file(CACHE_STAMP_INIT, args->gff_fname);
+        stamp = cache_stamp(stamp, &ftr_size, sizeof(ftr_size));
+    }
+    if ( !args->gff_cache_fname || !gff_cache_load(args, stamp) )
+    {
+        if ( args->gff_cache_fname ) args->gff_cache = cache_create(args->gff_cache_fname, GFF_CACHE_MAGIC, stamp);
+        kstring_t str = {0,0,0};
+        htsFile *fp = hts_open(args->gff_fname,"r");
+        if ( !fp ) error("Failed to read %s\n", args->gff_fname);
+        while ( hts_getline(fp, KS_SEP_LINE, &str) > 0 )
+        {
+            hts_expand(ftr_t, aux->nftr+1, aux->mftr, aux->ftr);
+            int ret = gff_parse(args, str.s, aux->ftr + aux->nftr);
+            if ( ret ) continue;
+            if ( args->gff_cache )
+            {
+                cache_write(args->gff_cache, "F", 1);
+                cache_write(args->gff_cache, aux->ftr + aux->nftr, sizeof(ftr_t));
+            }
+            aux->nftr++;
+        }
+        free(str.s);
+        if ( hts_close(fp)!=0 ) error("Close failed: %s\n", args->gff_fname);
+        if ( args->gff_cache ) gff_cache_close(args);
     }
-    free(str.s);
-    if ( hts_close(fp)!=0 ) error("Close failed: %s\n", args->gff_fname);
 
 
     // process gff information: connect CDS and exons to transcripts
@@ -1302,6 +1499,17 @@ void init_data(args_t *args)
     args->pos2vbuf  = kh_init(pos2vbuf);
     args->active_tr = khp_init(trhp);
     args->hap = (hap_t*) calloc(1,sizeof(hap_t));
+    if ( args->tscript_threads > 1 )
+    {
+        int i;
+        args->tr_hap = (hap_t**) malloc(sizeof(hap_t*)*args->tscript_threads);
+        for (i=0; i<args->tscript_threads; i++)
+        {
+            args->tr_hap[i] = (hap_t*) calloc(1,sizeof(hap_t));
+            args->tr_hap[i]->defer_push = 1;
+        }
+        pthread_mutex_init(&args->tr_job_lock, NULL);
+    }
 
     // init samples
     if ( !bcf_hdr_nsamples(args->hdr) ) args->phase = PHASE_DROP_GT;
@@ -1400,11 +1608,37 @@ void destroy_data(args_t *args)
     free(args->vcf_buf);
     free(args->rm_tr);
     free(args->csq_buf);
+    if ( args->verbose )
+    {
+        uint64_t nhit = args->hap->nmemo_hit, nmiss = args->hap->nmemo_miss;
+        for (i=0; args->tr_hap && i<args->tscript_threads; i++)
+        {
+            nhit  += args->tr_hap[i]->nmemo_hit;
+            nmiss += args->tr_hap[i]->nmemo_miss;
+        }
+        fprintf(stderr,"Translation cache: %"PRIu64" hits, %"PRIu64" misses\n", nhit, nmiss);
+        fprintf(stderr,"Buffered VCF records: %d at most\n", args->nvbuf_rec_max);
+    }
     free(args->hap->stack);
     free(args->hap->sseq.s);
     free(args->hap->tseq.s);
     free(args->hap->tref.s);
     free(args->hap);
+    if ( args->tr_hap )
+    {
+        for (i=0; i<args->tscript_threads; i++)
+        {
+            free(args->tr_hap[i]->stack);
+            free(args->tr_hap[i]->sseq.s);
+            free(args->tr_hap[i]->tseq.s);
+            free(args->tr_hap[i]->tref.s);
+            free(args->tr_hap[i]->push);
+            free(args->tr_hap[i]);
+        }
+        free(args->tr_hap);
+        pthread_mutex_destroy(&args->tr_job_lock);
+    }
+    free(args->tr_job);
     fai_destroy(args->fai);
     free(args->gt_arr);
     free(args->str.s);
@@ -2151,6 +2385,12 @@ void hap_destroy(hap_node_t *hap)
     free(hap->cur_child);
     free(hap->seq);
     free(hap->var);
+    if ( hap->memo )
+    {
+        free(hap->memo->tseq.s);
+        free(hap->memo->tref.s);
+        free(hap->memo);
+    }
     free(hap);
 }
 
@@ -2503,7 +2743,7 @@ void kput_vcsq(vcsq_t *csq, kstring_t *str)
     if ( csq->type & CSQ_PRINTED_UPSTREAM && csq->ref )
     {
         kputc_('@',str);
-        kputw(csq->ref->pos+1, str);
+        kputw(csq->ref_pos+1, str);
         return;
     }
     if ( csq->type & CSQ_UPSTREAM_STOP )
@@ -2532,6 +2772,22 @@ void kput_vcsq(vcsq_t *csq, kstring_t *str)
         kputs(csq->vstr.s, str);
 }
 
+// Pushes node->csq_list[icsq] to the VCF record, either immediately or, when
+// called from a worker thread, recorded for hap_flush() to replay it in order
+static inline void hap_csq_push(args_t *args, hap_t *hap, hap_node_t *node, int icsq, bcf1_t *rec)
+{
+    if ( !hap->defer_push )
+    {
+        csq_push(args, node->csq_list+icsq, rec);
+        return;
+    }
+    hts_expand(hap_push_t, hap->npush+1, hap->mpush, hap->push);
+    hap_push_t *push = &hap->push[hap->npush++];
+    push->node = node;
+    push->icsq = icsq;
+    push->rec  = rec;
+}
+
 void hap_add_csq(args_t *args, hap_t *hap, hap_node_t *node, int tlen, int ibeg, int iend, int dlen, int indel)
 {
     int i;
@@ -2628,8 +2884,9 @@ void hap_add_csq(args_t *args, hap_t *hap, hap_node_t *node, int tlen, int ibeg,
     {
         node->csq_list[icsq].type.type   |= hap->stack[ibeg].node->csq & ~rm_csq;
         node->csq_list[icsq].type.ref     = hap->stack[ibeg].node->rec;
+        node->csq_list[icsq].type.ref_pos = hap->stack[ibeg].node->rec->pos;
         node->csq_list[icsq].type.biotype = tr->type;
-        csq_push(args, node->csq_list+icsq, hap->stack[ibeg].node->rec);
+        hap_csq_push(args, hap, node, icsq, hap->stack[ibeg].node->rec);
         return;
     }
 
@@ -2659,7 +2916,7 @@ void hap_add_csq(args_t *args, hap_t *hap, hap_node_t *node, int tlen, int ibeg,
         kputs(hap->stack[i].node->var, &str);
     }
     node->csq_list[icsq].type.vstr = str;
-    csq_push(args, node->csq_list+icsq, hap->stack[ref_node].node->rec);
+    hap_csq_push(args, hap, node, icsq, hap->stack[ref_node].node->rec);
 
     for (i=ibeg; i<=iend; i++)
     {
@@ -2678,7 +2935,7 @@ void hap_add_csq(args_t *args, hap_t *hap, hap_node_t *node, int tlen, int ibeg,
             tmp_csq->type.biotype = tr->type;
             tmp_csq->type.vstr.l  = 0;
             kputs(str.s,&tmp_csq->type.vstr);
-            csq_push(args, tmp_csq, hap->stack[i].node->rec);
+            hap_csq_push(args, hap, node, node->ncsq_list - 1, hap->stack[i].node->rec);
         }
         if ( i!=ref_node && (node->csq_list[icsq].type.type & CSQ_COMPOUND || !(hap->stack[i].node->csq & ~CSQ_COMPOUND)) )
         {
@@ -2692,12 +2949,49 @@ void hap_add_csq(args_t *args, hap_t *hap, hap_node_t *node, int tlen, int ibeg,
             tmp_csq->type.type    = CSQ_PRINTED_UPSTREAM | hap->stack[i].node->csq;
             tmp_csq->type.biotype = tr->type;
             tmp_csq->type.ref     = hap->stack[ref_node].node->rec;
+            tmp_csq->type.ref_pos = hap->stack[ref_node].node->rec->pos;
             tmp_csq->type.vstr.l  = 0;
-            csq_push(args, tmp_csq, hap->stack[i].node->rec);
+            hap_csq_push(args, hap, node, node->ncsq_list - 1, hap->stack[i].node->rec);
         }
     }
 }
 
+/*
+    Haplotypes which share a part of the tree also share the translated
+    segments. The translation of a segment is fully determined by the path
+    from the root to the segment's deeper node and by the arguments of
+    cds_translate(), therefore it is stored in that node and reused by other
+    haplotypes passing through it.
+*/
+static inline int hap_memo_get(hap_t *hap, hap_node_t *deep, hap_node_t *shallow, uint32_t sbeg, uint32_t rbeg, uint32_t rend, int fill, kstring_t *sseq)
+{
+    tr_memo_t *memo = deep->memo;
+    if ( !memo || memo->node!=shallow || memo->sbeg!=sbeg || memo->rbeg!=rbeg || memo->rend!=rend
+        || memo->fill!=fill || memo->slen!=sseq->l || memo->smax!=sseq->m )
+    {
+        hap->nmemo_miss++;
+        return 0;
+    }
+    hap->tseq.l = 0; kputsn(memo->tseq.s, memo->tseq.l, &hap->tseq);
+    hap->tref.l = 0; kputsn(memo->tref.s, memo->tref.l, &hap->tref);
+    hap->nmemo_hit++;
+    return 1;
+}
+static inline void hap_memo_set(hap_t *hap, hap_node_t *deep, hap_node_t *shallow, uint32_t sbeg, uint32_t rbeg, uint32_t rend, int fill, kstring_t *sseq)
+{
+    if ( !deep->memo ) deep->memo = (tr_memo_t*) calloc(1,sizeof(tr_memo_t));
+    tr_memo_t *memo = deep->memo;
+    memo->node = shallow;
+    memo->sbeg = sbeg;
+    memo->rbeg = rbeg;
+    memo->rend = rend;
+    memo->fill = fill;
+    memo->slen = sseq->l;
+    memo->smax = sseq->m;
+    memo->tseq.l = 0; kputsn(hap->tseq.s, hap->tseq.l, &memo->tseq);
+    memo->tref.l = 0; kputsn(hap->tref.s, hap->tref.l, &memo->tref);
+}
+
 void hap_finalize(args_t *args, hap_t *hap)
 {
     tscript_t *tr = hap->tr;
@@ -2800,14 +3094,20 @@ void hap_finalize(args_t *args, hap_t *hap)
                 }
                 else    // splice site overlap, see #1475227917
                     sseq.l = fill = 0;
-                cds_translate(&sref, &sseq, icur,rbeg,rend, tr->strand, &hap->tseq, fill);
+                if ( !hap_memo_get(hap, hap->stack[i].node, hap->stack[ibeg].node, icur,rbeg,rend, fill, &sseq) )
+                {
+                    kstring_t alt = sseq;
+                    cds_translate(&sref, &sseq, icur,rbeg,rend, tr->strand, &hap->tseq, fill);
 
-                // ref
-                sseq.l = node2rend(i) - rbeg;
-                sseq.s = sref.s + N_REF_PAD + rbeg;
-                sseq.m = sref.m - 2*N_REF_PAD;
-                cds_translate(&sref, &sseq, rbeg,rbeg,rend, tr->strand, &hap->tref, fill);
-                sseq.m = sref.m - 2*N_REF_PAD + hap->stack[istack].dlen;
+                    // ref
+                    sseq.l = node2rend(i) - rbeg;
+                    sseq.s = sref.s + N_REF_PAD + rbeg;
+                    sseq.m = sref.m - 2*N_REF_PAD;
+                    cds_translate(&sref, &sseq, rbeg,rbeg,rend, tr->strand, &hap->tref, fill);
+                    sseq.m = sref.m - 2*N_REF_PAD + hap->stack[istack].dlen;
+
+                    hap_memo_set(hap, hap->stack[i].node, hap->stack[ibeg].node, icur,rbeg,rend, fill, &alt);
+                }
 
                 hap_add_csq(args,hap,node,0, ibeg,i,dlen,indel);
                 ibeg = -1;
@@ -2857,14 +3157,20 @@ void hap_finalize(args_t *args, hap_t *hap)
                 }
                 else    // splice site overlap, see #1475227917
                     sseq.l = fill = 0;
-                cds_translate(&sref, &sseq, icur,rbeg,rend, tr->strand, &hap->tseq, fill);
+                if ( !hap_memo_get(hap, hap->stack[ibeg].node, hap->stack[i].node, icur,rbeg,rend, fill, &sseq) )
+                {
+                    kstring_t alt = sseq;
+                    cds_translate(&sref, &sseq, icur,rbeg,rend, tr->strand, &hap->tseq, fill);
 
-                // ref
-                sseq.l = node2rend(ibeg) - rbeg;
-                sseq.s = sref.s + N_REF_PAD + rbeg;
-                sseq.m = sref.m - 2*N_REF_PAD;
-                cds_translate(&sref, &sseq, rbeg,rbeg,rend, tr->strand, &hap->tref, fill);
-                sseq.m = sref.m - 2*N_REF_PAD + hap->stack[istack].dlen;
+                    // ref
+                    sseq.l = node2rend(ibeg) - rbeg;
+                    sseq.s = sref.s + N_REF_PAD + rbeg;
+                    sseq.m = sref.m - 2*N_REF_PAD;
+                    cds_translate(&sref, &sseq, rbeg,rbeg,rend, tr->strand, &hap->tref, fill);
+                    sseq.m = sref.m - 2*N_REF_PAD + hap->stack[istack].dlen;
+
+                    hap_memo_set(hap, hap->stack[ibeg].node, hap->stack[i].node, icur,rbeg,rend, fill, &alt);
+                }
 
                 hap_add_csq(args,hap,node,sseq.m, i,ibeg,dlen,indel);
                 ibeg = -1;
@@ -2949,49 +3255,136 @@ static inline void hap_stage_vcf(args_t *args, tscript_t *tr, int ismpl, int iha
     }
 }
 
-void hap_flush(args_t *args, uint32_t pos)
+static void hap_output(args_t *args, tscript_t *tr)
 {
     int i,j;
-    tr_heap_t *heap = args->active_tr;
-
-    while ( heap->ndat && heap->dat[0]->end<=pos )
+    if ( tr->root && tr->root->nchild ) // normal, non-localized calling
     {
-        tscript_t *tr = heap->dat[0];
-        khp_delete(trhp, heap);
-
-        args->hap->tr = tr;
-        if ( tr->root && tr->root->nchild ) // normal, non-localized calling
+        if ( args->output_type==FT_TAB_TEXT )   // plain text output, not a vcf
         {
-            hap_finalize(args, args->hap);
-
-            if ( args->output_type==FT_TAB_TEXT )   // plain text output, not a vcf
-            {
-                if ( args->phase==PHASE_DROP_GT )
-                    hap_print_text(args, tr, -1,0, tr->hap[0]);
-                else
-                {
-                    for (i=0; i<args->smpl->n; i++)
-                    {
-                        for (j=0; j<2; j++)
-                            hap_print_text(args, tr, args->smpl->idx[i],j+1, tr->hap[i*2+j]);
-                    }
-                }
-            }
-            else if ( args->phase!=PHASE_DROP_GT )
+            if ( args->phase==PHASE_DROP_GT )
+                hap_print_text(args, tr, -1,0, tr->hap[0]);
+            else
             {
                 for (i=0; i<args->smpl->n; i++)
                 {
                     for (j=0; j<2; j++)
-                        hap_stage_vcf(args, tr, args->smpl->idx[i],j, tr->hap[i*2+j]);
+                        hap_print_text(args, tr, args->smpl->idx[i],j+1, tr->hap[i*2+j]);
                 }
             }
         }
+        else if ( args->phase!=PHASE_DROP_GT )
+        {
+            for (i=0; i<args->smpl->n; i++)
+            {
+                for (j=0; j<2; j++)
+                    hap_stage_vcf(args, tr, args->smpl->idx[i],j, tr->hap[i*2+j]);
+            }
+        }
+    }
 
-        // mark the transcript for deletion. Cannot delete it immediately because
-        // by-position VCF output will need them when flushed by vcf_buf_push
-        args->nrm_tr++;
-        hts_expand(tscript_t*,args->nrm_tr,args->mrm_tr,args->rm_tr);
-        args->rm_tr[args->nrm_tr-1] = tr;
+    // mark the transcript for deletion. Cannot delete it immediately because
+    // by-position VCF output will need them when flushed by vcf_buf_push
+    args->nrm_tr++;
+    hts_expand(tscript_t*,args->nrm_tr,args->mrm_tr,args->rm_tr);
+    args->rm_tr[args->nrm_tr-1] = tr;
+}
+
+typedef struct
+{
+    args_t *args;
+    hap_t *hap;
+}
+tr_worker_t;
+
+static void *tscript_worker(void *arg)
+{
+    tr_worker_t *worker = (tr_worker_t*) arg;
+    args_t *args = worker->args;
+    hap_t *hap = worker->hap;
+    while (1)
+    {
+        pthread_mutex_lock(&args->tr_job_lock);
+        int i = args->itr_job++;
+        pthread_mutex_unlock(&args->tr_job_lock);
+        if ( i >= args->ntr_job ) break;
+
+        tr_job_t *job = &args->tr_job[i];
+        job->hap = hap;
+        job->beg = hap->npush;
+        hap->tr  = job->tr;
+        if ( job->tr->root && job->tr->root->nchild ) hap_finalize(args, hap);
+        job->end = hap->npush;
+    }
+    return NULL;
+}
+
+// Transcripts are independent of each other, so the haplotype trees of all
+// waiting transcripts are finalized in parallel. The csq_push() calls, which
+// modify the shared VCF buffer, are replayed afterwards in the original order
+// so that the output is identical to the single-threaded run.
+static void hap_finalize_threaded(args_t *args)
+{
+    int i, j, nthreads = args->tscript_threads;
+    if ( nthreads > args->ntr_job ) nthreads = args->ntr_job;
+
+    tr_worker_t *workers = (tr_worker_t*) malloc(sizeof(tr_worker_t)*nthreads);
+    pthread_t *tid = (pthread_t*) malloc(sizeof(pthread_t)*nthreads);
+    args->itr_job = 0;
+    for (i=0; i<nthreads; i++)
+    {
+        workers[i].args = args;
+        workers[i].hap  = args->tr_hap[i];
+        workers[i].hap->npush = 0;
+        if ( i && pthread_create(&tid[i], NULL, tscript_worker, &workers[i]) ) error("Failed to create threads\n");
+    }
+    tscript_worker(&workers[0]);
+    for (i=1; i<nthreads; i++) pthread_join(tid[i], NULL);
+    free(workers);
+    free(tid);
+
+    for (i=0; i<args->ntr_job; i++)
+    {
+        tr_job_t *job = &args->tr_job[i];
+        for (j=job->beg; j<job->end; j++)
+        {
+            hap_push_t *push = &job->hap->push[j];
+            csq_push(args, push->node->csq_list + push->icsq, push->rec);
+        }
+        hap_output(args, job->tr);
+    }
+    args->ntr_job = 0;
+}
+
+void hap_flush(args_t *args, uint32_t pos)
+{
+    tr_heap_t *heap = args->active_tr;
+
+    if ( args->tscript_threads > 1 )
+    {
+        while ( heap->ndat && heap->dat[0]->end<=pos )
+        {
+            args->ntr_job++;
+            hts_expand(tr_job_t,args->ntr_job,args->mtr_job,args->tr_job);
+            args->tr_job[args->ntr_job-1].tr = heap->dat[0];
+            khp_delete(trhp, heap);
+        }
+
+        // The buffered VCF lines cannot be flushed while there are active transcripts,
+        // therefore the finished transcripts can wait and be processed in larger batches
+        if ( args->ntr_job && (!heap->ndat || args->ntr_job >= TSCRIPT_BATCH) )
+            hap_finalize_threaded(args);
+        return;
+    }
+
+    while ( heap->ndat && heap->dat[0]->end<=pos )
+    {
+        tscript_t *tr = heap->dat[0];
+        khp_delete(trhp, heap);
+
+        args->hap->tr = tr;
+        if ( tr->root && tr->root->nchild ) hap_finalize(args, args->hap);
+        hap_output(args, tr);
     }
 }
 
@@ -3032,16 +3425,39 @@ void vbuf_push(args_t *args, bcf1_t **rec_ptr)
     int ret;
     khint_t k = kh_put(pos2vbuf, args->pos2vbuf, (int)rec->pos, &ret);
     kh_val(args->pos2vbuf,k) = vbuf;
+
+    if ( ++args->nvbuf_rec > args->nvbuf_rec_max ) args->nvbuf_rec_max = args->nvbuf_rec;
+}
+
+/*
+ *  The buffered VCF lines can be flushed up to the first record of the
+ *  haplotype trees of the transcripts not yet finalized, either active or
+ *  waiting for hap_finalize_threaded(). A transcript that is finalized can
+ *  be destroyed once all lines up to its end are flushed, as their
+ *  consequences point into its tree.
+ */
+static uint32_t vbuf_flush_end(args_t *args)
+{
+    uint32_t end = REGIDX_MAX;
+    int i;
+    for (i=0; i<args->active_tr->ndat; i++)
+        if ( end > args->active_tr->dat[i]->vbeg ) end = args->active_tr->dat[i]->vbeg;
+    for (i=0; i<args->ntr_job; i++)
+        if ( end > args->tr_job[i].tr->vbeg ) end = args->tr_job[i].tr->vbeg;
+    return end;
 }
 
 void vbuf_flush(args_t *args)
 {
-    if ( args->active_tr->ndat ) return; // cannot output buffered VCF lines (args.vbuf) until all active transcripts are gone
+    uint32_t flush_end = vbuf_flush_end(args);
 
     int i,j;
-    while ( (i=rbuf_shift(&args->vcf_rbuf))>=0 )
+    while ( args->vcf_rbuf.n )
     {
-        vbuf_t *vbuf = args->vcf_buf[i];
+        vbuf_t *vbuf = args->vcf_buf[rbuf_kth(&args->vcf_rbuf,0)];
+        if ( vbuf->n && vbuf->vrec[0]->line->pos >= flush_end ) break;
+        rbuf_shift(&args->vcf_rbuf);
+        args->nvbuf_rec -= vbuf->n;
         for (i=0; i<vbuf->n; i++)
         {
             vrec_t *vrec = vbuf->vrec[i];
@@ -3052,7 +3468,9 @@ void vbuf_flush(args_t *args)
             }
             if ( !vrec->nvcsq )
             {
+                uint64_t t0 = profile_begin();
                 bcf_write(args->out_fh, args->hdr, vrec->line);
+                profile_end_bytes(PROF_WRITE, t0, profile_rec_size(vrec->line));
                 continue;
             }
             
@@ -3071,7 +3489,9 @@ void vbuf_flush(args_t *args)
                 bcf_update_format_int32(args->hdr, vrec->line, args->bcsq_tag, vrec->smpl, args->hdr_nsmpl*vrec->nfmt);
             }
             vrec->nvcsq = 0;
+            uint64_t t0 = profile_begin();
             bcf_write(args->out_fh, args->hdr, vrec->line);
+            profile_end_bytes(PROF_WRITE, t0, profile_rec_size(vrec->line));
         }
         if ( vbuf->n )
         {
@@ -3081,17 +3501,29 @@ void vbuf_flush(args_t *args)
         vbuf->n = 0;
     }
 
-    for (i=0; i<args->nrm_tr; i++)
+    // the first buffered position, the transcripts which end before it are no longer needed
+    uint32_t buf_beg = args->vcf_rbuf.n ? args->vcf_buf[rbuf_kth(&args->vcf_rbuf,0)]->vrec[0]->line->pos : REGIDX_MAX;
+    for (i=0,j=0; i<args->nrm_tr; i++)
     {
         tscript_t *tr = args->rm_tr[i];
+        if ( tr->end >= buf_beg ) { args->rm_tr[j++] = tr; continue; }
         if ( tr->root ) hap_destroy(tr->root);
         tr->root = NULL;
         free(tr->hap);
         free(tr->ref);
         free(tr->sref);
     }
-    args->nrm_tr = 0;
-    args->ncsq_buf = 0;
+    args->nrm_tr = j;
+    if ( !args->vcf_rbuf.n ) args->ncsq_buf = 0;
+
+    if ( args->max_buffered && args->nvbuf_rec > args->max_buffered )
+    {
+        // the waiting transcripts can be finalized early to free the buffer
+        if ( args->ntr_job ) { hap_finalize_threaded(args); vbuf_flush(args); return; }
+        bcf1_t *rec = args->vcf_buf[rbuf_kth(&args->vcf_rbuf,0)]->vrec[0]->line;
+        error("More than %d VCF lines buffered from %s:%d, waiting for the overlapping transcripts to end. "
+              "Increase --max-buffered or use --local-csq\n", args->max_buffered, bcf_seqname(args->hdr,rec),rec->pos+1);
+    }
 }
 
 void tscript_init_ref(args_t *args, tscript_t *tr, const char *chr)
@@ -3152,6 +3584,7 @@ int test_cds_local(args_t *args, bcf1_t *rec)
         {
             tscript_init_ref(args, tr, chr);
             tscript_splice_ref(tr);
+            tr->vbeg = REGIDX_MAX;  // the consequences are pushed immediately, nothing to wait for
             khp_insert(trhp, args->active_tr, &tr);     // only to clean the reference afterwards
         }
 
@@ -3322,6 +3755,7 @@ int test_cds(args_t *args, bcf1_t *rec)
             for (i=0; i<tr->nhap; i++) tr->hap[i] = NULL;
             tr->root->nend = tr->nhap;
             tr->root->type = HAP_ROOT;
+            tr->vbeg = rec->pos;
 
             khp_insert(trhp, args->active_tr, &tr);
         }
@@ -3678,8 +4112,11 @@ const char *usage(void)
         "\n"
         "CSQ options:\n"
         "   -c, --custom-tag <string>       use this tag instead of the default BCSQ\n"
+        "       --gff-cache <file>          binary cache of the parsed gff3, created or refreshed when missing or outdated\n"
         "   -l, --local-csq                 localized predictions, consider only one VCF record at a time\n"
+        "       --max-buffered <int>        exit with an error if more VCF records must be buffered for overlapping transcripts [0=no limit]\n"
         "   -n, --ncsq <int>                maximum number of consequences to consider per site [16]\n"
+        "       --tscript-threads <int>     number of threads to evaluate the haplotypes of transcripts in parallel [0]\n"
         "   -p, --phase <a|m|r|R|s>         how to construct haplotypes and how to deal with unphased data: [r]\n"
         "                                     a: take GTs as is, create haplotypes regardless of phase (0/1 -> 0|1)\n"
         "                                     m: merge *all* GTs into a single haplotype (0/1 -> 1, 1/2 -> 1)\n"
@@ -3699,6 +4136,7 @@ const char *usage(void)
         "   -S, --samples-file <file>       samples to include\n"
         "   -t, --targets <region>          similar to -r but streams rather than index-jumps\n"
         "   -T, --targets-file <file>       similar to -R but streams rather than index-jumps\n"
+        "   -v, --verbose                   print translation cache and buffer statistics on exit\n"
         "\n"
         "Example:\n"
         "   bcftools csq -f hs37d5.fa -g Homo_sapiens.GRCh37.82.gff3.gz in.vcf\n"
@@ -3724,6 +4162,9 @@ int main_csq(int argc, char *argv[])
         {"custom-tag",1,0,'c'},
         {"local-csq",0,0,'l'},
         {"gff-annot",1,0,'g'},
+        {"gff-cache",1,0,1},
+        {"tscript-threads",1,0,2},
+        {"max-buffered",1,0,3},
         {"fasta-ref",1,0,'f'},
         {"include",1,0,'i'},
         {"exclude",1,0,'e'},
@@ -3737,17 +4178,19 @@ int main_csq(int argc, char *argv[])
         {"samples-file",1,0,'S'},
         {"targets",1,0,'t'},
         {"targets-file",1,0,'T'},
+        {"verbose",0,0,'v'},
         {0,0,0,0}
     };
     int c, targets_is_file = 0, regions_is_file = 0; 
-    char *targets_list = NULL, *regions_list = NULL;
-    while ((c = getopt_long(argc, argv, "?hr:R:t:T:i:e:f:o:O:g:s:S:p:qc:ln:",loptions,NULL)) >= 0)
+    char *targets_list = NULL, *regions_list = NULL, *tmp;
+    while ((c = getopt_long(argc, argv, "?hr:R:t:T:i:e:f:o:O:g:s:S:p:qc:ln:v",loptions,NULL)) >= 0)
     {
         switch (c) 
         {
             case 'l': args->local_csq = 1; break;
             case 'c': args->bcsq_tag = optarg; break;
             case 'q': args->quiet++; break;
+            case 'v': args->verbose = 1; break;
             case 'p':
                 switch (optarg[0]) 
                 {
@@ -3761,6 +4204,15 @@ int main_csq(int argc, char *argv[])
                 break;
             case 'f': args->fa_fname = optarg; break;
             case 'g': args->gff_fname = optarg; break;
+            case  1 : args->gff_cache_fname = optarg; break;
+            case  2 :
+                args->tscript_threads = strtol(optarg,&tmp,10);
+                if ( *tmp || args->tscript_threads<0 ) error("Could not parse argument: --tscript-threads %s\n", optarg);
+                break;
+            case  3 :
+                args->max_buffered = strtol(optarg,&tmp,10);
+                if ( *tmp || args->max_buffered<0 ) error("Could not parse argument: --max-buffered %s\n", optarg);
+                break;
             case 'n': 
                 args->ncsq_max = 2 * atoi(optarg);
                 if ( args->ncsq_max <=0 ) error("Expected positive integer with -n, got %s\n", optarg);
@@ -3809,9 +4261,11 @@ int main_csq(int argc, char *argv[])
     args->hdr = bcf_sr_get_header(args->sr,0);
 
     init_data(args);
-    while ( bcf_sr_next_line(args->sr) )
+    while ( profile_sr_next_line(args->sr) )
     {
+        uint64_t t0 = profile_begin();
         process(args, &args->sr->readers[0].buffer[0]);
+        profile_end(PROF_CSQ, t0);
     }
     process(args,NULL);
 
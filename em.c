@@ -101,17 +101,51 @@ static double freq_iter(double *f, const double *_pdg, int beg, int end)
     return err;
 }
 
+/* SQUAREM acceleration of the EM iterations (Varadhan and Roland, 2008): from
+ * x and two EM steps x1 and x2, extrapolate along r=x1-x with the curvature
+ * v=x2-2*x1+x to x-2*a*r+a*a*v, where a=-|r|/|v|. The caller stabilizes the
+ * result with one more EM step. With a=-1 the point is x2, which is also used
+ * when the extrapolation leaves the parameter space (0,1).
+ */
+static void squarem(int n, double *x, const double *x1, const double *x2)
+{
+    double r, v, r2 = 0., v2 = 0., a, y[3];
+    int k;
+    for (k = 0; k < n; ++k) {
+        r = x1[k] - x[k]; v = x2[k] - x1[k] - r;
+        r2 += r * r; v2 += v * v;
+    }
+    a = v2 > 0.? -sqrt(r2 / v2) : -1.;
+    if (a > -1.) a = -1.;
+    for (k = 0; k < n; ++k) {
+        r = x1[k] - x[k]; v = x2[k] - x1[k] - r;
+        y[k] = x[k] - 2. * a * r + a * a * v;
+        if (y[k] <= 0. || y[k] >= 1.) break;
+    }
+    memcpy(x, k < n? x2 : y, n * sizeof(double));
+}
+
 /* The following function combines EM and Brent's method. When the signal from
  * the data is strong, EM is faster but sometimes, EM may converge very slowly.
  * When this happens, we switch to Brent's method. The idea is learned from
- * Rasmus Nielsen.
+ * Rasmus Nielsen. The EM steps are accelerated by SQUAREM, Brent's method is
+ * needed only when that fails to converge too.
  */
 static double freqml(double f0, int beg, int end, const double *pdg)
 {
     int i;
-    double f;
-    for (i = 0, f = f0; i < ITER_TRY; ++i)
-        if (freq_iter(&f, pdg, beg, end) < EPS) break;
+    double f, f1, f2, fprev;
+    for (i = 0, f = f0; i < ITER_TRY; ++i) {
+        // converged when a whole cycle moves less than EPS: near the boundary
+        // single EM steps are small already far from the maximum
+        fprev = f1 = f;
+        if (freq_iter(&f1, pdg, beg, end) == 0.) { f = f1; break; }
+        f2 = f1;
+        freq_iter(&f2, pdg, beg, end);
+        squarem(1, &f, &f1, &f2);
+        freq_iter(&f, pdg, beg, end);
+        if (fabs(f - fprev) < EPS) break;
+    }
     if (i == ITER_TRY) { // haven't converged yet; try Brent's method
         minaux1_t a;
         a.beg = beg; a.end = end; a.pdg = pdg;
@@ -140,6 +174,26 @@ static double g3_iter(double g[3], const double *_pdg, int beg, int end)
     return err;
 }
 
+// EM estimate of the genotype frequency with SQUAREM steps, at most ITER_MAX
+// iterations of g3_iter()
+static void g3_em(double g[3], const double *pdg, int beg, int end)
+{
+    double g0[3], g1[3], g2[3], err;
+    int i, k;
+    for (i = 0; i < ITER_MAX; i += 3) {
+        memcpy(g0, g, sizeof(g0));
+        memcpy(g1, g, sizeof(g1));
+        if (g3_iter(g1, pdg, beg, end) == 0.) { memcpy(g, g1, sizeof(g1)); break; }
+        memcpy(g2, g1, sizeof(g2));
+        g3_iter(g2, pdg, beg, end);
+        squarem(3, g, g1, g2);
+        g3_iter(g, pdg, beg, end);
+        for (k = 0, err = 0.; k < 3; ++k)
+            if (err < fabs(g[k] - g0[k])) err = fabs(g[k] - g0[k]);
+        if (err < EPS) break;   // a whole cycle, as in freqml()
+    }
+}
+
 // perform likelihood ratio test
 static double lk_ratio_test(int n, int n1, const double *pdg, double f3[3][3])
 {
@@ -186,8 +240,7 @@ int bcf_em1(call_t *call, const bcf1_t *rec, int n1, int flag, double x[10])
         f3[0] = g[0] = (1 - x[0]) * (1 - x[0]);
         f3[1] = g[1] = 2 * x[0] * (1 - x[0]);
         f3[2] = g[2] = x[0] * x[0];
-        for (i = 0; i < ITER_MAX; ++i)
-            if (g3_iter(g, pdg, 0, n) < EPS) break;
+        g3_em(g, pdg, 0, n);
         // Hardy-Weinberg equilibrium (HWE)
         for (i = 0, r = 1.; i < n; ++i) {
             double *p = pdg + i * 3;
@@ -211,10 +264,8 @@ int bcf_em1(call_t *call, const bcf1_t *rec, int n1, int flag, double x[10])
     if ((flag & 3<<8) && n1 > 0 && n1 < n) { // 2-degree P-value
         double g[3][3], tmp;
         for (i = 0; i < 3; ++i) memcpy(g[i], x + 1, 3 * sizeof(double));
-        for (i = 0; i < ITER_MAX; ++i)
-            if (g3_iter(g[1], pdg, 0, n1) < EPS) break;
-        for (i = 0; i < ITER_MAX; ++i)
-            if (g3_iter(g[2], pdg, n1, n) < EPS) break;
+        g3_em(g[1], pdg, 0, n1);
+        g3_em(g[2], pdg, n1, n);
         tmp = log(lk_ratio_test(n, n1, pdg, g));
         if (tmp < 0) tmp = 0;
         x[8] = kf_gammaq(1., tmp);
@@ -32,6 +32,8 @@ THE SOFTWARE.  */
 #include <htslib/khash_str2int.h>
 #include "filter.h"
 #include "bcftools.h"
+#include "gtcount.h"
+#include "profile.h"
 #include <htslib/hts_defs.h>
 #include <htslib/vcfutils.h>
 
@@ -72,6 +74,17 @@ typedef struct _token_t
     int (*comparator)(struct _token_t *, struct _token_t *, int op_type, bcf1_t *);
     void *hash;         // test presence of str value in the hash via comparator
     regex_t *regex;     // precompiled regex for string comparison
+    char *literal;      // set instead of regex when the pattern has no metacharacters
+    int nliteral, icase;
+    void *regex_cache;  // string -> regexec() result of repeated values, see regex_match()
+    int nregex_cache;
+    kstring_t regex_str;
+    int ifield;         // 1-based index to filter->fields if the fetched values are shared with other tokens, 0 otherwise
+    char *bcsq_type;    // TBCSQ: the consequence type to test for, a substring with bcsq_like set
+    int bcsq_like;
+    char *bcsq_info;    // TBCSQ: INFO/BCSQ and the FMT/BCSQ bits of the matching consequences
+    uint32_t *bcsq_mask;
+    int mbcsq_info, mbcsq_mask;
 
     // modified on filter evaluation at each VCF line
     double *values;     // In case str_value is set, values[0] is one sample's string length
@@ -85,6 +98,31 @@ typedef struct _token_t
 }
 token_t;
 
+// Site-level expressions which do not need the per-sample or string machinery
+// of the generic token stack are compiled once in filter_init() into a flat
+// program of these instructions, see filter_compile() and filter_test_prog()
+typedef struct
+{
+    int op;             // one of the OP_* codes below
+    int jump;           // OP_AND, OP_OR: where to continue when the result is known from the left operand
+    double value;       // OP_CONST: the constant, possibly folded from a subexpression
+    token_t *tok;       // OP_LOAD, OP_FILTER_EQ, OP_FILTER_NE: the token to evaluate
+}
+inst_t;
+
+// Values fetched from the record once per filter_test() when the same field is
+// referenced by more than one token, e.g. "FMT/DP>10 && FMT/DP<100" or
+// "AC>1 && AF<0.5", see filter_init_fields()
+typedef struct
+{
+    void (*setter)(filter_t *, bcf1_t *, struct _token_t *);
+    int hdr_id;
+    uint64_t nrec;      // valid if equal to filter->nrec
+    int n, m;           // the number of values or the return status, allocated size
+    void *dat;
+}
+field_t;
+
 struct _filter_t
 {
     bcf_hdr_t *hdr;
@@ -94,6 +132,12 @@ struct _filter_t
     int32_t *tmpi;
     float   *tmpf;
     int max_unpack, mtmpi, mtmpf, nsamples;
+    inst_t *prog;                   // compiled program, NULL if the expression must be interpreted
+    int nprog;
+    double *prog_stack;
+    field_t *fields;                // the fetched values of fields referenced by more than one token
+    int nfields;
+    uint64_t nrec;                  // incremented with each filter_test(), invalidates the fields
 };
 
 
@@ -499,10 +543,37 @@ static void filters_set_info_flag(filter_t *flt, bcf1_t *line, token_t *tok)
     tok->nvalues = 1;
 }
 
+// bcf_get_format_int32() or bcf_get_format_float(), the values are fetched once
+// per record for all tokens sharing the field
+static int filters_get_format(filter_t *flt, bcf1_t *line, token_t *tok, int type, void **dst)
+{
+    if ( !tok->ifield )
+    {
+        if ( type==BCF_HT_INT )
+        {
+            int ret = bcf_get_format_int32(flt->hdr,line,tok->tag,&flt->tmpi,&flt->mtmpi);
+            *dst = flt->tmpi;
+            return ret;
+        }
+        int ret = bcf_get_format_float(flt->hdr,line,tok->tag,&flt->tmpf,&flt->mtmpf);
+        *dst = flt->tmpf;
+        return ret;
+    }
+    field_t *field = &flt->fields[tok->ifield-1];
+    if ( field->nrec!=flt->nrec )
+    {
+        field->n = bcf_get_format_values(flt->hdr,line,tok->tag,&field->dat,&field->m,type);
+        field->nrec = flt->nrec;
+    }
+    *dst = field->dat;
+    return field->n;
+}
+
 static void filters_set_format_int(filter_t *flt, bcf1_t *line, token_t *tok)
 {
     int i;
-    if ( (tok->nvalues=bcf_get_format_int32(flt->hdr,line,tok->tag,&flt->tmpi,&flt->mtmpi))<0 )
+    int32_t *src;
+    if ( (tok->nvalues=filters_get_format(flt,line,tok,BCF_HT_INT,(void**)&src))<0 )
         tok->nvalues = 0;
     else
     {
@@ -510,11 +581,11 @@ static void filters_set_format_int(filter_t *flt, bcf1_t *line, token_t *tok)
         hts_expand(double,tok->nvalues,tok->mvalues,tok->values);
         for (i=0; i<tok->nvalues; i++)
         {
-            if ( flt->tmpi[i]==bcf_int32_missing || flt->tmpi[i]==bcf_int32_vector_end )
+            if ( src[i]==bcf_int32_missing || src[i]==bcf_int32_vector_end )
                 bcf_double_set_missing(tok->values[i]);
             else
             {
-                tok->values[i] = flt->tmpi[i];
+                tok->values[i] = src[i];
                 is_missing = 0;
             }
         }
@@ -538,7 +609,8 @@ static void filters_set_format_int(filter_t *flt, bcf1_t *line, token_t *tok)
 static void filters_set_format_float(filter_t *flt, bcf1_t *line, token_t *tok)
 {
     int i;
-    if ( (tok->nvalues=bcf_get_format_float(flt->hdr,line,tok->tag,&flt->tmpf,&flt->mtmpf))<=0 )
+    float *src;
+    if ( (tok->nvalues=filters_get_format(flt,line,tok,BCF_HT_REAL,(void**)&src))<=0 )
     {
         tok->nvalues = tok->nsamples = 0;   // missing values
     }
@@ -548,11 +620,11 @@ static void filters_set_format_float(filter_t *flt, bcf1_t *line, token_t *tok)
         hts_expand(double,tok->nvalues,tok->mvalues,tok->values);
         for (i=0; i<tok->nvalues; i++)
         {
-            if ( bcf_float_is_missing(flt->tmpf[i]) || bcf_float_is_vector_end(flt->tmpf[i]) )
+            if ( bcf_float_is_missing(src[i]) || bcf_float_is_vector_end(src[i]) )
                 bcf_double_set_missing(tok->values[i]);
             else
             {
-                tok->values[i] = flt->tmpf[i];
+                tok->values[i] = src[i];
                 is_missing = 0;
             }
         }
@@ -698,6 +770,79 @@ static void filters_set_alt_string(filter_t *flt, bcf1_t *line, token_t *tok)
     tok->values[0] = str.m;
     tok->str_value = str.s;
 }
+// TBCSQ: does the consequence type, e.g. "missense&inframe_altering", match tok->bcsq_type?
+static int tbcsq_match(token_t *tok, char *beg, char *end)
+{
+    if ( tok->bcsq_like )
+    {
+        char tmp = *end;
+        *end = 0;
+        int ret = strstr(beg, tok->bcsq_type) ? 1 : 0;
+        *end = tmp;
+        return ret;
+    }
+    int len = strlen(tok->bcsq_type);
+    while ( beg < end )
+    {
+        char *ss = beg;
+        while ( ss < end && *ss!='&' ) ss++;
+        if ( ss - beg == len && !strncmp(beg, tok->bcsq_type, len) ) return 1;
+        beg = ss + 1;
+    }
+    return 0;
+}
+// TBCSQ: 1 for samples with a consequence of the type tok->bcsq_type, 0 otherwise. The
+// INFO/BCSQ string is matched once per record and the samples are tested with the
+// FMT/BCSQ bitmask, two bits (one per haplotype) for each consequence
+static void filters_set_tbcsq(filter_t *flt, bcf1_t *line, token_t *tok)
+{
+    tok->nvalues = tok->nsamples = 0;
+    bcf_fmt_t *fmt = bcf_get_fmt(flt->hdr, line, "BCSQ");
+    if ( !fmt || !line->n_sample ) return;
+    if ( bcf_get_info_string(flt->hdr, line, "BCSQ", &tok->bcsq_info, &tok->mbcsq_info) <= 0 ) return;
+
+    int i, j, nmask = fmt->n, icsq = 0, nmatch = 0;
+    hts_expand(uint32_t, nmask, tok->mbcsq_mask, tok->bcsq_mask);
+    uint32_t *mask = tok->bcsq_mask;
+    memset(mask, 0, sizeof(*mask)*nmask);
+    char *ss = tok->bcsq_info;
+    while ( *ss && icsq < nmask*16 )
+    {
+        char *se = ss;
+        while ( *se && *se!='|' && *se!=',' ) se++;
+        if ( tbcsq_match(tok, ss, se) ) { mask[icsq/16] |= 3u << 2*(icsq%16); nmatch++; }
+        while ( *se && *se!=',' ) se++;
+        if ( !*se ) break;
+        ss = se + 1;
+        icsq++;
+    }
+
+    tok->nvalues = tok->nsamples = line->n_sample;
+    hts_expand(double, tok->nvalues, tok->mvalues, tok->values);
+    if ( !nmatch )
+    {
+        for (i=0; i<line->n_sample; i++) tok->values[i] = 0;
+        return;
+    }
+    #define BRANCH(type_t) \
+    { \
+        for (i=0; i<line->n_sample; i++) \
+        { \
+            type_t *x = (type_t*)(fmt->p + i*fmt->size); \
+            uint32_t hit = 0; \
+            for (j=0; j<nmask; j++) hit |= x[j] & mask[j]; \
+            tok->values[i] = hit ? 1 : 0; \
+        } \
+    }
+    switch (fmt->type)
+    {
+        case BCF_BT_INT8:  BRANCH(uint8_t); break;
+        case BCF_BT_INT16: BRANCH(uint16_t); break;
+        case BCF_BT_INT32: BRANCH(uint32_t); break;
+        default: error("Unexpected type of FMT/BCSQ: %d\n", fmt->type); break;
+    }
+    #undef BRANCH
+}
 static void filters_set_nmissing(filter_t *flt, bcf1_t *line, token_t *tok)
 {
     bcf_unpack(line, BCF_UN_FMT);
@@ -737,10 +882,31 @@ static void filters_set_nalt(filter_t *flt, bcf1_t *line, token_t *tok)
     tok->nvalues = 1;
     tok->values[0] = line->n_allele - 1;
 }
-static void filters_set_ac(filter_t *flt, bcf1_t *line, token_t *tok)
+// gtcount_calc_ac() into flt->tmpi, once per record for all AC, AN, MAC, AF
+// and MAF tokens
+static int filters_calc_ac(filter_t *flt, bcf1_t *line, token_t *tok)
 {
     hts_expand(int32_t, line->n_allele, flt->mtmpi, flt->tmpi);
-    if ( !bcf_calc_ac(flt->hdr, line, flt->tmpi, BCF_UN_INFO|BCF_UN_FMT) )
+    if ( !tok->ifield ) return gtcount_calc_ac(flt->hdr, line, flt->tmpi, BCF_UN_INFO|BCF_UN_FMT);
+
+    field_t *field = &flt->fields[tok->ifield-1];
+    if ( field->nrec!=flt->nrec )
+    {
+        field->n = gtcount_calc_ac(flt->hdr, line, flt->tmpi, BCF_UN_INFO|BCF_UN_FMT);
+        if ( field->n )
+        {
+            hts_expand(int32_t, line->n_allele, field->m, field->dat);
+            memcpy(field->dat, flt->tmpi, sizeof(int32_t)*line->n_allele);
+        }
+        field->nrec = flt->nrec;
+    }
+    else if ( field->n )
+        memcpy(flt->tmpi, field->dat, sizeof(int32_t)*line->n_allele);
+    return field->n;
+}
+static void filters_set_ac(filter_t *flt, bcf1_t *line, token_t *tok)
+{
+    if ( !filters_calc_ac(flt, line, tok) )
     {
         tok->nvalues = 0;
         return;
@@ -1205,21 +1371,79 @@ static int cmp_vector_strings(token_t *atok, token_t *btok, int logic)    // log
     }
     return pass_site;
 }
+// Plain substring search, used for patterns without regex metacharacters
+static inline int find_literal(const char *str, int len, const char *lit, int nlit, int icase)
+{
+    if ( !nlit ) return 1;
+    const char *end = str + len - nlit;
+    if ( !icase )
+    {
+        while ( str<=end )
+        {
+            const char *ptr = (const char*) memchr(str, lit[0], end-str+1);
+            if ( !ptr ) return 0;
+            if ( !memcmp(ptr+1, lit+1, nlit-1) ) return 1;
+            str = ptr + 1;
+        }
+        return 0;
+    }
+    for (; str<=end; str++)
+        if ( !strncasecmp(str, lit, nlit) ) return 1;
+    return 0;
+}
+
+// The results of regexec() are cached: string fields such as FILTER or CSQ
+// tend to repeat the same few values over and over
+#define REGEX_CACHE_MAX 10000
+static int regex_match(token_t *rtok, const char *str, int len)
+{
+    if ( rtok->literal ) return find_literal(str, len, rtok->literal, rtok->nliteral, rtok->icase);
+
+    // the per-sample values are not necessarily NUL-terminated
+    rtok->regex_str.l = 0;
+    kputsn(str, len, &rtok->regex_str);
+
+    int ret;
+    if ( rtok->regex_cache && khash_str2int_get(rtok->regex_cache, rtok->regex_str.s, &ret)==0 ) return ret;
+
+    ret = regexec(rtok->regex, rtok->regex_str.s, 0,NULL,0) ? 0 : 1;
+    if ( rtok->nregex_cache >= REGEX_CACHE_MAX )
+    {
+        khash_str2int_destroy_free(rtok->regex_cache);
+        rtok->regex_cache  = NULL;
+        rtok->nregex_cache = 0;
+    }
+    if ( !rtok->regex_cache ) rtok->regex_cache = khash_str2int_init();
+    khash_str2int_set(rtok->regex_cache, strdup(rtok->regex_str.s), ret);
+    rtok->nregex_cache++;
+    return ret;
+}
 static int regex_vector_strings(token_t *atok, token_t *btok, int negate)
 {
     int i, pass_site = 0;
     if ( atok->nsamples )
     {
+        // identical values of consecutive samples are matched only once
+        int width = (int)atok->values[0], prev_len = -1;
+        char *prev = NULL;
         for (i=0; i<atok->nsamples; i++)
         {
-            char *ptr = atok->str_value + i*(int)atok->values[0];
-            atok->pass_samples[i] = regexec(btok->regex, ptr, 0,NULL,0) ? 0 : 1;
-            if ( negate ) atok->pass_samples[i] = atok->pass_samples[i] ? 0 : 1;
+            char *ptr = atok->str_value + i*width, *end = ptr;
+            while ( end < ptr+width && *end ) end++;
+            if ( prev && end-ptr==prev_len && !memcmp(ptr,prev,prev_len) )
+                atok->pass_samples[i] = atok->pass_samples[i-1];
+            else
+            {
+                atok->pass_samples[i] = regex_match(btok, ptr, end-ptr);
+                if ( negate ) atok->pass_samples[i] = atok->pass_samples[i] ? 0 : 1;
+                prev = ptr;
+                prev_len = end - ptr;
+            }
             pass_site |= atok->pass_samples[i];
         }
         return pass_site;
     }
-    pass_site = regexec(btok->regex, atok->str_value, 0,NULL,0) ? 0 : 1;
+    pass_site = regex_match(btok, atok->str_value, strlen(atok->str_value));
     if ( negate ) pass_site = pass_site ? 0 : 1;
     return pass_site;
 }
@@ -1350,6 +1574,13 @@ static int filters_init1(filter_t *filter, char *str, int len, token_t *tok)
             tok->tag = strdup("F_MISSING");
             return 0;
         }
+        else if ( len==5 && !strncasecmp(str,"TBCSQ",len) )
+        {
+            tok->setter = &filters_set_tbcsq;
+            tok->tag = strdup("TBCSQ");
+            filter->max_unpack |= BCF_UN_INFO|BCF_UN_FMT;
+            return 0;
+        }
     }
 
     // does it have array subscript?
@@ -1519,7 +1750,288 @@ static void filter_debug_print(token_t *toks, token_t **tok_ptrs, int ntoks)
 }
 
 
+#define OP_CONST        0
+#define OP_LOAD         1
+#define OP_FILTER_EQ    2
+#define OP_FILTER_NE    3
+#define OP_ADD          4
+#define OP_SUB          5
+#define OP_MULT         6
+#define OP_DIV          7
+#define OP_LE           8
+#define OP_LT           9
+#define OP_EQ           10
+#define OP_BT           11
+#define OP_BE           12
+#define OP_NE           13
+#define OP_BIT_AND      14      // TYPE~"snp"
+#define OP_BIT_NAND     15      // TYPE!~"snp"
+#define OP_AND          16
+#define OP_OR           17
+
+// Expression tree nodes used only while compiling
+#define NODE_NUM        1       // numeric value
+#define NODE_BOOL       2       // result of a comparison or logical operator
+#define NODE_FLT_TOK    3       // the FILTER token, valid only as an operand of ==,!=
+#define NODE_FLT_VAL    4       // the FILTER value, e.g. "PASS"
+typedef struct
+{
+    int op, type;       // OP_* code and NODE_* type
+    int a, b;           // operands, indexes to the node array
+    double value;       // OP_CONST
+    token_t *tok;
+}
+node_t;
+
+static int filter_can_load(token_t *tok)
+{
+    if ( tok->setter==filters_set_qual || tok->setter==filters_set_type || tok->setter==filters_set_pos ) return 1;
+    if ( tok->setter==filters_set_nalt || tok->setter==filters_set_an || tok->setter==filters_set_info_flag ) return 1;
+    if ( tok->setter==filters_set_info ) return 1;      // Number=1 tags, strings are rejected by the caller
+    if ( (tok->setter==filters_set_info_int || tok->setter==filters_set_info_float) && tok->idx>=0 ) return 1;
+    return 0;
+}
+
+static int node_fold(node_t *node, node_t *a, node_t *b)
+{
+    if ( node->op==OP_AND || node->op==OP_OR )
+    {
+        // false&x is false, true&x is x; true|x is true, false|x is x
+        node_t *c = a->op==OP_CONST ? a : (b->op==OP_CONST ? b : NULL);
+        if ( !c ) return 0;
+        node_t *x = c==a ? b : a;
+        if ( (node->op==OP_AND && !c->value) || (node->op==OP_OR && c->value) ) *node = *c;
+        else *node = *x;
+        return 1;
+    }
+    if ( a->op!=OP_CONST || b->op!=OP_CONST ) return 0;
+    double x = a->value, y = b->value;
+    switch (node->op)
+    {
+        case OP_ADD:  node->value = x + y; break;
+        case OP_SUB:  node->value = x - y; break;
+        case OP_MULT: node->value = x * y; break;
+        case OP_DIV:  node->value = x / y; break;
+        case OP_LE:   node->value = x <= y ? 1 : 0; break;
+        case OP_LT:   node->value = x <  y ? 1 : 0; break;
+        case OP_EQ:   node->value = x == y ? 1 : 0; break;
+        case OP_BT:   node->value = x >  y ? 1 : 0; break;
+        case OP_BE:   node->value = x >= y ? 1 : 0; break;
+        case OP_NE:   node->value = x != y ? 1 : 0; break;
+        case OP_BIT_AND:  node->value = ((int)x & (int)y) ? 1 : 0; break;
+        case OP_BIT_NAND: node->value = ((int)x & (int)y) ? 0 : 1; break;
+        default: return 0;
+    }
+    node->op = OP_CONST;
+    return 1;
+}
+
+static void filter_emit(filter_t *flt, node_t *nodes, int inode)
+{
+    node_t *node = &nodes[inode];
+    if ( node->op==OP_CONST || node->op==OP_LOAD || node->op==OP_FILTER_EQ || node->op==OP_FILTER_NE )
+    {
+        inst_t *inst = &flt->prog[flt->nprog++];
+        inst->op = node->op; inst->value = node->value; inst->tok = node->tok;
+        return;
+    }
+    filter_emit(flt, nodes, node->a);
+    if ( node->op==OP_AND || node->op==OP_OR )
+    {
+        int ijump = flt->nprog++;
+        flt->prog[ijump].op = node->op;
+        filter_emit(flt, nodes, node->b);
+        flt->prog[ijump].jump = flt->nprog;
+        return;
+    }
+    filter_emit(flt, nodes, node->b);
+    flt->prog[flt->nprog++].op = node->op;
+}
+
+/*
+ *  Compile the RPN token list into a program for filter_test_prog(). Only
+ *  expressions evaluating to a single boolean per site are accepted: any
+ *  string, FORMAT, vector ([*]) or function token leaves the expression to
+ *  the generic interpreter. Constant subexpressions are folded and the &,|
+ *  operators short-circuit because a missing value evaluates to false
+ *  exactly as in vector_logic_and() and vector_logic_or().
+ */
+static void filter_compile(filter_t *flt)
+{
+    if ( flt->nsamples ) return;
+
+    node_t *nodes = (node_t*) calloc(flt->nfilters,sizeof(node_t));
+    int *stack = (int*) malloc(sizeof(int)*flt->nfilters);
+    int i, nstack = 0, ok = 1;
+    for (i=0; i<flt->nfilters && ok; i++)
+    {
+        token_t *tok = &flt->filters[i];
+        node_t *node = &nodes[i];
+        node->tok = tok;
+        if ( tok->tok_type==TOK_VAL )
+        {
+            if ( tok->comparator==filters_cmp_filter ) node->type = NODE_FLT_TOK;
+            else if ( tok->comparator || tok->hash || tok->key || tok->is_missing ) ok = 0;
+            else if ( tok->setter )
+            {
+                if ( tok->is_str || !filter_can_load(tok) ) ok = 0;
+                node->op = OP_LOAD, node->type = NODE_NUM;
+            }
+            else if ( tok->is_str ) node->type = NODE_FLT_VAL;  // the FILTER value, the string was converted to hdr_id
+            else
+                node->op = OP_CONST, node->type = NODE_NUM, node->value = tok->threshold;
+            stack[nstack++] = i;
+            continue;
+        }
+        if ( nstack<2 ) { ok = 0; break; }
+        node->a = stack[nstack-2];
+        node->b = stack[nstack-1];
+        node_t *a = &nodes[node->a], *b = &nodes[node->b];
+        nstack -= 2;
+
+        int type = NODE_NUM;
+        switch (tok->tok_type)
+        {
+            case TOK_ADD:  node->op = OP_ADD; break;
+            case TOK_SUB:  node->op = OP_SUB; break;
+            case TOK_MULT: node->op = OP_MULT; break;
+            case TOK_DIV:  node->op = OP_DIV; break;
+            case TOK_LE:   node->op = OP_LE; break;
+            case TOK_LT:   node->op = OP_LT; break;
+            case TOK_EQ:   node->op = OP_EQ; break;
+            case TOK_BT:   node->op = OP_BT; break;
+            case TOK_BE:   node->op = OP_BE; break;
+            case TOK_NE:   node->op = OP_NE; break;
+            case TOK_LIKE:  node->op = OP_BIT_AND; break;
+            case TOK_NLIKE: node->op = OP_BIT_NAND; break;
+            case TOK_AND: case TOK_AND_VEC: node->op = OP_AND; type = NODE_BOOL; break;
+            case TOK_OR:  case TOK_OR_VEC:  node->op = OP_OR;  type = NODE_BOOL; break;
+            default: ok = 0; break;
+        }
+        if ( !ok ) break;
+        if ( (node->op==OP_BIT_AND || node->op==OP_BIT_NAND) && tok->comparator!=filters_cmp_bit_and ) { ok = 0; break; }    // regex
+
+        if ( a->type==NODE_FLT_TOK || b->type==NODE_FLT_TOK )
+        {
+            node_t *val = a->type==NODE_FLT_TOK ? b : a;
+            if ( val->type!=NODE_FLT_VAL || (node->op!=OP_EQ && node->op!=OP_NE) ) { ok = 0; break; }
+            node->tok  = a->type==NODE_FLT_TOK ? a->tok : b->tok;
+            node->op   = node->op==OP_EQ ? OP_FILTER_EQ : OP_FILTER_NE;
+            node->type = NODE_BOOL;
+        }
+        else if ( a->type!=type || b->type!=type ) { ok = 0; break; }
+        else
+        {
+            if ( node->op>=OP_LE && node->op<=OP_BIT_NAND ) type = NODE_BOOL;
+            node->type = type;
+            node_fold(node, a, b);
+        }
+        stack[nstack++] = i;
+    }
+    if ( ok && nstack==1 && nodes[stack[0]].type==NODE_BOOL )
+    {
+        flt->prog = (inst_t*) calloc(flt->nfilters,sizeof(inst_t));
+        flt->prog_stack = (double*) malloc(sizeof(double)*flt->nfilters);
+        filter_emit(flt, nodes, stack[0]);
+    }
+    free(stack);
+    free(nodes);
+}
+
+#define PROG_ARITHMETICS(AOP) \
+{ \
+    nstack--; \
+    if ( bcf_double_is_missing(stack[nstack]) ) bcf_double_set_missing(stack[nstack-1]); \
+    else if ( !bcf_double_is_missing(stack[nstack-1]) ) stack[nstack-1] = stack[nstack-1] AOP stack[nstack]; \
+}
+#define PROG_CMP(CMP_OP) \
+{ \
+    nstack--; \
+    if ( bcf_double_is_missing(stack[nstack]) || bcf_double_is_missing(stack[nstack-1]) ) stack[nstack-1] = 0; \
+    else stack[nstack-1] = stack[nstack-1] CMP_OP stack[nstack] ? 1 : 0; \
+}
+static int filter_test_prog(filter_t *flt, bcf1_t *line)
+{
+    double *stack = flt->prog_stack;
+    int i, nstack = 0;
+    for (i=0; i<flt->nprog; i++)
+    {
+        inst_t *inst = &flt->prog[i];
+        switch (inst->op)
+        {
+            case OP_CONST: stack[nstack++] = inst->value; break;
+            case OP_LOAD:
+                inst->tok->setter(flt, line, inst->tok);
+                if ( inst->tok->nvalues ) stack[nstack++] = inst->tok->values[0];
+                else bcf_double_set_missing(stack[nstack++]);
+                break;
+            case OP_FILTER_EQ: stack[nstack++] = filters_cmp_filter(inst->tok, NULL, TOK_EQ, line); break;
+            case OP_FILTER_NE: stack[nstack++] = filters_cmp_filter(inst->tok, NULL, TOK_NE, line); break;
+            case OP_ADD:  PROG_ARITHMETICS(+); break;
+            case OP_SUB:  PROG_ARITHMETICS(-); break;
+            case OP_MULT: PROG_ARITHMETICS(*); break;
+            case OP_DIV:  PROG_ARITHMETICS(/); break;
+            case OP_LE: PROG_CMP(<=); break;
+            case OP_LT: PROG_CMP(<);  break;
+            case OP_EQ: PROG_CMP(==); break;
+            case OP_BT: PROG_CMP(>);  break;
+            case OP_BE: PROG_CMP(>=); break;
+            case OP_NE: PROG_CMP(!=); break;
+            case OP_BIT_AND:
+            case OP_BIT_NAND:
+            {
+                // as in filters_cmp_bit_and, a missing value is zero
+                nstack--;
+                int a = bcf_double_is_missing(stack[nstack-1]) ? 0 : (int)stack[nstack-1];
+                int b = bcf_double_is_missing(stack[nstack]) ? 0 : (int)stack[nstack];
+                stack[nstack-1] = (a&b ? 1 : 0) ^ (inst->op==OP_BIT_NAND ? 1 : 0);
+                break;
+            }
+            case OP_AND: if ( !stack[nstack-1] ) i = inst->jump - 1; else nstack--; break;
+            case OP_OR:  if ( stack[nstack-1] ) i = inst->jump - 1; else nstack--; break;
+        }
+    }
+    return stack[0] ? 1 : 0;
+}
+#undef PROG_ARITHMETICS
+#undef PROG_CMP
+
 // Parse filter expression and convert to reverse polish notation. Dijkstra's shunting-yard algorithm
+// Find the fields referenced by more than one token, their values will be
+// fetched only once per record
+static void filter_init_fields(filter_t *filter)
+{
+    int i, j;
+    for (i=0; i<filter->nfilters; i++)
+    {
+        token_t *tok = &filter->filters[i];
+        void (*setter)(filter_t *, bcf1_t *, struct _token_t *) = tok->setter;
+        if ( setter==filters_set_an || setter==filters_set_mac || setter==filters_set_af || setter==filters_set_maf ) setter = filters_set_ac;
+        else if ( setter!=filters_set_ac && setter!=filters_set_format_int && setter!=filters_set_format_float ) continue;
+        int hdr_id = setter==filters_set_ac ? -1 : tok->hdr_id;
+
+        for (j=0; j<filter->nfields; j++)
+            if ( filter->fields[j].setter==setter && filter->fields[j].hdr_id==hdr_id ) break;
+        if ( j==filter->nfields )
+        {
+            filter->nfields++;
+            filter->fields = (field_t*) realloc(filter->fields, sizeof(field_t)*filter->nfields);
+            memset(&filter->fields[j], 0, sizeof(field_t));
+            filter->fields[j].setter = setter;
+            filter->fields[j].hdr_id = hdr_id;
+        }
+        tok->ifield = j+1;
+    }
+
+    // fields used by a single token are fetched directly, without the extra copy
+    int *ntok = (int*) calloc(filter->nfields ? filter->nfields : 1, sizeof(int));
+    for (i=0; i<filter->nfilters; i++)
+        if ( filter->filters[i].ifield ) ntok[filter->filters[i].ifield-1]++;
+    for (i=0; i<filter->nfilters; i++)
+        if ( filter->filters[i].ifield && ntok[filter->filters[i].ifield-1]<2 ) filter->filters[i].ifield = 0;
+    free(ntok);
+}
+
 filter_t *filter_init(bcf_hdr_t *hdr, const char *str)
 {
     filter_t *filter = (filter_t *) calloc(1,sizeof(filter_t));
@@ -1646,6 +2158,12 @@ filter_t *filter_init(bcf_hdr_t *hdr, const char *str)
             }
             if ( regcomp(out[j].regex, out[j].key, cflags) )
                 error("Could not compile the regex expression \"%s\": %s\n", out[j].key,filter->str);
+            if ( !out[j].key[strcspn(out[j].key,"\\.[]()*+?{}|^$")] )
+            {
+                out[j].literal  = out[j].key;
+                out[j].nliteral = strlen(out[j].key);
+                out[j].icase    = cflags & REG_ICASE ? 1 : 0;
+            }
         }
         if ( out[i].tok_type!=TOK_VAL ) continue;
         if ( !out[i].tag ) continue;
@@ -1670,6 +2188,27 @@ filter_t *filter_init(bcf_hdr_t *hdr, const char *str)
             i = itok;
             continue;
         }
+        if ( !strcmp(out[i].tag,"TBCSQ") )
+        {
+            // TBCSQ="missense" or TBCSQ~"missense" is evaluated as a 0/1 value per sample
+            if ( i+1==nout ) error("Could not parse the expression: %s\n", filter->str);
+            int itok, ival;
+            if ( out[i+1].tok_type==TOK_EQ || out[i+1].tok_type==TOK_NE ) ival = i - 1, itok = i + 1;
+            else if ( out[i+1].tok_type==TOK_LIKE || out[i+1].tok_type==TOK_NLIKE ) ival = i - 1, itok = i + 1;
+            else if ( i+2<nout && (out[i+2].tok_type==TOK_EQ || out[i+2].tok_type==TOK_NE) ) itok = i + 2, ival = i + 1;
+            else if ( i+2<nout && (out[i+2].tok_type==TOK_LIKE || out[i+2].tok_type==TOK_NLIKE) ) itok = i + 2, ival = i + 1;
+            else error("[%s:%d %s] Could not parse the expression: %s\n",  __FILE__,__LINE__,__FUNCTION__, filter->str);
+            if ( ival<0 || out[ival].tok_type!=TOK_VAL || !out[ival].key )
+                error("[%s:%d %s] Could not parse the expression, an unquoted string value perhaps? %s\n", __FILE__,__LINE__,__FUNCTION__, filter->str);
+            out[i].bcsq_type = strdup(out[ival].key);
+            out[i].bcsq_like = out[itok].tok_type==TOK_LIKE || out[itok].tok_type==TOK_NLIKE ? 1 : 0;
+            if ( out[itok].tok_type==TOK_LIKE ) out[itok].tok_type = TOK_EQ;
+            else if ( out[itok].tok_type==TOK_NLIKE ) out[itok].tok_type = TOK_NE;
+            out[ival].threshold = 1; out[ival].is_str = 0;
+            out[ival].tag = out[ival].key; out[ival].key = NULL;
+            i = itok;
+            continue;
+        }
         if ( !strcmp(out[i].tag,"FILTER") )
         {
             if ( i+1==nout ) error("Could not parse the expression: %s\n", filter->str);
@@ -1720,6 +2259,8 @@ filter_t *filter_init(bcf_hdr_t *hdr, const char *str)
     filter->filters   = out;
     filter->nfilters  = nout;
     filter->flt_stack = (token_t **)malloc(sizeof(token_t*)*nout);
+    filter_init_fields(filter);
+    filter_compile(filter);
     return filter;
 }
 
@@ -1739,18 +2280,34 @@ void filter_destroy(filter_t *filter)
             regfree(filter->filters[i].regex);
             free(filter->filters[i].regex);
         }
+        if (filter->filters[i].regex_cache) khash_str2int_destroy_free(filter->filters[i].regex_cache);
+        free(filter->filters[i].regex_str.s);
+        free(filter->filters[i].bcsq_type);
+        free(filter->filters[i].bcsq_info);
+        free(filter->filters[i].bcsq_mask);
     }
+    for (i=0; i<filter->nfields; i++) free(filter->fields[i].dat);
+    free(filter->fields);
     free(filter->filters);
     free(filter->flt_stack);
+    free(filter->prog);
+    free(filter->prog_stack);
     free(filter->str);
     free(filter->tmpi);
     free(filter->tmpf);
     free(filter);
 }
 
-int filter_test(filter_t *filter, bcf1_t *line, const uint8_t **samples)
+static int _filter_test(filter_t *filter, bcf1_t *line, const uint8_t **samples)
 {
     bcf_unpack(line, filter->max_unpack);
+    filter->nrec++;
+
+    if ( filter->prog )
+    {
+        if ( samples ) *samples = NULL;
+        return filter_test_prog(filter, line);
+    }
 
     int i, nstack = 0;
     for (i=0; i<filter->nfilters; i++)
@@ -1908,6 +2465,14 @@ int filter_test(filter_t *filter, bcf1_t *line, const uint8_t **samples)
     return filter->flt_stack[0]->pass_site;
 }
 
+int filter_test(filter_t *filter, bcf1_t *line, const uint8_t **samples)
+{
+    uint64_t t0 = profile_begin();
+    int ret = _filter_test(filter, line, samples);
+    profile_end(PROF_FILTER, t0);
+    return ret;
+}
+
 int filter_max_unpack(filter_t *flt)
 {
     return flt->max_unpack;
@@ -0,0 +1,90 @@
+/* The MIT License
+
+   Copyright (c) 2017 Genome Research Ltd.
+
+   Author: Petr Danecek <pd3@sanger.ac.uk>
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+
+ */
+
+#include <stdlib.h>
+#include <htslib/kfunc.h>
+#include "fisher.h"
+
+#define FISHER_CACHE_BITS 16
+#define FISHER_MAX_COUNT  0xffff    // the counts must fit 16 bits of the key
+#define FISHER_EMPTY      UINT64_MAX
+
+typedef struct
+{
+    uint64_t key;
+    double left, right, two;
+}
+fisher_entry_t;
+
+struct _fisher_cache_t
+{
+    fisher_entry_t *dat;
+};
+
+fisher_cache_t *fisher_cache_init(void)
+{
+    fisher_cache_t *fc = (fisher_cache_t*) calloc(1, sizeof(fisher_cache_t));
+    fc->dat = (fisher_entry_t*) malloc(sizeof(fisher_entry_t) << FISHER_CACHE_BITS);
+    int i;
+    for (i=0; i < 1<<FISHER_CACHE_BITS; i++) fc->dat[i].key = FISHER_EMPTY;
+    return fc;
+}
+
+void fisher_cache_destroy(fisher_cache_t *fc)
+{
+    if ( !fc ) return;
+    free(fc->dat);
+    free(fc);
+}
+
+double fisher_exact(fisher_cache_t *fc, int n11, int n12, int n21, int n22, double *left, double *right)
+{
+    double l, r, two;
+    if ( n11<0 || n12<0 || n21<0 || n22<0 || n11>=FISHER_MAX_COUNT || n12>=FISHER_MAX_COUNT || n21>=FISHER_MAX_COUNT || n22>=FISHER_MAX_COUNT )
+    {
+        kt_fisher_exact(n11,n12,n21,n22, &l,&r,&two);
+        if ( left ) *left = l;
+        if ( right ) *right = r;
+        return two;
+    }
+    uint64_t key = (uint64_t)n11 | (uint64_t)n12<<16 | (uint64_t)n21<<32 | (uint64_t)n22<<48;
+    fisher_entry_t *e = &fc->dat[(key * 0x9e3779b97f4a7c15ULL) >> (64 - FISHER_CACHE_BITS)];
+    if ( e->key != key )
+    {
+        kt_fisher_exact(n11,n12,n21,n22, &e->left,&e->right,&e->two);
+        e->key = key;
+    }
+    if ( left ) *left = e->left;
+    if ( right ) *right = e->right;
+    return e->two;
+}
+
+void fisher_exact_batch(fisher_cache_t *fc, int ntab, const int32_t *tab, double *two)
+{
+    int i;
+    for (i=0; i<ntab; i++, tab+=4)
+        two[i] = fisher_exact(fc, tab[0],tab[1],tab[2],tab[3], NULL,NULL);
+}
@@ -0,0 +1,63 @@
+/* The MIT License
+
+   Copyright (c) 2017 Genome Research Ltd.
+
+   Author: Petr Danecek <pd3@sanger.ac.uk>
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+
+ */
+
+/*
+    Memoized Fisher's exact test of 2x2 tables. The counts of the tables tested
+    by bcftools, such as read depths, are small and repeat heavily across the
+    samples and sites, so the p-values are kept in a fixed-size direct-mapped
+    cache keyed by the table. Tables with counts which do not fit the key are
+    computed without caching. The cache is not thread-safe, each thread should
+    have its own.
+
+        fisher_cache_t *fc = fisher_cache_init();
+        double left, right, two = fisher_exact(fc, n11,n12,n21,n22, &left,&right);
+        fisher_cache_destroy(fc);
+*/
+
+#ifndef __FISHER_H__
+#define __FISHER_H__
+
+#include <stdint.h>
+
+typedef struct _fisher_cache_t fisher_cache_t;
+
+fisher_cache_t *fisher_cache_init(void);
+void fisher_cache_destroy(fisher_cache_t *fc);
+
+/*
+ *  fisher_exact() - the two-sided p-value of the table, the same as
+ *      kt_fisher_exact(). The one-sided p-values are set if left and right
+ *      are not NULL.
+ */
+double fisher_exact(fisher_cache_t *fc, int n11, int n12, int n21, int n22, double *left, double *right);
+
+/*
+ *  fisher_exact_batch() - the two-sided p-values of ntab tables, given as
+ *      consecutive quadruples n11,n12,n21,n22
+ */
+void fisher_exact_batch(fisher_cache_t *fc, int ntab, const int32_t *tab, double *two);
+
+#endif
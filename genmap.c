@@ -0,0 +1,305 @@
+/* The MIT License
+
+   Copyright (c) 2017 Genome Research Ltd.
+
+   Author: Petr Danecek <pd3@sanger.ac.uk>
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <htslib/hts.h>
+#include <htslib/kstring.h>
+#include <htslib/kseq.h>
+#include <htslib/khash_str2int.h>
+#include "bcftools.h"
+#include "genmap.h"
+#include "cache.h"
+
+/*
+    The index layout, see cache.h:
+        genmap_hdr_t
+        maps        .. int32_t 0-based positions [n], padded to 8 bytes, followed
+                       by double recombination probabilities (cM*0.01) [n]
+        sequences   .. genmap_seq_t [nseq], followed by NUL-terminated names
+    A single text map, not a mask, applies to all sequences and is stored once
+    under the name GENMAP_ANY. The offsets are from the beginning of the file.
+    The stamp covers the names, sizes and mtimes of the text maps.
+*/
+#define GENMAP_MAGIC "BCFGMAP\2"
+#define GENMAP_ANY   "*"
+#define GENMAP_HEADER "position COMBINED_rate(cM/Mb) Genetic_Map(cM)"
+
+typedef struct
+{
+    uint64_t nseq, seq_off;
+}
+genmap_hdr_t;
+
+typedef struct
+{
+    uint64_t off, n;
+}
+genmap_seq_t;
+
+struct _genmap_t
+{
+    char *fname;                // the text map or mask, NULL with the index
+    int is_mask;
+
+    // the current sequence
+    int n, m;
+    int32_t *pos;
+    double *rate;
+    kstring_t loaded;           // the text map the current sequence was read from
+
+    // the memory-mapped index
+    cache_t *cache;
+    uint8_t *map;
+    genmap_hdr_t *hdr;
+    genmap_seq_t *seq;
+    void *seq2id;
+};
+
+static void expand_mask(const char *fname, const char *seq, kstring_t *str)
+{
+    str->l = 0;
+    const char *tmp = strstr(fname,"{CHROM}");
+    if ( !tmp ) { kputs(fname, str); return; }
+    kputsn(fname, tmp - fname, str);
+    kputs(seq, str);
+    kputs(tmp+7, str);
+}
+
+// Returns -1 if the file does not exist
+static int parse_text(const char *fname, int *n, int *m, int32_t **pos, double **rate)
+{
+    htsFile *fp = hts_open(fname, "rb");
+    if ( !fp ) return -1;
+
+    kstring_t str = {0,0,0};
+    hts_getline(fp, KS_SEP_LINE, &str);
+    if ( !str.s || strcmp(str.s,GENMAP_HEADER) )
+        error("Unexpected header in %s, found:\n\t[%s], but expected:\n\t[%s]\n", fname, str.s ? str.s : "", GENMAP_HEADER);
+
+    int mpos = *m, mrate = *m;
+    *n = 0;
+    while ( hts_getline(fp, KS_SEP_LINE, &str) > 0 )
+    {
+        (*n)++;
+        hts_expand(int32_t,*n,mpos,*pos);
+        hts_expand(double,*n,mrate,*rate);
+
+        // position, convert to 0-based
+        char *tmp, *end;
+        (*pos)[*n-1] = strtol(str.s, &tmp, 10) - 1;
+        if ( str.s==tmp ) error("Could not parse %s: %s\n", fname, str.s);
+
+        // skip second column
+        tmp++;
+        while ( *tmp && !isspace(*tmp) ) tmp++;
+
+        // read the genetic map in cM, scale from % to likelihood
+        (*rate)[*n-1] = strtod(tmp+1, &end) * 0.01;
+        if ( tmp+1==end ) error("Could not parse %s: %s\n", fname, str.s);
+    }
+    if ( !*n ) error("Genetic map empty?\n");
+    if ( hts_close(fp) ) error("Close failed\n");
+    *m = mpos;
+    free(str.s);
+    return 0;
+}
+
+static uint64_t src_stamp(const char *fname, const char **seqs, int nseqs)
+{
+    int i, is_mask = strstr(fname,"{CHROM}") ? 1 : 0;
+    kstring_t str = {0,0,0};
+    uint64_t stamp = CACHE_STAMP_INIT;
+    for (i=0; i<(is_mask ? nseqs : 1); i++)
+    {
+        expand_mask(fname, is_mask ? seqs[i] : GENMAP_ANY, &str);
+        stamp = cache_stamp_str(stamp, str.s);
+        stamp = cache_stamp_file(stamp, str.s);
+    }
+    free(str.s);
+    return stamp;
+}
+
+// Read the text maps of all sequences and write the index
+static void genmap_build(const char *fname, const char *index_fname, const char **seqs, int nseqs, uint64_t stamp)
+{
+    cache_t *out = cache_create(index_fname, GENMAP_MAGIC, stamp);
+    genmap_hdr_t hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    uint64_t hdr_off = out->off;
+    cache_write(out, &hdr, sizeof(hdr));     // rewritten with the counts at the end
+
+    int i, n = 0, m = 0, is_mask = strstr(fname,"{CHROM}") ? 1 : 0;
+    int32_t *pos = NULL;
+    double *rate = NULL;
+    genmap_seq_t *seq = (genmap_seq_t*) malloc(sizeof(*seq)*(is_mask ? nseqs : 1));
+    kstring_t str = {0,0,0}, names = {0,0,0};
+    for (i=0; i<(is_mask ? nseqs : 1); i++)
+    {
+        expand_mask(fname, is_mask ? seqs[i] : GENMAP_ANY, &str);
+        if ( parse_text(str.s, &n, &m, &pos, &rate)!=0 ) continue;
+        seq[hdr.nseq].off = out->off;
+        seq[hdr.nseq].n   = n;
+        cache_write(out, pos, sizeof(*pos)*n);
+        cache_pad(out, 8);
+        cache_write(out, rate, sizeof(*rate)*n);
+        kputs(is_mask ? seqs[i] : GENMAP_ANY, &names);
+        kputc(0, &names);
+        hdr.nseq++;
+    }
+    if ( !hdr.nseq ) error("No genetic map found for any of the sequences: %s\n", fname);
+    hdr.seq_off = out->off;
+    cache_write(out, seq, sizeof(*seq)*hdr.nseq);
+    cache_write(out, names.s, names.l);
+    cache_write_at(out, hdr_off, &hdr, sizeof(hdr));
+    cache_commit(out);
+
+    free(pos);
+    free(rate);
+    free(seq);
+    free(str.s);
+    free(names.s);
+}
+
+// Returns NULL if the file is not an index or, when stamp!=0, if it is outdated
+static genmap_t *genmap_load(const char *index_fname, uint64_t stamp)
+{
+    cache_t *cache = cache_open(index_fname, GENMAP_MAGIC, stamp, stamp ? "genetic map index" : NULL);
+    if ( !cache ) return NULL;
+
+    genmap_t *gm = (genmap_t*) calloc(1, sizeof(genmap_t));
+    gm->cache = cache;
+    gm->map   = cache->map;
+    gm->hdr   = (genmap_hdr_t*) cache_ptr(cache, cache->off, sizeof(genmap_hdr_t));
+    gm->seq   = (genmap_seq_t*) cache_ptr(cache, gm->hdr->seq_off, sizeof(genmap_seq_t)*gm->hdr->nseq);
+
+    uint64_t i;
+    gm->seq2id = khash_str2int_init();
+    char *name = (char*) (gm->seq + gm->hdr->nseq);
+    for (i=0; i<gm->hdr->nseq; i++)
+    {
+        khash_str2int_set(gm->seq2id, name, i);
+        name += strlen(name) + 1;
+    }
+    return gm;
+}
+
+genmap_t *genmap_init(const char *fname, const char *index_fname, const char **seqs, int nseqs)
+{
+    genmap_t *gm;
+    if ( !index_fname )
+    {
+        gm = genmap_load(fname, 0);
+        if ( gm ) return gm;
+        gm = (genmap_t*) calloc(1, sizeof(genmap_t));
+        gm->fname   = strdup(fname);
+        gm->is_mask = strstr(fname,"{CHROM}") ? 1 : 0;
+        return gm;
+    }
+    uint64_t stamp = src_stamp(fname, seqs, nseqs);
+    if ( !stamp ) stamp = 1;
+    gm = genmap_load(index_fname, stamp);
+    if ( gm ) return gm;
+    genmap_build(fname, index_fname, seqs, nseqs, stamp);
+    gm = genmap_load(index_fname, stamp);
+    if ( !gm ) error("Failed to load %s\n", index_fname);
+    return gm;
+}
+
+void genmap_destroy(genmap_t *gm)
+{
+    if ( !gm ) return;
+    if ( gm->map )
+    {
+        cache_close(gm->cache);
+        khash_str2int_destroy(gm->seq2id);
+    }
+    else
+    {
+        free(gm->pos);
+        free(gm->rate);
+    }
+    free(gm->loaded.s);
+    free(gm->fname);
+    free(gm);
+}
+
+int genmap_set_seq(genmap_t *gm, const char *seq)
+{
+    if ( gm->map )
+    {
+        int id;
+        if ( khash_str2int_get(gm->seq2id, seq, &id)!=0 && khash_str2int_get(gm->seq2id, GENMAP_ANY, &id)!=0 ) return -1;
+        gm->n    = gm->seq[id].n;
+        gm->pos  = (int32_t*) (gm->map + gm->seq[id].off);
+        gm->rate = (double*) (gm->map + gm->seq[id].off + ((sizeof(int32_t)*gm->n + 7) & ~(size_t)7));
+        return 0;
+    }
+
+    // a single map is read only once for all sequences
+    if ( !gm->is_mask && gm->loaded.l ) return 0;
+
+    expand_mask(gm->fname, seq, &gm->loaded);
+    if ( parse_text(gm->loaded.s, &gm->n, &gm->m, &gm->pos, &gm->rate)!=0 )
+    {
+        gm->n = 0;
+        gm->loaded.l = 0;
+        return -1;
+    }
+    return 0;
+}
+
+double genmap_rate(const genmap_t *gm, int *cursor, uint32_t start_pos, uint32_t end_pos)
+{
+    const int32_t *pos = gm->pos;
+    int start = start_pos, end = end_pos;
+
+    // position i to be equal to or smaller than start
+    int i = *cursor;
+    if ( pos[i] > start )
+    {
+        while ( i>0 && pos[i] > start ) i--;
+    }
+    else
+    {
+        while ( i+1<gm->n && pos[i+1] < start ) i++;
+    }
+    // position j to be equal or larger than end
+    int j = i;
+    while ( j+1<gm->n && pos[j] < end ) j++;
+    if ( i==j )
+    {
+        *cursor = i;
+        return 0;
+    }
+
+    if ( start < pos[i] ) start = pos[i];
+    if ( end > pos[j] ) end = pos[j];
+    *cursor = j;
+    return (gm->rate[j] - gm->rate[i])/(pos[j] - pos[i]) * (end-start);
+}
@@ -0,0 +1,79 @@
+/* The MIT License
+
+   Copyright (c) 2017 Genome Research Ltd.
+
+   Author: Petr Danecek <pd3@sanger.ac.uk>
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+
+ */
+
+/*
+    Genetic maps in the format required by IMPUTE2, given either as a single
+    file, as a file mask where "{CHROM}" is replaced with the sequence name,
+    or as a binary index of all sequences, which is memory-mapped rather than
+    parsed. The index is written by genmap_init() when requested and is
+    recognised by its magic string when passed in place of the text map.
+
+    The interpolation is done with a cursor kept by the caller, one per
+    stream of increasing positions, so that the lookups advance through the
+    map rather than search it. The map itself is read-only once a sequence
+    is set and can be shared by threads which keep their own cursors.
+
+        genmap_t *gm = genmap_init(fname, NULL, NULL, 0);
+        if ( genmap_set_seq(gm, chr)==0 )
+        {
+            int cursor = 0;
+            double rate = genmap_rate(gm, &cursor, prev_pos, pos);
+        }
+*/
+
+#ifndef __GENMAP_H__
+#define __GENMAP_H__
+
+#include <stdint.h>
+
+typedef struct _genmap_t genmap_t;
+
+/*
+ *  genmap_init() - open the genetic map
+ *  @fname:         the text map, the {CHROM} mask, or the binary index
+ *  @index_fname:   if not NULL, the binary index of the text map @fname. It is
+ *                  built from the maps of @seqs if it does not exist or if the
+ *                  text maps have changed since, and memory-mapped otherwise.
+ *  @seqs,nseqs:    the sequences to include in the index
+ */
+genmap_t *genmap_init(const char *fname, const char *index_fname, const char **seqs, int nseqs);
+void genmap_destroy(genmap_t *gm);
+
+/*
+ *  genmap_set_seq() - switch to the map of the sequence, invalidating all
+ *      cursors. Returns 0 on success or -1 if there is no map for the sequence.
+ */
+int genmap_set_seq(genmap_t *gm, const char *seq);
+
+/*
+ *  genmap_rate() - the probability of recombination between the 0-based
+ *      positions start and end, interpolated linearly between the nearest
+ *      map positions
+ *  @cursor:    the position in the map, set to 0 with each new sequence
+ */
+double genmap_rate(const genmap_t *gm, int *cursor, uint32_t start, uint32_t end);
+
+#endif
@@ -0,0 +1,115 @@
+/*  gtcount.h -- allele counts from FORMAT/GT.
+
+    Copyright (C) 2017 Genome Research Ltd.
+
+    Author: Petr Danecek <pd3@sanger.ac.uk>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.  */
+
+/*
+    A drop-in replacement of bcf_calc_ac() which counts the alleles directly
+    in the packed FORMAT/GT block. The common int8 block is reduced to a
+    histogram of the byte values in a single branch-free pass: the missing,
+    vector_end and phasing bits do not need to be tested per value, as each
+    of them falls into its own bins. The counts are then read off the bins
+    of the alleles.
+*/
+
+#ifndef __GTCOUNT_H__
+#define __GTCOUNT_H__
+
+#include <stdint.h>
+#include <string.h>
+#include <htslib/vcf.h>
+#include <htslib/vcfutils.h>
+#include "bcftools.h"
+
+static inline void gtcount_int8(const bcf1_t *rec, const bcf_fmt_t *fmt, int *ac)
+{
+    // two interleaved histograms to avoid a dependency between consecutive increments
+    uint32_t hist[2][256];
+    memset(hist, 0, sizeof(hist));
+    const uint8_t *p = fmt->p;
+    size_t i, n = (size_t)rec->n_sample * fmt->size;
+    for (i=0; i+1<n; i+=2)
+    {
+        hist[0][p[i]]++;
+        hist[1][p[i+1]]++;
+    }
+    if ( i<n ) hist[0][p[i]]++;
+
+    // bins 0,1: missing; 2,3: allele 0 unphased, phased; ...; 128-255: negative values
+    int ial, bin, nbin = (rec->n_allele + 1) << 1;
+    for (ial=0; ial<rec->n_allele && ((ial+1)<<1) < 128; ial++)
+    {
+        bin = (ial+1) << 1;
+        ac[ial] = hist[0][bin] + hist[0][bin+1] + hist[1][bin] + hist[1][bin+1];
+    }
+    for (bin=nbin; bin<128; bin++)
+        if ( hist[0][bin] || hist[1][bin] ) error("An allele out of range at position %d: %d\n", rec->pos+1, (bin>>1)-1);
+}
+
+/**
+ *  gtcount_calc_ac() - the same as bcf_calc_ac()
+ *  @ac:     array of rec->n_allele counts to fill
+ *  @which:  BCF_UN_INFO to use INFO/AN,AC if present, BCF_UN_FMT to count
+ *           FORMAT/GT, or both
+ *
+ *  Returns 1 if the counts were set, 0 otherwise.
+ */
+static inline int gtcount_calc_ac(const bcf_hdr_t *hdr, bcf1_t *rec, int *ac, int which)
+{
+    if ( (which & BCF_UN_INFO) && bcf_calc_ac(hdr, rec, ac, BCF_UN_INFO) > 0 ) return 1;
+    if ( !(which & BCF_UN_FMT) ) return 0;
+
+    bcf_fmt_t *fmt = bcf_get_fmt(hdr, rec, "GT");
+    if ( !fmt || !fmt->p ) return 0;
+
+    memset(ac, 0, sizeof(*ac)*rec->n_allele);
+    if ( fmt->type==BCF_BT_INT8 )
+    {
+        gtcount_int8(rec, fmt, ac);
+        return 1;
+    }
+
+    int i, j;
+    #define BRANCH(type_t) { \
+        for (i=0; i<rec->n_sample; i++) \
+        { \
+            type_t *p = (type_t*) (fmt->p + i*fmt->size); \
+            for (j=0; j<fmt->n; j++) \
+            { \
+                if ( p[j] <= 1 ) continue;  /* missing or vector_end */ \
+                int ial = (p[j]>>1) - 1; \
+                if ( ial >= rec->n_allele ) error("An allele out of range at position %d: %d\n", rec->pos+1, ial); \
+                ac[ial]++; \
+            } \
+        } \
+    }
+    switch (fmt->type)
+    {
+        case BCF_BT_INT16: BRANCH(int16_t); break;
+        case BCF_BT_INT32: BRANCH(int32_t); break;
+        default: error("The GT type is not linearly encoded: %d\n", fmt->type); break;
+    }
+    #undef BRANCH
+    return 1;
+}
+
+#endif
@@ -0,0 +1,195 @@
+/*  gtedit.h -- in-place editing of FORMAT/GT.
+
+    Copyright (C) 2017 Genome Research Ltd.
+
+    Author: Petr Danecek <pd3@sanger.ac.uk>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.  */
+
+/*
+    The genotypes of one sample are read from and written back to the packed
+    FORMAT/GT block of the record, which avoids bcf_get_genotypes() of all
+    samples and the re-encoding by bcf_update_genotypes(). This is possible
+    only when the new values fit in the integer width the block already uses.
+
+    The diploid kernels below work on all samples at once. Each sample is
+    processed by the same branch-free sequence of masks and selects, so that
+    the compiler can vectorize the loop. The missing and vector_end values of
+    the narrow types have the same bit patterns in the low bits as their
+    int32 counterparts, so the results are the same as when decoding.
+*/
+
+#ifndef __GTEDIT_H__
+#define __GTEDIT_H__
+
+#include <stdint.h>
+#include <string.h>
+#include <htslib/vcf.h>
+
+/**
+ *  gtedit_fmt() - the FORMAT/GT block, if it can be edited in place
+ *  @max_gt:   the largest BCF-encoded genotype value to be written
+ *
+ *  Returns NULL if GT is not present or max_gt does not fit its width.
+ */
+static inline bcf_fmt_t *gtedit_fmt(const bcf_hdr_t *hdr, bcf1_t *rec, int32_t max_gt)
+{
+    bcf_fmt_t *fmt = bcf_get_fmt(hdr, rec, "GT");
+    if ( !fmt || !fmt->p ) return NULL;
+    switch (fmt->type)
+    {
+        case BCF_BT_INT8:  return max_gt <= INT8_MAX ? fmt : NULL;
+        case BCF_BT_INT16: return max_gt <= INT16_MAX ? fmt : NULL;
+        case BCF_BT_INT32: return fmt;
+    }
+    return NULL;
+}
+
+/**
+ *  gtedit_get() - decode the genotypes of one sample
+ *  @gts:   array of fmt->n values to fill, bcf_int32_* missing and vector_end
+ *          values are used regardless of the width
+ *
+ *  Returns the number of values, fmt->n.
+ */
+static inline int gtedit_get(const bcf_fmt_t *fmt, int ismpl, int32_t *gts)
+{
+    int i;
+    #define BRANCH(type_t, missing, vector_end) { \
+        type_t *ptr = (type_t*) (fmt->p + ismpl*fmt->size); \
+        for (i=0; i<fmt->n; i++) \
+        { \
+            if ( ptr[i]==vector_end ) gts[i] = bcf_int32_vector_end; \
+            else if ( ptr[i]==missing ) gts[i] = bcf_int32_missing; \
+            else gts[i] = ptr[i]; \
+        } \
+    }
+    switch (fmt->type)
+    {
+        case BCF_BT_INT8:  BRANCH(int8_t,  bcf_int8_missing,  bcf_int8_vector_end); break;
+        case BCF_BT_INT16: BRANCH(int16_t, bcf_int16_missing, bcf_int16_vector_end); break;
+        case BCF_BT_INT32: BRANCH(int32_t, bcf_int32_missing, bcf_int32_vector_end); break;
+    }
+    #undef BRANCH
+    return fmt->n;
+}
+
+/**
+ *  gtedit_set() - write back the genotypes of one sample, decoded by
+ *      gtedit_get() and modified with values not exceeding max_gt of
+ *      gtedit_fmt()
+ */
+static inline void gtedit_set(bcf_fmt_t *fmt, int ismpl, const int32_t *gts)
+{
+    int i;
+    #define BRANCH(type_t, missing, vector_end) { \
+        type_t *ptr = (type_t*) (fmt->p + ismpl*fmt->size); \
+        for (i=0; i<fmt->n; i++) \
+        { \
+            if ( gts[i]==bcf_int32_vector_end ) ptr[i] = vector_end; \
+            else if ( gts[i]==bcf_int32_missing ) ptr[i] = missing; \
+            else ptr[i] = gts[i]; \
+        } \
+    }
+    switch (fmt->type)
+    {
+        case BCF_BT_INT8:  BRANCH(int8_t,  bcf_int8_missing,  bcf_int8_vector_end); break;
+        case BCF_BT_INT16: BRANCH(int16_t, bcf_int16_missing, bcf_int16_vector_end); break;
+        case BCF_BT_INT32: BRANCH(int32_t, bcf_int32_missing, bcf_int32_vector_end); break;
+    }
+    #undef BRANCH
+}
+
+/**
+ *  gtedit_swap() - swap the two alleles of diploid samples, as when flipping
+ *      the haplotypes of phased samples; the new second allele is phased
+ *  @flip:  per-sample flags, non-zero to swap
+ *
+ *  Genotypes with the first allele missing and haploid genotypes are left
+ *  as they are. Requires fmt->n==2, the values always fit the width.
+ */
+static inline void gtedit_swap(bcf_fmt_t *fmt, int nsmpl, const uint8_t *flip)
+{
+    int i;
+    #define BRANCH(type_t, utype_t, vector_end) { \
+        for (i=0; i<nsmpl; i++) \
+        { \
+            type_t gt[2]; \
+            memcpy(gt, fmt->p + i*fmt->size, sizeof(gt)); \
+            type_t m = -(type_t)((flip[i]!=0) & ((utype_t)gt[0] > 1) & (gt[1]!=vector_end)); \
+            type_t a = (gt[1] & m) | (gt[0] & ~m); \
+            type_t b = ((gt[0]|1) & m) | (gt[1] & ~m); \
+            gt[0] = a; gt[1] = b; \
+            memcpy(fmt->p + i*fmt->size, gt, sizeof(gt)); \
+        } \
+    }
+    switch (fmt->type)
+    {
+        case BCF_BT_INT8:  BRANCH(int8_t,  uint8_t,  bcf_int8_vector_end); break;
+        case BCF_BT_INT16: BRANCH(int16_t, uint16_t, bcf_int16_vector_end); break;
+        case BCF_BT_INT32: BRANCH(int32_t, uint32_t, bcf_int32_vector_end); break;
+    }
+    #undef BRANCH
+}
+
+/**
+ *  gtedit_unphase() - remove phasing of diploid samples and sort the alleles,
+ *      1|0 becomes 0/1
+ *  @mask:  per-sample flags, non-zero to unphase
+ *
+ *  Returns the number of alleles which were phased. When there are none, the
+ *  block is left untouched, unphased genotypes such as 1/0 are sorted only
+ *  in records with at least one phased allele. Requires fmt->n==2.
+ */
+static inline int gtedit_unphase(bcf_fmt_t *fmt, int nsmpl, const uint8_t *mask)
+{
+    int i, nchanged = 0;
+    #define BRANCH(type_t, vector_end) { \
+        for (i=0; i<nsmpl; i++) \
+        { \
+            type_t gt[2]; \
+            memcpy(gt, fmt->p + i*fmt->size, sizeof(gt)); \
+            int sel = (mask[i]!=0) & (gt[0]!=vector_end); \
+            nchanged += (sel & gt[0] & 1) + (sel & (gt[1]!=vector_end) & gt[1] & 1); \
+        } \
+        if ( !nchanged ) return 0; \
+        for (i=0; i<nsmpl; i++) \
+        { \
+            type_t gt[2]; \
+            memcpy(gt, fmt->p + i*fmt->size, sizeof(gt)); \
+            int sel = (mask[i]!=0) & (gt[0]!=vector_end); \
+            int dip = sel & (gt[1]!=vector_end); \
+            type_t a = gt[0] ^ (sel & gt[0] & 1), b = gt[1] ^ (dip & gt[1] & 1); \
+            type_t m = -(type_t)(dip & (a > b)); \
+            gt[0] = (b & m) | (a & ~m); \
+            gt[1] = (a & m) | (b & ~m); \
+            memcpy(fmt->p + i*fmt->size, gt, sizeof(gt)); \
+        } \
+    }
+    switch (fmt->type)
+    {
+        case BCF_BT_INT8:  BRANCH(int8_t,  bcf_int8_vector_end); break;
+        case BCF_BT_INT16: BRANCH(int16_t, bcf_int16_vector_end); break;
+        case BCF_BT_INT32: BRANCH(int32_t, bcf_int32_vector_end); break;
+    }
+    #undef BRANCH
+    return nchanged;
+}
+
+#endif
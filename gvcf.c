@@ -30,23 +30,57 @@ struct _gvcf_t
     int *dp_range, ndp_range;   // per-sample DP ranges
     int prev_range;             // 0 if not in a block
     int32_t *dp, mdp, *pl, mpl, npl;
-    int32_t *tmp, mtmp, *gts, ngts,mgts, nqsum,mqsum;
+    int32_t *gts, ngts,mgts, nqsum,mqsum;
     float *qsum;
     int32_t rid, start, end, min_dp;
     kstring_t als;
     bcf1_t *line;
+    out_idx_t *out_idx;
+    int dp_id, pl_id, end_id;   // header ids, looked up on the first gvcf_write() call, -2 before
 };
 
+// The i-th value of a packed integer FORMAT vector, missing and vector_end
+// values converted to their int32 counterparts
+static inline int32_t fmt_int32(const bcf_fmt_t *fmt, int i)
+{
+    switch (fmt->type)
+    {
+        case BCF_BT_INT8:
+        {
+            int8_t v = ((int8_t*)fmt->p)[i];
+            if ( v==bcf_int8_missing ) return bcf_int32_missing;
+            if ( v==bcf_int8_vector_end ) return bcf_int32_vector_end;
+            return v;
+        }
+        case BCF_BT_INT16:
+        {
+            int16_t v = ((int16_t*)fmt->p)[i];
+            if ( v==bcf_int16_missing ) return bcf_int32_missing;
+            if ( v==bcf_int16_vector_end ) return bcf_int32_vector_end;
+            return v;
+        }
+        case BCF_BT_INT32: return ((int32_t*)fmt->p)[i];
+    }
+    error("Unexpected type of FORMAT field: %d\n", fmt->type);
+    return 0;
+}
+
 void gvcf_update_header(gvcf_t *gvcf, bcf_hdr_t *hdr)
 {
     bcf_hdr_append(hdr,"##INFO=<ID=END,Number=1,Type=Integer,Description=\"End position of the variant described in this record\">");
     bcf_hdr_append(hdr,"##INFO=<ID=MinDP,Number=1,Type=Integer,Description=\"Minimum per-sample depth in this gVCF block\">");
 }
 
+void gvcf_set_out_idx(gvcf_t *gvcf, out_idx_t *idx)
+{
+    gvcf->out_idx = idx;
+}
+
 gvcf_t *gvcf_init(const char *dp_ranges)
 {
     gvcf_t *gvcf = (gvcf_t*) calloc(1,sizeof(gvcf_t));
     gvcf->line = bcf_init();
+    gvcf->dp_id = gvcf->pl_id = gvcf->end_id = -2;
 
     int n = 1;
     const char *ss = dp_ranges;
@@ -77,7 +111,6 @@ void gvcf_destroy(gvcf_t *gvcf)
     free(gvcf->dp_range);
     free(gvcf->dp);
     free(gvcf->pl);
-    free(gvcf->tmp);
     free(gvcf->qsum);
     free(gvcf->gts);
     free(gvcf->als.s);
@@ -87,30 +120,43 @@ void gvcf_destroy(gvcf_t *gvcf)
 
 bcf1_t *gvcf_write(gvcf_t *gvcf, htsFile *fh, bcf_hdr_t *hdr, bcf1_t *rec, int is_ref)
 {
-    int i, ret, nsmpl = bcf_hdr_nsamples(hdr);
+    int i, nsmpl = bcf_hdr_nsamples(hdr);
     int can_collapse = is_ref ? 1 : 0;
     int32_t dp_range = 0, min_dp = 0;
 
     // No record and nothing to flush?
     if ( !rec && !gvcf->prev_range ) return NULL;
 
+    if ( gvcf->dp_id==-2 )
+    {
+        gvcf->dp_id  = bcf_hdr_id2int(hdr, BCF_DT_ID, "DP");
+        gvcf->pl_id  = bcf_hdr_id2int(hdr, BCF_DT_ID, "PL");
+        gvcf->end_id = bcf_hdr_id2int(hdr, BCF_DT_ID, "END");
+    }
+
     // Flush gVCF block if there are no more records, chr changed, a gap
     // encountered, or other conditions not met (block broken by a non-ref or DP too low).
     int needs_flush = can_collapse ? 0 : 1;
 
 
     // Can the record be included in a gVCF block? That is, is this a ref-only site?
+    // The per-site values are read directly from the packed record, the block
+    // is encoded only once, when flushed
+    bcf_fmt_t *dp_fmt = NULL;
     if ( rec && can_collapse )
     {
         bcf_unpack(rec, BCF_UN_ALL);
 
         // per-sample depth
-        ret = bcf_get_format_int32(hdr, rec, "DP", &gvcf->tmp, &gvcf->mtmp);
-        if ( ret==nsmpl )
+        dp_fmt = gvcf->dp_id>=0 ? bcf_get_fmt_id(rec, gvcf->dp_id) : NULL;
+        if ( dp_fmt && dp_fmt->n==1 && nsmpl )
         {
-            min_dp = gvcf->tmp[0];
+            min_dp = fmt_int32(dp_fmt, 0);
             for (i=1; i<nsmpl; i++)
-                if ( min_dp > gvcf->tmp[i] ) min_dp = gvcf->tmp[i];
+            {
+                int32_t dp = fmt_int32(dp_fmt, i);
+                if ( min_dp > dp ) min_dp = dp;
+            }
 
             for (i=0; i<gvcf->ndp_range; i++)
                 if ( min_dp < gvcf->dp_range[i] ) break;
@@ -156,7 +202,7 @@ bcf1_t *gvcf_write(gvcf_t *gvcf, htsFile *fh, bcf_hdr_t *hdr, bcf1_t *rec, int i
         if ( gvcf->npl>0 )
             bcf_update_format_int32(hdr, gvcf->line, "PL", gvcf->pl, gvcf->npl);
         bcf_update_format_int32(hdr, gvcf->line, "DP", gvcf->dp, nsmpl);
-        bcf_write1(fh, hdr, gvcf->line);
+        out_idx_write(gvcf->out_idx, fh, hdr, gvcf->line);
         gvcf->prev_range = 0;
         gvcf->rid  = -1;
         gvcf->npl  = 0;
@@ -171,7 +217,7 @@ bcf1_t *gvcf_write(gvcf_t *gvcf, htsFile *fh, bcf_hdr_t *hdr, bcf1_t *rec, int i
         if ( !gvcf->prev_range )
         {
             hts_expand(int32_t,nsmpl,gvcf->mdp,gvcf->dp);
-            memcpy(gvcf->dp,gvcf->tmp,nsmpl*sizeof(int32_t));   // tmp still contains DP from rec
+            for (i=0; i<nsmpl; i++) gvcf->dp[i] = fmt_int32(dp_fmt, i);
             gvcf->npl = bcf_get_format_int32(hdr, rec, "PL", &gvcf->pl, &gvcf->mpl);
 
             gvcf->nqsum = bcf_get_info_float(hdr,rec,"QS",&gvcf->qsum,&gvcf->mqsum);
@@ -192,28 +238,33 @@ bcf1_t *gvcf_write(gvcf_t *gvcf, htsFile *fh, bcf_hdr_t *hdr, bcf1_t *rec, int i
         {
             if ( gvcf->min_dp > min_dp ) gvcf->min_dp = min_dp;
             for (i=0; i<nsmpl; i++)
-                if ( gvcf->dp[i] > gvcf->tmp[i] ) gvcf->dp[i] = gvcf->tmp[i];
-            ret = bcf_get_format_int32(hdr, rec, "PL", &gvcf->tmp, &gvcf->mtmp);
-            if ( ret>=0 )
             {
-                if ( ret!=nsmpl*3 ) error("Unexpected number of PL fields\n");
+                int32_t dp = fmt_int32(dp_fmt, i);
+                if ( gvcf->dp[i] > dp ) gvcf->dp[i] = dp;
+            }
+            bcf_fmt_t *pl_fmt = gvcf->pl_id>=0 ? bcf_get_fmt_id(rec, gvcf->pl_id) : NULL;
+            if ( pl_fmt && gvcf->npl>0 )
+            {
+                if ( pl_fmt->n!=3 ) error("Unexpected number of PL fields\n");
                 for (i=0; i<nsmpl; i++)
                 {
-                    if ( gvcf->pl[3*i+1] > gvcf->tmp[3*i+1] )
+                    int32_t pl1 = fmt_int32(pl_fmt, 3*i+1), pl2 = fmt_int32(pl_fmt, 3*i+2);
+                    if ( gvcf->pl[3*i+1] > pl1 )
                     {
-                        gvcf->pl[3*i+1] = gvcf->tmp[3*i+1];
-                        gvcf->pl[3*i+2] = gvcf->tmp[3*i+2];
+                        gvcf->pl[3*i+1] = pl1;
+                        gvcf->pl[3*i+2] = pl2;
                     }
-                    else if ( gvcf->pl[3*i+1]==gvcf->tmp[3*i+1] && gvcf->pl[3*i+2] > gvcf->tmp[3*i+2] )
-                        gvcf->pl[3*i+2] = gvcf->tmp[3*i+2];
+                    else if ( gvcf->pl[3*i+1]==pl1 && gvcf->pl[3*i+2] > pl2 )
+                        gvcf->pl[3*i+2] = pl2;
                 }
             }
             else
                 gvcf->npl = 0;
         }
         gvcf->prev_range = dp_range;
-        if ( bcf_get_info_int32(hdr,rec,"END",&gvcf->tmp,&gvcf->mtmp)==1 )
-            gvcf->end = gvcf->tmp[0] - 1;   // from 1-based to 0-based
+        bcf_info_t *end_info = gvcf->end_id>=0 ? bcf_get_info_id(rec, gvcf->end_id) : NULL;
+        if ( end_info && end_info->len==1 && end_info->type!=BCF_BT_FLOAT && end_info->type!=BCF_BT_CHAR )
+            gvcf->end = end_info->v1.i - 1;   // from 1-based to 0-based
         else
             gvcf->end = rec->pos;
         return NULL;
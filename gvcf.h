@@ -35,6 +35,7 @@ typedef struct _gvcf_t gvcf_t;
 
 gvcf_t *gvcf_init(const char *dp_ranges);
 void gvcf_update_header(gvcf_t *gvcf, bcf_hdr_t *hdr);
+void gvcf_set_out_idx(gvcf_t *gvcf, out_idx_t *idx);   // index the written blocks, see out_idx_init()
 bcf1_t *gvcf_write(gvcf_t *gvcf, htsFile *fh, bcf_hdr_t *hdr, bcf1_t *rec, int is_ref);
 void gvcf_destroy(gvcf_t *gvcf);
 
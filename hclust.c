@@ -122,6 +122,32 @@ void hclust_debug(hclust_t *clust)
 }
 #endif
 
+/*
+    The nearest neighbour of a cluster among the clusters preceding it in the
+    list, ties resolved in favour of the earlier one. When the previous nearest
+    neighbour was merged, its distance is a lower bound of the new one as the
+    complete-linkage distances never decrease, and the scan can stop at the
+    first cluster at that distance.
+*/
+static void update_nn(hclust_t *clust, node_t *node, node_t **nn, float *nn_dist, float min_bound)
+{
+    float min_value = HUGE_VAL;
+    node_t *min_node = NULL, *iclust = clust->first;
+    while ( iclust!=node )
+    {
+        float value = PDIST(clust->pdist,node->idx,iclust->idx);
+        if ( value < min_value )
+        {
+            min_value = value;
+            min_node  = iclust;
+            if ( min_value <= min_bound ) break;
+        }
+        iclust = iclust->next;
+    }
+    nn[node->idx] = min_node;
+    nn_dist[node->idx] = min_value;
+}
+
 hclust_t *hclust_init(int n, float *pdist)
 {
     hclust_t *clust = (hclust_t*) calloc(1,sizeof(hclust_t));
@@ -133,26 +159,33 @@ hclust_t *hclust_init(int n, float *pdist)
     int i;
     for (i=0; i<clust->ndat; i++) append_node(clust,i);
 
+    // Nearest preceding neighbours of all clusters, indexed by pdist index. The closest
+    // pair is then found in O(n) rather than O(n^2) steps, and only the clusters whose
+    // nearest neighbour was merged need to be updated, which keeps the search order,
+    // and therefore the tree, of the exhaustive search.
+    node_t **nn = (node_t**) malloc(sizeof(node_t*)*n);
+    float *nn_dist = (float*) malloc(sizeof(float)*n);
+    node_t *iclust = clust->first;
+    while ( iclust )
+    {
+        update_nn(clust, iclust, nn, nn_dist, -HUGE_VAL);
+        iclust = iclust->next;
+    }
+
     // build the tree
     while ( clust->nclust>1 )
     {
         // find two clusters with minimum distance
         float min_value = HUGE_VAL;
-        node_t *iclust = clust->first->next;
         node_t *min_iclust = NULL, *min_jclust = NULL;
+        iclust = clust->first->next;
         while ( iclust )
         {
-            node_t *jclust = clust->first;
-            while ( jclust!=iclust )
+            if ( nn_dist[iclust->idx] < min_value )
             {
-                float value = PDIST(clust->pdist,iclust->idx,jclust->idx);
-                if ( value < min_value ) 
-                { 
-                    min_value  = value;
-                    min_iclust = iclust;
-                    min_jclust = jclust; 
-                }
-                jclust = jclust->next;
+                min_value  = nn_dist[iclust->idx];
+                min_iclust = iclust;
+                min_jclust = nn[iclust->idx];
             }
             iclust = iclust->next;
         }
@@ -178,7 +211,20 @@ hclust_t *hclust_init(int n, float *pdist)
         node->value = min_value;
         node->akid->parent = node;
         node->bkid->parent = node;
+
+        // the new cluster is the last in the list, the nearest neighbours of the others
+        // change only if it was one of the merged clusters
+        iclust = clust->first;
+        while ( iclust!=node )
+        {
+            node_t *inn = nn[iclust->idx];
+            if ( inn==min_iclust || inn==min_jclust ) update_nn(clust, iclust, nn, nn_dist, nn_dist[iclust->idx]);
+            iclust = iclust->next;
+        }
+        update_nn(clust, node, nn, nn_dist, -HUGE_VAL);
     }
+    free(nn);
+    free(nn_dist);
 
     return clust;
 }
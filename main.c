@@ -22,14 +22,18 @@ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
 OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 THE SOFTWARE.  */
 
+#define _GNU_SOURCE     // F_SETPIPE_SZ
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 #include <htslib/hts.h>
 #include "version.h"
 #include "bcftools.h"
+#include "profile.h"
 
 int main_tabix(int argc, char *argv[]);
 int main_vcfindex(int argc, char *argv[]);
@@ -47,6 +51,7 @@ int main_vcfannotate(int argc, char *argv[]);
 int main_vcfroh(int argc, char *argv[]);
 int main_vcfconcat(int argc, char *argv[]);
 int main_reheader(int argc, char *argv[]);
+int main_vcfsort(int argc, char *argv[]);
 int main_vcfconvert(int argc, char *argv[]);
 int main_vcfcnv(int argc, char *argv[]);
 #if USE_GPL
@@ -120,6 +125,10 @@ static cmd_t cmds[] =
       .alias = "reheader",
       .help  = "modify VCF/BCF header, change sample names"
     },
+    { .func  = main_vcfsort,
+      .alias = "sort",
+      .help  = "sort VCF/BCF file"
+    },
     { .func  = main_vcfview,
       .alias = "view",
       .help  = "VCF/BCF conversion, view, subset and filter VCF/BCF files"
@@ -198,7 +207,7 @@ static void usage(FILE *fp)
 #endif
     fprintf(fp, "Version: %s (using htslib %s)\n", bcftools_version(), hts_version());
     fprintf(fp, "\n");
-    fprintf(fp, "Usage:   bcftools [--version|--version-only] [--help] <command> <argument>\n");
+    fprintf(fp, "Usage:   bcftools [--version|--version-only] [--help] [--profile] <command> <argument>\n");
     fprintf(fp, "\n");
     fprintf(fp, "Commands:\n");
 
@@ -222,11 +231,52 @@ static void usage(FILE *fp)
             " in all situations. Un-indexed VCF and BCF and streams will work in most but\n"
             " not all situations.\n");
     fprintf(fp,"\n");
+    fprintf(fp,
+            " With --profile, the time spent in the stages of view, query, merge, annotate,\n"
+            " norm, csq, call and mpileup is printed to stderr at exit.\n");
+    fprintf(fp,"\n");
+}
+
+/*
+    In pipelines like "bcftools mpileup -Ou | bcftools call -Ou | ...", the
+    default 64kB pipe buffer makes the stages wake each other for every few
+    records. When stdin or stdout is a pipe, it is enlarged so that a stage
+    can hand over whole batches of records at a time. Linux only, the limit
+    for unprivileged users is /proc/sys/fs/pipe-max-size.
+*/
+#define PIPE_SIZE (1<<20)
+static void enlarge_pipes(void)
+{
+#ifdef F_SETPIPE_SZ
+    int size = PIPE_SIZE, fd;
+    FILE *fp = fopen("/proc/sys/fs/pipe-max-size", "r");
+    if ( fp )
+    {
+        int max;
+        if ( fscanf(fp, "%d", &max)==1 && max < size ) size = max;
+        fclose(fp);
+    }
+    for (fd=0; fd<=1; fd++)
+    {
+        struct stat st;
+        if ( fstat(fd, &st)!=0 || !S_ISFIFO(st.st_mode) ) continue;
+        if ( fcntl(fd, F_GETPIPE_SZ) < size ) fcntl(fd, F_SETPIPE_SZ, size);  // failure is not an error
+    }
+#endif
 }
 
 int main(int argc, char *argv[])
 {
     if (argc < 2) { usage(stderr); return 1; }
+    enlarge_pipes();
+
+    if ( !strcmp(argv[1], "--profile") )
+    {
+        profile_init();
+        argv++;
+        argc--;
+        if (argc < 2) { usage(stderr); return 1; }
+    }
 
     if (strcmp(argv[1], "version") == 0 || strcmp(argv[1], "--version") == 0 || strcmp(argv[1], "-v") == 0) {
         printf("bcftools %s\nUsing htslib %s\nCopyright (C) 2016 Genome Research Ltd.\n", bcftools_version(), hts_version());
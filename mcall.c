@@ -203,7 +203,6 @@ static void mcall_init_trios(call_t *call)
         assert( n==call->ntrio[FTYPE_100][nals] );
 
     }
-    call->GLs = (double*) calloc(bcf_hdr_nsamples(call->hdr)*10,sizeof(double));
 
     int i, j;
     for (i=0; i<call->nfams; i++)
@@ -244,10 +243,9 @@ static void mcall_destroy_trios(call_t *call)
             free(call->trio[j][i]);
 }
 
-void mcall_init(call_t *call)
+// Per-site working buffers, private to each call_t
+static void mcall_init_scratch(call_t *call)
 {
-    call_init_pl2p(call);
-
     call->nqsum = 5;
     call->qsum  = (float*) malloc(sizeof(float)*call->nqsum); // will be expanded later if ncessary
     call->nals_map = 5;
@@ -255,11 +253,39 @@ void mcall_init(call_t *call)
     call->npl_map  = 5*(5+1)/2;     // will be expanded later if necessary
     call->pl_map   = (int*) malloc(sizeof(int)*call->npl_map);
     call->gts  = (int32_t*) calloc(bcf_hdr_nsamples(call->hdr)*2,sizeof(int32_t));   // assuming at most diploid everywhere
-
     if ( call->flag & CALL_CONSTR_TRIO )
     {
         call->cgts = (int32_t*) calloc(bcf_hdr_nsamples(call->hdr),sizeof(int32_t));
         call->ugts = (int32_t*) calloc(bcf_hdr_nsamples(call->hdr),sizeof(int32_t));
+        call->GLs  = (double*) calloc(bcf_hdr_nsamples(call->hdr)*10,sizeof(double));
+    }
+    if ( call->output_tags & (CALL_FMT_GQ|CALL_FMT_GP) )
+        call->GQs = (int32_t*) malloc(sizeof(int32_t)*bcf_hdr_nsamples(call->hdr));
+}
+static void mcall_destroy_scratch(call_t *call)
+{
+    free(call->itmp);
+    free(call->GPs);
+    free(call->GLs);
+    free(call->GQs);
+    free(call->anno16);
+    free(call->PLs);
+    free(call->qsum);
+    free(call->als_map);
+    free(call->pl_map);
+    free(call->gts); free(call->cgts); free(call->ugts);
+    free(call->pdg);
+    free(call->als);
+    free(call->ac);
+}
+
+void mcall_init(call_t *call)
+{
+    call_init_pl2p(call);
+    mcall_init_scratch(call);
+
+    if ( call->flag & CALL_CONSTR_TRIO )
+    {
         mcall_init_trios(call);
         bcf_hdr_append(call->hdr,"##FORMAT=<ID=CGT,Number=1,Type=Integer,Description=\"Constrained Genotype (0-based index to Number=G ordering).\">");
         bcf_hdr_append(call->hdr,"##FORMAT=<ID=UGT,Number=1,Type=Integer,Description=\"Unconstrained Genotype (0-based index to Number=G ordering).\">");
@@ -271,8 +297,6 @@ void mcall_init(call_t *call)
         bcf_hdr_append(call->hdr,"##FORMAT=<ID=GQ,Number=1,Type=Integer,Description=\"Phred-scaled Genotype Quality\">");
     if ( call->output_tags & CALL_FMT_GP )
         bcf_hdr_append(call->hdr,"##FORMAT=<ID=GP,Number=G,Type=Float,Description=\"Phred-scaled genotype posterior probabilities\">");
-    if ( call->output_tags & (CALL_FMT_GQ|CALL_FMT_GP) )
-        call->GQs = (int32_t*) malloc(sizeof(int32_t)*bcf_hdr_nsamples(call->hdr));
     bcf_hdr_append(call->hdr,"##INFO=<ID=ICB,Number=1,Type=Float,Description=\"Inbreeding Coefficient Binomial test (bigger is better)\">");
     bcf_hdr_append(call->hdr,"##INFO=<ID=HOB,Number=1,Type=Float,Description=\"Bias in the number of HOMs number (smaller is better)\">");
     bcf_hdr_append(call->hdr,"##INFO=<ID=AC,Number=A,Type=Integer,Description=\"Allele count in genotypes for each ALT allele, in the same order as listed\">");
@@ -308,23 +332,32 @@ void mcall_init(call_t *call)
 void mcall_destroy(call_t *call)
 {
     if (call->vcmp) vcmp_destroy(call->vcmp);
-    free(call->itmp);
     mcall_destroy_trios(call);
-    free(call->GPs);
-    free(call->GLs);
-    free(call->GQs);
-    free(call->anno16);
-    free(call->PLs);
-    free(call->qsum);
-    free(call->als_map);
-    free(call->pl_map);
-    free(call->gts); free(call->cgts); free(call->ugts);
-    free(call->pdg);
-    free(call->als);
-    free(call->ac);
+    mcall_destroy_scratch(call);
     return;
 }
 
+void mcall_init_worker(call_t *call, const call_t *src)
+{
+    *call = *src;
+    call->GPs = NULL; call->nGPs = 0;
+    call->itmp = NULL; call->n_itmp = 0;
+    call->PLs = NULL; call->nPLs = call->mPLs = 0;
+    call->pdg = NULL; call->npdg = 0;
+    call->anno16 = NULL; call->n16 = 0;
+    call->als = NULL; call->nals = 0;
+    call->ac = NULL; call->nac = 0;
+    call->cgts = call->ugts = NULL;
+    call->GLs = NULL;
+    call->GQs = NULL;
+    call->vcmp = NULL;
+    mcall_init_scratch(call);
+}
+void mcall_destroy_worker(call_t *call)
+{
+    mcall_destroy_scratch(call);
+}
+
 
 // Inits P(D|G): convert PLs from log space and normalize. In case of zero
 // depth, missing PLs are all zero. In this case, pdg's are set to 0
@@ -347,18 +380,27 @@ void set_pdg(double *pl2p, int *PLs, double *pdg, int n_smpl, int n_gt, int unse
 
     for (i=0; i<n_smpl; i++)
     {
+        // Fast path for the common case: diploid, no missing values and all PLs
+        // within the pl2p table (the missing values are negative)
         double sum = 0;
         for (j=0; j<n_gt; j++)
+            if ( (uint32_t)PLs[j] > 255 ) break;
+        if ( j==n_gt )
+            for (j=0; j<n_gt; j++) sum += pdg[j] = pl2p[PLs[j]];
+        else
         {
-            if ( PLs[j]==bcf_int32_vector_end )
+            for (j=0; j<n_gt; j++)
             {
-                // We expect diploid genotype likelihoods. If not diploid, treat as missing
-                j = 0;
-                break;
+                if ( PLs[j]==bcf_int32_vector_end )
+                {
+                    // We expect diploid genotype likelihoods. If not diploid, treat as missing
+                    j = 0;
+                    break;
+                }
+                if ( PLs[j]==bcf_int32_missing ) break;
+                pdg[j] = PLs[j] < 256 ? pl2p[PLs[j]] : pow(10., -PLs[j]/10.);
+                sum += pdg[j];
             }
-            if ( PLs[j]==bcf_int32_missing ) break;
-            pdg[j] = PLs[j] < 256 ? pl2p[PLs[j]] : pow(10., -PLs[j]/10.);
-            sum += pdg[j];
         }
 
         if ( j==0 )
@@ -577,6 +619,34 @@ static inline double logsumexp2(double a, double b)
 
 #define SWAP(type_t,x,y) {type_t tmp; tmp = x; x = y; y = tmp; }
 
+// Accumulator of log-likelihoods summed over samples. The likelihoods are multiplied
+// and log() is called only when the product approaches underflow, instead of once
+// per sample. Zero likelihoods are skipped, as is done throughout.
+#define LK_FLUSH 1e-150
+typedef struct
+{
+    double prod, lk;
+    int set;
+}
+lk_acc_t;
+
+static inline void lk_acc_init(lk_acc_t *acc)
+{
+    acc->prod = 1; acc->lk = 0; acc->set = 0;
+}
+static inline void lk_acc_add(lk_acc_t *acc, double val)
+{
+    if ( !val ) return;
+    acc->set = 1;
+    if ( val < LK_FLUSH ) { acc->lk += log(val); return; }
+    acc->prod *= val;
+    if ( acc->prod < LK_FLUSH ) { acc->lk += log(acc->prod); acc->prod = 1; }
+}
+static inline double lk_acc_sum(lk_acc_t *acc)
+{
+    return acc->prod==1 ? acc->lk : acc->lk + log(acc->prod);
+}
+
 // Determine the most likely combination of alleles. In this implementation,
 // at most tri-allelic sites are considered. Returns the number of alleles.
 static int mcall_find_best_alleles(call_t *call, int nals, int *out_als)
@@ -589,18 +659,20 @@ static int mcall_find_best_alleles(call_t *call, int nals, int *out_als)
     int ngts  = nals*(nals+1)/2;
 
     // Single allele
+    lk_acc_t acc;
     for (ia=0; ia<nals; ia++)
     {
-        double lk_tot  = 0;
-        int lk_tot_set = 0;
         int iaa = (ia+1)*(ia+2)/2-1;    // index in PL which corresponds to the homozygous "ia/ia" genotype
         int isample;
         double *pdg = call->pdg + iaa;
+        lk_acc_init(&acc);
         for (isample=0; isample<nsmpl; isample++)
         {
-            if ( *pdg ) { lk_tot += log(*pdg); lk_tot_set = 1; }
+            lk_acc_add(&acc, *pdg);
             pdg += ngts;
         }
+        double lk_tot  = lk_acc_sum(&acc);
+        int lk_tot_set = acc.set;
         if ( ia==0 ) ref_lk = lk_tot;   // likelihood of 0/0 for all samples
         else lk_tot += call->theta; // the prior
         UPDATE_MAX_LKs(1<<ia, ia>0 && lk_tot_set);
@@ -616,8 +688,6 @@ static int mcall_find_best_alleles(call_t *call, int nals, int *out_als)
             for (ib=0; ib<ia; ib++)
             {
                 if ( call->qsum[ib]==0 ) continue;
-                double lk_tot  = 0;
-                int lk_tot_set = 0;
                 double fa  = call->qsum[ia]/(call->qsum[ia]+call->qsum[ib]);
                 double fb  = call->qsum[ib]/(call->qsum[ia]+call->qsum[ib]);
                 double fa2 = fa*fa;
@@ -625,6 +695,7 @@ static int mcall_find_best_alleles(call_t *call, int nals, int *out_als)
                 double fab = 2*fa*fb;
                 int isample, ibb = (ib+1)*(ib+2)/2-1, iab = iaa - ia + ib;
                 double *pdg  = call->pdg;
+                lk_acc_init(&acc);
                 for (isample=0; isample<nsmpl; isample++)
                 {
                     double val = 0;
@@ -632,9 +703,11 @@ static int mcall_find_best_alleles(call_t *call, int nals, int *out_als)
                         val = fa2*pdg[iaa] + fb2*pdg[ibb] + fab*pdg[iab];
                     else if ( call->ploidy && call->ploidy[isample]==1 )
                         val = fa*pdg[iaa] + fb*pdg[ibb];
-                    if ( val ) { lk_tot += log(val); lk_tot_set = 1; }
+                    lk_acc_add(&acc, val);
                     pdg += ngts;
                 }
+                double lk_tot  = lk_acc_sum(&acc);
+                int lk_tot_set = acc.set;
                 if ( ia!=0 ) lk_tot += call->theta;    // the prior
                 if ( ib!=0 ) lk_tot += call->theta;
                 UPDATE_MAX_LKs(1<<ia|1<<ib, lk_tot_set);
@@ -657,8 +730,6 @@ static int mcall_find_best_alleles(call_t *call, int nals, int *out_als)
                 for (ic=0; ic<ib; ic++)
                 {
                     if ( call->qsum[ic]==0 ) continue;
-                    double lk_tot  = 0;
-                    int lk_tot_set = 1;
                     double fa  = call->qsum[ia]/(call->qsum[ia]+call->qsum[ib]+call->qsum[ic]);
                     double fb  = call->qsum[ib]/(call->qsum[ia]+call->qsum[ib]+call->qsum[ic]);
                     double fc  = call->qsum[ic]/(call->qsum[ia]+call->qsum[ib]+call->qsum[ic]);
@@ -669,6 +740,7 @@ static int mcall_find_best_alleles(call_t *call, int nals, int *out_als)
                     int isample, icc = (ic+1)*(ic+2)/2-1;
                     int iac = iaa - ia + ic, ibc = ibb - ib + ic;
                     double *pdg = call->pdg;
+                    lk_acc_init(&acc);
                     for (isample=0; isample<nsmpl; isample++)
                     {
                         double val = 0;
@@ -676,9 +748,11 @@ static int mcall_find_best_alleles(call_t *call, int nals, int *out_als)
                             val = fa2*pdg[iaa] + fb2*pdg[ibb] + fc2*pdg[icc] + fab*pdg[iab] + fac*pdg[iac] + fbc*pdg[ibc];
                         else if ( call->ploidy && call->ploidy[isample]==1 )
                             val = fa*pdg[iaa] + fb*pdg[ibb] + fc*pdg[icc];
-                        if ( val ) { lk_tot += log(val); lk_tot_set = 1; }
+                        lk_acc_add(&acc, val);
                         pdg += ngts;
                     }
+                    double lk_tot  = lk_acc_sum(&acc);
+                    int lk_tot_set = 1;     // as before, for tri-allelic combinations always added to the sum
                     if ( ia!=0 ) lk_tot += call->theta;    // the prior
                     if ( ib!=0 ) lk_tot += call->theta;    // the prior
                     if ( ic!=0 ) lk_tot += call->theta;    // the prior
@@ -1002,6 +1076,12 @@ static void mcall_call_trio_genotypes(call_t *call, bcf1_t *rec, int nals, int n
         }
     }
 
+    // The prior log(1 - Pm*(1 - Pkij)) depends only on the 2/Pkij code of the
+    // trio table (1, 2, 4 or 8), evaluate it once per site
+    double trio_lprior[16];
+    for (i=1; i<16; i<<=1)
+        trio_lprior[i] = log(1 - trio_Pm * (1 - (double)2/i));
+
     // Calculate constrained likelihoods and determine genotypes
     int ifm;
     for (ifm=0; ifm<call->nfams; ifm++)
@@ -1012,45 +1092,59 @@ static void mcall_call_trio_genotypes(call_t *call, bcf1_t *rec, int nals, int n
 
         // Unconstrained likelihood
         int uc_itr = 0;
-        double uc_lk = 0;
+        double uc_lk = 0, gl_max[3];
+        double *fam_gl[3];
         for (i=0; i<3; i++)     // for father, mother, child
         {
             int ismpl = fam->sample[i];
             double *gl = call->GLs + nout_gts*ismpl;
-            if ( gl[0]==1 ) continue;
+            assert( !call->ploidy || call->ploidy[ismpl]>0 || gl[0]==1 );
+            fam_gl[i] = gl[0]==1 ? NULL : gl;
+            if ( !fam_gl[i] ) continue;
             int j, jmax = 0;
             double max  = gl[0];
             for (j=1; j<nout_gts; j++)
                 if ( max < gl[j] ) { max = gl[j]; jmax = j; }
             uc_lk += max;
             uc_itr |= jmax << ((2-i)*4);
+            gl_max[i] = max;
         }
 
-        // Best constrained likelihood
-        int c_itr = -1, itr, uc_is_mendelian = 0;
+        // Best constrained likelihood. The combinations are ordered by the
+        // parents' genotypes and, in the families with both parents and Pm>=0,
+        // all priors are not positive: once the parents' likelihood plus the
+        // child's best cannot exceed the best combination so far, skip to the
+        // next pair
+        int prune = fam->type <= FTYPE_122 && trio_Pm >= 0;
+        int c_itr = -1, itr, uc_is_mendelian = 0, pair = -1, skip_pair = 0;
         double c_lk = -HUGE_VAL;
         for (itr=0; itr<ntrio; itr++)   // for each trio genotype combination
         {
+            if ( uc_itr==trio[itr] ) uc_is_mendelian = 1;
+            if ( prune && pair!=(trio[itr] & 0xff0) )
+            {
+                pair = trio[itr] & 0xff0;
+                double bound = 0;
+                if ( fam_gl[0] ) bound += fam_gl[0][trio[itr]>>8 & 0xf];
+                if ( fam_gl[1] ) bound += fam_gl[1][trio[itr]>>4 & 0xf];
+                if ( fam_gl[2] ) bound += gl_max[2];
+                skip_pair = bound <= c_lk;
+            }
+            if ( skip_pair ) continue;
+
             double lk = 0;
             int npresent = 0;
             for (i=0; i<3; i++)     // for father, mother, child
             {
-                int ismpl = fam->sample[i];
-                double *gl = call->GLs + nout_gts*ismpl;
-                if ( gl[0]==1 ) continue;
+                if ( !fam_gl[i] ) continue;
                 int igt = trio[itr]>>((2-i)*4) & 0xf;
-                assert( !call->ploidy || call->ploidy[ismpl]>0 );
                 if ( igt==GT_SKIP ) continue;
-                lk += gl[igt];
+                lk += fam_gl[i][igt];
                 npresent++;
-                // fprintf(stderr," %e", gl[igt]);
             }
-            // fprintf(stderr,"\t\t");
-            double Pkij = npresent==3 ? (double)2/(trio[itr]>>12) : 1;  // with missing genotypes Pkij's are different
-            lk += log(1 - trio_Pm * (1 - Pkij));
-            // fprintf(stderr,"%d%d%d\t%e\t%.2f\n", trio[itr]>>8&0xf,trio[itr]>>4&0xf,trio[itr]&0xf, lk, Pkij);
+            // with missing genotypes Pkij's are different: Pkij=1 and the prior is zero
+            if ( npresent==3 ) lk += trio_lprior[trio[itr]>>12];
             if ( c_lk < lk ) { c_lk = lk; c_itr = trio[itr]; }
-            if ( uc_itr==trio[itr] ) uc_is_mendelian = 1;
         }
 
         if ( !uc_is_mendelian )
@@ -32,6 +32,7 @@ DEALINGS IN THE SOFTWARE.  */
 #include <strings.h>
 #include <limits.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <sys/stat.h>
 #include <getopt.h>
 #include <htslib/sam.h>
@@ -44,6 +45,8 @@ DEALINGS IN THE SOFTWARE.  */
 #include "bam2bcf.h"
 #include "bam_sample.h"
 #include "gvcf.h"
+#include "profile.h"
+#include "shard.h"
 
 #define MPLP_BCF        1
 #define MPLP_VCF        (1<<1)
@@ -59,6 +62,12 @@ DEALINGS IN THE SOFTWARE.  */
 #define MPLP_PER_SAMPLE (1<<11)
 #define MPLP_SMART_OVERLAPS (1<<12)
 
+// With --shard-threads, the maximum length of a shard
+#define MPLP_SHARD_SIZE 1000000
+
+// Targets closer than this are read with a single index jump
+#define MPLP_TARGET_GAP 1000
+
 typedef struct _mplp_aux_t mplp_aux_t;
 typedef struct _mplp_pileup_t mplp_pileup_t;
 
@@ -69,7 +78,7 @@ typedef struct {
     int openQ, extQ, tandemQ, min_support; // for indels
     double min_frac; // for indels
     char *reg_fname, *pl_list, *fai_fname, *output_fname;
-    int reg_is_file, record_cmd_line, n_threads;
+    int reg_is_file, record_cmd_line, n_threads, shard_threads, read_stats;
     faidx_t *fai;
     regidx_t *bed, *reg;    // bed: skipping regions, reg: index-jump to regions
     regitr_t *bed_itr, *reg_itr;
@@ -104,6 +113,27 @@ typedef struct {
 
 #define MPLP_REF_INIT {{NULL,NULL},{-1,-1},{0,0}}
 
+// BAQ qualities of reads which extend beyond the end of a region, for reuse
+// when the reads are read again by the next region
+typedef struct
+{
+    int32_t pos;
+    uint16_t flag;
+    int l_qname, n_cigar, l_qseq;
+    size_t off;         // qname, cigar, the original and BAQ qualities in baq_list_t.dat
+}
+baq_read_t;
+
+typedef struct
+{
+    baq_read_t *read;
+    int nread, mread, iread;    // iread: the lookup position, the reads come in the same order
+    int tid;                    // -1 when not caching
+    uint32_t end;               // end of the region the reads were cached for
+    kstring_t dat;
+}
+baq_list_t;
+
 // Data specific to each bam file
 struct _mplp_aux_t {
     samFile *fp;
@@ -113,6 +143,9 @@ struct _mplp_aux_t {
     const mplp_conf_t *conf;
     int bam_id;
     hts_idx_t *idx;     // maintained only with more than one -r regions
+    bam_smpl_cache_t rg_cache;  // the last read group, looked up by mplp_func and pileup_constructor
+    baq_list_t baq_prev, baq_next;  // BAQ of reads cached in the previous region and for the next one
+    uint64_t nread, nused;      // --read-stats counters, reset by mpileup_reg
 };
 
 // Data passed to htslib/mpileup
@@ -179,6 +212,87 @@ static int mplp_get_ref(mplp_aux_t *ma, int tid,  char **ref, int *ref_len) {
     return 1;
 }
 
+static void baq_list_destroy(baq_list_t *list)
+{
+    free(list->read);
+    free(list->dat.s);
+}
+
+// Called at the start of each region, tid=-1 disables the caching
+static void mplp_baq_region(mplp_aux_t *ma, int tid, uint32_t end)
+{
+    baq_list_t tmp = ma->baq_prev;
+    ma->baq_prev = ma->baq_next;
+    ma->baq_next = tmp;
+    ma->baq_prev.iread = 0;
+    ma->baq_next.nread = 0;
+    ma->baq_next.dat.l = 0;
+    ma->baq_next.tid   = tid;
+    ma->baq_next.end   = end;
+    if ( tid<0 ) ma->baq_prev.tid = -1;
+}
+
+static int baq_list_get(baq_list_t *list, bam1_t *b)
+{
+    if ( list->tid<0 || list->tid!=b->core.tid || b->core.pos > list->end ) return 0;
+    while ( list->iread < list->nread && list->read[list->iread].pos < b->core.pos ) list->iread++;
+    int i;
+    for (i=list->iread; i<list->nread && list->read[i].pos==b->core.pos; i++)
+    {
+        baq_read_t *read = &list->read[i];
+        if ( read->flag!=b->core.flag || read->l_qseq!=b->core.l_qseq || read->n_cigar!=b->core.n_cigar || read->l_qname!=b->core.l_qname ) continue;
+        char *dat = list->dat.s + read->off;
+        if ( memcmp(dat, bam_get_qname(b), read->l_qname) ) continue;
+        dat += read->l_qname;
+        if ( memcmp(dat, bam_get_cigar(b), read->n_cigar*4) ) continue;
+        dat += read->n_cigar*4;
+        if ( memcmp(dat, bam_get_qual(b), read->l_qseq) ) continue;
+        dat += read->l_qseq;
+        memcpy(bam_get_qual(b), dat, read->l_qseq);
+        return 1;
+    }
+    return 0;
+}
+
+// Called with the original qualities, the BAQ qualities are added by baq_list_set_baq()
+static void baq_list_push(baq_list_t *list, bam1_t *b)
+{
+    list->nread++;
+    hts_expand(baq_read_t, list->nread, list->mread, list->read);
+    baq_read_t *read = &list->read[list->nread-1];
+    read->pos     = b->core.pos;
+    read->flag    = b->core.flag;
+    read->l_qname = b->core.l_qname;
+    read->n_cigar = b->core.n_cigar;
+    read->l_qseq  = b->core.l_qseq;
+    read->off     = list->dat.l;
+    kputsn_((char*)bam_get_qname(b), read->l_qname, &list->dat);
+    kputsn_((char*)bam_get_cigar(b), read->n_cigar*4, &list->dat);
+    kputsn_((char*)bam_get_qual(b), read->l_qseq, &list->dat);
+}
+static void baq_list_set_baq(baq_list_t *list, bam1_t *b)
+{
+    kputsn_((char*)bam_get_qual(b), b->core.l_qseq, &list->dat);
+}
+
+static void mplp_realn(mplp_aux_t *ma, bam1_t *b, char *ref, int ref_len)
+{
+    int flag = (ma->conf->flag & MPLP_REDO_BAQ)? 7 : 3;
+
+    // Reads with BQ tags are cheap and have the tag removed, they are not cached
+    if ( ma->baq_next.tid<0 || bam_aux_get(b,"BQ") )
+    {
+        sam_prob_realn(b, ref, ref_len, flag);
+        return;
+    }
+    if ( baq_list_get(&ma->baq_prev, b) ) return;
+
+    int keep = b->core.tid==ma->baq_next.tid && bam_endpos(b) > ma->baq_next.end + 1;
+    if ( keep ) baq_list_push(&ma->baq_next, b);
+    sam_prob_realn(b, ref, ref_len, flag);
+    if ( keep ) baq_list_set_baq(&ma->baq_next, b);
+}
+
 static int mplp_func(void *data, bam1_t *b)
 {
     char *ref;
@@ -189,6 +303,7 @@ static int mplp_func(void *data, bam1_t *b)
         int has_ref;
         ret = ma->iter? sam_itr_next(ma->fp, ma->iter, b) : sam_read1(ma->fp, ma->h, b);
         if (ret < 0) break;
+        ma->nread++;
         // The 'B' cigar operation is not part of the specification, considering as obsolete.
         //  bam_remove_B(b);
         if (b->core.tid < 0 || (b->core.flag&BAM_FUNMAP)) continue; // exclude unmapped reads
@@ -211,7 +326,7 @@ static int mplp_func(void *data, bam1_t *b)
             }
             if ( !overlap ) continue;
         }
-        if ( bam_smpl_get_sample_id(ma->conf->bsmpl,ma->bam_id,b)<0 ) continue;
+        if ( bam_smpl_get_sample_id_cached(ma->conf->bsmpl,ma->bam_id,b,&ma->rg_cache)<0 ) continue;
         if (ma->conf->flag & MPLP_ILLUMINA13) {
             int i;
             uint8_t *qual = bam_get_qual(b);
@@ -230,7 +345,7 @@ static int mplp_func(void *data, bam1_t *b)
             has_ref = 0;
         }
 
-        if (has_ref && (ma->conf->flag&MPLP_REALN)) sam_prob_realn(b, ref, ref_len, (ma->conf->flag & MPLP_REDO_BAQ)? 7 : 3);
+        if (has_ref && (ma->conf->flag&MPLP_REALN)) mplp_realn(ma, b, ref, ref_len);
         if (has_ref && ma->conf->capQ_thres > 10) {
             int q = sam_cap_mapq(b, ref, ref_len, ma->conf->capQ_thres);
             if (q < 0) continue;    // skip
@@ -239,6 +354,7 @@ static int mplp_func(void *data, bam1_t *b)
         if (b->core.qual < ma->conf->min_mq) continue;
         else if ((ma->conf->flag&MPLP_NO_ORPHAN) && (b->core.flag&BAM_FPAIRED) && !(b->core.flag&BAM_FPROPER_PAIR)) continue;
 
+        ma->nused++;
         return ret;
     };
     return ret;
@@ -252,7 +368,7 @@ static int mplp_func(void *data, bam1_t *b)
 // the pileup structures.  We stash the sample ID there.
 static int pileup_constructor(void *data, const bam1_t *b, bam_pileup_cd *cd) {
     mplp_aux_t *ma = (mplp_aux_t *)data;
-    cd->i = bam_smpl_get_sample_id(ma->conf->bsmpl, ma->bam_id, (bam1_t *)b);
+    cd->i = bam_smpl_get_sample_id_cached(ma->conf->bsmpl, ma->bam_id, (bam1_t *)b, &ma->rg_cache);
     return 0;
 }
 
@@ -276,7 +392,7 @@ static void group_smpl(mplp_pileup_t *m, bam_smpl_t *bsmpl, int n, int *n_plp, c
     }
 }
 
-static void flush_bcf_records(mplp_conf_t *conf, htsFile *fp, bcf_hdr_t *hdr, bcf1_t *rec)
+static void _flush_bcf_records(mplp_conf_t *conf, htsFile *fp, bcf_hdr_t *hdr, bcf1_t *rec)
 {
     if ( !conf->gvcf )
     {
@@ -300,15 +416,54 @@ static void flush_bcf_records(mplp_conf_t *conf, htsFile *fp, bcf_hdr_t *hdr, bc
     rec = gvcf_write(conf->gvcf, fp, hdr, rec, is_ref);
     if ( rec ) bcf_write1(fp,hdr,rec);
 }
+static void flush_bcf_records(mplp_conf_t *conf, htsFile *fp, bcf_hdr_t *hdr, bcf1_t *rec)
+{
+    uint64_t t0 = profile_begin();
+    _flush_bcf_records(conf, fp, hdr, rec);
+    profile_end_bytes(PROF_WRITE, t0, rec ? profile_rec_size(rec) : 0);
+}
+
+// bam_mplp_auto() timed as the PILEUP stage
+static inline int mplp_pileup_next(mplp_conf_t *conf, int *tid, int *pos)
+{
+    uint64_t t0 = profile_begin();
+    int ret = bam_mplp_auto(conf->iter, tid, pos, conf->n_plp, conf->plp);
+    profile_end(PROF_PILEUP, t0);
+    return ret;
+}
+
+// With --read-stats, print the number of reads read and used in the region
+static void mplp_print_read_stats(mplp_conf_t *conf, const char *seq, uint32_t beg, uint32_t end, uint64_t t0)
+{
+    uint64_t nread = 0, nused = 0;
+    int i;
+    for (i=0; i<conf->nfiles; i++)
+    {
+        nread += conf->mplp_data[i]->nread;
+        nused += conf->mplp_data[i]->nused;
+        conf->mplp_data[i]->nread = conf->mplp_data[i]->nused = 0;
+    }
+    double dt = (profile_now() - t0)*1e-9;
+    if ( seq )
+        fprintf(stderr,"[mpileup] %s:%u-%u\t%"PRIu64" reads\t%"PRIu64" used\t%.2f sec\t%.0f reads/sec\n",
+            seq,beg+1,end+1,nread,nused,dt,dt>0 ? nread/dt : 0);
+    else
+        fprintf(stderr,"[mpileup] all\t%"PRIu64" reads\t%"PRIu64" used\t%.2f sec\t%.0f reads/sec\n",
+            nread,nused,dt,dt>0 ? nread/dt : 0);
+}
 
-static int mpileup_reg(mplp_conf_t *conf, uint32_t beg, uint32_t end)
+static int mpileup_reg(mplp_conf_t *conf, const char *seq, uint32_t beg, uint32_t end)
 {
     bam_hdr_t *hdr = conf->mplp_data[0]->h; // header of first file in input list
 
     int ret, i, tid, pos, ref_len;
     char *ref;
+    uint64_t t0 = conf->read_stats ? profile_now() : 0;
 
-    while ( (ret=bam_mplp_auto(conf->iter, &tid, &pos, conf->n_plp, conf->plp)) > 0) 
+    int reg_tid = seq ? bam_name2id(hdr, seq) : -1;
+    for (i=0; i<conf->nfiles; i++) mplp_baq_region(conf->mplp_data[i], reg_tid, end);
+
+    while ( (ret=mplp_pileup_next(conf, &tid, &pos)) > 0 )
     {
         if ( end && (pos<beg || pos>end) ) continue;
         if ( conf->bed && tid >= 0 )
@@ -324,6 +479,7 @@ static int mpileup_reg(mplp_conf_t *conf, uint32_t beg, uint32_t end)
         group_smpl(conf->gplp, conf->bsmpl, conf->nfiles, conf->n_plp, conf->plp);
         _ref0 = (ref && pos < ref_len)? ref[pos] : 'N';
         ref16 = seq_nt16_table[_ref0];
+        uint64_t tc = profile_begin();
         bcf_callaux_clean(conf->bca, &conf->bc);
         for (i = 0; i < conf->gplp->n; ++i)
             bcf_call_glfgen(conf->gplp->n_plp[i], conf->gplp->plp[i], ref16, conf->bca, conf->bcr + i);
@@ -331,10 +487,12 @@ static int mpileup_reg(mplp_conf_t *conf, uint32_t beg, uint32_t end)
         bcf_call_combine(conf->gplp->n, conf->bcr, conf->bca, ref16, &conf->bc);
         bcf_clear1(conf->bcf_rec);
         bcf_call2bcf(&conf->bc, conf->bcf_rec, conf->bcr, conf->fmt_flag, 0, 0);
+        profile_end(PROF_CALL, tc);
         flush_bcf_records(conf, conf->bcf_fp, conf->bcf_hdr, conf->bcf_rec);
 
         // call indels; todo: subsampling with total_depth>max_indel_depth instead of ignoring?
         // check me: rghash in bcf_call_gap_prep() should have no effect, reads mplp_func already excludes them
+        tc = profile_begin();
         if (!(conf->flag&MPLP_NO_INDEL) && total_depth < conf->max_indel_depth 
             && bcf_call_gap_prep(conf->gplp->n, conf->gplp->n_plp, conf->gplp->plp, pos, conf->bca, ref) >= 0)
         {
@@ -345,13 +503,271 @@ static int mpileup_reg(mplp_conf_t *conf, uint32_t beg, uint32_t end)
             {
                 bcf_clear1(conf->bcf_rec);
                 bcf_call2bcf(&conf->bc, conf->bcf_rec, conf->bcr, conf->fmt_flag, conf->bca, ref);
+                profile_end(PROF_CALL, tc);
+                tc = 0;
                 flush_bcf_records(conf, conf->bcf_fp, conf->bcf_hdr, conf->bcf_rec);
             }
         }
+        profile_end(PROF_CALL, tc);
     }
+    if ( conf->read_stats ) mplp_print_read_stats(conf, seq, beg, end, t0);
     return 0;
 }
 
+static void mplp_init_caller(mplp_conf_t *conf, int nsmpl)
+{
+    int i;
+    conf->bca = bcf_call_init(-1., conf->min_baseQ);
+    conf->bcr = (bcf_callret1_t*) calloc(nsmpl, sizeof(bcf_callret1_t));
+    conf->bca->openQ = conf->openQ, conf->bca->extQ = conf->extQ, conf->bca->tandemQ = conf->tandemQ;
+    conf->bca->min_frac = conf->min_frac;
+    conf->bca->min_support = conf->min_support;
+    conf->bca->per_sample_flt = conf->flag & MPLP_PER_SAMPLE;
+
+    conf->bc.bcf_hdr = conf->bcf_hdr;
+    conf->bc.n  = nsmpl;
+    conf->bc.PL = (int32_t*) malloc(15 * nsmpl * sizeof(*conf->bc.PL));
+    if (conf->fmt_flag)
+    {
+        assert( sizeof(float)==sizeof(int32_t) );
+        conf->bc.DP4 = (int32_t*) malloc(nsmpl * sizeof(int32_t) * 4);
+        conf->bc.fmt_arr = (uint8_t*) malloc(nsmpl * sizeof(float)); // all fmt_flag fields, float and int32
+        if ( conf->fmt_flag&B2B_FMT_SP ) conf->bc.fisher = fisher_cache_init();
+        if ( conf->fmt_flag&(B2B_INFO_DPR|B2B_FMT_DPR|B2B_INFO_AD|B2B_INFO_ADF|B2B_INFO_ADR|B2B_FMT_AD|B2B_FMT_ADF|B2B_FMT_ADR) )
+        {
+            // first B2B_MAX_ALLELES fields for total numbers, the rest per-sample
+            conf->bc.ADR = (int32_t*) malloc((nsmpl+1)*B2B_MAX_ALLELES*sizeof(int32_t));
+            conf->bc.ADF = (int32_t*) malloc((nsmpl+1)*B2B_MAX_ALLELES*sizeof(int32_t));
+            for (i=0; i<nsmpl; i++)
+            {
+                conf->bcr[i].ADR = conf->bc.ADR + (i+1)*B2B_MAX_ALLELES;
+                conf->bcr[i].ADF = conf->bc.ADF + (i+1)*B2B_MAX_ALLELES;
+            }
+        }
+    }
+}
+static void mplp_destroy_caller(mplp_conf_t *conf)
+{
+    free(conf->bc.tmp.s);
+    bcf_call_destroy(conf->bca);
+    free(conf->bc.PL);
+    free(conf->bc.DP4);
+    free(conf->bc.ADR);
+    free(conf->bc.ADF);
+    free(conf->bc.fmt_arr);
+    if ( conf->bc.fisher ) fisher_cache_destroy(conf->bc.fisher);
+    free(conf->bcr);
+}
+
+/*
+    The --shard-threads mode. The regions, or the whole genome when no regions
+    are given, are cut into shards of at most MPLP_SHARD_SIZE bases. Each worker
+    thread owns its readers, indexes, pileup iterator and calling structures;
+    these are initialized once and reused for all shards the worker processes.
+    The workers write the sites without gVCF blocking, the blocks are formed by
+    the main thread when the shards are stitched, so that they can span the
+    shard boundaries as in the single-threaded run.
+*/
+typedef struct
+{
+    mplp_conf_t conf;
+    mplp_ref_t ref;
+}
+mplp_worker_t;
+
+static void *mplp_shard_init(void *data)
+{
+    mplp_conf_t *main_conf = (mplp_conf_t*) data;
+    mplp_worker_t *worker = (mplp_worker_t*) calloc(1, sizeof(mplp_worker_t));
+    mplp_ref_t ref = MPLP_REF_INIT;
+    worker->ref  = ref;
+    worker->conf = *main_conf;
+    mplp_conf_t *conf = &worker->conf;
+    bam_hdr_t *hdr = main_conf->mplp_data[0]->h;
+    int i, nsmpl = main_conf->bc.n;
+
+    memset(&conf->buf, 0, sizeof(conf->buf));
+    if ( conf->fai )
+    {
+        conf->fai = fai_load(conf->fai_fname);
+        if ( !conf->fai ) error("Failed to load the fai index: %s\n", conf->fai_fname);
+    }
+    if ( conf->bed ) conf->bed_itr = regitr_init(conf->bed);
+    conf->gvcf = NULL;
+
+    conf->mplp_data = (mplp_aux_t**) calloc(conf->nfiles, sizeof(mplp_aux_t*));
+    for (i=0; i<conf->nfiles; i++)
+    {
+        mplp_aux_t *ma = conf->mplp_data[i] = (mplp_aux_t*) calloc(1, sizeof(mplp_aux_t));
+        ma->fp = sam_open(conf->files[i], "rb");
+        if ( !ma->fp ) error("Failed to open %s: %s\n", conf->files[i], strerror(errno));
+        if ( hts_set_opt(ma->fp, CRAM_OPT_DECODE_MD, 0) ) error("Failed to set CRAM_OPT_DECODE_MD value\n");
+        if ( conf->fai_fname && hts_set_fai_filename(ma->fp, conf->fai_fname)!=0 )
+            error("Failed to process %s: %s\n", conf->fai_fname, strerror(errno));
+        bam_hdr_t *h_tmp = sam_hdr_read(ma->fp);
+        if ( !h_tmp ) error("Failed to read the header of %s\n", conf->files[i]);
+        bam_hdr_destroy(h_tmp);
+        ma->h      = hdr;
+        ma->conf   = conf;
+        ma->ref    = &worker->ref;
+        ma->bam_id = main_conf->mplp_data[i]->bam_id;
+        ma->idx    = sam_index_load(ma->fp, conf->files[i]);
+        if ( !ma->idx ) error("Failed to load the index of %s, --shard-threads requires indexed files\n", conf->files[i]);
+    }
+    conf->gplp = (mplp_pileup_t *) calloc(1,sizeof(mplp_pileup_t));
+    conf->gplp->n = main_conf->gplp->n;
+    conf->gplp->n_plp = (int*) calloc(conf->gplp->n, sizeof(int));
+    conf->gplp->m_plp = (int*) calloc(conf->gplp->n, sizeof(int));
+    conf->gplp->plp = (bam_pileup1_t**) calloc(conf->gplp->n, sizeof(bam_pileup1_t*));
+    conf->plp = (const bam_pileup1_t**) calloc(conf->nfiles, sizeof(bam_pileup1_t*));
+    conf->n_plp = (int*) calloc(conf->nfiles, sizeof(int));
+    mplp_init_caller(conf, nsmpl);
+    conf->bcf_rec = bcf_init1();
+
+    conf->iter = bam_mplp_init(conf->nfiles, mplp_func, (void**)conf->mplp_data);
+    if ( conf->flag & MPLP_SMART_OVERLAPS ) bam_mplp_init_overlaps(conf->iter);
+    bam_mplp_set_maxcnt(conf->iter, conf->max_depth);
+    bam_mplp_constructor(conf->iter, pileup_constructor);
+    return worker;
+}
+
+static void mplp_shard_run(void *data, shard_t *shard, htsFile *fh)
+{
+    mplp_worker_t *worker = (mplp_worker_t*) data;
+    mplp_conf_t *conf = &worker->conf;
+    bam_hdr_t *hdr = conf->mplp_data[0]->h;
+    int j;
+
+    conf->buf.l = 0;
+    ksprintf(&conf->buf,"%s:%u-%u",shard->seq,shard->beg+1,shard->end+1);
+    for (j=0; j<conf->nfiles; j++)
+    {
+        if ( conf->mplp_data[j]->iter ) hts_itr_destroy(conf->mplp_data[j]->iter);
+        conf->mplp_data[j]->iter = sam_itr_querys(conf->mplp_data[j]->idx, hdr, conf->buf.s);
+        if ( !conf->mplp_data[j]->iter ) error("Failed to query the region %s in %s\n", conf->buf.s, conf->files[j]);
+    }
+    bam_mplp_reset(conf->iter);
+
+    conf->bcf_fp = fh;
+    mpileup_reg(conf, shard->seq, shard->beg, shard->end);
+    conf->bcf_fp = NULL;
+}
+
+static void mplp_shard_destroy(void *data)
+{
+    mplp_worker_t *worker = (mplp_worker_t*) data;
+    mplp_conf_t *conf = &worker->conf;
+    int i;
+    bcf_destroy1(conf->bcf_rec);
+    mplp_destroy_caller(conf);
+    bam_mplp_destroy(conf->iter);
+    for (i=0; i<conf->gplp->n; i++) free(conf->gplp->plp[i]);
+    free(conf->gplp->plp); free(conf->gplp->n_plp); free(conf->gplp->m_plp); free(conf->gplp);
+    for (i=0; i<conf->nfiles; i++)
+    {
+        hts_idx_destroy(conf->mplp_data[i]->idx);
+        if ( conf->mplp_data[i]->iter ) hts_itr_destroy(conf->mplp_data[i]->iter);
+        sam_close(conf->mplp_data[i]->fp);
+        bam_smpl_cache_destroy(&conf->mplp_data[i]->rg_cache);
+        baq_list_destroy(&conf->mplp_data[i]->baq_prev);
+        baq_list_destroy(&conf->mplp_data[i]->baq_next);
+        free(conf->mplp_data[i]);
+    }
+    free(conf->mplp_data); free(conf->plp); free(conf->n_plp);
+    free(worker->ref.ref[0]);
+    free(worker->ref.ref[1]);
+    if ( conf->fai ) fai_destroy(conf->fai);
+    if ( conf->bed_itr ) regitr_destroy(conf->bed_itr);
+    free(conf->buf.s);
+    free(worker);
+}
+
+// The stitched records are packed, the alleles are needed for the gVCF blocks
+static void mplp_shard_write(void *data, bcf1_t *rec)
+{
+    mplp_conf_t *conf = (mplp_conf_t*) data;
+    if ( conf->gvcf ) bcf_unpack(rec, BCF_UN_STR);
+    flush_bcf_records(conf, conf->bcf_fp, conf->bcf_hdr, rec);
+}
+
+static void mpileup_shards(mplp_conf_t *conf, bam_hdr_t *hdr)
+{
+    shards_t *shards = shards_init("mpileup");
+    int i;
+    if ( conf->reg )
+    {
+        regitr_t *itr = regitr_init(conf->reg);
+        while ( regitr_loop(itr) )
+            shards_add(shards, itr->seq, itr->beg, itr->end, MPLP_SHARD_SIZE);
+        regitr_destroy(itr);
+    }
+    else
+    {
+        for (i=0; i<hdr->n_targets; i++)
+            if ( hdr->target_len[i] ) shards_add(shards, hdr->target_name[i], 0, hdr->target_len[i]-1, MPLP_SHARD_SIZE);
+    }
+    shards_run(shards, conf->shard_threads, conf->bcf_hdr, mplp_shard_init, mplp_shard_run, mplp_shard_destroy, mplp_shard_write, conf);
+    shards_destroy(shards);
+}
+
+/*
+    With -t/-T and indexed files, the targets are turned into regions so that
+    the alignments outside of the targets are not read at all. Nearby targets
+    are coalesced into one region to avoid many small index jumps; the exact
+    positions are still checked against the targets in mpileup_reg(). The
+    regions follow the order of the BAM header, as streaming would.
+*/
+static regidx_t *mplp_targets_to_regs(mplp_conf_t *conf, bam_hdr_t *hdr)
+{
+    regidx_t *reg = regidx_init(NULL,regidx_parse_reg,NULL,0,NULL);
+    regitr_t *itr = regitr_init(conf->bed);
+    int i;
+    for (i=0; i<hdr->n_targets; i++)
+    {
+        char *seq = hdr->target_name[i];
+        if ( !regidx_overlap(conf->bed, seq, 0, REGIDX_MAX, itr) ) continue;
+        int nreg = 0;
+        uint32_t beg = 0, end = 0;
+        while ( regitr_overlap(itr) )
+        {
+            if ( nreg && itr->beg <= end + MPLP_TARGET_GAP )
+            {
+                if ( end < itr->end ) end = itr->end;
+                continue;
+            }
+            if ( nreg ) regidx_push(reg, seq, seq+strlen(seq)-1, beg, end, NULL);
+            beg = itr->beg;
+            end = itr->end;
+            nreg++;
+        }
+        regidx_push(reg, seq, seq+strlen(seq)-1, beg, end, NULL);
+    }
+    regitr_destroy(itr);
+    if ( !regidx_nregs(reg) )
+    {
+        regidx_destroy(reg);
+        return NULL;
+    }
+    return reg;
+}
+
+// Some of the files are not indexed, stream the targets instead
+static void mplp_drop_target_regs(mplp_conf_t *conf, int nfiles)
+{
+    int i;
+    for (i=0; i<nfiles; i++)
+    {
+        if ( conf->mplp_data[i]->iter ) hts_itr_destroy(conf->mplp_data[i]->iter);
+        if ( conf->mplp_data[i]->idx ) hts_idx_destroy(conf->mplp_data[i]->idx);
+        conf->mplp_data[i]->iter = NULL;
+        conf->mplp_data[i]->idx  = NULL;
+    }
+    regitr_destroy(conf->reg_itr);
+    regidx_destroy(conf->reg);
+    conf->reg_itr = NULL;
+    conf->reg = NULL;
+}
+
 static int mpileup(mplp_conf_t *conf)
 {
     if (conf->nfiles == 0) {
@@ -396,7 +812,7 @@ static int mpileup(mplp_conf_t *conf)
     // read the header of each file in the list and initialize data
     // beware: mpileup has always assumed that tid's are consistent in the headers, add sanity check at least!
     bam_hdr_t *hdr = NULL;      // header of first file in input list
-    int i;
+    int i, targets_as_regs = 0;
     for (i = 0; i < conf->nfiles; ++i) {
         bam_hdr_t *h_tmp;
         conf->mplp_data[i] = (mplp_aux_t*) calloc(1, sizeof(mplp_aux_t));
@@ -436,8 +852,24 @@ static int mpileup(mplp_conf_t *conf)
             i--;
             continue;
         }
+        if ( !i && conf->bed && conf->bed_logic && !conf->reg )
+        {
+            conf->reg = mplp_targets_to_regs(conf, h_tmp);
+            if ( conf->reg )
+            {
+                targets_as_regs = 1;
+                nregs = regidx_nregs(conf->reg);
+                conf->reg_itr = regitr_init(conf->reg);
+                regitr_loop(conf->reg_itr);
+            }
+        }
+        hts_idx_t *idx = conf->reg ? sam_index_load(conf->mplp_data[i]->fp, conf->files[i]) : NULL;
+        if ( !idx && targets_as_regs )
+        {
+            mplp_drop_target_regs(conf, i);
+            targets_as_regs = nregs = 0;
+        }
         if (conf->reg) {
-            hts_idx_t *idx = sam_index_load(conf->mplp_data[i]->fp, conf->files[i]);
             if (idx == NULL) {
                 fprintf(stderr, "[%s] fail to load index for %s\n", __func__, conf->files[i]);
                 exit(EXIT_FAILURE);
@@ -573,33 +1005,7 @@ static int mpileup(mplp_conf_t *conf)
         bcf_hdr_add_sample(conf->bcf_hdr, smpl[i]);
     bcf_hdr_write(conf->bcf_fp, conf->bcf_hdr);
 
-    conf->bca = bcf_call_init(-1., conf->min_baseQ);
-    conf->bcr = (bcf_callret1_t*) calloc(nsmpl, sizeof(bcf_callret1_t));
-    conf->bca->openQ = conf->openQ, conf->bca->extQ = conf->extQ, conf->bca->tandemQ = conf->tandemQ;
-    conf->bca->min_frac = conf->min_frac;
-    conf->bca->min_support = conf->min_support;
-    conf->bca->per_sample_flt = conf->flag & MPLP_PER_SAMPLE;
-
-    conf->bc.bcf_hdr = conf->bcf_hdr;
-    conf->bc.n  = nsmpl;
-    conf->bc.PL = (int32_t*) malloc(15 * nsmpl * sizeof(*conf->bc.PL));
-    if (conf->fmt_flag)
-    {
-        assert( sizeof(float)==sizeof(int32_t) );
-        conf->bc.DP4 = (int32_t*) malloc(nsmpl * sizeof(int32_t) * 4);
-        conf->bc.fmt_arr = (uint8_t*) malloc(nsmpl * sizeof(float)); // all fmt_flag fields, float and int32
-        if ( conf->fmt_flag&(B2B_INFO_DPR|B2B_FMT_DPR|B2B_INFO_AD|B2B_INFO_ADF|B2B_INFO_ADR|B2B_FMT_AD|B2B_FMT_ADF|B2B_FMT_ADR) )
-        {
-            // first B2B_MAX_ALLELES fields for total numbers, the rest per-sample
-            conf->bc.ADR = (int32_t*) malloc((nsmpl+1)*B2B_MAX_ALLELES*sizeof(int32_t));
-            conf->bc.ADF = (int32_t*) malloc((nsmpl+1)*B2B_MAX_ALLELES*sizeof(int32_t));
-            for (i=0; i<nsmpl; i++)
-            {
-                conf->bcr[i].ADR = conf->bc.ADR + (i+1)*B2B_MAX_ALLELES;
-                conf->bcr[i].ADF = conf->bc.ADF + (i+1)*B2B_MAX_ALLELES;
-            }
-        }
-    }
+    mplp_init_caller(conf, nsmpl);
 
     // init mpileup
     conf->iter = bam_mplp_init(conf->nfiles, mplp_func, (void**)conf->mplp_data);
@@ -614,7 +1020,9 @@ static int mpileup(mplp_conf_t *conf)
     bam_mplp_constructor(conf->iter, pileup_constructor);
 
     // Run mpileup for multiple regions
-    if ( nregs )
+    if ( conf->shard_threads )
+        mpileup_shards(conf, hdr);
+    else if ( nregs )
     {
         int ireg = 0;
         do 
@@ -642,29 +1050,22 @@ static int mpileup(mplp_conf_t *conf)
                     bam_mplp_reset(conf->iter);
                 }
             }
-            mpileup_reg(conf,conf->reg_itr->beg,conf->reg_itr->end);
+            mpileup_reg(conf,conf->reg_itr->seq,conf->reg_itr->beg,conf->reg_itr->end);
         }
         while ( regitr_loop(conf->reg_itr) );
     }
     else
-        mpileup_reg(conf,0,0);
+        mpileup_reg(conf,NULL,0,0);
 
     flush_bcf_records(conf, conf->bcf_fp, conf->bcf_hdr, NULL);
 
     // clean up
-    free(conf->bc.tmp.s);
     bcf_destroy1(conf->bcf_rec);
     if (conf->bcf_fp)
     {
         hts_close(conf->bcf_fp);
         bcf_hdr_destroy(conf->bcf_hdr);
-        bcf_call_destroy(conf->bca);
-        free(conf->bc.PL);
-        free(conf->bc.DP4);
-        free(conf->bc.ADR);
-        free(conf->bc.ADF);
-        free(conf->bc.fmt_arr);
-        free(conf->bcr);
+        mplp_destroy_caller(conf);
     }
     if ( conf->gvcf ) gvcf_destroy(conf->gvcf);
     free(conf->buf.s);
@@ -676,6 +1077,9 @@ static int mpileup(mplp_conf_t *conf)
         if ( nregs>1 ) hts_idx_destroy(conf->mplp_data[i]->idx);
         sam_close(conf->mplp_data[i]->fp);
         if ( conf->mplp_data[i]->iter) hts_itr_destroy(conf->mplp_data[i]->iter);
+        bam_smpl_cache_destroy(&conf->mplp_data[i]->rg_cache);
+        baq_list_destroy(&conf->mplp_data[i]->baq_prev);
+        baq_list_destroy(&conf->mplp_data[i]->baq_next);
         free(conf->mplp_data[i]);
     }
     if ( conf->reg_itr ) regitr_destroy(conf->reg_itr);
@@ -838,9 +1242,10 @@ static void print_usage(FILE *fp, const mplp_conf_t *mplp)
     fprintf(fp,
 "  -s, --samples LIST      comma separated list of samples to include\n"
 "  -S, --samples-file FILE file of samples to include\n"
-"  -t, --targets REG[,...] similar to -r but streams rather than index-jumps\n"
-"  -T, --targets-file FILE similar to -R but streams rather than index-jumps\n"
+"  -t, --targets REG[,...] similar to -r but streams when the files are not indexed\n"
+"  -T, --targets-file FILE similar to -R but streams when the files are not indexed\n"
 "  -x, --ignore-overlaps   disable read-pair overlap detection\n"
+"      --read-stats        print the number of reads read and used per region to stderr\n"
 "\n"
 "Output options:\n"
 "  -a, --annotate LIST     optional tags to output; '?' to list []\n"
@@ -851,6 +1256,7 @@ static void print_usage(FILE *fp, const mplp_conf_t *mplp)
 "  -O, --output-type TYPE  'b' compressed BCF; 'u' uncompressed BCF;\n"
 "                          'z' compressed VCF; 'v' uncompressed VCF [v]\n"
 "      --threads INT       number of extra output compression threads [0]\n"
+"      --shard-threads INT number of threads to process shards of the genome or regions in parallel [0]\n"
 "\n"
 "SNP/INDEL genotype likelihoods options:\n"
 "  -e, --ext-prob INT      Phred-scaled gap extension seq error probability [%d]\n", mplp->extQ);
@@ -879,6 +1285,7 @@ static void print_usage(FILE *fp, const mplp_conf_t *mplp)
 int bam_mpileup(int argc, char *argv[])
 {
     int c;
+    char *tmp;
     const char *file_list = NULL;
     char **fn = NULL;
     int nfiles = 0, use_orphan = 0, noref = 0;
@@ -912,6 +1319,8 @@ int bam_mpileup(int argc, char *argv[])
         {"non-reference", no_argument, NULL, 7},
         {"no-version", no_argument, NULL, 8},
         {"threads",required_argument,NULL,9},
+        {"shard-threads",required_argument,NULL,10},
+        {"read-stats",no_argument,NULL,11},
         {"illumina1.3+", no_argument, NULL, '6'},
         {"count-orphans", no_argument, NULL, 'A'},
         {"bam-list", required_argument, NULL, 'b'},
@@ -975,13 +1384,17 @@ int bam_mpileup(int argc, char *argv[])
         case  7 : noref = 1; break;
         case  8 : mplp.record_cmd_line = 0; break;
         case  9 : mplp.n_threads = strtol(optarg, 0, 0); break;
+        case 10 :
+            mplp.shard_threads = strtol(optarg, &tmp, 10);
+            if ( *tmp || mplp.shard_threads<0 ) error("Could not parse argument: --shard-threads %s\n", optarg);
+            break;
+        case 11 : mplp.read_stats = 1; break;
         case 'd': mplp.max_depth = atoi(optarg); break;
         case 'r': mplp.reg_fname = strdup(optarg); break;
         case 'R': mplp.reg_fname = strdup(optarg); mplp.reg_is_file = 1; break;
         case 't':
-                  // In the original version the whole BAM was streamed which is inefficient
-                  //  with few BED intervals and big BAMs. Todo: devise a heuristic to determine
-                  //  best strategy, that is streaming or jumping.
+                  // Unless -r is given, the targets are index-jumped when the files are indexed,
+                  //  see mplp_targets_to_regs()
                   if ( optarg[0]=='^' ) optarg++;
                   else mplp.bed_logic = 1;
                   mplp.bed = regidx_init(NULL,regidx_parse_reg,NULL,0,NULL);
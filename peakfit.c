@@ -26,6 +26,7 @@
 
 #include "peakfit.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <gsl/gsl_version.h>
 #include <gsl/gsl_vector.h>
 #include <gsl/gsl_multifit_nlin.h>
@@ -59,6 +60,10 @@ struct _peakfit_t
     double *xvals, *yvals, *vals;
     kstring_t str;
     int verbose, nmc_iter;
+    unsigned int seed;                  // rand_r() state, reset with each run for reproducibility
+    gsl_multifit_fdfsolver *solver;     // reused while the number of values and parameters stays the same
+    gsl_vector *grad;
+    size_t solver_n, solver_p;
 };
 
 
@@ -375,6 +380,8 @@ void peakfit_reset(peakfit_t *pkf)
 
 void peakfit_destroy(peakfit_t *pkf)
 {
+    if ( pkf->solver ) gsl_multifit_fdfsolver_free(pkf->solver);
+    if ( pkf->grad ) gsl_vector_free(pkf->grad);
     free(pkf->str.s);
     free(pkf->vals);
     free(pkf->params);
@@ -486,7 +493,7 @@ void peakfit_set_mc(peakfit_t *pkf, double xmin, double xmax, int iparam, int ni
 
 double peakfit_run(peakfit_t *pkf, int nvals, double *xvals, double *yvals)
 {
-    srand(0);   // for reproducibility
+    pkf->seed = 0;  // for reproducibility
 
     pkf->nvals = nvals;
     pkf->xvals = xvals;
@@ -502,11 +509,16 @@ double peakfit_run(peakfit_t *pkf, int nvals, double *xvals, double *yvals)
     mfunc.p   = pkf->nparams;
     mfunc.params = pkf;
 
-    const gsl_multifit_fdfsolver_type *solver_type;
-    gsl_multifit_fdfsolver *solver;
-    solver_type = gsl_multifit_fdfsolver_lmsder;
-    solver = gsl_multifit_fdfsolver_alloc(solver_type, nvals, mfunc.p);
-    gsl_vector *grad = gsl_vector_alloc(pkf->nparams);
+    if ( !pkf->solver || pkf->solver_n!=mfunc.n || pkf->solver_p!=mfunc.p )
+    {
+        if ( pkf->solver ) gsl_multifit_fdfsolver_free(pkf->solver);
+        if ( pkf->grad ) gsl_vector_free(pkf->grad);
+        pkf->solver   = gsl_multifit_fdfsolver_alloc(gsl_multifit_fdfsolver_lmsder, mfunc.n, mfunc.p);
+        pkf->grad     = gsl_vector_alloc(mfunc.p);
+        pkf->solver_n = mfunc.n;
+        pkf->solver_p = mfunc.p;
+    }
+    gsl_multifit_fdfsolver *solver = pkf->solver;
 
     int imc_iter, i,j, iparam;
     double best_fit = HUGE_VAL;
@@ -520,9 +532,9 @@ double peakfit_run(peakfit_t *pkf, int nvals, double *xvals, double *yvals)
             for (j=0; j<NPARAMS; j++)
             {
                 pk->params[j] = pk->ori_params[j];
-                if ( pk->mc[j].scan )
+                if ( pk->mc[j].scan && imc_iter>0 )    // the first iteration starts from the given parameters
                 {
-                    pk->params[j] = rand()*(pk->mc[j].max - pk->mc[j].min)/RAND_MAX + pk->mc[j].min;
+                    pk->params[j] = rand_r(&pkf->seed)*(pk->mc[j].max - pk->mc[j].min)/RAND_MAX + pk->mc[j].min;
                     if ( pk->convert_set ) pk->params[j] = pk->convert_set(pk, j, pk->params[j]);
                 }
                 if ( !(pk->fit_mask & (1<<j)) ) continue;
@@ -555,8 +567,8 @@ double peakfit_run(peakfit_t *pkf, int nvals, double *xvals, double *yvals)
             int info;
             test1 = gsl_multifit_fdfsolver_test(solver, 1e-8,1e-8, 0.0, &info);
 #else
-            gsl_multifit_gradient(solver->J, solver->f, grad);
-            test1 = gsl_multifit_test_gradient(grad, 1e-8);
+            gsl_multifit_gradient(solver->J, solver->f, pkf->grad);
+            test1 = gsl_multifit_test_gradient(pkf->grad, 1e-8);
             test2 = gsl_multifit_test_delta(solver->dx, solver->x, 1e-8, 1e-8);
 #endif
         }
@@ -591,8 +603,6 @@ double peakfit_run(peakfit_t *pkf, int nvals, double *xvals, double *yvals)
         }
         if ( fit<best_fit ) best_fit = fit;
     }
-    gsl_multifit_fdfsolver_free(solver);
-    gsl_vector_free(grad);
 
     for (i=0; i<pkf->npeaks; i++)
     {
@@ -38,6 +38,9 @@ struct _ploidy_t
     void *sex2id;
     char **id2sex;
     kstring_t tmp_str;
+    void *seq2bps;      // sequence name to the index of its breakpoints, built by ploidy_cursor_init()
+    struct _bps_t *bps;
+    int nbps;
 };
 
 typedef struct
@@ -46,6 +49,23 @@ typedef struct
 }
 sex_ploidy_t;
 
+// Sorted region boundaries of one sequence: the first position of each region and the one following it
+typedef struct _bps_t
+{
+    uint32_t *pos;
+    int n, m;
+}
+bps_t;
+
+struct _ploidy_cursor_t
+{
+    ploidy_t *ploidy;
+    regitr_t *itr;
+    kstring_t seq;
+    uint32_t beg, end;      // the stretch the cached values are valid for
+    int nsex, min, max, *sex2ploidy, *tmp;
+};
+
 
 regidx_t *ploidy_regions(ploidy_t *ploidy)
 {
@@ -186,12 +206,16 @@ void ploidy_destroy(ploidy_t *ploidy)
     free(ploidy->id2sex);
     free(ploidy->tmp_str.s);
     free(ploidy->sex2dflt);
+    if ( ploidy->seq2bps ) khash_str2int_destroy(ploidy->seq2bps);
+    int i;
+    for (i=0; i<ploidy->nbps; i++) free(ploidy->bps[i].pos);
+    free(ploidy->bps);
     free(ploidy);
 }
 
-int ploidy_query(ploidy_t *ploidy, char *seq, int pos, int *sex2ploidy, int *min, int *max)
+static int _query(ploidy_t *ploidy, regitr_t *itr, const char *seq, int pos, int *sex2ploidy, int *min, int *max)
 {
-    int i, ret = regidx_overlap(ploidy->idx, seq,pos,pos, ploidy->itr);
+    int i, ret = regidx_overlap(ploidy->idx, seq,pos,pos, itr);
 
     if ( !sex2ploidy && !min && !max ) return ret;
 
@@ -208,10 +232,10 @@ int ploidy_query(ploidy_t *ploidy, char *seq, int pos, int *sex2ploidy, int *min
     int _min = INT_MAX, _max = -1;
     if ( sex2ploidy ) for (i=0; i<ploidy->nsex; i++) sex2ploidy[i] = ploidy->dflt;
 
-    while ( regitr_overlap(ploidy->itr) )
+    while ( regitr_overlap(itr) )
     {
-        int sex = regitr_payload(ploidy->itr,sex_ploidy_t).sex;
-        int pld = regitr_payload(ploidy->itr,sex_ploidy_t).ploidy;
+        int sex = regitr_payload(itr,sex_ploidy_t).sex;
+        int pld = regitr_payload(itr,sex_ploidy_t).ploidy;
         if ( pld!=ploidy->dflt ) 
         {
             if ( sex2ploidy ) sex2ploidy[ sex ] = pld;
@@ -226,6 +250,120 @@ int ploidy_query(ploidy_t *ploidy, char *seq, int pos, int *sex2ploidy, int *min
     return 1;
 }
 
+int ploidy_query(ploidy_t *ploidy, char *seq, int pos, int *sex2ploidy, int *min, int *max)
+{
+    return _query(ploidy, ploidy->itr, seq, pos, sex2ploidy, min, max);
+}
+
+static int cmp_uint32(const void *a, const void *b)
+{
+    uint32_t x = *((const uint32_t*)a), y = *((const uint32_t*)b);
+    if ( x < y ) return -1;
+    return x > y ? 1 : 0;
+}
+
+static void _init_breakpoints(ploidy_t *ploidy)
+{
+    ploidy->seq2bps = khash_str2int_init();
+    regitr_t *itr = regitr_init(ploidy->idx);
+    while ( regitr_loop(itr) )
+    {
+        int iseq;
+        if ( khash_str2int_get(ploidy->seq2bps, itr->seq, &iseq)!=0 )
+        {
+            iseq = ploidy->nbps++;
+            ploidy->bps = (bps_t*) realloc(ploidy->bps, sizeof(bps_t)*ploidy->nbps);
+            memset(&ploidy->bps[iseq], 0, sizeof(bps_t));
+            khash_str2int_set(ploidy->seq2bps, itr->seq, iseq);    // the name is owned by regidx
+        }
+        bps_t *bps = &ploidy->bps[iseq];
+        hts_expand(uint32_t, bps->n+2, bps->m, bps->pos);
+        bps->pos[bps->n++] = itr->beg;
+        if ( itr->end < UINT32_MAX ) bps->pos[bps->n++] = itr->end + 1;
+    }
+    regitr_destroy(itr);
+
+    int i, j, k;
+    for (i=0; i<ploidy->nbps; i++)
+    {
+        bps_t *bps = &ploidy->bps[i];
+        qsort(bps->pos, bps->n, sizeof(*bps->pos), cmp_uint32);
+        for (j=1,k=1; j<bps->n; j++)
+            if ( bps->pos[j]!=bps->pos[k-1] ) bps->pos[k++] = bps->pos[j];
+        bps->n = k;
+    }
+}
+
+ploidy_cursor_t *ploidy_cursor_init(ploidy_t *ploidy)
+{
+    if ( !ploidy->seq2bps ) _init_breakpoints(ploidy);
+    ploidy_cursor_t *cursor = (ploidy_cursor_t*) calloc(1,sizeof(ploidy_cursor_t));
+    cursor->ploidy = ploidy;
+    cursor->itr = regitr_init(ploidy->idx);
+    cursor->nsex = -1;
+    return cursor;
+}
+
+void ploidy_cursor_destroy(ploidy_cursor_t *cursor)
+{
+    regitr_destroy(cursor->itr);
+    free(cursor->seq.s);
+    free(cursor->sex2ploidy);
+    free(cursor->tmp);
+    free(cursor);
+}
+
+int ploidy_cursor_query(ploidy_cursor_t *cursor, const char *seq, int pos, const int **sex2ploidy, int *min, int *max)
+{
+    ploidy_t *ploidy = cursor->ploidy;
+    int changed = 0;
+    if ( cursor->nsex != ploidy->nsex )
+    {
+        // first call or new sexes added by ploidy_add_sex(), start afresh
+        cursor->nsex = ploidy->nsex;
+        cursor->sex2ploidy = (int*) realloc(cursor->sex2ploidy, sizeof(int)*(cursor->nsex+1));
+        cursor->tmp = (int*) realloc(cursor->tmp, sizeof(int)*(cursor->nsex+1));
+        cursor->seq.l = 0;
+        changed = 1;
+    }
+    if ( !cursor->seq.l || (uint32_t)pos < cursor->beg || (uint32_t)pos > cursor->end || strcmp(seq,cursor->seq.s) )
+    {
+        int _min, _max;
+        _query(ploidy, cursor->itr, seq, pos, cursor->tmp, &_min, &_max);
+        if ( changed || _min!=cursor->min || _max!=cursor->max || memcmp(cursor->tmp,cursor->sex2ploidy,sizeof(int)*cursor->nsex) )
+        {
+            int *tmp = cursor->tmp; cursor->tmp = cursor->sex2ploidy; cursor->sex2ploidy = tmp;
+            cursor->min = _min;
+            cursor->max = _max;
+            changed = 1;
+        }
+        cursor->seq.l = 0;
+        kputs(seq, &cursor->seq);
+
+        // the stretch between the nearest boundaries around pos
+        int iseq;
+        cursor->beg = 0;
+        cursor->end = UINT32_MAX;
+        if ( khash_str2int_get(ploidy->seq2bps, seq, &iseq)==0 )
+        {
+            bps_t *bps = &ploidy->bps[iseq];
+            int lo = 0, hi = bps->n;
+            while ( lo < hi )
+            {
+                int mid = (lo + hi) / 2;
+                if ( bps->pos[mid] <= (uint32_t)pos ) lo = mid + 1;
+                else hi = mid;
+            }
+            if ( lo > 0 ) cursor->beg = bps->pos[lo-1];
+            if ( lo < bps->n ) cursor->end = bps->pos[lo] - 1;
+        }
+    }
+    if ( sex2ploidy ) *sex2ploidy = cursor->sex2ploidy;
+    if ( min ) *min = cursor->min;
+    if ( max ) *max = cursor->max;
+    return changed;
+}
+
 int ploidy_nsex(ploidy_t *ploidy)
 {
     return ploidy->nsex;
@@ -58,6 +58,7 @@
 #include "regidx.h"
 
 typedef struct _ploidy_t ploidy_t;
+typedef struct _ploidy_cursor_t ploidy_cursor_t;
 
 /*
  *  ploidy_init()
@@ -118,6 +119,30 @@ int ploidy_sex2id(ploidy_t *ploidy, char *sex);
  */
 int ploidy_add_sex(ploidy_t *ploidy, const char *sex);
 
+/*
+ *  ploidy_cursor_init() - cursor for repeated queries at sorted positions.
+ *      The ploidy is constant between two consecutive region boundaries, the
+ *      cursor keeps the result for the current stretch and queries the
+ *      regions again only when a position falls outside of it. Cursors must
+ *      be created from a single thread, then each can be used by its own
+ *      thread.
+ */
+ploidy_cursor_t *ploidy_cursor_init(ploidy_t *ploidy);
+void ploidy_cursor_destroy(ploidy_cursor_t *cursor);
+
+/*
+ *  ploidy_cursor_query() - the same as ploidy_query()
+ *  @param sex2ploidy:  if not NULL, set to the mapping from sex id to ploidy.
+ *                      The array is owned by the cursor, the pointer does not
+ *                      change between calls.
+ *  @param min:         if not NULL, minimum encountered ploidy will be set
+ *  @param max:         if not NULL, maximum encountered ploidy will be set
+ *
+ *  Returns 1 if the ploidy differs from the previous call (always on the
+ *  first call), 0 otherwise.
+ */
+int ploidy_cursor_query(ploidy_cursor_t *cursor, const char *seq, int pos, const int **sex2ploidy, int *min, int *max);
+
 /** Returns region index for raw access */
 regidx_t *ploidy_regions(ploidy_t *ploidy);
 
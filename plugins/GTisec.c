@@ -40,8 +40,6 @@ DEALINGS IN THE SOFTWARE.  */
 
 #include <htslib/vcf.h>
 #include <htslib/synced_bcf_reader.h>
-#include <htslib/khash.h>
-KHASH_MAP_INIT_INT(gts2smps, uint32_t)
 
 #include "bcftools.h"
 
@@ -61,6 +59,8 @@ typedef struct _args_t
     int nsmpp2; /*! 2^(nsmp) (is needed multiple times) */
     int *gt_arr; /*! temporary array, to store GTs of current line/record */
     int ngt_arr; /*! hold the number of current GT array entries */
+    int *gt_ids; /*! distinct genotypes of the current record, there can be at most nsmp of them */
+    uint32_t *gt_smps; /*! for each of gt_ids, the flag of samples carrying the genotype */
     uint32_t *bankers; /*! array to store banker's sequence for all possible sample subsets for
                                 programmatic indexing into smp_is for output printing, e.g. for three
                                 samples A, B and C this would be the following order:
@@ -161,6 +161,8 @@ int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
 
     args.gt_arr = NULL;
     args.ngt_arr = 0;
+    args.gt_ids = (int*) malloc( args.nsmp * sizeof(int) );
+    args.gt_smps = (uint32_t*) malloc( args.nsmp * sizeof(uint32_t) );
 
     args.out = stdout;
 
@@ -324,11 +326,10 @@ bcf1_t *process(bcf1_t *rec)
     }
 
     gte_smp /= args.nsmp; // divide total number of genotypes array entries (= args.ngt_arr) by number of samples
-    int ret;
 
-    // stick all genotypes in a hash as keys and store up to 32 samples in a corresponding flag as its value
-    khiter_t bucket;
-    khash_t(gts2smps) *gts = kh_init(gts2smps); // create hash
+    // collect the distinct genotypes and store up to 32 samples in a corresponding flag. There are
+    // usually only a few distinct genotypes per record, a linear scan is faster than hashing
+    int j, ngts = 0;
     for ( i = 0; i < args.nsmp; i++ )
     {
         int *gt_ptr = args.gt_arr + gte_smp * i;
@@ -354,27 +355,25 @@ bcf1_t *process(bcf1_t *rec)
             error("gtisec does not support ploidy higher than 2.\n");
         }
 
-        int idx = bcf_alleles2gt(a,b); // generate genotype specific hash key
+        int idx = bcf_alleles2gt(a,b); // generate genotype specific key
 
-        bucket = kh_get(gts2smps, gts, idx); // get the genotype's hash bucket
-
-        if ( bucket == kh_end(gts) ) { // means that key does not exist
-            bucket = kh_put(gts2smps, gts, idx, &ret); // create bucket with genotype index as key and return its iterator
-            kh_val(gts, bucket) = 0; // initialize the bucket with all sample bits unset
+        for ( j = 0; j < ngts; j++ )
+        {
+            if ( args.gt_ids[j] == idx ) break;
+        }
+        if ( j == ngts ) // first sample with this genotype, initialize the flag with all sample bits unset
+        {
+            args.gt_ids[ngts] = idx;
+            args.gt_smps[ngts++] = 0;
         }
-        kh_value(gts, bucket) |= (1<<i); // set the sample's bit to 1 in this genotype's bucket
+        args.gt_smps[j] |= (uint32_t)1 << i; // set the sample's bit to 1 in this genotype's flag
     }
 
-    // iterate over genotypes and for each genotype increment the appropriate smp_is entry
-    for ( bucket = kh_begin(gts); bucket != kh_end(gts); ++bucket ) // iterate over all genotypes at this position
+    // for each genotype increment the appropriate smp_is entry
+    for ( j = 0; j < ngts; j++ )
     {
-        if ( kh_exist(gts, bucket) ) // for existing genotype buckets
-        {
-            uint32_t s = kh_val(gts, bucket); // get the 32 bit flag
-            args.smp_is[s]++; // add to the corresponding subset
-        }
+        args.smp_is[ args.gt_smps[j] ]++;
     }
-    kh_destroy(gts2smps, gts); // destroy hash
 
     return NULL;
 }
@@ -463,6 +462,8 @@ void destroy(void)
 
     /* freeing up args */
     free(args.gt_arr);
+    free(args.gt_ids);
+    free(args.gt_smps);
     free(args.bankers);
     free(args.quick);
     if (args.flag & MISSING) free(args.missing_gts);
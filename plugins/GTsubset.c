@@ -33,6 +33,7 @@ DEALINGS IN THE SOFTWARE.  */
 #include <math.h>
 #include <unistd.h>
 #include <inttypes.h>
+#include <string.h>
 
 #include <htslib/vcf.h>
 #include <htslib/synced_bcf_reader.h>
@@ -42,16 +43,23 @@ DEALINGS IN THE SOFTWARE.  */
 typedef struct _args_t
 {
     bcf_hdr_t *hdr;     /*! VCF file header */
-    int *gt_arr;        /*! temporary array, to store GTs of current line/record */
-    int ngt_arr;        /*! hold the number of current GT array entries */
     int nsmp;           /*! number of samples, can be determined from header but is needed in multiple contexts */
     int n_sel_smps;     /*! number of selected samples who should exclusively share genotypes */
     int *selected_smps; /*! pointer to start of array containing 1 at indices corresponding to selected samples in header dict and 0 at others*/
+    uint16_t *sel_lanes;/*! 0x8000 for selected samples and 0 for others, padded to a multiple of four, see pass_diploid_int8() */
 }
 args_t;
 
 static args_t args;
 
+/*! the per-thread state of process_batch(), process() uses its own */
+typedef struct
+{
+    int *gt_arr, ngt_arr;
+}
+ctx_t;
+static ctx_t main_ctx;
+
 const char *about(void)
 {
     return "Output only sites where the requested samples all exclusively share a genotype (GT).\n";
@@ -146,27 +154,78 @@ int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
 
     if ( bcf_hdr_id2int(args.hdr, BCF_DT_ID, "GT")<0 ) error("[E::%s] GT not present in the header\n", __func__);
 
-    args.gt_arr = NULL;
+    args.sel_lanes = (uint16_t*) calloc((args.nsmp+3)/4*4,sizeof(uint16_t));
+    for ( i = 0; i < args.nsmp; i++ )
+        if ( args.selected_smps[i] ) args.sel_lanes[i] = 0x8000;
 
     return 0;
 }
 
 
+/*
+ * Diploid genotypes stored as int8, the most common case, are tested directly
+ * in the packed record, four samples at a time: each sample's two alleles are
+ * one 16-bit lane of a 64-bit word and the high bit of each lane is set by the
+ * SWAR tests for equal and missing genotypes. A sample fails when not missing
+ * and its equality differs from its selection.
+ */
+#define LANES_LO 0x7fff7fff7fff7fffULL
+#define LANES_HI 0x8000800080008000ULL
+#define BYTES_LO 0x7f7f7f7f7f7f7f7fULL
+#define BYTES_HI 0x8080808080808080ULL
+static int pass_diploid_int8(const uint8_t *gt, int nsmp, const uint16_t *sel_lanes)
+{
+    // the reference genotype: the first selected sample with both alleles present
+    int i;
+    for (i=0; i<nsmp; i++)
+        if ( sel_lanes[i] && gt[2*i] && gt[2*i+1] ) break;
+    if ( i==nsmp ) return 1;    // none of the other samples can match then
+
+    uint8_t ref[8];
+    int j;
+    for (j=0; j<8; j+=2) { ref[j] = gt[2*i]; ref[j+1] = gt[2*i+1]; }
+    uint64_t pat, x, sel, t, eq, miss;
+    memcpy(&pat, ref, 8);
+    for (i=0; i+4<=nsmp; i+=4)
+    {
+        memcpy(&x, gt + 2*i, 8);
+        memcpy(&sel, sel_lanes + i, 8);
+        t    = x ^ pat;
+        eq   = ~(((t & LANES_LO) + LANES_LO) | t) & LANES_HI;
+        miss = ~(((x & BYTES_LO) + BYTES_LO) | x) & BYTES_HI;
+        miss = (miss | miss<<8) & LANES_HI;
+        if ( ~miss & (sel ^ eq) & LANES_HI ) return 0;
+    }
+    for (; i<nsmp; i++)
+    {
+        const uint8_t *b = gt + 2*i;
+        if ( !b[0] || !b[1] ) continue;
+        int is_eq = b[0]==ref[0] && b[1]==ref[1];
+        if ( is_eq != (sel_lanes[i] ? 1 : 0) ) return 0;
+    }
+    return 1;
+}
+
 /*
  * GT field (genotype) comparison function.
  */
-bcf1_t *process(bcf1_t *rec)
+static int subset_pass(ctx_t *ctx, bcf1_t *rec)
 {
     uint64_t i;
     bcf_unpack(rec, BCF_UN_FMT); // unpack the Format fields, including the GT field
+
+    bcf_fmt_t *fmt = bcf_get_fmt(args.hdr, rec, "GT");
+    if ( fmt && fmt->type==BCF_BT_INT8 && fmt->n==2 )
+        return pass_diploid_int8(fmt->p, args.nsmp, args.sel_lanes);
+
     int gte_smp = 0; // number GT array entries per sample (should be 2, one entry per allele)
-    args.ngt_arr = 0;        /*! hold the number of current GT array entries */
-    if ( (gte_smp = bcf_get_genotypes(args.hdr, rec, &(args.gt_arr), &(args.ngt_arr) ) ) <= 0 )
+    if ( (gte_smp = bcf_get_genotypes(args.hdr, rec, &(ctx->gt_arr), &(ctx->ngt_arr) ) ) <= 0 )
     {
         error("GT not present at %s: %d\n", args.hdr->id[BCF_DT_CTG][rec->rid].key, rec->pos+1);
     }
+    int *gt_arr = ctx->gt_arr;
 
-    gte_smp /= args.nsmp; // divide total number of genotypes array entries (= args.ngt_arr) by number of samples
+    gte_smp /= args.nsmp; // divide total number of genotypes array entries (= ctx->ngt_arr) by number of samples
 
     // initialize with missing genotype
     int a1 = 0;
@@ -179,8 +238,8 @@ bcf1_t *process(bcf1_t *rec)
        gt++;
        if (gt == args.nsmp) break;
        if (args.selected_smps[gt] == 0) continue;
-       a1 = (args.gt_arr + gte_smp * gt)[0];
-       if ( gte_smp == 2 ) a2 = (args.gt_arr + gte_smp * gt)[1];
+       a1 = (gt_arr + gte_smp * gt)[0];
+       if ( gte_smp == 2 ) a2 = (gt_arr + gte_smp * gt)[1];
        else if ( gte_smp == 1 ) a2 = bcf_int32_vector_end;
        else error("GTsubset does not support ploidy higher than 2.\n");
     }
@@ -190,7 +249,7 @@ bcf1_t *process(bcf1_t *rec)
     gt = 0;
     for ( i = 0; i < args.nsmp; i++ )
     {
-        int *gt_ptr = args.gt_arr + gte_smp * i;
+        int *gt_ptr = gt_arr + gte_smp * i;
 
         int b1 = gt_ptr[0];
         int b2;
@@ -247,20 +306,43 @@ bcf1_t *process(bcf1_t *rec)
             }
         }
     }
-    if ( gt == args.nsmp )
-    {
-        return rec;
-    }
-    else
-    {
-        return NULL;
-    }
+    return gt == args.nsmp ? 1 : 0;
+}
+
+bcf1_t *process(bcf1_t *rec)
+{
+    return subset_pass(&main_ctx, rec) ? rec : NULL;
+}
+
+/*
+ * The batch API: the records are tested independently, the worker threads
+ * differ only in the GT buffers.
+ */
+void *init_thread(int ithread)
+{
+    return calloc(1, sizeof(ctx_t));
 }
 
+int process_batch(void *ctx, bcf1_t **recs, int nrecs)
+{
+    int i;
+    for (i=0; i<nrecs; i++)
+        if ( !subset_pass((ctx_t*)ctx, recs[i]) ) recs[i] = NULL;
+    return 0;
+}
+
+void reduce(void *ctx)
+{
+    free(((ctx_t*)ctx)->gt_arr);
+    free(ctx);
+}
+
+
 void destroy(void)
 {
     /* freeing up args */
     bcf_hdr_destroy(args.hdr);
-    free(args.gt_arr);
+    free(main_ctx.gt_arr);
     free(args.selected_smps);
+    free(args.sel_lanes);
 }
@@ -36,6 +36,7 @@
 #include <inttypes.h>
 #include "bcftools.h"
 #include "convert.h"
+#include "fisher.h"
 
 typedef struct
 {
@@ -55,6 +56,11 @@ typedef struct
     convert_t *convert;
     kstring_t str;
     uint64_t nsite,ncmp;
+    fisher_cache_t *fisher;
+    int32_t *tab;       // the 2x2 tables of the pairs tested at the current site
+    int *itab, mtab, mitab;
+    double *pval;
+    int mpval;
 }
 args_t;
 
@@ -164,6 +170,7 @@ int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
     if ( !fname ) error("Expected the -s option\n");
     parse_samples(&args, fname);
     if ( format ) args.convert = convert_init(args.hdr, NULL, 0, format);
+    args.fisher = fisher_cache_init();
     printf("# This file was produced by: bcftools +ad-bias(%s+htslib-%s)\n", bcftools_version(),hts_version());
     printf("# The command line was:\tbcftools +ad-bias %s", argv[0]);
     for (c=1; c<argc; c++) printf(" %s",argv[c]);
@@ -183,7 +190,11 @@ bcf1_t *process(bcf1_t *rec)
     if ( args.convert ) convert_line(args.convert, rec, &args.str);
     args.nsite++;
 
-    int i;
+    // Collect the tables first and test them all at once, the same tables
+    // repeat across the pairs and sites and are looked up in the cache
+    int i, ntab = 0;
+    hts_expand(int32_t, 4*args.npair, args.mtab, args.tab);
+    hts_expand(int, args.npair, args.mitab, args.itab);
     for (i=0; i<args.npair; i++)
     {
         pair_t *pair = &args.pair[i];
@@ -196,18 +207,26 @@ bcf1_t *process(bcf1_t *rec)
         if ( bptr[0]+bptr[1] < args.min_dp ) continue;
         if ( aptr[1] < args.min_alt_dp && bptr[1] < args.min_alt_dp ) continue;
 
-        args.ncmp++;
+        int32_t *tab = args.tab + 4*ntab;
+        tab[0] = aptr[0]; tab[1] = aptr[1];
+        tab[2] = bptr[0]; tab[3] = bptr[1];
+        args.itab[ntab++] = i;
+    }
+    args.ncmp += ntab;
+    hts_expand(double, ntab, args.mpval, args.pval);
+    fisher_exact_batch(args.fisher, ntab, args.tab, args.pval);
 
-        int n11 = aptr[0], n12 = aptr[1];
-        int n21 = bptr[0], n22 = bptr[1];
-        double left, right, fisher;
-        kt_fisher_exact(n11,n12,n21,n22, &left,&right,&fisher);
+    for (i=0; i<ntab; i++)
+    {
+        double fisher = args.pval[i];
         if ( fisher >= args.th ) continue;
 
+        pair_t *pair = &args.pair[args.itab[i]];
+        int32_t *tab = args.tab + 4*i;
         printf("FT\t%s\t%s\t%s\t%d\t%d\t%d\t%d\t%d\t%e",
             pair->smpl_name,pair->ctrl_name,
             bcf_hdr_id2name(args.hdr,rec->rid), rec->pos+1,
-            n11,n12,n21,n22, fisher
+            tab[0],tab[1],tab[2],tab[3], fisher
             );
         if ( args.convert ) printf("\t%s", args.str.s);
         printf("\n");
@@ -223,4 +242,8 @@ void destroy(void)
     free(args.str.s);
     free(args.pair);
     free(args.ad_arr);
+    free(args.tab);
+    free(args.itab);
+    free(args.pval);
+    fisher_cache_destroy(args.fisher);
 }
@@ -1,2 +1,2 @@
-plugins/ad-bias.so: plugins/ad-bias.c version.h version.c convert.h convert.c
-	$(CC) $(PLUGIN_FLAGS) $(CFLAGS) $(EXTRA_CPPFLAGS) $(CPPFLAGS) $(LDFLAGS) -o $@ convert.c version.c $< $(LIBS)
+plugins/ad-bias.so: plugins/ad-bias.c version.h version.c convert.h convert.c fisher.h fisher.c
+	$(CC) $(PLUGIN_FLAGS) $(CFLAGS) $(EXTRA_CPPFLAGS) $(CPPFLAGS) $(LDFLAGS) -o $@ convert.c fisher.c version.c $< $(LIBS)
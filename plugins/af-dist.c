@@ -133,10 +133,10 @@ int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
     return 1;
 }
 
-bcf1_t *process(bcf1_t *rec)
+static void process_rec(args_t *args, bcf1_t *rec)
 {
     int naf = bcf_get_info_float(args->hdr,rec,args->af_tag,&args->af,&args->naf);
-    if ( naf<=0 ) return NULL;
+    if ( naf<=0 ) return;
     float af = args->af[0];
 
     float pRA = 2*af*(1-af);
@@ -185,10 +185,57 @@ bcf1_t *process(bcf1_t *rec)
         int iAF = bin_get_idx(args->dev_bins,af_dev);
         args->dev_dist[iAF]++;
     }
+}
 
+bcf1_t *process(bcf1_t *rec)
+{
+    process_rec(args, rec);
     return NULL;
 }
 
+/*
+    The thread context is a copy of args with private histograms and buffers,
+    the bins are shared
+*/
+void *init_thread(int ithread)
+{
+    if ( args->list_min!=-1 ) error("The --list option cannot be combined with --record-threads\n");
+    args_t *targs = (args_t*) malloc(sizeof(args_t));
+    *targs = *args;
+    targs->dev_dist  = (uint64_t*) calloc(bin_get_size(args->dev_bins),sizeof(*targs->dev_dist));
+    targs->prob_dist = (uint64_t*) calloc(bin_get_size(args->prob_bins),sizeof(*targs->prob_dist));
+    targs->gt = NULL;
+    targs->af = NULL;
+    targs->ngt = targs->naf = 0;
+    return targs;
+}
+
+int process_batch(void *ctx, bcf1_t **recs, int nrecs)
+{
+    int i;
+    for (i=0; i<nrecs; i++)
+    {
+        process_rec((args_t*)ctx, recs[i]);
+        recs[i] = NULL;
+    }
+    return 0;
+}
+
+void reduce(void *ctx)
+{
+    args_t *targs = (args_t*) ctx;
+    int i, n;
+    n = bin_get_size(args->dev_bins);
+    for (i=0; i<n; i++) args->dev_dist[i] += targs->dev_dist[i];
+    n = bin_get_size(args->prob_bins);
+    for (i=0; i<n; i++) args->prob_dist[i] += targs->prob_dist[i];
+    free(targs->dev_dist);
+    free(targs->prob_dist);
+    free(targs->gt);
+    free(targs->af);
+    free(targs);
+}
+
 void destroy(void)
 {
     printf("# PROB_DIST, genotype probability distribution, assumes HWE\n");
@@ -24,10 +24,12 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <strings.h>
 #include <getopt.h>
 #include <stdarg.h>
 #include <stdint.h>
+#include <pthread.h>
 #include <htslib/vcf.h>
 #include <htslib/synced_bcf_reader.h>
 #include <htslib/vcfutils.h>
@@ -36,7 +38,38 @@
 #include <unistd.h>
 #include "bcftools.h"
 
+// With --batch-gap, at most this many adjacent regions are read with a single iterator
+#define MAX_BATCH 16
+
+// The number of batches processed by the threads before the output is flushed
+#define NBATCH_FLUSH 256
+
+// Samples without genotypes in a region
+typedef struct
+{
+    int nsmpl, *smpl, *nsites, nread;
+    int beg, end;       // 0-based, half-open; used to assign the records of a --batch-gap batch
+    kstring_t out;
+}
+region_t;
+
+// Consecutive regions read with one iterator
 typedef struct
+{
+    int ibeg, iend;
+}
+batch_t;
+
+typedef struct
+{
+    struct _args_t *args;
+    htsFile *fp;
+    bcf1_t *rec;
+    kstring_t tmps;
+}
+worker_t;
+
+typedef struct _args_t
 {
     int argc;
     char **argv, *fname, *region, **regs;
@@ -46,9 +79,16 @@ typedef struct
     bcf1_t *rec;
     tbx_t *tbx;
     hts_idx_t *idx;
-    hts_itr_t *itr;
     htsFile *fp;
     bcf_hdr_t *hdr;
+
+    // --threads and --batch-gap
+    int nthreads, batch_gap, nbatch, ibatch, jbatch;
+    batch_t *batch;
+    region_t *reg;
+    worker_t *workers;
+    pthread_t *threads;
+    pthread_mutex_t lock;
 }
 args_t;
 
@@ -65,12 +105,46 @@ static const char *usage_text(void)
         "\n"
         "Usage: bcftools +check-sparsity <file.vcf.gz> [Plugin Options]\n"
         "Plugin options:\n"
+        "   -b, --batch-gap <int>           read adjacent regions closer than <int> bp with a single index query\n"
         "   -n, --n-markers <int>           minimum number of required markers [1]\n"
         "   -r, --regions <chr:beg-end>     restrict to comma-separated list of regions\n"
         "   -R, --regions-file <file>       restrict to regions listed in a file\n"
+        "       --threads <int>             number of threads to test the regions, requires an index [1]\n"
         "\n";
 }
 
+// Group adjacent regions on the same chromosome into batches. Without --batch-gap, or for
+// regions which are not in the chr:beg-end format, each region has its own batch
+static void init_batches(args_t *args)
+{
+    int i;
+    args->reg   = (region_t*) calloc(args->nregs, sizeof(region_t));
+    args->batch = (batch_t*) malloc(sizeof(batch_t)*args->nregs);
+    const char *prev_chr = NULL;
+    int prev_len = 0;
+    for (i=0; i<args->nregs; i++)
+    {
+        region_t *reg = &args->reg[i];
+        const char *chr_end = hts_parse_reg(args->regs[i], &reg->beg, &reg->end);
+        int is_range = chr_end && *chr_end==':';
+        int len = chr_end ? chr_end - args->regs[i] : 0;
+        if ( args->batch_gap>=0 && is_range && prev_chr && prev_len==len && !strncmp(prev_chr,args->regs[i],len)
+                && reg->beg - args->reg[i-1].end <= args->batch_gap && reg->beg >= args->reg[i-1].beg
+                && i - args->batch[args->nbatch-1].ibeg < MAX_BATCH )
+        {
+            args->batch[args->nbatch-1].iend = i+1;
+        }
+        else
+        {
+            args->batch[args->nbatch].ibeg = i;
+            args->batch[args->nbatch].iend = i+1;
+            args->nbatch++;
+        }
+        prev_chr = is_range ? args->regs[i] : NULL;
+        prev_len = len;
+    }
+}
+
 static void init_data(args_t *args)
 {
     args->fp = hts_open(args->fname,"r");
@@ -113,11 +187,40 @@ static void init_data(args_t *args)
         }
         else
             args->regs = (char**) (args->tbx ? tbx_seqnames(args->tbx, &args->nregs) : bcf_index_seqnames(args->idx, args->hdr, &args->nregs));
+        init_batches(args);
     }
+    else if ( args->nthreads>1 ) error("The --threads option requires an indexed file\n");
+
+    if ( args->nthreads > args->nbatch ) args->nthreads = args->nbatch;
+    if ( args->nthreads < 1 ) args->nthreads = 1;
+    args->workers = (worker_t*) calloc(args->nthreads, sizeof(worker_t));
+    args->threads = (pthread_t*) malloc(sizeof(pthread_t)*args->nthreads);
+    for (i=0; i<args->nthreads; i++)
+    {
+        worker_t *worker = &args->workers[i];
+        worker->args = args;
+        worker->rec  = bcf_init1();
+        if ( i==0 ) { worker->fp = args->fp; continue; }
+        worker->fp = hts_open(args->fname,"r");     // each thread needs its own file handle to seek
+        if ( !worker->fp ) error("Could not read %s\n", args->fname);
+    }
+    pthread_mutex_init(&args->lock, NULL);
 }
 static void destroy_data(args_t *args)
 {
     int i;
+    for (i=0; i<args->nthreads; i++)
+    {
+        worker_t *worker = &args->workers[i];
+        bcf_destroy(worker->rec);
+        free(worker->tmps.s);
+        if ( i>0 ) hts_close(worker->fp);
+    }
+    free(args->workers);
+    free(args->threads);
+    free(args->batch);
+    free(args->reg);
+    pthread_mutex_destroy(&args->lock);
     if ( args->regs_free )
         for (i=0; i<args->nregs; i++) free(args->regs[i]);
     free(args->regs);
@@ -126,12 +229,47 @@ static void destroy_data(args_t *args)
     free(args->tmps.s);
     free(args->smpl);
     free(args->nsites);
-    if ( args->itr ) hts_itr_destroy(args->itr);
     if ( args->tbx ) tbx_destroy(args->tbx);
     if ( args->idx ) hts_idx_destroy(args->idx);
     hts_close(args->fp);
 }
 
+static bcf_fmt_t *get_gt_fmt(args_t *args, bcf1_t *rec)
+{
+    int i;
+    bcf_unpack(rec, BCF_UN_FMT);
+    bcf_fmt_t *fmt_gt = NULL;
+    for (i=0; i<rec->n_fmt; i++)
+        if ( rec->d.fmt[i].id==args->gt_id ) { fmt_gt = &rec->d.fmt[i]; break; }
+    if ( !fmt_gt ) return NULL;         // no GT tag
+    if ( fmt_gt->n==0 ) return NULL;    // empty?!
+    if ( fmt_gt->type!=BCF_BT_INT8 ) error("TODO: the GT fmt_type is not int8!\n");
+    return fmt_gt;
+}
+
+// Update the array of missing samples, returns the number of samples left
+static int update_missing(args_t *args, bcf_fmt_t *fmt_gt, int *smpl, int *nsites, int nsmpl)
+{
+    int i;
+    for (i=0; i<nsmpl; i++)
+    {
+        int8_t *ptr = (int8_t*) (fmt_gt->p + smpl[i]*fmt_gt->size);
+        int ial = 0;
+        for (ial=0; ial<fmt_gt->n; ial++)
+            if ( ptr[ial]==bcf_gt_missing || ptr[ial]==bcf_int8_vector_end ) break;
+        if ( ial==0 ) continue;     // missing
+        if ( ++nsites[i] < args->min_sites ) continue;
+        if ( i+1<nsmpl )
+        {
+            memmove(smpl+i, smpl+i+1, sizeof(int)*(nsmpl-i-1));
+            memmove(nsites+i, nsites+i+1, sizeof(int)*(nsmpl-i-1));
+        }
+        nsmpl--;
+        i--;
+    }
+    return nsmpl;
+}
+
 static void report(args_t *args, const char *reg)
 {
     int i;
@@ -141,88 +279,150 @@ static void report(args_t *args, const char *reg)
     for (i=0; i<args->nsmpl; i++) args->smpl[i] = i;
     memset(args->nsites, 0, sizeof(int)*args->nsmpl);
 }
-static void test_region(args_t *args, char *reg)
+
+// Without an index the file is streamed and reported by chromosome
+static void test_file(args_t *args)
 {
-    if ( args->tbx )
+    int ret, rid = -1, nread = 0;
+    while (1)
     {
-        args->itr = tbx_itr_querys(args->tbx,reg);
-        if ( !args->itr ) return;
+        if ( args->fp->format.format==vcf )
+        {
+            if ( (ret=hts_getline(args->fp, KS_SEP_LINE, &args->tmps)) < 0 ) break;   // no more lines
+            ret = vcf_parse1(&args->tmps, args->hdr, args->rec);
+            if ( ret<0 ) error("Could not parse the line: %s\n", args->tmps.s);
+        }
+        else if ( args->fp->format.format==bcf )
+        {
+            ret = bcf_read1(args->fp, args->hdr, args->rec);
+            if ( ret < -1 ) error("Could not parse %s\n", args->fname);
+            if ( ret < 0 ) break; // no more lines or an error
+        }
+        if ( rid!=-1 && rid!=args->rec->rid )
+        {
+            report(args, bcf_hdr_id2name(args->hdr,rid));
+            nread = 0;
+        }
+        rid = args->rec->rid;
+
+        bcf_fmt_t *fmt_gt = get_gt_fmt(args, args->rec);
+        if ( !fmt_gt ) continue;
+        args->nsmpl = update_missing(args, fmt_gt, args->smpl, args->nsites, args->nsmpl);
+        nread = 1;
+        if ( !args->nsmpl ) break;
     }
-    else if ( args->idx )
+    if ( nread ) report(args, bcf_hdr_id2name(args->hdr,rid));
+}
+
+static void test_batch(worker_t *worker, batch_t *batch)
+{
+    args_t *args = worker->args;
+    int i, nsmpl = bcf_hdr_nsamples(args->hdr), nreg = batch->iend - batch->ibeg;
+    region_t *reg = args->reg + batch->ibeg;
+    for (i=0; i<nreg; i++)
     {
-        args->itr = bcf_itr_querys(args->idx,args->hdr,reg);
-        if ( !args->itr ) return;
+        int j;
+        reg[i].nsmpl  = nsmpl;
+        reg[i].smpl   = (int*) malloc(sizeof(int)*nsmpl);
+        reg[i].nsites = (int*) calloc(nsmpl, sizeof(int));
+        for (j=0; j<nsmpl; j++) reg[i].smpl[j] = j;
     }
 
-    int ret,i, rid = -1, nread = 0;
-    while (1)
+    // a single region is queried as given, a batch by the range spanning all its regions
+    char *query = args->regs[batch->ibeg];
+    kstring_t str = {0,0,0};
+    if ( nreg>1 )
+    {
+        int beg, end = reg[0].end;
+        for (i=1; i<nreg; i++)
+            if ( end < reg[i].end ) end = reg[i].end;
+        const char *chr_end = hts_parse_reg(query, &beg, &beg);
+        kputsn(query, chr_end - query, &str);
+        ksprintf(&str, ":%d-%d", reg[0].beg+1, end);
+        query = str.s;
+    }
+
+    hts_itr_t *itr = args->tbx ? tbx_itr_querys(args->tbx,query) : bcf_itr_querys(args->idx,args->hdr,query);
+    int ret, nactive = nreg;
+    while ( itr )
     {
         if ( args->tbx )
         {
-            if ( (ret=tbx_itr_next(args->fp, args->tbx, args->itr, &args->tmps)) < 0 ) break;  // no more lines
-            ret = vcf_parse1(&args->tmps, args->hdr, args->rec);
-            if ( ret<0 ) error("Could not parse the line: %s\n", args->tmps.s);
+            if ( (ret=tbx_itr_next(worker->fp, args->tbx, itr, &worker->tmps)) < 0 ) break;  // no more lines
+            ret = vcf_parse1(&worker->tmps, args->hdr, worker->rec);
+            if ( ret<0 ) error("Could not parse the line: %s\n", worker->tmps.s);
         }
-        else if ( args->idx )
+        else
         {
-            ret = bcf_itr_next(args->fp, args->itr, args->rec);
-            if ( ret < -1 ) error("Could not parse a line from %s\n", reg);
+            ret = bcf_itr_next(worker->fp, itr, worker->rec);
+            if ( ret < -1 ) error("Could not parse a line from %s\n", query);
             if ( ret < 0 ) break; // no more lines or an error
         }
-        else
+
+        bcf_fmt_t *fmt_gt = get_gt_fmt(args, worker->rec);
+        if ( !fmt_gt ) continue;
+        for (i=0; i<nreg; i++)
         {
-            if ( args->fp->format.format==vcf )
-            {
-                if ( (ret=hts_getline(args->fp, KS_SEP_LINE, &args->tmps)) < 0 ) break;   // no more lines
-                ret = vcf_parse1(&args->tmps, args->hdr, args->rec);
-                if ( ret<0 ) error("Could not parse the line: %s\n", args->tmps.s);
-            }
-            else if ( args->fp->format.format==bcf )
-            {
-                ret = bcf_read1(args->fp, args->hdr, args->rec);
-                if ( ret < -1 ) error("Could not parse %s\n", args->fname);
-                if ( ret < 0 ) break; // no more lines or an error
-            }
-            if ( rid!=-1 && rid!=args->rec->rid )
-            {
-                report(args, bcf_hdr_id2name(args->hdr,rid));
-                nread = 0;
-            }
-            rid = args->rec->rid;
+            if ( !reg[i].nsmpl ) continue;
+            if ( nreg>1 && (worker->rec->pos >= reg[i].end || worker->rec->pos + worker->rec->rlen <= reg[i].beg) ) continue;
+            reg[i].nsmpl = update_missing(args, fmt_gt, reg[i].smpl, reg[i].nsites, reg[i].nsmpl);
+            reg[i].nread = 1;
+            if ( !reg[i].nsmpl ) nactive--;
         }
+        if ( !nactive ) break;
+    }
+    if ( itr ) hts_itr_destroy(itr);
+    free(str.s);
+
+    for (i=0; i<nreg; i++)
+    {
+        int j;
+        if ( reg[i].nread )
+            for (j=0; j<reg[i].nsmpl; j++)
+                ksprintf(&reg[i].out, "%s\t%s\n", args->regs[batch->ibeg+i], args->hdr->samples[reg[i].smpl[j]]);
+        free(reg[i].smpl);
+        free(reg[i].nsites);
+        reg[i].smpl = reg[i].nsites = NULL;
+    }
+}
+
+static void *test_worker(void *arg)
+{
+    worker_t *worker = (worker_t*) arg;
+    args_t *args = worker->args;
+    while (1)
+    {
+        pthread_mutex_lock(&args->lock);
+        int ibatch = args->ibatch < args->jbatch ? args->ibatch++ : -1;
+        pthread_mutex_unlock(&args->lock);
+        if ( ibatch<0 ) break;
+        test_batch(worker, &args->batch[ibatch]);
+    }
+    return NULL;
+}
 
-        bcf_unpack(args->rec, BCF_UN_FMT);
-        bcf_fmt_t *fmt_gt = NULL;
-        for (i=0; i<args->rec->n_fmt; i++)
-            if ( args->rec->d.fmt[i].id==args->gt_id ) { fmt_gt = &args->rec->d.fmt[i]; break; }
-        if ( !fmt_gt ) continue;        // no GT tag
-        if ( fmt_gt->n==0 ) continue;   // empty?!
-        if ( fmt_gt->type!=BCF_BT_INT8 ) error("TODO: the GT fmt_type is not int8!\n");
+// Test the batches in chunks of NBATCH_FLUSH, the output is printed in the input order
+static void test_regions(args_t *args)
+{
+    int i, ibeg;
+    for (ibeg=0; ibeg<args->nbatch; ibeg+=NBATCH_FLUSH)
+    {
+        args->ibatch = ibeg;
+        args->jbatch = ibeg + NBATCH_FLUSH < args->nbatch ? ibeg + NBATCH_FLUSH : args->nbatch;
+        for (i=1; i<args->nthreads; i++)
+            if ( pthread_create(&args->threads[i], NULL, test_worker, &args->workers[i]) ) error("Failed to create a thread\n");
+        test_worker(&args->workers[0]);
+        for (i=1; i<args->nthreads; i++) pthread_join(args->threads[i], NULL);
 
-        // update the array of missing samples
-        for (i=0; i<args->nsmpl; i++)
+        int ireg, jreg = args->batch[args->jbatch-1].iend;
+        for (ireg=args->batch[ibeg].ibeg; ireg<jreg; ireg++)
         {
-            int8_t *ptr = (int8_t*) (fmt_gt->p + args->smpl[i]*fmt_gt->size);
-            int ial = 0;
-            for (ial=0; ial<fmt_gt->n; ial++)
-                if ( ptr[ial]==bcf_gt_missing || ptr[ial]==bcf_int8_vector_end ) break;
-            if ( ial==0 ) continue;     // missing
-            if ( ++args->nsites[i] < args->min_sites ) continue;
-            if ( i+1<args->nsmpl )
-            {
-                memmove(args->smpl+i, args->smpl+i+1, sizeof(int)*(args->nsmpl-i-1));
-                memmove(args->nsites+i, args->nsites+i+1, sizeof(int)*(args->nsmpl-i-1));
-            }
-            args->nsmpl--;
-            i--;
+            region_t *reg = &args->reg[ireg];
+            if ( reg->out.l ) fwrite(reg->out.s, 1, reg->out.l, stdout);
+            free(reg->out.s);
+            memset(&reg->out, 0, sizeof(reg->out));
         }
-        nread = 1;
-        if ( !args->nsmpl ) break;
     }
-    if ( nread ) report(args, rid==-1 ? reg : bcf_hdr_id2name(args->hdr,rid));
-
-    tbx_itr_destroy(args->itr);
-    args->itr = NULL;
 }
 
 int run(int argc, char **argv)
@@ -230,16 +430,20 @@ int run(int argc, char **argv)
     args_t *args = (args_t*) calloc(1,sizeof(args_t));
     args->argc   = argc; args->argv = argv;
     args->min_sites = 1;
+    args->nthreads  = 1;
+    args->batch_gap = -1;
     static struct option loptions[] =
     {
         {"n-markers",required_argument,NULL,'n'},
         {"regions",required_argument,NULL,'r'},
         {"regions-file",required_argument,NULL,'R'},
+        {"batch-gap",required_argument,NULL,'b'},
+        {"threads",required_argument,NULL,1},
         {NULL,0,NULL,0}
     };
-    int c,i;
+    int c;
     char *tmp;
-    while ((c = getopt_long(argc, argv, "vr:R:n:",loptions,NULL)) >= 0)
+    while ((c = getopt_long(argc, argv, "vr:R:n:b:",loptions,NULL)) >= 0)
     {
         switch (c) 
         {
@@ -247,6 +451,14 @@ int run(int argc, char **argv)
                 args->min_sites = strtol(optarg,&tmp,10);
                 if ( *tmp ) error("Could not parse: -n %s\n", optarg);
                 break;
+            case 'b':
+                args->batch_gap = strtol(optarg,&tmp,10);
+                if ( *tmp || args->batch_gap<0 ) error("Could not parse: -b %s\n", optarg);
+                break;
+            case  1 :
+                args->nthreads = strtol(optarg,&tmp,10);
+                if ( *tmp || args->nthreads<1 ) error("Could not parse: --threads %s\n", optarg);
+                break;
             case 'R': args->region_is_file = 1; 
             case 'r': args->region = optarg; break; 
             case 'h':
@@ -263,11 +475,10 @@ int run(int argc, char **argv)
     else args->fname = argv[optind];
     init_data(args);
 
-    for (i=0; i<args->nregs; i++) test_region(args, args->regs[i]);
-    if ( !args->nregs ) test_region(args, NULL);
+    if ( args->nregs ) test_regions(args);
+    else if ( !args->tbx && !args->idx ) test_file(args);
 
     destroy_data(args);
     free(args);
     return 0;
 }
-
@@ -24,9 +24,17 @@ DEALINGS IN THE SOFTWARE.  */
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <htslib/vcf.h>
 
-int nsamples, nsnps, nindels, nmnps, nothers, nsites;
+typedef struct
+{
+    int nsnps, nindels, nmnps, nothers, nsites;
+}
+counts_t;
+
+int nsamples;
+counts_t counts;
 
 /*
     This short description is used to generate the output of `bcftools plugin -l`.
@@ -45,38 +53,75 @@ const char *about(void)
 int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
 {
     nsamples = bcf_hdr_nsamples(in);
-    nsnps = nindels = nmnps = nothers = nsites = 0;
+    memset(&counts, 0, sizeof(counts));
     return 1;
 }
 
 
+static void count_rec(counts_t *cnt, bcf1_t *rec)
+{
+    int type = bcf_get_variant_types(rec);
+    if ( type & VCF_SNP ) cnt->nsnps++;
+    if ( type & VCF_INDEL ) cnt->nindels++;
+    if ( type & VCF_MNP ) cnt->nmnps++;
+    if ( type & VCF_OTHER ) cnt->nothers++;
+    cnt->nsites++;
+}
+
 /*
     Called for each VCF record. Return rec to output the line or NULL
     to suppress output.
 */
 bcf1_t *process(bcf1_t *rec)
 {
-    int type = bcf_get_variant_types(rec);
-    if ( type & VCF_SNP ) nsnps++;
-    if ( type & VCF_INDEL ) nindels++;
-    if ( type & VCF_MNP ) nmnps++;
-    if ( type & VCF_OTHER ) nothers++;
-    nsites++;
+    count_rec(&counts, rec);
     return NULL;
 }
 
 
+/*
+    The optional batch API used with --record-threads: each thread counts
+    into its own context, the contexts are summed in reduce().
+*/
+void *init_thread(int ithread)
+{
+    return calloc(1, sizeof(counts_t));
+}
+
+int process_batch(void *ctx, bcf1_t **recs, int nrecs)
+{
+    int i;
+    for (i=0; i<nrecs; i++)
+    {
+        count_rec((counts_t*)ctx, recs[i]);
+        recs[i] = NULL;
+    }
+    return 0;
+}
+
+void reduce(void *ctx)
+{
+    counts_t *cnt = (counts_t*) ctx;
+    counts.nsnps   += cnt->nsnps;
+    counts.nindels += cnt->nindels;
+    counts.nmnps   += cnt->nmnps;
+    counts.nothers += cnt->nothers;
+    counts.nsites  += cnt->nsites;
+    free(cnt);
+}
+
+
 /*
     Clean up.
 */
 void destroy(void)
 {
     printf("Number of samples: %d\n", nsamples);
-    printf("Number of SNPs:    %d\n", nsnps);
-    printf("Number of INDELs:  %d\n", nindels);
-    printf("Number of MNPs:    %d\n", nmnps);
-    printf("Number of others:  %d\n", nothers);
-    printf("Number of sites:   %d\n", nsites);
+    printf("Number of SNPs:    %d\n", counts.nsnps);
+    printf("Number of INDELs:  %d\n", counts.nindels);
+    printf("Number of MNPs:    %d\n", counts.nmnps);
+    printf("Number of others:  %d\n", counts.nothers);
+    printf("Number of sites:   %d\n", counts.nsites);
 }
 
 
@@ -24,9 +24,14 @@ DEALINGS IN THE SOFTWARE.  */
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
 #include <htslib/vcf.h>
+#include <htslib/kstring.h>
 #include <math.h>
 #include <getopt.h>
+#include "bcftools.h"
 
 
 /*
@@ -47,24 +52,43 @@ const char *usage(void)
         "   run \"bcftools plugin\" for a list of common options\n"
         "\n"
         "Plugin options:\n"
-        "   -t, --tags <list>   VCF tags to determine the dosage from [PL,GL,GT]\n"
+        "   -b, --binary <prefix>   write a binary matrix <prefix>.bin with <prefix>.sites and <prefix>.samples, see the man page\n"
+        "   -t, --tags <list>       VCF tags to determine the dosage from [PL,GL,GT]\n"
         "\n"
         "Example:\n"
         "   bcftools +dosage in.vcf -- -t GT\n"
         "\n";
 }
 
+// Dosages in the binary matrix are stored as uint16_t scaled by BIN_SCALE, missing values as BIN_MISSING
+#define BIN_SCALE   32767.0
+#define BIN_MISSING 0xffff
+
+// The PL->probability lookup table, larger PLs are computed directly
+#define NPL2PROB 256
+
 bcf_hdr_t *in_hdr = NULL;
 int pl_type = 0, gl_type = 0;
 uint8_t *buf = NULL;
 int nbuf = 0;   // NB: number of elements, not bytes
 char **tags = NULL;
 int ntags = 0;
+float *dsg = NULL;      // dosages of the current record, -1 for missing
+float pl2prob[NPL2PROB];
+char *bin_prefix = NULL;
+FILE *bin_fp = NULL, *sites_fp = NULL;
+uint16_t *bin_buf = NULL;
+kstring_t str = {0,0,0};
 
 typedef int (*dosage_f) (bcf1_t *);
 dosage_f *handlers = NULL;
 int nhandlers = 0;
 
+static inline float prob2dosage(float *vals)
+{
+    float sum = vals[0] + vals[1] + vals[2];
+    return sum==0 ? -1 : (vals[1] + 2*vals[2]) / sum;
+}
 
 int calc_dosage_PL(bcf1_t *rec)
 {
@@ -72,54 +96,63 @@ int calc_dosage_PL(bcf1_t *rec)
     if ( nret<0 ) return -1;
 
     nret /= rec->n_sample;
-    #define BRANCH(type_t,is_missing,is_vector_end) \
-    { \
-        type_t *ptr = (type_t*) buf; \
-        for (i=0; i<rec->n_sample; i++) \
-        { \
-            float vals[3] = {0,0,0}; \
-            for (j=0; j<nret; j++) \
-            { \
-                if ( is_missing || is_vector_end ) break; \
-                vals[j] = exp(-0.1*ptr[j]); \
-            } \
-            float sum = vals[0] + vals[1] + vals[2]; \
-            printf("\t%.1f", sum==0 ? -1 : (vals[1] + 2*vals[2]) / sum); \
-            ptr += nret; \
-        } \
+    int nval = nret < 3 ? nret : 3;     // only the first ALT is considered
+    if ( pl_type==BCF_HT_INT )
+    {
+        int32_t *ptr = (int32_t*) buf;
+        for (i=0; i<rec->n_sample; i++)
+        {
+            float vals[3] = {0,0,0};
+            for (j=0; j<nval; j++)
+            {
+                if ( ptr[j]==bcf_int32_missing || ptr[j]==bcf_int32_vector_end ) break;
+                vals[j] = ptr[j]>=0 && ptr[j]<NPL2PROB ? pl2prob[ptr[j]] : exp(-0.1*ptr[j]);
+            }
+            dsg[i] = prob2dosage(vals);
+            ptr += nret;
+        }
     }
-    switch (pl_type)
+    else
     {
-        case BCF_HT_INT:  BRANCH(int32_t,ptr[j]==bcf_int32_missing,ptr[j]==bcf_int32_vector_end); break;
-        case BCF_HT_REAL: BRANCH(float,bcf_float_is_missing(ptr[j]),bcf_float_is_vector_end(ptr[j])); break;
+        float *ptr = (float*) buf;
+        for (i=0; i<rec->n_sample; i++)
+        {
+            float vals[3] = {0,0,0};
+            for (j=0; j<nval; j++)
+            {
+                if ( bcf_float_is_missing(ptr[j]) || bcf_float_is_vector_end(ptr[j]) ) break;
+                vals[j] = exp(-0.1*ptr[j]);
+            }
+            dsg[i] = prob2dosage(vals);
+            ptr += nret;
+        }
     }
-    #undef BRANCH
     return 0;
 }
 
 int calc_dosage_GL(bcf1_t *rec)
 {
-    int i, j, nret = bcf_get_format_values(in_hdr,rec,"GL",(void**)&buf,&nbuf,pl_type);
+    int i, j, nret = bcf_get_format_values(in_hdr,rec,"GL",(void**)&buf,&nbuf,gl_type);
     if ( nret<0 ) return -1;
 
     nret /= rec->n_sample;
+    int nval = nret < 3 ? nret : 3;     // only the first ALT is considered
     #define BRANCH(type_t,is_missing,is_vector_end) \
     { \
         type_t *ptr = (type_t*) buf; \
         for (i=0; i<rec->n_sample; i++) \
         { \
             float vals[3] = {0,0,0}; \
-            for (j=0; j<nret; j++) \
+            for (j=0; j<nval; j++) \
             { \
                 if ( is_missing || is_vector_end ) break; \
-                vals[j] = exp(ptr[j]); \
+                vals[j] = pow(10,ptr[j]); \
             } \
-            float sum = vals[0] + vals[1] + vals[2]; \
-            printf("\t%.1f", sum==0 ? -1 : (vals[1] + 2*vals[2]) / sum); \
+            dsg[i] = prob2dosage(vals); \
             ptr  += nret; \
         } \
     }
-    switch (pl_type)
+    switch (gl_type)
     {
         case BCF_HT_INT:  BRANCH(int32_t,ptr[j]==bcf_int32_missing,ptr[j]==bcf_int32_vector_end); break;
         case BCF_HT_REAL: BRANCH(float,bcf_float_is_missing(ptr[j]),bcf_float_is_vector_end(ptr[j])); break;
@@ -137,18 +170,49 @@ int calc_dosage_GT(bcf1_t *rec)
     int32_t *ptr = (int32_t*) buf;
     for (i=0; i<rec->n_sample; i++)
     {
-        float dsg = 0;
+        float nalt = 0;
         for (j=0; j<nret; j++)
         {
             if ( ptr[j]==bcf_int32_vector_end || bcf_gt_is_missing(ptr[j]) ) break;
-            if ( bcf_gt_allele(ptr[j]) ) dsg += 1;
+            if ( bcf_gt_allele(ptr[j]) ) nalt += 1;
         }
-        printf("\t%.1f", j>0 ? dsg : -1);
+        dsg[i] = j>0 ? nalt : -1;
         ptr += nret;
     }
     return 0;
 }
 
+static void write_text(bcf1_t *rec)
+{
+    int i;
+    printf("%s\t%d\t%s\t%s", bcf_seqname(in_hdr,rec),rec->pos+1,rec->d.allele[0],rec->n_allele>1 ? rec->d.allele[1] : ".");
+    for (i=0; i<rec->n_sample; i++) printf("\t%.1f", dsg[i]);
+    printf("\n");
+}
+
+static void write_binary(bcf1_t *rec)
+{
+    int i;
+    for (i=0; i<rec->n_sample; i++)
+        bin_buf[i] = dsg[i]<0 ? BIN_MISSING : (uint16_t)(dsg[i]*BIN_SCALE + 0.5);
+    if ( fwrite(bin_buf, sizeof(*bin_buf), rec->n_sample, bin_fp)!=rec->n_sample )
+        error("Failed to write to %s.bin: %s\n", bin_prefix, strerror(errno));
+
+    str.l = 0;
+    ksprintf(&str, "%s\t%d\t%s\t%s\n", bcf_seqname(in_hdr,rec),rec->pos+1,rec->d.allele[0],rec->n_allele>1 ? rec->d.allele[1] : ".");
+    if ( fwrite(str.s, 1, str.l, sites_fp)!=str.l )
+        error("Failed to write to %s.sites: %s\n", bin_prefix, strerror(errno));
+}
+
+static FILE *open_output(const char *suffix)
+{
+    str.l = 0;
+    ksprintf(&str, "%s.%s", bin_prefix, suffix);
+    FILE *fp = fopen(str.s, "w");
+    if ( !fp ) error("Failed to open %s: %s\n", str.s, strerror(errno));
+    return fp;
+}
+
 
 char **split_list(char *str, int *nitems)
 {
@@ -177,13 +241,15 @@ int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
     static struct option loptions[] =
     {
         {"tags",1,0,'t'},
+        {"binary",1,0,'b'},
         {0,0,0,0}
     };
-    while ((c = getopt_long(argc, argv, "t:?h",loptions,NULL)) >= 0)
+    while ((c = getopt_long(argc, argv, "t:b:?h",loptions,NULL)) >= 0)
     {
         switch (c) 
         {
             case 't': tags_str = optarg; break;
+            case 'b': bin_prefix = optarg; break;
             case 'h':
             case '?':
             default: fprintf(stderr,"%s", usage()); exit(1); break;
@@ -238,6 +304,20 @@ int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
     free(tags[0]);
     free(tags);
 
+    for (i=0; i<NPL2PROB; i++) pl2prob[i] = exp(-0.1*i);
+    dsg = (float*) malloc(sizeof(*dsg)*(bcf_hdr_nsamples(in_hdr)+1));
+
+    if ( bin_prefix )
+    {
+        FILE *fp = open_output("samples");
+        for (i=0; i<bcf_hdr_nsamples(in_hdr); i++) fprintf(fp, "%s\n", in_hdr->samples[i]);
+        if ( fclose(fp)!=0 ) error("Failed to close %s.samples\n", bin_prefix);
+        sites_fp = open_output("sites");
+        bin_fp   = open_output("bin");
+        bin_buf  = (uint16_t*) malloc(sizeof(*bin_buf)*(bcf_hdr_nsamples(in_hdr)+1));
+        return 1;
+    }
+
     printf("#[1]CHROM\t[2]POS\t[3]REF\t[4]ALT");
     for (i=0; i<bcf_hdr_nsamples(in_hdr); i++) printf("\t[%d]%s", i+5,in_hdr->samples[i]);
     printf("\n");
@@ -248,27 +328,24 @@ int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
 
 bcf1_t *process(bcf1_t *rec)
 {
-    int i, ret;
+    int i;
 
-    printf("%s\t%d\t%s\t%s", bcf_seqname(in_hdr,rec),rec->pos+1,rec->d.allele[0],rec->n_allele>1 ? rec->d.allele[1] : ".");
     if ( rec->n_allele==1 )
     {
-        for (i=0; i<rec->n_sample; i++) printf("\t0.0");
+        for (i=0; i<rec->n_sample; i++) dsg[i] = 0;
     }
     else
     {
         for (i=0; i<nhandlers; i++)
-        {
-            ret = handlers[i](rec);
-            if ( !ret ) break;  // successfully printed
-        }
+            if ( !handlers[i](rec) ) break;  // successfully calculated
         if ( i==nhandlers )
         {
             // none of the annotations present
-            for (i=0; i<rec->n_sample; i++) printf("\t-1.0");
+            for (i=0; i<rec->n_sample; i++) dsg[i] = -1;
         }
     }
-    printf("\n");
+    if ( bin_fp ) write_binary(rec);
+    else write_text(rec);
 
     return NULL;
 }
@@ -276,8 +353,11 @@ bcf1_t *process(bcf1_t *rec)
 
 void destroy(void)
 {
+    if ( bin_fp && fclose(bin_fp)!=0 ) error("Failed to close %s.bin\n", bin_prefix);
+    if ( sites_fp && fclose(sites_fp)!=0 ) error("Failed to close %s.sites\n", bin_prefix);
+    free(bin_buf);
+    free(str.s);
+    free(dsg);
     free(handlers);
     free(buf);
 }
-
-
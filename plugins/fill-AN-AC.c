@@ -27,6 +27,7 @@ DEALINGS IN THE SOFTWARE.  */
 #include <htslib/hts.h>
 #include <htslib/vcf.h>
 #include <htslib/vcfutils.h>
+#include "gtcount.h"
 
 bcf_hdr_t *in_hdr, *out_hdr;
 int *arr = NULL, marr = 0;
@@ -48,7 +49,7 @@ int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
 bcf1_t *process(bcf1_t *rec)
 {
     hts_expand(int,rec->n_allele,marr,arr);
-    int ret = bcf_calc_ac(in_hdr,rec,arr,BCF_UN_FMT);
+    int ret = gtcount_calc_ac(in_hdr,rec,arr,BCF_UN_FMT);
     if ( ret>0 )
     {
         int i, an = 0;
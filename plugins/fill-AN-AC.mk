@@ -0,0 +1,2 @@
+plugins/fill-AN-AC.so: plugins/fill-AN-AC.c version.h version.c gtcount.h
+	$(CC) $(PLUGIN_FLAGS) $(CFLAGS) $(EXTRA_CPPFLAGS) $(CPPFLAGS) $(LDFLAGS) -o $@ version.c $< $(LIBS)
@@ -45,6 +45,9 @@
 #define SET_MAF     (1<<7)
 #define SET_HWE     (1<<8)
 
+// HWE p-values for up to this many diploid genotypes are precomputed
+#define HWE_LOOKUP_NGT 100
+
 typedef struct
 {
     int nhom, nhet, nhemi, nac;
@@ -70,6 +73,7 @@ typedef struct
     int32_t *iarr, niarr, miarr, nfarr, mfarr;
     double *hwe_probs;
     int mhwe_probs;
+    float **hwe_lookup, *hwe_lookup_dat;    // p-values indexed by ngt*(ngt+1)/2+nrare and nhet, shared by threads
     kstring_t str;
 }
 args_t;
@@ -242,6 +246,116 @@ void hdr_append(args_t *args, char *fmt)
         bcf_hdr_printf(args->out_hdr, fmt, args->pop[i].suffix,*args->pop[i].name ? " in " : "",args->pop[i].name);
 }
 
+/* 
+    Wigginton 2005, PMID: 15789306 
+
+    Fill probs[0..nrare] with the probabilities of observing nhet het genotypes
+    given nrare rare alleles in ngt diploid genotypes
+*/
+static void hwe_probs(double *probs, int ngt, int nrare)
+{
+    int nals = 2*ngt;
+    memset(probs, 0, sizeof(*probs)*(nrare+1));
+
+    // start at midpoint
+    int mid = nrare * (nals - nrare) / nals;
+
+    // check to ensure that midpoint and rare alleles have same parity
+    if ( (nrare & 1) ^ (mid & 1) ) mid++;
+
+    int het = mid;
+    int hom_r  = (nrare - mid) / 2;
+    int hom_c  = ngt - het - hom_r;
+    double sum = probs[mid] = 1.0;
+
+    for (het = mid; het > 1; het -= 2)
+    {
+        probs[het - 2] = probs[het] * het * (het - 1.0) / (4.0 * (hom_r + 1.0) * (hom_c + 1.0));
+        sum += probs[het - 2];
+
+        // 2 fewer heterozygotes for next iteration -> add one rare, one common homozygote
+        hom_r++;
+        hom_c++;
+    }
+
+    het = mid;
+    hom_r = (nrare - mid) / 2;
+    hom_c = ngt - het - hom_r;
+    for (het = mid; het <= nrare - 2; het += 2)
+    {
+        probs[het + 2] = probs[het] * 4.0 * hom_r * hom_c / ((het + 2.0) * (het + 1.0));
+        sum += probs[het + 2];
+
+        // add 2 heterozygotes for next iteration -> subtract one rare, one common homozygote
+        hom_r--;
+        hom_c--;
+    }
+
+    for (het=0; het<nrare+1; het++) probs[het] /= sum;
+}
+static float hwe_pvalue(double *probs, int nrare, int nhet)
+{
+    int het;
+    double p_rank = 0.0;
+    for (het=0; het <= nrare; het++)
+    {
+        if ( probs[het] > probs[nhet]) continue;
+        p_rank += probs[het];
+    }
+    return p_rank > 1 ? 1.0 : p_rank;
+}
+
+/*
+    The p-values of small populations are looked up, the exact test is
+    otherwise recalculated for most records
+*/
+static void init_hwe_lookup(args_t *args)
+{
+    int ngt, nrare, nhet, n = 0;
+    for (ngt=0; ngt<=HWE_LOOKUP_NGT; ngt++)
+        for (nrare=0; nrare<=ngt; nrare++) n += nrare + 1;
+
+    args->hwe_lookup_dat = (float*) malloc(sizeof(float)*n);
+    args->hwe_lookup = (float**) malloc(sizeof(float*)*(HWE_LOOKUP_NGT+1)*(HWE_LOOKUP_NGT+2)/2);
+    hts_expand(double,HWE_LOOKUP_NGT+1,args->mhwe_probs,args->hwe_probs);
+
+    float *dat = args->hwe_lookup_dat;
+    for (ngt=0; ngt<=HWE_LOOKUP_NGT; ngt++)
+    {
+        for (nrare=0; nrare<=ngt; nrare++)
+        {
+            args->hwe_lookup[ngt*(ngt+1)/2+nrare] = dat;
+            if ( ngt ) hwe_probs(args->hwe_probs, ngt, nrare);
+            for (nhet=0; nhet<=nrare; nhet++)
+                dat[nhet] = ngt ? hwe_pvalue(args->hwe_probs, nrare, nhet) : 1;
+            dat += nrare + 1;
+        }
+    }
+}
+
+/*
+    nref .. number of reference alleles
+    nalt .. number of alt alleles
+    nhet .. number of het genotypes, assuming number of genotypes = (nref+nalt)*2
+
+*/
+float calc_hwe(args_t *args, int nref, int nalt, int nhet)
+{
+    int ngt   = (nref+nalt) / 2;
+    int nrare = nref < nalt ? nref : nalt;
+
+    // sanity check: there is odd/even number of rare alleles iff there is odd/even number of hets
+    if ( (nrare & 1) ^ (nhet & 1) ) error("nrare/nhet should be both odd or even: nrare=%d nref=%d nalt=%d nhet=%d\n",nrare,nref,nalt,nhet);
+    if ( nrare < nhet ) error("Fewer rare alleles than hets? nrare=%d nref=%d nalt=%d nhet=%d\n",nrare,nref,nalt,nhet);
+    if ( (nref+nalt) & 1 ) error("Expected diploid genotypes: nref=%d nalt=%d\n",nref,nalt);
+
+    if ( ngt<=HWE_LOOKUP_NGT ) return args->hwe_lookup[ngt*(ngt+1)/2+nrare][nhet];
+
+    hts_expand(double,nrare+1,args->mhwe_probs,args->hwe_probs);
+    hwe_probs(args->hwe_probs, ngt, nrare);
+    return hwe_pvalue(args->hwe_probs, nrare, nhet);
+}
+
 int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
 {
     args = (args_t*) calloc(1,sizeof(args_t));
@@ -290,76 +404,9 @@ int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
     if ( args->tags & SET_MAF ) hdr_append(args, "##INFO=<ID=MAF%s,Number=A,Type=Float,Description=\"Minor Allele frequency%s%s\">");
     if ( args->tags & SET_HWE ) hdr_append(args, "##INFO=<ID=HWE%s,Number=A,Type=Float,Description=\"HWE test%s%s (PMID:15789306)\">");
 
-    return 0;
-}
+    if ( args->tags & SET_HWE ) init_hwe_lookup(args);
 
-/* 
-    Wigginton 2005, PMID: 15789306 
-
-    nref .. number of reference alleles
-    nalt .. number of alt alleles
-    nhet .. number of het genotypes, assuming number of genotypes = (nref+nalt)*2
-
-*/
-float calc_hwe(args_t *args, int nref, int nalt, int nhet)
-{
-    int ngt   = (nref+nalt) / 2;
-    int nrare = nref < nalt ? nref : nalt;
-
-    // sanity check: there is odd/even number of rare alleles iff there is odd/even number of hets
-    if ( (nrare & 1) ^ (nhet & 1) ) error("nrare/nhet should be both odd or even: nrare=%d nref=%d nalt=%d nhet=%d\n",nrare,nref,nalt,nhet);
-    if ( nrare < nhet ) error("Fewer rare alleles than hets? nrare=%d nref=%d nalt=%d nhet=%d\n",nrare,nref,nalt,nhet);
-    if ( (nref+nalt) & 1 ) error("Expected diploid genotypes: nref=%d nalt=%d\n",nref,nalt);
-
-    // initialize het probs
-    hts_expand(double,nrare+1,args->mhwe_probs,args->hwe_probs);
-    memset(args->hwe_probs, 0, sizeof(*args->hwe_probs)*(nrare+1));
-    double *probs = args->hwe_probs;
-
-    // start at midpoint
-    int mid = nrare * (nref + nalt - nrare) / (nref + nalt);
-
-    // check to ensure that midpoint and rare alleles have same parity
-    if ( (nrare & 1) ^ (mid & 1) ) mid++;
-
-    int het = mid;
-    int hom_r  = (nrare - mid) / 2;
-    int hom_c  = ngt - het - hom_r;
-    double sum = probs[mid] = 1.0;
-
-    for (het = mid; het > 1; het -= 2)
-    {
-        probs[het - 2] = probs[het] * het * (het - 1.0) / (4.0 * (hom_r + 1.0) * (hom_c + 1.0));
-        sum += probs[het - 2];
-
-        // 2 fewer heterozygotes for next iteration -> add one rare, one common homozygote
-        hom_r++;
-        hom_c++;
-    }
-
-    het = mid;
-    hom_r = (nrare - mid) / 2;
-    hom_c = ngt - het - hom_r;
-    for (het = mid; het <= nrare - 2; het += 2)
-    {
-        probs[het + 2] = probs[het] * 4.0 * hom_r * hom_c / ((het + 2.0) * (het + 1.0));
-        sum += probs[het + 2];
-
-        // add 2 heterozygotes for next iteration -> subtract one rare, one common homozygote
-        hom_r--;
-        hom_c--;
-    }
-
-    for (het=0; het<nrare+1; het++) probs[het] /= sum;
-
-    double p_rank = 0.0;
-    for (het=0; het <= nrare; het++)
-    {
-        if ( probs[het] > probs[nhet]) continue;
-        p_rank += probs[het];
-    }
-
-    return p_rank > 1 ? 1.0 : p_rank;
+    return 0;
 }
 
 static inline void set_counts(pop_t *pop, int is_half, int is_hom, int is_hemi, int als)
@@ -384,7 +431,7 @@ static void clean_counts(pop_t *pop, int nals)
     memset(pop->counts,0,sizeof(counts_t)*nals);
 }
 
-bcf1_t *process(bcf1_t *rec)
+static void process_rec(args_t *args, bcf1_t *rec)
 {
     int i,j, nsmpl = bcf_hdr_nsamples(args->in_hdr);;
 
@@ -392,7 +439,7 @@ bcf1_t *process(bcf1_t *rec)
     bcf_fmt_t *fmt_gt = NULL;
     for (i=0; i<rec->n_fmt; i++)
         if ( rec->d.fmt[i].id==args->gt_id ) { fmt_gt = &rec->d.fmt[i]; break; }
-    if ( !fmt_gt ) return rec;    // no GT tag
+    if ( !fmt_gt ) return;    // no GT tag
 
     hts_expand(int32_t,rec->n_allele, args->miarr, args->iarr);
     hts_expand(float,rec->n_allele, args->mfarr, args->farr);
@@ -594,10 +641,62 @@ bcf1_t *process(bcf1_t *rec)
                 error("Error occurred while updating %s at %s:%d\n", args->str.s,bcf_seqname(args->in_hdr,rec),rec->pos+1);
         }
     }
+}
 
+bcf1_t *process(bcf1_t *rec)
+{
+    process_rec(args, rec);
     return rec;
 }
 
+/*
+    The thread context is a copy of args with private counts and buffers,
+    the population names, sample lists and the HWE lookup are shared
+*/
+void *init_thread(int ithread)
+{
+    int i, nsmpl = bcf_hdr_nsamples(args->in_hdr);
+    args_t *targs = (args_t*) malloc(sizeof(args_t));
+    *targs = *args;
+    targs->pop = (pop_t*) malloc(sizeof(pop_t)*args->npop);
+    for (i=0; i<args->npop; i++)
+    {
+        targs->pop[i] = args->pop[i];
+        targs->pop[i].counts = NULL;
+        targs->pop[i].ncounts = targs->pop[i].mcounts = 0;
+    }
+    targs->smpl2pop = (pop_t**) malloc(sizeof(pop_t*)*nsmpl*(args->npop+1));
+    for (i=0; i<nsmpl*(args->npop+1); i++)
+        targs->smpl2pop[i] = args->smpl2pop[i] ? targs->pop + (args->smpl2pop[i] - args->pop) : NULL;
+    targs->iarr = NULL;
+    targs->farr = NULL;
+    targs->hwe_probs = NULL;
+    targs->miarr = targs->mfarr = targs->mhwe_probs = 0;
+    memset(&targs->str, 0, sizeof(targs->str));
+    return targs;
+}
+
+int process_batch(void *ctx, bcf1_t **recs, int nrecs)
+{
+    int i;
+    for (i=0; i<nrecs; i++) process_rec((args_t*)ctx, recs[i]);
+    return 0;
+}
+
+void reduce(void *ctx)
+{
+    args_t *targs = (args_t*) ctx;
+    int i;
+    for (i=0; i<targs->npop; i++) free(targs->pop[i].counts);
+    free(targs->pop);
+    free(targs->smpl2pop);
+    free(targs->iarr);
+    free(targs->farr);
+    free(targs->hwe_probs);
+    free(targs->str.s);
+    free(targs);
+}
+
 void destroy(void)
 {
     int i; 
@@ -614,6 +713,8 @@ void destroy(void)
     free(args->iarr);
     free(args->farr);
     free(args->hwe_probs);
+    free(args->hwe_lookup);
+    free(args->hwe_lookup_dat);
     free(args);
 }
 
@@ -35,9 +35,10 @@
 
 static bcf_hdr_t *in_hdr = NULL, *out_hdr = NULL;
 static int *sample2sex = NULL;
-static int n_sample = 0, nsex = 0, *sex2ploidy = NULL;
+static int n_sample = 0, nsex = 0;
 static int32_t ngt_arr = 0, *gt_arr = NULL, *gt_arr2 = NULL, ngt_arr2 = 0;
 static ploidy_t *ploidy = NULL;
+static ploidy_cursor_t *ploidy_cursor = NULL;
 
 const char *about(void)
 {
@@ -158,7 +159,7 @@ int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
     for (i=0; i<n_sample; i++) sample2sex[i] = dflt_sex_id; // by default all are F
     if ( sex_fname ) set_samples(sex_fname, in, ploidy, sample2sex);
     nsex = ploidy_nsex(ploidy);
-    sex2ploidy = (int*) malloc(sizeof(int)*nsex);
+    ploidy_cursor = ploidy_cursor_init(ploidy);
 
     return 0;
 }
@@ -175,7 +176,8 @@ bcf1_t *process(bcf1_t *rec)
     if ( ngts % n_sample )
         error("Error at %s:%d: wrong number of GT fields\n",bcf_seqname(in_hdr,rec),rec->pos+1);
 
-    ploidy_query(ploidy, (char*)bcf_seqname(in_hdr,rec), rec->pos, sex2ploidy,NULL,&max_ploidy);
+    const int *sex2ploidy;
+    ploidy_cursor_query(ploidy_cursor, bcf_seqname(in_hdr,rec), rec->pos, &sex2ploidy,NULL,&max_ploidy);
 
     ngts /= n_sample;
     if ( ngts < max_ploidy )
@@ -223,7 +225,7 @@ void destroy(void)
     free(gt_arr);
     free(gt_arr2);
     free(sample2sex);
-    free(sex2ploidy);
+    ploidy_cursor_destroy(ploidy_cursor);
     ploidy_destroy(ploidy);
 }
 
@@ -73,7 +73,10 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <strings.h>
+#include <errno.h>
+#include <sys/stat.h>
 #include <getopt.h>
 #include <math.h>
 #include <htslib/hts.h>
@@ -83,8 +86,11 @@
 #include <htslib/kfunc.h>
 #include <htslib/faidx.h>
 #include <htslib/khash.h>
+#include <htslib/khash_str2int.h>
 #include <htslib/synced_bcf_reader.h>
 #include "bcftools.h"
+#include "refwin.h"
+#include "cache.h"
 
 #define MODE_STATS    1
 #define MODE_TOP2FWD  2
@@ -101,14 +107,55 @@ marker_t;
 KHASH_MAP_INIT_INT(i2m, marker_t)
 typedef khash_t(i2m) i2m_t;
 
+/*
+    The --rsid-cache layout, see cache.h:
+        rsx_hdr_t
+        sequences   .. for each sequence of the dbSNP VCF: uint32_t rsIDs [n] sorted in
+                       ascending order, uint32_t positions [n], uint8_t REF<<4|ALT [n],
+                       padded to 8 bytes
+        index       .. rsx_seq_t [nseq], followed by NUL-terminated sequence names
+    The offsets are from the beginning of the file. The stamp covers the size
+    and mtime of the dbSNP VCF.
+*/
+#define RSX_MAGIC "BCFRSX\2"
+
+typedef struct
+{
+    uint64_t nseq, seq_off;
+}
+rsx_hdr_t;
+
+typedef struct
+{
+    uint64_t off, n;
+}
+rsx_seq_t;
+
+typedef struct
+{
+    uint32_t id, pos, ord;
+    uint8_t als;
+}
+rsx_site_t;
+
 typedef struct
 {
     char *dbsnp_fname;
     int mode, discard;
     bcf_hdr_t *hdr;
     faidx_t *fai;
+    refwin_t *refwin;   // the records are sorted, the reference is read sequentially
     int rid, skip_rid;
     i2m_t *i2m;
+    char *rsx_fname;        // --rsid-cache: memory-mapped rsIDs of all sequences, used instead of i2m
+    cache_t *rsx_cache;
+    uint8_t *rsx_map;
+    rsx_seq_t *rsx_seq;
+    int rsx_nseq;
+    void *rsx_seq2id;
+    uint64_t rsx_n;         // the rsIDs, positions and alleles of the current sequence
+    uint32_t *rsx_ids, *rsx_pos;
+    uint8_t *rsx_als;
     int32_t *gts, ngts, pos;
     uint32_t nsite,nok,nflip,nunresolved,nswap,nflip_swap,nonSNP,nonACGT,nonbiallelic;
     uint32_t count[4][4], npos_err, unsorted;
@@ -116,6 +163,7 @@ typedef struct
 args_t;
 
 args_t args;
+static void rsx_init(args_t *args);
 
 const char *about(void)
 {
@@ -149,6 +197,8 @@ const char *usage(void)
         "                               Download the dbSNP file from\n"
         "                                   https://www.ncbi.nlm.nih.gov/variation/docs/human_variation_vcf\n"
         "   -m, --mode <string>         Collect stats (\"stats\") or convert (\"flip\", \"id\", \"top\") [stats]\n"
+        "       --rsid-cache <file>     With -i, look up the rsIDs in a memory-mapped table built from the dbSNP file\n"
+        "                               on the first use and rebuilt when the dbSNP file changes\n"
         "\n"
         "Examples:\n"
         "   # run stats\n"
@@ -160,6 +210,9 @@ const char *usage(void)
         "   # match the REF/ALT alleles based on the ID column, discard unknown sites\n"
         "   bcftools +fixref file.bcf -Ob -o out.bcf -- -d -f ref.fa -i All_20151104.vcf.gz\n"
         "\n"
+        "   # the same, reusing the rsID table across runs\n"
+        "   bcftools +fixref file.bcf -Ob -o out.bcf -- -d -f ref.fa -i All_20151104.vcf.gz --rsid-cache All_20151104.rsx\n"
+        "\n"
         "   # assuming the reference build is correct, just flip to fwd, discarding the rest\n"
         "   bcftools +fixref file.bcf -Ob -o out.bcf -- -d -f ref.fa -m flip\n"
         "\n";
@@ -169,6 +222,7 @@ int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
 {
     memset(&args,0,sizeof(args_t));
     args.skip_rid = -1;
+    args.rid = -1;
     args.hdr = in;
     args.mode = MODE_STATS;
     char *ref_fname = NULL;
@@ -178,6 +232,7 @@ int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
         {"discard",no_argument,NULL,'d'},
         {"fasta-ref",required_argument,NULL,'f'},
         {"use-id",required_argument,NULL,'i'},
+        {"rsid-cache",required_argument,NULL,1},
         {NULL,0,NULL,0}
     };
     int c;
@@ -193,6 +248,7 @@ int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
                 else error("The source strand convention not recognised: %s\n", optarg);
                 break;
             case 'i': args.dbsnp_fname = optarg; args.mode = MODE_USE_ID; break;
+            case  1 : args.rsx_fname = optarg; break;
             case 'd': args.discard = 1; break;
             case 'f': ref_fname = optarg; break;
             case 'h':
@@ -203,6 +259,12 @@ int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
     if ( !ref_fname ) error("Expected the -f option\n");
     args.fai = fai_load(ref_fname);
     if ( !args.fai ) error("Failed to load the fai index: %s\n", ref_fname);
+    args.refwin = refwin_init(args.fai, 1000, 100000);
+    if ( args.rsx_fname )
+    {
+        if ( !args.dbsnp_fname ) error("The --rsid-cache option requires -i\n");
+        rsx_init(&args);
+    }
 
     if ( args.mode==MODE_STATS ) return 1;
     return 0;
@@ -266,20 +328,172 @@ static int fetch_ref(args_t *args, bcf1_t *rec)
 {
     // Get the reference allele
     int len;
-    char *ref = faidx_fetch_seq(args->fai, (char*)bcf_seqname(args->hdr,rec), rec->pos, rec->pos, &len);
+    const char *ref = refwin_fetch(args->refwin, bcf_seqname(args->hdr,rec), rec->pos, rec->pos, &len);
     if ( !ref )
     {
-        if ( faidx_has_seq(args->fai, bcf_seqname(args->hdr,rec))==0 )
+        fprintf(stderr,"Ignoring sequence \"%s\"\n", bcf_seqname(args->hdr,rec));
+        args->skip_rid = rec->rid;
+        return -2;
+    }
+    return nt2int(*ref);
+}
+
+static int rsx_site_cmp(const void *aptr, const void *bptr)
+{
+    const rsx_site_t *a = (const rsx_site_t*) aptr, *b = (const rsx_site_t*) bptr;
+    if ( a->id < b->id ) return -1;
+    if ( a->id > b->id ) return 1;
+    if ( a->ord < b->ord ) return -1;
+    if ( a->ord > b->ord ) return 1;
+    return 0;
+}
+
+// Sort the sites of one sequence by rsID and write them out. Repeated rsIDs are ambiguous,
+// only the first one in the file is kept as in dbsnp_init()
+static void rsx_flush_seq(cache_t *out, rsx_seq_t *seq, rsx_site_t *site, int nsite, void **buf, size_t *mbuf)
+{
+    int i, n = 0;
+    qsort(site, nsite, sizeof(*site), rsx_site_cmp);
+    for (i=0; i<nsite; i++)
+    {
+        if ( n && site[n-1].id==site[i].id ) continue;
+        site[n++] = site[i];
+    }
+    size_t size = (size_t)n*(2*sizeof(uint32_t) + sizeof(uint8_t));
+    if ( *mbuf < size )
+    {
+        *mbuf = size;
+        *buf  = realloc(*buf, *mbuf);
+    }
+    uint32_t *ids = (uint32_t*) *buf, *pos = ids + n;
+    uint8_t *als  = (uint8_t*) (pos + n);
+    for (i=0; i<n; i++)
+    {
+        ids[i] = site[i].id;
+        pos[i] = site[i].pos;
+        als[i] = site[i].als;
+    }
+    seq->off = out->off;
+    seq->n   = n;
+    cache_write(out, *buf, size);
+    cache_pad(out, 8);
+}
+
+static void rsx_build(args_t *args, uint64_t stamp)
+{
+    htsFile *fp = hts_open(args->dbsnp_fname, "r");
+    if ( !fp ) error("Failed to read %s\n", args->dbsnp_fname);
+    bcf_hdr_t *hdr = bcf_hdr_read(fp);
+    if ( !hdr ) error("Failed to read the header of %s\n", args->dbsnp_fname);
+
+    cache_t *out = cache_create(args->rsx_fname, RSX_MAGIC, stamp);
+    rsx_hdr_t rhdr;
+    memset(&rhdr, 0, sizeof(rhdr));
+    uint64_t hdr_off = out->off;
+    cache_write(out, &rhdr, sizeof(rhdr));       // rewritten with the index offset at the end
+
+    uint8_t *seen = NULL;
+    int mseen = 0, nseq = 0, mseq = 0, nsite = 0, msite = 0, prev_rid = -1;
+    rsx_seq_t *seq = NULL;
+    rsx_site_t *site = NULL;
+    void *buf = NULL;
+    size_t mbuf = 0;
+    kstring_t seq_names = {0,0,0};
+    bcf1_t *rec = bcf_init1();
+    while ( bcf_read1(fp, hdr, rec)==0 )
+    {
+        if ( rec->rid!=prev_rid )
         {
-            fprintf(stderr,"Ignoring sequence \"%s\"\n", bcf_seqname(args->hdr,rec));
-            args->skip_rid = rec->rid;
-            return -2;
+            if ( prev_rid>=0 ) rsx_flush_seq(out, &seq[nseq-1], site, nsite, &buf, &mbuf);
+            if ( cache_seq_seen(&seen, &mseen, rec->rid) ) error("The file is not sorted: %s\n", args->dbsnp_fname);
+            hts_expand(rsx_seq_t, nseq+1, mseq, seq);
+            nseq++;
+            kputs(bcf_seqname(hdr,rec), &seq_names);
+            kputc(0, &seq_names);
+            prev_rid = rec->rid;
+            nsite = 0;
         }
-        error("faidx_fetch_seq failed at %s:%d\n", bcf_seqname(args->hdr,rec),rec->pos+1);
+        if ( rec->n_allele!=2 ) continue;       // skip multiallelic markers
+        bcf_unpack(rec, BCF_UN_STR);
+        if ( rec->d.allele[0][1]!=0 || rec->d.allele[1][1]!=0 ) continue;   // skip non-snps
+
+        int ref = nt2int(rec->d.allele[0][0]);
+        int alt = nt2int(rec->d.allele[1][0]);
+        if ( ref<0 || alt<0 ) continue;     // non-[ACGT] base
+
+        uint32_t id = parse_rsid(rec->d.id);
+        if ( !id ) continue;
+
+        hts_expand(rsx_site_t, nsite+1, msite, site);
+        site[nsite].id  = id;
+        site[nsite].pos = rec->pos;
+        site[nsite].ord = nsite;
+        site[nsite].als = ref<<4 | alt;
+        nsite++;
+    }
+    if ( prev_rid>=0 ) rsx_flush_seq(out, &seq[nseq-1], site, nsite, &buf, &mbuf);
+
+    rhdr.nseq    = nseq;
+    rhdr.seq_off = out->off;
+    cache_write(out, seq, sizeof(*seq)*nseq);
+    cache_write(out, seq_names.s, seq_names.l);
+    cache_write_at(out, hdr_off, &rhdr, sizeof(rhdr));
+    cache_commit(out);
+
+    bcf_destroy1(rec);
+    bcf_hdr_destroy(hdr);
+    if ( hts_close(fp)!=0 ) error("Close failed: %s\n", args->dbsnp_fname);
+    free(seen);
+    free(seq);
+    free(site);
+    free(buf);
+    free(seq_names.s);
+}
+
+// Returns 0 if the cache does not exist or is outdated
+static int rsx_load(args_t *args, uint64_t stamp)
+{
+    cache_t *cache = cache_open(args->rsx_fname, RSX_MAGIC, stamp, "rsID cache");
+    if ( !cache ) return 0;
+
+    rsx_hdr_t hdr;
+    cache_read(cache, &hdr, sizeof(hdr));
+    args->rsx_cache = cache;
+    args->rsx_map   = cache->map;
+    args->rsx_seq   = (rsx_seq_t*) cache_ptr(cache, hdr.seq_off, sizeof(rsx_seq_t)*hdr.nseq);
+    args->rsx_nseq  = hdr.nseq;
+    args->rsx_seq2id = khash_str2int_init();
+    char *name = (char*) (args->rsx_seq + hdr.nseq);
+    uint64_t i;
+    for (i=0; i<hdr.nseq; i++)
+    {
+        khash_str2int_set(args->rsx_seq2id, name, i);
+        name += strlen(name) + 1;
     }
-    int ir = nt2int(*ref);
-    free(ref);
-    return ir;
+    return 1;
+}
+
+static void rsx_init(args_t *args)
+{
+    struct stat st;
+    if ( stat(args->dbsnp_fname, &st)!=0 ) error("Failed to stat %s: %s\n", args->dbsnp_fname, strerror(errno));
+    uint64_t stamp = cache_stamp_file(CACHE_STAMP_INIT, args->dbsnp_fname);
+    if ( rsx_load(args, stamp) ) return;
+    rsx_build(args, stamp);
+    if ( !rsx_load(args, stamp) ) error("Failed to load %s\n", args->rsx_fname);
+}
+
+// Point the lookup arrays to the sites of the sequence, leave them empty if not in dbSNP
+static void rsx_set_seq(args_t *args, const char *chr)
+{
+    int iseq;
+    args->rsx_n = 0;
+    if ( khash_str2int_get(args->rsx_seq2id, chr, &iseq)!=0 ) return;
+    rsx_seq_t *seq = &args->rsx_seq[iseq];
+    args->rsx_n   = seq->n;
+    args->rsx_ids = (uint32_t*) (args->rsx_map + seq->off);
+    args->rsx_pos = args->rsx_ids + seq->n;
+    args->rsx_als = (uint8_t*) (args->rsx_pos + seq->n);
 }
 
 static void dbsnp_init(args_t *args, const char *chr)
@@ -314,16 +528,41 @@ done:
     bcf_sr_destroy(sr);
 }
 
+static int dbsnp_lookup(args_t *args, uint32_t id, marker_t *marker)
+{
+    if ( !args->rsx_map )
+    {
+        int k = kh_get(i2m, args->i2m, id);
+        if ( k==kh_end(args->i2m) ) return 0;
+        *marker = kh_val(args->i2m, k);
+        return 1;
+    }
+
+    // binary search in the rsIDs of the current sequence
+    uint64_t min = 0, max = args->rsx_n;
+    while ( min<max )
+    {
+        uint64_t i = (min+max)/2;
+        if ( args->rsx_ids[i] < id ) min = i + 1;
+        else max = i;
+    }
+    if ( min==args->rsx_n || args->rsx_ids[min]!=id ) return 0;
+    marker->pos = args->rsx_pos[min];
+    marker->ref = args->rsx_als[min] >> 4;
+    marker->alt = args->rsx_als[min] & 0xf;
+    return 1;
+}
+
 static bcf1_t *dbsnp_check(args_t *args, bcf1_t *rec, int ir, int ia, int ib)
 {
-    int k, ref,alt,pos;
+    int ref,alt,pos;
     uint32_t id = parse_rsid(rec->d.id);
     if ( !id ) goto no_info;
 
-    k = kh_get(i2m, args->i2m, id);
-    if ( k==kh_end(args->i2m) ) goto no_info;
+    marker_t marker;
+    if ( !dbsnp_lookup(args, id, &marker) ) goto no_info;
 
-    pos = (int)kh_val(args->i2m, k).pos;
+    pos = (int)marker.pos;
     if ( pos != rec->pos ) 
     {
         rec->pos = pos;
@@ -331,8 +570,8 @@ static bcf1_t *dbsnp_check(args_t *args, bcf1_t *rec, int ir, int ia, int ib)
         args->npos_err++;
     }
 
-    ref = kh_val(args->i2m, k).ref;
-    alt = kh_val(args->i2m, k).alt;
+    ref = marker.ref;
+    alt = marker.alt;
 
 	if ( ref!=ir ) 
         error("Reference base mismatch at %s:%d .. %c vs %c\n",bcf_seqname(args->hdr,rec),rec->pos+1,int2nt(ref),int2nt(ir));
@@ -403,11 +642,12 @@ bcf1_t *process(bcf1_t *rec)
 
     if ( args.mode==MODE_USE_ID )
     {
-        if ( !args.i2m || args.rid!=rec->rid )
+        if ( args.rid!=rec->rid )
         {
             args.pos = 0;
             args.rid = rec->rid;
-            dbsnp_init(&args,bcf_seqname(args.hdr,rec));
+            if ( args.rsx_map ) rsx_set_seq(&args,bcf_seqname(args.hdr,rec));
+            else dbsnp_init(&args,bcf_seqname(args.hdr,rec));
         }
         ret = dbsnp_check(&args, rec, ir,ia,ib);
         if ( !args.unsorted && args.pos > rec->pos )
@@ -460,7 +700,7 @@ bcf1_t *process(bcf1_t *rec)
         else    // ambiguous pair, sequence walking must be performed
         {
             int len, win = rec->pos > 100 ? 100 : rec->pos, beg = rec->pos - win, end = rec->pos + win;
-            char *ref = faidx_fetch_seq(args.fai, (char*)bcf_seqname(args.hdr,rec), beg,end, &len);
+            const char *ref = refwin_fetch(args.refwin, bcf_seqname(args.hdr,rec), beg,end, &len);
             if ( !ref ) error("faidx_fetch_seq failed at %s:%d\n", bcf_seqname(args.hdr,rec),rec->pos+1);
             if ( end - beg + 1 != len ) error("FIXME: check win=%d,len=%d at %s:%d  (%d %d %d)\n", win,len, bcf_seqname(args.hdr,rec),rec->pos+1);
 
@@ -475,7 +715,6 @@ bcf1_t *process(bcf1_t *rec)
                 strand = ra & 0x9 ? 1 : -1;
                 break;
             }
-            free(ref);
             
             if ( strand==1 )
             {
@@ -571,6 +810,12 @@ void destroy(void)
     fprintf(stderr,"NS\tnon-biallelic\t%u\n", args.nonbiallelic);
 
     free(args.gts);
+    refwin_destroy(args.refwin);
     if ( args.fai ) fai_destroy(args.fai);
     if ( args.i2m ) kh_destroy(i2m, args.i2m);
+    if ( args.rsx_map )
+    {
+        cache_close(args.rsx_cache);
+        khash_str2int_destroy(args.rsx_seq2id);
+    }
 }
@@ -0,0 +1,2 @@
+plugins/fixref.so: plugins/fixref.c version.h version.c refwin.h refwin.c cache.h cache.c
+	$(CC) $(PLUGIN_FLAGS) $(CFLAGS) $(EXTRA_CPPFLAGS) $(CPPFLAGS) $(LDFLAGS) -o $@ refwin.c cache.c version.c $< $(LIBS)
@@ -33,6 +33,9 @@
 #include <htslib/vcfutils.h>
 #include <inttypes.h>
 #include <unistd.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
 #include "bcftools.h"
 #include "filter.h"
 
@@ -59,7 +62,35 @@ typedef struct
 }
 stats_t;
 
+#define SITE_GT     1
+#define SITE_DIP    2   // diploid PL or GL
+#define SITE_HAP    3   // haploid PL or GL
+
+// One buffered site, the FORMAT values of all samples are kept until the site is processed
+typedef struct
+{
+    int rid, pos, type, nval;   // nval: number of values per sample
+    int32_t *iarr;              // GT or PL
+    float *farr;                // GL
+    int miarr, mfarr, filtered; // filtered: per-sample filtering, see smpl_pass
+    uint8_t *smpl_pass;         // a copy of the per-sample filter
+    double af;                  // the --AF-tag value or -1 if not available
+    double freq[2];
+}
+site_t;
+
 typedef struct
+{
+    struct _args_t *args;
+    int ithread, pass, mfreq;
+    double *freq;               // per-site frequency sums from this thread's samples [2*nsites]
+}
+guess_job_t;
+
+// Maximum number of FORMAT values to buffer before the sites are processed
+#define MAX_BUFFERED_VALS (1<<24)
+
+typedef struct _args_t
 {
     int argc;
     char **argv, *af_tag;
@@ -68,14 +99,16 @@ typedef struct
     filter_t *filter;
     char *filter_str;
     int filter_logic;   // include or exclude sites which match the filters? One of FLT_INCLUDE/FLT_EXCLUDE
-    const uint8_t *smpl_pass;
     int nsample, verbose, tag, include_indels;
     int *counts, ncounts;       // number of observed GTs with given ploidy, used when -g is not given
-    double *tmpf, *pl2p, gt_err_prob;
+    double *pl2p, gt_err_prob;
     float *af;
     int maf;
-    int32_t *arr, narr, nfarr;
-    float *farr;
+    site_t *sites;              // sites buffered for processing in parallel
+    int nsites, msites, nthreads;
+    uint64_t nvals;
+    guess_job_t *jobs;
+    pthread_t *threads;
     bcf_srs_t *sr;
     bcf_hdr_t *hdr;
 }
@@ -113,7 +146,9 @@ static const char *usage_text(void)
         "   -g, --genome <str>              shortcut to select nonPAR region for common genomes b37|hg19|b38|hg38\n"
         "   -r, --regions <chr:beg-end>     restrict to comma-separated list of regions\n"
         "   -R, --regions-file <file>       restrict to regions listed in a file\n"
+        "       --sites-file <file>         restrict to informative sites listed in a file (CHROM\\tPOS), fetched via the index\n"
         "   -t, --tag <tag>                 genotype or genotype likelihoods: GT, PL, GL [PL]\n"
+        "       --threads <int>             number of threads, the samples are split between them [1]\n"
         "   -v, --verbose                   verbose output (specify twice to increase verbosity)\n"
         "\n"
         "Region shortcuts:\n"
@@ -130,267 +165,279 @@ static const char *usage_text(void)
         "\n";
 }
 
-static inline int smpl_pass(args_t *args, int ismpl)
+static inline int smpl_pass(args_t *args, site_t *site, int ismpl)
 {
-    if ( !args->smpl_pass ) return 1;
-    int pass = args->smpl_pass[ismpl];
+    if ( !site->filtered ) return 1;
+    int pass = site->smpl_pass[ismpl];
     if ( args->filter_logic & FLT_EXCLUDE ) pass = pass ? 0 : 1;
     if ( pass ) return 1;
     return 0;
 }
 
-void process_region_guess(args_t *args)
+static inline double pl2p(args_t *args, int32_t pl)
 {
-    while ( bcf_sr_next_line(args->sr) )
-    {
-        bcf1_t *rec = bcf_sr_get_line(args->sr,0);
-        if ( rec->n_allele==1 ) continue;
-        if ( !args->include_indels && !(bcf_get_variant_types(rec)&VCF_SNP) ) continue;
-
-        if ( args->filter )
-        {
-            int pass = filter_test(args->filter, rec, &args->smpl_pass);
-            if ( args->filter_logic & FLT_EXCLUDE ) pass = pass ? 0 : 1;
-            if ( !args->smpl_pass && !pass ) continue;     // site-level filtering, not per-sample filtering
-        }
+    return (pl<0 || pl>=256) ? args->pl2p[255] : args->pl2p[pl];
+}
 
-        double freq[2] = {0,0}, sum;
-        int ismpl,i;
-        if ( args->tag & GUESS_GT )   // use GTs to guess the ploidy, considering only one ALT
+/*
+ *  Genotype probabilities of one sample at the site, normalized to sum to one.
+ *  Returns 0 if the sample is to be skipped, 1 if it contributes diploid counts to
+ *  the allele frequency estimate, 2 if haploid counts and 3 if none.
+ */
+static int site_probs(args_t *args, site_t *site, int ismpl, double *tmp)
+{
+    int i;
+    double sum;
+    if ( site->type==SITE_GT )
+    {
+        int32_t *ptr = site->iarr + ismpl*site->nval;
+        if ( ptr[0]==bcf_gt_missing ) return 0;
+        if ( ptr[1]==bcf_int32_vector_end )
         {
-            int ngt = bcf_get_genotypes(args->hdr,rec,&args->arr,&args->narr);
-            if ( ngt<=0 ) continue;
-            ngt /= args->nsample;
-            for (ismpl=0; ismpl<args->nsample; ismpl++)
+            if ( bcf_gt_allele(ptr[0])==0 ) // haploid R
             {
-                if ( !smpl_pass(args,ismpl) ) continue;
-                int32_t *ptr = args->arr + ismpl*ngt;
-                double *tmp = args->tmpf + ismpl*3;
-
-                if ( ptr[0]==bcf_gt_missing ) 
-                {
-                    tmp[0] = -1;
-                    continue;
-                }
-                if ( ptr[1]==bcf_int32_vector_end )
-                {
-                    if ( bcf_gt_allele(ptr[0])==0 ) // haploid R
-                    {
-                        tmp[0] = 1 - 2*args->gt_err_prob;
-                        tmp[1] = tmp[2] = args->gt_err_prob;
-                    }
-                    else    // haploid A
-                    {
-                        tmp[0] = tmp[1] = args->gt_err_prob;
-                        tmp[2] = 1 - 2*args->gt_err_prob;
-                    }
-                    continue;
-                }
-                if ( bcf_gt_allele(ptr[0])==0 && bcf_gt_allele(ptr[1])==0 ) // RR
-                {
-                    tmp[0] = 1 - 2*args->gt_err_prob;
-                    tmp[1] = tmp[2] = args->gt_err_prob;
-                }
-                else if ( bcf_gt_allele(ptr[0])==bcf_gt_allele(ptr[1]) ) // AA
-                {
-                    tmp[0] = tmp[1] = args->gt_err_prob;
-                    tmp[2] = 1 - 2*args->gt_err_prob;
-                }
-                else  // RA or hetAA, treating as RA
-                {
-                    tmp[1] = 1 - 2*args->gt_err_prob;
-                    tmp[0] = tmp[2] = args->gt_err_prob;
-                }
-                freq[0] += 2*tmp[0]+tmp[1];
-                freq[1] += tmp[1]+2*tmp[2];
+                tmp[0] = 1 - 2*args->gt_err_prob;
+                tmp[1] = tmp[2] = args->gt_err_prob;
+            }
+            else    // haploid A
+            {
+                tmp[0] = tmp[1] = args->gt_err_prob;
+                tmp[2] = 1 - 2*args->gt_err_prob;
             }
+            return 3;
         }
-        else if ( args->tag & GUESS_PL )    // use PL guess the ploidy, restrict to first ALT allele
+        if ( bcf_gt_allele(ptr[0])==0 && bcf_gt_allele(ptr[1])==0 ) // RR
         {
-            int npl = bcf_get_format_int32(args->hdr,rec,"PL",&args->arr,&args->narr);
-            if ( npl<=0 ) continue;
-            npl /= args->nsample;
-            int ndip_gt = rec->n_allele*(rec->n_allele+1)/2;
-            if ( npl==ndip_gt )             // diploid
-            {
-                for (ismpl=0; ismpl<args->nsample; ismpl++)
-                {
-                    if ( !smpl_pass(args,ismpl) ) continue;
-                    int32_t *ptr = args->arr + ismpl*npl;
-                    double *tmp = args->tmpf + ismpl*3;
-
-                    // restrict to first ALT
-                    if ( ptr[0]==bcf_int32_missing || ptr[1]==bcf_int32_missing || ptr[2]==bcf_int32_missing ) 
-                    {
-                        tmp[0] = -1;
-                        continue;
-                    }
-                    if ( ptr[0]==ptr[1] && ptr[0]==ptr[2] ) // non-informative
-                    {
-                        tmp[0] = -1;
-                        continue;
-                    }
-                    if ( ptr[2]==bcf_int32_vector_end )
-                    {
-                        tmp[0] = (ptr[0]<0 || ptr[0]>=256) ? args->pl2p[255] : args->pl2p[ptr[0]];
-                        tmp[1] = args->pl2p[255];
-                        tmp[2] = (ptr[1]<0 || ptr[1]>=256) ? args->pl2p[255] : args->pl2p[ptr[1]];
-                    }
-                    else
-                        for (i=0; i<3; i++)
-                            tmp[i] = (ptr[i]<0 || ptr[i]>=256) ? args->pl2p[255] : args->pl2p[ptr[i]];
+            tmp[0] = 1 - 2*args->gt_err_prob;
+            tmp[1] = tmp[2] = args->gt_err_prob;
+        }
+        else if ( bcf_gt_allele(ptr[0])==bcf_gt_allele(ptr[1]) ) // AA
+        {
+            tmp[0] = tmp[1] = args->gt_err_prob;
+            tmp[2] = 1 - 2*args->gt_err_prob;
+        }
+        else  // RA or hetAA, treating as RA
+        {
+            tmp[1] = 1 - 2*args->gt_err_prob;
+            tmp[0] = tmp[2] = args->gt_err_prob;
+        }
+        return 1;
+    }
 
-                    sum = 0;
-                    for (i=0; i<3; i++) sum += tmp[i];
-                    for (i=0; i<3; i++) tmp[i] /= sum;
+    int ret;
+    if ( site->iarr )   // PL, restrict to first ALT
+    {
+        int32_t *ptr = site->iarr + ismpl*site->nval;
+        if ( ptr[0]==bcf_int32_missing || ptr[1]==bcf_int32_missing ) return 0;
+        if ( site->type==SITE_DIP )
+        {
+            if ( ptr[2]==bcf_int32_missing ) return 0;
+            if ( ptr[0]==ptr[1] && ptr[0]==ptr[2] ) return 0;  // non-informative
+        }
+        if ( site->type==SITE_HAP || ptr[2]==bcf_int32_vector_end )
+        {
+            tmp[0] = pl2p(args,ptr[0]);
+            tmp[1] = args->pl2p[255];
+            tmp[2] = pl2p(args,ptr[1]);
+            ret = 2;
+        }
+        else
+        {
+            for (i=0; i<3; i++) tmp[i] = pl2p(args,ptr[i]);
+            ret = 1;
+        }
+    }
+    else    // GL, restrict to first ALT
+    {
+        float *ptr = site->farr + ismpl*site->nval;
+        if ( bcf_float_is_missing(ptr[0]) || bcf_float_is_missing(ptr[1]) ) return 0;
+        if ( site->type==SITE_DIP )
+        {
+            if ( bcf_float_is_missing(ptr[2]) ) return 0;
+            if ( ptr[0]==ptr[1] && ptr[0]==ptr[2] ) return 0;  // non-informative
+        }
+        if ( site->type==SITE_HAP || bcf_float_is_vector_end(ptr[2]) )
+        {
+            tmp[0] = pow(10.,ptr[0]);
+            tmp[1] = 1e-26;             // arbitrary small value for a het
+            tmp[2] = pow(10.,ptr[1]);
+            ret = 2;
+        }
+        else
+        {
+            for (i=0; i<3; i++) tmp[i] = pow(10.,ptr[i]);
+            ret = 1;
+        }
+    }
+    sum = 0;
+    for (i=0; i<3; i++) sum += tmp[i];
+    for (i=0; i<3; i++) tmp[i] /= sum;
+    return ret;
+}
 
-                    if ( ptr[2]==bcf_int32_vector_end )
-                    {
-                        freq[0] += tmp[0];
-                        freq[1] += tmp[2];
-                    }
-                    else
+// The samples are split into args->nthreads contiguous shards, each thread
+// accumulates the counts of its own samples only
+static void *guess_worker(void *arg)
+{
+    guess_job_t *job = (guess_job_t*) arg;
+    args_t *args = job->args;
+    int nshard = (args->nsample + args->nthreads - 1) / args->nthreads;
+    int beg = job->ithread*nshard, end = beg + nshard, isite, ismpl;
+    if ( end > args->nsample ) end = args->nsample;
+    double tmp[3];
+    for (isite=0; isite<args->nsites; isite++)
+    {
+        site_t *site = &args->sites[isite];
+        if ( job->pass==0 )
+        {
+            // allele frequency estimate
+            double freq[2] = {0,0};
+            if ( site->af<0 )
+                for (ismpl=beg; ismpl<end; ismpl++)
+                {
+                    if ( !smpl_pass(args,site,ismpl) ) continue;
+                    int ret = site_probs(args, site, ismpl, tmp);
+                    if ( ret==1 )
                     {
                         freq[0] += 2*tmp[0]+tmp[1];
                         freq[1] += tmp[1]+2*tmp[2];
                     }
-                }
-            }
-            else if ( npl==rec->n_allele )  // all samples haploid
-            {
-                for (ismpl=0; ismpl<args->nsample; ismpl++)
-                {
-                    if ( !smpl_pass(args,ismpl) ) continue;
-                    int32_t *ptr = args->arr + ismpl*npl;
-                    double *tmp = args->tmpf + ismpl*3;
-
-                    // restrict to first ALT
-                    if ( ptr[0]==bcf_int32_missing || ptr[1]==bcf_int32_missing ) 
+                    else if ( ret==2 )
                     {
-                        tmp[0] = -1;
-                        continue;
+                        freq[0] += tmp[0];
+                        freq[1] += tmp[2];
                     }
-                    tmp[0] = (ptr[0]<0 || ptr[0]>=256) ? args->pl2p[255] : args->pl2p[ptr[0]];
-                    tmp[1] = args->pl2p[255];
-                    tmp[2] = (ptr[1]<0 || ptr[1]>=256) ? args->pl2p[255] : args->pl2p[ptr[1]];
-
-                    sum = 0;
-                    for (i=0; i<3; i++) sum += tmp[i];
-                    for (i=0; i<3; i++) tmp[i] /= sum;
-
-                    freq[0] += tmp[0];
-                    freq[1] += tmp[2];
                 }
-            }
-            else
-                continue;   // neither diploid nor haploid
+            job->freq[2*isite]   = freq[0];
+            job->freq[2*isite+1] = freq[1];
+            continue;
         }
-        else    // use GL
+        double *freq = site->freq;
+        for (ismpl=beg; ismpl<end; ismpl++)
         {
-            int ngl = bcf_get_format_float(args->hdr,rec,"GL",&args->farr,&args->nfarr);
-            if ( ngl<=0 ) continue;
-            ngl /= args->nsample;
-            int ndip_gt = rec->n_allele*(rec->n_allele+1)/2;
-            if ( ngl==ndip_gt )             // diploid
-            {
-                for (ismpl=0; ismpl<args->nsample; ismpl++)
-                {
-                    if ( !smpl_pass(args,ismpl) ) continue;
-                    float *ptr = args->farr + ismpl*ngl;
-                    double *tmp = args->tmpf + ismpl*3;
-
-                    // restrict to first ALT
-                    if ( bcf_float_is_missing(ptr[0]) || bcf_float_is_missing(ptr[1]) || bcf_float_is_missing(ptr[2]) ) 
-                    {
-                        tmp[0] = -1;
-                        continue;
-                    }
-                    if ( ptr[0]==ptr[1] && ptr[0]==ptr[2] ) // non-informative
-                    {
-                        tmp[0] = -1;
-                        continue;
-                    }
-                    if ( bcf_float_is_vector_end(ptr[2]) )
-                    {
-                        tmp[0] = pow(10.,ptr[0]);
-                        tmp[1] = 1e-26;             // arbitrary small value for a het
-                        tmp[2] = pow(10.,ptr[1]);
-                    }
-                    else
-                        for (i=0; i<3; i++)
-                            tmp[i] = pow(10.,ptr[i]);
+            if ( !smpl_pass(args,site,ismpl) ) continue;
+            if ( !site_probs(args, site, ismpl, tmp) ) continue;
+            count_t *counts = &args->stats.counts[ismpl];
+            double phap = freq[0]*tmp[0] + freq[1]*tmp[2];
+            double pdip = freq[0]*freq[0]*tmp[0] + 2*freq[0]*freq[1]*tmp[1] + freq[1]*freq[1]*tmp[2];
+            counts->phap += log(phap);
+            counts->pdip += log(pdip);
+            counts->ncount++;
+            if ( args->verbose>1 )
+                printf("DBG\t%s\t%d\t%s\t%e\t%e\t%e\t%e\t%e\t%e\n", bcf_hdr_id2name(args->hdr,site->rid),site->pos+1,bcf_hdr_int2id(args->hdr,BCF_DT_SAMPLE,ismpl),
+                    freq[1],tmp[0],tmp[1],tmp[2],phap,pdip);
+        }
+    }
+    return NULL;
+}
 
-                    sum = 0;
-                    for (i=0; i<3; i++) sum += tmp[i];
-                    for (i=0; i<3; i++) tmp[i] /= sum;
+static void run_pass(args_t *args, int pass)
+{
+    int i;
+    for (i=0; i<args->nthreads; i++)
+    {
+        args->jobs[i].pass = pass;
+        if ( args->nthreads==1 ) guess_worker(&args->jobs[i]);
+        else if ( pthread_create(&args->threads[i], NULL, guess_worker, &args->jobs[i]) ) error("Failed to create a thread\n");
+    }
+    if ( args->nthreads > 1 )
+        for (i=0; i<args->nthreads; i++) pthread_join(args->threads[i], NULL);
+}
 
-                    if ( bcf_float_is_vector_end(ptr[2]) )
-                    {
-                        freq[0] += tmp[0];
-                        freq[1] += tmp[2];
-                    }
-                    else
-                    {
-                        freq[0] += 2*tmp[0]+tmp[1];
-                        freq[1] += tmp[1]+2*tmp[2];
-                    }
-                }
-            }
-            else if ( ngl==rec->n_allele )  // all samples haploid
+static void flush_sites(args_t *args)
+{
+    if ( !args->nsites ) return;
+    int i, j;
+    for (i=0; i<args->nthreads; i++)
+        hts_expand(double, 2*args->nsites, args->jobs[i].mfreq, args->jobs[i].freq);
+    run_pass(args, 0);
+    for (i=0; i<args->nsites; i++)
+    {
+        site_t *site = &args->sites[i];
+        double *freq = site->freq, sum;
+        if ( site->af>=0 ) { freq[0] = 1 - site->af; freq[1] = site->af; }
+        else
+        {
+            freq[0] = freq[1] = 0;
+            for (j=0; j<args->nthreads; j++)
             {
-                for (ismpl=0; ismpl<args->nsample; ismpl++)
-                {
-                    if ( !smpl_pass(args,ismpl) ) continue;
-                    float *ptr = args->farr + ismpl*ngl;
-                    double *tmp = args->tmpf + ismpl*3;
+                freq[0] += args->jobs[j].freq[2*i];
+                freq[1] += args->jobs[j].freq[2*i+1];
+            }
+        }
+        if ( !freq[0] && !freq[1] ) { freq[0] = 1 - args->af_dflt; freq[1] = args->af_dflt; }
+        sum = freq[0] + freq[1];
+        freq[0] /= sum;
+        freq[1] /= sum;
+    }
+    run_pass(args, 1);
+    args->nsites = 0;
+    args->nvals  = 0;
+}
 
-                    // restrict to first ALT
-                    if ( bcf_float_is_missing(ptr[0]) || bcf_float_is_missing(ptr[1]) ) 
-                    {
-                        tmp[0] = -1;
-                        continue;
-                    }
-                    tmp[0] = pow(10.,ptr[0]);
-                    tmp[1] = 1e-26;
-                    tmp[2] = pow(10.,ptr[1]);
+void process_region_guess(args_t *args)
+{
+    const uint8_t *smpl_pass = NULL;
+    while ( bcf_sr_next_line(args->sr) )
+    {
+        bcf1_t *rec = bcf_sr_get_line(args->sr,0);
+        if ( rec->n_allele==1 ) continue;
+        if ( !args->include_indels && !(bcf_get_variant_types(rec)&VCF_SNP) ) continue;
 
-                    sum = 0;
-                    for (i=0; i<3; i++) sum += tmp[i];
-                    for (i=0; i<3; i++) tmp[i] /= sum;
+        smpl_pass = NULL;
+        if ( args->filter )
+        {
+            int pass = filter_test(args->filter, rec, &smpl_pass);
+            if ( args->filter_logic & FLT_EXCLUDE ) pass = pass ? 0 : 1;
+            if ( !smpl_pass && !pass ) continue;     // site-level filtering, not per-sample filtering
+        }
 
-                    freq[0] += tmp[0];
-                    freq[1] += tmp[2];
-                }
-            }
-            else
-                continue;   // neither diploid nor haploid
+        hts_expand0(site_t, args->nsites+1, args->msites, args->sites);
+        site_t *site = &args->sites[args->nsites];
+        int nval, ndip_gt = rec->n_allele*(rec->n_allele+1)/2;
+        if ( args->tag & GUESS_GT )   // use GTs to guess the ploidy, considering only one ALT
+        {
+            nval = bcf_get_genotypes(args->hdr,rec,&site->iarr,&site->miarr);
+            if ( nval<=0 ) continue;
+            site->type = SITE_GT;
+        }
+        else if ( args->tag & GUESS_PL )    // use PL guess the ploidy, restrict to first ALT allele
+        {
+            nval = bcf_get_format_int32(args->hdr,rec,"PL",&site->iarr,&site->miarr);
+            if ( nval<=0 ) continue;
+        }
+        else    // use GL
+        {
+            nval = bcf_get_format_float(args->hdr,rec,"GL",&site->farr,&site->mfarr);
+            if ( nval<=0 ) continue;
+        }
+        nval /= args->nsample;
+        if ( !(args->tag & GUESS_GT) )
+        {
+            if ( nval==ndip_gt ) site->type = SITE_DIP;
+            else if ( nval==rec->n_allele ) site->type = SITE_HAP;  // all samples haploid
+            else continue;  // neither diploid nor haploid
         }
+        site->nval = nval;
+        site->rid  = rec->rid;
+        site->pos  = rec->pos;
+        site->af   = -1;
         if ( args->af_tag )
         {
             int ret = bcf_get_info_float(args->hdr,rec,args->af_tag,&args->af, &args->maf);
-            if ( ret>0 ) { freq[0] = 1 - args->af[0]; freq[1] = args->af[0]; }
+            if ( ret>0 ) site->af = args->af[0];
         }
-
-        if ( !freq[0] && !freq[1] ) { freq[0] = 1 - args->af_dflt; freq[1] = args->af_dflt; }
-        sum = freq[0] + freq[1];
-        freq[0] /= sum;
-        freq[1] /= sum;
-        for (ismpl=0; ismpl<args->nsample; ismpl++)
+        site->filtered = smpl_pass ? 1 : 0;
+        if ( smpl_pass )
         {
-            if ( !smpl_pass(args,ismpl) ) continue;
-            count_t *counts = &args->stats.counts[ismpl];
-            double *tmp = args->tmpf + ismpl*3;
-            if ( tmp[0] < 0 ) continue;
-            double phap = freq[0]*tmp[0] + freq[1]*tmp[2];
-            double pdip = freq[0]*freq[0]*tmp[0] + 2*freq[0]*freq[1]*tmp[1] + freq[1]*freq[1]*tmp[2];
-            counts->phap += log(phap);
-            counts->pdip += log(pdip);
-            counts->ncount++;
-            if ( args->verbose>1 )
-                printf("DBG\t%s\t%d\t%s\t%e\t%e\t%e\t%e\t%e\t%e\n", bcf_seqname(args->hdr,rec),rec->pos+1,bcf_hdr_int2id(args->hdr,BCF_DT_SAMPLE,ismpl),
-                    freq[1],tmp[0],tmp[1],tmp[2],phap,pdip);
+            if ( !site->smpl_pass ) site->smpl_pass = (uint8_t*) malloc(args->nsample);
+            memcpy(site->smpl_pass, smpl_pass, args->nsample);
         }
+        args->nsites++;
+        args->nvals += (uint64_t)nval*args->nsample;
+        if ( args->nvals >= MAX_BUFFERED_VALS ) flush_sites(args);
     }
+    flush_sites(args);
 }
 
 int run(int argc, char **argv)
@@ -400,7 +447,7 @@ int run(int argc, char **argv)
     args->argc   = argc; args->argv = argv;
     args->gt_err_prob = 1e-3;
     args->af_dflt = 0.5;
-    char *region  = NULL;
+    char *region  = NULL, *sites_fname = NULL;
     int region_is_file = 0;
     static struct option loptions[] =
     {
@@ -416,6 +463,8 @@ int run(int argc, char **argv)
         {"regions",required_argument,NULL,'r'},
         {"regions-file",required_argument,NULL,'R'},
         {"background",required_argument,NULL,'b'},
+        {"threads",required_argument,NULL,4},
+        {"sites-file",required_argument,NULL,5},
         {NULL,0,NULL,0}
     };
     int c;
@@ -431,6 +480,11 @@ int run(int argc, char **argv)
                     break;
             case 2: args->filter_str = optarg; args->filter_logic |= FLT_EXCLUDE; break;
             case 3: args->filter_str = optarg; args->filter_logic |= FLT_INCLUDE; break;
+            case 4:
+                    args->nthreads = strtol(optarg,&tmp,10);
+                    if ( *tmp ) error("Could not parse: --threads %s\n", optarg);
+                    break;
+            case 5: sites_fname = optarg; break;
             case 'i': args->include_indels = 1; break;
             case 'e':
                 args->gt_err_prob = strtod(optarg,&tmp);
@@ -472,7 +526,16 @@ int run(int argc, char **argv)
     args->sr = bcf_sr_init();
     if ( strcmp("-",fname) )
     {
-        if ( region )
+        if ( sites_fname )
+        {
+            // jump to the informative sites via the index, the region only filters them
+            args->sr->require_index = 1;
+            if ( bcf_sr_set_regions(args->sr, sites_fname, 1)<0 )
+                error("Failed to read the sites: %s\n",sites_fname);
+            if ( region && bcf_sr_set_targets(args->sr, region, region_is_file, 0)<0 )
+                error("Failed to read the targets: %s\n",region);
+        }
+        else if ( region )
         {
             args->sr->require_index = 1;
             if ( bcf_sr_set_regions(args->sr, region, region_is_file)<0 )
@@ -481,6 +544,8 @@ int run(int argc, char **argv)
     }
     else
     {
+        if ( region && sites_fname ) error("The options --sites-file and -r/-g cannot be combined when reading from stdin\n");
+        if ( sites_fname ) { region = sites_fname; region_is_file = 1; }
         if ( region )
         {
             if ( bcf_sr_set_targets(args->sr, region, region_is_file, 0)<0 )
@@ -519,8 +584,15 @@ int run(int argc, char **argv)
         args->pl2p = (double*) calloc(256,sizeof(double));
         for (i=0; i<256; i++) args->pl2p[i] = pow(10., -i/10.);
     }
-    if ( args->tag&GUESS_PL || args->tag&GUESS_GL || args->tag&GUESS_GT )
-        args->tmpf = (double*) malloc(sizeof(*args->tmpf)*3*args->nsample);
+    if ( args->nthreads < 1 || args->verbose > 1 ) args->nthreads = 1;  // the DBG lines are printed in order
+    if ( args->nthreads > args->nsample ) args->nthreads = args->nsample ? args->nsample : 1;
+    args->jobs    = (guess_job_t*) calloc(args->nthreads, sizeof(guess_job_t));
+    args->threads = (pthread_t*) malloc(sizeof(pthread_t)*args->nthreads);
+    for (i=0; i<args->nthreads; i++)
+    {
+        args->jobs[i].args    = args;
+        args->jobs[i].ithread = i;
+    }
 
     if ( args->verbose )
     {
@@ -557,11 +629,18 @@ int run(int argc, char **argv)
 
     bcf_sr_destroy(args->sr);
     free(args->pl2p);
-    free(args->tmpf);
     free(args->counts);
     free(args->stats.counts);
-    free(args->arr);
-    free(args->farr);
+    for (i=0; i<args->msites; i++)
+    {
+        free(args->sites[i].iarr);
+        free(args->sites[i].farr);
+        free(args->sites[i].smpl_pass);
+    }
+    free(args->sites);
+    for (i=0; i<args->nthreads; i++) free(args->jobs[i].freq);
+    free(args->jobs);
+    free(args->threads);
     free(args->af);
     free(args);
     return 0;
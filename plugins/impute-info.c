@@ -56,13 +56,20 @@ The IMPUTE2 information measure is then:
     else:
         I(theta_j) = 1
 
+When only the dosages e_ij are available (FORMAT/DS), the dosage r-squared
+of MACH is added instead:
+
+    R2_j = (SUM[i=1..N] e_ij^2 / N - (2 * theta_j)^2) / 2 * theta_j * (1 - theta_j)
+
 */
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <htslib/vcf.h>
 #include <math.h>
 #include <getopt.h>
+#include "bcftools.h"
 
 const char *about(void)
 {
@@ -74,92 +81,178 @@ const char *usage(void)
     return 
         "\n"
         "About: Add imputation information metrics to the INFO field based\n"
-        "       on selected FORMAT tags. Only the IMPUTE2 INFO metric from\n"
-        "       FORMAT/GP tags is currently available.\n"
+        "       on selected FORMAT tags: the IMPUTE2 INFO metric from FORMAT/GP\n"
+        "       or the dosage r-squared (INFO/R2) from FORMAT/DS.\n"
         "Usage: bcftools +impute-info [General Options] -- [Plugin Options]\n"
         "Options:\n"
         "   run \"bcftools plugin\" for a list of common options\n"
         "\n"
-        // "Plugin options:\n"
-        // "   -i, --info <list>   information metrics to add [INFO]\n" // [BEAGLE_R2,MACH_R2]
-        // "   -t, --tags <tag>    VCF tags to determine the information from [GP]\n"
-        // "\n"
+        "Plugin options:\n"
+        "   -t, --tags <tag>    VCF tags to determine the information from: GP or DS [GP]\n"
+        "\n"
         "Example:\n"
         "   bcftools +impute-info in.vcf\n"
+        "   bcftools +impute-info in.vcf --record-threads 4 -- -t DS\n"
         "\n";
 }
 
 bcf_hdr_t *in_hdr = NULL, *out_hdr = NULL;
-int gp_type = BCF_HT_REAL;
-uint8_t *buf = NULL;
-int nbuf = 0;   // NB: number of elements, not bytes
-int nrec = 0, nskip_gp = 0, nskip_dip = 0;
+int use_ds = 0;
+int warned_gp = 0, warned_dip = 0;
+
+// The counters of one thread of the batch API, process() uses its own
+typedef struct
+{
+    int nrec, nskip_gp, nskip_dip;
+}
+ctx_t;
+ctx_t main_ctx;
 
 int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
 {
+    static struct option loptions[] =
+    {
+        {"tags",required_argument,NULL,'t'},
+        {NULL,0,NULL,0}
+    };
+    int c;
+    while ((c = getopt_long(argc, argv, "?ht:",loptions,NULL)) >= 0)
+    {
+        switch (c)
+        {
+            case 't':
+                if ( !strcmp("GP",optarg) ) use_ds = 0;
+                else if ( !strcmp("DS",optarg) ) use_ds = 1;
+                else error("The tag \"%s\" is not supported\n", optarg);
+                break;
+            case 'h':
+            case '?':
+            default: error("%s", usage()); break;
+        }
+    }
     in_hdr  = in;
     out_hdr = out;
-    bcf_hdr_append(out_hdr,"##INFO=<ID=INFO,Number=1,Type=Float,Description=\"IMPUTE2 info score\">");
+    if ( use_ds )
+        bcf_hdr_append(out_hdr,"##INFO=<ID=R2,Number=1,Type=Float,Description=\"Estimated dosage r-squared\">");
+    else
+        bcf_hdr_append(out_hdr,"##INFO=<ID=INFO,Number=1,Type=Float,Description=\"IMPUTE2 info score\">");
     return 0;
 }
 
-bcf1_t *process(bcf1_t *rec)
+/*
+    The sums are accumulated directly from the packed float values of the
+    record, in four independent partial sums which the compiler can keep in
+    vector registers. Missing values end the sample's vector, the sample is
+    counted with the values read so far.
+*/
+static float gp_info(const float *gp, int nsmpl)
 {
-    int nval = 0, i, j, nret = bcf_get_format_values(in_hdr,rec,"GP",(void**)&buf,&nbuf,gp_type);
-    if ( nret<0 )
+    double esum[4] = {0,0,0,0}, e2sum[4] = {0,0,0,0}, fsum[4] = {0,0,0,0};
+    int i, j;
+    for (i=0; i<nsmpl; i++)
     {
-        if (!nskip_gp) fprintf(stderr, "[impute-info.c] Warning: info tag not added to sites without GP tag\n");
-        nskip_gp++;
-        return rec; // require FORMAT/GP tag, return site unchanged
+        const float *ptr = gp + 3*i;
+        double vals[3] = {0,0,0};
+        for (j=0; j<3; j++)
+        {
+            if ( bcf_float_is_missing(ptr[j]) || bcf_float_is_vector_end(ptr[j]) ) break;
+            vals[j] = ptr[j];
+        }
+        double norm = vals[0]+vals[1]+vals[2];
+        if ( norm ) for (j=0; j<3; j++) vals[j] /= norm;
+        double e = vals[1] + 2*vals[2];
+        esum[i&3]  += e;
+        e2sum[i&3] += e * e;
+        fsum[i&3]  += vals[1] + 4*vals[2];
     }
-
-    nret /= rec->n_sample;
-    if ( nret != 3 )
+    double es  = (esum[0] + esum[1]) + (esum[2] + esum[3]);
+    double e2s = (e2sum[0] + e2sum[1]) + (e2sum[2] + e2sum[3]);
+    double fs  = (fsum[0] + fsum[1]) + (fsum[2] + fsum[3]);
+    double theta = es / (2 * (double)nsmpl);
+    return (theta>0 && theta<1) ? (float)(1 - (fs - e2s) / (2 * (double)nsmpl * theta * (1.0 - theta))) : 1;
+}
+static float ds_r2(const float *ds, int nsmpl)
+{
+    double esum[4] = {0,0,0,0}, e2sum[4] = {0,0,0,0};
+    int i, n = 0;
+    for (i=0; i<nsmpl; i++)
     {
-        if (!nskip_dip) fprintf(stderr, "[impute-info.c] Warning: info tag not added to sites that are not biallelic diploid\n");
-        nskip_dip++;
-        return rec; // require biallelic diploid, return site unchanged
+        if ( bcf_float_is_missing(ds[i]) || bcf_float_is_vector_end(ds[i]) ) continue;
+        esum[i&3]  += ds[i];
+        e2sum[i&3] += (double)ds[i] * ds[i];
+        n++;
     }
+    if ( !n ) return 0;
+    double es  = (esum[0] + esum[1]) + (esum[2] + esum[3]);
+    double e2s = (e2sum[0] + e2sum[1]) + (e2sum[2] + e2sum[3]);
+    double mean = es / n;
+    double theta = mean / 2;
+    return (theta>0 && theta<1) ? (float)((e2s / n - mean * mean) / (2 * theta * (1.0 - theta))) : 1;
+}
 
-    double esum = 0, e2sum = 0, fsum = 0;
-    #define BRANCH(type_t,is_missing,is_vector_end) \
-    { \
-        type_t *ptr = (type_t*) buf; \
-        for (i=0; i<rec->n_sample; i++) \
-        { \
-            double vals[3] = {0,0,0}; \
-            for (j=0; j<nret; j++) \
-            { \
-                if ( is_missing || is_vector_end ) break; \
-                vals[j] = ptr[j]; \
-            } \
-            double norm = vals[0]+vals[1]+vals[2]; \
-            if ( norm ) for (j=0; j<3; j++) vals[j] /= norm; \
-            esum  += vals[1] + 2*vals[2]; \
-            e2sum += (vals[1] + 2*vals[2]) * (vals[1] + 2*vals[2]); \
-            fsum  += vals[1] + 4*vals[2]; \
-            ptr   += nret; \
-            nval++; \
-        } \
+static void add_info(ctx_t *ctx, bcf1_t *rec)
+{
+    const char *tag = use_ds ? "DS" : "GP";
+    bcf_unpack(rec, BCF_UN_FMT);
+    bcf_fmt_t *fmt = rec->n_sample ? bcf_get_fmt(in_hdr,rec,tag) : NULL;
+    if ( !fmt || fmt->type!=BCF_BT_FLOAT )
+    {
+        if ( !__sync_lock_test_and_set(&warned_gp,1) ) fprintf(stderr, "[impute-info.c] Warning: info tag not added to sites without %s tag\n", tag);
+        ctx->nskip_gp++;
+        return; // require FORMAT/GP or DS tag, return site unchanged
     }
-    switch (gp_type)
+    if ( fmt->n != (use_ds ? 1 : 3) )
     {
-        case BCF_HT_INT:  BRANCH(int32_t,ptr[j]==bcf_int32_missing,ptr[j]==bcf_int32_vector_end); break;
-        case BCF_HT_REAL: BRANCH(float,bcf_float_is_missing(ptr[j]),bcf_float_is_vector_end(ptr[j])); break;
+        if ( !__sync_lock_test_and_set(&warned_dip,1) ) fprintf(stderr, "[impute-info.c] Warning: info tag not added to sites that are not biallelic diploid\n");
+        ctx->nskip_dip++;
+        return; // require biallelic diploid, return site unchanged
     }
-    #undef BRANCH
-
-    double theta = esum / (2 * (double)nval);
-    float info  = (theta>0 && theta<1) ? (float)(1 - (fsum - e2sum) / (2 * (double)nval * theta * (1.0 - theta))) : 1;
+    if ( use_ds )
+    {
+        float r2 = ds_r2((const float*)fmt->p, rec->n_sample);
+        bcf_update_info_float(out_hdr, rec, "R2", &r2, 1);
+    }
+    else
+    {
+        float info = gp_info((const float*)fmt->p, rec->n_sample);
+        bcf_update_info_float(out_hdr, rec, "INFO", &info, 1);
+    }
+    ctx->nrec++;
+}
 
-    bcf_update_info_float(out_hdr, rec, "INFO", &info, 1);
-    nrec++;
+bcf1_t *process(bcf1_t *rec)
+{
+    add_info(&main_ctx, rec);
     return rec;
 }
 
+/*
+    The batch API, the sites are independent and only the counters are kept
+    per thread.
+*/
+void *init_thread(int ithread)
+{
+    return calloc(1, sizeof(ctx_t));
+}
+
+int process_batch(void *ctx, bcf1_t **recs, int nrecs)
+{
+    int i;
+    for (i=0; i<nrecs; i++) add_info((ctx_t*)ctx, recs[i]);
+    return 0;
+}
+
+void reduce(void *_ctx)
+{
+    ctx_t *ctx = (ctx_t*) _ctx;
+    main_ctx.nrec      += ctx->nrec;
+    main_ctx.nskip_gp  += ctx->nskip_gp;
+    main_ctx.nskip_dip += ctx->nskip_dip;
+    free(ctx);
+}
 
 void destroy(void)
 {
-    fprintf(stderr,"Lines total/info-added/unchanged-no-tag/unchanged-not-biallelic-diploid:\t%d/%d/%d/%d\n", nrec+nskip_gp+nskip_dip, nrec, nskip_gp, nskip_dip);
-    free(buf);
+    ctx_t *c = &main_ctx;
+    fprintf(stderr,"Lines total/info-added/unchanged-no-tag/unchanged-not-biallelic-diploid:\t%d/%d/%d/%d\n", c->nrec+c->nskip_gp+c->nskip_dip, c->nrec, c->nskip_gp, c->nskip_dip);
 }
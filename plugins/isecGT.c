@@ -33,6 +33,7 @@
 #include <inttypes.h>
 #include <unistd.h>
 #include <errno.h>
+#include <string.h>
 #include "bcftools.h"
 #include "smpl_ilist.h"
 
@@ -69,6 +70,29 @@ static const char *usage_text(void)
         "\n";
 }
 
+/*
+    When both files store GT with the same type and ploidy, the genotypes
+    are compared byte by byte in the packed records and the mismatching ones
+    are set to missing in place: a zero of any integer width is a missing
+    allele. Returns -1 when the layouts differ, the caller decodes then.
+*/
+static int isec_packed(args_t *args, bcf1_t *line_a, bcf1_t *line_b, smpl_ilist_t *smpl)
+{
+    bcf_unpack(line_a, BCF_UN_FMT);
+    bcf_unpack(line_b, BCF_UN_FMT);
+    bcf_fmt_t *fa = bcf_get_fmt(args->hdr_a, line_a, "GT");
+    bcf_fmt_t *fb = bcf_get_fmt(args->hdr_b, line_b, "GT");
+    if ( !fa || !fb || fa->type!=fb->type || fa->n!=fb->n ) return -1;
+
+    int i, size = fa->size;
+    for (i=0; i<smpl->n; i++)
+    {
+        uint8_t *a = fa->p + i*size;
+        if ( memcmp(a, fb->p + smpl->idx[i]*size, size) ) memset(a, 0, size);
+    }
+    return 0;
+}
+
 int run(int argc, char **argv)
 {
     args_t *args = (args_t*) calloc(1,sizeof(args_t));
@@ -144,6 +168,11 @@ int run(int argc, char **argv)
 
         bcf1_t *line_a = bcf_sr_get_line(args->sr,0);
         bcf1_t *line_b = bcf_sr_get_line(args->sr,1);
+        if ( isec_packed(args, line_a, line_b, smpl)==0 )
+        {
+            bcf_write(args->out_fh, args->hdr_a, line_a);
+            continue;
+        }
         int ngt_a = bcf_get_genotypes(args->hdr_a, line_a, &args->arr_a, &args->narr_a);
         int ngt_b = bcf_get_genotypes(args->hdr_b, line_b, &args->arr_b, &args->narr_b);
         assert( ngt_a==ngt_b );     // todo
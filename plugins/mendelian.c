@@ -41,19 +41,28 @@
 
 typedef struct
 {
-    int nok, nbad;
     int imother,ifather,ichild;
 }
 trio_t;
 
+// The state of one thread, see init_thread()
+typedef struct
+{
+    int32_t *gt_arr;
+    int ngt_arr, nrec;
+    int *als;           // bitmask of alleles of each sample, 0 for missing genotypes
+    int *nok, *nbad;    // per-trio counts
+}
+ctx_t;
+
 typedef struct _args_t
 {
     bcf_hdr_t *hdr;
-    int32_t *gt_arr;
     int mode;
-    int ngt_arr, nrec;
     trio_t *trios;
     int ntrios;
+    int *smpl, nsmpl;   // samples present in any of the trios
+    ctx_t ctx;
 }
 args_t;
 
@@ -85,6 +94,21 @@ const char *usage(void)
         "\n";
 }
 
+static void init_ctx(ctx_t *ctx)
+{
+    memset(ctx,0,sizeof(ctx_t));
+    ctx->als  = (int*) calloc(bcf_hdr_nsamples(args.hdr),sizeof(int));
+    ctx->nok  = (int*) calloc(args.ntrios,sizeof(int));
+    ctx->nbad = (int*) calloc(args.ntrios,sizeof(int));
+}
+static void destroy_ctx(ctx_t *ctx)
+{
+    free(ctx->gt_arr);
+    free(ctx->als);
+    free(ctx->nok);
+    free(ctx->nbad);
+}
+
 int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
 {
     char *trio_samples = NULL, *trio_file = NULL;
@@ -136,6 +160,8 @@ int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
         args.trios[0].imother = bcf_hdr_id2int(args.hdr, BCF_DT_SAMPLE, list[0]);
         args.trios[0].ifather = bcf_hdr_id2int(args.hdr, BCF_DT_SAMPLE, list[1]);
         args.trios[0].ichild  = bcf_hdr_id2int(args.hdr, BCF_DT_SAMPLE, list[2]);
+        for (i=0; i<n; i++)
+            if ( bcf_hdr_id2int(args.hdr, BCF_DT_SAMPLE, list[i])<0 ) error("No such sample: \"%s\"\n", list[i]);
         for (i=0; i<n; i++) free(list[i]);
         free(list);
     }
@@ -166,61 +192,70 @@ int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
         }
         free(list);
     }
+
+    // index the trio samples so that each is decoded only once per record
+    int nsmpl = bcf_hdr_nsamples(args.hdr);
+    char *is_trio = (char*) calloc(nsmpl,1);
+    for (i=0; i<args.ntrios; i++)
+        is_trio[args.trios[i].imother] = is_trio[args.trios[i].ifather] = is_trio[args.trios[i].ichild] = 1;
+    args.smpl = (int*) malloc(sizeof(int)*nsmpl);
+    for (i=0; i<nsmpl; i++)
+        if ( is_trio[i] ) args.smpl[args.nsmpl++] = i;
+    free(is_trio);
+
+    init_ctx(&args.ctx);
     return args.mode&(MODE_LIST_GOOD|MODE_LIST_BAD) ? 0 : 1;
 }
 
-bcf1_t *process(bcf1_t *rec)
+static bcf1_t *process_rec(ctx_t *ctx, bcf1_t *rec)
 {
     bcf1_t *dflt = args.mode&MODE_LIST_GOOD ? rec : NULL;
-    args.nrec++;
+    ctx->nrec++;
 
-    int ngt = bcf_get_genotypes(args.hdr, rec, &args.gt_arr, &args.ngt_arr);
+    int ngt = bcf_get_genotypes(args.hdr, rec, &ctx->gt_arr, &ctx->ngt_arr);
     if ( ngt<0 ) return dflt;
     if ( ngt!=2*bcf_hdr_nsamples(args.hdr) ) return dflt;
 
     int i, has_bad = 0, needs_update = 0;
+    int32_t *gt_arr = ctx->gt_arr;
+    int *als = ctx->als;
+    for (i=0; i<args.nsmpl; i++)
+    {
+        int32_t *gt = gt_arr + 2*args.smpl[i];
+        if ( bcf_gt_is_missing(gt[0]) || bcf_gt_is_missing(gt[1]) ) als[args.smpl[i]] = 0;
+        else als[args.smpl[i]] = (1<<bcf_gt_allele(gt[0])) | (1<<bcf_gt_allele(gt[1]));
+    }
     for (i=0; i<args.ntrios; i++)
     {
-        int mother,father,child;
-        int32_t a,b,c,d,e,f;
         trio_t *trio = &args.trios[i];
-
-        a = args.gt_arr[2*trio->imother];
-        b = args.gt_arr[2*trio->imother+1];
-        c = args.gt_arr[2*trio->ifather];
-        d = args.gt_arr[2*trio->ifather+1];
-        e = args.gt_arr[2*trio->ichild];
-        f = args.gt_arr[2*trio->ichild+1];
-        if ( bcf_gt_is_missing(a) || bcf_gt_is_missing(b) ) continue; 
-        if ( bcf_gt_is_missing(c) || bcf_gt_is_missing(d) ) continue; 
-        if ( bcf_gt_is_missing(e) || bcf_gt_is_missing(f) ) continue; 
-
-        mother = (1<<bcf_gt_allele(a)) | (1<<bcf_gt_allele(b));
-        father = (1<<bcf_gt_allele(c)) | (1<<bcf_gt_allele(d));
-        child  = (1<<bcf_gt_allele(e)) | (1<<bcf_gt_allele(f));
+        int mother = als[trio->imother];
+        int father = als[trio->ifather];
+        int child  = als[trio->ichild];
+        if ( !mother || !father || !child ) continue;
 
         if ( (mother&child) && (father&child) ) 
         {
-            trio->nok++;
+            ctx->nok[i]++;
         }
         else
         {
-            trio->nbad++;
+            ctx->nbad[i]++;
             has_bad = 1;
             if ( args.mode&MODE_DELETE )
             {
-                args.gt_arr[2*trio->imother]   = bcf_gt_missing;
-                args.gt_arr[2*trio->imother+1] = bcf_gt_missing;
-                args.gt_arr[2*trio->ifather]   = bcf_gt_missing;
-                args.gt_arr[2*trio->ifather+1] = bcf_gt_missing;
-                args.gt_arr[2*trio->ichild]    = bcf_gt_missing;
-                args.gt_arr[2*trio->ichild+1]  = bcf_gt_missing;
+                gt_arr[2*trio->imother]   = bcf_gt_missing;
+                gt_arr[2*trio->imother+1] = bcf_gt_missing;
+                gt_arr[2*trio->ifather]   = bcf_gt_missing;
+                gt_arr[2*trio->ifather+1] = bcf_gt_missing;
+                gt_arr[2*trio->ichild]    = bcf_gt_missing;
+                gt_arr[2*trio->ichild+1]  = bcf_gt_missing;
+                als[trio->imother] = als[trio->ifather] = als[trio->ichild] = 0;
                 needs_update = 1;
             }
         }
     }
 
-    if ( needs_update && bcf_update_genotypes(args.hdr,rec,args.gt_arr,ngt) )
+    if ( needs_update && bcf_update_genotypes(args.hdr,rec,gt_arr,ngt) )
         error("Could not update GT field at %s:%d\n", bcf_seqname(args.hdr,rec),rec->pos+1);
 
     if ( args.mode&MODE_DELETE ) return rec;
@@ -230,6 +265,39 @@ bcf1_t *process(bcf1_t *rec)
     return NULL;
 }
 
+bcf1_t *process(bcf1_t *rec)
+{
+    return process_rec(&args.ctx, rec);
+}
+
+void *init_thread(int ithread)
+{
+    ctx_t *ctx = (ctx_t*) malloc(sizeof(ctx_t));
+    init_ctx(ctx);
+    return ctx;
+}
+
+int process_batch(void *ctx, bcf1_t **recs, int nrecs)
+{
+    int i;
+    for (i=0; i<nrecs; i++) recs[i] = process_rec((ctx_t*)ctx, recs[i]);
+    return 0;
+}
+
+void reduce(void *ctx)
+{
+    ctx_t *thr = (ctx_t*) ctx;
+    int i;
+    args.ctx.nrec += thr->nrec;
+    for (i=0; i<args.ntrios; i++)
+    {
+        args.ctx.nok[i]  += thr->nok[i];
+        args.ctx.nbad[i] += thr->nbad[i];
+    }
+    destroy_ctx(thr);
+    free(thr);
+}
+
 void destroy(void)
 {
     int i;
@@ -238,14 +306,15 @@ void destroy(void)
     {
         trio_t *trio = &args.trios[i];
         fprintf(stderr,"%d\t%d\t%d\t%s,%s,%s\n", 
-            trio->nok,trio->nbad,args.nrec-(trio->nok+trio->nbad),
+            args.ctx.nok[i],args.ctx.nbad[i],args.ctx.nrec-(args.ctx.nok[i]+args.ctx.nbad[i]),
             bcf_hdr_int2id(args.hdr, BCF_DT_SAMPLE, trio->imother),
             bcf_hdr_int2id(args.hdr, BCF_DT_SAMPLE, trio->ifather),
             bcf_hdr_int2id(args.hdr, BCF_DT_SAMPLE, trio->ichild)
             );
     }
-    free(args.gt_arr);
+    destroy_ctx(&args.ctx);
     free(args.trios);
+    free(args.smpl);
 }
 
 
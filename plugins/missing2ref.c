@@ -28,11 +28,20 @@ DEALINGS IN THE SOFTWARE.  */
 #include <htslib/vcfutils.h>
 #include <inttypes.h>
 #include <getopt.h>
+#include "gtedit.h"
+#include "gtcount.h"
+
+// The state of one thread, see init_thread()
+typedef struct
+{
+    int32_t *gts;
+    int *arr, mgts, marr;
+    uint64_t nchanged;
+}
+ctx_t;
 
 bcf_hdr_t *in_hdr, *out_hdr;
-int32_t *gts = NULL, mgts = 0;
-int *arr = NULL, marr = 0;
-uint64_t nchanged = 0;
+ctx_t main_ctx;
 int new_gt = bcf_gt_unphased(0);
 int use_major = 0;
 
@@ -86,10 +95,9 @@ int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
     return 0;
 }
 
-bcf1_t *process(bcf1_t *rec)
+static void process_rec(ctx_t *ctx, bcf1_t *rec)
 {
-    int ngts = bcf_get_genotypes(in_hdr, rec, &gts, &mgts);
-    int i, changed = 0;
+    int i, j, changed = 0, gt = new_gt;
     
     // Calculating allele frequency for each allele and determining major allele
     // only do this if use_major is true
@@ -97,8 +105,9 @@ bcf1_t *process(bcf1_t *rec)
     int maxAC = -1;
     int an = 0;
     if(use_major == 1){
-        hts_expand(int,rec->n_allele,marr,arr);
-        int ret = bcf_calc_ac(in_hdr,rec,arr,BCF_UN_FMT);
+        hts_expand(int,rec->n_allele,ctx->marr,ctx->arr);
+        int *arr = ctx->arr;
+        int ret = gtcount_calc_ac(in_hdr,rec,arr,BCF_UN_FMT);
         if(ret > 0){
             for(i=0; i < rec->n_allele; ++i){
                 an += arr[i];
@@ -115,30 +124,80 @@ bcf1_t *process(bcf1_t *rec)
 
         // replacing new_gt by major allele
         if(bcf_gt_is_phased(new_gt))
-            new_gt = bcf_gt_phased(majorAllele);
+            gt = bcf_gt_phased(majorAllele);
         else
-            new_gt = bcf_gt_unphased(majorAllele);
+            gt = bcf_gt_unphased(majorAllele);
     }
 
-    // replace gts
+    // replace gts, in place when the new value fits the width of the GT block
+    bcf_fmt_t *fmt = gtedit_fmt(in_hdr, rec, gt);
+    if ( fmt )
+    {
+        hts_expand(int32_t,fmt->n,ctx->mgts,ctx->gts);
+        int32_t *gts = ctx->gts;
+        for (i=0; i<rec->n_sample; i++)
+        {
+            int nchanged = 0;
+            gtedit_get(fmt, i, gts);
+            for (j=0; j<fmt->n; j++)
+            {
+                if ( gts[j]==bcf_gt_missing )
+                {
+                    gts[j] = gt;
+                    nchanged++;
+                }
+            }
+            if ( nchanged ) gtedit_set(fmt, i, gts);
+            changed += nchanged;
+        }
+        ctx->nchanged += changed;
+        return;
+    }
+
+    int ngts = bcf_get_genotypes(in_hdr, rec, &ctx->gts, &ctx->mgts);
+    int32_t *gts = ctx->gts;
     for (i=0; i<ngts; i++)
     {
         if ( gts[i]==bcf_gt_missing )
         {
-            gts[i] = new_gt;
+            gts[i] = gt;
             changed++;
         }
     }
-    nchanged += changed;
+    ctx->nchanged += changed;
     if ( changed ) bcf_update_genotypes(out_hdr, rec, gts, ngts);
+}
+
+bcf1_t *process(bcf1_t *rec)
+{
+    process_rec(&main_ctx, rec);
     return rec;
 }
 
-void destroy(void)
+void *init_thread(int ithread)
+{
+    return calloc(1, sizeof(ctx_t));
+}
+
+int process_batch(void *ctx, bcf1_t **recs, int nrecs)
 {
-    free(arr);
-    fprintf(stderr,"Filled %"PRId64" REF alleles\n", nchanged);
-    free(gts);
+    int i;
+    for (i=0; i<nrecs; i++) process_rec((ctx_t*)ctx, recs[i]);
+    return 0;
 }
 
+void reduce(void *ctx)
+{
+    ctx_t *thr = (ctx_t*) ctx;
+    main_ctx.nchanged += thr->nchanged;
+    free(thr->gts);
+    free(thr->arr);
+    free(thr);
+}
 
+void destroy(void)
+{
+    free(main_ctx.arr);
+    fprintf(stderr,"Filled %"PRId64" REF alleles\n", main_ctx.nchanged);
+    free(main_ctx.gts);
+}
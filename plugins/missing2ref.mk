@@ -0,0 +1,2 @@
+plugins/missing2ref.so: plugins/missing2ref.c version.h version.c gtedit.h gtcount.h
+	$(CC) $(PLUGIN_FLAGS) $(CFLAGS) $(EXTRA_CPPFLAGS) $(CPPFLAGS) $(LDFLAGS) -o $@ version.c $< $(LIBS)
@@ -30,20 +30,30 @@ DEALINGS IN THE SOFTWARE.  */
 #include <getopt.h>
 #include "bcftools.h"
 #include "filter.h"
+#include "gtedit.h"
+#include "gtcount.h"
 
 // Logic of the filters: include or exclude sites which match the filters?
 #define FLT_INCLUDE 1
 #define FLT_EXCLUDE 2
 
+// The state of one thread, see init_thread()
+typedef struct
+{
+    int32_t *gts;
+    int *arr, mgts, marr;
+    uint8_t *smpl_mask;     // the samples to unphase by gtedit_unphase() or to write back
+    int msmpl_mask;
+    uint64_t nchanged;
+    filter_t *filter;
+}
+ctx_t;
+
 bcf_hdr_t *in_hdr, *out_hdr;
-int32_t *gts = NULL, mgts = 0;
-int *arr = NULL, marr = 0;
-uint64_t nchanged = 0;
+ctx_t main_ctx;
 int tgt_mask = 0, new_mask = 0, new_gt = 0;
-filter_t *filter = NULL;
 char *filter_str = NULL;
 int filter_logic = 0;
-const uint8_t *smpl_pass = NULL;
 
 #define GT_MISSING   1
 #define GT_PARTIAL  (1<<1)
@@ -147,7 +157,7 @@ int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
 
     if ( filter_str  && tgt_mask!=GT_QUERY ) error("Expected -t? with -i/-e\n");
     if ( !filter_str && tgt_mask&GT_QUERY ) error("Expected -i/-e with -t?\n");
-    if ( filter_str ) filter = filter_init(in,filter_str);
+    if ( filter_str ) main_ctx.filter = filter_init(in,filter_str);
 
     return 0;
 }
@@ -190,21 +200,45 @@ static inline int set_gt(int32_t *ptr, int ngts, int gt)
     return changed;
 }
 
-bcf1_t *process(bcf1_t *rec)
+// Returns the number of changed alleles of one sample
+static inline int edit_gt(int32_t *ptr, int ngts, int gt, int query)
+{
+    if ( !query )
+    {
+        int j, ploidy = 0, nmiss = 0;
+        for (j=0; j<ngts; j++)
+        {
+            if ( ptr[j]==bcf_int32_vector_end ) break;
+            ploidy++;
+            if ( ptr[j]==bcf_gt_missing ) nmiss++;
+        }
+
+        int do_set = 0;
+        if ( tgt_mask&GT_ALL ) do_set = 1;
+        else if ( tgt_mask&GT_PARTIAL && nmiss ) do_set = 1;
+        else if ( tgt_mask&GT_MISSING && ploidy==nmiss ) do_set = 1;
+
+        if ( !do_set ) return 0;
+    }
+    if ( new_mask&GT_UNPHASED )
+        return unphase_gt(ptr, ngts);
+    return set_gt(ptr, ngts, gt);
+}
+
+static void process_rec(ctx_t *ctx, bcf1_t *rec)
 {
-    if ( !rec->n_sample ) return rec;
+    if ( !rec->n_sample ) return;
 
-    int ngts = bcf_get_genotypes(in_hdr, rec, &gts, &mgts);
-    ngts /= rec->n_sample;
-    int i, j, changed = 0;
+    int i, changed = 0, gt = new_gt;
     
     // Calculating allele frequency for each allele and determining major allele
     // only do this if use_major is true
     int an = 0, maxAC = -1, majorAllele = -1;
     if ( new_mask & GT_MAJOR )
     {
-        hts_expand(int,rec->n_allele,marr,arr);
-        int ret = bcf_calc_ac(in_hdr,rec,arr,BCF_UN_FMT);
+        hts_expand(int,rec->n_allele,ctx->marr,ctx->arr);
+        int *arr = ctx->arr;
+        int ret = gtcount_calc_ac(in_hdr,rec,arr,BCF_UN_FMT);
         if ( ret<= 0 )
             error("Could not calculate allele count at %s:%d\n", bcf_seqname(in_hdr,rec),rec->pos+1);
 
@@ -219,65 +253,113 @@ bcf1_t *process(bcf1_t *rec)
         }
 
         // replacing new_gt by major allele
-        new_gt = new_mask & GT_PHASED ?  bcf_gt_phased(majorAllele) : bcf_gt_unphased(majorAllele);
+        gt = new_mask & GT_PHASED ?  bcf_gt_phased(majorAllele) : bcf_gt_unphased(majorAllele);
     }
 
-    // replace gts
-    if ( tgt_mask&GT_QUERY )
+    const uint8_t *smpl_pass = NULL;
+    int query = tgt_mask&GT_QUERY ? 1 : 0;
+    if ( query )
     {
-        int pass_site = filter_test(filter,rec,&smpl_pass);
-        if ( (pass_site && filter_logic==FLT_EXCLUDE) || (!pass_site && filter_logic==FLT_INCLUDE) ) return rec;
-        for (i=0; i<rec->n_sample; i++)
-        {
-            if ( smpl_pass )
-            {
-                if ( !smpl_pass[i] && filter_logic==FLT_INCLUDE ) continue;
-                if (  smpl_pass[i] && filter_logic==FLT_EXCLUDE ) continue;
-            }
+        int pass_site = filter_test(ctx->filter,rec,&smpl_pass);
+        if ( (pass_site && filter_logic==FLT_EXCLUDE) || (!pass_site && filter_logic==FLT_INCLUDE) ) return;
+    }
 
-            if ( new_mask&GT_UNPHASED )
-                changed += unphase_gt(gts + i*ngts, ngts);
-            else
-                changed += set_gt(gts + i*ngts, ngts, new_gt);
-        }
+    // Edit the genotypes in place when the new values fit the width of the GT
+    // block, unphasing only makes the values smaller. Otherwise decode all
+    // genotypes and re-encode them
+    int ngts;
+    bcf_fmt_t *fmt = gtedit_fmt(in_hdr, rec, new_mask&GT_UNPHASED ? 0 : gt);
+    if ( fmt )
+    {
+        ngts = fmt->n;
+        hts_expand(int32_t,ngts*rec->n_sample,ctx->mgts,ctx->gts);
     }
     else
     {
+        ngts = bcf_get_genotypes(in_hdr, rec, &ctx->gts, &ctx->mgts);
+        if ( ngts<=0 ) return;
+        ngts /= rec->n_sample;
+    }
+
+    // Unphasing of diploid genotypes of all or the queried samples is done in a
+    // single pass over the packed block
+    if ( fmt && fmt->n==2 && new_mask&GT_UNPHASED && tgt_mask&(GT_ALL|GT_QUERY) )
+    {
+        hts_expand(uint8_t,rec->n_sample,ctx->msmpl_mask,ctx->smpl_mask);
         for (i=0; i<rec->n_sample; i++)
         {
-            int ploidy = 0, nmiss = 0;
-            int32_t *ptr = gts + i*ngts;
-            for (j=0; j<ngts; j++)
-            {
-                if ( ptr[j]==bcf_int32_vector_end ) break;
-                ploidy++;
-                if ( ptr[j]==bcf_gt_missing ) nmiss++;
-            }
-
-            int do_set = 0;
-            if ( tgt_mask&GT_ALL ) do_set = 1;
-            else if ( tgt_mask&GT_PARTIAL && nmiss ) do_set = 1;
-            else if ( tgt_mask&GT_MISSING && ploidy==nmiss ) do_set = 1;
-
-            if ( !do_set ) continue;
+            if ( !smpl_pass ) ctx->smpl_mask[i] = 1;
+            else ctx->smpl_mask[i] = filter_logic==FLT_INCLUDE ? smpl_pass[i]!=0 : !smpl_pass[i];
+        }
+        ctx->nchanged += gtedit_unphase(fmt, rec->n_sample, ctx->smpl_mask);
+        return;
+    }
 
-            if ( new_mask&GT_UNPHASED )
-                changed += unphase_gt(ptr, ngts);
-            else
-                changed += set_gt(ptr, ngts, new_gt);
+    // Unphasing sorts the alleles also when none was phased, so once the record
+    // changes, all processed samples are written back, not only the changed ones
+    if ( fmt ) hts_expand(uint8_t,rec->n_sample,ctx->msmpl_mask,ctx->smpl_mask);
+    for (i=0; i<rec->n_sample; i++)
+    {
+        if ( fmt ) ctx->smpl_mask[i] = 0;
+        if ( smpl_pass )
+        {
+            if ( !smpl_pass[i] && filter_logic==FLT_INCLUDE ) continue;
+            if (  smpl_pass[i] && filter_logic==FLT_EXCLUDE ) continue;
         }
+        if ( fmt )
+        {
+            gtedit_get(fmt, i, ctx->gts + i*ngts);
+            ctx->smpl_mask[i] = 1;
+        }
+        changed += edit_gt(ctx->gts + i*ngts, ngts, gt, query);
+    }
+    ctx->nchanged += changed;
+    if ( !changed ) return;
+    if ( !fmt )
+    {
+        bcf_update_genotypes(out_hdr, rec, ctx->gts, ngts*rec->n_sample);
+        return;
     }
-    nchanged += changed;
-    if ( changed ) bcf_update_genotypes(out_hdr, rec, gts, ngts*rec->n_sample);
+    for (i=0; i<rec->n_sample; i++)
+        if ( ctx->smpl_mask[i] ) gtedit_set(fmt, i, ctx->gts + i*ngts);
+}
+
+bcf1_t *process(bcf1_t *rec)
+{
+    process_rec(&main_ctx, rec);
     return rec;
 }
 
-void destroy(void)
+void *init_thread(int ithread)
+{
+    ctx_t *ctx = (ctx_t*) calloc(1, sizeof(ctx_t));
+    if ( filter_str ) ctx->filter = filter_init(in_hdr, filter_str);
+    return ctx;
+}
+
+int process_batch(void *ctx, bcf1_t **recs, int nrecs)
 {
-    if ( filter ) filter_destroy(filter);
-    free(arr);
-    fprintf(stderr,"Filled %"PRId64" alleles\n", nchanged);
-    free(gts);
+    int i;
+    for (i=0; i<nrecs; i++) process_rec((ctx_t*)ctx, recs[i]);
+    return 0;
 }
 
+void reduce(void *ctx)
+{
+    ctx_t *thr = (ctx_t*) ctx;
+    main_ctx.nchanged += thr->nchanged;
+    if ( thr->filter ) filter_destroy(thr->filter);
+    free(thr->gts);
+    free(thr->arr);
+    free(thr->smpl_mask);
+    free(thr);
+}
 
+void destroy(void)
+{
+    if ( main_ctx.filter ) filter_destroy(main_ctx.filter);
+    free(main_ctx.arr);
+    fprintf(stderr,"Filled %"PRId64" alleles\n", main_ctx.nchanged);
+    free(main_ctx.gts);
+    free(main_ctx.smpl_mask);
+}
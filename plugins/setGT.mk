@@ -1,2 +1,2 @@
-plugins/setGT.so: plugins/setGT.c version.h version.c filter.h filter.c
+plugins/setGT.so: plugins/setGT.c version.h version.c filter.h filter.c gtedit.h gtcount.h
 	$(CC) $(PLUGIN_FLAGS) $(CFLAGS) $(EXTRA_CPPFLAGS) $(CPPFLAGS) $(LDFLAGS) -o $@ filter.c version.c $< $(LIBS)
@@ -26,8 +26,10 @@ DEALINGS IN THE SOFTWARE.  */
 #include <stdlib.h>
 #include <getopt.h>
 #include <math.h>
+#include <string.h>
 #include <htslib/hts.h>
 #include <htslib/vcf.h>
+#include <htslib/kstring.h>
 #include "bcftools.h"
 
 
@@ -41,6 +43,7 @@ static bcf_hdr_t *in_hdr, *out_hdr;
 static float *farr = NULL, thresh = 0.1;
 static int32_t *iarr = NULL;
 static int mfarr = 0, miarr = 0;
+static kstring_t tmp = {0,0,0};
 
 const char *about(void)
 {
@@ -70,6 +73,105 @@ const char *usage(void)
 }
 
 
+/*
+ *  The conversions read the values directly from the packed FORMAT field.
+ *  The destination can be the source itself when the widths are the same,
+ *  see convert_in_place().
+ */
+
+// Imputed GP values repeat a small number of distinct values, log10 of each
+// is computed once and kept in a direct-mapped cache keyed by the float bits
+#define LOG10_CACHE_BITS 12
+static struct { uint32_t key; float val; } log10_cache[1<<LOG10_CACHE_BITS];
+
+static void log10_cache_init(void)
+{
+    int i;
+    union { float f; uint32_t i; } u;
+    bcf_float_set_missing(u.f);     // never looked up, marks the empty slots
+    for (i=0; i<(1<<LOG10_CACHE_BITS); i++) log10_cache[i].key = u.i;
+}
+static inline float gp2gl(float gp)
+{
+    union { float f; uint32_t i; } u;
+    u.f = gp;
+    int i = (u.i * 2654435761u) >> (32 - LOG10_CACHE_BITS);
+    if ( log10_cache[i].key != u.i )
+    {
+        log10_cache[i].key = u.i;
+        log10_cache[i].val = gp ? log10(gp) : -99;
+    }
+    return log10_cache[i].val;
+}
+static void gp_to_gl(const float *src, float *dst, int n)
+{
+    int i;
+    for (i=0; i<n; i++)
+    {
+        if ( bcf_float_is_missing(src[i]) || bcf_float_is_vector_end(src[i]) ) dst[i] = src[i];
+        else dst[i] = gp2gl(src[i]);
+    }
+}
+#define BRANCH(type_t, is_missing, is_vector_end) \
+{ \
+    const type_t *ptr = (const type_t*) src; \
+    for (i=0; i<n; i++) \
+    { \
+        if ( is_missing ) bcf_float_set_missing(dst[i]); \
+        else if ( is_vector_end ) bcf_float_set_vector_end(dst[i]); \
+        else dst[i] = -0.1 * ptr[i]; \
+    } \
+}
+static void pl_to_gl(const uint8_t *src, int type, float *dst, int n)
+{
+    int i;
+    switch (type)
+    {
+        case BCF_BT_INT8:  BRANCH(int8_t,  ptr[i]==bcf_int8_missing,  ptr[i]==bcf_int8_vector_end); break;
+        case BCF_BT_INT16: BRANCH(int16_t, ptr[i]==bcf_int16_missing, ptr[i]==bcf_int16_vector_end); break;
+        case BCF_BT_INT32: BRANCH(int32_t, ptr[i]==bcf_int32_missing, ptr[i]==bcf_int32_vector_end); break;
+        default: error("Unexpected type of FORMAT/PL: %d\n", type);
+    }
+}
+#undef BRANCH
+static void gl_to_pl(const float *src, int32_t *dst, int n)
+{
+    int i;
+    for (i=0; i<n; i++)
+    {
+        if ( bcf_float_is_missing(src[i]) )
+            dst[i] = bcf_int32_missing;
+        else if ( bcf_float_is_vector_end(src[i]) )
+            dst[i] = bcf_int32_vector_end;
+        else
+            dst[i] = lroundf(-10 * src[i]);
+    }
+}
+
+/*
+ *  With --replace, the field is converted in place when the new values have
+ *  the same width as the old ones: the key and type bytes are re-encoded and
+ *  the values overwritten in the packed record, avoiding the temporary arrays
+ *  and the re-encoding of the whole FORMAT block. Returns 0 if the field can
+ *  be converted this way, the caller does the conversion.
+ */
+static int convert_in_place(bcf1_t *rec, bcf_fmt_t *fmt, const char *dst_tag, int dst_type)
+{
+    if ( !drop_source_tag || fmt->p_free ) return -1;
+    if ( bcf_type_shift[fmt->type] != bcf_type_shift[dst_type] ) return -1;
+    if ( bcf_get_fmt(out_hdr,rec,dst_tag) ) return -1;  // the destination tag exists already
+
+    int id = bcf_hdr_id2int(out_hdr,BCF_DT_ID,dst_tag);
+    tmp.l = 0;
+    bcf_enc_int1(&tmp, id);
+    bcf_enc_size(&tmp, fmt->n, dst_type);
+    if ( tmp.l != fmt->p_off ) return -1;
+    memcpy(fmt->p - fmt->p_off, tmp.s, tmp.l);
+    fmt->id   = id;
+    fmt->type = dst_type;
+    return 0;
+}
+
 static void init_header(bcf_hdr_t *hdr, const char *ori, int ori_type, const char *new_hdr_line)
 {
     if ( ori )
@@ -108,6 +210,7 @@ int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
         }
     }
     if ( !mode ) mode = GP_TO_GL;
+    log10_cache_init();
 
     in_hdr  = in;
     out_hdr = out;
@@ -133,51 +236,48 @@ int init(int argc, char **argv, bcf_hdr_t *in, bcf_hdr_t *out)
 bcf1_t *process(bcf1_t *rec)
 {
     int i, n;
+    if ( !rec->n_sample ) return rec;
+    bcf_unpack(rec, BCF_UN_FMT);
     if ( mode==GP_TO_GL )
     {
-        n = bcf_get_format_float(in_hdr,rec,"GP",&farr,&mfarr);
-        if ( n<=0 ) return rec;
-        for (i=0; i<n; i++)
+        bcf_fmt_t *fmt = bcf_get_fmt(in_hdr,rec,"GP");
+        if ( !fmt || fmt->type!=BCF_BT_FLOAT ) return rec;
+        n = fmt->n * rec->n_sample;
+        if ( convert_in_place(rec,fmt,"GL",BCF_BT_FLOAT)==0 )
         {
-            if ( bcf_float_is_missing(farr[i]) || bcf_float_is_vector_end(farr[i]) ) continue;
-            farr[i] = farr[i] ? log10(farr[i]) : -99;
+            gp_to_gl((float*)fmt->p, (float*)fmt->p, n);
+            return rec;
         }
+        hts_expand(float, n, mfarr, farr);
+        gp_to_gl((float*)fmt->p, farr, n);
         bcf_update_format_float(out_hdr,rec,"GL",farr,n);
         if ( drop_source_tag )
             bcf_update_format_float(out_hdr,rec,"GP",NULL,0);
     }
     else if ( mode==PL_TO_GL )
     {
-        n = bcf_get_format_int32(in_hdr,rec,"PL",&iarr,&miarr);
-        if ( n<=0 ) return rec;
-        hts_expand(float, n, mfarr, farr);
-        for (i=0; i<n; i++)
+        bcf_fmt_t *fmt = bcf_get_fmt(in_hdr,rec,"PL");
+        if ( !fmt || fmt->type==BCF_BT_FLOAT || fmt->type==BCF_BT_CHAR ) return rec;
+        n = fmt->n * rec->n_sample;
+        if ( convert_in_place(rec,fmt,"GL",BCF_BT_FLOAT)==0 )
         {
-            if ( iarr[i]==bcf_int32_missing )
-                bcf_float_set_missing(farr[i]);
-            else if ( iarr[i]==bcf_int32_vector_end )
-                bcf_float_set_vector_end(farr[i]);
-            else
-                farr[i] = -0.1 * iarr[i];
+            pl_to_gl(fmt->p, BCF_BT_INT32, (float*)fmt->p, n);
+            return rec;
         }
+        hts_expand(float, n, mfarr, farr);
+        pl_to_gl(fmt->p, fmt->type, farr, n);
         bcf_update_format_float(out_hdr,rec,"GL",farr,n);
         if ( drop_source_tag )
             bcf_update_format_int32(out_hdr,rec,"PL",NULL,0);
     }
     else if ( mode==GL_TO_PL )
     {
-        n = bcf_get_format_float(in_hdr,rec,"GL",&farr,&mfarr);
-        if ( n<=0 ) return rec;
+        bcf_fmt_t *fmt = bcf_get_fmt(in_hdr,rec,"GL");
+        if ( !fmt || fmt->type!=BCF_BT_FLOAT ) return rec;
+        // not in place, bcf_update_format_int32() narrows PL to the smallest type
+        n = fmt->n * rec->n_sample;
         hts_expand(int32_t, n, miarr, iarr);
-        for (i=0; i<n; i++)
-        {
-            if ( bcf_float_is_missing(farr[i]) )
-                iarr[i] = bcf_int32_missing;
-            else if ( bcf_float_is_vector_end(farr[i]) )
-                iarr[i] = bcf_int32_vector_end;
-            else
-                iarr[i] = lroundf(-10 * farr[i]);
-        }
+        gl_to_pl((float*)fmt->p, iarr, n);
         bcf_update_format_int32(out_hdr,rec,"PL",iarr,n);
         if ( drop_source_tag )
             bcf_update_format_float(out_hdr,rec,"GL",NULL,0);
@@ -185,16 +285,17 @@ bcf1_t *process(bcf1_t *rec)
     else if ( mode==GP_TO_GT )
     {
         int nals  = rec->n_allele;
-        int nsmpl = bcf_hdr_nsamples(in_hdr);
+        int nsmpl = rec->n_sample;
         hts_expand(int32_t,nsmpl*2,miarr,iarr);
 
-        n = bcf_get_format_float(in_hdr,rec,"GP",&farr,&mfarr);
-        if ( n<=0 ) return rec;
+        bcf_fmt_t *fmt = bcf_get_fmt(in_hdr,rec,"GP");
+        if ( !fmt || fmt->type!=BCF_BT_FLOAT ) return rec;
+        const float *gp = (const float*) fmt->p;
 
-        n /= nsmpl;
+        n = fmt->n;
         for (i=0; i<nsmpl; i++)
         {
-            float *ptr = farr + i*n;
+            const float *ptr = gp + i*n;
             if ( bcf_float_is_missing(ptr[0]) )
             {
                 iarr[2*i] = iarr[2*i+1] = bcf_gt_missing;
@@ -249,6 +350,7 @@ void destroy(void)
 {
     free(farr);
     free(iarr);
+    free(tmp.s);
 }
 
 
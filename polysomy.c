@@ -30,12 +30,15 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <gsl/gsl_vector.h>
 #include <gsl/gsl_multifit_nlin.h>
 #include <htslib/vcf.h>
 #include <htslib/synced_bcf_reader.h>
+#include <htslib/kstring.h>
 #include "bcftools.h"
 #include "peakfit.h"
+#include "baflrr.h"
 
 typedef struct
 {
@@ -45,6 +48,7 @@ typedef struct
     int copy_number;    // heuristics to skip futile CN1 fits when no het peak is detected
     int irr, ira, iaa;  // chop off RR and AA peaks
     char *chr;
+    kstring_t out, log; // the fit results and verbose output, see fit_dist()
 }
 dist_t;
 
@@ -55,8 +59,8 @@ typedef struct
     dist_t *dist;
     char **argv, *output_dir;
     double fit_th, peak_symmetry, cn_penalty, min_peak_size, min_fraction;
-    int argc, plot, verbose, regions_is_file, targets_is_file, include_aa, force_cn;
-    char *dat_fname, *fname, *regions_list, *targets_list, *sample;
+    int argc, plot, verbose, regions_is_file, targets_is_file, include_aa, force_cn, nthreads;
+    char *dat_fname, *fname, *regions_list, *targets_list, *sample, *cache_fname;
     FILE *dat_fp;
 }
 args_t;
@@ -164,7 +168,20 @@ static void init_dist(args_t *args, dist_t *dist, int verbose)
             dist->copy_number,sra/srr,saa/sra, (int)sra);
 }
 
-static void init_data(args_t *args)
+static dist_t *add_dist(args_t *args, const char *chr)
+{
+    int idist = args->ndist++;
+    args->dist = (dist_t*) realloc(args->dist, sizeof(dist_t)*args->ndist);
+    memset(&args->dist[idist],0,sizeof(dist_t));
+    args->dist[idist].chr   = strdup(chr);
+    args->dist[idist].yvals = (double*) calloc(args->nbins,sizeof(double));
+    args->dist[idist].xvals = args->xvals;
+    args->dist[idist].nvals = args->nbins;
+    return &args->dist[idist];
+}
+
+// collect BAF distributions for all chromosomes from the VCF
+static void read_vcf(args_t *args)
 {
     bcf_srs_t *files = bcf_sr_init();
     if ( args->regions_list )
@@ -191,40 +208,67 @@ static void init_data(args_t *args)
     if ( !bcf_hdr_idinfo_exists(hdr,BCF_HL_FMT,bcf_hdr_id2int(hdr,BCF_DT_ID,"BAF")) )
         error("The tag FORMAT/BAF is not present in the VCF: %s\n", args->fname);
 
-    int i;
-    args->xvals = (double*) calloc(args->nbins,sizeof(double));
-    for (i=0; i<args->nbins; i++) args->xvals[i] = 1.0*i/(args->nbins-1);
-
-    // collect BAF distributions for all chromosomes
-    int idist = -1, nbaf = 0, nprocessed = 0, ntotal = 0, prev_chr = -1;
+    dist_t *dist = NULL;
+    int nbaf = 0, prev_chr = -1;
     float *baf = NULL;
     while ( bcf_sr_next_line(files) )
     {
-        ntotal++;
-
         bcf1_t *line = bcf_sr_get_line(files,0);
         if ( bcf_get_format_float(hdr,line,"BAF",&baf,&nbaf) != 1 ) continue;
         if ( bcf_float_is_missing(baf[0]) ) continue;
 
-        nprocessed++;
-
         if ( prev_chr==-1 || prev_chr!=line->rid )
         {
             // new chromosome
-            idist = args->ndist++;
-            args->dist = (dist_t*) realloc(args->dist, sizeof(dist_t)*args->ndist);
-            memset(&args->dist[idist],0,sizeof(dist_t));
-            args->dist[idist].chr   = strdup(bcf_seqname(hdr,line));
-            args->dist[idist].yvals = (double*) calloc(args->nbins,sizeof(double));
-            args->dist[idist].xvals = args->xvals;
-            args->dist[idist].nvals = args->nbins;
+            dist = add_dist(args, bcf_seqname(hdr,line));
             prev_chr = line->rid;
         }
         int bin = baf[0]*(args->nbins-1);
-        args->dist[idist].yvals[bin]++;   // the distribution
+        dist->yvals[bin]++;   // the distribution
     }
     free(baf);
     bcf_sr_destroy(files);
+}
+
+// the same from the --baf-cache, one chromosome at a time
+static void read_cache(args_t *args)
+{
+    if ( args->regions_list || args->targets_list )
+        error("The options -r, -R, -t and -T cannot be combined with --baf-cache\n");
+    baflrr_t *baflrr = baflrr_open(args->fname, args->cache_fname);
+    int ismpl = 0;
+    if ( !args->sample )
+    {
+        if ( baflrr_nsamples(baflrr)>1 ) error("Missing the option -s, --sample\n");
+    }
+    else if ( (ismpl = baflrr_sample_idx(baflrr,args->sample))<0 ) error("No such sample: %s\n", args->sample);
+
+    int i, iseq, nbaf, mbaf = 0;
+    float *baf = NULL;
+    for (iseq=0; iseq<baflrr_nseqs(baflrr); iseq++)
+    {
+        nbaf = baflrr_get_values(baflrr, iseq, ismpl, &baf, NULL, &mbaf);
+        dist_t *dist = NULL;
+        for (i=0; i<nbaf; i++)
+        {
+            if ( isnan(baf[i]) ) continue;
+            if ( !dist ) dist = add_dist(args, baflrr_seq_name(baflrr,iseq));
+            int bin = baf[i]*(args->nbins-1);
+            dist->yvals[bin]++;
+        }
+    }
+    free(baf);
+    baflrr_destroy(baflrr);
+}
+
+static void init_data(args_t *args)
+{
+    int i, idist;
+    args->xvals = (double*) calloc(args->nbins,sizeof(double));
+    for (i=0; i<args->nbins; i++) args->xvals[i] = 1.0*i/(args->nbins-1);
+
+    if ( args->cache_fname ) read_cache(args);
+    else read_vcf(args);
 
     for (idist=0; idist<args->ndist; idist++)
     {
@@ -361,6 +405,8 @@ static void destroy_data(args_t *args)
     {
         free(args->dist[i].chr);
         free(args->dist[i].yvals);
+        free(args->dist[i].out.s);
+        free(args->dist[i].log.s);
     }
     free(args->dist);
     free(args->xvals);
@@ -374,245 +420,291 @@ static void save_dist(args_t *args, dist_t *dist)
     for (i=0; i<args->nbins; i++)
         fprintf(args->dat_fp,"DIST\t%s\t%f\t%f\n",dist->chr,dist->xvals[i],dist->yvals[i]);
 }
-static void fit_curves(args_t *args)
+// Fit the copy number models to one chromosome. The output goes to dist->out and,
+// with -v, to dist->log so that chromosomes can be fitted in parallel
+static void fit_dist(args_t *args, peakfit_t *pkf, dist_t *dist)
 {
-    peakfit_t *pkf = peakfit_init();
-    peakfit_verbose(pkf,args->verbose);
-
-    int i, nmc = 50;
-    for (i=0; i<args->ndist; i++)
+    int nmc = 50;
+    if ( dist->copy_number!=0 )
     {
-        dist_t *dist = &args->dist[i];
-        save_dist(args, &args->dist[i]);
-
-        if ( dist->copy_number!=0 )
-        {
-            fprintf(args->dat_fp,"CN\t%s\t%.2f\n", dist->chr,(float)dist->copy_number);
-            continue;
-        }
+        ksprintf(&dist->out,"CN\t%s\t%.2f\n", dist->chr,(float)dist->copy_number);
+        return;
+    }
 
-        if ( args->verbose )
-            fprintf(stderr,"%s:\n", dist->chr);
+    if ( args->verbose )
+        ksprintf(&dist->log,"%s:\n", dist->chr);
 
-        int nrr_aa  = dist->iaa - dist->irr + 1;
-        int nrr_ra  = dist->ira - dist->irr + 1;
-        int naa_max = dist->nvals - dist->iaa;
-        double xrr  = dist->xvals[dist->irr], *xrr_vals = &dist->xvals[dist->irr], *yrr_vals = &dist->yvals[dist->irr];
-        double xaa  = dist->xvals[dist->iaa], *xaa_vals = &dist->xvals[dist->iaa], *yaa_vals = &dist->yvals[dist->iaa];
-        double xra  = dist->xvals[dist->ira];
-        double xmax = dist->xvals[dist->nvals-1];
+    int nrr_aa  = dist->iaa - dist->irr + 1;
+    int nrr_ra  = dist->ira - dist->irr + 1;
+    int naa_max = dist->nvals - dist->iaa;
+    double xrr  = dist->xvals[dist->irr], *xrr_vals = &dist->xvals[dist->irr], *yrr_vals = &dist->yvals[dist->irr];
+    double xaa  = dist->xvals[dist->iaa], *xaa_vals = &dist->xvals[dist->iaa], *yaa_vals = &dist->yvals[dist->iaa];
+    double xra  = dist->xvals[dist->ira];
+    double xmax = dist->xvals[dist->nvals-1];
 
 
-        // CN2
-        double cn2aa_fit = 0, cn2ra_fit, cn2_fit;
-        char *cn2aa_func = 0, *cn2ra_func;
-        double cn2aa_params[3] = {1,1,1} ,cn2ra_params[3];
-        if ( args->include_aa )
-        {
-            peakfit_reset(pkf);
-            peakfit_add_exp(pkf, 1.0,1.0,0.2, 5);
-            peakfit_set_mc(pkf, 0.01,0.3,2,nmc);
-            peakfit_set_mc(pkf, 0.05,1.0,0,nmc);
-            cn2aa_fit  = peakfit_run(pkf, naa_max, xaa_vals, yaa_vals);
-            cn2aa_func = strdup(peakfit_sprint_func(pkf));
-            peakfit_get_params(pkf,0,cn2aa_params,3);
-        }
+    // CN2
+    double cn2aa_fit = 0, cn2ra_fit, cn2_fit;
+    char *cn2aa_func = 0, *cn2ra_func;
+    double cn2aa_params[3] = {1,1,1} ,cn2ra_params[3];
+    if ( args->include_aa )
+    {
         peakfit_reset(pkf);
-        peakfit_add_bounded_gaussian(pkf, 1.0,0.5,0.03, 0.45,0.55, 7);
+        peakfit_add_exp(pkf, 1.0,1.0,0.2, 5);
         peakfit_set_mc(pkf, 0.01,0.3,2,nmc);
         peakfit_set_mc(pkf, 0.05,1.0,0,nmc);
-        cn2ra_fit  = peakfit_run(pkf, nrr_aa,xrr_vals,yrr_vals);
-        cn2ra_func = strdup(peakfit_sprint_func(pkf));
-        cn2_fit    = cn2ra_fit + cn2aa_fit;
-        peakfit_get_params(pkf,0,cn2ra_params,3);
-
-
-        // CN3: fit two peaks, then enforce the symmetry and fit again
-        double cn3rra_params[5], cn3raa_params[5], *cn3aa_params = cn2aa_params;
-        double cn3aa_fit = cn2aa_fit, cn3ra_fit;
-        char *cn3aa_func = cn2aa_func, *cn3ra_func;
-        double min_dx3   = 0.5 - 1./(args->min_fraction+2);
-        peakfit_reset(pkf);
-        peakfit_add_bounded_gaussian(pkf, 1.0,1/3.,0.03, xrr,xra-min_dx3, 7);
-        peakfit_set_mc(pkf, xrr,xra-min_dx3, 1,nmc);
-        peakfit_add_bounded_gaussian(pkf, 1.0,2/3.,0.03, xra+min_dx3,xaa, 7);
-        peakfit_set_mc(pkf, xra+min_dx3,xaa, 1,nmc);
-        peakfit_run(pkf, nrr_aa, xrr_vals, yrr_vals);
-        // force symmetry around x=0.5
-        peakfit_get_params(pkf,0,cn3rra_params,5);
-        peakfit_get_params(pkf,1,cn3raa_params,5);
-        double cn3_dx = (0.5-cn3rra_params[1] + cn3raa_params[1]-0.5)*0.5;
-        if ( cn3_dx > 0.5/3 ) cn3_dx = 0.5/3;   // CN3 peaks should not be separated by more than 1/3
-        peakfit_reset(pkf);
-        peakfit_add_gaussian(pkf, cn3rra_params[0],0.5-cn3_dx,cn3rra_params[2], 5);
-        peakfit_add_gaussian(pkf, cn3raa_params[0],0.5+cn3_dx,cn3raa_params[2], 5);
-        cn3ra_fit  = peakfit_run(pkf, nrr_aa, xrr_vals, yrr_vals);
-        cn3ra_func = strdup(peakfit_sprint_func(pkf));
-        // compare peak sizes
-        peakfit_get_params(pkf,0,cn3rra_params,3);
-        peakfit_get_params(pkf,1,cn3raa_params,3);
-        double cn3rra_size = cn3rra_params[0]*cn3rra_params[0];
-        double cn3raa_size = cn3raa_params[0]*cn3raa_params[0];
-        double cn3_dy      = cn3rra_size > cn3raa_size ? cn3raa_size/cn3rra_size : cn3rra_size/cn3raa_size;
-        double cn3_frac    = (1 - 2*cn3rra_params[1]) / cn3rra_params[1];
-        double cn3_fit     = cn3ra_fit + cn3aa_fit;
-        // A very reasonable heuristics: check if the peak's width converged, exclude far too broad or far too narrow peaks
-        if ( cn3rra_params[2]>0.3  || cn3raa_params[2]>0.3 ) cn3_fit = HUGE_VAL;
-        if ( cn3rra_params[2]<1e-2 || cn3raa_params[2]<1e-2 ) cn3_fit = HUGE_VAL;
-
-
-        // CN4 (contaminations)
-        // - first fit only the [0,0.5] part of the data, then enforce the symmetry and fit again
-        // - min_frac=1 (resp. 0.5) is interpreted as 50:50% (rep. 75:25%) contamination
-        double cn4AAaa_params[3] = {1,1,1} ,cn4AAra_params[3] = {1,1,1}, cn4RAra_params[3], cn4RArr_params[5], cn4RAaa_params[5];
-        double cn4aa_fit = 0, cn4ra_fit;
-        char *cn4aa_func = 0, *cn4ra_func;
-        double min_dx4   = 0.25*args->min_fraction;
-        if ( args->include_aa )
-        {
-            peakfit_reset(pkf);
-            peakfit_add_exp(pkf, 0.5,1.0,0.2, 5);
-            peakfit_set_mc(pkf, 0.01,0.3,2,nmc);
-            peakfit_add_bounded_gaussian(pkf, 0.4,(xaa+xmax)*0.5,2e-2, xaa,xmax, 7);
-            peakfit_set_mc(pkf, xaa,xmax, 1,nmc);
-            cn4aa_fit  = peakfit_run(pkf, naa_max, xaa_vals,yaa_vals);
-            cn4aa_func = strdup(peakfit_sprint_func(pkf));
-            peakfit_get_params(pkf,0,cn4AAaa_params,3);
-            peakfit_get_params(pkf,1,cn4AAra_params,5);
-        }
-        peakfit_reset(pkf);
-        // first fit only the [0,0.5] part of the data
-        peakfit_add_gaussian(pkf, 1.0,0.5,0.03, 5);
-        peakfit_add_bounded_gaussian(pkf, 0.6,0.3,0.03, xrr,xra-min_dx4, 7);
-        peakfit_set_mc(pkf, xrr,xra-min_dx4,2,nmc);
-        peakfit_run(pkf, nrr_ra , xrr_vals, yrr_vals);
-        // now forcet symmetry around x=0.5
-        peakfit_get_params(pkf,0,cn4RAra_params,3);
-        peakfit_get_params(pkf,1,cn4RArr_params,5);
-        double cn4_dx = 0.5-cn4RArr_params[1];
-        if ( cn4_dx > 0.25 ) cn4_dx = 0.25;   // CN4 peaks should not be separated by more than 0.5
+        cn2aa_fit  = peakfit_run(pkf, naa_max, xaa_vals, yaa_vals);
+        cn2aa_func = strdup(peakfit_sprint_func(pkf));
+        peakfit_get_params(pkf,0,cn2aa_params,3);
+    }
+    peakfit_reset(pkf);
+    peakfit_add_bounded_gaussian(pkf, 1.0,0.5,0.03, 0.45,0.55, 7);
+    peakfit_set_mc(pkf, 0.01,0.3,2,nmc);
+    peakfit_set_mc(pkf, 0.05,1.0,0,nmc);
+    cn2ra_fit  = peakfit_run(pkf, nrr_aa,xrr_vals,yrr_vals);
+    cn2ra_func = strdup(peakfit_sprint_func(pkf));
+    cn2_fit    = cn2ra_fit + cn2aa_fit;
+    peakfit_get_params(pkf,0,cn2ra_params,3);
+
+
+    // CN3: fit two peaks, then enforce the symmetry and fit again
+    double cn3rra_params[5], cn3raa_params[5], *cn3aa_params = cn2aa_params;
+    double cn3aa_fit = cn2aa_fit, cn3ra_fit;
+    char *cn3aa_func = cn2aa_func, *cn3ra_func;
+    double min_dx3   = 0.5 - 1./(args->min_fraction+2);
+    peakfit_reset(pkf);
+    peakfit_add_bounded_gaussian(pkf, 1.0,1/3.,0.03, xrr,xra-min_dx3, 7);
+    peakfit_set_mc(pkf, xrr,xra-min_dx3, 1,nmc);
+    peakfit_add_bounded_gaussian(pkf, 1.0,2/3.,0.03, xra+min_dx3,xaa, 7);
+    peakfit_set_mc(pkf, xra+min_dx3,xaa, 1,nmc);
+    peakfit_run(pkf, nrr_aa, xrr_vals, yrr_vals);
+    // force symmetry around x=0.5
+    peakfit_get_params(pkf,0,cn3rra_params,5);
+    peakfit_get_params(pkf,1,cn3raa_params,5);
+    double cn3_dx = (0.5-cn3rra_params[1] + cn3raa_params[1]-0.5)*0.5;
+    if ( cn3_dx > 0.5/3 ) cn3_dx = 0.5/3;   // CN3 peaks should not be separated by more than 1/3
+    peakfit_reset(pkf);
+    peakfit_add_gaussian(pkf, cn3rra_params[0],0.5-cn3_dx,cn3rra_params[2], 5);
+    peakfit_add_gaussian(pkf, cn3raa_params[0],0.5+cn3_dx,cn3raa_params[2], 5);
+    cn3ra_fit  = peakfit_run(pkf, nrr_aa, xrr_vals, yrr_vals);
+    cn3ra_func = strdup(peakfit_sprint_func(pkf));
+    // compare peak sizes
+    peakfit_get_params(pkf,0,cn3rra_params,3);
+    peakfit_get_params(pkf,1,cn3raa_params,3);
+    double cn3rra_size = cn3rra_params[0]*cn3rra_params[0];
+    double cn3raa_size = cn3raa_params[0]*cn3raa_params[0];
+    double cn3_dy      = cn3rra_size > cn3raa_size ? cn3raa_size/cn3rra_size : cn3rra_size/cn3raa_size;
+    double cn3_frac    = (1 - 2*cn3rra_params[1]) / cn3rra_params[1];
+    double cn3_fit     = cn3ra_fit + cn3aa_fit;
+    // A very reasonable heuristics: check if the peak's width converged, exclude far too broad or far too narrow peaks
+    if ( cn3rra_params[2]>0.3  || cn3raa_params[2]>0.3 ) cn3_fit = HUGE_VAL;
+    if ( cn3rra_params[2]<1e-2 || cn3raa_params[2]<1e-2 ) cn3_fit = HUGE_VAL;
+
+
+    // CN4 (contaminations)
+    // - first fit only the [0,0.5] part of the data, then enforce the symmetry and fit again
+    // - min_frac=1 (resp. 0.5) is interpreted as 50:50% (rep. 75:25%) contamination
+    double cn4AAaa_params[3] = {1,1,1} ,cn4AAra_params[3] = {1,1,1}, cn4RAra_params[3], cn4RArr_params[5], cn4RAaa_params[5];
+    double cn4aa_fit = 0, cn4ra_fit;
+    char *cn4aa_func = 0, *cn4ra_func;
+    double min_dx4   = 0.25*args->min_fraction;
+    if ( args->include_aa )
+    {
         peakfit_reset(pkf);
-        peakfit_add_gaussian(pkf, cn4RAra_params[0],0.5,cn4RAra_params[2], 5);
-        peakfit_add_gaussian(pkf, cn4RArr_params[0],0.5-cn4_dx,cn4RArr_params[2], 5);
-        peakfit_add_gaussian(pkf, cn4RArr_params[0],0.5+cn4_dx,cn4RArr_params[2], 5);
-        peakfit_set_mc(pkf, 0.1,cn4RAra_params[0],0,nmc);
-        peakfit_set_mc(pkf, 0.01,0.1,2,nmc);
-        cn4ra_fit  = peakfit_run(pkf, nrr_aa , xrr_vals, yrr_vals);
-        cn4ra_func = strdup(peakfit_sprint_func(pkf));
-        peakfit_get_params(pkf,0,cn4RAra_params,3);
-        peakfit_get_params(pkf,1,cn4RArr_params,3);
-        peakfit_get_params(pkf,2,cn4RAaa_params,3);
-        double cn4RAra_size = cn4RAra_params[0]==0 ? HUGE_VAL : cn4RAra_params[0]*cn4RAra_params[0];
-        double cn4RArr_size = cn4RArr_params[0]*cn4RArr_params[0];
-        double cn4RAaa_size = cn4RAaa_params[0]*cn4RAaa_params[0];
-        double cn4RArr_dy   = cn4RArr_size < cn4RAra_size ? cn4RArr_size/cn4RAra_size : cn4RAra_size/cn4RArr_size;
-        double cn4RAaa_dy   = cn4RAaa_size < cn4RAra_size ? cn4RAaa_size/cn4RAra_size : cn4RAra_size/cn4RAaa_size;
-        double cn4_dy       = cn4RArr_dy < cn4RAaa_dy ? cn4RArr_dy/cn4RAaa_dy : cn4RAaa_dy/cn4RArr_dy;
-        double cn4_ymin     = cn4RArr_size < cn4RAaa_size ? cn4RArr_size/cn4RAra_size : cn4RAaa_size/cn4RAra_size;
-        cn4_dx              = (cn4RAaa_params[1]-0.5) - (0.5-cn4RArr_params[1]);
-        double cn4_frac     = cn4RAaa_params[1] - cn4RArr_params[1];
-        double cn4_fit      = cn4ra_fit + cn4aa_fit;
-        // A very reasonable heuristics: check if the peak's width converged, exclude far too broad or far too narrow peaks
-        if ( cn4RAra_params[2]>0.3 || cn4RArr_params[2]>0.3 || cn4RAaa_params[2]>0.3 ) cn4_fit = HUGE_VAL;
-        if ( cn4RAra_params[2]<1e-2 || cn4RArr_params[2]<1e-2 || cn4RAaa_params[2]<1e-2 ) cn4_fit = HUGE_VAL;
-
-
-        // Choose the best match
-        char cn2_fail = '*', cn3_fail = '*', cn4_fail = '*';
-        if ( cn2_fit > args->fit_th ) cn2_fail = 'f';
-
-        if ( cn3_fit > args->fit_th ) cn3_fail = 'f';
-        else if ( cn3_dy < args->peak_symmetry ) cn3_fail = 'y';    // size difference is too big
-
-        if ( cn4_fit > args->fit_th ) cn4_fail = 'f';
-        else if ( cn4_ymin < args->min_peak_size ) cn4_fail = 'y';      // side peak is too small
-        else if ( cn4_dy < args->peak_symmetry ) cn4_fail = 'Y';    // size difference is too big
-        else if ( cn4_dx > 0.1 ) cn4_fail = 'x';                    // side peaks placed assymetrically
-
-        double cn = -1, fit = cn2_fit;
-        if ( cn2_fail == '*' ) { cn = 2; fit = cn2_fit; }
-        if ( cn3_fail == '*' )
-        {
-            // Use cn_penalty as a tiebreaker. If set to 0.3, cn3_fit must be 30% smaller than cn2_fit.
-            if ( cn<0 || cn3_fit < (1-args->cn_penalty) * fit )
-            {
-                cn = 2 + cn3_frac; 
-                fit = cn3_fit; 
-                if ( cn2_fail=='*' ) cn2_fail = 'p';
-            }
-            else cn3_fail = 'p';
-        }
-        if ( cn4_fail == '*' )
+        peakfit_add_exp(pkf, 0.5,1.0,0.2, 5);
+        peakfit_set_mc(pkf, 0.01,0.3,2,nmc);
+        peakfit_add_bounded_gaussian(pkf, 0.4,(xaa+xmax)*0.5,2e-2, xaa,xmax, 7);
+        peakfit_set_mc(pkf, xaa,xmax, 1,nmc);
+        cn4aa_fit  = peakfit_run(pkf, naa_max, xaa_vals,yaa_vals);
+        cn4aa_func = strdup(peakfit_sprint_func(pkf));
+        peakfit_get_params(pkf,0,cn4AAaa_params,3);
+        peakfit_get_params(pkf,1,cn4AAra_params,5);
+    }
+    peakfit_reset(pkf);
+    // first fit only the [0,0.5] part of the data
+    peakfit_add_gaussian(pkf, 1.0,0.5,0.03, 5);
+    peakfit_add_bounded_gaussian(pkf, 0.6,0.3,0.03, xrr,xra-min_dx4, 7);
+    peakfit_set_mc(pkf, xrr,xra-min_dx4,2,nmc);
+    peakfit_run(pkf, nrr_ra , xrr_vals, yrr_vals);
+    // now forcet symmetry around x=0.5
+    peakfit_get_params(pkf,0,cn4RAra_params,3);
+    peakfit_get_params(pkf,1,cn4RArr_params,5);
+    double cn4_dx = 0.5-cn4RArr_params[1];
+    if ( cn4_dx > 0.25 ) cn4_dx = 0.25;   // CN4 peaks should not be separated by more than 0.5
+    peakfit_reset(pkf);
+    peakfit_add_gaussian(pkf, cn4RAra_params[0],0.5,cn4RAra_params[2], 5);
+    peakfit_add_gaussian(pkf, cn4RArr_params[0],0.5-cn4_dx,cn4RArr_params[2], 5);
+    peakfit_add_gaussian(pkf, cn4RArr_params[0],0.5+cn4_dx,cn4RArr_params[2], 5);
+    peakfit_set_mc(pkf, 0.1,cn4RAra_params[0],0,nmc);
+    peakfit_set_mc(pkf, 0.01,0.1,2,nmc);
+    cn4ra_fit  = peakfit_run(pkf, nrr_aa , xrr_vals, yrr_vals);
+    cn4ra_func = strdup(peakfit_sprint_func(pkf));
+    peakfit_get_params(pkf,0,cn4RAra_params,3);
+    peakfit_get_params(pkf,1,cn4RArr_params,3);
+    peakfit_get_params(pkf,2,cn4RAaa_params,3);
+    double cn4RAra_size = cn4RAra_params[0]==0 ? HUGE_VAL : cn4RAra_params[0]*cn4RAra_params[0];
+    double cn4RArr_size = cn4RArr_params[0]*cn4RArr_params[0];
+    double cn4RAaa_size = cn4RAaa_params[0]*cn4RAaa_params[0];
+    double cn4RArr_dy   = cn4RArr_size < cn4RAra_size ? cn4RArr_size/cn4RAra_size : cn4RAra_size/cn4RArr_size;
+    double cn4RAaa_dy   = cn4RAaa_size < cn4RAra_size ? cn4RAaa_size/cn4RAra_size : cn4RAra_size/cn4RAaa_size;
+    double cn4_dy       = cn4RArr_dy < cn4RAaa_dy ? cn4RArr_dy/cn4RAaa_dy : cn4RAaa_dy/cn4RArr_dy;
+    double cn4_ymin     = cn4RArr_size < cn4RAaa_size ? cn4RArr_size/cn4RAra_size : cn4RAaa_size/cn4RAra_size;
+    cn4_dx              = (cn4RAaa_params[1]-0.5) - (0.5-cn4RArr_params[1]);
+    double cn4_frac     = cn4RAaa_params[1] - cn4RArr_params[1];
+    double cn4_fit      = cn4ra_fit + cn4aa_fit;
+    // A very reasonable heuristics: check if the peak's width converged, exclude far too broad or far too narrow peaks
+    if ( cn4RAra_params[2]>0.3 || cn4RArr_params[2]>0.3 || cn4RAaa_params[2]>0.3 ) cn4_fit = HUGE_VAL;
+    if ( cn4RAra_params[2]<1e-2 || cn4RArr_params[2]<1e-2 || cn4RAaa_params[2]<1e-2 ) cn4_fit = HUGE_VAL;
+
+
+    // Choose the best match
+    char cn2_fail = '*', cn3_fail = '*', cn4_fail = '*';
+    if ( cn2_fit > args->fit_th ) cn2_fail = 'f';
+
+    if ( cn3_fit > args->fit_th ) cn3_fail = 'f';
+    else if ( cn3_dy < args->peak_symmetry ) cn3_fail = 'y';    // size difference is too big
+
+    if ( cn4_fit > args->fit_th ) cn4_fail = 'f';
+    else if ( cn4_ymin < args->min_peak_size ) cn4_fail = 'y';      // side peak is too small
+    else if ( cn4_dy < args->peak_symmetry ) cn4_fail = 'Y';    // size difference is too big
+    else if ( cn4_dx > 0.1 ) cn4_fail = 'x';                    // side peaks placed assymetrically
+
+    double cn = -1, fit = cn2_fit;
+    if ( cn2_fail == '*' ) { cn = 2; fit = cn2_fit; }
+    if ( cn3_fail == '*' )
+    {
+        // Use cn_penalty as a tiebreaker. If set to 0.3, cn3_fit must be 30% smaller than cn2_fit.
+        if ( cn<0 || cn3_fit < (1-args->cn_penalty) * fit )
         {
-            if ( cn<0 || cn4_fit < (1-args->cn_penalty) * fit )
-            {
-                cn = 3 + cn4_frac;
-                fit = cn4_fit;
-                if ( cn2_fail=='*' ) cn2_fail = 'p';
-                if ( cn3_fail=='*' ) cn3_fail = 'p';
-            }
-            else cn4_fail = 'p';
+            cn = 2 + cn3_frac; 
+            fit = cn3_fit; 
+            if ( cn2_fail=='*' ) cn2_fail = 'p';
         }
-
-        if ( args->verbose )
+        else cn3_fail = 'p';
+    }
+    if ( cn4_fail == '*' )
+    {
+        if ( cn<0 || cn4_fit < (1-args->cn_penalty) * fit )
         {
-            fprintf(stderr,"\tcn2 %c fit=%e\n", cn2_fail, cn2_fit);
-            fprintf(stderr,"\t       .. %e\n", cn2ra_fit);
-            fprintf(stderr,"\t            RA:   %f %f %f\n", cn2ra_params[0],cn2ra_params[1],cn2ra_params[2]);
-            fprintf(stderr,"\t       .. %e\n", cn2aa_fit);
-            fprintf(stderr,"\t            AA:   %f %f %f\n", cn2aa_params[0],cn2aa_params[1],cn2aa_params[2]);
-            fprintf(stderr,"\t      func:\n");
-            fprintf(stderr,"\t            %s\n", cn2ra_func);
-            fprintf(stderr,"\t            %s\n", cn2aa_func);
-            fprintf(stderr,"\n");
-            fprintf(stderr,"\tcn3 %c fit=%e  frac=%f  symmetry=%f\n", cn3_fail, cn3_fit, cn3_frac, cn3_dy);
-            fprintf(stderr,"\t       .. %e\n", cn3ra_fit);
-            fprintf(stderr,"\t            RRA:  %f %f %f\n", cn3rra_params[0],cn3rra_params[1],cn3rra_params[2]);
-            fprintf(stderr,"\t            RAA:  %f %f %f\n", cn3raa_params[0],cn3raa_params[1],cn3raa_params[2]);
-            fprintf(stderr,"\t       .. %e\n", cn3aa_fit);
-            fprintf(stderr,"\t            AAA:  %f %f %f\n", cn3aa_params[0],cn3aa_params[1],cn3aa_params[2]);
-            fprintf(stderr,"\t      func:\n");
-            fprintf(stderr,"\t            %s\n", cn3ra_func);
-            fprintf(stderr,"\t            %s\n", cn3aa_func);
-            fprintf(stderr,"\n");
-            fprintf(stderr,"\tcn4 %c fit=%e  frac=%f  symmetry=%f ymin=%f\n", cn4_fail, cn4_fit, cn4_frac, cn4_dy, cn4_ymin);
-            fprintf(stderr,"\t       .. %e\n", cn4ra_fit);
-            fprintf(stderr,"\t            RArr:  %f %f %f\n", cn4RArr_params[0],cn4RArr_params[1],cn4RArr_params[2]);
-            fprintf(stderr,"\t            RAra:  %f %f %f\n", cn4RAra_params[0],cn4RAra_params[1],cn4RAra_params[2]);
-            fprintf(stderr,"\t            RAaa:  %f %f %f\n", cn4RAaa_params[0],cn4RAaa_params[1],cn4RAaa_params[2]);
-            fprintf(stderr,"\t       .. %e\n", cn4aa_fit);
-            fprintf(stderr,"\t            AAaa:  %f %f %f\n", cn4AAaa_params[0],cn4AAaa_params[1],cn4AAaa_params[2]);
-            fprintf(stderr,"\t      func:\n");
-            fprintf(stderr,"\t            %s\n", cn4ra_func);
-            fprintf(stderr,"\t            %s\n", cn4aa_func);
-            fprintf(stderr,"\n");
+            cn = 3 + cn4_frac;
+            fit = cn4_fit;
+            if ( cn2_fail=='*' ) cn2_fail = 'p';
+            if ( cn3_fail=='*' ) cn3_fail = 'p';
         }
+        else cn4_fail = 'p';
+    }
 
-        if ( args->force_cn==2 || cn2_fail == '*' )
-        {
-            fprintf(args->dat_fp,"FIT\t%s\t%e\t%d\t%d\t%s\n", dist->chr,cn2ra_fit,dist->irr,dist->iaa,cn2ra_func);
-            if ( cn2aa_func ) fprintf(args->dat_fp,"FIT\t%s\t%e\t%d\t%d\t%s\n", dist->chr,cn2aa_fit,dist->iaa,dist->nvals-1,cn2aa_func);
-        }
-        if ( args->force_cn==3 || cn3_fail == '*' )
-        {
-            fprintf(args->dat_fp,"FIT\t%s\t%e\t%d\t%d\t%s\n", dist->chr,cn3ra_fit,dist->irr,dist->iaa,cn3ra_func);
-            if ( cn3aa_func ) fprintf(args->dat_fp,"FIT\t%s\t%e\t%d\t%d\t%s\n", dist->chr,cn3aa_fit,dist->iaa,dist->nvals-1,cn3aa_func);
-        }
-        if ( args->force_cn==4 || cn4_fail == '*' )
-        {
-            fprintf(args->dat_fp,"FIT\t%s\t%e\t%d\t%d\t%s\n", dist->chr,cn4ra_fit,dist->irr,dist->iaa,cn4ra_func);
-            if ( cn4aa_func ) fprintf(args->dat_fp,"FIT\t%s\t%e\t%d\t%d\t%s\n", dist->chr,cn4aa_fit,dist->iaa,dist->nvals-1,cn4aa_func);
-        }
-        fprintf(args->dat_fp,"CN\t%s\t%.2f\t%f\n", dist->chr, cn, fit);
+    if ( args->verbose )
+    {
+        ksprintf(&dist->log,"\tcn2 %c fit=%e\n", cn2_fail, cn2_fit);
+        ksprintf(&dist->log,"\t       .. %e\n", cn2ra_fit);
+        ksprintf(&dist->log,"\t            RA:   %f %f %f\n", cn2ra_params[0],cn2ra_params[1],cn2ra_params[2]);
+        ksprintf(&dist->log,"\t       .. %e\n", cn2aa_fit);
+        ksprintf(&dist->log,"\t            AA:   %f %f %f\n", cn2aa_params[0],cn2aa_params[1],cn2aa_params[2]);
+        ksprintf(&dist->log,"\t      func:\n");
+        ksprintf(&dist->log,"\t            %s\n", cn2ra_func);
+        ksprintf(&dist->log,"\t            %s\n", cn2aa_func);
+        ksprintf(&dist->log,"\n");
+        ksprintf(&dist->log,"\tcn3 %c fit=%e  frac=%f  symmetry=%f\n", cn3_fail, cn3_fit, cn3_frac, cn3_dy);
+        ksprintf(&dist->log,"\t       .. %e\n", cn3ra_fit);
+        ksprintf(&dist->log,"\t            RRA:  %f %f %f\n", cn3rra_params[0],cn3rra_params[1],cn3rra_params[2]);
+        ksprintf(&dist->log,"\t            RAA:  %f %f %f\n", cn3raa_params[0],cn3raa_params[1],cn3raa_params[2]);
+        ksprintf(&dist->log,"\t       .. %e\n", cn3aa_fit);
+        ksprintf(&dist->log,"\t            AAA:  %f %f %f\n", cn3aa_params[0],cn3aa_params[1],cn3aa_params[2]);
+        ksprintf(&dist->log,"\t      func:\n");
+        ksprintf(&dist->log,"\t            %s\n", cn3ra_func);
+        ksprintf(&dist->log,"\t            %s\n", cn3aa_func);
+        ksprintf(&dist->log,"\n");
+        ksprintf(&dist->log,"\tcn4 %c fit=%e  frac=%f  symmetry=%f ymin=%f\n", cn4_fail, cn4_fit, cn4_frac, cn4_dy, cn4_ymin);
+        ksprintf(&dist->log,"\t       .. %e\n", cn4ra_fit);
+        ksprintf(&dist->log,"\t            RArr:  %f %f %f\n", cn4RArr_params[0],cn4RArr_params[1],cn4RArr_params[2]);
+        ksprintf(&dist->log,"\t            RAra:  %f %f %f\n", cn4RAra_params[0],cn4RAra_params[1],cn4RAra_params[2]);
+        ksprintf(&dist->log,"\t            RAaa:  %f %f %f\n", cn4RAaa_params[0],cn4RAaa_params[1],cn4RAaa_params[2]);
+        ksprintf(&dist->log,"\t       .. %e\n", cn4aa_fit);
+        ksprintf(&dist->log,"\t            AAaa:  %f %f %f\n", cn4AAaa_params[0],cn4AAaa_params[1],cn4AAaa_params[2]);
+        ksprintf(&dist->log,"\t      func:\n");
+        ksprintf(&dist->log,"\t            %s\n", cn4ra_func);
+        ksprintf(&dist->log,"\t            %s\n", cn4aa_func);
+        ksprintf(&dist->log,"\n");
+    }
 
-        free(cn2aa_func);
-        free(cn2ra_func);
-        free(cn3ra_func);
-        free(cn4ra_func);
-        free(cn4aa_func);
+    if ( args->force_cn==2 || cn2_fail == '*' )
+    {
+        ksprintf(&dist->out,"FIT\t%s\t%e\t%d\t%d\t%s\n", dist->chr,cn2ra_fit,dist->irr,dist->iaa,cn2ra_func);
+        if ( cn2aa_func ) ksprintf(&dist->out,"FIT\t%s\t%e\t%d\t%d\t%s\n", dist->chr,cn2aa_fit,dist->iaa,dist->nvals-1,cn2aa_func);
+    }
+    if ( args->force_cn==3 || cn3_fail == '*' )
+    {
+        ksprintf(&dist->out,"FIT\t%s\t%e\t%d\t%d\t%s\n", dist->chr,cn3ra_fit,dist->irr,dist->iaa,cn3ra_func);
+        if ( cn3aa_func ) ksprintf(&dist->out,"FIT\t%s\t%e\t%d\t%d\t%s\n", dist->chr,cn3aa_fit,dist->iaa,dist->nvals-1,cn3aa_func);
     }
+    if ( args->force_cn==4 || cn4_fail == '*' )
+    {
+        ksprintf(&dist->out,"FIT\t%s\t%e\t%d\t%d\t%s\n", dist->chr,cn4ra_fit,dist->irr,dist->iaa,cn4ra_func);
+        if ( cn4aa_func ) ksprintf(&dist->out,"FIT\t%s\t%e\t%d\t%d\t%s\n", dist->chr,cn4aa_fit,dist->iaa,dist->nvals-1,cn4aa_func);
+    }
+    ksprintf(&dist->out,"CN\t%s\t%.2f\t%f\n", dist->chr, cn, fit);
+
+    free(cn2aa_func);
+    free(cn2ra_func);
+    free(cn3ra_func);
+    free(cn4ra_func);
+    free(cn4aa_func);
+}
+
+typedef struct
+{
+    args_t *args;
+    pthread_mutex_t *lock;
+    int *next;
+}
+fit_job_t;
 
+static void *fit_worker(void *arg)
+{
+    fit_job_t *job = (fit_job_t*) arg;
+    peakfit_t *pkf = peakfit_init();
+    peakfit_verbose(pkf,job->args->verbose);
+    while (1)
+    {
+        pthread_mutex_lock(job->lock);
+        int idist = (*job->next)++;
+        pthread_mutex_unlock(job->lock);
+        if ( idist >= job->args->ndist ) break;
+        fit_dist(job->args, pkf, &job->args->dist[idist]);
+    }
     peakfit_destroy(pkf);
+    return NULL;
+}
+
+static void fit_curves(args_t *args)
+{
+    int i, next = 0, nthr = args->nthreads > 1 ? args->nthreads : 1;
+    if ( nthr > args->ndist ) nthr = args->ndist;
+
+    pthread_mutex_t lock;
+    pthread_mutex_init(&lock, NULL);
+    fit_job_t job = { args, &lock, &next };
+    if ( nthr<=1 )
+        fit_worker(&job);
+    else
+    {
+        pthread_t *thr = (pthread_t*) malloc(sizeof(pthread_t)*nthr);
+        for (i=0; i<nthr; i++)
+            if ( pthread_create(&thr[i], NULL, fit_worker, &job) ) error("Failed to create a thread\n");
+        for (i=0; i<nthr; i++) pthread_join(thr[i], NULL);
+        free(thr);
+    }
+    pthread_mutex_destroy(&lock);
+
+    // output in the order of chromosomes
+    for (i=0; i<args->ndist; i++)
+    {
+        dist_t *dist = &args->dist[i];
+        save_dist(args, dist);
+        if ( dist->out.l ) fputs(dist->out.s, args->dat_fp);
+        if ( dist->log.l ) fputs(dist->log.s, stderr);
+    }
 }
 
 static void usage(args_t *args)
@@ -622,12 +714,14 @@ static void usage(args_t *args)
     fprintf(stderr, "Usage:   bcftools polysomy [OPTIONS] <file.vcf>\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "General options:\n");
+    fprintf(stderr, "        --baf-cache <file>         read BAF from a compact cache of the VCF, built on first use\n");
     fprintf(stderr, "    -o, --output-dir <path>        \n");
     fprintf(stderr, "    -r, --regions <region>         restrict to comma-separated list of regions\n");
     fprintf(stderr, "    -R, --regions-file <file>      restrict to regions listed in a file\n");
     fprintf(stderr, "    -s, --sample <name>            sample to analyze\n");
     fprintf(stderr, "    -t, --targets <region>         similar to -r but streams rather than index-jumps\n");
     fprintf(stderr, "    -T, --targets-file <file>      similar to -R but streams rather than index-jumps\n");
+    fprintf(stderr, "        --threads <int>            number of threads to fit the chromosomes on [1]\n");
     fprintf(stderr, "    -v, --verbose                  \n");
     fprintf(stderr, "\n");
     fprintf(stderr, "Algorithm options:\n");
@@ -673,6 +767,8 @@ int main_polysomy(int argc, char *argv[])
         {"targets-file",1,0,'T'},
         {"regions",1,0,'r'},
         {"regions-file",1,0,'R'},
+        {"baf-cache",1,0,3},
+        {"threads",1,0,4},
         {0,0,0,0}
     };
     char *tmp;
@@ -683,6 +779,11 @@ int main_polysomy(int argc, char *argv[])
         {
             case  1 : args->ra_rr_scaling = 0; break;
             case  2 : args->force_cn = atoi(optarg); break;
+            case  3 : args->cache_fname = optarg; break;
+            case  4 :
+                args->nthreads = strtol(optarg,&tmp,10);
+                if ( *tmp ) error("Could not parse: --threads %s\n", optarg);
+                break;
             case 'n': args->nbins = atoi(optarg); break;
             case 'S': args->smooth = atoi(optarg); break;
             case 'i': args->include_aa = 1; break;
@@ -725,6 +826,7 @@ int main_polysomy(int argc, char *argv[])
     else args->fname = argv[optind];
     if ( !args->fname ) usage(args);
     if ( !args->output_dir ) error("Missing the -o option\n");
+    if ( args->cache_fname && !strcmp(args->fname,"-") ) error("The --baf-cache option requires a file name, cannot read from stdin\n");
 
     init_data(args);
     fit_curves(args);
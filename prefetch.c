@@ -0,0 +1,160 @@
+/* The MIT License
+
+   Copyright (c) 2017 Genome Research Ltd.
+
+   Author: Petr Danecek <pd3@sanger.ac.uk>
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "bcftools.h"
+#include "prefetch.h"
+
+// A queue slot holds either a record or the end of a sequence
+typedef struct
+{
+    bcf1_t *rec;
+    int iseq, end;
+}
+slot_t;
+
+struct _prefetch_t
+{
+    prefetch_seq_f seq;
+    prefetch_rec_f rec;
+    void *data;
+    int nseq, stop, done;       // done: all sequences were read
+    slot_t *slot;
+    int nslot, ihead, nfull;    // ihead: the oldest filled slot
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+// Wait for a free slot, returns NULL when stopped
+static slot_t *slot_get(prefetch_t *pf)
+{
+    pthread_mutex_lock(&pf->lock);
+    while ( pf->nfull==pf->nslot && !pf->stop ) pthread_cond_wait(&pf->cond, &pf->lock);
+    slot_t *slot = pf->stop ? NULL : &pf->slot[(pf->ihead + pf->nfull) % pf->nslot];
+    pthread_mutex_unlock(&pf->lock);
+    return slot;
+}
+
+static void slot_put(prefetch_t *pf)
+{
+    pthread_mutex_lock(&pf->lock);
+    pf->nfull++;
+    pthread_cond_broadcast(&pf->cond);
+    pthread_mutex_unlock(&pf->lock);
+}
+
+static void *prefetch_worker(void *arg)
+{
+    prefetch_t *pf = (prefetch_t*) arg;
+    int iseq;
+    for (iseq=0; iseq<pf->nseq; iseq++)
+    {
+        slot_t *slot;
+        if ( pf->seq(pf->data, iseq) )
+        {
+            while ( (slot = slot_get(pf)) )
+            {
+                if ( !pf->rec(pf->data, slot->rec) ) break;
+                slot->iseq = iseq;
+                slot->end  = 0;
+                slot_put(pf);
+            }
+            if ( !slot ) return NULL;
+        }
+        if ( !(slot = slot_get(pf)) ) return NULL;
+        slot->iseq = iseq;
+        slot->end  = 1;
+        slot_put(pf);
+    }
+    pthread_mutex_lock(&pf->lock);
+    pf->done = 1;
+    pthread_cond_broadcast(&pf->cond);
+    pthread_mutex_unlock(&pf->lock);
+    return NULL;
+}
+
+prefetch_t *prefetch_init(int nseq, int nqueue, prefetch_seq_f seq, prefetch_rec_f rec, void *data)
+{
+    int i;
+    prefetch_t *pf = (prefetch_t*) calloc(1,sizeof(prefetch_t));
+    pf->seq   = seq;
+    pf->rec   = rec;
+    pf->data  = data;
+    pf->nseq  = nseq;
+    pf->nslot = nqueue + 1;     // one more for the end of sequence marker
+    pf->slot  = (slot_t*) calloc(pf->nslot,sizeof(slot_t));
+    for (i=0; i<pf->nslot; i++) pf->slot[i].rec = bcf_init();
+    pthread_mutex_init(&pf->lock, NULL);
+    pthread_cond_init(&pf->cond, NULL);
+    if ( pthread_create(&pf->thread, NULL, prefetch_worker, pf) ) error("Failed to create threads\n");
+    return pf;
+}
+
+int prefetch_read(prefetch_t *pf, int iseq, bcf1_t **rec)
+{
+    int ret = 0;
+    pthread_mutex_lock(&pf->lock);
+    while ( 1 )
+    {
+        if ( !pf->nfull )
+        {
+            if ( pf->done ) break;
+            pthread_cond_wait(&pf->cond, &pf->lock);
+            continue;
+        }
+        slot_t *slot = &pf->slot[pf->ihead];
+        if ( slot->iseq > iseq ) break;     // the sequence was done before
+        if ( slot->iseq==iseq && !slot->end )
+        {
+            bcf1_t *tmp = *rec; *rec = slot->rec; slot->rec = tmp;
+            ret = 1;
+        }
+        pf->ihead = (pf->ihead + 1) % pf->nslot;
+        pf->nfull--;
+        pthread_cond_broadcast(&pf->cond);
+        if ( slot->iseq==iseq ) break;
+    }
+    pthread_mutex_unlock(&pf->lock);
+    return ret;
+}
+
+void prefetch_destroy(prefetch_t *pf)
+{
+    int i;
+    pthread_mutex_lock(&pf->lock);
+    pf->stop = 1;
+    pthread_cond_broadcast(&pf->cond);
+    pthread_mutex_unlock(&pf->lock);
+    pthread_join(pf->thread, NULL);
+    for (i=0; i<pf->nslot; i++) bcf_destroy(pf->slot[i].rec);
+    free(pf->slot);
+    pthread_mutex_destroy(&pf->lock);
+    pthread_cond_destroy(&pf->cond);
+    free(pf);
+}
@@ -0,0 +1,79 @@
+/* The MIT License
+
+   Copyright (c) 2017 Genome Research Ltd.
+
+   Author: Petr Danecek <pd3@sanger.ac.uk>
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+
+ */
+
+/*
+    Background reading of one input file. A thread reads and parses the
+    records of all sequences, in the order given by the caller, ahead of the
+    consumer and keeps them in a bounded queue. The records are handed over
+    by swapping bcf1_t pointers, no data are copied.
+
+        prefetch_t *pf = prefetch_init(nseq, 1000, start_seq, read_rec, data);
+        for (iseq=0; iseq<nseq; iseq++)
+            while ( prefetch_read(pf, iseq, &rec) ) ...
+        prefetch_destroy(pf);
+
+    The callbacks run on the background thread, they must not share state
+    with the consumer.
+*/
+
+#ifndef __PREFETCH_H__
+#define __PREFETCH_H__
+
+#include <htslib/vcf.h>
+
+typedef struct _prefetch_t prefetch_t;
+
+/*
+ *  prefetch_seq_f - position the reader at the start of the iseq-th sequence,
+ *      returns 0 if the sequence is not present in the file
+ *  prefetch_rec_f - read the next record of the current sequence into rec,
+ *      returns 0 when the sequence is done
+ */
+typedef int (*prefetch_seq_f)(void *data, int iseq);
+typedef int (*prefetch_rec_f)(void *data, bcf1_t *rec);
+
+/*
+ *  prefetch_init() - start the background thread
+ *  @nseq:      number of sequences to read, in the order of their indexes
+ *  @nqueue:    maximum number of records read ahead
+ */
+prefetch_t *prefetch_init(int nseq, int nqueue, prefetch_seq_f seq, prefetch_rec_f rec, void *data);
+
+/*
+ *  prefetch_read() - the next record of the iseq-th sequence, *rec is swapped
+ *      with the prefetched record. Records of sequences preceding iseq which
+ *      were not read are discarded.
+ *
+ *  Returns 1 on success, 0 when the sequence is done.
+ */
+int prefetch_read(prefetch_t *pf, int iseq, bcf1_t **rec);
+
+/*
+ *  prefetch_destroy() - stop the thread and free the queue
+ */
+void prefetch_destroy(prefetch_t *pf);
+
+#endif
@@ -241,11 +241,12 @@ static void mc_cal_y_core(bcf_p1aux_t *ma, int beg)
             for (; _min < _max && z[0][_min] < TINY; ++_min) z[0][_min] = z[1][_min] = 0.;
             for (; _max > _min && z[0][_max] < TINY; --_max) z[0][_max] = z[1][_max] = 0.;
             _max += 2;
-            if (_min == 0) k = 0, z[1][k] = (M0-k+1) * (M0-k+2) * p[0] * z[0][k];
-            if (_min <= 1) k = 1, z[1][k] = (M0-k+1) * (M0-k+2) * p[0] * z[0][k] + k*(M0-k+2) * p[1] * z[0][k-1];
+            // the normalizing sum is accumulated in the same pass, in the order of k
+            sum = 0.;
+            if (_min == 0) k = 0, sum += z[1][k] = (M0-k+1) * (M0-k+2) * p[0] * z[0][k];
+            if (_min <= 1) k = 1, sum += z[1][k] = (M0-k+1) * (M0-k+2) * p[0] * z[0][k] + k*(M0-k+2) * p[1] * z[0][k-1];
             for (k = _min < 2? 2 : _min; k <= _max; ++k)
-                z[1][k] = (M0-k+1)*(M0-k+2) * p[0] * z[0][k] + k*(M0-k+2) * p[1] * z[0][k-1] + k*(k-1)* p[2] * z[0][k-2];
-            for (k = _min, sum = 0.; k <= _max; ++k) sum += z[1][k];
+                sum += z[1][k] = (M0-k+1)*(M0-k+2) * p[0] * z[0][k] + k*(M0-k+2) * p[1] * z[0][k-1] + k*(k-1)* p[2] * z[0][k-2];
             ma->t += log(sum / (M * (M - 1.)));
             for (k = _min; k <= _max; ++k) z[1][k] /= sum;
             if (_min >= 1) z[1][_min-1] = 0.;
@@ -275,10 +276,10 @@ static void mc_cal_y_core(bcf_p1aux_t *ma, int beg)
             if (ma->ploidy[j] == 1) {
                 p[0] = pdg[0]; p[1] = pdg[2];
                 _max++;
-                if (_min == 0) k = 0, z[1][k] = (M0+1-k) * p[0] * z[0][k];
+                sum = 0.;
+                if (_min == 0) k = 0, sum += z[1][k] = (M0+1-k) * p[0] * z[0][k];
                 for (k = _min < 1? 1 : _min; k <= _max; ++k)
-                    z[1][k] = (M0+1-k) * p[0] * z[0][k] + k * p[1] * z[0][k-1];
-                for (k = _min, sum = 0.; k <= _max; ++k) sum += z[1][k];
+                    sum += z[1][k] = (M0+1-k) * p[0] * z[0][k] + k * p[1] * z[0][k-1];
                 ma->t += log(sum / M);
                 for (k = _min; k <= _max; ++k) z[1][k] /= sum;
                 if (_min >= 1) z[1][_min-1] = 0.;
@@ -287,11 +288,12 @@ static void mc_cal_y_core(bcf_p1aux_t *ma, int beg)
             } else if (ma->ploidy[j] == 2) {
                 p[0] = pdg[0]; p[1] = 2 * pdg[1]; p[2] = pdg[2];
                 _max += 2;
-                if (_min == 0) k = 0, z[1][k] = (M0-k+1) * (M0-k+2) * p[0] * z[0][k];
-                if (_min <= 1) k = 1, z[1][k] = (M0-k+1) * (M0-k+2) * p[0] * z[0][k] + k*(M0-k+2) * p[1] * z[0][k-1];
+                // the normalizing sum is accumulated in the same pass, in the order of k
+                sum = 0.;
+                if (_min == 0) k = 0, sum += z[1][k] = (M0-k+1) * (M0-k+2) * p[0] * z[0][k];
+                if (_min <= 1) k = 1, sum += z[1][k] = (M0-k+1) * (M0-k+2) * p[0] * z[0][k] + k*(M0-k+2) * p[1] * z[0][k-1];
                 for (k = _min < 2? 2 : _min; k <= _max; ++k)
-                    z[1][k] = (M0-k+1)*(M0-k+2) * p[0] * z[0][k] + k*(M0-k+2) * p[1] * z[0][k-1] + k*(k-1)* p[2] * z[0][k-2];
-                for (k = _min, sum = 0.; k <= _max; ++k) sum += z[1][k];
+                    sum += z[1][k] = (M0-k+1)*(M0-k+2) * p[0] * z[0][k] + k*(M0-k+2) * p[1] * z[0][k-1] + k*(k-1)* p[2] * z[0][k-2];
                 ma->t += log(sum / (M * (M - 1.)));
                 for (k = _min; k <= _max; ++k) z[1][k] /= sum;
                 if (_min >= 1) z[1][_min-1] = 0.;
@@ -0,0 +1,113 @@
+/* The MIT License
+
+   Copyright (c) 2017 Genome Research Ltd.
+
+   Author: Petr Danecek <pd3@sanger.ac.uk>
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <time.h>
+#include "profile.h"
+
+int profile_enabled = 0;
+
+typedef struct
+{
+    uint64_t ncalls, time, nbytes;
+}
+stage_t;
+
+typedef struct
+{
+    uint64_t n, sum, max;
+}
+queue_t;
+
+static const char *stage_names[PROF_NSTAGES] =
+{
+    "read", "unpack", "filter", "format", "annotate", "norm", "merge", "csq", "call", "pileup", "write"
+};
+static const char *queue_names[PROF_NQUEUES] =
+{
+    "record-batches", "shards", "stream-annots"
+};
+
+// Updated concurrently by the worker threads, hence the atomic operations
+static stage_t stages[PROF_NSTAGES];
+static queue_t queues[PROF_NQUEUES];
+static uint64_t start_time;
+
+uint64_t profile_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+void profile_add(profile_stage_t stage, uint64_t t0, uint64_t nbytes)
+{
+    uint64_t dt = profile_now() - t0;
+    __sync_fetch_and_add(&stages[stage].ncalls, 1);
+    __sync_fetch_and_add(&stages[stage].time, dt);
+    if ( nbytes ) __sync_fetch_and_add(&stages[stage].nbytes, nbytes);
+}
+
+void profile_queue_add(profile_queue_t queue, int depth)
+{
+    queue_t *q = &queues[queue];
+    __sync_fetch_and_add(&q->n, 1);
+    __sync_fetch_and_add(&q->sum, depth);
+    uint64_t max = q->max;
+    while ( depth > max && !__sync_bool_compare_and_swap(&q->max, max, depth) ) max = q->max;
+}
+
+static void profile_report(void)
+{
+    double wall = (profile_now() - start_time)*1e-9;
+    int i;
+    fprintf(stderr, "# bcftools --profile: wall time %.3f sec\n", wall);
+    fprintf(stderr, "# [1]stage\t[2]calls\t[3]time (sec)\t[4]time (%% of wall)\t[5]bytes\t[6]MB/sec\n");
+    for (i=0; i<PROF_NSTAGES; i++)
+    {
+        if ( !stages[i].ncalls ) continue;
+        double sec = stages[i].time*1e-9;
+        fprintf(stderr, "%s\t%"PRIu64"\t%.3f\t%.1f\t%"PRIu64"\t", stage_names[i], stages[i].ncalls, sec, wall>0 ? 100*sec/wall : 0, stages[i].nbytes);
+        if ( stages[i].nbytes && sec>0 ) fprintf(stderr, "%.1f\n", stages[i].nbytes*1e-6/sec);
+        else fprintf(stderr, "-\n");
+    }
+    int has_queues = 0;
+    for (i=0; i<PROF_NQUEUES; i++)
+    {
+        if ( !queues[i].n ) continue;
+        if ( !has_queues++ ) fprintf(stderr, "# [1]queue\t[2]samples\t[3]mean depth\t[4]max depth\n");
+        fprintf(stderr, "%s\t%"PRIu64"\t%.2f\t%"PRIu64"\n", queue_names[i], queues[i].n, (double)queues[i].sum/queues[i].n, queues[i].max);
+    }
+}
+
+void profile_init(void)
+{
+    profile_enabled = 1;
+    start_time = profile_now();
+    atexit(profile_report);
+}
@@ -0,0 +1,137 @@
+/* The MIT License
+
+   Copyright (c) 2017 Genome Research Ltd.
+
+   Author: Petr Danecek <pd3@sanger.ac.uk>
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+
+ */
+
+/*
+    Stage timing and counters enabled by `bcftools --profile <command>`. The
+    time, number of calls and bytes of each stage are accumulated over all
+    threads and a summary table is printed to stderr at exit. When profiling
+    is not enabled, each instrumented call costs a single branch.
+
+        uint64_t t0 = profile_begin();
+        ...
+        profile_end(PROF_FILTER, t0);
+*/
+
+#ifndef __PROFILE_H__
+#define __PROFILE_H__
+
+#include <stdint.h>
+#include <htslib/vcf.h>
+#include <htslib/synced_bcf_reader.h>
+
+typedef enum
+{
+    PROF_READ,      // reading, decompression and parsing of the input records
+    PROF_UNPACK,    // bcf_unpack() outside of the other stages
+    PROF_FILTER,    // filter_test()
+    PROF_FORMAT,    // convert_line()
+    PROF_ANNOT,     // annotate: lookups and transfer of the annotations
+    PROF_NORM,      // norm: realignment, splitting and joining of records
+    PROF_MERGE,     // merge: merging of the records at one position
+    PROF_CSQ,       // csq: consequence calling, the WRITE stage is nested in it
+    PROF_CALL,      // call, mpileup: genotype likelihoods and calling
+    PROF_PILEUP,    // mpileup: reading of the alignments and the pileup
+    PROF_WRITE,     // writing of the output records
+    PROF_NSTAGES
+}
+profile_stage_t;
+
+typedef enum
+{
+    PROFQ_BATCHES,  // record batches read but not yet written, --record-threads
+    PROFQ_SHARDS,   // shards started but not yet written, --shard-threads
+    PROFQ_ANNOTS,   // parsed batches of annotation lines waiting, annotate --stream-annots
+    PROF_NQUEUES
+}
+profile_queue_t;
+
+extern int profile_enabled;
+
+/*
+ *  profile_init() - enable profiling, called from main() with --profile. The
+ *      summary is printed at exit.
+ */
+void profile_init(void);
+
+uint64_t profile_now(void);     // monotonic time in nanoseconds
+void profile_add(profile_stage_t stage, uint64_t t0, uint64_t nbytes);
+void profile_queue_add(profile_queue_t queue, int depth);
+
+/*
+ *  profile_begin() - start timing a stage, returns 0 when profiling is disabled
+ *  profile_end() - add the time since t0 and one call to the stage
+ *  profile_end_bytes() - the same, also counting nbytes processed
+ */
+static inline uint64_t profile_begin(void)
+{
+    return profile_enabled ? profile_now() : 0;
+}
+static inline void profile_end(profile_stage_t stage, uint64_t t0)
+{
+    if ( t0 ) profile_add(stage, t0, 0);
+}
+static inline void profile_end_bytes(profile_stage_t stage, uint64_t t0, uint64_t nbytes)
+{
+    if ( t0 ) profile_add(stage, t0, nbytes);
+}
+
+/*
+ *  profile_queue() - record the current depth of a queue, the mean and maximum
+ *      are reported
+ */
+static inline void profile_queue(profile_queue_t queue, int depth)
+{
+    if ( profile_enabled ) profile_queue_add(queue, depth);
+}
+
+/*
+ *  profile_rec_size() - the size of the packed record, as counted by the READ
+ *      and WRITE stages
+ */
+static inline uint64_t profile_rec_size(const bcf1_t *rec)
+{
+    return rec->shared.l + rec->indiv.l;
+}
+
+/*
+ *  profile_sr_next_line() - bcf_sr_next_line() timed as the READ stage
+ */
+static inline int profile_sr_next_line(bcf_srs_t *files)
+{
+    uint64_t t0 = profile_begin();
+    int ret = bcf_sr_next_line(files);
+    if ( t0 )
+    {
+        uint64_t nbytes = 0;
+        int i;
+        for (i=0; i<files->nreaders; i++)
+            if ( bcf_sr_has_line(files,i) ) nbytes += profile_rec_size(bcf_sr_get_line(files,i));
+        profile_add(PROF_READ, t0, nbytes);
+    }
+    return ret;
+}
+
+#endif
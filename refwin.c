@@ -0,0 +1,109 @@
+/* The MIT License
+
+   Copyright (c) 2017 Genome Research Ltd.
+
+   Author: Petr Danecek <pd3@sanger.ac.uk>
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <htslib/faidx.h>
+#include "bcftools.h"
+#include "refwin.h"
+
+struct _refwin_t
+{
+    faidx_t *fai;
+    int before, after;
+    char *chr;          // the current sequence and its length
+    int len;
+    char *seq;          // the window beg..end, m bytes allocated
+    int beg, end, m;
+};
+
+refwin_t *refwin_init(faidx_t *fai, int before, int after)
+{
+    refwin_t *rw = (refwin_t*) calloc(1, sizeof(refwin_t));
+    rw->fai    = fai;
+    rw->before = before;
+    rw->after  = after;
+    rw->end    = -1;
+    return rw;
+}
+
+void refwin_destroy(refwin_t *rw)
+{
+    if ( !rw ) return;
+    free(rw->chr);
+    free(rw->seq);
+    free(rw);
+}
+
+// Read beg..end and append it to the first nkeep bases of the window
+static void refwin_read(refwin_t *rw, int nkeep, int beg, int end)
+{
+    int nseq;
+    char *seq = faidx_fetch_seq(rw->fai, rw->chr, beg, end, &nseq);
+    if ( !seq || nseq != end - beg + 1 ) error("faidx_fetch_seq failed at %s:%d\n", rw->chr,beg+1);
+    hts_expand(char, nkeep + nseq, rw->m, rw->seq);
+    memcpy(rw->seq + nkeep, seq, nseq);
+    free(seq);
+}
+
+const char *refwin_fetch(refwin_t *rw, const char *chr, int beg, int end, int *len)
+{
+    if ( !rw->chr || strcmp(rw->chr,chr) )
+    {
+        int seq_len = faidx_has_seq(rw->fai, chr) ? faidx_seq_len(rw->fai, chr) : -1;
+        if ( seq_len<=0 ) return NULL;
+        free(rw->chr);
+        rw->chr = strdup(chr);
+        rw->len = seq_len;
+        rw->beg = 0;
+        rw->end = -1;
+    }
+    if ( end < beg ) beg = end;
+    if ( beg < 0 ) beg = 0;
+    else if ( beg >= rw->len ) beg = rw->len - 1;
+    if ( end < 0 ) end = 0;
+    else if ( end >= rw->len ) end = rw->len - 1;
+
+    if ( beg < rw->beg || end > rw->end )
+    {
+        int wbeg = beg > rw->before ? beg - rw->before : 0;
+        int wend = end + rw->after < rw->len ? end + rw->after : rw->len - 1;
+        if ( wbeg >= rw->beg && wbeg <= rw->end )
+        {
+            // moving forward: keep the overlap, read only the new sequence ahead
+            int nkeep = rw->end - wbeg + 1;
+            memmove(rw->seq, rw->seq + wbeg - rw->beg, nkeep);
+            refwin_read(rw, nkeep, rw->end + 1, wend);
+        }
+        else
+            refwin_read(rw, 0, wbeg, wend);
+        rw->beg = wbeg;
+        rw->end = wend;
+    }
+
+    *len = end - beg + 1;
+    return rw->seq + beg - rw->beg;
+}
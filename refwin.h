@@ -0,0 +1,62 @@
+/* The MIT License
+
+   Copyright (c) 2017 Genome Research Ltd.
+
+   Author: Petr Danecek <pd3@sanger.ac.uk>
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+
+ */
+
+/*
+    Sequential access to the reference. The sequence is read from the faidx
+    in large windows which advance with the stream of requested positions:
+    the part of the current window still needed is kept, only the sequence
+    ahead of it is read, and the same buffer is reused throughout. Random
+    access works too, each jump away from the window costs one read.
+
+        refwin_t *rw = refwin_init(fai, 1000, 100000);
+        const char *ref = refwin_fetch(rw, chr, beg, end, &len);
+        refwin_destroy(rw);
+*/
+
+#ifndef __REFWIN_H__
+#define __REFWIN_H__
+
+#include <htslib/faidx.h>
+
+typedef struct _refwin_t refwin_t;
+
+/*
+ *  refwin_init() - create the reader, the faidx is owned by the caller
+ *  @before:    the number of bases to keep before the requested position
+ *  @after:     the number of bases to read ahead on a window miss
+ */
+refwin_t *refwin_init(faidx_t *fai, int before, int after);
+void refwin_destroy(refwin_t *rw);
+
+/*
+ *  refwin_fetch() - the sequence chr:beg-end, 0-based and inclusive, clipped
+ *      to the sequence ends the same way as faidx_fetch_seq(). The returned
+ *      pointer is into the window, it is not NUL-terminated and is valid until
+ *      the next call. Returns NULL if the sequence is not in the fasta.
+ */
+const char *refwin_fetch(refwin_t *rw, const char *chr, int beg, int end, int *len);
+
+#endif
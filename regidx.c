@@ -31,8 +31,6 @@
 
 #define MAX_COOR_0 REGIDX_MAX   // CSI and hts_itr_query limit, 0-based
 
-#define iBIN(x) ((x)>>13)
-
 typedef struct
 {
     uint32_t beg, end;
@@ -53,13 +51,18 @@ typedef struct
     regidx_t *ridx;
     reglist_t *list;
     int active;
+
+    // Cursor for repeated queries: the sequence (1-based, 0 if unset) and the
+    // result of the last search, see regidx_overlap()
+    int cur_seq;
+    uint32_t cur_beg, cur_ireg, cur_nreg;
 }
 _itr_t;
 
 // List of regions for one chromosome.
 struct _reglist_t
 {
-    uint32_t *idx, nidx;    // index to list.reg+1
+    uint32_t *max_end;      // max_end[i] is the maximum end of reg[0..i], non-decreasing
     uint32_t nreg, mreg;    // n:used, m:allocated
     reg_t *reg;             // regions
     void *dat;              // payload data
@@ -163,6 +166,12 @@ inline int regidx_push(regidx_t *idx, char *chr_beg, char *chr_end, uint32_t beg
 
     reglist_t *list = &idx->seq[rid];
     list->seq = idx->seq_names[rid];
+    if ( list->max_end )
+    {
+        // the index is rebuilt on the next query
+        free(list->max_end);
+        list->max_end = NULL;
+    }
     list->nreg++;
     int mreg = list->mreg;
     hts_expand(reg_t,list->nreg,list->mreg,list->reg);
@@ -252,7 +261,7 @@ void regidx_destroy(regidx_t *idx)
         }
         free(list->dat);
         free(list->reg);
-        free(list->idx);
+        free(list->max_end);
     }
     free(idx->seq_names);
     free(idx->seq);
@@ -300,30 +309,16 @@ int _reglist_build_index(regidx_t *regidx, reglist_t *list)
         list->unsorted = 0;
     }
 
-    list->nidx = 0;
-    int j,k, midx = 0;
-    for (j=0; j<list->nreg; j++)
+    // With regions sorted by start, the running maximum of the ends is
+    // non-decreasing and the first region overlapping a query can be found by
+    // a binary search over a single contiguous array, regardless of how dense
+    // or nested the regions are
+    uint32_t max_end = 0;
+    list->max_end = (uint32_t*) malloc(sizeof(uint32_t)*list->nreg);
+    for (i=0; i<list->nreg; i++)
     {
-        int ibeg = iBIN(list->reg[j].beg);
-        int iend = iBIN(list->reg[j].end);
-        if ( midx <= iend )
-        {
-            int old_midx = midx; 
-            midx = iend + 1;
-            kroundup32(midx);
-            list->idx = (uint32_t*) realloc(list->idx, midx*sizeof(uint32_t));
-            memset(list->idx+old_midx, 0, sizeof(uint32_t)*(midx-old_midx));
-        }
-        if ( ibeg==iend )
-        {
-            if ( !list->idx[ibeg] ) list->idx[ibeg] = j + 1;
-        }
-        else
-        {
-            for (k=ibeg; k<=iend; k++)
-                if ( !list->idx[k] ) list->idx[k] = j + 1;
-        }
-        if ( list->nidx < iend+1 ) list->nidx = iend+1;
+        if ( max_end < list->reg[i].end ) max_end = list->reg[i].end;
+        list->max_end[i] = max_end;
     }
 
     return 0;
@@ -334,7 +329,13 @@ int regidx_overlap(regidx_t *regidx, const char *chr, uint32_t beg, uint32_t end
     if ( regitr ) regitr->seq = NULL;
 
     int iseq, ireg;
-    if ( khash_str2int_get(regidx->seq2regs, chr, &iseq)!=0 ) return 0;    // no such sequence
+    _itr_t *itr = regitr ? (_itr_t*)regitr->itr : NULL;
+    if ( itr && itr->ridx!=regidx ) itr->cur_seq = 0;
+
+    // Repeated queries on the same sequence do not need to hash the name
+    if ( itr && itr->cur_seq && itr->cur_seq <= regidx->nseq && !strcmp(chr,regidx->seq[itr->cur_seq-1].seq) )
+        iseq = itr->cur_seq - 1;
+    else if ( khash_str2int_get(regidx->seq2regs, chr, &iseq)!=0 ) return 0;    // no such sequence
 
     reglist_t *list = &regidx->seq[iseq];
     if ( !list->nreg ) return 0;
@@ -347,37 +348,46 @@ int regidx_overlap(regidx_t *regidx, const char *chr, uint32_t beg, uint32_t end
     }
     else
     {
-        if ( !list->idx )
+        if ( !list->max_end )
             _reglist_build_index(regidx,list);
 
-        int ibeg = iBIN(beg);
-        if ( ibeg >= list->nidx ) return 0;     // beg is too big
-
-        // find a matching region
-        uint32_t i = list->idx[ibeg];
-        if ( !i )
+        // Find the first region with max_end >= beg, this is the first region
+        // that ends at or after beg. With queries coming in sorted order, the
+        // search gallops forward from the result of the previous query.
+        uint32_t lo = 0, hi = list->nreg;
+        if ( itr && itr->cur_seq==iseq+1 && itr->cur_nreg==list->nreg && beg >= itr->cur_beg )
         {
-            int iend = iBIN(end);
-            if ( iend > list->nidx ) iend = list->nidx;
-            for (i=ibeg; i<iend; i++)
-                if ( list->idx[i] ) break;
-            if ( i==iend ) return 0;
-            i = list->idx[i];
+            uint32_t i = lo = itr->cur_ireg, step = 1;
+            while ( i < list->nreg && list->max_end[i] < beg )
+            {
+                lo = i + 1;
+                i += step;
+                step <<= 1;
+            }
+            if ( i < list->nreg ) hi = i + 1;
         }
-
-        for (ireg=i-1; ireg<list->nreg; ireg++)
+        while ( lo < hi )
         {
-            if ( list->reg[ireg].beg > end ) return 0;   // no match, past the query region
-            if ( list->reg[ireg].end >= beg && list->reg[ireg].beg <= end ) break; // found
+            uint32_t mid = lo + (hi - lo)/2;
+            if ( list->max_end[mid] < beg ) lo = mid + 1;
+            else hi = mid;
         }
-
-        if ( ireg >= list->nreg ) return 0;   // no match
+        if ( itr )
+        {
+            itr->ridx     = regidx;
+            itr->cur_seq  = iseq + 1;
+            itr->cur_beg  = beg;
+            itr->cur_ireg = lo;
+            itr->cur_nreg = list->nreg;
+        }
+        if ( lo >= list->nreg ) return 0;             // beg is too big
+        if ( list->reg[lo].beg > end ) return 0;      // no match, the following regions start even later
+        ireg = lo;
     }
 
     if ( !regitr ) return 1;    // match, but no more info to save
 
     // may need to iterate over the matching regions later
-    _itr_t *itr = (_itr_t*)regitr->itr;
     itr->ridx = regidx;
     itr->list = list;
     itr->beg  = beg;
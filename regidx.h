@@ -134,6 +134,11 @@ void regidx_destroy(regidx_t *idx);
  *
  *  Returns 0 if there is no overlap or 1 if overlap is found. The overlapping
  *  regions can be iterated as shown in the example above.
+ *
+ *  The iterator keeps a cursor: when the same iterator is reused for queries
+ *  on the same sequence with non-decreasing beg, as with records of a sorted
+ *  VCF, the search continues from the previous position rather than from
+ *  scratch and the sequence name is not looked up again.
  */
 int regidx_overlap(regidx_t *idx, const char *chr, uint32_t beg, uint32_t end, regitr_t *itr);
 
@@ -366,6 +366,68 @@ static bcf_hdr_t *strip_header(bcf_hdr_t *src, bcf_hdr_t *dst)
     return out;
 }
 
+/*
+ *  Returns 1 if records encoded with the dictionaries of src decode to the
+ *  same CHROM, FILTER, INFO and FORMAT names with dst, 0 otherwise
+ */
+static int bcf_ids_preserved(bcf_hdr_t *src, bcf_hdr_t *dst)
+{
+    if ( bcf_hdr_nsamples(src)!=bcf_hdr_nsamples(dst) ) return 0;
+
+    int i;
+    for (i=0; i<src->n[BCF_DT_CTG]; i++)
+    {
+        if ( !src->id[BCF_DT_CTG][i].key ) continue;
+        if ( i>=dst->n[BCF_DT_CTG] || !dst->id[BCF_DT_CTG][i].key ) return 0;
+        if ( strcmp(src->id[BCF_DT_CTG][i].key,dst->id[BCF_DT_CTG][i].key) ) return 0;
+    }
+    for (i=0; i<src->n[BCF_DT_ID]; i++)
+    {
+        if ( !src->id[BCF_DT_ID][i].key ) continue;
+        if ( i>=dst->n[BCF_DT_ID] || !dst->id[BCF_DT_ID][i].key ) return 0;
+        if ( strcmp(src->id[BCF_DT_ID][i].key,dst->id[BCF_DT_ID][i].key) ) return 0;
+        if ( bcf_hdr_idinfo_exists(src,BCF_HL_FLT,i) && !bcf_hdr_idinfo_exists(dst,BCF_HL_FLT,i) ) return 0;
+        if ( bcf_hdr_idinfo_exists(src,BCF_HL_INFO,i) && !bcf_hdr_idinfo_exists(dst,BCF_HL_INFO,i) ) return 0;
+        if ( bcf_hdr_idinfo_exists(src,BCF_HL_FMT,i) && !bcf_hdr_idinfo_exists(dst,BCF_HL_FMT,i) ) return 0;
+    }
+    return 1;
+}
+
+/*
+ *  The records do not need to be touched when the dictionary IDs are kept:
+ *  write the new header, recompress what is left of the block with the end
+ *  of the old header and copy the remaining BGZF blocks as they are.
+ */
+static void reheader_bcf_raw(args_t *args, bcf_hdr_t *hdr_out, int is_compressed)
+{
+    BGZF *fp = hts_get_bgzfp(args->fp);
+    htsFile *fp_out = hts_open(args->output_fname ? args->output_fname : "-",is_compressed ? "wb" : "wbu");
+    if ( !fp_out ) error("%s: %s\n", args->output_fname ? args->output_fname : "-", strerror(errno));
+    bcf_hdr_write(fp_out, hdr_out);
+
+    BGZF *bgzf_out = hts_get_bgzfp(fp_out);
+    if ( fp->block_length - fp->block_offset > 0 )
+    {
+        if ( bgzf_write(bgzf_out, (char*)fp->uncompressed_block + fp->block_offset, fp->block_length - fp->block_offset)<0 ) error("Error: %d\n",bgzf_out->errcode);
+    }
+    if ( bgzf_flush(bgzf_out)<0 ) error("Error: %d\n",bgzf_out->errcode);
+
+    ssize_t nread;
+    const size_t page_size = 32768;
+    char *buf = (char*) malloc(page_size);
+    while (1)
+    {
+        nread = bgzf_raw_read(fp, buf, page_size);
+        if ( nread<=0 ) break;
+
+        int count = bgzf_raw_write(bgzf_out, buf, nread);
+        if (count != nread) error("Write failed, wrote %d instead of %d bytes.\n", count,(int)nread);
+    }
+    if ( nread<0 ) error("Error reading %s\n", args->fname);
+    free(buf);
+    if ( hts_close(fp_out) ) error("Error closing %s\n",args->output_fname ? args->output_fname : "-");
+}
+
 static void reheader_bcf(args_t *args, int is_compressed)
 {
     htsFile *fp = args->fp;
@@ -393,6 +455,17 @@ static void reheader_bcf(args_t *args, int is_compressed)
     if ( bcf_hdr_parse(hdr_out, htxt.s) < 0 ) error("An error occurred while parsing the header\n");
     if ( args->header_fname ) hdr_out = strip_header(hdr, hdr_out);
 
+    // fast path: IDs unchanged, the BGZF blocks can be copied without decoding and recompressing
+    if ( args->type.compression!=gzip && hts_get_bgzfp(fp) && bcf_ids_preserved(hdr, hdr_out) )
+    {
+        reheader_bcf_raw(args, hdr_out, is_compressed);
+        free(htxt.s);
+        hts_close(fp);
+        bcf_hdr_destroy(hdr_out);
+        bcf_hdr_destroy(hdr);
+        return;
+    }
+
     // write the header and the body
     htsFile *fp_out = hts_open(args->output_fname ? args->output_fname : "-",is_compressed ? "wb" : "wbu");
     if ( !fp_out ) error("%s: %s\n", args->output_fname ? args->output_fname : "-", strerror(errno));
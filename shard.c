@@ -0,0 +1,234 @@
+/* The MIT License
+
+   Copyright (c) 2017 Genome Research Ltd.
+
+   Author: Petr Danecek <pd3@sanger.ac.uk>
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <htslib/vcf.h>
+#include <htslib/tbx.h>
+#include <htslib/kstring.h>
+#include <htslib/khash_str2int.h>
+#include "bcftools.h"
+#include "profile.h"
+#include "shard.h"
+
+struct _shards_t
+{
+    char *cmd;
+    shard_t *shard;
+    int nshard, mshard, ishard;     // ishard: the next shard waiting for a worker
+    void *seqs;                     // shards_add_seqs(): the sequences added so far
+    bcf_hdr_t *hdr;
+    shard_init_f init;
+    shard_run_f run;
+    shard_destroy_f destroy;
+    void *data;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+shards_t *shards_init(const char *cmd)
+{
+    shards_t *shards = (shards_t*) calloc(1, sizeof(shards_t));
+    shards->cmd = strdup(cmd);
+    pthread_mutex_init(&shards->lock, NULL);
+    pthread_cond_init(&shards->cond, NULL);
+    return shards;
+}
+
+void shards_destroy(shards_t *shards)
+{
+    int i;
+    for (i=0; i<shards->nshard; i++)
+    {
+        if ( shards->shard[i].fname )
+        {
+            unlink(shards->shard[i].fname);
+            free(shards->shard[i].fname);
+        }
+        free(shards->shard[i].seq);
+    }
+    free(shards->shard);
+    if ( shards->seqs ) khash_str2int_destroy(shards->seqs);
+    free(shards->cmd);
+    pthread_mutex_destroy(&shards->lock);
+    pthread_cond_destroy(&shards->cond);
+    free(shards);
+}
+
+int shards_nshards(shards_t *shards)
+{
+    return shards->nshard;
+}
+
+void shards_add(shards_t *shards, const char *seq, uint32_t beg, uint32_t end, uint32_t max_len)
+{
+    while ( beg <= end )
+    {
+        shards->nshard++;
+        hts_expand0(shard_t, shards->nshard, shards->mshard, shards->shard);
+        shard_t *shard = &shards->shard[shards->nshard-1];
+        shard->seq = strdup(seq);
+        shard->beg = beg;
+        shard->end = max_len && end - beg >= max_len ? beg + max_len - 1 : end;
+        if ( shard->end == end ) break;
+        beg = shard->end + 1;
+    }
+}
+
+void shards_add_seqs(shards_t *shards, bcf_sr_t *reader, regidx_t *regs)
+{
+    int i, nseq = 0;
+    const char **names = NULL;
+    if ( reader->tbx_idx ) names = tbx_seqnames(reader->tbx_idx, &nseq);
+    else if ( reader->bcf_idx ) names = bcf_index_seqnames(reader->bcf_idx, reader->header, &nseq);
+    else error("No index found for %s, --shard-threads requires indexed files\n", reader->fname);
+
+    if ( !shards->seqs ) shards->seqs = khash_str2int_init();
+    for (i=0; i<nseq; i++)
+    {
+        if ( khash_str2int_has_key(shards->seqs, names[i]) ) continue;
+        if ( regs && !regidx_seq_nregs(regs, names[i]) ) continue;
+        shards_add(shards, names[i], 0, REGIDX_MAX, 0);
+        khash_str2int_inc(shards->seqs, shards->shard[shards->nshard-1].seq);
+    }
+    free(names);
+}
+
+void shard_set_regions(bcf_srs_t *files, const shard_t *shard, regidx_t *regs)
+{
+    kstring_t str = {0,0,0};
+    if ( regs )
+    {
+        regitr_t *itr = regitr_init(regs);
+        if ( regidx_overlap(regs, shard->seq, shard->beg, shard->end, itr) )
+        {
+            while ( regitr_overlap(itr) )
+            {
+                uint32_t beg = itr->beg > shard->beg ? itr->beg : shard->beg;
+                uint32_t end = itr->end < shard->end ? itr->end : shard->end;
+                if ( str.l ) kputc(',', &str);
+                ksprintf(&str, "%s:%u-%u", shard->seq, beg+1, end+1);
+            }
+        }
+        regitr_destroy(itr);
+    }
+    else if ( shard->beg==0 && shard->end==REGIDX_MAX )
+        kputs(shard->seq, &str);
+    else
+        ksprintf(&str, "%s:%u-%u", shard->seq, shard->beg+1, shard->end+1);
+    if ( bcf_sr_set_regions(files, str.s, 0)<0 ) error("Failed to set the region: %s\n", str.s);
+    free(str.s);
+}
+
+static htsFile *shard_open(shards_t *shards, shard_t *shard)
+{
+    const char *tmpdir = getenv("TMPDIR");
+    if ( !tmpdir ) tmpdir = "/tmp";
+    kstring_t str = {0,0,0};
+    ksprintf(&str, "%s/bcftools-%s.XXXXXX", tmpdir, shards->cmd);
+    int fd = mkstemp(str.s);
+    if ( fd<0 ) error("Could not create a temporary file in %s: %s\n", tmpdir, strerror(errno));
+    close(fd);
+    shard->fname = str.s;
+
+    htsFile *fh = hts_open(shard->fname, "wbu");
+    if ( !fh ) error("Can't write to \"%s\": %s\n", shard->fname, strerror(errno));
+
+    // the header is shared by all workers
+    pthread_mutex_lock(&shards->lock);
+    if ( bcf_hdr_write(fh, shards->hdr)!=0 ) error("Failed to write to %s\n", shard->fname);
+    pthread_mutex_unlock(&shards->lock);
+    return fh;
+}
+
+static void *shard_worker(void *data)
+{
+    shards_t *shards = (shards_t*) data;
+    void *worker = shards->init ? shards->init(shards->data) : shards->data;
+    while (1)
+    {
+        pthread_mutex_lock(&shards->lock);
+        int i = shards->ishard++;
+        pthread_mutex_unlock(&shards->lock);
+        if ( i >= shards->nshard ) break;
+
+        shard_t *shard = &shards->shard[i];
+        htsFile *fh = shard_open(shards, shard);
+        shards->run(worker, shard, fh);
+        if ( hts_close(fh)!=0 ) error("Close failed: %s\n", shard->fname);
+
+        pthread_mutex_lock(&shards->lock);
+        shard->done = 1;
+        pthread_cond_broadcast(&shards->cond);
+        pthread_mutex_unlock(&shards->lock);
+    }
+    if ( shards->destroy ) shards->destroy(worker);
+    return NULL;
+}
+
+void shards_run(shards_t *shards, int nthreads, bcf_hdr_t *hdr, shard_init_f init, shard_run_f run,
+        shard_destroy_f destroy, shard_write_f write, void *data)
+{
+    shards->hdr     = hdr;
+    shards->init    = init;
+    shards->run     = run;
+    shards->destroy = destroy;
+    shards->data    = data;
+
+    int i, nthr = nthreads < shards->nshard ? nthreads : shards->nshard;
+    pthread_t *thr = (pthread_t*) malloc(sizeof(pthread_t)*(nthr ? nthr : 1));
+    for (i=0; i<nthr; i++)
+        if ( pthread_create(&thr[i], NULL, shard_worker, shards)!=0 ) error("Failed to create threads\n");
+
+    bcf1_t *rec = bcf_init1();
+    for (i=0; i<shards->nshard; i++)
+    {
+        shard_t *shard = &shards->shard[i];
+        pthread_mutex_lock(&shards->lock);
+        profile_queue(PROFQ_SHARDS, (shards->ishard < shards->nshard ? shards->ishard : shards->nshard) - i);
+        while ( !shard->done ) pthread_cond_wait(&shards->cond, &shards->lock);
+        pthread_mutex_unlock(&shards->lock);
+
+        htsFile *fh = hts_open(shard->fname, "r");
+        if ( !fh ) error("Could not read %s\n", shard->fname);
+        bcf_hdr_t *tmp_hdr = bcf_hdr_read(fh);
+        if ( !tmp_hdr ) error("Could not parse the header of %s\n", shard->fname);
+        while ( bcf_read1(fh, tmp_hdr, rec)==0 ) write(data, rec);
+        bcf_hdr_destroy(tmp_hdr);
+        hts_close(fh);
+        unlink(shard->fname);
+        free(shard->fname);
+        shard->fname = NULL;
+    }
+    bcf_destroy1(rec);
+
+    for (i=0; i<nthr; i++) pthread_join(thr[i], NULL);
+    free(thr);
+}
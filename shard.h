@@ -0,0 +1,107 @@
+/* The MIT License
+
+   Copyright (c) 2017 Genome Research Ltd.
+
+   Author: Petr Danecek <pd3@sanger.ac.uk>
+
+   Permission is hereby granted, free of charge, to any person obtaining a copy
+   of this software and associated documentation files (the "Software"), to deal
+   in the Software without restriction, including without limitation the rights
+   to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+   copies of the Software, and to permit persons to whom the Software is
+   furnished to do so, subject to the following conditions:
+
+   The above copyright notice and this permission notice shall be included in
+   all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+   IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+   FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+   AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+   LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+   OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+   THE SOFTWARE.
+
+ */
+
+/*
+    The --shard-threads modes: the genome is cut into shards, whole sequences
+    or intervals, which are processed independently on worker threads. Each
+    shard is written to a temporary uncompressed BCF and the main thread
+    streams the shards to the output in their original order as soon as they
+    become available. The commands supply only the worker for one shard.
+
+        shards_t *shards = shards_init("norm");
+        shards_add_seqs(shards, reader, regs);
+        shards_run(shards, nthreads, hdr, NULL, norm_shard, NULL, write_rec, args);
+        shards_destroy(shards);
+*/
+
+#ifndef __SHARD_H__
+#define __SHARD_H__
+
+#include <stdint.h>
+#include <htslib/vcf.h>
+#include <htslib/synced_bcf_reader.h>
+#include "regidx.h"
+
+typedef struct
+{
+    char *seq;          // sequence name
+    uint32_t beg, end;  // 0-based, inclusive; 0,REGIDX_MAX for the whole sequence
+    char *fname;        // the temporary BCF, NULL until the shard is started
+    int done;
+}
+shard_t;
+
+typedef struct _shards_t shards_t;
+
+/*
+ *  shard_init_f    - create the state of a worker thread, called on the thread
+ *  shard_run_f     - process the shard, writing the records to @fh whose
+ *                    header has been written already
+ *  shard_destroy_f - free the state of the worker, called on the thread
+ *  shard_write_f   - called on the main thread with the records of the shards
+ *                    in the original order
+ *
+ *  Without shard_init_f, the workers are passed @data of shards_run().
+ */
+typedef void *(*shard_init_f)(void *data);
+typedef void (*shard_run_f)(void *worker, shard_t *shard, htsFile *fh);
+typedef void (*shard_destroy_f)(void *worker);
+typedef void (*shard_write_f)(void *data, bcf1_t *rec);
+
+/*
+ *  shards_init() - the temporary files are created in $TMPDIR or /tmp, named
+ *      bcftools-<cmd>.XXXXXX
+ */
+shards_t *shards_init(const char *cmd);
+void shards_destroy(shards_t *shards);
+
+/*
+ *  shards_add() - add the interval beg,end of the sequence (0-based,
+ *      inclusive) cut into shards of at most max_len bases, or as one shard
+ *      if max_len is 0
+ *  shards_add_seqs() - add the sequences present in the index of the reader
+ *      as whole-sequence shards, in the order of the index, skipping those
+ *      already added. With @regs, only sequences with a region are added.
+ */
+void shards_add(shards_t *shards, const char *seq, uint32_t beg, uint32_t end, uint32_t max_len);
+void shards_add_seqs(shards_t *shards, bcf_sr_t *reader, regidx_t *regs);
+int shards_nshards(shards_t *shards);
+
+/*
+ *  shard_set_regions() - restrict the synced reader to the shard, intersected
+ *      with @regs if given
+ */
+void shard_set_regions(bcf_srs_t *files, const shard_t *shard, regidx_t *regs);
+
+/*
+ *  shards_run() - process all shards on at most nthreads threads and pass
+ *      their records to @write in order
+ *  @hdr:   the header written to the temporary files
+ */
+void shards_run(shards_t *shards, int nthreads, bcf_hdr_t *hdr, shard_init_f init, shard_run_f run,
+        shard_destroy_f destroy, shard_write_f write, void *data);
+
+#endif
@@ -0,0 +1,394 @@
+/*  test/bench-ds.c -- Microbenchmarks of the shared data structures.
+
+    Copyright (C) 2017 Genome Research Ltd.
+
+    Author: Petr Danecek <pd3@sanger.ac.uk>
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+    THE SOFTWARE.
+*/
+
+/*
+    Throughput of regidx, rbuf, vcfbuf and kheap on synthetic data, to compare
+    alternative implementations. Each benchmark prints one tab-delimited line
+    with the number of operations, the time and a result which depends only on
+    the input data and the seed, e.g. the number of overlaps found, and must
+    not change when the data structure is reimplemented.
+*/
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <time.h>
+#include <htslib/kstring.h>
+#include <htslib/vcf.h>
+#include "regidx.h"
+#include "rbuf.h"
+#include "vcfbuf.h"
+#include "kheap.h"
+
+#define SEQ_LEN 250000000
+
+void error(const char *format, ...)
+{
+    va_list ap;
+    va_start(ap, format);
+    vfprintf(stderr, format, ap);
+    va_end(ap);
+    exit(-1);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+static void report(const char *name, uint64_t nops, double t0, uint64_t result)
+{
+    double sec = now() - t0;
+    printf("%s\t%"PRIu64"\t%.4f\t%.3f\t%"PRIu64"\n", name, nops, sec, sec>0 ? nops*1e-6/sec : 0, result);
+    fflush(stdout);
+}
+
+static void random_interval(uint32_t *beg, uint32_t *end, int max_len)
+{
+    *beg = random() % SEQ_LEN;
+    *end = *beg + random() % max_len;
+}
+
+
+static void bench_regidx(int nregs, int nqry, int max_len)
+{
+    int i;
+    uint32_t beg, end;
+    uint64_t nhit;
+    char *names[] = { "1", "2", "3" };
+
+    // low level insertion, the regions are in random order, three sequences
+    regidx_t *idx = regidx_init(NULL,NULL,NULL,0,NULL);
+    double t0 = now();
+    for (i=0; i<nregs; i++)
+    {
+        random_interval(&beg,&end,max_len);
+        char *chr = names[i%3];
+        regidx_push(idx, chr, chr, beg, end, NULL);
+    }
+    report("regidx_push", nregs, t0, regidx_nregs(idx));
+
+    // the index is built lazily by the first query
+    regitr_t *itr = regitr_init(idx);
+    t0 = now();
+    nhit = regidx_overlap(idx, "1", 0, 0, itr);
+    report("regidx_build", nregs, t0, nhit);
+
+    t0 = now();
+    for (i=nhit=0; i<nqry; i++)
+    {
+        random_interval(&beg,&end,10);
+        if ( !regidx_overlap(idx, names[i%3], beg, end, NULL) ) continue;
+        nhit++;
+    }
+    report("regidx_query_random", nqry, t0, nhit);
+
+    // the same iterator reused with increasing coordinates, as when
+    // streaming a sorted VCF
+    t0 = now();
+    int nper = nqry/3 + 1;
+    uint32_t step = SEQ_LEN / nper;
+    for (i=nhit=0, beg=0; i<nqry; i++)
+    {
+        if ( i % nper == 0 ) beg = 0;
+        beg += 1 + random() % (2*step);
+        if ( !regidx_overlap(idx, names[i/nper], beg, beg, itr) ) continue;
+        while ( regitr_overlap(itr) ) nhit++;
+    }
+    report("regidx_query_sorted", nqry, t0, nhit);
+
+    t0 = now();
+    regitr_reset(idx, itr);
+    for (nhit=0; regitr_loop(itr); ) nhit++;
+    report("regidx_loop", nregs, t0, nhit);
+
+    regitr_destroy(itr);
+    regidx_destroy(idx);
+
+    // parsing of text lines, as when reading a -R file
+    kstring_t str = {0,0,0};
+    idx = regidx_init(NULL,regidx_parse_tab,NULL,0,NULL);
+    t0 = now();
+    for (i=0; i<nregs; i++)
+    {
+        random_interval(&beg,&end,max_len);
+        str.l = 0;
+        ksprintf(&str, "%s\t%u\t%u", names[i%3], beg+1, end+1);
+        if ( regidx_insert(idx, str.s)!=0 ) error("insert failed: %s\n", str.s);
+    }
+    report("regidx_insert", nregs, t0, regidx_nregs(idx));
+    regidx_destroy(idx);
+    free(str.s);
+}
+
+
+static void bench_rbuf(int nops, int size)
+{
+    rbuf_t rbuf;
+    rbuf_init(&rbuf, size);
+    uint64_t *dat = (uint64_t*) malloc(sizeof(uint64_t)*size);
+    uint64_t sum = 0;
+    int i, j;
+
+    // a sliding window: append to the end, shift from the front when full
+    double t0 = now();
+    for (i=0; i<nops; i++)
+    {
+        if ( rbuf.n==rbuf.m ) sum += dat[rbuf_shift(&rbuf)];
+        dat[rbuf_append(&rbuf)] = i;
+    }
+    while ( (j=rbuf_shift(&rbuf))>=0 ) sum += dat[j];
+    report("rbuf_append_shift", nops, t0, sum);
+
+    // iteration over a full buffer
+    for (i=0; i<size; i++) dat[rbuf_append(&rbuf)] = i;
+    t0 = now();
+    int nloop = nops / size;
+    for (i=sum=0; i<nloop; i++)
+        for (j=-1; rbuf_next(&rbuf,&j); ) sum += dat[j];
+    report("rbuf_next", (uint64_t)nloop*size, t0, sum);
+
+    // random access
+    t0 = now();
+    for (i=sum=0; i<nops; i++) sum += dat[rbuf_kth(&rbuf, random() % size)];
+    report("rbuf_kth", nops, t0, sum);
+
+    free(dat);
+}
+
+
+typedef struct
+{
+    uint32_t key;
+}
+heap_dat_t;
+static inline int heap_is_smaller(heap_dat_t *a, heap_dat_t *b)
+{
+    return a->key < b->key ? 1 : 0;
+}
+KHEAP_INIT(bench, heap_dat_t, heap_is_smaller)
+typedef khp_bench_t heap_t;
+
+static void bench_kheap(int nops)
+{
+    heap_t *heap = khp_init(bench);
+    heap_dat_t dat;
+    int i;
+
+    double t0 = now();
+    for (i=0; i<nops; i++)
+    {
+        dat.key = random();
+        khp_insert(bench, heap, &dat);
+    }
+    report("kheap_insert", nops, t0, heap->dat[0].key);
+
+    t0 = now();
+    uint32_t prev = 0;
+    uint64_t nerr = 0;
+    while ( heap->ndat )
+    {
+        if ( heap->dat[0].key < prev ) nerr++;
+        prev = heap->dat[0].key;
+        khp_delete(bench, heap);
+    }
+    report("kheap_delete", nops, t0, nerr);
+
+    // a merge-like pattern: the heap stays small, the minimum is repeatedly
+    // replaced by a larger value
+    for (i=0; i<1024; i++) { dat.key = random() % 1024; khp_insert(bench, heap, &dat); }
+    t0 = now();
+    for (i=0; i<nops; i++)
+    {
+        dat.key = heap->dat[0].key + 1 + random() % 1024;
+        khp_delete(bench, heap);
+        khp_insert(bench, heap, &dat);
+    }
+    report("kheap_replace", nops, t0, heap->dat[0].key);
+
+    khp_destroy(bench, heap);
+}
+
+
+static bcf_hdr_t *vcf_header(int nsmpl)
+{
+    bcf_hdr_t *hdr = bcf_hdr_init("w");
+    bcf_hdr_append(hdr, "##contig=<ID=1,length=250000000>");
+    bcf_hdr_append(hdr, "##FORMAT=<ID=GT,Number=1,Type=String,Description=\"Genotype\">");
+    kstring_t str = {0,0,0};
+    int i;
+    for (i=0; i<nsmpl; i++)
+    {
+        str.l = 0;
+        ksprintf(&str, "S%d", i+1);
+        bcf_hdr_add_sample(hdr, str.s);
+    }
+    bcf_hdr_add_sample(hdr, NULL);
+    bcf_hdr_sync(hdr);
+    free(str.s);
+    return hdr;
+}
+
+// Biallelic sites, consecutive sites tend to share the allele frequency so
+// that there is some LD to be found
+static bcf1_t **vcf_records(bcf_hdr_t *hdr, int nrec, int nsmpl)
+{
+    bcf1_t **recs = (bcf1_t**) malloc(sizeof(bcf1_t*)*nrec);
+    int32_t *gts = (int32_t*) malloc(sizeof(int32_t)*nsmpl*2);
+    int i, j, pos = 0;
+    double af = 0.5;
+    for (i=0; i<nrec; i++)
+    {
+        if ( random() % 10 == 0 ) af = 0.05 + 0.9*random()/RAND_MAX;
+        pos += 1 + random() % 100;
+        recs[i] = bcf_init1();
+        recs[i]->rid = 0;
+        recs[i]->pos = pos;
+        bcf_update_alleles_str(hdr, recs[i], "A,C");
+        for (j=0; j<nsmpl*2; j++)
+        {
+            if ( random() % 100 == 0 ) gts[j] = bcf_gt_missing;
+            else gts[j] = bcf_gt_unphased((double)random()/RAND_MAX < af ? 1 : 0);
+        }
+        bcf_update_genotypes(hdr, recs[i], gts, nsmpl*2);
+    }
+    free(gts);
+    return recs;
+}
+
+static void vcf_records_destroy(bcf1_t **recs, int nrec)
+{
+    int i;
+    for (i=0; i<nrec; i++) bcf_destroy1(recs[i]);
+    free(recs);
+}
+
+static void bench_vcfbuf(int nrec, int nsmpl, int win, double max_ld)
+{
+    bcf_hdr_t *hdr = vcf_header(nsmpl);
+    bcf1_t **recs = vcf_records(hdr, nrec, nsmpl);
+    int i;
+
+    // push and flush only; the pushed records are swapped with the buffer's
+    vcfbuf_t *buf = vcfbuf_init(hdr, win);
+    uint64_t nout = 0;
+    double t0 = now();
+    for (i=0; i<nrec; i++)
+    {
+        recs[i] = vcfbuf_push(buf, recs[i], 1);
+        while ( vcfbuf_flush(buf, 0) ) nout++;
+    }
+    while ( vcfbuf_flush(buf, 1) ) nout++;
+    report("vcfbuf_push_flush", nrec, t0, nout);
+    vcfbuf_destroy(buf);
+    vcf_records_destroy(recs, nrec);
+
+    // the prune plugin's loop: LD of each new site with the window, sites in
+    // LD with an earlier site are dropped
+    recs = vcf_records(hdr, nrec, nsmpl);
+    buf = vcfbuf_init(hdr, win);
+    vcfbuf_set_opt(buf,double,LD_MAX,max_ld);
+    nout = 0;
+    t0 = now();
+    for (i=0; i<nrec; i++)
+    {
+        while ( vcfbuf_flush(buf, 0) ) nout++;
+        double ld;
+        if ( vcfbuf_max_ld(buf, recs[i], &ld) ) continue;
+        recs[i] = vcfbuf_push(buf, recs[i], 1);
+    }
+    while ( vcfbuf_flush(buf, 1) ) nout++;
+    report("vcfbuf_max_ld", nrec, t0, nout);
+    vcfbuf_destroy(buf);
+    vcf_records_destroy(recs, nrec);
+
+    bcf_hdr_destroy(hdr);
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: bench-ds [OPTIONS]\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "   -b, --bench <list>      benchmarks to run: regidx,rbuf,kheap,vcfbuf [all]\n");
+    fprintf(stderr, "   -h, --help              this help message\n");
+    fprintf(stderr, "   -l, --max-len <int>     maximum length of the regidx intervals [1000]\n");
+    fprintf(stderr, "   -m, --max-ld <float>    vcfbuf: the LD_MAX threshold [0.2]\n");
+    fprintf(stderr, "   -n, --nops <int>        number of regidx intervals and queries, rbuf and kheap operations [1000000]\n");
+    fprintf(stderr, "   -r, --nrecs <int>       number of vcfbuf records [20000]\n");
+    fprintf(stderr, "   -S, --nsamples <int>    vcfbuf: number of samples [100]\n");
+    fprintf(stderr, "   -s, --seed <int>        random seed [1]\n");
+    fprintf(stderr, "   -w, --window <int>      rbuf size and vcfbuf window in sites [100]\n");
+    fprintf(stderr, "Output: [1]benchmark [2]operations [3]time (sec) [4]Mops/sec [5]result\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    static struct option loptions[] =
+    {
+        {"help",0,0,'h'},
+        {"bench",1,0,'b'},
+        {"max-len",1,0,'l'},
+        {"max-ld",1,0,'m'},
+        {"nops",1,0,'n'},
+        {"nrecs",1,0,'r'},
+        {"nsamples",1,0,'S'},
+        {"seed",1,0,'s'},
+        {"window",1,0,'w'},
+        {0,0,0,0}
+    };
+    int c, nops = 1000000, nrecs = 20000, nsmpl = 100, win = 100, max_len = 1000, seed = 1;
+    double max_ld = 0.2;
+    char *bench = "regidx,rbuf,kheap,vcfbuf", *tmp;
+    while ((c = getopt_long(argc, argv, "hb:l:m:n:r:S:s:w:",loptions,NULL)) >= 0)
+    {
+        switch (c)
+        {
+            case 'b': bench = optarg; break;
+            case 'l': max_len = strtol(optarg,&tmp,10); if ( *tmp || max_len<=0 ) error("Could not parse: -l %s\n", optarg); break;
+            case 'm': max_ld = strtod(optarg,&tmp); if ( *tmp ) error("Could not parse: -m %s\n", optarg); break;
+            case 'n': nops = strtol(optarg,&tmp,10); if ( *tmp || nops<=0 ) error("Could not parse: -n %s\n", optarg); break;
+            case 'r': nrecs = strtol(optarg,&tmp,10); if ( *tmp || nrecs<=0 ) error("Could not parse: -r %s\n", optarg); break;
+            case 'S': nsmpl = strtol(optarg,&tmp,10); if ( *tmp || nsmpl<=0 ) error("Could not parse: -S %s\n", optarg); break;
+            case 's': seed = strtol(optarg,&tmp,10); if ( *tmp ) error("Could not parse: -s %s\n", optarg); break;
+            case 'w': win = strtol(optarg,&tmp,10); if ( *tmp || win<=0 ) error("Could not parse: -w %s\n", optarg); break;
+            default: usage(); break;
+        }
+    }
+    if ( optind!=argc ) usage();
+
+    printf("# [1]benchmark\t[2]operations\t[3]time (sec)\t[4]Mops/sec\t[5]result\n");
+    srandom(seed);
+    if ( strstr(bench,"regidx") ) bench_regidx(nops, nops, max_len);
+    if ( strstr(bench,"rbuf") ) bench_rbuf(nops, win);
+    if ( strstr(bench,"kheap") ) bench_kheap(nops);
+    if ( strstr(bench,"vcfbuf") ) bench_vcfbuf(nrecs, nsmpl, win, max_ld);
+    return 0;
+}
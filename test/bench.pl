@@ -0,0 +1,348 @@
+#!/usr/bin/env perl
+#
+#   Copyright (C) 2017 Genome Research Ltd.
+#
+#   Author: Petr Danecek <pd3@sanger.ac.uk>
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in
+# all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+# THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+# FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+# DEALINGS IN THE SOFTWARE.
+
+# Timed scenarios on synthetic data, the output is tab-delimited so that the
+# timings can be compared across versions. The data are generated from a fixed
+# seed, the same parameters always give the same files.
+
+use strict;
+use warnings;
+use Carp;
+use FindBin;
+use lib "$FindBin::Bin";
+use Getopt::Long;
+use File::Temp qw/ tempfile tempdir /;
+use Time::HiRes qw/ time /;
+
+my @scenarios = qw(view filter query convert merge norm annotate csq call stats regidx);
+
+my $opts = parse_params();
+generate_data($opts);
+run_scenarios($opts);
+
+exit;
+
+#--------------------
+
+sub error
+{
+    my (@msg) = @_;
+    if ( scalar @msg ) { confess @msg; }
+    print
+        "About: timed bcftools scenarios on synthetic data\n",
+        "Usage: bench.pl [OPTIONS]\n",
+        "Options:\n",
+        "   -a, --alleles <int>             Maximum number of ALT alleles per site [2]\n",
+        "   -d, --fmt-density <float>       Fraction of samples with non-missing FORMAT fields [1.0]\n",
+        "   -n, --sites <int>               Number of sites [10000]\n",
+        "   -o, --output <file>             Append the timings to <file> rather than print to stdout\n",
+        "   -R, --repeat <int>              Number of runs of each scenario [3]\n",
+        "   -s, --samples <int>             Number of samples [100]\n",
+        "   -S, --scenarios <list>          Comma-separated list of scenarios [all]:\n",
+        "                                       ", join(',',@scenarios), "\n",
+        "       --seed <int>                Random seed of the data generator [1]\n",
+        "   -t, --temp-dir <path>           When given, temporary files will not be removed.\n",
+        "   -h, -?, --help                  This help message.\n",
+        "\n",
+        "Output columns:\n",
+        "   version, scenario, samples, sites, alleles, fmt-density, run, wall [s], user [s], sys [s], peak RSS [kB]\n",
+        "\n";
+    exit -1;
+}
+sub parse_params
+{
+    my $opts = { bgzip=>"bgzip", tabix=>"tabix", keep_files=>0, samples=>100, sites=>10000, alleles=>2,
+        fmt_density=>1.0, repeat=>3, seed=>1 };
+    my ($help,$scenarios);
+    Getopt::Long::Configure('bundling');
+    my $ret = GetOptions (
+            'e|exec=s' => sub { my ($tool, $path) = split /=/, $_[1]; $$opts{$tool} = $path if $path },
+            't|temp-dir:s' => \$$opts{keep_files},
+            's|samples=i' => \$$opts{samples},
+            'n|sites=i' => \$$opts{sites},
+            'a|alleles=i' => \$$opts{alleles},
+            'd|fmt-density=f' => \$$opts{fmt_density},
+            'R|repeat=i' => \$$opts{repeat},
+            'S|scenarios=s' => \$scenarios,
+            'seed=i' => \$$opts{seed},
+            'o|output=s' => \$$opts{output},
+            'h|?|help' => \$help
+            );
+    if ( !$ret or $help ) { error(); }
+    if ( $$opts{samples}<1 or $$opts{sites}<1 or $$opts{alleles}<1 or $$opts{repeat}<1 ) { error("Expected positive values\n"); }
+    if ( $$opts{fmt_density}<0 or $$opts{fmt_density}>1 ) { error("Expected --fmt-density between 0 and 1\n"); }
+    $$opts{scenarios} = [ @scenarios ];
+    if ( defined $scenarios )
+    {
+        my %known = map { $_=>1 } @scenarios;
+        $$opts{scenarios} = [ split(/,/,$scenarios) ];
+        for my $scenario (@{$$opts{scenarios}})
+        {
+            if ( !exists($known{$scenario}) ) { error("No such scenario: $scenario\n"); }
+        }
+    }
+    $$opts{tmp} = $$opts{keep_files} ? $$opts{keep_files} : tempdir(CLEANUP=>1);
+    if ( $$opts{keep_files} ) { cmd("mkdir -p $$opts{keep_files}"); }
+    $$opts{bin} = $FindBin::RealBin;
+    $$opts{bin} =~ s{/test/?$}{};
+
+    # GNU time reports the peak RSS, without it only the times are given
+    $$opts{gnu_time} = -x '/usr/bin/time' && !(_cmd("/usr/bin/time -f %M -o /dev/null true"))[0] ? '/usr/bin/time' : undef;
+    return $opts;
+}
+sub _cmd
+{
+    my ($cmd) = @_;
+    my $kid_io;
+    my @out;
+    my $pid = open($kid_io, "-|");
+    if ( !defined $pid ) { error("Cannot fork: $!"); }
+    if ($pid)
+    {
+        # parent
+        @out = <$kid_io>;
+        close($kid_io);
+    }
+    else
+    {
+        # child
+        exec('/bin/bash', '-o','pipefail','-c', $cmd) or error("Cannot execute the command [/bin/sh -o pipefail -c $cmd]: $!");
+    }
+    return ($? >> 8, join('',@out));
+}
+sub cmd
+{
+    my ($cmd) = @_;
+    my ($ret,$out) = _cmd($cmd);
+    if ( $ret ) { error("The command failed: $cmd\n", $out); }
+    return $out;
+}
+
+#--------------------
+
+sub random_base
+{
+    my ($not) = @_;
+    my @bases = qw(A C G T);
+    while (1)
+    {
+        my $base = $bases[int(rand(4))];
+        if ( !defined $not or $base ne $not ) { return $base; }
+    }
+}
+
+# A single sequence, sites are placed on average every 100bp. Genes with three
+# coding exons start every 10kb.
+sub generate_data
+{
+    my ($opts) = @_;
+    srand($$opts{seed});
+
+    my $tmp  = $$opts{tmp};
+    my $len  = $$opts{sites}*200 + 1000;
+    my $ref  = join('', map { random_base() } 1..$len);
+
+    open(my $fh,'>',"$tmp/ref.fa") or error("$tmp/ref.fa: $!");
+    print $fh ">1\n";
+    for (my $i=0; $i<$len; $i+=60) { print $fh substr($ref,$i,60), "\n"; }
+    close($fh) or error("close failed: $tmp/ref.fa");
+    write_fai($opts,"$tmp/ref.fa",$len);
+
+    open($fh,'>',"$tmp/genes.gff3") or error("$tmp/genes.gff3: $!");
+    print $fh "##gff-version 3\n";
+    for (my $beg=1000, my $igene=1; $beg+3000<$len; $beg+=10000, $igene++)
+    {
+        my $end = $beg + 2299;
+        my $gene = sprintf("ENSG%011d",$igene);
+        my $tscript = sprintf("ENST%011d",$igene);
+        print $fh join("\t",1,'.','gene',$beg,$end,'.','+','.',"ID=gene:$gene;Name=G$igene;biotype=protein_coding"),"\n";
+        print $fh join("\t",1,'.','transcript',$beg,$end,'.','+','.',"ID=transcript:$tscript;Parent=gene:$gene;biotype=protein_coding"),"\n";
+        for my $off (0,1000,2000)
+        {
+            print $fh join("\t",1,'.','exon',$beg+$off,$beg+$off+299,'.','+','.',"Parent=transcript:$tscript"),"\n";
+            print $fh join("\t",1,'.','CDS',$beg+$off,$beg+$off+299,'.','+','0',"Parent=transcript:$tscript"),"\n";
+        }
+    }
+    close($fh) or error("close failed: $tmp/genes.gff3");
+
+    my @pos = ();
+    my $pos = 0;
+    for (my $i=0; $i<$$opts{sites}; $i++)
+    {
+        $pos += 1 + int(rand(199));
+        push @pos, $pos;
+    }
+    write_vcf($opts,"$tmp/a.vcf",'A',\@pos,\$ref);
+    write_vcf($opts,"$tmp/b.vcf",'B',[ grep { $_ % 2 } @pos ],\$ref);
+    for my $name ('a','b')
+    {
+        cmd("$$opts{bin}/bcftools view -Ob -o $tmp/$name.bcf $tmp/$name.vcf");
+        cmd("$$opts{bin}/bcftools index $tmp/$name.bcf");
+    }
+
+    open($fh,'>',"$tmp/annots.tab") or error("$tmp/annots.tab: $!");
+    for (my $i=0; $i<@pos; $i+=2) { printf $fh "1\t%d\t%.3f\n", $pos[$i], rand(); }
+    close($fh) or error("close failed: $tmp/annots.tab");
+    cmd("cat $tmp/annots.tab | $$opts{bgzip} -c > $tmp/annots.tab.gz");
+    cmd("$$opts{tabix} -f -s1 -b2 -e2 $tmp/annots.tab.gz");
+    open($fh,'>',"$tmp/annots.hdr") or error("$tmp/annots.hdr: $!");
+    print $fh qq[##INFO=<ID=SCORE,Number=1,Type=Float,Description="Synthetic score">\n];
+    close($fh) or error("close failed: $tmp/annots.hdr");
+
+    open($fh,'>',"$tmp/targets.tab") or error("$tmp/targets.tab: $!");
+    for (my $i=0; $i<@pos; $i+=3) { printf $fh "1\t%d\t%d\n", $pos[$i], $pos[$i]+int(rand(50)); }
+    close($fh) or error("close failed: $tmp/targets.tab");
+}
+
+sub write_fai
+{
+    my ($opts,$fname,$len) = @_;
+    open(my $fh,'>',"$fname.fai") or error("$fname.fai: $!");
+    print $fh join("\t",1,$len,3,60,61),"\n";
+    close($fh) or error("close failed: $fname.fai");
+}
+
+sub write_vcf
+{
+    my ($opts,$fname,$prefix,$pos,$ref) = @_;
+    open(my $fh,'>',$fname) or error("$fname: $!");
+    print $fh "##fileformat=VCFv4.2\n";
+    print $fh "##contig=<ID=1,length=".length($$ref).">\n";
+    print $fh qq[##INFO=<ID=DP,Number=1,Type=Integer,Description="Total depth">\n];
+    print $fh qq[##FORMAT=<ID=GT,Number=1,Type=String,Description="Genotype">\n];
+    print $fh qq[##FORMAT=<ID=DP,Number=1,Type=Integer,Description="Depth">\n];
+    print $fh qq[##FORMAT=<ID=AD,Number=R,Type=Integer,Description="Allelic depths">\n];
+    print $fh qq[##FORMAT=<ID=PL,Number=G,Type=Integer,Description="Phred-scaled genotype likelihoods">\n];
+    print $fh join("\t",'#CHROM','POS','ID','REF','ALT','QUAL','FILTER','INFO','FORMAT',map { "$prefix$_" } 1..$$opts{samples}),"\n";
+    for my $pos (@$pos)
+    {
+        my $rbase = substr($$ref,$pos-1,1);
+        my $nalt  = 1 + int(rand($$opts{alleles}));
+        my %seen  = ();
+        my @alts  = ();
+        while ( @alts < $nalt )
+        {
+            # mostly SNPs, some insertions
+            my $alt = rand() < 0.9 ? random_base($rbase) : $rbase.join('', map { random_base() } 1..(1+int(rand(3))));
+            if ( exists($seen{$alt}) ) { next; }
+            $seen{$alt} = 1;
+            push @alts, $alt;
+        }
+        my $nals = $nalt + 1;
+        my $npl  = $nals*($nals+1)/2;
+        my @smpl = ();
+        my $dp_tot = 0;
+        for (my $i=0; $i<$$opts{samples}; $i++)
+        {
+            if ( rand() >= $$opts{fmt_density} )
+            {
+                push @smpl, './.:.:'.join(',',('.')x$nals).':'.join(',',('.')x$npl);
+                next;
+            }
+            my $a = int(rand($nals));
+            my $b = rand() < 0.5 ? 0 : int(rand($nals));
+            if ( $a < $b ) { ($a,$b) = ($b,$a); }
+            my $dp = 5 + int(rand(40));
+            $dp_tot += $dp;
+            my @ad = map { int(rand($dp/$nals+1)) } 1..$nals;
+            my @pl = map { int(rand(100)) } 1..$npl;
+            $pl[ $a*($a+1)/2+$b ] = 0;
+            push @smpl, "$b/$a:$dp:".join(',',@ad).':'.join(',',@pl);
+        }
+        print $fh join("\t",1,$pos,'.',$rbase,join(',',@alts),int(rand(100)),'PASS',"DP=$dp_tot",'GT:DP:AD:PL',@smpl),"\n";
+    }
+    close($fh) or error("close failed: $fname");
+}
+
+sub scenario_cmds
+{
+    my ($opts) = @_;
+    my $bin = "$$opts{bin}/bcftools";
+    my $tmp = $$opts{tmp};
+    return
+    {
+        view     => "$bin view -Ou $tmp/a.bcf > /dev/null",
+        filter   => "$bin view -i 'QUAL>50 && FMT/DP>20' -Ou $tmp/a.bcf > /dev/null",
+        query    => "$bin query -f '%CHROM\\t%POS\\t%REF\\t%ALT[\\t%GT:%DP]\\n' $tmp/a.bcf > /dev/null",
+        convert  => "$bin convert -g $tmp/out $tmp/a.bcf > /dev/null 2>&1",
+        merge    => "$bin merge -Ou $tmp/a.bcf $tmp/b.bcf > /dev/null",
+        norm     => "$bin norm -f $tmp/ref.fa -m -any -Ou $tmp/a.bcf > /dev/null 2>&1",
+        annotate => "$bin annotate -a $tmp/annots.tab.gz -h $tmp/annots.hdr -c CHROM,POS,SCORE -Ou $tmp/a.bcf > /dev/null",
+        csq      => "$bin csq -p a -f $tmp/ref.fa -g $tmp/genes.gff3 -Ou $tmp/a.bcf > /dev/null 2>&1",
+        call     => "$bin call -mv -Ou $tmp/a.bcf > /dev/null 2>&1",
+        stats    => "$bin stats -s - $tmp/a.bcf > /dev/null",
+        regidx   => "$bin view -T $tmp/targets.tab -Ou $tmp/a.bcf > /dev/null",
+    };
+}
+
+# Returns wall, user and sys times in seconds and peak RSS in kB, NA if not available
+sub run_timed
+{
+    my ($opts,$cmd) = @_;
+    my $script = "$$opts{tmp}/cmd.sh";
+    open(my $fh,'>',$script) or error("$script: $!");
+    print $fh "$cmd\n";
+    close($fh) or error("close failed: $script");
+
+    if ( $$opts{gnu_time} )
+    {
+        my $tm = "$$opts{tmp}/time.txt";
+        my ($ret,$out) = _cmd("$$opts{gnu_time} -f '%e\t%U\t%S\t%M' -o $tm /bin/bash -o pipefail $script");
+        if ( $ret ) { error("The command failed: $cmd\n", $out); }
+        open(my $fh,'<',$tm) or error("$tm: $!");
+        my @lines = <$fh>;
+        close($fh);
+        chomp($lines[-1]);
+        return split(/\t/,$lines[-1]);
+    }
+
+    my @t0 = times();
+    my $wall = time();
+    cmd("/bin/bash -o pipefail $script");
+    $wall = time() - $wall;
+    my @t1 = times();
+    return (sprintf("%.2f",$wall), sprintf("%.2f",$t1[2]-$t0[2]), sprintf("%.2f",$t1[3]-$t0[3]), 'NA');
+}
+
+sub run_scenarios
+{
+    my ($opts) = @_;
+    my $version = cmd("$$opts{bin}/bcftools --version-only");
+    chomp($version);
+    my $cmds = scenario_cmds($opts);
+
+    my $fh = \*STDOUT;
+    if ( defined $$opts{output} ) { open($fh,'>>',$$opts{output}) or error("$$opts{output}: $!"); }
+    else { print $fh join("\t",'# version','scenario','samples','sites','alleles','fmt-density','run','wall','user','sys','peak-rss'),"\n"; }
+    for my $scenario (@{$$opts{scenarios}})
+    {
+        for (my $i=1; $i<=$$opts{repeat}; $i++)
+        {
+            my @times = run_timed($opts,$$cmds{$scenario});
+            print $fh join("\t",$version,$scenario,$$opts{samples},$$opts{sites},$$opts{alleles},$$opts{fmt_density},$i,@times),"\n";
+        }
+    }
+    if ( defined $$opts{output} ) { close($fh) or error("close failed: $$opts{output}"); }
+}
+
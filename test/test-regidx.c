@@ -226,6 +226,57 @@ void test_random(int nregs, uint32_t min, uint32_t max)
     free(str.s);
 }
 
+void test_sorted_queries(int nregs, uint32_t min, uint32_t max)
+{
+    min--;
+    max--;
+
+    regidx_t *idx = regidx_init(NULL,custom_parse,custom_free,sizeof(char*),NULL);
+    if ( !idx ) error("init failed\n");
+
+    // Random regions, including a long one which overlaps everything
+    int i, j;
+    uint32_t *regs = (uint32_t*) malloc(sizeof(uint32_t)*2*nregs);
+    kstring_t str = {0,0,0};
+    for (i=0; i<nregs; i++)
+    {
+        if ( i==0 ) { regs[0] = min; regs[1] = max; }
+        else get_random_region(min,max,&regs[2*i],&regs[2*i+1]);
+        str.l = 0;
+        ksprintf(&str,"1\t%"PRIu32"\t%"PRIu32"\t1:%"PRIu32"-%"PRIu32"",regs[2*i]+1,regs[2*i+1]+1,regs[2*i]+1,regs[2*i+1]+1);
+        if ( regidx_insert(idx,str.s)!=0 ) error("insert failed: %s\n", str.s);
+    }
+
+    // Queries with increasing start coordinates reusing the same iterator,
+    // compared with a brute force search
+    regitr_t *itr = regitr_init(idx);
+    uint32_t beg = min;
+    while ( beg <= max )
+    {
+        uint32_t end = beg + random() % 10;
+        int nexp = 0, nhit = 0;
+        for (j=0; j<nregs; j++)
+            if ( regs[2*j+1]>=beg && regs[2*j]<=end ) nexp++;
+        int ret = regidx_overlap(idx,"1",beg,end,itr);
+        if ( nexp && !ret ) error("sorted query failed, expected %d overlap(s), found none: %d-%d\n", nexp,beg+1,end+1);
+        if ( !nexp && ret ) error("sorted query failed, expected no overlaps, found some: %d-%d\n", beg+1,end+1);
+        while ( ret && regitr_overlap(itr) )
+        {
+            if ( itr->beg > end || itr->end < beg )
+                error("sorted query failed, incorrect hit: %d-%d vs %d-%d\n", beg+1,end+1,itr->beg+1,itr->end+1);
+            nhit++;
+        }
+        if ( nexp!=nhit ) error("sorted query failed, expected %d overlap(s), found %d: %d-%d\n",nexp,nhit,beg+1,end+1);
+        beg += 1 + random() % 20;
+    }
+    debug("ok: sorted queries\n");
+
+    regitr_destroy(itr);
+    regidx_destroy(idx);
+    free(regs);
+    free(str.s);
+}
+
 void create_line_bed(char *line, char *chr, int start, int end)
 {
     sprintf(line,"%s\t%d\t%d\n",chr,start-1,end);
@@ -368,6 +419,9 @@ int main(int argc, char **argv)
     info("%d randomized tests, %d regions per test. Random seed is %d\n", ntest,nreg,seed);
     for (i=0; i<ntest; i++) test_random(nreg,1,1000);
 
+    info("%d randomized tests of sorted queries\n", ntest/10);
+    for (i=0; i<ntest/10; i++) test_sorted_queries(nreg,1,1000);
+
     return 0;
 }
 
@@ -38,33 +38,76 @@ test_tabix($opts,in=>'merge.a',reg=>'2:3199812-3199812',out=>'tabix.2.3199812.ou
 test_tabix($opts,in=>'merge.a',reg=>'1:3000151-3000151',out=>'tabix.1.3000151.out');
 test_index($opts,in=>'large_chrom_csi_limit',reg=>'chr20:1-2147483647',out=>'large_chrom_csi_limit.20.1.2147483647.out'); # 2147483647 (1<<31-1) is the current chrom limit for csi. bcf conversion and indexing fail above this
 test_index($opts,in=>'large_chrom_csi_limit',reg=>'chr20',out=>'large_chrom.20.1.2147483647.out'); # this fails until bug resolved
+test_index_chunks($opts,nchunks=>4);
+test_index_chunks($opts,nchunks=>4,args=>'--snap');
+test_index_chunks($opts,nchunks=>7);
 test_vcf_idxstats($opts,in=>'idx',args=>'-s',out=>'idx.out');
 test_vcf_idxstats($opts,in=>'idx',args=>'-n',out=>'idx_count.out');
 test_vcf_idxstats($opts,in=>'empty',args=>'-s',out=>'empty.idx.out');
 test_vcf_idxstats($opts,in=>'empty',args=>'-n',out=>'empty.idx_count.out');
 test_vcf_check($opts,in=>'check',out=>'check.chk');
 test_vcf_check_merge($opts,in=>'check',out=>'check_merge.chk');
+test_vcf_gtcheck_cache($opts,in=>'view',gt=>'view',args=>'');
+test_vcf_gtcheck_cache($opts,in=>'view',gt=>'view',args=>'-G 1');
+test_vcf_gtcheck_cache($opts,args=>'');
+test_vcf_gtcheck_cache($opts,args=>'-s B');
+test_vcf_gtcheck_pairs($opts,args=>'-G 1');
+test_vcf_gtcheck_pairs($opts,args=>'-G 1 --pair-threads 2');
+test_vcf_baf_cache($opts,cmd=>'cnv',args=>'-s A');
+test_vcf_baf_cache($opts,cmd=>'cnv',args=>'-s A -c B');
+test_vcf_baf_cache($opts,cmd=>'polysomy',args=>'-s A');
+test_vcf_cnv_samples($opts,args=>'');
+test_vcf_cnv_samples($opts,args=>'--threads 2');
+test_vcf_polysomy_threads($opts,args=>'-s A');
+test_vcf_polysomy_threads($opts,args=>'-s B -i');
+test_vcf_roh_cache($opts,args=>'-G30 --AF-tag AF');
+test_vcf_roh_cache($opts,args=>'-G30');
+test_vcf_roh_threads($opts,args=>'-G30 --AF-tag AF');
+test_vcf_roh_threads($opts,args=>'-G30 -s A,C');
+test_vcf_som_threads($opts,args=>'-f 5');
+test_vcf_som_threads($opts,args=>'-f 3 -m max');
+test_vcf_roh_genmap($opts,map=>'roh.map.txt',args=>'-G30 --AF-tag AF');
+test_vcf_roh_genmap($opts,map=>'roh.map.{CHROM}.txt',args=>'-G30 --AF-tag AF');
 test_vcf_stats($opts,in=>['stats.a','stats.b'],out=>'stats.chk',args=>'-s -');
 test_vcf_stats($opts,in=>['stats.a','stats.b'],out=>'stats.B.chk',args=>'-s B');
+test_vcf_stats_merge($opts,in=>['stats.a','stats.b'],out=>'stats.chk',args=>'-s -',regions=>['1:1-1001','1:1002-1003']);
+test_vcf_stats_threads($opts,in=>'stats.a',args=>'-s -');
+test_vcf_stats_threads($opts,args=>'-s -');
 test_vcf_isec($opts,in=>['isec.a','isec.b'],out=>'isec.ab.out',args=>'-n =2');
 test_vcf_isec($opts,in=>['isec.a','isec.b'],out=>'isec.ab.flt.out',args=>'-n =2 -i"STRLEN(REF)==2"');
 test_vcf_isec($opts,in=>['isec.a','isec.b'],out=>'isec.ab.both.out',args=>'-n =2 -c both');
 test_vcf_isec($opts,in=>['isec.a','isec.b'],out=>'isec.ab.any.out',args=>'-n =2 -c any');
 test_vcf_isec($opts,in=>['isec.a','isec.b'],out=>'isec.ab.C.out',args=>'-C -c any');
+test_vcf_isec($opts,in=>['isec.a','isec.b','isec.b'],out=>'isec.abb.out',args=>'-n =3');
+test_vcf_isec($opts,in=>['isec.a','isec.b','isec.b'],out=>'isec.abb.out',args=>'-n =3 --prefetch 2');
+test_vcf_isec_bitmap($opts,in=>['isec.a','isec.b'],out=>'isec.ab.bitmap.out',args=>'-n +1',query=>'--subset 1,2 --subset 1 --subset 2');
 test_vcf_isec2($opts,vcf_in=>['isec.a'],tab_in=>'isec',out=>'isec.tab.out',args=>'');
 test_vcf_merge($opts,in=>['merge.a','merge.b','merge.c'],out=>'merge.abc.out',args=>'--force-samples');
+test_vcf_merge($opts,in=>['merge.a','merge.b','merge.c'],out=>'merge.abc.out',args=>'--force-samples --shard-threads 2');
+test_vcf_merge($opts,in=>['merge.a','merge.b','merge.c'],out=>'merge.abc.out',args=>'--force-samples --max-site-mem 1k');
 test_vcf_merge($opts,in=>['merge.a','merge.b','merge.c'],out=>'merge.abc.2.out',args=>'--force-samples -Fx');
 test_vcf_merge($opts,in=>['merge.a','merge.b','merge.c'],out=>'merge.abc.3.out',args=>'--force-samples -0');
 test_vcf_merge($opts,in=>['merge.2.a','merge.2.b'],out=>'merge.2.none.out',args=>'--force-samples -m none');
 test_vcf_merge($opts,in=>['merge.2.a','merge.2.b'],out=>'merge.2.both.out',args=>'--force-samples -m both');
 test_vcf_merge($opts,in=>['merge.2.a','merge.2.b'],out=>'merge.2.all.out',args=>'--force-samples -m all');
+test_vcf_merge($opts,in=>['merge.2.a','merge.2.b'],out=>'merge.2.all.out',args=>'--force-samples -m all --max-site-mem 1k');
 test_vcf_merge($opts,in=>['merge.3.a','merge.3.b'],out=>'merge.3.out',args=>'--force-samples -i TR:sum,TA:sum,TG:sum');
 test_vcf_merge($opts,in=>['merge.4.a','merge.4.b'],out=>'merge.4.out',args=>'--force-samples -m id');
 test_vcf_merge($opts,in=>['gvcf.merge.1','gvcf.merge.2','gvcf.merge.3'],out=>'gvcf.merge.1.out',args=>'--gvcf -');
 test_vcf_merge($opts,in=>['merge.gvcf.2.a','merge.gvcf.2.b','merge.gvcf.2.c'],out=>'merge.gvcf.2.out',args=>'--gvcf -');
+test_vcf_merge($opts,in=>['merge.gvcf.2.a','merge.gvcf.2.b','merge.gvcf.2.c'],out=>'merge.gvcf.2.out',args=>'--gvcf - --shard-threads 2');
 test_vcf_merge($opts,in=>['merge.gvcf.3.a','merge.gvcf.3.b'],out=>'merge.gvcf.3.out',args=>'--gvcf - -i SRC:join');
 test_vcf_merge($opts,in=>['merge.5.a','merge.5.b'],out=>'merge.5.out');
 test_vcf_query($opts,in=>'query',out=>'query.out',args=>q[-f '%CHROM\\t%POS\\t%REF\\t%ALT\\t%DP4\\t%AN[\\t%GT\\t%TGT]\\n']);
+test_vcf_query($opts,in=>'query',out=>'query.out',args=>q[-f '%CHROM\\t%POS\\t%REF\\t%ALT\\t%DP4\\t%AN[\\t%GT\\t%TGT]\\n' --record-threads 3]);
+test_vcf_query_columnar($opts,in=>'query',args=>q[-f '%CHROM\\t%POS\\t%ID\\t%REF\\t%ALT\\t%QUAL\\t%FILTER\\t%TEST\\t%DP4\\t%DP4{1}\\t%AC[\\t%GT\\t%TGT\\t%TT\\t%GQ\\t%GL]\\n']);
+test_vcf_query_columnar($opts,in=>'query',args=>q[-f '%CHROM\\t%POS\\t%ID\\t%REF\\t%ALT\\t%QUAL\\t%FILTER\\t%TEST\\t%DP4\\t%DP4{1}\\t%AC[\\t%GT\\t%TGT\\t%TT\\t%GQ\\t%GL]\\n' --record-threads 3]);
+test_vcf_query_server($opts,in=>'query',out=>'query.out',regs=>['1,2','3','4'],args=>q[-f '%CHROM\\t%POS\\t%REF\\t%ALT\\t%DP4\\t%AN[\\t%GT\\t%TGT]\\n']);
+test_vcf_query_tbcsq($opts,subscript=>'');
+test_vcf_query_tbcsq($opts,subscript=>0);
+test_vcf_query_tbcsq($opts,subscript=>2);
+test_vcf_query_tbcsq($opts,filter=>'TBCSQ="missense"');
+test_vcf_query_tbcsq($opts,filter=>'TBCSQ~"stop"');
 test_vcf_query($opts,in=>'view.filter',out=>'query.2.out',args=>q[-f'%XRI\\n' -i'XRI[*]>1111']);
 test_vcf_query($opts,in=>'view.filter',out=>'query.3.out',args=>q[-f'%XRF\\n' -i'XRF[*]=2e6']);
 test_vcf_query($opts,in=>'view.filter',out=>'query.4.out',args=>q[-f'%XGS\\n' -i'XGS[5]="PQR"']);
@@ -80,8 +123,10 @@ test_vcf_query($opts,in=>'query',out=>'query.8.out',args=>q[-f'%POS[ %GL]\\n' -i
 test_vcf_query($opts,in=>'view.filter',out=>'query.9.out',args=>q[-f'%POS %CIGAR\\n' -i'strlen(CIGAR[*])=4']);
 test_vcf_query($opts,in=>'query',out=>'query.10.out',args=>q[-f'%POS[ %GT]\\n' -i'AC[0]=3']);
 test_vcf_query($opts,in=>'query',out=>'query.10.out',args=>q[-f'%POS[ %GT]\\n' -i'AF[0]=3/4']);
+test_vcf_query($opts,in=>'query',out=>'query.10.out',args=>q[-f'%POS[ %GT]\\n' -i'AC[0]=3 && AF[0]=3/4']);
 test_vcf_query($opts,in=>'query',out=>'query.11.out',args=>q[-f'%POS[ %GT]\\n' -i'MAC[0]=1']);
 test_vcf_query($opts,in=>'query',out=>'query.11.out',args=>q[-f'%POS[ %GT]\\n' -i'MAF[0]=1/4']);
+test_vcf_query($opts,in=>'query',out=>'query.11.out',args=>q[-f'%POS[ %GT]\\n' -i'MAC[0]=1 && MAF[0]=1/4']);
 test_vcf_query($opts,in=>'view.vectors',out=>'query.12.out',args=>q[-f'I8=%I8 I16=%I16 I32=%I32 IF=%IF IA8=%IA8 IA16=%IA16 IA32=%IA32 IAF=%IAF IA8=%IA8{1} IA16=%IA16{1} IA32=%IA32{1} IAF=%IAF{1} [ %F8:%F16:%F32:%FF]\\n']);
 test_vcf_query($opts,in=>'query.filter',out=>'query.13.out',args=>q[-f'%POS[ %GT]\\n' -i'GT ="1"']);
 test_vcf_query($opts,in=>'query.filter',out=>'query.14.out',args=>q[-f'%POS[ %GT]\\n' -i'GT!="1"']);
@@ -118,10 +163,13 @@ test_vcf_norm($opts,in=>'norm.merge',out=>'norm.merge.out',args=>'-m+');
 test_vcf_norm($opts,in=>'norm.merge.2',out=>'norm.merge.2.out',args=>'-m+');
 test_vcf_norm($opts,in=>'norm.merge.3',out=>'norm.merge.3.out',args=>'-m+');
 test_vcf_norm($opts,in=>'norm.merge',out=>'norm.merge.strict.out',args=>'-m+ -s');
+test_vcf_norm($opts,in=>'norm',out=>'norm.out',fai=>'norm',args=>'-cx --shard-threads 2');
+test_vcf_norm($opts,in=>'norm.merge',out=>'norm.merge.out',args=>'-m+ --shard-threads 2');
 test_vcf_norm($opts,in=>'norm.setref',out=>'norm.setref.out',args=>'-Nc s',fai=>'norm');
 test_vcf_norm($opts,in=>'norm.telomere',out=>'norm.telomere.out',fai=>'norm');
 test_vcf_view($opts,in=>'view',out=>'view.1.out',args=>'-aUc1 -C1 -s NA00002 -v snps',reg=>'');
 test_vcf_view($opts,in=>'view',out=>'view.2.out',args=>'-f PASS -Xks NA00003',reg=>'-r20,Y');
+test_vcf_view_write_index($opts,in=>'view',out=>'view.2.out',args=>'-f PASS -Xks NA00003',reg=>'-r20,Y');
 test_vcf_view($opts,in=>'view',out=>'view.3.out',args=>'-xs NA00003',reg=>'');
 test_vcf_view($opts,in=>'view',out=>'view.4.out',args=>q[-i 'QUAL==999 && (FS<20 || FS>=41.02) && ICF>-0.1 && HWE*2>1.2'],reg=>'');
 test_vcf_view($opts,in=>'view',out=>'view.5.out',args=>q[-p],reg=>'');
@@ -130,6 +178,8 @@ test_vcf_view($opts,in=>'view',out=>'view.7.out',args=>q[-hm2 -M2 -q0.3 -Q0.7],r
 test_vcf_view($opts,in=>'view',out=>'view.8.out',args=>q[-Hu],reg=>'');
 test_vcf_view($opts,in=>'view',out=>'view.9.out',args=>q[-GVsnps],reg=>'');
 test_vcf_view($opts,in=>'view',out=>'view.10.out',args=>q[-ne 'INDEL=1 || PV4[0]<0.006'],reg=>'');
+test_vcf_view($opts,in=>'view',out=>'view.1.out',args=>'-aUc1 -C1 -s NA00002 -v snps --record-threads 2',reg=>'');
+test_vcf_view($opts,in=>'view',out=>'view.4.out',args=>q[-i 'QUAL==999 && (FS<20 || FS>=41.02) && ICF>-0.1 && HWE*2>1.2' --record-threads 2],reg=>'');
 test_vcf_view($opts,in=>'view',out=>'view.exclude.out',args=>'-s ^NA00003',reg=>'');
 test_vcf_view($opts,in=>'view.omitgenotypes',out=>'view.omitgenotypes.out',args=>'',reg=>'');
 test_vcf_view($opts,in=>'view.omitgenotypes',out=>'view.dropgenotypes.out',args=>'-G',reg=>'');
@@ -156,12 +206,16 @@ test_vcf_view($opts,in=>'view.minmaxac',out=>'view.minmaxac.2.out',args=>q[-H -c
 test_vcf_view($opts,in=>'view.minmaxac',out=>'view.minmaxac.1.out',args=>q[-H -q0.3:major],reg=>'');
 test_vcf_view($opts,in=>'view.filter.annovar',out=>'view.filter.annovar.1.out',args=>q[-H -i 'Gene.refGene=="RAD21L1"'],reg=>'');
 test_vcf_view($opts,in=>'view.filter.annovar',out=>'view.filter.annovar.2.out',args=>q[-H -i 'Gene.refGene~"NOD"'],reg=>'');
+test_vcf_view($opts,in=>'view.filter.annovar',out=>'view.filter.annovar.2.out',args=>q[-H -i 'Gene.refGene~"nod/i"'],reg=>'');
 test_vcf_view($opts,in=>'view.filter.annovar',out=>'view.filter.annovar.3.out',args=>q[-H -i 'LJB2_MutationTaster=="0.291000"'],reg=>'');
 test_vcf_call($opts,in=>'mpileup',out=>'mpileup.1.out',args=>'-mv');
 test_vcf_call($opts,in=>'mpileup',out=>'mpileup.2.out',args=>'-mg0');
+test_vcf_call($opts,in=>'mpileup',out=>'mpileup.1.out',args=>'-mv --record-threads 2');
+test_vcf_call($opts,in=>'mpileup',out=>'mpileup.2.out',args=>'-mg0 --record-threads 2');
 test_vcf_call($opts,in=>'mpileup.X',out=>'mpileup.X.out',args=>'-mv --ploidy-file {PATH}/mpileup.ploidy -S {PATH}/mpileup.samples');
 test_vcf_call($opts,in=>'mpileup.X',out=>'mpileup.X.out',args=>'-mv --ploidy-file {PATH}/mpileup.ploidy -S {PATH}/mpileup.ped');
 test_vcf_call($opts,in=>'mpileup.X',out=>'mpileup.X.2.out',args=>'-mv --ploidy-file {PATH}/mpileup.ploidy -S {PATH}/mpileup.2.samples');
+test_vcf_call($opts,in=>'mpileup.X',out=>'mpileup.X.2.out',args=>'-mv --ploidy-file {PATH}/mpileup.ploidy -S {PATH}/mpileup.2.samples --record-threads 2');
 test_vcf_call_cAls($opts,in=>'mpileup',out=>'mpileup.cAls.out',tab=>'mpileup');
 test_vcf_call($opts,in=>'mpileup.c',out=>'mpileup.c.1.out',args=>'-cv');
 # test_vcf_call($opts,in=>'mpileup.c',out=>'mpileup.c.2.out',args=>'-cg0');
@@ -170,6 +224,7 @@ test_vcf_call($opts,in=>'mpileup.c.X',out=>'mpileup.c.X.out',args=>'-cv --ploidy
 test_vcf_call($opts,in=>'mpileup.c.X',out=>'mpileup.c.X.2.out',args=>'-cv --ploidy-file {PATH}/mpileup.ploidy -S {PATH}/mpileup.2.samples');
 test_vcf_filter($opts,in=>'filter.1',out=>'filter.1.out',args=>'-mx -g2 -G2');
 test_vcf_filter($opts,in=>'filter.2',out=>'filter.2.out',args=>q[-e'QUAL==59.2 || (INDEL=0 & (FMT/GQ=25 | FMT/DP=10))' -sModified -S.]);
+test_vcf_filter($opts,in=>'filter.2',out=>'filter.2.out',args=>q[-e'QUAL==59.2 || (INDEL=0 & (FMT/GQ=25 | FMT/DP=10 | FMT/DP=10))' -sModified -S.]);
 test_vcf_filter($opts,in=>'filter.3',out=>'filter.3.out',args=>q[-e'DP=19'],fmt=>'%POS\\t%FILTER\\t%DP[\\t%GT]\\n');
 test_vcf_filter($opts,in=>'filter.3',out=>'filter.4.out',args=>q[-e'DP=19' -s XX],fmt=>'%POS\\t%FILTER\\t%DP[\\t%GT]\\n');
 test_vcf_filter($opts,in=>'filter.3',out=>'filter.5.out',args=>q[-e'DP=19' -s XX -m+],fmt=>'%POS\\t%FILTER\\t%DP[\\t%GT]\\n');
@@ -180,6 +235,14 @@ test_vcf_filter($opts,in=>'filter.3',out=>'filter.4.out',args=>q[-e'FMT/GT="0/2"
 test_vcf_filter($opts,in=>'filter.3',out=>'filter.5.out',args=>q[-e'FMT/GT="0/2"' -s XX -m+],fmt=>'%POS\\t%FILTER\\t%DP[\\t%GT]\\n');
 test_vcf_filter($opts,in=>'filter.3',out=>'filter.6.out',args=>q[-e'FMT/GT="0/2"' -s XX -mx],fmt=>'%POS\\t%FILTER\\t%DP[\\t%GT]\\n');
 test_vcf_filter($opts,in=>'filter.3',out=>'filter.7.out',args=>q[-e'FMT/GT="0/2"' -s XX -m+x],fmt=>'%POS\\t%FILTER\\t%DP[\\t%GT]\\n');
+# FILTER set in place: the same size, spliced into the shared block, after unpacking INFO and in a dirty record
+test_vcf_filter($opts,in=>'filter.3',out=>'filter.4.out',args=>q[-e'POS=3162006' -s XX],fmt=>'%POS\\t%FILTER\\t%DP[\\t%GT]\\n',bcf=>1);
+test_vcf_filter($opts,in=>'filter.3',out=>'filter.5.out',args=>q[-e'POS=3162006' -s XX -m+],fmt=>'%POS\\t%FILTER\\t%DP[\\t%GT]\\n',bcf=>1);
+test_vcf_filter($opts,in=>'filter.3',out=>'filter.6.out',args=>q[-e'POS=3162006' -s XX -mx],fmt=>'%POS\\t%FILTER\\t%DP[\\t%GT]\\n',bcf=>1);
+test_vcf_filter($opts,in=>'filter.3',out=>'filter.7.out',args=>q[-e'POS=3162006' -s XX -m+x],fmt=>'%POS\\t%FILTER\\t%DP[\\t%GT]\\n',bcf=>1);
+test_vcf_filter($opts,in=>'filter.3',out=>'filter.5.out',args=>q[-e'DP=19' -s XX -m+],fmt=>'%POS\\t%FILTER\\t%DP[\\t%GT]\\n',bcf=>1);
+test_vcf_filter($opts,in=>'filter.1',out=>'filter.1.out',args=>q[-i'QUAL>0' -mx -g2 -G2],bcf=>1);
+test_vcf_filter($opts,in=>'filter.1',out=>'filter.1.out',args=>q[-i'DP=35' -mx -g2 -G2],bcf=>1);
 test_vcf_filter($opts,in=>'filter.2',out=>'filter.8.out',args=>q[-i'FMT/GT="0/0" && AC[*]=2'],fmt=>'%POS\\t%AC[\\t%GT]\\n');
 test_vcf_filter($opts,in=>'filter.2',out=>'filter.8.out',args=>q[-i'AC[*]=2 && FMT/GT="0/0"'],fmt=>'%POS\\t%AC[\\t%GT]\\n');
 test_vcf_filter($opts,in=>'filter.2',out=>'filter.9.out',args=>q[-i'ALT="."'],fmt=>'%POS\\t%AC[\\t%GT]\\n');
@@ -188,6 +251,9 @@ test_vcf_filter($opts,in=>'filter.4',out=>'filter.10.out',args=>q[-S . -i 'FORMA
 test_vcf_regions($opts,in=>'regions');
 test_vcf_annotate($opts,in=>'annotate',tab=>'annotate',out=>'annotate.out',args=>'-c CHROM,POS,REF,ALT,ID,QUAL,INFO/T_INT,INFO/T_FLOAT,INDEL');
 test_vcf_annotate($opts,in=>'annotate',tab=>'annotate2',out=>'annotate2.out',args=>'-c CHROM,FROM,TO,T_STR');
+test_vcf_annotate($opts,in=>'annotate',tab=>'annotate',out=>'annotate.out',args=>'-c CHROM,POS,REF,ALT,ID,QUAL,INFO/T_INT,INFO/T_FLOAT,INDEL --stream-annots');
+test_vcf_annotate($opts,in=>'annotate',tab=>'annotate',out=>'annotate.out',args=>"-c CHROM,POS,REF,ALT,ID,QUAL,INFO/T_INT,INFO/T_FLOAT,INDEL --annots-cache $$opts{tmp}/annotate.anx");
+test_vcf_annotate($opts,in=>'annotate',tab=>'annotate2',out=>'annotate2.out',args=>'-c CHROM,FROM,TO,T_STR --stream-annots');
 test_vcf_annotate($opts,in=>'annotate',vcf=>'annots',out=>'annotate3.out',args=>'-c STR,ID,QUAL,FILTER');
 test_vcf_annotate($opts,in=>'annotate2',vcf=>'annots2',out=>'annotate4.out',args=>'-c ID,QUAL,FILTER,INFO,FMT');
 test_vcf_annotate($opts,in=>'annotate2',vcf=>'annots2',out=>'annotate5.out',args=>'-c ID,QUAL,+FILTER,+INFO,FMT/GT -s A');
@@ -201,20 +267,33 @@ test_vcf_annotate($opts,in=>'annotate2',tab=>'annots11',out=>'annotate11.out',ar
 test_vcf_annotate($opts,in=>'annotate2',vcf=>'annots2',out=>'annotate12.out',args=>'-c AAA:=IINT,FMT/BBB:=FMT/FINT');
 test_vcf_annotate($opts,in=>'annotate2',vcf=>'annots2',out=>'annotate13.out',args=>'-x INFO -c INFO/IINT');
 test_vcf_plugin($opts,in=>'plugin1',out=>'missing2ref.out',cmd=>'+missing2ref --no-version');
+test_vcf_plugin($opts,in=>'plugin1',out=>'missing2ref.out',cmd=>'+missing2ref --no-version --record-threads 2');
 test_vcf_plugin($opts,in=>'plugin1',out=>'missing2ref.out',cmd=>'+setGT --no-version',args=>'-- -t . -n 0');
+test_vcf_plugin($opts,in=>'plugin1',out=>'missing2ref.out',cmd=>'+missing2ref --no-version',args=>'-- +setGT -- -t . -n 0');
+test_vcf_plugin($opts,in=>'plugin1',out=>'missing2ref.out',cmd=>'+missing2ref --no-version --record-threads 2',args=>'-- +setGT -- -t . -n 0');
 test_vcf_plugin($opts,in=>'setGT',out=>'setGT.1.out',cmd=>'+setGT --no-version',args=>'-- -t q -n 0 -i \'GT~"." && FMT/DP=30 && GQ=150\'');
+test_vcf_plugin($opts,in=>'setGT',out=>'setGT.1.out',cmd=>'+setGT --no-version --record-threads 2',args=>'-- -t q -n 0 -i \'GT~"." && FMT/DP=30 && GQ=150\'');
+test_vcf_plugin($opts,in=>'setGT',out=>'setGT.2.out',cmd=>'+setGT --no-version',args=>'-- -t a -n u');
+test_vcf_plugin($opts,in=>'setGT',out=>'setGT.2.out',cmd=>'+setGT --no-version --record-threads 2',args=>'-- -t a -n u');
+test_vcf_plugin($opts,in=>'setGT.phased',out=>'setGT.3.out',cmd=>'+setGT --no-version',args=>'-- -t a -n u');
+test_vcf_plugin($opts,in=>'setGT.phased',out=>'setGT.3.out',cmd=>'+setGT --no-version --record-threads 2',args=>'-- -t a -n u');
+test_vcf_plugin($opts,in=>'setGT.phased',out=>'setGT.4.out',cmd=>'+setGT --no-version',args=>'-- -t ./x -n u');
 test_vcf_annotate($opts,in=>'annotate9',tab=>'annots9',out=>'annotate9.out',args=>'-c CHROM,POS,REF,ALT,+ID');
 test_vcf_plugin($opts,in=>'plugin1',out=>'fill-AN-AC.out',cmd=>'+fill-AN-AC --no-version');
 test_vcf_plugin($opts,in=>'plugin1',out=>'dosage.out',cmd=>'+dosage');
+test_vcf_plugin($opts,in=>'plugin1',out=>'dosage.bin.out',cmd=>'+dosage',args=>"-- -b $$opts{tmp}/dosage && cat $$opts{tmp}/dosage.samples $$opts{tmp}/dosage.sites");
 test_vcf_plugin($opts,in=>'fixploidy',out=>'fixploidy.out',cmd=>'+fixploidy --no-version',args=>'-- -s {PATH}/fixploidy.samples -p {PATH}/fixploidy.ploidy');
 test_vcf_plugin($opts,in=>'view.PL',out=>'guess-ploidy.PL.out',cmd=>'+guess-ploidy',args=>'-vrX | grep -v bcftools');
 test_vcf_plugin($opts,in=>'view.GL',out=>'guess-ploidy.GL.out',cmd=>'+guess-ploidy',args=>'-vrX | grep -v bcftools');
+test_vcf_plugin($opts,in=>'view.PL',out=>'guess-ploidy.PL.out',cmd=>'+guess-ploidy',args=>'-vrX --threads 2 | grep -v bcftools');
 test_vcf_plugin($opts,in=>'view.GL',out=>'view.PL.vcf',cmd=>'+tag2tag --no-version',args=>'-- -r --gl-to-pl');
 test_vcf_plugin($opts,in=>'view.GP',out=>'view.GT.vcf',cmd=>'+tag2tag --no-version',args=>'-- -r --gp-to-gt -t 0.2');
 test_vcf_plugin($opts,in=>'merge.a',out=>'fill-tags.out',cmd=>'+fill-tags --no-version',args=>'-- -t AN,AC,AC_Hom,AC_Het,AC_Hemi');
 test_vcf_plugin($opts,in=>'view',out=>'fill-tags.2.out',cmd=>'+fill-tags --no-version',args=>'-- -t AC,AN,AF,MAF,NS');
 test_vcf_plugin($opts,in=>'view',out=>'fill-tags.3.out',cmd=>'+fill-tags --no-version',args=>'-- -t AC -S {PATH}/fill-tags.3.smpl');
+test_vcf_plugin($opts,in=>'view',out=>'fill-tags.3.out',cmd=>'+fill-tags --no-version --record-threads 2',args=>'-- -t AC -S {PATH}/fill-tags.3.smpl');
 test_vcf_plugin($opts,in=>'fill-tags-hemi',out=>'fill-tags-hemi.1.out',cmd=>'+fill-tags --no-version');
+test_vcf_plugin($opts,in=>'fill-tags-hemi',out=>'fill-tags-hemi.1.out',cmd=>'+fill-tags --no-version --record-threads 2');
 test_vcf_plugin($opts,in=>'fill-tags-hemi',out=>'fill-tags-hemi.2.out',cmd=>'+fill-tags --no-version',args=>'-- -d');
 test_vcf_plugin($opts,in=>'view',out=>'view.GTisec.out',cmd=>'+GTisec',args=>' | grep -v bcftools');
 test_vcf_plugin($opts,in=>'view',out=>'view.GTisec.H.out',cmd=>'+GTisec',args=>'-- -H | grep -v bcftools');
@@ -227,15 +306,26 @@ test_vcf_plugin($opts,in=>'view',out=>'view.GTisec.v.out',cmd=>'+GTisec',args=>'
 test_vcf_plugin($opts,in=>'trio',out=>'trio.out',cmd=>'+trio-switch-rate',args=>'-- -p {PATH}/trio.ped | grep -v bcftools');
 test_vcf_plugin($opts,in=>'ad-bias',out=>'ad-bias.out',cmd=>'+ad-bias',args=>'-- -s {PATH}/ad-bias.samples | grep -v bcftools');
 test_vcf_plugin($opts,in=>'af-dist',out=>'af-dist.out',cmd=>'+af-dist',args=>' | grep -v bcftools');
+test_vcf_plugin($opts,in=>'af-dist',out=>'af-dist.out',cmd=>'+af-dist --record-threads 2',args=>' | grep -v bcftools');
+test_vcf_plugin($opts,in=>'af-dist',out=>'af-dist.counts.out',cmd=>'+counts --record-threads 2',args=>'-- +af-dist | grep -v bcftools');
 test_vcf_plugin($opts,in=>'fixref',out=>'fixref.1.out',cmd=>'+fixref',args=>'-- -f {PATH}/norm.fa -m top');
+test_vcf_fixref_cache($opts,fa=>'norm.fa',args=>'');
+test_vcf_fixref_cache($opts,fa=>'norm.fa',args=>'-d');
 test_vcf_plugin($opts,in=>'aa',out=>'aa.out',cmd=>'+fill-from-fasta',args=>'-- -f {PATH}/aa.fa -c AA -h {PATH}/aa.hdr -i \'TYPE="snp"\'');
 test_vcf_plugin($opts,in=>'ref',out=>'ref.out',cmd=>'+fill-from-fasta',args=>'-- -f {PATH}/norm.fa -c REF');
 test_vcf_plugin($opts,in=>'view',out=>'view.GTsubset.NA1.out',cmd=>'+GTsubset --no-version',args=>'-- -s NA00001');
 test_vcf_plugin($opts,in=>'view',out=>'view.GTsubset.NA1NA2.out',cmd=>'+GTsubset --no-version',args=>'-- -s NA00001,NA00002');
 test_vcf_plugin($opts,in=>'view',out=>'view.GTsubset.NA1NA2NA3.out',cmd=>'+GTsubset --no-version',args=>'-- -s NA00001,NA00002,NA00003');
 test_vcf_plugin($opts,in=>'mendelian',out=>'mendelian.1.out',cmd=>'+mendelian --no-version',args=>'-- -t mom1,dad1,child1 -d');
+test_vcf_plugin($opts,in=>'mendelian',out=>'mendelian.1.out',cmd=>'+mendelian --no-version --record-threads 2',args=>'-- -t mom1,dad1,child1 -d');
 test_vcf_plugin($opts,in=>'mendelian',out=>'mendelian.2.out',cmd=>'+mendelian --no-version',args=>'-- -t mom1,dad1,child1 -l+');
 test_vcf_plugin($opts,in=>'mendelian',out=>'mendelian.3.out',cmd=>'+mendelian --no-version',args=>'-- -t mom1,dad1,child1 -lx');
+test_vcf_plugin($opts,in=>'mendelian',out=>'mendelian.3.out',cmd=>'+mendelian --no-version --record-threads 2',args=>'-- -t mom1,dad1,child1 -lx');
+test_vcf_check_sparsity($opts,args=>'--threads 3',regs=>'');
+test_vcf_check_sparsity($opts,args=>'-b 500',regs=>'-r 1:1000-20000,1:15000-40000,2:5000-9000');
+test_vcf_check_sparsity($opts,args=>'-b 500 --threads 3',regs=>'-r 1:1000-20000,1:15000-40000,2:5000-9000');
+test_vcf_impute_info($opts,args=>'-t GP');
+test_vcf_impute_info($opts,args=>'-t DS');
 test_vcf_concat($opts,in=>['concat.1.a','concat.1.b'],out=>'concat.1.vcf.out',do_bcf=>0,args=>'');
 test_vcf_concat($opts,in=>['concat.1.a','concat.1.b'],out=>'concat.1.bcf.out',do_bcf=>1,args=>'');
 test_vcf_concat($opts,in=>['concat.2.a','concat.2.b'],out=>'concat.2.vcf.out',do_bcf=>0,args=>'-a');
@@ -244,6 +334,8 @@ test_vcf_concat($opts,in=>['concat.2.a','concat.2.b'],out=>'concat.4.vcf.out',do
 test_vcf_concat($opts,in=>['concat.2.a','concat.2.b'],out=>'concat.4.bcf.out',do_bcf=>1,args=>'-aD');
 test_vcf_concat($opts,in=>['concat.3.a','concat.3.b','concat.3.0','concat.3.c','concat.3.d','concat.3.e','concat.3.f'],out=>'concat.3.vcf.out',do_bcf=>0,args=>'-l');
 test_vcf_concat($opts,in=>['concat.3.a','concat.3.b','concat.3.0','concat.3.c','concat.3.d','concat.3.e','concat.3.f'],out=>'concat.3.bcf.out',do_bcf=>1,args=>'-l');
+test_vcf_concat($opts,in=>['concat.3.a','concat.3.b','concat.3.0','concat.3.c','concat.3.d','concat.3.e','concat.3.f'],out=>'concat.3.vcf.out',do_bcf=>0,args=>'-l --ligate-threads 2');
+test_vcf_concat($opts,in=>['concat.3.a','concat.3.b','concat.3.0','concat.3.c','concat.3.d','concat.3.e','concat.3.f'],out=>'concat.3.bcf.out',do_bcf=>1,args=>'-l --ligate-threads 2');
 test_naive_concat($opts,name=>'naive_concat',max_hdr_lines=>10000,max_body_lines=>10000,nfiles=>10);
 test_vcf_reheader($opts,in=>'reheader',out=>'reheader.1.out',header=>'reheader.hdr');
 test_vcf_reheader($opts,in=>'reheader',out=>'reheader.2.out',samples=>'reheader.samples');
@@ -251,11 +343,15 @@ test_vcf_reheader($opts,in=>'reheader',out=>'reheader.2.out',samples=>'reheader.
 test_vcf_reheader($opts,in=>'reheader',out=>'reheader.3.out',samples=>'reheader.samples3');
 test_vcf_reheader($opts,in=>'reheader',out=>'reheader.4.out',samples=>'reheader.samples4');
 test_vcf_reheader($opts,in=>'empty',out=>'reheader.empty.out',header=>'reheader.empty.hdr');
+test_vcf_sort($opts,in=>'view',args=>'');
+test_vcf_sort($opts,in=>'view',args=>"-m 1k --sort-threads 3 -T $$opts{tmp}/sort");
 test_rename_chrs($opts,in=>'annotate');
 test_vcf_convert($opts,in=>'convert',out=>'convert.gs.gt.gen',args=>'-g -,.');
 test_vcf_convert($opts,in=>'convert',out=>'convert.gs.gt.samples',args=>'-g .,-');
 test_vcf_convert($opts,in=>'convert',out=>'convert.gs.pl.gen',args=>'-g -,. --tag PL');
 test_vcf_convert($opts,in=>'convert',out=>'convert.gs.pl.samples',args=>'-g .,- --tag PL');
+test_vcf_convert($opts,in=>'convert',out=>'convert.gs.gt.gen',args=>'-g -,. --record-threads 3');
+test_vcf_convert($opts,in=>'convert',out=>'convert.gs.pl.gen',args=>'-g -,. --tag PL --record-threads 2');
 test_vcf_convert($opts,in=>'check',out=>'check.gs.vcfids.gen',args=>'-g -,. --vcf-ids');
 test_vcf_convert($opts,in=>'check',out=>'check.gs.vcfids.samples',args=>'-g .,- --vcf-ids');
 test_vcf_convert($opts,in=>'check',out=>'check.gs.chrom.gen',args=>'-g -,. --chrom');
@@ -265,12 +361,18 @@ test_vcf_convert($opts,in=>'check',out=>'check.gs.vcfids_chrom.samples',args=>'-
 test_vcf_convert($opts,in=>'convert',out=>'convert.hls.haps',args=>'-h -,.,.');
 test_vcf_convert($opts,in=>'convert',out=>'convert.hls.legend',args=>'-h .,-,.');
 test_vcf_convert($opts,in=>'convert',out=>'convert.hls.samples',args=>'-h .,.,-');
+test_vcf_convert($opts,in=>'convert',out=>'convert.hls.haps',args=>'-h -,.,. --record-threads 2');
+test_vcf_convert($opts,in=>'convert',out=>'convert.hls.legend',args=>'-h .,-,. --record-threads 2');
 test_vcf_convert_hls2vcf($opts,h=>'convert.hls.gt.hap',l=>'convert.hls.gt.legend',s=>'convert.hls.gt.samples',out=>'convert.gt.noHead.vcf',args=>'-H');
 test_vcf_convert_hs2vcf($opts,h=>'convert.hs.gt.hap',s=>'convert.hs.gt.samples',out=>'convert.gt.noHead.vcf',args=>'--hapsample2vcf');
 test_vcf_convert($opts,in=>'convert',out=>'convert.hs.hap',args=>'--hapsample -,.');
 test_vcf_convert($opts,in=>'convert',out=>'convert.hs.sample',args=>'--hapsample .,-');
+test_vcf_convert($opts,in=>'convert',out=>'convert.hs.hap',args=>'--hapsample -,. --record-threads 2');
 test_vcf_convert_gvcf($opts,in=>'convert.gvcf',out=>'convert.gvcf.out',fa=>'gvcf.fa',args=>'--gvcf2vcf');
+test_vcf_convert_gvcf($opts,in=>'convert.gvcf',out=>'convert.gvcf.out',fa=>'gvcf.fa',args=>'--gvcf2vcf --record-threads 2');
+test_vcf_convert_gvcf($opts,in=>'convert.gvcf',out=>'convert.gvcf.out',fa=>'gvcf.fa',args=>'--gvcf2vcf --expand-targets {PATH}/convert.gvcf.targets');
 test_vcf_convert_tsv2vcf($opts,in=>'convert.23andme',out=>'convert.23andme.vcf',args=>'-c ID,CHROM,POS,AA -s SAMPLE1',fai=>'23andme');
+test_vcf_convert_tsv2vcf($opts,in=>'convert.23andme',out=>'convert.23andme.vcf',args=>'-c ID,CHROM,POS,AA -s SAMPLE1 --record-threads 2',fai=>'23andme');
 test_vcf_consensus($opts,in=>'consensus',out=>'consensus.1.out',fa=>'consensus.fa',mask=>'consensus.tab',args=>'');
 test_vcf_consensus_chain($opts,in=>'consensus',out=>'consensus.1.chain',chain=>'consensus.1.chain',fa=>'consensus.fa',mask=>'consensus.tab',args=>'');
 test_vcf_consensus($opts,in=>'consensus',out=>'consensus.2.out',fa=>'consensus.fa',mask=>'consensus.tab',args=>'-H 1');
@@ -281,25 +383,37 @@ test_vcf_consensus($opts,in=>'consensus',out=>'consensus.4.out',fa=>'consensus.f
 test_vcf_consensus_chain($opts,in=>'consensus',out=>'consensus.4.chain',chain=>'consensus.4.chain',fa=>'consensus.fa',args=>'-H 1');
 test_vcf_consensus($opts,in=>'consensus2',out=>'consensus2.1.out',fa=>'consensus2.fa',args=>'-H 1');
 test_vcf_consensus($opts,in=>'consensus2',out=>'consensus2.2.out',fa=>'consensus2.fa',args=>'-H 2');
+test_vcf_consensus($opts,in=>'consensus',out=>'consensus.4.out',fa=>'consensus.fa',args=>'-H 1 -s NA001',prefix=>'consensus.',sample=>'NA001');
+test_vcf_consensus_chain($opts,in=>'consensus',out=>'consensus.4.chain',fa=>'consensus.fa',args=>'-H 1 -s NA001',prefix=>'consensus.',sample=>'NA001');
 test_vcf_consensus($opts,in=>'empty',out=>'consensus.5.out',fa=>'consensus.fa',args=>'');
 test_mpileup($opts,in=>[qw(1 2 3)],out=>'mpileup/mpileup.1.out',args=>q[-r17:100-150],test_list=>1);
 test_mpileup($opts,in=>[qw(1 2 3)],out=>'mpileup/mpileup.2.out',args=>q[-a DP,DV -r17:100-600]); # test files from samtools mpileup test suite
+test_mpileup($opts,in=>[qw(1 2 3)],out=>'mpileup/mpileup.2.out',args=>q[-a DP,DV -r17:100-300,17:301-600 --shard-threads 2]);
+test_mpileup($opts,in=>[qw(1 2 3)],out=>'mpileup/mpileup.2.out',args=>q[-a DP,DV -t17:100-300,17:301-600]);
 test_mpileup($opts,in=>[qw(1)],out=>'mpileup/mpileup.3.out',args=>q[-B --ff 0x14 -r17:1050-1060]); # test file converted to vcf from samtools mpileup test suite
 test_mpileup($opts,in=>[qw(1 2 3)],out=>'mpileup/mpileup.4.out',args=>q[-a DP,DPR,DV,DP4,INFO/DPR,SP -r17:100-600]); #test files from samtools mpileup test suite
+test_mpileup($opts,in=>[qw(1 2 3)],out=>'mpileup/mpileup.4.out',args=>q[-a DP,DPR,DV,DP4,INFO/DPR,SP -r17:100-600 --read-stats]);
+test_mpileup($opts,in=>[qw(1 2 3)],out=>'mpileup/mpileup.2.out',args=>q[-a DP,DV -r17:100-300,17:301-600 --shard-threads 2 --read-stats]);
 test_mpileup($opts,in=>[qw(1 2 3)],out=>'mpileup/mpileup.5.out',args=>q[-a DP,AD,ADF,ADR,SP,INFO/AD,INFO/ADF,INFO/ADR -r17:100-600]);
 test_mpileup($opts,in=>[qw(1 2 3)],out=>'mpileup/mpileup.6.out',args=>q[-a DP,DV -r17:100-600 --gvcf 0,2,5]);
 test_mpileup($opts,in=>[qw(1 2 3)],out=>'mpileup/mpileup.6.out',args=>q[-a DP,DV -r17:100-200,17:201-300,17:301-400,17:401-500,17:501-600 --gvcf 0,2,5]);
+test_mpileup($opts,in=>[qw(1 2 3)],out=>'mpileup/mpileup.6.out',args=>q[-a DP,DV -r17:100-200,17:201-300,17:301-400,17:401-500,17:501-600 --gvcf 0,2,5 --shard-threads 3]);
 test_mpileup($opts,in=>[qw(1 2 3)],out=>'mpileup/mpileup.7.out',args=>q[-r17:100-150 -s HG00101,HG00102]);
 test_mpileup($opts,in=>[qw(1 2 3)],out=>'mpileup/mpileup.7.out',args=>q[-r17:100-150 -S {PATH}/mplp.samples]);
 test_mpileup($opts,in=>[qw(1 2 3)],out=>'mpileup/mpileup.8.out',args=>q[-r17:100-150 -s ^HG00101,HG00102]);
 test_mpileup($opts,in=>[qw(1 2 3)],out=>'mpileup/mpileup.8.out',args=>q[-r17:100-150 -S ^{PATH}/mplp.samples]);
 test_mpileup($opts,in=>[qw(1 2 3)],out=>'mpileup/mpileup.9.out',args=>q[-t17:100-150 -S {PATH}/mplp.9.samples]);
 test_mpileup($opts,in=>[qw(1 2 3)],out=>'mpileup/mpileup.10.out',args=>q[-t17:100-150 -G {PATH}/mplp.10.samples]);
+test_mpileup($opts,in=>[qw(1 2 3)],out=>'mpileup/mpileup.10.out',args=>q[-t17:100-150 -G {PATH}/mplp.10.samples --read-stats]);
 test_mpileup($opts,in=>[qw(3)],out=>'mpileup/mpileup.11.out',args=>q[]);
 test_mpileup($opts,in=>[qw(3 4)],out=>'mpileup/mpileup.11.out',args=>q[-s HG00102]);
 test_mpileup($opts,in=>[qw(3 4)],out=>'mpileup/mpileup.11.out',args=>q[-s ^HG99999]);
 test_mpileup($opts,in=>[qw(3 4)],out=>'mpileup/mpileup.11.out',args=>q[-G {PATH}/mplp.11.rgs]);
 test_csq($opts,in=>'csq',out=>'csq.1.out',cmd=>'-f {PATH}/csq.fa -g {PATH}/csq.gff3');
+test_csq($opts,in=>'csq',out=>'csq.1.out',cmd=>'-f {PATH}/csq.fa -g {PATH}/csq.gff3 --gff-cache {TMP}/csq.gff3.cache');
+test_csq($opts,in=>'csq',out=>'csq.1.out',cmd=>'-f {PATH}/csq.fa -g {PATH}/csq.gff3 --gff-cache {TMP}/csq.gff3.cache');
+test_csq($opts,in=>'csq',out=>'csq.1.out',cmd=>'-f {PATH}/csq.fa -g {PATH}/csq.gff3 --tscript-threads 3');
+test_csq($opts,in=>'csq',out=>'csq.1.out',cmd=>'-f {PATH}/csq.fa -g {PATH}/csq.gff3 --tscript-threads 3 --max-buffered 1000');
 test_csq_real($opts,in=>'csq');
 
 print "\nNumber of tests:\n";
@@ -510,6 +624,12 @@ sub test_index
     cmd("$$opts{bin}/bcftools index -f $$opts{tmp}/$args{in}.bcf");
     test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools view -H $$opts{tmp}/$args{in}.bcf $args{reg}");
 
+    # parallel build
+    cmd("$$opts{bin}/bcftools index --threads 2 -f $$opts{tmp}/$args{in}.vcf.gz");
+    test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools view -H $$opts{tmp}/$args{in}.vcf.gz $args{reg}");
+    cmd("$$opts{bin}/bcftools index --threads 2 -f $$opts{tmp}/$args{in}.bcf");
+    test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools view -H $$opts{tmp}/$args{in}.bcf $args{reg}");
+
     # output path
     unlink("$$opts{tmp}/$args{in}.bcf.csi", "$$opts{tmp}/$args{in}.bcf.csi", "$$opts{tmp}/$args{in}.vcf.gz.tbi");
     cmd("$$opts{bin}/bcftools index -fo $$opts{tmp}/$args{in}.csi $$opts{tmp}/$args{in}.bcf");
@@ -523,6 +643,70 @@ sub test_index
     test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools view -H $$opts{tmp}/$args{in}.bcf $args{reg}");
 }
 
+# The --chunks regions must cover the contigs without gaps or overlaps, each
+# record must be in exactly one chunk, and the chunks must be of similar size.
+# The records are spread over several BGZF blocks, with a long gap in the
+# middle of the first contig.
+sub test_index_chunks
+{
+    my ($opts,%args) = @_;
+    my $vcf = "$$opts{tmp}/index_chunks.vcf";
+    open(my $fh,'>',$vcf) or error("$vcf: $!");
+    print $fh "##fileformat=VCFv4.2\n";
+    print $fh "##contig=<ID=1,length=200000000>\n";
+    print $fh "##contig=<ID=2>\n";
+    print $fh "##INFO=<ID=XX,Number=1,Type=Integer,Description=\"Test\">\n";
+    print $fh "#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\n";
+    my @acgt = qw(A C G T);
+    my $nrec = 0;
+    for my $pos ((map { 1 + $_*300 } 0..9999), (map { 150000000 + $_*300 } 0..9999))
+    {
+        print $fh "1\t$pos\t.\t$acgt[$pos%4]\t$acgt[($pos+1)%4]\t.\t.\tXX=".($pos*7919%100003)."\n"; $nrec++;
+    }
+    for my $pos (map { 1 + $_*300 } 0..9999)
+    {
+        print $fh "2\t$pos\t.\t$acgt[$pos%4]\t$acgt[($pos+1)%4]\t.\t.\tXX=".($pos*7919%100003)."\n"; $nrec++;
+    }
+    close($fh);
+
+    my $test = 'test_index_chunks';
+    my $args = exists($args{args}) ? $args{args} : '';
+    for my $fmt ('z','b')
+    {
+        my $file = "$$opts{tmp}/index_chunks." . ($fmt eq 'z' ? 'vcf.gz' : 'bcf');
+        cmd("$$opts{bin}/bcftools view -O$fmt $vcf > $file && $$opts{bin}/bcftools index -f $file");
+        my $cmd = "$$opts{bin}/bcftools index --chunks $args{nchunks} $args $file";
+        print "$test:\n\t$cmd\n";
+        my @chunks = grep { chomp; $_ ne '' } split(/\n/, cmd($cmd));
+        my %end = ();
+        my $err = '';
+        my $ntot = 0;
+        for my $chunk (@chunks)
+        {
+            my ($regs,$nbytes) = split(/\t/, $chunk);
+            for my $reg (split(/,/, $regs))
+            {
+                my ($chr,$beg,$end) = $reg=~/^([^:]+)(?::(\d+)-(\d*))?$/ or do { $err .= "\tCould not parse the region: $reg\n"; next; };
+                if ( !defined $beg ) { $beg = 1; $end = ''; }
+                my $exp = exists($end{$chr}) ? $end{$chr} + 1 : 1;
+                if ( $exp eq '' or $beg != $exp ) { $err .= "\tThe region $reg does not start at " . ($exp eq '' ? 'the end of the previous one' : $exp) . "\n"; }
+                $end{$chr} = $end eq '' ? '' : $end;
+            }
+            my $n = cmd("$$opts{bin}/bcftools view -H -r $regs $file | wc -l");
+            $n =~ s/\s+//g;
+            $ntot += $n;
+            if ( $n < $nrec/$args{nchunks}/2 or $n > $nrec/$args{nchunks}*2 ) { $err .= "\tUnbalanced chunk with $n records: $chunk\n"; }
+        }
+        if ( @chunks != $args{nchunks} ) { $err .= "\tExpected $args{nchunks} chunks, found ".scalar @chunks."\n"; }
+        for my $chr (1,2)
+        {
+            if ( !exists($end{$chr}) or $end{$chr} ne '' ) { $err .= "\tThe contig $chr is not covered to the end\n"; }
+        }
+        if ( $ntot != $nrec ) { $err .= "\tExpected $nrec records in the chunks, found $ntot\n"; }
+        if ( $err ) { failed($opts,$test,$err); next; }
+        passed($opts,$test);
+    }
+}
 sub test_vcf_idxstats
 {
     my ($opts,%args) = @_;
@@ -537,6 +721,13 @@ sub test_vcf_idxstats
     cmd("$$opts{bin}/bcftools view -Ob $$opts{path}/$args{in}.vcf > $$opts{tmp}/$args{in}.bcf");
     cmd("$$opts{bin}/bcftools index -f $$opts{tmp}/$args{in}.bcf");
     test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools index $args{args} $$opts{tmp}/$args{in}.bcf");
+
+    # parallel build
+    cmd("$$opts{bin}/bcftools index --threads 2 --tbi -f $$opts{tmp}/$args{in}.vcf.gz");
+    test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools index $args{args} $$opts{tmp}/$args{in}.vcf.gz");
+    unlink("$$opts{tmp}/$args{in}.vcf.gz.tbi");
+    cmd("$$opts{bin}/bcftools index --threads 2 -f $$opts{tmp}/$args{in}.bcf");
+    test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools index $args{args} $$opts{tmp}/$args{in}.bcf");
 }
 
 sub test_vcf_check
@@ -558,6 +749,325 @@ sub test_vcf_check_merge
     test_cmd($opts,%args,cmd=>"$$opts{bin}/misc/plot-vcfstats -m $$opts{tmp}/$args{in}.1.chk $$opts{tmp}/$args{in}.2.chk $$opts{tmp}/$args{in}.3.chk $$opts{tmp}/$args{in}.4.chk 2>/dev/null | grep -v 'plot-vcfstats' | grep -v '^# The command' | grep -v '^# This' | grep -v '^ID\t'");
 }
 
+# The --gt-cache is built by the first run and memory-mapped by the second,
+# both must match the output without the cache. The -g file has no ##contig
+# lines, the contigs are added to the header as the records are read.
+# Cross-check with -G on a generated file with more than 64 samples and more
+# sites than fit in one packed block. The CN counts must match those computed
+# here site by site, as process_GT() does.
+sub test_vcf_gtcheck_pairs
+{
+    my ($opts,%args) = @_;
+    my $nsmpl = 70;
+    my $vcf = "$$opts{tmp}/gtcheck.pairs.vcf";
+    open(my $fh,'>',$vcf) or error("$vcf: $!");
+    print $fh "##fileformat=VCFv4.2\n##contig=<ID=1>\n";
+    print $fh "##FORMAT=<ID=GT,Number=1,Type=String,Description=\"Genotype\">\n";
+    print $fh join("\t",'#CHROM','POS','ID','REF','ALT','QUAL','FILTER','INFO','FORMAT',map {"S$_"} (0..$nsmpl-1)) . "\n";
+    my $rand = 12345;
+    my $next = sub { $rand = ($rand*1103515245 + 12345) % 2147483648; return $rand / 2147483648; };
+    my (@ntot,@ndif);
+    for my $isite (0..4499)
+    {
+        my $nals = $isite%100==50 ? 3 : 2;
+        my (@gts,@cls);
+        for my $ismpl (0..$nsmpl-1)
+        {
+            if ( &$next() < 0.05 ) { push @gts,'./.'; push @cls,undef; next; }
+            my ($a,$b) = map { int(&$next()*$nals) } (0,1);
+            push @gts, "$a/$b";
+            push @cls, 1<<$a | 1<<$b;
+        }
+        for my $i (1..$nsmpl-1)
+        {
+            next if !defined $cls[$i];
+            for my $j (0..$i-1)
+            {
+                next if !defined $cls[$j];
+                $ntot[$i][$j]++;
+                if ( $cls[$i]!=$cls[$j] ) { $ndif[$i][$j]++; }
+            }
+        }
+        print $fh join("\t", 1, 1000+$isite*10, '.', 'A', $nals==2 ? 'C' : 'C,G', '.', '.', '.', 'GT', @gts) . "\n";
+    }
+    close($fh);
+    my $exp = '';
+    for my $i (1..$nsmpl-1)
+    {
+        for my $j (0..$i-1) { $exp .= join("\t",'CN',$ndif[$i][$j]//0,$ntot[$i][$j]//0,0,"S$i","S$j") . "\n"; }
+    }
+    test_cmd($opts,%args,exp=>$exp,out=>'gtcheck.pairs.out',cmd=>"$$opts{bin}/bcftools gtcheck $args{args} $vcf 2>/dev/null | grep ^CN");
+}
+# Without {in}, gtcheck_data() generates both the query and the -g file.
+sub test_vcf_gtcheck_cache
+{
+    my ($opts,%args) = @_;
+    my ($in,$src);
+    if ( exists($args{in}) )
+    {
+        bgzip_tabix_vcf($opts,$args{in});
+        $in  = "$$opts{tmp}/$args{in}.vcf.gz";
+        $src = "$$opts{path}/$args{gt}.vcf";
+    }
+    else
+    {
+        $args{gt} = 'gtcheck';
+        $src = gtcheck_data($opts);
+        $in  = "$$opts{tmp}/gtcheck.vcf.gz";
+        cmd("$$opts{bgzip} -c $src > $in && $$opts{tabix} -f -p vcf $in");
+    }
+    my $gt = "$$opts{tmp}/$args{gt}.nocontig.vcf.gz";
+    cmd("grep -v ^##contig $src | $$opts{bgzip} -c > $gt && $$opts{tabix} -f -p vcf $gt");
+    my $cmd = "$$opts{bin}/bcftools gtcheck $args{args} -g $gt";
+    my $exp = cmd("$cmd $in 2>/dev/null | grep -v ^#");
+    my $cache = "$$opts{tmp}/$args{gt}.gtx";
+    unlink($cache);
+    for my $run ('build','load')
+    {
+        test_cmd($opts,%args,exp=>$exp,out=>'gtcheck.cache.out',cmd=>"$cmd --gt-cache $cache $in 2>/dev/null | grep -v ^#");
+    }
+}
+# Three samples, GT only, with biallelic, 3-allelic and 25-allelic sites. The
+# genotype indexes of the latter do not fit in a byte.
+sub gtcheck_data
+{
+    my ($opts) = @_;
+    my $vcf = "$$opts{tmp}/gtcheck.vcf";
+    open(my $fh,'>',$vcf) or error("$vcf: $!");
+    print $fh "##fileformat=VCFv4.2\n##contig=<ID=1>\n";
+    print $fh "##FORMAT=<ID=GT,Number=1,Type=String,Description=\"Genotype\">\n";
+    print $fh "#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\tFORMAT\tA\tB\tC\n";
+    my @alts = map { 'A' x ($_+1) } (1..24);
+    for my $i (0..59)
+    {
+        my $nals = $i%10==5 ? 25 : ($i%10==7 ? 3 : 2);
+        my $alt  = $nals==2 ? 'C' : ($nals==3 ? 'C,G' : join(',',@alts));
+        my @gts  = ();
+        for my $ismpl (0..2)
+        {
+            my $a = ($i*7 + $ismpl*3) % $nals;
+            my $b = ($i*5 + $ismpl) % $nals;
+            push @gts, $i%13==$ismpl ? './.' : "$a/$b";
+        }
+        print $fh join("\t", 1, 1000 + $i*100, '.', 'A', $alt, '.', '.', '.', 'GT', @gts) . "\n";
+    }
+    close($fh);
+    return $vcf;
+}
+# The BAF and LRR test data with samples A and B: a deletion in the first
+# sample on contig 1. The BAF and LRR values are chosen so that the 16-bit
+# quantization of the --baf-cache is exact. The VCF has no ##contig lines and
+# the first contig spans two chunks of the cache.
+sub baf_data
+{
+    my ($opts) = @_;
+    my $vcf = "$$opts{tmp}/baf_cache.vcf";
+    open(my $fh,'>',$vcf) or error("$vcf: $!");
+    print $fh "##fileformat=VCFv4.2\n";
+    print $fh "##FORMAT=<ID=BAF,Number=1,Type=Float,Description=\"B Allele Frequency\">\n";
+    print $fh "##FORMAT=<ID=LRR,Number=1,Type=Float,Description=\"Log R Ratio\">\n";
+    print $fh "#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\tFORMAT\tA\tB\n";
+    my $rand = 12345;
+    my $next = sub { $rand = ($rand*1103515245 + 12345) % 2147483648; return $rand % 65535; };
+    my $baf  = sub
+    {
+        my ($del) = @_;
+        my $v = &$next();
+        my $het = !$del && $v%3==0;
+        $v = $het ? 32767 + $v%2001 - 1000 : ($v%2 ? $v%1500 : 65534 - $v%1500);
+        return sprintf("%.9g", unpack('f', pack('f', $v/65534)));
+    };
+    my $lrr = sub { my ($del) = @_; return (&$next() % 9 - 4 - ($del ? 4 : 0))/8; };
+    for my $chr ([1,20000],[2,3000])
+    {
+        for my $i (0..$$chr[1]-1)
+        {
+            my $del = $$chr[0]==1 && $i>=8000 && $i<12000;
+            print $fh join("\t", $$chr[0], 1000+$i*100, '.', 'A', 'C', '.', '.', '.', 'BAF:LRR',
+                &$baf($del).':'.&$lrr($del), &$baf(0).':'.&$lrr(0)) . "\n";
+        }
+    }
+    close($fh);
+    return $vcf;
+}
+# The --baf-cache is built by the first run and memory-mapped by the second,
+# both must match the output without the cache
+sub test_vcf_baf_cache
+{
+    my ($opts,%args) = @_;
+    if ( $args{cmd} eq 'polysomy' )
+    {
+        my ($ret,$out) = _cmd("$$opts{bin}/bcftools 2>&1");
+        if ( $out !~ /^\s+polysomy\s/m ) { return; }     # not compiled without USE_GPL
+    }
+    my $vcf = baf_data($opts);
+    my $dir = "$$opts{tmp}/baf_cache.$args{cmd}";
+    my $out = $args{cmd} eq 'cnv' ? "cat $dir/*.tab" : "cat $dir/dist.dat";
+    my $cmd = "rm -rf $dir && $$opts{bin}/bcftools $args{cmd} $args{args} -o $dir";
+    my $exp = cmd("$cmd $vcf 2>/dev/null && $out | grep -v ^#");
+    my $cache = "$$opts{tmp}/baf_cache.bin";
+    unlink($cache);
+    for my $run ('build','load')
+    {
+        test_cmd($opts,%args,exp=>$exp,out=>'baf_cache.out',cmd=>"$cmd --baf-cache $cache $vcf 2>/dev/null && $out | grep -v ^#");
+    }
+}
+# The chromosomes fitted on threads must give the same output as the
+# single-threaded run
+sub test_vcf_polysomy_threads
+{
+    my ($opts,%args) = @_;
+    my ($ret,$out) = _cmd("$$opts{bin}/bcftools 2>&1");
+    if ( $out !~ /^\s+polysomy\s/m ) { return; }     # not compiled without USE_GPL
+    my $vcf = baf_data($opts);
+    my $dir = "$$opts{tmp}/polysomy";
+    my $cmd = "rm -rf $dir && $$opts{bin}/bcftools polysomy $args{args} -o $dir";
+    my $exp = cmd("$cmd $vcf 2>/dev/null && cat $dir/dist.dat | grep -v ^#");
+    test_cmd($opts,%args,exp=>$exp,out=>'polysomy.threads.out',cmd=>"$cmd --threads 2 $vcf 2>/dev/null && cat $dir/dist.dat | grep -v ^#");
+}
+# All query samples from -S are called in one pass, the output of each must
+# match a separate -s run
+sub test_vcf_cnv_samples
+{
+    my ($opts,%args) = @_;
+    my $vcf  = baf_data($opts);
+    my $list = "$$opts{tmp}/cnv.samples.txt";
+    open(my $fh,'>',$list) or error("$list: $!");
+    print $fh "A\nB\n";
+    close($fh);
+    my $exp = '';
+    for my $smpl ('A','B')
+    {
+        my $dir = "$$opts{tmp}/cnv.$smpl";
+        $exp .= cmd("rm -rf $dir && $$opts{bin}/bcftools cnv -s $smpl -o $dir $vcf 2>/dev/null && cat $dir/*.tab | grep -v ^#");
+    }
+    my $dir = "$$opts{tmp}/cnv.samples";
+    test_cmd($opts,%args,exp=>$exp,out=>'cnv.samples.out',
+        cmd=>"rm -rf $dir && $$opts{bin}/bcftools cnv $args{args} -S $list -o $dir $vcf 2>/dev/null && cat $dir/A/*.tab $dir/B/*.tab | grep -v ^#");
+}
+# The roh test data: two contigs with a run of homozygous genotypes in the
+# first sample, records with different alleles at the same position and
+# genetic maps for both contigs, as a single file and by the {CHROM} mask
+sub roh_data
+{
+    my ($opts) = @_;
+    my $vcf = "$$opts{tmp}/roh.vcf";
+    open(my $fh,'>',$vcf) or error("$vcf: $!");
+    print $fh "##fileformat=VCFv4.2\n##contig=<ID=1>\n##contig=<ID=2>\n";
+    print $fh "##INFO=<ID=AF,Number=A,Type=Float,Description=\"Allele frequency\">\n";
+    print $fh "##INFO=<ID=AC,Number=A,Type=Integer,Description=\"Allele count\">\n";
+    print $fh "##INFO=<ID=AN,Number=1,Type=Integer,Description=\"Total number of alleles\">\n";
+    print $fh "##FORMAT=<ID=GT,Number=1,Type=String,Description=\"Genotype\">\n";
+    print $fh "#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\tFORMAT\tA\tB\tC\n";
+    my $rand = 54321;
+    my $next = sub { $rand = ($rand*1103515245 + 12345) % 2147483648; return $rand / 2147483648; };
+    for my $chr (1,2)
+    {
+        for my $i (0..1999)
+        {
+            my $pos = 1000 + $i*1000;
+            my @alts = $i%50 ? ('C') : ('C','G');
+            for my $alt (@alts)
+            {
+                my $af = $alt eq 'G' ? 0.6 : sprintf("%.2f", 0.05 + 0.45*&$next());
+                my @gts = ();
+                my $ac = 0;
+                for my $ismpl (0..2)
+                {
+                    my @gt = map { &$next() < $af ? 1 : 0 } (0,1);
+                    if ( $ismpl==0 && $chr==1 && $i>=600 && $i<1400 ) { @gt = ($gt[0],$gt[0]); }
+                    $ac += $gt[0] + $gt[1];
+                    push @gts, "$gt[0]/$gt[1]";
+                }
+                print $fh join("\t", $chr, $pos, '.', 'A', $alt, '.', '.', "AF=$af;AC=$ac;AN=6", 'GT', @gts) . "\n";
+            }
+        }
+    }
+    close($fh);
+
+    open(my $map,'>',"$$opts{tmp}/roh.map.txt") or error("$$opts{tmp}/roh.map.txt: $!");
+    print $map "position COMBINED_rate(cM/Mb) Genetic_Map(cM)\n";
+    for my $chr (1,2)
+    {
+        open(my $fmap,'>',"$$opts{tmp}/roh.map.$chr.txt") or error("$$opts{tmp}/roh.map.$chr.txt: $!");
+        print $fmap "position COMBINED_rate(cM/Mb) Genetic_Map(cM)\n";
+        my $cm = 0;
+        for (my $pos=1; $pos<2200000; $pos+=50000)
+        {
+            my $rate = $chr==1 ? 0.5 + ($pos % 300000)/100000 : 1.5;
+            if ( $chr==1 ) { printf $map "%d %f %f\n", $pos, $rate, $cm; }
+            printf $fmap "%d %f %f\n", $pos, $rate, $cm;
+            $cm += $rate*0.05;
+        }
+        close($fmap);
+    }
+    close($map);
+    return $vcf;
+}
+# The --AF-cache is built by the first run and memory-mapped by the second,
+# both must match the output without the cache
+# Train the n-fold maps and classify the sites of a generated annotation file
+# with and without --threads. The output, the evaluation and the maps must match.
+sub test_vcf_som_threads
+{
+    my ($opts,%args) = @_;
+    my $tab = "$$opts{tmp}/som.tab";
+    open(my $fh,'>',$tab) or error("$tab: $!");
+    my $rand = 4321;
+    my $next = sub { $rand = ($rand*1103515245 + 12345) % 2147483648; return $rand / 2147483648; };
+    for my $i (0..2999)
+    {
+        my $good = &$next() < 0.7 ? 1 : 0;
+        my @vals = map { sprintf("%.4f", $good ? 0.3 + 0.5*&$next() : 0.6*&$next()) } (0..2);
+        print $fh join("\t", $good ? 2 : 1, @vals) . "\n";
+    }
+    close($fh);
+    my ($p1,$p2) = ("$$opts{tmp}/som.1","$$opts{tmp}/som.2");
+    my $som = "$$opts{bin}/bcftools som $args{args}";
+    my $exp = cmd("$som --train -p $p1 $tab && cat $p1.eval && $som --classify -p $p1 $tab");
+    test_cmd($opts,%args,exp=>$exp,out=>'som.threads.out',
+        cmd=>"$som --train --threads 3 -p $p2 $tab && cat $p2.eval && $som --classify --threads 3 -p $p2 $tab && cmp $p1.som $p2.som");
+}
+# The --sample-threads output must match the single-threaded one
+sub test_vcf_roh_threads
+{
+    my ($opts,%args) = @_;
+    my $vcf = roh_data($opts);
+    my $cmd = "$$opts{bin}/bcftools roh $args{args} $vcf";
+    my $exp = cmd("$cmd 2>/dev/null | grep -v ^#");
+    test_cmd($opts,%args,exp=>$exp,out=>'roh.threads.out',cmd=>"$cmd --sample-threads 2 2>/dev/null | grep -v ^#");
+}
+sub test_vcf_roh_cache
+{
+    my ($opts,%args) = @_;
+    my $vcf = roh_data($opts);
+    my $cmd = "$$opts{bin}/bcftools roh $args{args} $vcf";
+    my $exp = cmd("$cmd 2>/dev/null | grep -v ^#");
+    my $cache = "$$opts{tmp}/roh.af.cache";
+    unlink($cache);
+    for my $run ('build','load')
+    {
+        test_cmd($opts,%args,exp=>$exp,out=>'roh.cache.out',cmd=>"$cmd --AF-cache $cache 2>/dev/null | grep -v ^#");
+    }
+}
+# The --genetic-map-index is built by the first run and memory-mapped by the
+# second, then given in place of the text map. All must match the output with
+# the text map.
+sub test_vcf_roh_genmap
+{
+    my ($opts,%args) = @_;
+    my $vcf = roh_data($opts);
+    my $cmd = "$$opts{bin}/bcftools roh $args{args} $vcf";
+    my $map = "'$$opts{tmp}/$args{map}'";
+    my $exp = cmd("$cmd -m $map 2>/dev/null | grep -v ^#");
+    my $idx = "$$opts{tmp}/roh.map.idx";
+    unlink($idx);
+    for my $run ('build','load')
+    {
+        test_cmd($opts,%args,exp=>$exp,out=>'roh.genmap.out',cmd=>"$cmd -m $map --genetic-map-index $idx 2>/dev/null | grep -v ^#");
+    }
+    test_cmd($opts,%args,exp=>$exp,out=>'roh.genmap.out',cmd=>"$cmd -m $idx 2>/dev/null | grep -v ^#");
+}
 sub test_vcf_stats
 {
     my ($opts,%args) = @_;
@@ -569,6 +1079,40 @@ sub test_vcf_stats
     }
     test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools stats $args{args} $files | grep -v '^#' | grep -v '^ID\t'");
 }
+# The --record-threads output must match the single-threaded one. Without
+# {in}, the generated roh.vcf is used, which spans several batches.
+sub test_vcf_stats_threads
+{
+    my ($opts,%args) = @_;
+    my $file = "$$opts{tmp}/roh.vcf";
+    if ( exists($args{in}) )
+    {
+        bgzip_tabix_vcf($opts,$args{in});
+        $file = "$$opts{tmp}/$args{in}.vcf.gz";
+    }
+    else { roh_data($opts); }
+    my $cmd = "$$opts{bin}/bcftools stats $args{args}";
+    my $exp = join('',grep { !/^#/ && !/^ID\t/ } `$cmd $file`);
+    test_cmd($opts,%args,exp=>$exp,out=>'stats.threads.out',cmd=>"$cmd --record-threads 2 $file | grep -v '^#' | grep -v '^ID\t'");
+}
+sub test_vcf_stats_merge
+{
+    my ($opts,%args) = @_;
+    my $files = '';
+    for my $file (@{$args{in}})
+    {
+        bgzip_tabix_vcf($opts,$file);
+        $files .= " $$opts{tmp}/$file.vcf.gz";
+    }
+    my @dumps;
+    for my $reg (@{$args{regions}})
+    {
+        my $dump = "$$opts{tmp}/$args{out}.".scalar(@dumps).".dump";
+        cmd("$$opts{bin}/bcftools stats $args{args} -r $reg --dump $dump $files > /dev/null");
+        push @dumps, $dump;
+    }
+    test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools stats --merge @dumps | grep -v '^#' | grep -v '^ID\t'");
+}
 sub test_vcf_merge
 {
     my ($opts,%args) = @_;
@@ -596,6 +1140,19 @@ sub test_vcf_isec
     test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools isec $args{args} $files 2>/dev/null");
     test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools isec -Ob $args{args} $files 2>/dev/null");
 }
+sub test_vcf_isec_bitmap
+{
+    my ($opts,%args) = @_;
+    my @files;
+    for my $file (@{$args{in}})
+    {
+        bgzip_tabix_vcf($opts,$file);
+        push @files, "$$opts{tmp}/$file.vcf.gz";
+    }
+    my $files = join(' ',@files);
+    cmd("$$opts{bin}/bcftools isec $args{args} --sites-bitmap $$opts{tmp}/$args{out}.bin -o /dev/null $files");
+    test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools isec --query-bitmap $$opts{tmp}/$args{out}.bin $args{query}");
+}
 sub test_vcf_isec2
 {
     my ($opts,%args) = @_;
@@ -617,6 +1174,253 @@ sub test_vcf_query
     test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools query $args{args} $$opts{tmp}/$args{in}.vcf.gz");
     test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools view -Ob $$opts{tmp}/$args{in}.vcf.gz | $$opts{bin}/bcftools query $args{args}");
 }
+# Decode the --columnar output and compare it with the text output of the same
+# format string. The per-sample columns must follow the site columns.
+sub test_vcf_query_columnar
+{
+    my ($opts,%args) = @_;
+    bgzip_tabix_vcf($opts,$args{in});
+    my $text = $args{args};
+    $text =~ s/\s*--record-threads\s+\d+//;
+    my $exp = cmd("$$opts{bin}/bcftools query $text $$opts{tmp}/$args{in}.vcf.gz");
+
+    my $cmd = "$$opts{bin}/bcftools query --columnar $args{args} $$opts{tmp}/$args{in}.vcf.gz";
+    print "test_vcf_query_columnar:\n";
+    print "\t$cmd\n";
+    my ($ret,$out) = _cmd($cmd);
+    if ( $ret ) { failed($opts,'test_vcf_query_columnar',"Non-zero status $ret"); return; }
+    $out = decode_columnar($out);
+    if ( $out ne $exp )
+    {
+        open(my $fh,'>',"$$opts{tmp}/$args{in}.columnar.out") or error("$$opts{tmp}/$args{in}.columnar.out: $!");
+        print $fh $out;
+        close($fh);
+        failed($opts,'test_vcf_query_columnar',"The decoded output differs from the text output, see $$opts{tmp}/$args{in}.columnar.out");
+        return;
+    }
+    passed($opts,'test_vcf_query_columnar');
+}
+sub columnar_u64
+{
+    my ($lo,$hi) = unpack('VV',$_[0]);
+    return $hi*4294967296 + $lo;
+}
+# The cells of one column of a chunk, formatted as in the text output
+sub columnar_cells
+{
+    my ($type,$dat,$ncells) = @_;
+    my @cells = ();
+    if ( $type==1 or $type==2 )
+    {
+        my $width = unpack('V',$dat);
+        my @vals  = unpack("V".($ncells*$width), substr($dat,4));
+        for (my $i=0; $i<$ncells; $i++)
+        {
+            my @out = ();
+            for (my $j=0; $j<$width; $j++)
+            {
+                my $val = $vals[$i*$width+$j];
+                if ( $type==1 )
+                {
+                    last if ( $val==0x80000001 );
+                    push @out, $val==0x80000000 ? '.' : unpack('l<',pack('V',$val));
+                }
+                else
+                {
+                    last if ( $val==0x7F800002 );
+                    push @out, $val==0x7F800001 ? '.' : sprintf("%g",unpack('f<',pack('V',$val)));
+                }
+            }
+            push @cells, join(',',@out);
+        }
+    }
+    elsif ( $type==3 )
+    {
+        my $ndict = unpack('V',$dat);
+        my @offs  = unpack("V".($ndict+1), substr($dat,4));
+        my $beg   = 4 + 4*($ndict+1);
+        my $strs  = substr($dat,$beg,$offs[$ndict]);
+        my $codes = $beg + $offs[$ndict];
+        $codes += (4 - $codes % 4) % 4;
+        for my $code (unpack("V$ncells", substr($dat,$codes)))
+        {
+            if ( $code==0xffffffff ) { push @cells, '.'; next; }
+            push @cells, unpack('Z*', substr($strs,$offs[$code]));
+        }
+    }
+    elsif ( $type==4 )
+    {
+        my ($ploidy,$nbits) = unpack('VV',$dat);
+        my $bits = substr($dat,8);
+        my $vector_end = (1<<$nbits) - 1;
+        my $ibit = 0;
+        for (my $i=0; $i<$ncells; $i++)
+        {
+            my $gt = '';
+            for (my $j=0; $j<$ploidy; $j++)
+            {
+                my $val = 0;
+                for (my $k=0; $k<$nbits; $k++) { $val |= vec($bits,$ibit++,1) << $k; }
+                next if ( $val==$vector_end );
+                if ( $j ) { $gt .= $val & 1 ? '|' : '/'; }
+                $gt .= $val>>1 ? ($val>>1) - 1 : '.';
+            }
+            push @cells, $gt;
+        }
+    }
+    else { error("Unknown column type: $type\n"); }
+    return \@cells;
+}
+# Convert the columnar output to text, the site columns first, then the
+# per-sample columns of each sample
+sub decode_columnar
+{
+    my ($buf) = @_;
+    if ( substr($buf,0,8) ne "BCFCOL\1\0" ) { error("Not a columnar output\n"); }
+    my $size = columnar_u64(substr($buf,8,8));
+    my $hdr  = substr($buf,16,$size);
+    my ($nsmpl,$ncols) = unpack('VV',$hdr);
+    my $off = 8;
+    for (my $i=0; $i<$nsmpl; $i++) { $off += length(unpack('Z*',substr($hdr,$off))) + 1; }
+    my @cols = ();
+    for (my $i=0; $i<$ncols; $i++)
+    {
+        my ($type,$per_sample) = unpack('CC',substr($hdr,$off,2));
+        my $name = unpack('Z*',substr($hdr,$off+2));
+        $off += 2 + length($name) + 1;
+        push @cols, { type=>$type, per_sample=>$per_sample, name=>$name };
+    }
+    my $out = '';
+    $off = 16 + $size;
+    while ( $off < length($buf) )
+    {
+        my $chunk_size = columnar_u64(substr($buf,$off,8));
+        my $chunk = substr($buf,$off+8,$chunk_size);
+        $off += 8 + $chunk_size;
+        my ($nrows,$nc) = unpack('VV',$chunk);
+        if ( $nc!=$ncols ) { error("Expected $ncols columns, found $nc\n"); }
+        my $coff = 8;
+        my @cells = ();
+        for (my $i=0; $i<$ncols; $i++)
+        {
+            my $col_size = columnar_u64(substr($chunk,$coff,8));
+            my $ncells = $cols[$i]{per_sample} ? $nrows*$nsmpl : $nrows;
+            push @cells, columnar_cells($cols[$i]{type}, substr($chunk,$coff+8,$col_size), $ncells);
+            $coff += 8 + $col_size;
+        }
+        for (my $irow=0; $irow<$nrows; $irow++)
+        {
+            my @row = ();
+            for (my $i=0; $i<$ncols; $i++) { push @row, $cells[$i][$irow] unless $cols[$i]{per_sample}; }
+            for (my $j=0; $j<$nsmpl; $j++)
+            {
+                for (my $i=0; $i<$ncols; $i++) { push @row, $cells[$i][$irow*$nsmpl+$j] if $cols[$i]{per_sample}; }
+            }
+            $out .= join("\t",@row)."\n";
+        }
+    }
+    return $out;
+}
+sub test_vcf_query_server
+{
+    my ($opts,%args) = @_;
+    bgzip_tabix_vcf($opts,$args{in});
+    my $regs = join('\\n',@{$args{regs}});
+    test_cmd($opts,%args,cmd=>"printf '$regs\\n' | $$opts{bin}/bcftools query --server $args{args} $$opts{tmp}/$args{in}.vcf.gz | grep -v ^#END");
+}
+# Check %TBCSQ and the TBCSQ filter on generated FORMAT/BCSQ bitmasks against
+# the consequences decoded here. Most samples share one of a few bitmasks,
+# many have none, and the consequences do not fit in a single integer. The
+# filter is tested per sample, the genotypes of failed samples are set to
+# missing by filter -S.
+sub test_vcf_query_tbcsq
+{
+    my ($opts,%args) = @_;
+    my @types = qw(missense synonymous stop_gained missense&inframe_altering splice_region&synonymous start_lost frameshift stop_lost);
+    my $vcf = "$$opts{tmp}/tbcsq.vcf";
+    open(my $fh,'>',$vcf) or error("$vcf: $!");
+    print $fh "##fileformat=VCFv4.2\n##contig=<ID=1>\n";
+    print $fh "##INFO=<ID=BCSQ,Number=.,Type=String,Description=\"Consequence\">\n";
+    print $fh "##FORMAT=<ID=GT,Number=1,Type=String,Description=\"Genotype\">\n";
+    print $fh "##FORMAT=<ID=BCSQ,Number=.,Type=Integer,Description=\"Bitmask of the INFO/BCSQ consequences\">\n";
+    print $fh join("\t",'#CHROM','POS','ID','REF','ALT','QUAL','FILTER','INFO','FORMAT',map { "S$_" } 0..99)."\n";
+    my $rand = 4321;
+    my $next = sub { $rand = ($rand*1103515245 + 12345) % 2147483648; return $rand >> 8; };
+    my $exp = '';
+    for my $pos (1..40)
+    {
+        my $ncsq = 1 + &$next() % 20;
+        my @csq  = map { $types[&$next() % @types]."|GENE$_|TR$pos|protein_coding|+|c.${pos}A>C" } 0..$ncsq-1;
+        # consequence 15 is not used, its second bit would make the first integer negative
+        my @bits = grep { $_!=15 } 0..$ncsq-1;
+        my $rand_mask = sub
+        {
+            my @mask = (0,0);
+            for my $icsq (@bits) { for my $hap (0,1) { if ( &$next()%5==0 ) { $mask[int($icsq/16)] |= 1 << (2*($icsq%16)+$hap); } } }
+            return \@mask;
+        };
+        my @shared = map { &$rand_mask() } 0..3;
+        my @smpl   = ();
+        for my $i (0..99)
+        {
+            my $r = &$next() % 10;
+            push @smpl, $r<3 ? [0,0] : $r<8 ? $shared[$r%4] : &$rand_mask();
+        }
+        print $fh join("\t",1,$pos*10,'.','A','C','.','.','BCSQ='.join(',',@csq),'GT:BCSQ',map { "0/1:$$_[0],$$_[1]" } @smpl)."\n";
+
+        my @lines = ();
+        for my $i (0..99)
+        {
+            my @hap = ([],[]);
+            for my $icsq (@bits)
+            {
+                for my $hap (0,1)
+                {
+                    if ( $smpl[$i][int($icsq/16)] & (1 << (2*($icsq%16)+$hap)) ) { push @{$hap[$hap]},$icsq; }
+                }
+            }
+            if ( exists($args{filter}) )
+            {
+                my ($op,$type) = $args{filter}=~/^TBCSQ([=~])"(.+)"$/ or error("Unexpected filter: $args{filter}\n");
+                my $pass = 0;
+                for my $icsq (@{$hap[0]},@{$hap[1]})
+                {
+                    my ($csq_type) = split(/\|/,$csq[$icsq]);
+                    if ( $op eq '~' ? index($csq_type,$type)>=0 : (grep { $_ eq $type } split(/&/,$csq_type)) ) { $pass = 1; last; }
+                }
+                push @lines, $pass ? "\t0/1" : "\t./.";
+                next;
+            }
+            my %merged = map { $_=>1 } (@{$hap[0]},@{$hap[1]});
+            my $hap1 = @{$hap[0]} ? join(',',map { $csq[$_] } @{$hap[0]}) : '.';
+            my $hap2 = @{$hap[1]} ? join(',',map { $csq[$_] } @{$hap[1]}) : '.';
+            my $out  = '';
+            if ( %merged )
+            {
+                if ( $args{subscript} eq '' ) { $out = "$hap1\t$hap2"; }
+                elsif ( $args{subscript}==0 ) { $out = join(',',map { $csq[$_] } sort { $a<=>$b } keys %merged); }
+                elsif ( $args{subscript}==1 ) { $out = $hap1; }
+                else { $out = $hap2; }
+            }
+            push @lines, "S$i\t$out\n";
+        }
+        if ( exists($args{filter}) ) { $exp .= $pos*10 . join('',@lines) . "\n"; }
+        else { $exp .= join('',@lines); }
+    }
+    close($fh);
+    my $subscript = exists($args{subscript}) && $args{subscript} ne '' ? "{$args{subscript}}" : '';
+    if ( exists($args{filter}) )
+    {
+        my $cmd = "$$opts{bin}/bcftools filter -S . -i '$args{filter}'";
+        my $query = "$$opts{bin}/bcftools query -f '%POS[\\t%GT]\\n'";
+        test_cmd($opts,%args,exp=>$exp,out=>'query.tbcsq.out',cmd=>"$cmd $vcf | $query");
+        test_cmd($opts,%args,exp=>$exp,out=>'query.tbcsq.out',cmd=>"$$opts{bin}/bcftools view -Ob $vcf | $cmd | $query");
+        return;
+    }
+    my $cmd = "$$opts{bin}/bcftools query -f '[%SAMPLE\\t%TBCSQ$subscript\\n]'";
+    test_cmd($opts,%args,exp=>$exp,out=>'query.tbcsq.out',cmd=>"$cmd $vcf");
+    test_cmd($opts,%args,exp=>$exp,out=>'query.tbcsq.out',cmd=>"$$opts{bin}/bcftools view -Ob $vcf | $cmd");
+}
 sub test_vcf_convert
 {
     my ($opts,%args) = @_;
@@ -641,6 +1445,7 @@ sub test_vcf_convert_hs2vcf
 sub test_vcf_convert_gvcf
 {
     my ($opts,%args) = @_;
+    $args{args} =~ s/{PATH}/$$opts{path}/g;
     bgzip_tabix_vcf($opts,$args{in});
     test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools convert --no-version $args{args} -f $$opts{path}/$args{fa} $$opts{tmp}/$args{in}.vcf.gz 2>/dev/null");
     test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools view -Ob $$opts{tmp}/$args{in}.vcf.gz | $$opts{bin}/bcftools convert $args{args} -f $$opts{path}/$args{fa} 2>/dev/null | grep -v ^##bcftools");
@@ -676,6 +1481,18 @@ sub test_vcf_view
         test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools view -Ob $args{args} $$opts{tmp}/$args{in}.vcf.gz $args{reg} | $$opts{bin}/bcftools view | grep -v ^##bcftools_");
     }
 }
+sub test_vcf_view_write_index
+{
+    my ($opts,%args) = @_;
+    bgzip_tabix_vcf($opts,$args{in});
+    my %sfx = (b=>'bcf', z=>'vcf.gz');
+    for my $type ('b','z')
+    {
+        my $out = "$$opts{tmp}/$args{in}.wi.$sfx{$type}";
+        cmd("$$opts{bin}/bcftools view --no-version -O$type --write-index -o $out $$opts{tmp}/$args{in}.vcf.gz");
+        test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools view --no-version $args{args} $out $args{reg}");
+    }
+}
 sub test_vcf_call
 {
     my ($opts,%args) = @_;
@@ -700,6 +1517,10 @@ sub test_vcf_filter
     }
     test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools filter $args{args} $$opts{path}/$args{in}.vcf | $pipe");
     test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools filter -Ob $args{args} $$opts{path}/$args{in}.vcf | $$opts{bin}/bcftools view | $pipe");
+    if ( !$args{bcf} ) { return; }
+    cmd("$$opts{bin}/bcftools view -Ob $$opts{path}/$args{in}.vcf > $$opts{tmp}/$args{in}.bcf");
+    test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools filter $args{args} $$opts{tmp}/$args{in}.bcf | $pipe");
+    test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools filter -Ob $args{args} $$opts{tmp}/$args{in}.bcf | $$opts{bin}/bcftools view | $pipe");
 }
 sub test_vcf_regions
 {
@@ -871,6 +1692,185 @@ sub test_vcf_plugin
     cmd("$$opts{bin}/bcftools index -f $$opts{tmp}/$args{in}.bcf");
     test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools $args{cmd} $$opts{tmp}/$args{in}.bcf $args{args} 2>/dev/null | grep -v ^##bcftools_");
 }
+# The regions tested on threads and in batches must give the same output as
+# the single-threaded run with one index query per region. The samples are
+# genotyped in windows of different lengths, so that each region reports a
+# different set of samples. There are more regions than the workers flush at
+# once, some of them overlapping or out of order.
+sub test_vcf_check_sparsity
+{
+    my ($opts,%args) = @_;
+    if ( !$$opts{test_plugins} ) { return; }
+    $ENV{BCFTOOLS_PLUGINS} = "$$opts{bin}/plugins";
+    my $src = "$$opts{tmp}/sparsity.vcf";
+    open(my $fh,'>',$src) or error("$src: $!");
+    print $fh "##fileformat=VCFv4.2\n##contig=<ID=1>\n##contig=<ID=2>\n";
+    print $fh "##FORMAT=<ID=GT,Number=1,Type=String,Description=\"Genotype\">\n";
+    print $fh join("\t",'#CHROM','POS','ID','REF','ALT','QUAL','FILTER','INFO','FORMAT',map { "S$_" } 0..7)."\n";
+    for my $chr (1,2)
+    {
+        for my $i (0..2999)
+        {
+            my @gts = map { int($i/(13+$_*5)) % ($_%3+2) == ($chr+$_)%2 ? ($i%3 ? '0/1' : '1/1') : './.' } 0..7;
+            print $fh join("\t",$chr,1000+$i*50,'.','A','C','.','.','.','GT',@gts)."\n";
+        }
+    }
+    close($fh);
+    my $regs = "$$opts{tmp}/sparsity.regs.txt";
+    open($fh,'>',$regs) or error("$regs: $!");
+    for my $i (0..399)
+    {
+        my $chr = $i<300 ? 1 : 2;
+        my $beg = 1000 + ($i%300)*480 + ($i%7)*40;
+        print $fh "$chr:$beg-".($beg + 200 + ($i%5)*150)."\n";
+        if ( $i%50==0 ) { print $fh "$chr:".($beg+300)."-".($beg+900)."\n"; }
+    }
+    print $fh "1:2000-5000\n2\n";
+    close($fh);
+    my $vcf = "$$opts{tmp}/sparsity.vcf.gz";
+    my $bcf = "$$opts{tmp}/sparsity.bcf";
+    cmd("$$opts{bgzip} -c $src > $vcf && $$opts{tabix} -f -p vcf $vcf");
+    cmd("$$opts{bin}/bcftools view -Ob -o $bcf $vcf && $$opts{bin}/bcftools index -f $bcf");
+    for my $file ($vcf,$bcf)
+    {
+        my $cmd = "$$opts{bin}/bcftools +check-sparsity $file -- -n 2";
+        my $exp = cmd("$cmd $args{regs}");
+        $exp .= cmd("$cmd -R $regs");
+        test_cmd($opts,%args,exp=>$exp,out=>'check-sparsity.out',cmd=>"$cmd $args{args} $args{regs} && $cmd $args{args} -R $regs");
+    }
+}
+# The INFO/INFO score from FORMAT/GP or INFO/R2 from FORMAT/DS must match the
+# value computed here, and the --record-threads run must give the same output
+# as the single-threaded run. The data include missing and truncated values,
+# a monomorphic site and sites which are left unchanged: one without the tag
+# and one multiallelic.
+sub test_vcf_impute_info
+{
+    my ($opts,%args) = @_;
+    if ( !$$opts{test_plugins} ) { return; }
+    $ENV{BCFTOOLS_PLUGINS} = "$$opts{bin}/plugins";
+    my $use_ds = $args{args}=~/-t\s*DS/ ? 1 : 0;
+    my $nsmpl  = 301;
+    my $vcf = "$$opts{tmp}/impute-info.vcf";
+    open(my $fh,'>',$vcf) or error("$vcf: $!");
+    print $fh "##fileformat=VCFv4.2\n##contig=<ID=1>\n";
+    print $fh "##FORMAT=<ID=GT,Number=1,Type=String,Description=\"Genotype\">\n";
+    print $fh "##FORMAT=<ID=GP,Number=G,Type=Float,Description=\"Genotype probabilities\">\n";
+    print $fh "##FORMAT=<ID=DS,Number=A,Type=Float,Description=\"Dosage\">\n";
+    print $fh join("\t",'#CHROM','POS','ID','REF','ALT','QUAL','FILTER','INFO','FORMAT',map { "S$_" } 1..$nsmpl)."\n";
+    my $rand = 2024;
+    my $next = sub { $rand = ($rand*1103515245 + 12345) % 2147483648; return ($rand >> 8) % 1000; };
+    my %exp = ();
+    for my $pos (1..200)
+    {
+        my $tag = $use_ds ? 'DS' : 'GP';
+        if ( $pos==50 ) { print $fh join("\t",1,$pos*10,'.','A','C','.','.','.','GT',('0/1')x$nsmpl)."\n"; next; }
+        if ( $pos==60 )
+        {
+            my $val = $use_ds ? '0.5,0.5' : '0.2,0.2,0.2,0.2,0.1,0.1';
+            print $fh join("\t",1,$pos*10,'.','A','C,G','.','.','.',$tag,($val)x$nsmpl)."\n";
+            next;
+        }
+        my $skew = $pos%3 ? 1000 : 200;     # the alt allele is rare at every third site
+        my ($esum,$e2sum,$fsum,$n) = (0,0,0,0);
+        my @smpl = ();
+        for my $i (1..$nsmpl)
+        {
+            my $r = &$next();
+            if ( $pos==70 ) { push @smpl, $use_ds ? '0' : '1,0,0'; $n++; next; }
+            if ( $r<20 ) { push @smpl, '.'; $n++ unless $use_ds; next; }
+            my @gp = (1000 + &$next(), &$next()%$skew, (&$next()%$skew)/2);
+            if ( !$use_ds && $r<40 ) { @gp = ($gp[0]); }          # truncated, the other values are missing
+            my $norm = 0; $norm += $_ for @gp;
+            @gp = map { sprintf("%.4f", $_/$norm) } @gp;
+            my @v = (@gp,0,0)[0..2];
+            my $sum = $v[0]+$v[1]+$v[2];
+            @v = map { $_/$sum } @v;
+            my $e = $v[1] + 2*$v[2];
+            if ( $use_ds ) { $e = sprintf("%.4f", $e); push @smpl, $e; }
+            else { push @smpl, join(',',@gp); }
+            $esum += $e; $e2sum += $e*$e; $fsum += $v[1] + 4*$v[2]; $n++;
+        }
+        print $fh join("\t",1,$pos*10,'.','A','C','.','.','.',$tag,@smpl)."\n";
+        my $theta = $use_ds ? $esum/$n/2 : $esum/(2*$n);
+        if ( !($theta>0 && $theta<1) ) { $exp{$pos*10} = 1; }
+        elsif ( $use_ds ) { $exp{$pos*10} = ($e2sum/$n - 4*$theta*$theta) / (2*$theta*(1-$theta)); }
+        else { $exp{$pos*10} = 1 - ($fsum - $e2sum) / (2*$n*$theta*(1-$theta)); }
+    }
+    close($fh);
+
+    my $tag = $use_ds ? 'R2' : 'INFO';
+    my $query = "$$opts{bin}/bcftools query -f '%POS\\t%INFO/$tag\\n'";
+    my $cmd = "$$opts{bin}/bcftools +impute-info $vcf -- $args{args} 2>/dev/null | $query";
+    print "test_vcf_impute_info:\n\t$cmd\n";
+    my $out = cmd($cmd);
+    my @err = ();
+    for my $line (split(/\n/,$out))
+    {
+        my ($pos,$val) = split(/\t/,$line);
+        if ( !exists($exp{$pos}) ) { if ( $val ne '.' ) { push @err,"$pos: expected no $tag, found $val"; } next; }
+        if ( $val eq '.' || abs($val - $exp{$pos}) > 1e-4 ) { push @err,"$pos: expected $exp{$pos}, found $val"; }
+        delete($exp{$pos});
+    }
+    for my $pos (sort { $a<=>$b } keys %exp) { push @err,"$pos: no output"; }
+    if ( @err ) { failed($opts,'test_vcf_impute_info',join("\n\t",@err)); }
+    else { passed($opts,'test_vcf_impute_info'); }
+
+    test_cmd($opts,%args,exp=>$out,out=>'impute-info.out',cmd=>"$$opts{bin}/bcftools +impute-info --record-threads 3 $vcf -- $args{args} 2>/dev/null | $query");
+}
+# The -i --rsid-cache is built by the first run and memory-mapped by the
+# second, both must match the output without the cache. The dbSNP file has no
+# ##contig lines and some of the query sites have the alleles swapped, an
+# unknown rsID or a contig missing from dbSNP.
+sub test_vcf_fixref_cache
+{
+    my ($opts,%args) = @_;
+    if ( !$$opts{test_plugins} ) { return; }
+    $ENV{BCFTOOLS_PLUGINS} = "$$opts{bin}/plugins";
+    my %seq = ();
+    my $chr;
+    open(my $fh,'<',"$$opts{path}/$args{fa}") or error("$$opts{path}/$args{fa}: $!");
+    while (my $line=<$fh>)
+    {
+        chomp($line);
+        if ( $line=~/^>(\S+)/ ) { $chr = $1; $seq{$chr} = ''; next; }
+        $seq{$chr} .= uc($line);
+    }
+    close($fh);
+
+    my $dbsnp = "$$opts{tmp}/fixref_cache.dbsnp.vcf";
+    my $query = "$$opts{tmp}/fixref_cache.vcf";
+    open(my $db,'>',$dbsnp) or error("$dbsnp: $!");
+    open(my $fq,'>',$query) or error("$query: $!");
+    print $db "##fileformat=VCFv4.2\n#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\n";
+    print $fq "##fileformat=VCFv4.2\n##contig=<ID=20>\n##contig=<ID=1>\n##contig=<ID=2>\n#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\n";
+    my $id = 1000;
+    for my $chr ('20','1','2')
+    {
+        for (my $pos=20; $pos<280; $pos+=3)
+        {
+            my $ref = substr($seq{$chr},$pos-1,1);
+            if ( $ref!~/^[ACGT]$/ ) { next; }
+            my $alt = $ref eq 'A' ? 'G' : 'A';
+            $id++;
+            if ( $chr ne '2' && $id%5 ) { print $db "$chr\t$pos\trs$id\t$ref\t$alt\t.\t.\t.\n"; }
+            my @als = $id%3 ? ($ref,$alt) : ($alt,$ref);
+            print $fq "$chr\t$pos\trs$id\t$als[0]\t$als[1]\t.\t.\t.\n";
+        }
+    }
+    close($db);
+    close($fq);
+    cmd("$$opts{bgzip} -c $dbsnp > $dbsnp.gz && $$opts{tabix} -f -p vcf $dbsnp.gz");
+
+    my $cmd = "$$opts{bin}/bcftools +fixref $query -- -f $$opts{path}/$args{fa} -i $dbsnp.gz $args{args}";
+    my $exp = cmd("$cmd 2>/dev/null | grep -v ^##bcftools_");
+    my $cache = "$$opts{tmp}/fixref_cache.rsx";
+    unlink($cache);
+    for my $run ('build','load')
+    {
+        test_cmd($opts,%args,exp=>$exp,out=>'fixref_cache.out',cmd=>"$cmd --rsid-cache $cache 2>/dev/null | grep -v ^##bcftools_");
+    }
+}
 sub test_vcf_concat
 {
     my ($opts,%args) = @_;
@@ -908,6 +1908,18 @@ sub test_vcf_reheader
         test_cmd($opts,%args,%bcf_args,cmd=>"cat $file | $$opts{bin}/bcftools reheader $arg | $$opts{bin}/bcftools view --no-version");
     }
 }
+sub test_vcf_sort
+{
+    my ($opts,%args) = @_;
+    my $exp = cmd("$$opts{bin}/bcftools view --no-version $$opts{path}/$args{in}.vcf");
+    cmd("(grep ^# $$opts{path}/$args{in}.vcf; grep -v ^# $$opts{path}/$args{in}.vcf | sort -r) > $$opts{tmp}/$args{in}.unsorted.vcf");
+    cmd("$$opts{bin}/bcftools view --no-version -Ob $$opts{tmp}/$args{in}.unsorted.vcf > $$opts{tmp}/$args{in}.unsorted.bcf");
+    for my $file ("$$opts{tmp}/$args{in}.unsorted.vcf","$$opts{tmp}/$args{in}.unsorted.bcf")
+    {
+        test_cmd($opts,%args,exp=>$exp,out=>'sort.out',cmd=>"$$opts{bin}/bcftools sort --no-version $args{args} $file");
+        test_cmd($opts,%args,exp=>$exp,out=>'sort.out',cmd=>"cat $file | $$opts{bin}/bcftools sort --no-version -Ou $args{args} | $$opts{bin}/bcftools view --no-version");
+    }
+}
 sub test_rename_chrs
 {
     my ($opts,%args) = @_;
@@ -928,6 +1940,12 @@ sub test_vcf_consensus
     bgzip_tabix_vcf($opts,$args{in});
     my $mask = $args{mask} ? "-m $$opts{path}/$args{mask}" : '';
     my $chain = $args{chain} ? "-c $$opts{tmp}/$args{chain}" : '';
+    if ( exists($args{prefix}) )
+    {
+        # one output file per sample, named <prefix><sample>.fa
+        test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools consensus $$opts{tmp}/$args{in}.vcf.gz -f $$opts{path}/$args{fa} $args{args} $mask -p $$opts{tmp}/$args{prefix} 2>/dev/null; cat $$opts{tmp}/$args{prefix}$args{sample}.fa");
+        return;
+    }
     test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools consensus $$opts{tmp}/$args{in}.vcf.gz -f $$opts{path}/$args{fa} $args{args} $mask $chain 2>/dev/null");
 }
 sub test_vcf_consensus_chain
@@ -935,6 +1953,12 @@ sub test_vcf_consensus_chain
     my ($opts,%args) = @_;
     bgzip_tabix_vcf($opts,$args{in});
     my $mask = $args{mask} ? "-m $$opts{path}/$args{mask}" : '';
+    if ( exists($args{prefix}) )
+    {
+        # one chain file per sample, named <prefix><sample>.chain
+        test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools consensus $$opts{tmp}/$args{in}.vcf.gz -f $$opts{path}/$args{fa} $args{args} $mask -p $$opts{tmp}/$args{prefix} -c $$opts{tmp}/$args{prefix} 2>/dev/null; cat $$opts{tmp}/$args{prefix}$args{sample}.chain");
+        return;
+    }
     my $chain = $args{chain} ? "-c $$opts{tmp}/$args{chain}.new" : '';
     test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools consensus $$opts{tmp}/$args{in}.vcf.gz -f $$opts{path}/$args{fa} $args{args} $mask $chain > /dev/null 2>/dev/null; cat $$opts{tmp}/$args{chain}.new");
 }
@@ -991,6 +2015,9 @@ sub test_naive_concat
 
     my $vcfs = join('.vcf.gz ',@files).'.vcf.gz';
     test_cmd($opts,exp=>$exp,out=>"concat.naive.vcf.out",cmd=>"$$opts{bin}/bcftools concat --naive $vcfs | $$opts{bin}/bcftools view -H");
+
+    test_cmd($opts,exp=>$exp,out=>"concat.naive.bcf.out",cmd=>"$$opts{bin}/bcftools concat --naive --naive-prefetch 3 $bcfs | $$opts{bin}/bcftools view -H");
+    test_cmd($opts,exp=>$exp,out=>"concat.naive.vcf.out",cmd=>"$$opts{bin}/bcftools concat --naive --naive-prefetch 3 $vcfs | $$opts{bin}/bcftools view -H");
 }
 
 sub test_mpileup
@@ -1038,6 +2065,7 @@ sub test_csq
 {
     my ($opts,%args) = @_;
     $args{cmd}  =~ s/{PATH}/$$opts{path}/g;
+    $args{cmd}  =~ s/{TMP}/$$opts{tmp}/g;
     test_cmd($opts,%args,cmd=>"$$opts{bin}/bcftools csq $args{cmd} $$opts{path}/$args{in}.vcf | $$opts{bin}/test/csq/sort-csq | $$opts{bin}/bcftools query -f'%POS\\t%REF\\t%ALT\\t%EXP\\n%POS\\t%REF\\t%ALT\\t%BCSQ\\n\\n'");
 }
 sub test_csq_real
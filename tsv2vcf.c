@@ -104,7 +104,15 @@ int tsv_setter_chrom(tsv_t *tsv, bcf1_t *rec, void *usr)
 
 int tsv_setter_pos(tsv_t *tsv, bcf1_t *rec, void *usr)
 {
-    char *endptr;
+    // plain digits are the common case, leave anything else to strtol
+    char *ss = tsv->ss, *endptr;
+    int32_t pos = 0;
+    while ( ss < tsv->se && ss - tsv->ss < 9 && *ss>='0' && *ss<='9' ) { pos = pos*10 + *ss - '0'; ss++; }
+    if ( ss==tsv->se && ss!=tsv->ss )
+    {
+        rec->pos = pos - 1;
+        return 0;
+    }
     rec->pos = strtol(tsv->ss, &endptr, 10) - 1;
     if ( tsv->ss==endptr ) return -1;
     return 0;
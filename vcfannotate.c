@@ -33,8 +33,10 @@ THE SOFTWARE.  */
 #include <sys/types.h>
 #include <dirent.h>
 #include <math.h>
+#include <pthread.h>
 #include <htslib/vcf.h>
 #include <htslib/synced_bcf_reader.h>
+#include <htslib/tbx.h>
 #include <htslib/kseq.h>
 #include <htslib/khash_str2int.h>
 #include <dlfcn.h>
@@ -43,6 +45,8 @@ THE SOFTWARE.  */
 #include "filter.h"
 #include "convert.h"
 #include "smpl_ilist.h"
+#include "profile.h"
+#include "cache.h"
 
 struct _args_t;
 
@@ -50,6 +54,7 @@ typedef struct _rm_tag_t
 {
     char *key;
     int hdr_id;
+    int packed;     // removed by remove_fields_packed(), the handler is the fallback
     void (*handler)(struct _args_t *, bcf1_t *, struct _rm_tag_t *);
 }
 rm_tag_t;
@@ -62,9 +67,93 @@ typedef struct
     int nals, mals;
     kstring_t line;
     int rid, start, end;
+    uint64_t irec;          // the record in the --annots-cache file
 }
 annot_line_t;
 
+// Streaming merge-join of tab-delimited annotations: the index is used only to
+// seek to a new sequence, the lines are then read and parsed sequentially on
+// a helper thread and passed to the main thread in batches
+#define ANNOT_STREAM_NLINES 4096
+#define ANNOT_STREAM_NBATCH 4
+typedef struct
+{
+    annot_line_t *lines;
+    int nlines, mlines;
+}
+annot_batch_t;
+
+typedef struct
+{
+    htsFile *fp;
+    tbx_t *tbx;
+    annot_batch_t batch[ANNOT_STREAM_NBATCH];
+    int ibeg, nfull;        // the ring of parsed batches, consumed from batch[ibeg]
+    int cur, iline;         // the main thread's current batch and line in the batch
+    int gen, done_gen;      // incremented on each seek; set to gen when the sequence is exhausted
+    int rid, pos, quit;     // the sequence requested by the main thread and the last position seen
+    kstring_t chr;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+}
+annot_stream_t;
+
+/*
+    The -a annotations cache written by --annots-cache, see cache.h, with the layout:
+        anx_hdr_t
+        columns     .. anx_col_t [ncol]
+        records     .. anx_rec_t, sorted by sequence and position
+        sequences   .. uint64_t index of the first record of each sequence [nseq+1],
+                       followed by NUL-terminated sequence names
+        values      .. for each column, uint64_t offsets of the record's values [nrec+1]
+                       followed by the values: int32_t for integers and flags, float for
+                       reals, NUL-terminated strings otherwise. Missing values are empty.
+    Only the columns required by -c are stored, numeric values are parsed once at build time.
+    The offsets are from the beginning of the file. The stamp covers the size and mtime of
+    the -a file and the stored columns.
+*/
+#define ANX_MAGIC "BCFANX\2"
+#define ANX_STR  0      // NUL-terminated string
+#define ANX_ALS  1      // ALT alleles, a list of NUL-terminated strings
+#define ANX_INT  2
+#define ANX_REAL 3
+#define ANX_FLAG 4
+
+typedef struct
+{
+    uint64_t ncol, nseq, nrec;
+    uint64_t rec_off, seq_off;
+}
+anx_hdr_t;
+
+typedef struct
+{
+    uint32_t icol, type;
+    uint64_t off, dat;      // file offsets of the value offsets and of the values
+}
+anx_col_t;
+
+typedef struct
+{
+    int32_t start, end, max_end;    // max_end: the running maximum of the ends within the sequence
+}
+anx_rec_t;
+
+typedef struct
+{
+    cache_t *cache;
+    uint8_t *map;
+    anx_hdr_t *hdr;
+    anx_col_t *col;
+    anx_rec_t *rec;
+    uint64_t *seq_beg;
+    void *seq2id;
+    int *str_col, nstr_col; // the string column of each -a column or -1, indexed by icol
+    int ref_col, als_col;
+}
+anx_t;
+
 #define REPLACE_MISSING  0  // replace only missing values
 #define REPLACE_ALL      1  // replace both missing and existing values
 #define REPLACE_NON_MISSING 2  // replace only if tgt is not missing
@@ -72,6 +161,7 @@ annot_line_t;
 typedef struct _annot_col_t
 {
     int icol, replace, number;  // number: one of BCF_VL_* types
+    int ianx;                   // the column in the --annots-cache file
     char *hdr_key_src, *hdr_key_dst;
     int (*setter)(struct _args_t *, bcf1_t *, struct _annot_col_t *, void*);
 }
@@ -89,8 +179,11 @@ typedef struct _args_t
     bcf_srs_t *files;
     bcf_hdr_t *hdr, *hdr_out;
     htsFile *out_fh;
-    int output_type, n_threads;
+    out_idx_t *out_idx;
+    int output_type, n_threads, write_index;
     bcf_sr_regions_t *tgts;
+    annot_stream_t *astream;
+    anx_t *anx;             // the -a annotations cache, see --annots-cache
 
     filter_t *filter;
     char *filter_str;
@@ -98,6 +191,8 @@ typedef struct _args_t
 
     rm_tag_t *rm;           // tags scheduled for removal
     int nrm;
+    uint8_t *rm_ids;        // RM_INFO|RM_FMT flags of INFO and FORMAT tags to remove, indexed by the header ID
+    int nrm_ids, rm_info, rm_fmt;
     int flt_keep_pass;      // when all filters removed, reset to PASS
 
     vcmp_t *vcmp;           // for matching annotation and VCF lines by allele
@@ -122,8 +217,8 @@ typedef struct _args_t
     kstring_t tmpks;
 
     char **argv, *output_fname, *targets_fname, *regions_list, *header_fname;
-    char *remove_annots, *columns, *rename_chrs, *sample_names, *mark_sites;
-    int argc, drop_header, record_cmd_line, tgts_is_vcf, mark_sites_logic;
+    char *remove_annots, *columns, *rename_chrs, *sample_names, *mark_sites, *anx_fname;
+    int argc, drop_header, record_cmd_line, tgts_is_vcf, mark_sites_logic, stream_annots;
 }
 args_t;
 
@@ -191,6 +286,114 @@ void remove_format(args_t *args, bcf1_t *line, rm_tag_t *tag)
     }
 }
 
+/*
+ *  INFO and FORMAT tags are removed in a single pass over the packed record,
+ *  copying the byte ranges of the kept fields in place. Removing the tags one
+ *  by one with bcf_update_info() and bcf_update_format() marks the record dirty
+ *  and the shared and indiv blocks are then re-encoded on output. Records which
+ *  have been modified already fall back to the handlers.
+ */
+#define RM_INFO 1
+#define RM_FMT  2
+static int remove_fields_packed(args_t *args, bcf1_t *line)
+{
+    if ( line->d.shared_dirty || line->d.indiv_dirty ) return -1;
+    int rm_fmt = args->rm_fmt && line->n_fmt;
+    if ( rm_fmt && !line->n_sample ) return -1;
+    bcf_unpack(line, rm_fmt ? BCF_UN_INFO|BCF_UN_FMT : BCF_UN_INFO);
+
+    int i, n;
+    for (i=0; i<line->n_info; i++)
+        if ( line->d.info[i].vptr_free ) return -1;
+    for (i=0; rm_fmt && i<line->n_fmt; i++)
+        if ( line->d.fmt[i].p_free ) return -1;
+
+    uint8_t *rm = args->rm_ids;
+    if ( args->rm_info && line->n_info )
+    {
+        uint8_t *dst = (uint8_t*)line->shared.s + line->unpack_size[0] + line->unpack_size[1] + line->unpack_size[2];
+        for (i=0,n=0; i<line->n_info; i++)
+        {
+            bcf_info_t *inf = &line->d.info[i];
+            if ( inf->key < args->nrm_ids && rm[inf->key] & RM_INFO ) continue;
+            uint8_t *src = inf->vptr - inf->vptr_off;
+            int len = inf->vptr_off + inf->vptr_len;
+            if ( src!=dst ) memmove(dst, src, len);
+            dst += len;
+            n++;
+        }
+        if ( n < line->n_info )
+        {
+            line->shared.l = dst - (uint8_t*)line->shared.s;
+            line->n_info = n;
+            line->unpacked &= ~BCF_UN_INFO;     // the pointers of d.info are no longer valid
+        }
+    }
+    if ( rm_fmt )
+    {
+        uint8_t *dst = (uint8_t*)line->indiv.s;
+        for (i=0,n=0; i<line->n_fmt; i++)
+        {
+            bcf_fmt_t *fmt = &line->d.fmt[i];
+            if ( fmt->id < args->nrm_ids && rm[fmt->id] & RM_FMT ) continue;
+            uint8_t *src = fmt->p - fmt->p_off;
+            int len = fmt->p_off + fmt->p_len;
+            if ( src!=dst ) memmove(dst, src, len);
+            dst += len;
+            n++;
+        }
+        if ( n < line->n_fmt )
+        {
+            line->indiv.l = dst - (uint8_t*)line->indiv.s;
+            line->n_fmt = n;
+            line->unpacked &= ~BCF_UN_FMT;
+        }
+    }
+    return 0;
+}
+static void remove_fields(args_t *args, bcf1_t *line)
+{
+    int i, packed = args->rm_ids && remove_fields_packed(args, line)==0 ? 1 : 0;
+    for (i=0; i<args->nrm; i++)
+    {
+        if ( packed && args->rm[i].packed ) continue;
+        args->rm[i].handler(args, line, &args->rm[i]);
+    }
+}
+// Set the flags of the tags which can be removed by remove_fields_packed()
+static void init_remove_fields_packed(args_t *args)
+{
+    int i, j;
+    args->nrm_ids = args->hdr->n[BCF_DT_ID];
+    args->rm_ids  = (uint8_t*) calloc(args->nrm_ids, 1);
+    for (i=0; i<args->nrm; i++)
+    {
+        rm_tag_t *tag = &args->rm[i];
+        if ( tag->handler==remove_info_tag || tag->handler==remove_format_tag )
+        {
+            int id = bcf_hdr_id2int(args->hdr, BCF_DT_ID, tag->key);
+            if ( id<0 ) continue;
+            if ( tag->handler==remove_info_tag ) { args->rm_ids[id] |= RM_INFO; args->rm_info = 1; }
+            else { args->rm_ids[id] |= RM_FMT; args->rm_fmt = 1; }
+        }
+        else if ( tag->handler==remove_info )
+        {
+            for (j=0; j<args->nrm_ids; j++) args->rm_ids[j] |= RM_INFO;
+            args->rm_info = 1;
+        }
+        else if ( tag->handler==remove_format )
+        {
+            int igt = bcf_hdr_id2int(args->hdr, BCF_DT_ID, "GT");
+            for (j=0; j<args->nrm_ids; j++)
+                if ( j!=igt ) args->rm_ids[j] |= RM_FMT;
+            args->rm_fmt = 1;
+        }
+        else continue;
+        tag->packed = 1;
+    }
+    if ( !args->rm_info && !args->rm_fmt ) { free(args->rm_ids); args->rm_ids = NULL; }
+}
+
 #include "htslib/khash.h"
 KHASH_MAP_INIT_STR(vdict, bcf_idinfo_t)
 typedef khash_t(vdict) vdict_t;
@@ -236,6 +439,7 @@ static void init_remove_annots(args_t *args)
         args->rm = (rm_tag_t*) realloc(args->rm,sizeof(rm_tag_t)*args->nrm);
         rm_tag_t *tag = &args->rm[args->nrm-1];
         tag->key = NULL;
+        tag->packed = 0;
 
         int type = BCF_HL_GEN;
         if ( !strncasecmp("INFO/",ss,5) ) { type = BCF_HL_INFO; ss += 5; }
@@ -346,6 +550,7 @@ static void init_remove_annots(args_t *args)
             args->nrm++;
             args->rm = (rm_tag_t*) realloc(args->rm,sizeof(rm_tag_t)*args->nrm);
             rm_tag_t *tag = &args->rm[args->nrm-1];
+            tag->packed = 0;
             if ( hrec->type==BCF_HL_INFO ) tag->handler = remove_info_tag;
             else if ( hrec->type==BCF_HL_FMT ) tag->handler = remove_format_tag;
             else 
@@ -360,6 +565,7 @@ static void init_remove_annots(args_t *args)
     khash_str2int_destroy_free(keep);
     if ( !args->nrm ) error("No matching tag in -x %s\n", args->remove_annots);
     bcf_hdr_sync(args->hdr_out);
+    init_remove_fields_packed(args);
 }
 static void init_header_lines(args_t *args)
 {
@@ -529,6 +735,21 @@ static int setter_ARinfo_int32(args_t *args, bcf1_t *line, annot_col_t *col, int
     bcf_update_info_int32(args->hdr_out,line,col->hdr_key_dst,args->tmpi2,ndst);
     return 0;
 }
+// Set INFO integers from the ntmpi values in args->tmpi
+static int core_setter_info_int(args_t *args, bcf1_t *line, annot_col_t *col, int nals, char **als, int ntmpi)
+{
+    if ( col->number==BCF_VL_A || col->number==BCF_VL_R ) 
+        return setter_ARinfo_int32(args,line,col,nals,als,ntmpi);
+
+    if ( col->replace==REPLACE_MISSING )
+    {
+        int ret = bcf_get_info_int32(args->hdr, line, col->hdr_key_dst, &args->tmpi2, &args->mtmpi2);
+        if ( ret>0 && args->tmpi2[0]!=bcf_int32_missing ) return 0;
+    }
+
+    bcf_update_info_int32(args->hdr_out,line,col->hdr_key_dst,args->tmpi,ntmpi);
+    return 0;
+}
 static int setter_info_int(args_t *args, bcf1_t *line, annot_col_t *col, void *data)
 {
     annot_line_t *tab = (annot_line_t*) data;
@@ -546,36 +767,14 @@ static int setter_info_int(args_t *args, bcf1_t *line, annot_col_t *col, void *d
         args->tmpi[ntmpi-1] = val;
         str = end+1;
     }
-
-    if ( col->number==BCF_VL_A || col->number==BCF_VL_R ) 
-        return setter_ARinfo_int32(args,line,col,tab->nals,tab->als,ntmpi);
-
-    if ( col->replace==REPLACE_MISSING )
-    {
-        int ret = bcf_get_info_int32(args->hdr, line, col->hdr_key_dst, &args->tmpi2, &args->mtmpi2);
-        if ( ret>0 && args->tmpi2[0]!=bcf_int32_missing ) return 0;
-    }
-
-    bcf_update_info_int32(args->hdr_out,line,col->hdr_key_dst,args->tmpi,ntmpi);
-    return 0;
+    return core_setter_info_int(args,line,col,tab->nals,tab->als,ntmpi);
 }
 static int vcf_setter_info_int(args_t *args, bcf1_t *line, annot_col_t *col, void *data)
 {
     bcf1_t *rec = (bcf1_t*) data;
     int ntmpi = bcf_get_info_int32(args->files->readers[1].header,rec,col->hdr_key_src,&args->tmpi,&args->mtmpi);
     if ( ntmpi < 0 ) return 0;    // nothing to add
-
-    if ( col->number==BCF_VL_A || col->number==BCF_VL_R ) 
-        return setter_ARinfo_int32(args,line,col,rec->n_allele,rec->d.allele,ntmpi);
-
-    if ( col->replace==REPLACE_MISSING )
-    {
-        int ret = bcf_get_info_int32(args->hdr, line, col->hdr_key_dst, &args->tmpi2, &args->mtmpi2);
-        if ( ret>0 && args->tmpi2[0]!=bcf_int32_missing ) return 0;
-    }
-
-    bcf_update_info_int32(args->hdr_out,line,col->hdr_key_dst,args->tmpi,ntmpi);
-    return 0;
+    return core_setter_info_int(args,line,col,rec->n_allele,rec->d.allele,ntmpi);
 }
 static int setter_ARinfo_real(args_t *args, bcf1_t *line, annot_col_t *col, int nals, char **als, int ntmpf)
 {
@@ -609,6 +808,21 @@ static int setter_ARinfo_real(args_t *args, bcf1_t *line, annot_col_t *col, int
     bcf_update_info_float(args->hdr_out,line,col->hdr_key_dst,args->tmpf2,ndst);
     return 0;
 }
+// Set INFO reals from the ntmpf values in args->tmpf
+static int core_setter_info_real(args_t *args, bcf1_t *line, annot_col_t *col, int nals, char **als, int ntmpf)
+{
+    if ( col->number==BCF_VL_A || col->number==BCF_VL_R ) 
+        return setter_ARinfo_real(args,line,col,nals,als,ntmpf);
+
+    if ( col->replace==REPLACE_MISSING )
+    {
+        int ret = bcf_get_info_float(args->hdr, line, col->hdr_key_dst, &args->tmpf2, &args->mtmpf2);
+        if ( ret>0 && !bcf_float_is_missing(args->tmpf2[0]) ) return 0;
+    }
+
+    bcf_update_info_float(args->hdr_out,line,col->hdr_key_dst,args->tmpf,ntmpf);
+    return 0;
+}
 static int setter_info_real(args_t *args, bcf1_t *line, annot_col_t *col, void *data)
 {
     annot_line_t *tab = (annot_line_t*) data;
@@ -626,36 +840,14 @@ static int setter_info_real(args_t *args, bcf1_t *line, annot_col_t *col, void *
         args->tmpf[ntmpf-1] = val;
         str = end+1;
     }
-
-    if ( col->number==BCF_VL_A || col->number==BCF_VL_R ) 
-        return setter_ARinfo_real(args,line,col,tab->nals,tab->als,ntmpf);
-
-    if ( col->replace==REPLACE_MISSING )
-    {
-        int ret = bcf_get_info_float(args->hdr, line, col->hdr_key_dst, &args->tmpf2, &args->mtmpf2);
-        if ( ret>0 && !bcf_float_is_missing(args->tmpf2[0]) ) return 0;
-    }
-
-    bcf_update_info_float(args->hdr_out,line,col->hdr_key_dst,args->tmpf,ntmpf);
-    return 0;
+    return core_setter_info_real(args,line,col,tab->nals,tab->als,ntmpf);
 }
 static int vcf_setter_info_real(args_t *args, bcf1_t *line, annot_col_t *col, void *data)
 {
     bcf1_t *rec = (bcf1_t*) data;
     int ntmpf = bcf_get_info_float(args->files->readers[1].header,rec,col->hdr_key_src,&args->tmpf,&args->mtmpf);
     if ( ntmpf < 0 ) return 0;    // nothing to add
-
-    if ( col->number==BCF_VL_A || col->number==BCF_VL_R ) 
-        return setter_ARinfo_real(args,line,col,rec->n_allele,rec->d.allele,ntmpf);
-
-    if ( col->replace==REPLACE_MISSING )
-    {
-        int ret = bcf_get_info_float(args->hdr, line, col->hdr_key_dst, &args->tmpf2, &args->mtmpf2);
-        if ( ret>0 && !bcf_float_is_missing(args->tmpf2[0]) ) return 0;
-    }
-
-    bcf_update_info_float(args->hdr_out,line,col->hdr_key_dst,args->tmpf,ntmpf);
-    return 0;
+    return core_setter_info_real(args,line,col,rec->n_allele,rec->d.allele,ntmpf);
 }
 int copy_string_field(char *src, int isrc, int src_len, kstring_t *dst, int idst); // see vcfmerge.c
 static int setter_ARinfo_string(args_t *args, bcf1_t *line, annot_col_t *col, int nals, char **als)
@@ -1393,6 +1585,7 @@ static void init_columns(args_t *args)
             if ( replace==SET_OR_APPEND ) error("Apologies, the =INFO/TAG feature has not been implemented yet.\n");
             bcf_hdr_t *tgts_hdr = args->files->readers[1].header;
             int j;
+            // add all header lines first and sync only once, the output header can carry many samples
             for (j=0; j<tgts_hdr->nhrec; j++)
             {
                 bcf_hrec_t *hrec = tgts_hdr->hrec[j];
@@ -1403,7 +1596,14 @@ static void init_columns(args_t *args)
                 tmp.l = 0;
                 bcf_hrec_format(hrec, &tmp);
                 bcf_hdr_append(args->hdr_out, tmp.s);
-                bcf_hdr_sync(args->hdr_out);
+            }
+            bcf_hdr_sync(args->hdr_out);
+            for (j=0; j<tgts_hdr->nhrec; j++)
+            {
+                bcf_hrec_t *hrec = tgts_hdr->hrec[j];
+                if ( hrec->type!=BCF_HL_INFO ) continue;
+                int k = bcf_hrec_find_key(hrec,"ID");
+                if ( skip_info && khash_str2int_has_key(skip_info,hrec->vals[k]) ) continue;
                 int hdr_id = bcf_hdr_id2int(args->hdr_out, BCF_DT_ID, hrec->vals[k]);
                 args->ncols++; args->cols = (annot_col_t*) realloc(args->cols,sizeof(annot_col_t)*args->ncols);
                 annot_col_t *col = &args->cols[args->ncols-1];
@@ -1427,6 +1627,7 @@ static void init_columns(args_t *args)
             bcf_hdr_t *tgts_hdr = args->files->readers[1].header;
             need_sample_map = 1;
             int j;
+            // add all header lines first and sync only once, the output header can carry many samples
             for (j=0; j<tgts_hdr->nhrec; j++)
             {
                 bcf_hrec_t *hrec = tgts_hdr->hrec[j];
@@ -1437,7 +1638,14 @@ static void init_columns(args_t *args)
                 tmp.l = 0;
                 bcf_hrec_format(hrec, &tmp);
                 bcf_hdr_append(args->hdr_out, tmp.s);
-                bcf_hdr_sync(args->hdr_out);
+            }
+            bcf_hdr_sync(args->hdr_out);
+            for (j=0; j<tgts_hdr->nhrec; j++)
+            {
+                bcf_hrec_t *hrec = tgts_hdr->hrec[j];
+                if ( hrec->type!=BCF_HL_FMT) continue;
+                int k = bcf_hrec_find_key(hrec,"ID");
+                if ( skip_fmt && khash_str2int_has_key(skip_fmt,hrec->vals[k]) ) continue;
                 int hdr_id = bcf_hdr_id2int(args->hdr_out, BCF_DT_ID, hrec->vals[k]);
                 args->ncols++; args->cols = (annot_col_t*) realloc(args->cols,sizeof(annot_col_t)*args->ncols);
                 annot_col_t *col = &args->cols[args->ncols-1];
@@ -1605,6 +1813,619 @@ static void rename_chrs(args_t *args, char *fname)
     free(map);
 }
 
+static void parse_annot_line(args_t *args, char *str, annot_line_t *tmp)
+{
+    tmp->line.l = 0;
+    kputs(str, &tmp->line);
+    char *s = tmp->line.s;
+    tmp->ncols = 1;
+    hts_expand(char*,tmp->ncols,tmp->mcols,tmp->cols);
+    tmp->cols[0] = s;
+    while ( *s )
+    {
+        if ( *s=='\t' )
+        {
+            tmp->ncols++;
+            hts_expand(char*,tmp->ncols,tmp->mcols,tmp->cols);
+            tmp->cols[tmp->ncols-1] = s+1;
+            *s = 0;
+        }
+        s++;
+    }
+    if ( args->ref_idx != -1 )
+    {
+        if ( args->ref_idx >= tmp->ncols ) 
+            error("Could not parse the line, expected %d+ columns, found %d:\n\t%s\n",args->ref_idx+1,tmp->ncols,str);
+        if ( args->alt_idx >= tmp->ncols )
+            error("Could not parse the line, expected %d+ columns, found %d:\n\t%s\n",args->alt_idx+1,tmp->ncols,str);
+        tmp->nals = 2;
+        hts_expand(char*,tmp->nals,tmp->mals,tmp->als);
+        tmp->als[0] = tmp->cols[args->ref_idx];
+        tmp->als[1] = s = tmp->cols[args->alt_idx];
+        while ( *s )
+        {
+            if ( *s==',' )
+            {
+                tmp->nals++;
+                hts_expand(char*,tmp->nals,tmp->mals,tmp->als);
+                tmp->als[tmp->nals-1] = s+1;
+                *s = 0;
+            }
+            s++;
+        }
+    }
+}
+
+// Parse the coordinates the same way bcf_sr_regions does for indexed files
+static void parse_annot_coords(tbx_conf_t *conf, char *str, annot_line_t *tmp)
+{
+    int ibeg = conf->bc - 1, iend = conf->ec ? conf->ec - 1 : ibeg;
+    if ( ibeg >= tmp->ncols || iend >= tmp->ncols )
+        error("Could not parse the line, expected %d+ columns, found %d:\n\t%s\n",(ibeg>iend?ibeg:iend)+1,tmp->ncols,str);
+    char *end;
+    int from = strtol(tmp->cols[ibeg], &end, 10);
+    if ( end==tmp->cols[ibeg] ) error("Could not parse the line: %s\n", str);
+    int to = from;
+    if ( iend!=ibeg )
+    {
+        to = strtol(tmp->cols[iend], &end, 10);
+        if ( end==tmp->cols[iend] ) error("Could not parse the line: %s\n", str);
+    }
+    if ( conf->preset & TBX_UCSC ) from++;
+    tmp->start = from - 1;
+    tmp->end   = to - 1;
+}
+
+static void *annot_stream_worker(void *arg)
+{
+    args_t *args = (args_t*) arg;
+    annot_stream_t *as = args->astream;
+    kstring_t str = {0,0,0}, chr = {0,0,0};
+    hts_itr_t *itr = NULL;
+
+    pthread_mutex_lock(&as->lock);
+    while (1)
+    {
+        while ( !as->quit && as->done_gen==as->gen ) pthread_cond_wait(&as->cond, &as->lock);
+        if ( as->quit ) break;
+
+        int gen = as->gen, rid = as->rid;
+        chr.l = 0;
+        kputs(as->chr.s, &chr);
+        pthread_mutex_unlock(&as->lock);
+
+        if ( itr ) tbx_itr_destroy(itr);
+        itr = tbx_itr_querys(as->tbx, chr.s);
+        int eof = itr ? 0 : 1;
+
+        pthread_mutex_lock(&as->lock);
+        while (1)
+        {
+            while ( as->nfull==ANNOT_STREAM_NBATCH && gen==as->gen && !as->quit ) pthread_cond_wait(&as->cond, &as->lock);
+            if ( gen!=as->gen || as->quit ) break;
+            annot_batch_t *batch = &as->batch[(as->ibeg + as->nfull) % ANNOT_STREAM_NBATCH];
+            pthread_mutex_unlock(&as->lock);
+
+            batch->nlines = 0;
+            while ( !eof && batch->nlines < ANNOT_STREAM_NLINES )
+            {
+                if ( tbx_itr_next(as->fp, as->tbx, itr, &str) < 0 ) { eof = 1; break; }
+                batch->nlines++;
+                hts_expand0(annot_line_t,batch->nlines,batch->mlines,batch->lines);
+                annot_line_t *tmp = &batch->lines[batch->nlines-1];
+                parse_annot_line(args, str.s, tmp);
+                parse_annot_coords(&as->tbx->conf, str.s, tmp);
+                tmp->rid = rid;
+            }
+
+            pthread_mutex_lock(&as->lock);
+            if ( gen!=as->gen || as->quit ) break;  // the main thread moved on, discard the batch
+            as->nfull++;
+            if ( eof ) as->done_gen = gen;
+            pthread_cond_broadcast(&as->cond);
+            if ( eof ) break;
+        }
+    }
+    pthread_mutex_unlock(&as->lock);
+
+    if ( itr ) tbx_itr_destroy(itr);
+    free(str.s);
+    free(chr.s);
+    return NULL;
+}
+
+static void annot_stream_init(args_t *args)
+{
+    annot_stream_t *as = (annot_stream_t*) calloc(1,sizeof(annot_stream_t));
+    args->astream = as;
+    as->fp = hts_open(args->targets_fname,"r");
+    if ( !as->fp ) error("Could not read %s\n", args->targets_fname);
+    as->tbx = tbx_index_load(args->targets_fname);
+    if ( !as->tbx ) error("Expected tabix-indexed annotation file: %s\n", args->targets_fname);
+    as->cur = -1;
+    as->rid = -1;
+    pthread_mutex_init(&as->lock, NULL);
+    pthread_cond_init(&as->cond, NULL);
+    if ( pthread_create(&as->thread, NULL, annot_stream_worker, args) ) error("Failed to create threads\n");
+}
+
+static void annot_stream_destroy(annot_stream_t *as)
+{
+    pthread_mutex_lock(&as->lock);
+    as->quit = 1;
+    pthread_cond_broadcast(&as->cond);
+    pthread_mutex_unlock(&as->lock);
+    pthread_join(as->thread, NULL);
+    pthread_mutex_destroy(&as->lock);
+    pthread_cond_destroy(&as->cond);
+
+    int i, j;
+    for (i=0; i<ANNOT_STREAM_NBATCH; i++)
+    {
+        for (j=0; j<as->batch[i].mlines; j++)
+        {
+            free(as->batch[i].lines[j].cols);
+            free(as->batch[i].lines[j].als);
+            free(as->batch[i].lines[j].line.s);
+        }
+        free(as->batch[i].lines);
+    }
+    free(as->chr.s);
+    tbx_destroy(as->tbx);
+    if ( hts_close(as->fp) ) error("Close failed: %s\n", as->fp->fn);
+    free(as);
+}
+
+// Restart reading at the beginning of a sequence, the batches parsed so far are discarded
+static void annot_stream_seek(annot_stream_t *as, const char *chr, int rid)
+{
+    pthread_mutex_lock(&as->lock);
+    as->gen++;
+    as->rid = rid;
+    as->chr.l = 0;
+    kputs(chr, &as->chr);
+    as->ibeg = as->nfull = 0;
+    as->cur = -1;
+    pthread_cond_broadcast(&as->cond);
+    pthread_mutex_unlock(&as->lock);
+}
+
+// Returns the next unconsumed annotation line or NULL when the sequence is exhausted
+static annot_line_t *annot_stream_peek(annot_stream_t *as)
+{
+    while (1)
+    {
+        if ( as->cur>=0 && as->iline < as->batch[as->cur].nlines ) return &as->batch[as->cur].lines[as->iline];
+
+        pthread_mutex_lock(&as->lock);
+        if ( as->cur>=0 )
+        {
+            as->ibeg = (as->ibeg + 1) % ANNOT_STREAM_NBATCH;
+            as->nfull--;
+            as->cur = -1;
+            pthread_cond_broadcast(&as->cond);
+        }
+        while ( !as->nfull && as->done_gen!=as->gen ) pthread_cond_wait(&as->cond, &as->lock);
+        if ( as->nfull )
+        {
+            profile_queue(PROFQ_ANNOTS, as->nfull);
+            as->cur = as->ibeg;
+            as->iline = 0;
+        }
+        pthread_mutex_unlock(&as->lock);
+        if ( as->cur<0 ) return NULL;
+    }
+}
+
+static void stream_annot_lines(args_t *args, bcf1_t *line, int start_pos, int end_pos)
+{
+    annot_stream_t *as = args->astream;
+    if ( line->rid!=as->rid || line->pos < as->pos )
+    {
+        // new sequence or the records are not sorted, the only time the index is used
+        annot_stream_seek(as, bcf_seqname(args->hdr,line), line->rid);
+        args->nalines = 0;
+    }
+    as->pos = line->pos;
+
+    annot_line_t *tmp;
+    while ( (tmp = annot_stream_peek(as)) )
+    {
+        if ( tmp->end < line->pos ) { as->iline++; continue; }    // cannot overlap this or any later record
+        if ( tmp->start > end_pos ) break;
+
+        // take over the parsed line, the batch gets the spare one in exchange
+        args->nalines++;
+        hts_expand0(annot_line_t,args->nalines,args->malines,args->alines);
+        annot_line_t swap = args->alines[args->nalines-1];
+        args->alines[args->nalines-1] = *tmp;
+        *tmp = swap;
+        as->iline++;
+    }
+}
+
+static char anx_missing[] = ".";
+
+static void anx_write(FILE *fp, const char *fname, const void *ptr, size_t size)
+{
+    if ( size && fwrite(ptr, size, 1, fp)!=1 ) error("Failed to write %s: %s\n", fname, strerror(errno));
+}
+
+// Append the temporary file to the cache and close it
+static void anx_copy(cache_t *cache, FILE *tmp)
+{
+    char buf[65536];
+    size_t n;
+    rewind(tmp);
+    while ( (n = fread(buf, 1, sizeof(buf), tmp)) > 0 ) cache_write(cache, buf, n);
+    if ( ferror(tmp) ) error("Failed to read a temporary file: %s\n", strerror(errno));
+    fclose(tmp);
+}
+
+static FILE *anx_tmpfile(void)
+{
+    FILE *fp = tmpfile();
+    if ( !fp ) error("Failed to create a temporary file: %s\n", strerror(errno));
+    return fp;
+}
+
+// Parse the values of one column and write them to the column file, returns the number of bytes written
+static uint64_t anx_put_values(args_t *args, anx_col_t *col, annot_line_t *tab, FILE *fp, const char *line)
+{
+    char *str = tab->cols[col->icol], *end = str;
+    uint64_t len = 0;
+    int i;
+    if ( col->type==ANX_STR )
+    {
+        len = strlen(str) + 1;
+        anx_write(fp, "a temporary file", str, len);
+        return len;
+    }
+    if ( col->type==ANX_ALS )
+    {
+        for (i=1; i<tab->nals; i++)
+        {
+            size_t l = strlen(tab->als[i]) + 1;
+            anx_write(fp, "a temporary file", tab->als[i], l);
+            len += l;
+        }
+        return len;
+    }
+    if ( str[0]=='.' && str[1]==0 ) return 0;   // missing value, nothing to set
+    if ( col->type==ANX_FLAG )
+    {
+        int32_t val;
+        if ( str[0]=='1' && str[1]==0 ) val = 1;
+        else if ( str[0]=='0' && str[1]==0 ) val = 0;
+        else error("Could not parse the flag [%s]:\n\t%s\n", str, line);
+        anx_write(fp, "a temporary file", &val, sizeof(val));
+        return sizeof(val);
+    }
+    while ( *end )
+    {
+        if ( col->type==ANX_INT )
+        {
+            int32_t val = strtol(str, &end, 10);
+            if ( end==str ) error("Could not parse the integer [%s]:\n\t%s\n", tab->cols[col->icol], line);
+            anx_write(fp, "a temporary file", &val, sizeof(val));
+            len += sizeof(val);
+        }
+        else
+        {
+            float val = strtod(str, &end);
+            if ( end==str ) error("Could not parse the real [%s]:\n\t%s\n", tab->cols[col->icol], line);
+            anx_write(fp, "a temporary file", &val, sizeof(val));
+            len += sizeof(val);
+        }
+        str = end+1;
+    }
+    return len;
+}
+
+// Read the tab-delimited -a file and write the annotations cache with the columns requested
+static void anx_build(args_t *args, uint64_t stamp, anx_col_t *cols, int ncols)
+{
+    tbx_t *tbx = tbx_index_load(args->targets_fname);
+    if ( !tbx ) error("Expected tabix-indexed annotation file: %s\n", args->targets_fname);
+    htsFile *fp = hts_open(args->targets_fname, "r");
+    if ( !fp ) error("Failed to read %s\n", args->targets_fname);
+
+    cache_t *out = cache_create(args->anx_fname, ANX_MAGIC, stamp);
+    anx_hdr_t anx_hdr;
+    memset(&anx_hdr, 0, sizeof(anx_hdr));
+    anx_hdr.ncol = ncols;
+    uint64_t hdr_off = out->off;
+    cache_write(out, &anx_hdr, sizeof(anx_hdr));
+    cache_write(out, cols, sizeof(*cols)*ncols);    // rewritten with the offsets at the end
+
+    // the records and each column are collected in temporary files, then concatenated
+    int i, nseq = 0, mseq = 0, ncols_min = tbx->conf.sc, nskip = tbx->conf.line_skip;
+    FILE *rec_fp = anx_tmpfile();
+    FILE **off_fp = (FILE**) malloc(sizeof(FILE*)*ncols);
+    FILE **dat_fp = (FILE**) malloc(sizeof(FILE*)*ncols);
+    uint64_t *dat_len = (uint64_t*) calloc(ncols, sizeof(uint64_t));
+    for (i=0; i<ncols; i++)
+    {
+        off_fp[i] = anx_tmpfile();
+        dat_fp[i] = anx_tmpfile();
+        if ( ncols_min < cols[i].icol+1 ) ncols_min = cols[i].icol+1;
+    }
+
+    annot_line_t aline;
+    memset(&aline, 0, sizeof(aline));
+    kstring_t str = {0,0,0}, seq_names = {0,0,0};
+    uint64_t nrec = 0, *seq_beg = NULL, last_name = 0;
+    void *seen = khash_str2int_init();
+    anx_rec_t rec = {0,0,0};
+    while ( hts_getline(fp, KS_SEP_LINE, &str) >= 0 )
+    {
+        if ( nskip>0 ) { nskip--; continue; }
+        if ( !str.l || str.s[0]==tbx->conf.meta_char ) continue;
+        parse_annot_line(args, str.s, &aline);
+        if ( aline.ncols < ncols_min )
+            error("Could not parse the line, expected %d+ columns, found %d:\n\t%s\n",ncols_min,aline.ncols,str.s);
+        parse_annot_coords(&tbx->conf, str.s, &aline);
+
+        char *chr = aline.cols[tbx->conf.sc-1];
+        if ( !nseq || strcmp(chr, seq_names.s + last_name) )
+        {
+            if ( khash_str2int_has_key(seen, chr) ) error("The file is not sorted: %s\n", args->targets_fname);
+            khash_str2int_inc(seen, strdup(chr));
+            hts_expand(uint64_t, nseq+1, mseq, seq_beg);
+            seq_beg[nseq++] = nrec;
+            last_name = seq_names.l;
+            kputs(chr, &seq_names);
+            kputc(0, &seq_names);
+            rec.max_end = aline.end;
+        }
+        else if ( aline.start < rec.start ) error("The file is not sorted: %s\n", args->targets_fname);
+        rec.start = aline.start;
+        rec.end   = aline.end;
+        if ( rec.max_end < rec.end ) rec.max_end = rec.end;
+        anx_write(rec_fp, "a temporary file", &rec, sizeof(rec));
+
+        for (i=0; i<ncols; i++)
+        {
+            anx_write(off_fp[i], "a temporary file", &dat_len[i], sizeof(uint64_t));
+            dat_len[i] += anx_put_values(args, &cols[i], &aline, dat_fp[i], str.s);
+        }
+        nrec++;
+    }
+    for (i=0; i<ncols; i++)
+        anx_write(off_fp[i], "a temporary file", &dat_len[i], sizeof(uint64_t));
+    hts_expand(uint64_t, nseq+1, mseq, seq_beg);
+    seq_beg[nseq] = nrec;
+
+    cache_pad(out, 8);
+    anx_hdr.rec_off = out->off;
+    anx_copy(out, rec_fp);
+    cache_pad(out, 8);
+    anx_hdr.seq_off = out->off;
+    cache_write(out, seq_beg, sizeof(*seq_beg)*(nseq+1));
+    cache_write(out, seq_names.s, seq_names.l);
+    for (i=0; i<ncols; i++)
+    {
+        cache_pad(out, 8);
+        cols[i].off = out->off;
+        anx_copy(out, off_fp[i]);
+        cols[i].dat = out->off;
+        anx_copy(out, dat_fp[i]);
+    }
+    anx_hdr.nseq = nseq;
+    anx_hdr.nrec = nrec;
+    cache_write_at(out, hdr_off, &anx_hdr, sizeof(anx_hdr));
+    cache_write_at(out, hdr_off + sizeof(anx_hdr), cols, sizeof(*cols)*ncols);
+    cache_commit(out);
+
+    if ( hts_close(fp)!=0 ) error("Close failed: %s\n", args->targets_fname);
+    tbx_destroy(tbx);
+    khash_str2int_destroy_free(seen);
+    free(aline.cols);
+    free(aline.als);
+    free(aline.line.s);
+    free(str.s);
+    free(seq_names.s);
+    free(seq_beg);
+    free(off_fp);
+    free(dat_fp);
+    free(dat_len);
+}
+
+// Returns 1 if the cache exists and is up to date with the -a file and the -c columns, 0 otherwise
+static int anx_load(args_t *args, uint64_t stamp, int ncols)
+{
+    cache_t *cache = cache_open(args->anx_fname, ANX_MAGIC, stamp, "annotations cache");
+    if ( !cache ) return 0;
+
+    anx_t *anx = (anx_t*) calloc(1, sizeof(anx_t));
+    anx->cache = cache;
+    anx->map   = cache->map;
+    anx->hdr   = (anx_hdr_t*) cache_ptr(cache, cache->off, sizeof(anx_hdr_t));
+    anx->col   = (anx_col_t*) cache_ptr(cache, cache->off + sizeof(anx_hdr_t), sizeof(anx_col_t)*ncols);
+    if ( ncols ) cache_ptr(cache, anx->col[ncols-1].dat, 0);
+    anx->rec     = (anx_rec_t*) cache_ptr(cache, anx->hdr->rec_off, sizeof(anx_rec_t)*anx->hdr->nrec);
+    anx->seq_beg = (uint64_t*) cache_ptr(cache, anx->hdr->seq_off, sizeof(uint64_t)*(anx->hdr->nseq+1));
+    anx->seq2id  = khash_str2int_init();
+    char *name = (char*) (anx->seq_beg + anx->hdr->nseq + 1);
+    uint64_t j;
+    for (j=0; j<anx->hdr->nseq; j++)
+    {
+        khash_str2int_set(anx->seq2id, name, j);
+        name += strlen(name) + 1;
+    }
+    args->anx = anx;
+    return 1;
+}
+
+static void anx_destroy(anx_t *anx)
+{
+    cache_close(anx->cache);
+    khash_str2int_destroy(anx->seq2id);
+    free(anx->str_col);
+    free(anx);
+}
+
+// The values of a column at the record as stored in the cache, no parsing involved
+static inline void *anx_values(anx_t *anx, int icol, uint64_t irec, int *nbytes)
+{
+    uint64_t *off = (uint64_t*) (anx->map + anx->col[icol].off);
+    *nbytes = off[irec+1] - off[irec];
+    return anx->map + anx->col[icol].dat + off[irec];
+}
+
+static int anx_setter_qual(args_t *args, bcf1_t *line, annot_col_t *col, void *data)
+{
+    annot_line_t *tab = (annot_line_t*) data;
+    int nbytes;
+    float *val = (float*) anx_values(args->anx, col->ianx, tab->irec, &nbytes);
+    if ( !nbytes ) return 0;   // empty
+    if ( col->replace==REPLACE_MISSING && !bcf_float_is_missing(line->qual) ) return 0;
+    line->qual = *val;
+    return 0;
+}
+static int anx_setter_info_flag(args_t *args, bcf1_t *line, annot_col_t *col, void *data)
+{
+    annot_line_t *tab = (annot_line_t*) data;
+    int nbytes;
+    int32_t *val = (int32_t*) anx_values(args->anx, col->ianx, tab->irec, &nbytes);
+    if ( !nbytes ) return 0;
+    return bcf_update_info_flag(args->hdr_out,line,col->hdr_key_dst,NULL,*val);
+}
+static int anx_setter_info_int(args_t *args, bcf1_t *line, annot_col_t *col, void *data)
+{
+    annot_line_t *tab = (annot_line_t*) data;
+    int nbytes;
+    void *vals = anx_values(args->anx, col->ianx, tab->irec, &nbytes);
+    if ( !nbytes ) return 0;
+    int ntmpi = nbytes / sizeof(int32_t);
+    hts_expand(int32_t,ntmpi,args->mtmpi,args->tmpi);
+    memcpy(args->tmpi, vals, nbytes);
+    return core_setter_info_int(args,line,col,tab->nals,tab->als,ntmpi);
+}
+static int anx_setter_info_real(args_t *args, bcf1_t *line, annot_col_t *col, void *data)
+{
+    annot_line_t *tab = (annot_line_t*) data;
+    int nbytes;
+    void *vals = anx_values(args->anx, col->ianx, tab->irec, &nbytes);
+    if ( !nbytes ) return 0;
+    int ntmpf = nbytes / sizeof(float);
+    hts_expand(float,ntmpf,args->mtmpf,args->tmpf);
+    memcpy(args->tmpf, vals, nbytes);
+    return core_setter_info_real(args,line,col,tab->nals,tab->als,ntmpf);
+}
+
+static int anx_add_col(anx_col_t **cols, int *ncols, int *mcols, int icol, int type)
+{
+    int i;
+    for (i=0; i<*ncols; i++)
+        if ( (*cols)[i].icol==(uint32_t)icol && (*cols)[i].type==(uint32_t)type ) return i;
+    hts_expand0(anx_col_t, *ncols+1, *mcols, *cols);
+    (*cols)[*ncols].icol = icol;
+    (*cols)[*ncols].type = type;
+    return (*ncols)++;
+}
+
+static void anx_init(args_t *args)
+{
+    // numeric INFO and QUAL columns are read typed by the anx_setter_* functions,
+    // the text setters get string columns
+    anx_col_t *cols = NULL;
+    int i, j, ncols = 0, mcols = 0, ref_col = -1, als_col = -1;
+    for (i=0; i<args->ncols; i++)
+    {
+        annot_col_t *col = &args->cols[i];
+        int type = ANX_STR, n = 1;
+        if ( col->setter==setter_info_int ) { type = ANX_INT; col->setter = anx_setter_info_int; }
+        else if ( col->setter==setter_info_real ) { type = ANX_REAL; col->setter = anx_setter_info_real; }
+        else if ( col->setter==setter_qual ) { type = ANX_REAL; col->setter = anx_setter_qual; }
+        else if ( col->setter==setter_info_flag ) { type = ANX_FLAG; col->setter = anx_setter_info_flag; }
+        else if ( col->setter==setter_format_int || col->setter==setter_format_real || col->setter==setter_format_str ) n = args->nsmpl_annot;
+        for (j=0; j<n; j++)
+        {
+            int k = anx_add_col(&cols, &ncols, &mcols, col->icol+j, type);
+            if ( !j ) col->ianx = k;
+        }
+    }
+    if ( args->ref_idx!=-1 )
+    {
+        ref_col = anx_add_col(&cols, &ncols, &mcols, args->ref_idx, ANX_STR);
+        als_col = anx_add_col(&cols, &ncols, &mcols, args->alt_idx, ANX_ALS);
+    }
+
+    struct stat st;
+    if ( stat(args->targets_fname, &st)!=0 ) error("Failed to stat %s: %s\n", args->targets_fname, strerror(errno));
+    uint64_t stamp = cache_stamp_file(CACHE_STAMP_INIT, args->targets_fname);
+    for (i=0; i<ncols; i++)
+    {
+        stamp = cache_stamp(stamp, &cols[i].icol, sizeof(cols[i].icol));
+        stamp = cache_stamp(stamp, &cols[i].type, sizeof(cols[i].type));
+    }
+    if ( !anx_load(args, stamp, ncols) )
+    {
+        anx_build(args, stamp, cols, ncols);
+        if ( !anx_load(args, stamp, ncols) ) error("Failed to load %s\n", args->anx_fname);
+    }
+
+    anx_t *anx = args->anx;
+    anx->ref_col = ref_col;
+    anx->als_col = als_col;
+    for (i=0; i<ncols; i++)
+        if ( anx->nstr_col < (int)cols[i].icol+1 ) anx->nstr_col = cols[i].icol+1;
+    anx->str_col = (int*) malloc(sizeof(int)*(anx->nstr_col ? anx->nstr_col : 1));
+    for (i=0; i<anx->nstr_col; i++) anx->str_col[i] = -1;
+    for (i=0; i<ncols; i++)
+        if ( cols[i].type==ANX_STR ) anx->str_col[cols[i].icol] = i;
+    free(cols);
+}
+
+// Point the buffered lines to the cached records overlapping the VCF record
+static void anx_annot_lines(args_t *args, bcf1_t *line, int start_pos, int end_pos)
+{
+    anx_t *anx = args->anx;
+    args->nalines = 0;
+    int i, id, nbytes;
+    if ( khash_str2int_get(anx->seq2id, bcf_seqname(args->hdr,line), &id)!=0 ) return;
+
+    // the first record which can overlap, max_end is non-decreasing
+    uint64_t beg = anx->seq_beg[id], end = anx->seq_beg[id+1];
+    while ( beg < end )
+    {
+        uint64_t mid = (beg + end) / 2;
+        if ( anx->rec[mid].max_end < start_pos ) beg = mid + 1;
+        else end = mid;
+    }
+    for (; beg < anx->seq_beg[id+1] && anx->rec[beg].start <= end_pos; beg++)
+    {
+        anx_rec_t *rec = &anx->rec[beg];
+        if ( rec->end < start_pos ) continue;
+
+        args->nalines++;
+        hts_expand0(annot_line_t,args->nalines,args->malines,args->alines);
+        annot_line_t *tmp = &args->alines[args->nalines-1];
+        tmp->rid   = line->rid;
+        tmp->start = rec->start;
+        tmp->end   = rec->end;
+        tmp->irec  = beg;
+        tmp->ncols = anx->nstr_col;
+        hts_expand(char*,tmp->ncols,tmp->mcols,tmp->cols);
+        for (i=0; i<tmp->ncols; i++)
+            tmp->cols[i] = anx->str_col[i]<0 ? anx_missing : (char*) anx_values(anx, anx->str_col[i], beg, &nbytes);
+        if ( anx->ref_col<0 ) continue;
+
+        tmp->nals = 1;
+        hts_expand(char*,tmp->nals,tmp->mals,tmp->als);
+        tmp->als[0] = (char*) anx_values(anx, anx->ref_col, beg, &nbytes);
+        char *als = (char*) anx_values(anx, anx->als_col, beg, &nbytes), *als_end = als + nbytes;
+        while ( als < als_end )
+        {
+            tmp->nals++;
+            hts_expand(char*,tmp->nals,tmp->mals,tmp->als);
+            tmp->als[tmp->nals-1] = als;
+            als += strlen(als) + 1;
+        }
+    }
+}
+
 static void init_data(args_t *args)
 {
     args->hdr = args->files->readers[0].header;
@@ -1626,9 +2447,14 @@ static void init_data(args_t *args)
         if ( args->from_idx==-1 ) error("The -c POS option not given\n");
         if ( args->to_idx==-1 ) args->to_idx = -args->from_idx - 1;
 
-        args->tgts = bcf_sr_regions_init(args->targets_fname,1,args->chr_idx,args->from_idx,args->to_idx);
-        if ( !args->tgts ) error("Could not initialize the annotation file: %s\n", args->targets_fname);
-        if ( !args->tgts->tbx ) error("Expected tabix-indexed annotation file: %s\n", args->targets_fname);
+        if ( args->anx_fname ) anx_init(args);
+        else if ( args->stream_annots ) annot_stream_init(args);
+        else
+        {
+            args->tgts = bcf_sr_regions_init(args->targets_fname,1,args->chr_idx,args->from_idx,args->to_idx);
+            if ( !args->tgts ) error("Could not initialize the annotation file: %s\n", args->targets_fname);
+            if ( !args->tgts->tbx ) error("Expected tabix-indexed annotation file: %s\n", args->targets_fname);
+        }
     }
     args->vcmp = vcmp_init();
 
@@ -1658,6 +2484,7 @@ static void init_data(args_t *args)
         if ( args->n_threads )
             hts_set_opt(args->out_fh, HTS_OPT_THREAD_POOL, args->files->p);
         bcf_hdr_write(args->out_fh, args->hdr_out);
+        if ( args->write_index ) args->out_idx = out_idx_init(args->out_fh, args->hdr_out, args->output_fname);
     }
 }
 
@@ -1666,6 +2493,7 @@ static void destroy_data(args_t *args)
     int i;
     for (i=0; i<args->nrm; i++) free(args->rm[i].key);
     free(args->rm);
+    free(args->rm_ids);
     if ( args->hdr_out ) bcf_hdr_destroy(args->hdr_out);
     if (args->vcmp) vcmp_destroy(args->vcmp);
     for (i=0; i<args->ncols; i++)
@@ -1682,6 +2510,8 @@ static void destroy_data(args_t *args)
     }
     free(args->alines);
     if ( args->tgts ) bcf_sr_regions_destroy(args->tgts);
+    if ( args->astream ) annot_stream_destroy(args->astream);
+    if ( args->anx ) anx_destroy(args->anx);
     free(args->tmpks.s);
     free(args->tmpi);
     free(args->tmpf);
@@ -1697,12 +2527,17 @@ static void destroy_data(args_t *args)
         convert_destroy(args->set_ids);
     if ( args->filter )
         filter_destroy(args->filter);
-    if (args->out_fh) hts_close(args->out_fh);
+    if (args->out_fh) out_idx_close(args->out_idx, args->out_fh);
     free(args->sample_map);
 }
 
 static void buffer_annot_lines(args_t *args, bcf1_t *line, int start_pos, int end_pos)
 {
+    if ( args->anx )
+    {
+        anx_annot_lines(args, line, start_pos, end_pos);
+        return;
+    }
     if ( args->nalines && args->alines[0].rid != line->rid ) args->nalines = 0;
 
     int i = 0;
@@ -1721,6 +2556,12 @@ static void buffer_annot_lines(args_t *args, bcf1_t *line, int start_pos, int en
         else i++;
     }
 
+    if ( args->astream )
+    {
+        stream_annot_lines(args, line, start_pos, end_pos);
+        return;
+    }
+
     if ( args->ref_idx==-1 && args->nalines ) return;
 
     while ( !bcf_sr_regions_overlap(args->tgts, bcf_seqname(args->hdr,line), start_pos,end_pos) )
@@ -1731,44 +2572,9 @@ static void buffer_annot_lines(args_t *args, bcf1_t *line, int start_pos, int en
         tmp->rid   = line->rid;
         tmp->start = args->tgts->start;
         tmp->end   = args->tgts->end;
-        tmp->line.l = 0;
-        kputs(args->tgts->line.s, &tmp->line);
-        char *s = tmp->line.s;
-        tmp->ncols = 1;
-        hts_expand(char*,tmp->ncols,tmp->mcols,tmp->cols);
-        tmp->cols[0] = s;
-        while ( *s )
-        {
-            if ( *s=='\t' )
-            {
-                tmp->ncols++;
-                hts_expand(char*,tmp->ncols,tmp->mcols,tmp->cols);
-                tmp->cols[tmp->ncols-1] = s+1;
-                *s = 0;
-            }
-            s++;
-        }
+        parse_annot_line(args, args->tgts->line.s, tmp);
         if ( args->ref_idx != -1 )
         {
-            if ( args->ref_idx >= tmp->ncols ) 
-                error("Could not parse the line, expected %d+ columns, found %d:\n\t%s\n",args->ref_idx+1,tmp->ncols,args->tgts->line.s);
-            if ( args->alt_idx >= tmp->ncols )
-                error("Could not parse the line, expected %d+ columns, found %d:\n\t%s\n",args->alt_idx+1,tmp->ncols,args->tgts->line.s);
-            tmp->nals = 2;
-            hts_expand(char*,tmp->nals,tmp->mals,tmp->als);
-            tmp->als[0] = tmp->cols[args->ref_idx];
-            tmp->als[1] = s = tmp->cols[args->alt_idx];
-            while ( *s )
-            {
-                if ( *s==',' )
-                {
-                    tmp->nals++;
-                    hts_expand(char*,tmp->nals,tmp->mals,tmp->als);
-                    tmp->als[tmp->nals-1] = s+1;
-                    *s = 0;
-                }
-                s++;
-            }
             int iseq = args->tgts->iseq;
             if ( bcf_sr_regions_next(args->tgts)<0 || args->tgts->iseq!=iseq ) break;
         }
@@ -1779,10 +2585,9 @@ static void buffer_annot_lines(args_t *args, bcf1_t *line, int start_pos, int en
 static void annotate(args_t *args, bcf1_t *line)
 {
     int i, j;
-    for (i=0; i<args->nrm; i++)
-        args->rm[i].handler(args, line, &args->rm[i]);
+    if ( args->nrm ) remove_fields(args, line);
 
-    if ( args->tgts )
+    if ( args->tgts || args->astream || args->anx )
     {
         // Buffer annotation lines. When multiple ALT alleles are present in the
         // annotation file, at least one must match one of the VCF alleles.
@@ -1864,6 +2669,7 @@ static void usage(args_t *args)
     fprintf(stderr, "\n");
     fprintf(stderr, "Options:\n");
     fprintf(stderr, "   -a, --annotations <file>       VCF file or tabix-indexed file with annotations: CHR\\tPOS[\\tVALUE]+\n");
+    fprintf(stderr, "       --annots-cache <file>      read the tab-delimited annotations from a binary cache, created if needed\n");
     fprintf(stderr, "       --collapse <string>        matching records by <snps|indels|both|all|some|none>, see man page for details [some]\n");
     fprintf(stderr, "   -c, --columns <list>           list of columns in the annotation file, e.g. CHROM,POS,REF,ALT,-,INFO/TAG. See man page for details\n");
     fprintf(stderr, "   -e, --exclude <expr>           exclude sites for which the expression is true (see man page for details)\n");
@@ -1879,8 +2685,10 @@ static void usage(args_t *args)
     fprintf(stderr, "       --rename-chrs <file>       rename sequences according to map file: from\\tto\n");
     fprintf(stderr, "   -s, --samples [^]<list>        comma separated list of samples to annotate (or exclude with \"^\" prefix)\n");
     fprintf(stderr, "   -S, --samples-file [^]<file>   file of samples to annotate (or exclude with \"^\" prefix)\n");
+    fprintf(stderr, "       --stream-annots            read the tab-delimited -a file sequentially on a helper thread, seek only to new sequences\n");
     fprintf(stderr, "   -x, --remove <list>            list of annotations to remove (e.g. ID,INFO/DP,FORMAT/DP,FILTER). See man page for details\n");
     fprintf(stderr, "       --threads <int>            number of extra output compression threads [0]\n");
+    fprintf(stderr, "       --write-index              index the compressed output on the fly, the index is written to <file>.csi\n");
     fprintf(stderr, "\n");
     exit(1);
 }
@@ -1919,6 +2727,9 @@ int main_vcfannotate(int argc, char *argv[])
         {"samples",required_argument,NULL,'s'},
         {"samples-file",required_argument,NULL,'S'},
         {"no-version",no_argument,NULL,8},
+        {"stream-annots",no_argument,NULL,3},
+        {"annots-cache",required_argument,NULL,4},
+        {"write-index",no_argument,NULL,5},
         {NULL,0,NULL,0}
     };
     while ((c = getopt_long(argc, argv, "h:?o:O:r:R:a:x:c:i:e:S:s:I:m:",loptions,NULL)) >= 0)
@@ -1962,6 +2773,9 @@ int main_vcfannotate(int argc, char *argv[])
                 else if ( !strcmp(optarg,"none") ) collapse = COLLAPSE_NONE;
                 else error("The --collapse string \"%s\" not recognised.\n", optarg);
                 break;
+            case  3 : args->stream_annots = 1; break;
+            case  4 : args->anx_fname = optarg; break;
+            case  5 : args->write_index = 1; break;
             case  9 : args->n_threads = strtol(optarg, 0, 0); break;
             case  8 : args->record_cmd_line = 0; break;
             case '?': usage(args); break;
@@ -1995,11 +2809,17 @@ int main_vcfannotate(int argc, char *argv[])
             args->files->collapse = collapse ? collapse : COLLAPSE_SOME;
         }
     }
+    if ( args->stream_annots && (!args->targets_fname || args->tgts_is_vcf) )
+        error("The --stream-annots option requires a tab-delimited -a file\n");
+    if ( args->anx_fname && (!args->targets_fname || args->tgts_is_vcf) )
+        error("The --annots-cache option requires a tab-delimited -a file\n");
+    if ( args->anx_fname && args->stream_annots )
+        error("The options --annots-cache and --stream-annots cannot be combined\n");
     if ( bcf_sr_set_threads(args->files, args->n_threads)<0 ) error("Failed to create threads\n");
     if ( !bcf_sr_add_reader(args->files, fname) ) error("Failed to open %s: %s\n", fname,bcf_sr_strerror(args->files->errnum));
 
     init_data(args);
-    while ( bcf_sr_next_line(args->files) )
+    while ( profile_sr_next_line(args->files) )
     {
         if ( !bcf_sr_has_line(args->files,0) ) continue;
         bcf1_t *line = bcf_sr_get_line(args->files,0);
@@ -2010,8 +2830,10 @@ int main_vcfannotate(int argc, char *argv[])
             if ( args->filter_logic & FLT_EXCLUDE ) pass = pass ? 0 : 1;
             if ( !pass ) continue;
         }
+        uint64_t t0 = profile_begin();
         annotate(args, line);
-        bcf_write1(args->out_fh, args->hdr_out, line);
+        profile_end(PROF_ANNOT, t0);
+        out_idx_write(args->out_idx, args->out_fh, args->hdr_out, line);
     }
     destroy_data(args);
     bcf_sr_destroy(args->files);
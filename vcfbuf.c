@@ -24,11 +24,13 @@
 
  */
 
+#include <stdint.h>
 #include <htslib/vcf.h>
 #include <htslib/vcfutils.h>
 #include "bcftools.h"
 #include "vcfbuf.h"
 #include "rbuf.h"
+#include "gtcount.h"
 
 typedef struct
 {
@@ -37,11 +39,26 @@ typedef struct
 }
 ld_t;
 
+// GT dosages of a record packed once for all pairs in the window
+#define GT_UNSET    0
+#define GT_PACKED   1
+#define GT_NONE     2   // no GT tag, no pairs can be calculated
+#define GT_SCALAR   3   // cannot be packed, use the per-sample loop
+typedef struct
+{
+    uint64_t *bits;     // three bit planes of nwords each: non-missing, dosage&1, dosage&2
+    int mbits, status;
+    int na;             // the number of non-missing genotypes, their sum and sum of squares
+    double a, aa;
+}
+gtbits_t;
+
 typedef struct
 {
     bcf1_t *rec;
     double af;
     int af_set:1, idx:31;
+    gtbits_t gt;
 }
 vcfrec_t;
 
@@ -63,6 +80,7 @@ struct _vcfbuf_t
     rbuf_t rbuf;
     ld_t ld;
     prune_t prune;
+    gtbits_t gt;        // the record tested by vcfbuf_max_ld()
 };
 
 vcfbuf_t *vcfbuf_init(bcf_hdr_t *hdr, int win)
@@ -78,8 +96,12 @@ void vcfbuf_destroy(vcfbuf_t *buf)
 {
     int i;
     for (i=0; i<buf->rbuf.m; i++)
+    {
         if ( buf->vcf[i].rec ) bcf_destroy(buf->vcf[i].rec);
+        free(buf->vcf[i].gt.bits);
+    }
     free(buf->vcf);
+    free(buf->gt.bits);
     free(buf->prune.farr);
     free(buf->prune.vrec);
     free(buf->prune.ac);
@@ -108,6 +130,7 @@ bcf1_t *vcfbuf_push(vcfbuf_t *buf, bcf1_t *rec, int swap)
     bcf1_t *ret = buf->vcf[i].rec;
     buf->vcf[i].rec = rec;
     buf->vcf[i].af_set = 0;
+    buf->vcf[i].gt.status = GT_UNSET;
 
     return ret;
 }
@@ -157,7 +180,7 @@ static void _prune_sites(vcfbuf_t *buf, int flush_all)
             {
                 if ( bcf_get_info_float(buf->hdr,line,buf->prune.af_tag,&buf->prune.farr, &buf->prune.mfarr) > 0 ) buf->vcf[i].af = buf->prune.farr[0];
             }
-            else if ( bcf_calc_ac(buf->hdr, line, buf->prune.ac, BCF_UN_INFO|BCF_UN_FMT) )
+            else if ( gtcount_calc_ac(buf->hdr, line, buf->prune.ac, BCF_UN_INFO|BCF_UN_FMT) )
             {
                 int ntot = buf->prune.ac[0], nalt = 0; 
                 for (k=1; k<line->n_allele; k++) nalt += buf->prune.ac[k];
@@ -227,11 +250,92 @@ static double _estimate_af(int8_t *ptr, int size, int nvals, int nsamples)
     return (double)nalt/(nref+nalt);
 }
 
+static inline int popcount64(uint64_t x)
+{
+    return __builtin_popcountll(x);
+}
+
+/*
+    Pack the dosages of the record as bit planes so that the pairwise sums can
+    be calculated by popcount, counting the alleles the same way as the loop in
+    _calc_ld_scalar(). Ploidy up to three fits in the two dosage planes,
+    randomized missing genotypes are drawn per pair and are never packed.
+*/
+static void _pack_gt(vcfbuf_t *buf, bcf1_t *rec, gtbits_t *gt)
+{
+    gt->status = GT_SCALAR;
+    if ( buf->ld.rand_missing ) return;
+
+    int i,j,igt = bcf_hdr_id2int(buf->hdr, BCF_DT_ID, "GT");
+    bcf_unpack(rec, BCF_UN_FMT);
+    bcf_fmt_t *fmt = NULL;
+    for (i=0; i<rec->n_fmt; i++)
+        if ( rec->d.fmt[i].id==igt ) { fmt = &rec->d.fmt[i]; break; }
+    if ( !fmt || fmt->n==0 ) { gt->status = GT_NONE; return; }
+    if ( fmt->type!=BCF_BT_INT8 ) return;   // let the scalar code report the error
+
+    int nwords = (rec->n_sample + 63) / 64;
+    hts_expand(uint64_t, 3*nwords, gt->mbits, gt->bits);
+    memset(gt->bits, 0, sizeof(uint64_t)*3*nwords);
+    uint64_t *val = gt->bits, *lo = gt->bits + nwords, *hi = gt->bits + 2*nwords;
+
+    gt->na = 0;
+    gt->a = gt->aa = 0;
+    for (i=0; i<rec->n_sample; i++)
+    {
+        int8_t *ptr = (int8_t*) (fmt->p + i*fmt->size);
+        int dsg = 0, n = 0;
+        for (j=0; j<fmt->n; j++)
+        {
+            if ( ptr[j]==bcf_int8_vector_end || ptr[j]==bcf_gt_missing ) break;
+            if ( bcf_gt_allele(ptr[j]) ) dsg += 1;
+            n++;
+        }
+        if ( !n ) continue;
+        if ( dsg > 3 ) return;
+        uint64_t bit = (uint64_t)1 << (i & 63);
+        val[i>>6] |= bit;
+        if ( dsg & 1 ) lo[i>>6] |= bit;
+        if ( dsg & 2 ) hi[i>>6] |= bit;
+        gt->aa += dsg*dsg;
+        gt->a  += dsg;
+        gt->na++;
+    }
+    gt->status = GT_PACKED;
+}
+
 /*
     For unphased genotypes D is approximated as suggested in https://www.ncbi.nlm.nih.gov/pmc/articles/PMC2710162/
         D =~ (GT correlation) * sqrt(Pa*(1-Pa)*Pb*(1-Pb))
 */
-static double _calc_ld(vcfbuf_t *buf, bcf1_t *arec, bcf1_t *brec)
+static double _calc_r2(double ab, double aa, double bb, double a, double b, int nab, int na, int nb, int ndiff)
+{
+    if ( !nab ) return -1;
+
+    double cor;
+    if ( !ndiff ) cor = 1;
+    else
+    {
+        // Don't know how to deal with zero variance. Since this the purpose is filtering,
+        // it is not enough to say the value is undefined. Therefore an artificial noise is
+        // added to make the denominator non-zero.
+        if ( aa == a*a/na || bb == b*b/nb )
+        {
+            aa += 3*3;
+            bb += 3*3;
+            ab += 3*3;
+            a  += 3;
+            b  += 3;
+            na++;
+            nb++;
+            nab++;
+        }
+        cor = (ab/nab - a/na*b/nb) / sqrt(aa/na - a/na*a/na) / sqrt(bb/nb - b/nb*b/nb);
+    }
+    return cor*cor;
+}
+
+static double _calc_ld_scalar(vcfbuf_t *buf, bcf1_t *arec, bcf1_t *brec)
 {
     if ( arec->n_sample!=brec->n_sample ) error("Different number of samples: %d vs %d\n",arec->n_sample,brec->n_sample);
     assert( arec->n_sample );
@@ -309,29 +413,35 @@ static double _calc_ld(vcfbuf_t *buf, bcf1_t *arec, bcf1_t *brec)
             nab++;
         }
     }
-    if ( !nab ) return -1;
+    return _calc_r2(ab, aa, bb, a, b, nab, na, nb, ndiff);
+}
 
-    double cor;
-    if ( !ndiff ) cor = 1;
-    else
+static double _calc_ld(vcfbuf_t *buf, vcfrec_t *avrec, bcf1_t *brec, gtbits_t *bgt)
+{
+    bcf1_t *arec = avrec->rec;
+    gtbits_t *agt = &avrec->gt;
+    if ( arec->n_sample!=brec->n_sample ) error("Different number of samples: %d vs %d\n",arec->n_sample,brec->n_sample);
+    assert( arec->n_sample );
+
+    if ( agt->status==GT_UNSET ) _pack_gt(buf, arec, agt);
+    if ( agt->status==GT_NONE || bgt->status==GT_NONE ) return -1;
+    if ( agt->status==GT_SCALAR || bgt->status==GT_SCALAR ) return _calc_ld_scalar(buf, arec, brec);
+
+    int i, nwords = (arec->n_sample + 63) / 64;
+    uint64_t *aval = agt->bits, *alo = agt->bits + nwords, *ahi = agt->bits + 2*nwords;
+    uint64_t *bval = bgt->bits, *blo = bgt->bits + nwords, *bhi = bgt->bits + 2*nwords;
+    int nab = 0, ndiff = 0, ll = 0, lh = 0, hh = 0;
+    for (i=0; i<nwords; i++)
     {
-        // Don't know how to deal with zero variance. Since this the purpose is filtering,
-        // it is not enough to say the value is undefined. Therefore an artificial noise is
-        // added to make the denominator non-zero.
-        if ( aa == a*a/na || bb == b*b/nb )
-        {
-            aa += 3*3;
-            bb += 3*3;
-            ab += 3*3;
-            a  += 3;
-            b  += 3;
-            na++;
-            nb++;
-            nab++;
-        }
-        cor = (ab/nab - a/na*b/nb) / sqrt(aa/na - a/na*a/na) / sqrt(bb/nb - b/nb*b/nb);
+        uint64_t val = aval[i] & bval[i];
+        nab   += popcount64(val);
+        ndiff += popcount64(val & ((alo[i]^blo[i]) | (ahi[i]^bhi[i])));
+        ll += popcount64(alo[i] & blo[i]);
+        lh += popcount64(alo[i] & bhi[i]) + popcount64(ahi[i] & blo[i]);
+        hh += popcount64(ahi[i] & bhi[i]);
     }
-    return cor*cor;
+    double ab = ll + 2*lh + 4*hh;
+    return _calc_r2(ab, agt->aa, bgt->aa, agt->a, bgt->a, nab, agt->na, bgt->na, ndiff);
 }
 
 bcf1_t *vcfbuf_max_ld(vcfbuf_t *buf, bcf1_t *rec, double *ld)
@@ -345,6 +455,8 @@ bcf1_t *vcfbuf_max_ld(vcfbuf_t *buf, bcf1_t *rec, double *ld)
     // must come from the same chromosome
     if ( buf->vcf[i].rec->rid != rec->rid ) return NULL;
 
+    _pack_gt(buf, rec, &buf->gt);
+
     int imax = 0;
     double max = 0;
     for (i=-1; rbuf_next(&buf->rbuf,&i); )
@@ -354,7 +466,7 @@ bcf1_t *vcfbuf_max_ld(vcfbuf_t *buf, bcf1_t *rec, double *ld)
             if ( buf->vcf[i].rec->d.n_flt > 1 ) continue;   // multiple filters are set
             if ( buf->vcf[i].rec->d.n_flt==1 && buf->vcf[i].rec->d.flt[0]!=0 ) continue;    // not PASS
         }
-        double val = _calc_ld(buf, buf->vcf[i].rec, rec);
+        double val = _calc_ld(buf, &buf->vcf[i], rec, &buf->gt);
         if ( buf->ld.max && buf->ld.max < val ) 
         {
             *ld = val;
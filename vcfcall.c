@@ -42,6 +42,8 @@ THE SOFTWARE.  */
 #include "prob1.h"
 #include "ploidy.h"
 #include "gvcf.h"
+#include "profile.h"
+#include "batch.h"
 
 void error(const char *format, ...);
 
@@ -69,8 +71,9 @@ void error(const char *format, ...);
 typedef struct
 {
     int flag;   // combination of CF_* flags above
-    int output_type, n_threads, record_cmd_line;
+    int output_type, n_threads, record_cmd_line, record_threads, write_index;
     htsFile *bcf_in, *out_fh;
+    out_idx_t *out_idx;
     char *bcf_fname, *output_fname;
     char **samples;             // for subsampling and ploidy
     int nsamples, *samples_map; // mapping from output sample names to original VCF
@@ -80,8 +83,9 @@ typedef struct
     char *samples_fname;
     int samples_is_file;
     int *sample2sex;    // mapping for ploidy. If negative, interpreted as -1*ploidy
-    int *sex2ploidy, *sex2ploidy_prev, nsex;
+    int nsex;
     ploidy_t *ploidy;
+    ploidy_cursor_t *ploidy_cursor;
     gvcf_t *gvcf;
 
     bcf1_t *missed_line;
@@ -366,7 +370,7 @@ static void print_missed_line(bcf_sr_regions_t *regs, void *data)
     missed->pos  = regs->start;
     bcf_update_alleles_str(call->hdr, missed,ss);
 
-    bcf_write1(args->out_fh, call->hdr, missed);
+    out_idx_write(args->out_idx, args->out_fh, call->hdr, missed);
 }
 
 static void init_data(args_t *args)
@@ -407,8 +411,7 @@ static void init_data(args_t *args)
     if ( args->ploidy  )
     {
         args->nsex = ploidy_nsex(args->ploidy);
-        args->sex2ploidy = (int*) calloc(args->nsex,sizeof(int));
-        args->sex2ploidy_prev = (int*) calloc(args->nsex,sizeof(int));
+        args->ploidy_cursor = ploidy_cursor_init(args->ploidy);
         if ( !args->nsamples )
         {
             args->nsamples = bcf_hdr_nsamples(args->aux.hdr);
@@ -420,7 +423,6 @@ static void init_data(args_t *args)
     {
         args->aux.ploidy = (uint8_t*) malloc(args->nsamples);
         for (i=0; i<args->nsamples; i++) args->aux.ploidy[i] = ploidy_max(args->ploidy);
-        for (i=0; i<args->nsex; i++) args->sex2ploidy_prev[i] = ploidy_max(args->ploidy);
         for (i=0; i<args->nsamples; i++) 
             if ( args->sample2sex[i] >= args->nsex ) args->sample2sex[i] = args->nsex - 1;
     }
@@ -469,6 +471,11 @@ static void init_data(args_t *args)
 
     if (args->record_cmd_line) bcf_hdr_append_version(args->aux.hdr, args->argc, args->argv, "bcftools_call");
     bcf_hdr_write(args->out_fh, args->aux.hdr);
+    if ( args->write_index )
+    {
+        args->out_idx = out_idx_init(args->out_fh, args->aux.hdr, args->output_fname);
+        if ( args->gvcf ) gvcf_set_out_idx(args->gvcf, args->out_idx);
+    }
 
     if ( args->flag&CF_INS_MISSED ) init_missed_line(args);
 }
@@ -489,16 +496,15 @@ static void destroy_data(args_t *args)
         free(args->aux.fams);
     }
     if ( args->missed_line ) bcf_destroy(args->missed_line);
+    if ( args->ploidy_cursor ) ploidy_cursor_destroy(args->ploidy_cursor);
     ploidy_destroy(args->ploidy);
-    free(args->sex2ploidy);
-    free(args->sex2ploidy_prev);
     free(args->samples);
     free(args->samples_map);
     free(args->sample2sex);
     free(args->aux.ploidy);
     if ( args->gvcf ) gvcf_destroy(args->gvcf);
     bcf_hdr_destroy(args->aux.hdr);
-    hts_close(args->out_fh);
+    out_idx_close(args->out_idx, args->out_fh);
     bcf_sr_destroy(args->aux.srs);
 }
 
@@ -547,22 +553,17 @@ static int parse_format_flag(const char *str)
 
 static void set_ploidy(args_t *args, bcf1_t *rec)
 {
-    ploidy_query(args->ploidy,(char*)bcf_seqname(args->aux.hdr,rec),rec->pos,args->sex2ploidy,NULL,NULL);
+    const int *sex2ploidy;
+    if ( !ploidy_cursor_query(args->ploidy_cursor,bcf_seqname(args->aux.hdr,rec),rec->pos,&sex2ploidy,NULL,NULL) ) return;    // ploidy same as previously
 
     int i;
-    for (i=0; i<args->nsex; i++)
-        if ( args->sex2ploidy[i]!=args->sex2ploidy_prev[i] ) break;
-
-    if ( i==args->nsex ) return;    // ploidy same as previously
-
     for (i=0; i<args->nsamples; i++)
     {
         if ( args->sample2sex[i]<0 )
             args->aux.ploidy[i] = -1*args->sample2sex[i];
         else
-            args->aux.ploidy[i] = args->sex2ploidy[args->sample2sex[i]];
+            args->aux.ploidy[i] = sex2ploidy[args->sample2sex[i]];
     }
-    int *tmp = args->sex2ploidy; args->sex2ploidy = args->sex2ploidy_prev; args->sex2ploidy_prev = tmp;
 }
 
 ploidy_t *init_ploidy(char *alias)
@@ -601,6 +602,150 @@ ploidy_t *init_ploidy(char *alias)
     return ploidy_init_string(pld->ploidy,2);
 }
 
+// Apply the site filters, determine the unseen allele and set the ploidy; returns 0 if the
+// site should be skipped
+static int prepare_record(args_t *args, bcf1_t *bcf_rec)
+{
+    if ( args->samples_map ) bcf_subset(args->aux.hdr, bcf_rec, args->nsamples, args->samples_map);
+    bcf_unpack(bcf_rec, BCF_UN_STR);
+
+    // Skip unwanted sites
+    int i, is_indel = bcf_is_snp(bcf_rec) ? 0 : 1;
+    if ( (args->flag & CF_INDEL_ONLY) && !is_indel ) return 0;
+    if ( (args->flag & CF_NO_INDEL) && is_indel ) return 0;
+    if ( (args->flag & CF_ACGT_ONLY) && (bcf_rec->d.allele[0][0]=='N' || bcf_rec->d.allele[0][0]=='n') ) return 0;   // REF[0] is 'N'
+
+    // Which allele is symbolic? All SNPs should have it, but not indels
+    args->aux.unseen = 0;
+    for (i=1; i<bcf_rec->n_allele; i++)
+    {
+        if ( bcf_rec->d.allele[i][0]=='X' ) { args->aux.unseen = i; break; }  // old X
+        if ( bcf_rec->d.allele[i][0]=='<' )
+        {
+            if ( bcf_rec->d.allele[i][1]=='X' && bcf_rec->d.allele[i][2]=='>' ) { args->aux.unseen = i; break; } // old <X>
+            if ( bcf_rec->d.allele[i][1]=='*' && bcf_rec->d.allele[i][2]=='>' ) { args->aux.unseen = i; break; } // new <*>
+        }
+    }
+    int is_ref = (bcf_rec->n_allele==1 || (bcf_rec->n_allele==2 && args->aux.unseen>0)) ? 1 : 0;
+
+    if ( is_ref && args->aux.flag&CALL_VARONLY )
+        return 0;
+
+    bcf_unpack(bcf_rec, BCF_UN_ALL);
+    if ( args->nsex ) set_ploidy(args, bcf_rec);
+    return 1;
+}
+
+// Output a record given the return value of mcall() or ccall()
+static void write_record(args_t *args, bcf1_t *bcf_rec, int ret)
+{
+    if ( ret==-1 ) error("Something is wrong\n");
+    else if ( ret==-2 ) return;   // skip the site
+
+    // Normal output
+    if ( (args->aux.flag & CALL_VARONLY) && ret==0 && !args->gvcf ) return;     // not a variant
+    if ( args->gvcf )
+        bcf_rec = gvcf_write(args->gvcf, args->out_fh, args->aux.hdr, bcf_rec, ret==1?1:0);
+    if ( bcf_rec )
+        out_idx_write(args->out_idx, args->out_fh, args->aux.hdr, bcf_rec);
+}
+
+// Multi-threaded calling (--record-threads): the main thread reads and prepares
+// batches of sites, the workers of a batch pool run mcall() on them, each with
+// a private call_t, and the batches are written in the original order. The
+// ploidy and the unseen allele are determined by the main thread and stored
+// with each site.
+#define BATCH_SIZE      64
+
+typedef struct
+{
+    bcf1_t **rec;
+    int *unseen, *ret;
+    uint8_t *ploidy;    // BATCH_SIZE x nsmpl ploidy values, NULL if not used
+    int nrec;
+}
+batch_t;
+
+static void batch_work(void *worker, void *data)
+{
+    call_t *call   = (call_t*) worker;
+    batch_t *batch = (batch_t*) data;
+    int i, nsmpl = bcf_hdr_nsamples(call->hdr);
+    for (i=0; i<batch->nrec; i++)
+    {
+        call->unseen = batch->unseen[i];
+        if ( batch->ploidy ) call->ploidy = batch->ploidy + i*nsmpl;
+        uint64_t t0 = profile_begin();
+        batch->ret[i] = mcall(call, batch->rec[i]);
+        profile_end(PROF_CALL, t0);
+    }
+}
+
+static void batch_write(void *data, void *bdata)
+{
+    batch_t *batch = (batch_t*) bdata;
+    int i;
+    for (i=0; i<batch->nrec; i++)
+        write_record((args_t*)data, batch->rec[i], batch->ret[i]);
+}
+
+static void call_records_threaded(args_t *args)
+{
+    int i, j, nthreads = args->record_threads, nbatch = 2*nthreads;
+    int nsmpl = bcf_hdr_nsamples(args->aux.hdr);
+    call_t *calls = (call_t*) malloc(sizeof(call_t)*nthreads);
+    void **workers = (void**) malloc(sizeof(void*)*nthreads);
+    for (i=0; i<nthreads; i++)
+    {
+        mcall_init_worker(&calls[i], &args->aux);
+        workers[i] = &calls[i];
+    }
+    batch_t *batch = (batch_t*) calloc(nbatch, sizeof(batch_t));
+    void **batches = (void**) malloc(sizeof(void*)*nbatch);
+    for (i=0; i<nbatch; i++)
+    {
+        batch[i].rec    = (bcf1_t**) malloc(sizeof(bcf1_t*)*BATCH_SIZE);
+        batch[i].unseen = (int*) malloc(sizeof(int)*BATCH_SIZE);
+        batch[i].ret    = (int*) malloc(sizeof(int)*BATCH_SIZE);
+        if ( args->aux.ploidy ) batch[i].ploidy = (uint8_t*) malloc(BATCH_SIZE*nsmpl);
+        for (j=0; j<BATCH_SIZE; j++) batch[i].rec[j] = bcf_init();
+        batches[i] = &batch[i];
+    }
+
+    batch_pool_t *pool = batch_pool_init(nthreads, workers, batches, nbatch, batch_work, batch_write, args);
+    int eof = 0;
+    while ( !eof )
+    {
+        batch_t *bt = (batch_t*) batch_pool_get(pool);
+        bt->nrec = 0;
+        while ( bt->nrec < BATCH_SIZE )
+        {
+            if ( !profile_sr_next_line(args->aux.srs) ) { eof = 1; break; }
+            bcf1_t *line = args->aux.srs->readers[0].buffer[0];
+            if ( !prepare_record(args, line) ) continue;
+            bt->unseen[bt->nrec] = args->aux.unseen;
+            if ( bt->ploidy ) memcpy(bt->ploidy + bt->nrec*nsmpl, args->aux.ploidy, nsmpl);
+            bcf_copy(bt->rec[bt->nrec++], line);
+        }
+        if ( bt->nrec ) batch_pool_submit(pool);
+    }
+    batch_pool_destroy(pool);
+
+    for (i=0; i<nthreads; i++) mcall_destroy_worker(&calls[i]);
+    for (i=0; i<nbatch; i++)
+    {
+        for (j=0; j<BATCH_SIZE; j++) bcf_destroy(batch[i].rec[j]);
+        free(batch[i].rec);
+        free(batch[i].unseen);
+        free(batch[i].ret);
+        free(batch[i].ploidy);
+    }
+    free(batch);
+    free(batches);
+    free(calls);
+    free(workers);
+}
+
 static void usage(args_t *args)
 {
     fprintf(stderr, "\n");
@@ -624,6 +769,8 @@ static void usage(args_t *args)
     fprintf(stderr, "   -t, --targets <region>          similar to -r but streams rather than index-jumps\n");
     fprintf(stderr, "   -T, --targets-file <file>       similar to -R but streams rather than index-jumps\n");
     fprintf(stderr, "       --threads <int>             number of extra output compression threads [0]\n");
+    fprintf(stderr, "       --record-threads <int>      number of threads calling the sites with -m [0]\n");
+    fprintf(stderr, "       --write-index               index the compressed output on the fly, the index is written to <file>.csi\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "Input/output options:\n");
     fprintf(stderr, "   -A, --keep-alts                 keep all possible alternate alleles at variant sites\n");
@@ -689,6 +836,8 @@ int main_vcfcall(int argc, char *argv[])
         {"targets",required_argument,NULL,'t'},
         {"targets-file",required_argument,NULL,'T'},
         {"threads",required_argument,NULL,9},
+        {"record-threads",required_argument,NULL,10},
+        {"write-index",no_argument,NULL,11},
         {"keep-alts",no_argument,NULL,'A'},
         {"insert-missed",no_argument,NULL,'i'},
         {"skip-Ns",no_argument,NULL,'N'},            // now the new default
@@ -772,6 +921,11 @@ int main_vcfcall(int argc, char *argv[])
             case 's': args.samples_fname = optarg; break;
             case 'S': args.samples_fname = optarg; args.samples_is_file = 1; break;
             case  9 : args.n_threads = strtol(optarg, 0, 0); break;
+            case 10 :
+                args.record_threads = strtol(optarg,&tmp,10);
+                if ( *tmp || args.record_threads<0 ) error("Could not parse argument: --record-threads %s\n", optarg);
+                break;
+            case 11 : args.write_index = 1; break;
             case  8 : args.record_cmd_line = 0; break;
             default: usage(&args);
         }
@@ -805,61 +959,39 @@ int main_vcfcall(int argc, char *argv[])
     }
     if ( args.flag & CF_INS_MISSED && !(args.aux.flag&CALL_CONSTR_ALLELES) ) error("The -i option requires -C alleles\n");
     if ( args.aux.flag&CALL_VARONLY && args.gvcf ) error("The two options cannot be combined: --variants-only and --gvcf\n");
+    if ( args.record_threads )
+    {
+        if ( !(args.flag & CF_MCALL) ) error("The --record-threads option requires -m\n");
+        if ( args.aux.flag & CALL_CONSTR_ALLELES ) error("The two options cannot be combined: --record-threads and \"-C alleles\"\n");
+    }
     init_data(&args);
 
-    while ( bcf_sr_next_line(args.aux.srs) )
+    if ( args.record_threads )
+        call_records_threaded(&args);
+    else
     {
-        bcf1_t *bcf_rec = args.aux.srs->readers[0].buffer[0];
-        if ( args.samples_map ) bcf_subset(args.aux.hdr, bcf_rec, args.nsamples, args.samples_map);
-        bcf_unpack(bcf_rec, BCF_UN_STR);
-
-        // Skip unwanted sites
-        int i, is_indel = bcf_is_snp(bcf_rec) ? 0 : 1;
-        if ( (args.flag & CF_INDEL_ONLY) && !is_indel ) continue;
-        if ( (args.flag & CF_NO_INDEL) && is_indel ) continue;
-        if ( (args.flag & CF_ACGT_ONLY) && (bcf_rec->d.allele[0][0]=='N' || bcf_rec->d.allele[0][0]=='n') ) continue;   // REF[0] is 'N'
-
-        // Which allele is symbolic? All SNPs should have it, but not indels
-        args.aux.unseen = 0;
-        for (i=1; i<bcf_rec->n_allele; i++)
+        while ( profile_sr_next_line(args.aux.srs) )
         {
-            if ( bcf_rec->d.allele[i][0]=='X' ) { args.aux.unseen = i; break; }  // old X
-            if ( bcf_rec->d.allele[i][0]=='<' )
+            bcf1_t *bcf_rec = args.aux.srs->readers[0].buffer[0];
+            if ( !prepare_record(&args, bcf_rec) ) continue;
+
+            // Various output modes: QCall output (todo)
+            if ( args.flag & CF_QCALL )
             {
-                if ( bcf_rec->d.allele[i][1]=='X' && bcf_rec->d.allele[i][2]=='>' ) { args.aux.unseen = i; break; } // old <X>
-                if ( bcf_rec->d.allele[i][1]=='*' && bcf_rec->d.allele[i][2]=='>' ) { args.aux.unseen = i; break; } // new <*>
+                qcall(&args.aux, bcf_rec);
+                continue;
             }
-        }
-        int is_ref = (bcf_rec->n_allele==1 || (bcf_rec->n_allele==2 && args.aux.unseen>0)) ? 1 : 0;
-
-        if ( is_ref && args.aux.flag&CALL_VARONLY )
-            continue;
-
-        bcf_unpack(bcf_rec, BCF_UN_ALL);
-        if ( args.nsex ) set_ploidy(&args, bcf_rec);
 
-        // Various output modes: QCall output (todo)
-        if ( args.flag & CF_QCALL )
-        {
-            qcall(&args.aux, bcf_rec);
-            continue;
+            // Calling modes which output VCFs
+            int ret;
+            uint64_t t0 = profile_begin();
+            if ( args.flag & CF_MCALL )
+                ret = mcall(&args.aux, bcf_rec);
+            else
+                ret = ccall(&args.aux, bcf_rec);
+            profile_end(PROF_CALL, t0);
+            write_record(&args, bcf_rec, ret);
         }
-
-        // Calling modes which output VCFs
-        int ret;
-        if ( args.flag & CF_MCALL )
-            ret = mcall(&args.aux, bcf_rec);
-        else
-            ret = ccall(&args.aux, bcf_rec);
-        if ( ret==-1 ) error("Something is wrong\n");
-        else if ( ret==-2 ) continue;   // skip the site
-
-        // Normal output
-        if ( (args.aux.flag & CALL_VARONLY) && ret==0 && !args.gvcf ) continue;     // not a variant
-        if ( args.gvcf )
-            bcf_rec = gvcf_write(args.gvcf, args.out_fh, args.aux.hdr, bcf_rec, ret==1?1:0);
-        if ( bcf_rec )
-            bcf_write1(args.out_fh, args.aux.hdr, bcf_rec);
     }
     if ( args.gvcf ) gvcf_write(args.gvcf, args.out_fh, args.aux.hdr, NULL, 0);
     if ( args.flag & CF_INS_MISSED ) bcf_sr_regions_flush(args.aux.srs->targets);
@@ -32,8 +32,11 @@
 
 #include <stdio.h>
 #include <unistd.h>
+#include <errno.h>
+#include <string.h>
 #include <getopt.h>
 #include <math.h>
+#include <pthread.h>
 #include <htslib/vcf.h>
 #include <htslib/synced_bcf_reader.h>
 #include <htslib/kstring.h>
@@ -42,6 +45,7 @@
 #include "bcftools.h"
 #include "HMM.h"
 #include "rbuf.h"
+#include "baflrr.h"
 
 #define DBG0 0
 
@@ -90,14 +94,29 @@ typedef struct _args_t
     int ntprob_arr;
 
     hmm_t *hmm;
-    double *eprob;          // emission probs [nstates*nsites,msites]
+    double *eprob;          // emission probs [nstates*nsites,meprob]
     uint32_t *sites;        // positions [nsites,msites]
-    int nsites, msites;
+    int nsites, msites, meprob;
+
+    // multi-sample mode (-S): one run per query sample, each a copy of this
+    // structure with its own observations and output directory. The runs
+    // borrow hmm, eprob and tmpf from the worker which flushes them
+    struct _args_t *runs;
+    int nruns, nthreads, reopen;    // reopen: the output files are kept closed between flushes
+    char *samples_fname;
+
+    // the --baf-cache input, read one chromosome at a time instead of the VCF
+    baflrr_t *baflrr;
+    char *cache_fname;
+    uint32_t *cache_pos;
+    float *cache_baf[2], *cache_lrr[2];
+    int mcache_pos, mcache[2];
+    const char *chr;        // the current chromosome
 
     double baum_welch_th, optimize_frac; 
     float plot_th;
     FILE *summary_fh;
-    char **argv, *regions_list, *summary_fname, *output_dir;
+    char **argv, *regions_list, *summary_fname, *output_dir;   // output_dir is owned by the run in multi-sample mode
     char *targets_list, *af_fname;
     int argc, verbose, lrr_smooth_win;
 }
@@ -220,50 +239,125 @@ static void init_sample_files(sample_t *smpl, char *dir)
 }
 static void close_sample_files(sample_t *smpl)
 {
-    fclose(smpl->dat_fh);
-    fclose(smpl->cn_fh);
-    fclose(smpl->summary_fh);
+    if ( !smpl->dat_fh ) return;
+    if ( fclose(smpl->dat_fh) ) error("Close failed: %s\n", smpl->dat_fname);
+    if ( fclose(smpl->cn_fh) ) error("Close failed: %s\n", smpl->cn_fname);
+    if ( fclose(smpl->summary_fh) ) error("Close failed: %s\n", smpl->summary_fname);
+    smpl->dat_fh = smpl->cn_fh = smpl->summary_fh = NULL;
+}
+static void reopen_sample_files(sample_t *smpl)
+{
+    smpl->dat_fh = fopen(smpl->dat_fname,"a");
+    if ( !smpl->dat_fh ) error("Failed to open %s: %s\n", smpl->dat_fname,strerror(errno));
+    smpl->cn_fh = fopen(smpl->cn_fname,"a");
+    if ( !smpl->cn_fh ) error("Failed to open %s: %s\n", smpl->cn_fname,strerror(errno));
+    smpl->summary_fh = fopen(smpl->summary_fname,"a");
+    if ( !smpl->summary_fh ) error("Failed to open %s: %s\n", smpl->summary_fname,strerror(errno));
+}
+static void close_run_files(args_t *args)
+{
+    close_sample_files(&args->query_sample);
+    if ( args->control_sample.name ) close_sample_files(&args->control_sample);
+    if ( args->summary_fh )
+    {
+        if ( fclose(args->summary_fh) ) error("Close failed: %s\n", args->summary_fname);
+        args->summary_fh = NULL;
+    }
+}
+static void reopen_run_files(args_t *args)
+{
+    reopen_sample_files(&args->query_sample);
+    if ( !args->control_sample.name ) return;
+    reopen_sample_files(&args->control_sample);
+    args->summary_fh = fopen(args->summary_fname,"a");
+    if ( !args->summary_fh ) error("Failed to open %s: %s\n", args->summary_fname,strerror(errno));
 }
 
 static double norm_cdf(double mean, double dev);
+char *msprintf(const char *fmt, ...);
+static void init_run(args_t *args);
+static int sample_idx(args_t *args, const char *name)
+{
+    if ( args->baflrr ) return baflrr_sample_idx(args->baflrr, name);
+    return bcf_hdr_id2int(args->hdr,BCF_DT_SAMPLE,name);
+}
 static void init_data(args_t *args)
 {
     args->prev_rid = -1;
-    args->hdr = args->files->readers[0].header;
+    args->hdr = args->baflrr ? NULL : args->files->readers[0].header;
 
-    if ( !args->query_sample.name )
+    int i, nquery = 1;
+    char **query = &args->query_sample.name;
+    if ( args->samples_fname )
+    {
+        if ( args->query_sample.name ) error("The options -s and -S cannot be combined\n");
+        query = hts_readlist(args->samples_fname, 1, &nquery);
+        if ( !query || !nquery ) error("Could not read the list: %s\n", args->samples_fname);
+        for (i=0; i<nquery; i++)
+            if ( sample_idx(args,query[i])<0 ) error("The sample \"%s\" not found\n", query[i]);
+    }
+    else if ( !args->query_sample.name )
     {
-        if ( bcf_hdr_nsamples(args->hdr)>1 ) error("Multi-sample VCF, missing the -s option\n");
-        args->query_sample.name = strdup(args->hdr->samples[0]);
+        if ( (args->baflrr ? baflrr_nsamples(args->baflrr) : bcf_hdr_nsamples(args->hdr))>1 ) error("Multi-sample VCF, missing the -s option\n");
+        args->query_sample.name = strdup(args->baflrr ? baflrr_sample_name(args->baflrr,0) : args->hdr->samples[0]);
     }
     else 
-        if ( bcf_hdr_id2int(args->hdr,BCF_DT_SAMPLE,args->query_sample.name)<0 ) error("The sample \"%s\" not found\n", args->query_sample.name);
-    if ( !args->files->readers[0].file->is_bin )
+        if ( sample_idx(args,args->query_sample.name)<0 ) error("The sample \"%s\" not found\n", args->query_sample.name);
+    if ( args->baflrr )
+    {
+        if ( args->control_sample.name && sample_idx(args,args->control_sample.name)<0 )
+            error("The sample \"%s\" not found\n", args->control_sample.name);
+    }
+    else if ( !args->files->readers[0].file->is_bin )
     {
         int ret;
         kstring_t tmp = {0,0,0};
-        if ( args->control_sample.name )
+        for (i=0; i<nquery; i++)
         {
-            ksprintf(&tmp, "%s,%s", args->query_sample.name,args->control_sample.name);
-            ret = bcf_hdr_set_samples(args->hdr, tmp.s, 0);
-        }
-        else
-        {
-            ret = bcf_hdr_set_samples(args->hdr, args->query_sample.name, 0);
-            tmp.s = args->query_sample.name;
+            if ( i ) kputc(',',&tmp);
+            kputs(query[i],&tmp);
         }
+        if ( args->control_sample.name ) ksprintf(&tmp, ",%s", args->control_sample.name);
+        ret = bcf_hdr_set_samples(args->hdr, tmp.s, 0);
         if ( ret<0 ) error("Error parsing the list of samples: %s\n", tmp.s);
-        else if ( ret>0 ) error("The sample not found in the VCF: %s\n", ret==1 ? args->query_sample.name : args->control_sample.name);
-
-        if ( args->control_sample.name ) free(tmp.s);
+        else if ( ret>0 ) error("The sample not found in the VCF: %s\n", ret<=nquery ? query[ret-1] : args->control_sample.name);
+        free(tmp.s);
     }
-    args->query_sample.idx = bcf_hdr_id2int(args->hdr,BCF_DT_SAMPLE,args->query_sample.name);
-    args->control_sample.idx = args->control_sample.name ? bcf_hdr_id2int(args->hdr,BCF_DT_SAMPLE,args->control_sample.name) : -1;
     args->nstates = args->control_sample.name ? N_STATES*N_STATES : N_STATES;
     args->tprob  = init_tprob_matrix(args->nstates, args->ij_prob, args->same_prob);
     args->iprobs = init_iprobs(args->nstates, args->same_prob);
-    args->hmm = hmm_init(args->nstates, args->tprob, 10000);
-    hmm_init_states(args->hmm, args->iprobs);
+
+    if ( !args->samples_fname )
+    {
+        args->hmm = hmm_init(args->nstates, args->tprob, 10000);
+        hmm_init_states(args->hmm, args->iprobs);
+        init_run(args);
+        return;
+    }
+
+    // one run per query sample, the output goes to a subdirectory named after the sample
+    args->nruns = nquery;
+    args->runs  = (args_t*) malloc(sizeof(args_t)*nquery);
+    for (i=0; i<nquery; i++)
+    {
+        args_t *run = &args->runs[i];
+        *run = *args;
+        run->runs   = NULL;
+        run->nruns  = 0;
+        run->reopen = 1;
+        run->query_sample.name = query[i];
+        run->output_dir = msprintf("%s/%s", args->output_dir, query[i]);
+        init_run(run);
+        close_run_files(run);
+    }
+    free(query);
+}
+
+// Per-sample part of the initialization: sample indexes, output files and their headers
+static void init_run(args_t *args)
+{
+    args->query_sample.idx = sample_idx(args,args->query_sample.name);
+    args->control_sample.idx = args->control_sample.name ? sample_idx(args,args->control_sample.name) : -1;
 
     args->summary_fh = stdout;
     init_sample_files(&args->query_sample, args->output_dir);
@@ -392,9 +486,7 @@ static void plot_sample(args_t *args, sample_t *smpl)
 
 static void create_plots(args_t *args)
 {
-    close_sample_files(&args->query_sample);
-    if ( args->control_sample.name ) close_sample_files(&args->control_sample);
-    if ( args->summary_fh ) fclose(args->summary_fh);
+    close_run_files(args);
 
     if ( !args->control_sample.name )
     {
@@ -559,15 +651,11 @@ static void create_plots(args_t *args)
     free(fname);
 }
 
-static void destroy_data(args_t *args)
+static void destroy_run(args_t *args)
 {
-    bcf_sr_destroy(args->files);
-    hmm_destroy(args->hmm);
     free(args->tmpf);
     free(args->sites);
     free(args->eprob);
-    free(args->tprob);
-    free(args->iprobs);
     free(args->summary_fname);
     free(args->nonref_afs);
     free(args->query_sample.baf);
@@ -581,6 +669,25 @@ static void destroy_data(args_t *args)
     free(args->control_sample.dat_fname);
     free(args->control_sample.cn_fname);
     free(args->control_sample.summary_fname);
+    if ( args->reopen ) free(args->output_dir);
+}
+static void destroy_data(args_t *args)
+{
+    int i;
+    bcf_sr_destroy(args->files);
+    baflrr_destroy(args->baflrr);
+    free(args->cache_pos);
+    for (i=0; i<2; i++)
+    {
+        free(args->cache_baf[i]);
+        free(args->cache_lrr[i]);
+    }
+    if ( args->hmm ) hmm_destroy(args->hmm);
+    free(args->tprob);
+    free(args->iprobs);
+    for (i=0; i<args->nruns; i++) destroy_run(&args->runs[i]);
+    free(args->runs);
+    destroy_run(args);
 }
 
 static inline char copy_number_state(args_t *args, int istate, int ismpl)
@@ -919,6 +1026,18 @@ static int update_args(args_t *args)
 static void cnv_flush_viterbi(args_t *args)
 {
     if ( !args->nsites ) return;
+    if ( args->reopen ) reopen_run_files(args);
+
+    // Output the raw data, skipping missing values
+    int i,j, isite;
+    for (isite=0; isite<args->nsites; isite++)
+    {
+        if ( args->control_sample.name && args->control_sample.baf[isite]>=0 )
+            fprintf(args->control_sample.dat_fh,"%s\t%d\t%.3f\t%.3f\n",args->chr, args->sites[isite]+1,args->control_sample.baf[isite],args->control_sample.lrr[isite]);
+        if ( args->query_sample.baf[isite]>=0 )
+            fprintf(args->query_sample.dat_fh,"%s\t%d\t%.3f\t%.3f\n",args->chr, args->sites[isite]+1,args->query_sample.baf[isite],args->query_sample.lrr[isite]);
+    }
+    hts_expand(double,args->nsites*args->nstates,args->meprob,args->eprob);
 
     // Set HMM transition matrix for the new chromsome again. This is for case
     // Baum-Welch was used, which is experimental, largerly unsupported and not
@@ -946,7 +1065,7 @@ static void cnv_flush_viterbi(args_t *args)
     if ( args->optimize_frac )
     {
         int niter = 0;
-        fprintf(stderr,"Attempting to estimate the fraction of aberrant cells (chr %s):\n", bcf_hdr_id2name(args->hdr,args->prev_rid));
+        fprintf(stderr,"Attempting to estimate the fraction of aberrant cells (chr %s):\n", args->chr);
         do
         {
             fprintf(stderr,"\t.. %f %f", args->query_sample.cell_frac,args->query_sample.baf_dev2);
@@ -974,15 +1093,15 @@ static void cnv_flush_viterbi(args_t *args)
         fprintf(stderr,"\n");
 
         fprintf(args->query_sample.summary_fh,"CF\t%s\t%d\t%d\t%.2f\t%f\n",
-            bcf_hdr_id2name(args->hdr,args->prev_rid),args->sites[0]+1,args->sites[args->nsites-1]+1,
+            args->chr,args->sites[0]+1,args->sites[args->nsites-1]+1,
             args->query_sample.cell_frac,sqrt(args->query_sample.baf_dev2));
         if ( args->control_sample.name )
         {
             fprintf(args->control_sample.summary_fh,"CF\t%s\t%d\t%d\t%.2f\t%f\n",
-                    bcf_hdr_id2name(args->hdr,args->prev_rid),args->sites[0]+1,args->sites[args->nsites-1]+1,
+                    args->chr,args->sites[0]+1,args->sites[args->nsites-1]+1,
                     args->control_sample.cell_frac,sqrt(args->control_sample.baf_dev2));
             fprintf(args->summary_fh,"CF\t%s\t%d\t%d\t%.2f\t%.2f\t%f\t%f\n",
-                    bcf_hdr_id2name(args->hdr,args->prev_rid),args->sites[0]+1,args->sites[args->nsites-1]+1,
+                    args->chr,args->sites[0]+1,args->sites[args->nsites-1]+1,
                     args->query_sample.cell_frac, args->control_sample.cell_frac,
                     sqrt(args->query_sample.baf_dev2), sqrt(args->control_sample.baf_dev2));
         }
@@ -1021,7 +1140,7 @@ static void cnv_flush_viterbi(args_t *args)
     // Output the results
     uint8_t *vpath = hmm_get_viterbi_path(hmm);
     double qual = 0, *fwd = hmm_get_fwd_bwd_prob(hmm);
-    int i,j, isite, start_cn = vpath[0], start_pos = args->sites[0], istart_pos = 0;
+    int start_cn = vpath[0], start_pos = args->sites[0], istart_pos = 0;
     int ctrl_ntot = 0, smpl_ntot = 0, ctrl_nhet = 0, smpl_nhet = 0;
     for (isite=0; isite<args->nsites; isite++)
     {
@@ -1033,7 +1152,7 @@ static void cnv_flush_viterbi(args_t *args)
         // output CN and fwd-bwd likelihood for each site
         if ( args->query_sample.cn_fh )
         {
-            fprintf(args->query_sample.cn_fh, "%s\t%d\t%c", bcf_hdr_id2name(args->hdr,args->prev_rid), args->sites[isite]+1, copy_number_state(args,state,0));
+            fprintf(args->query_sample.cn_fh, "%s\t%d\t%c", args->chr, args->sites[isite]+1, copy_number_state(args,state,0));
             if ( !args->control_sample.cn_fh )
                 for (i=0; i<args->nstates; i++) fprintf(args->query_sample.cn_fh, "\t%f", pval[i]);
             else
@@ -1052,7 +1171,7 @@ static void cnv_flush_viterbi(args_t *args)
         }
         if ( args->control_sample.cn_fh )
         {
-            fprintf(args->control_sample.cn_fh, "%s\t%d\t%c", bcf_hdr_id2name(args->hdr,args->prev_rid), args->sites[isite]+1, copy_number_state(args,state,1));
+            fprintf(args->control_sample.cn_fh, "%s\t%d\t%c", args->chr, args->sites[isite]+1, copy_number_state(args,state,1));
             for (i=0; i<N_STATES; i++)
             {
                 double sum = 0;
@@ -1072,16 +1191,16 @@ static void cnv_flush_viterbi(args_t *args)
             char start_cn_query = copy_number_state(args,start_cn,0);
             qual = phred_score(1 - qual/(isite - istart_pos));
             fprintf(args->query_sample.summary_fh,"RG\t%s\t%d\t%d\t%c\t%.1f\t%d\t%d\n",
-                bcf_hdr_id2name(args->hdr,args->prev_rid), start_pos+1, args->sites[isite],start_cn_query,qual,smpl_ntot,smpl_nhet);
+                args->chr, start_pos+1, args->sites[isite],start_cn_query,qual,smpl_ntot,smpl_nhet);
 
             if ( args->control_sample.name )
             {
                 // regions 0-based, half-open
                 char start_cn_ctrl = copy_number_state(args,start_cn,1);
                 fprintf(args->control_sample.summary_fh,"RG\t%s\t%d\t%d\t%c\t%.1f\t%d\t%d\n",
-                    bcf_hdr_id2name(args->hdr,args->prev_rid), start_pos+1, args->sites[isite],start_cn_ctrl,qual,ctrl_ntot,ctrl_nhet);
+                    args->chr, start_pos+1, args->sites[isite],start_cn_ctrl,qual,ctrl_ntot,ctrl_nhet);
                 fprintf(args->summary_fh,"RG\t%s\t%d\t%d\t%c\t%c\t%.1f\t%d\t%d\t%d\t%d\n",
-                    bcf_hdr_id2name(args->hdr,args->prev_rid), start_pos+1, args->sites[isite],start_cn_query,start_cn_ctrl,qual,smpl_ntot,smpl_nhet,ctrl_ntot,ctrl_nhet);
+                    args->chr, start_pos+1, args->sites[isite],start_cn_query,start_cn_ctrl,qual,smpl_ntot,smpl_nhet,ctrl_ntot,ctrl_nhet);
             }
 
             istart_pos = isite;
@@ -1094,25 +1213,26 @@ static void cnv_flush_viterbi(args_t *args)
     qual = phred_score(1 - qual/(isite - istart_pos));
     char start_cn_query = copy_number_state(args,start_cn,0);
     fprintf(args->query_sample.summary_fh,"RG\t%s\t%d\t%d\t%c\t%.1f\t%d\t%d\n",
-        bcf_hdr_id2name(args->hdr,args->prev_rid), start_pos+1, args->sites[isite-1]+1,start_cn_query,qual,smpl_ntot,smpl_nhet);
+        args->chr, start_pos+1, args->sites[isite-1]+1,start_cn_query,qual,smpl_ntot,smpl_nhet);
     if ( args->control_sample.name )
     {
         char start_cn_ctrl = copy_number_state(args,start_cn,1);
         fprintf(args->control_sample.summary_fh,"RG\t%s\t%d\t%d\t%c\t%.1f\t%d\t%d\n",
-            bcf_hdr_id2name(args->hdr,args->prev_rid), start_pos+1, args->sites[isite-1]+1,start_cn_ctrl,qual,ctrl_ntot,ctrl_nhet);
+            args->chr, start_pos+1, args->sites[isite-1]+1,start_cn_ctrl,qual,ctrl_ntot,ctrl_nhet);
         fprintf(args->summary_fh,"RG\t%s\t%d\t%d\t%c\t%c\t%.1f\t%d\t%d\t%d\t%d\n",
-            bcf_hdr_id2name(args->hdr,args->prev_rid), start_pos+1, args->sites[isite-1]+1,start_cn_query,start_cn_ctrl,qual,smpl_ntot,smpl_nhet,ctrl_ntot,ctrl_nhet);
+            args->chr, start_pos+1, args->sites[isite-1]+1,start_cn_query,start_cn_ctrl,qual,smpl_ntot,smpl_nhet,ctrl_ntot,ctrl_nhet);
     }
+    if ( args->reopen ) close_run_files(args);
 }
 
-static int parse_lrr_baf(sample_t *smpl, bcf_fmt_t *baf_fmt, bcf_fmt_t *lrr_fmt, float *baf, float *lrr)
+static int set_lrr_baf(float baf_in, float lrr_in, int use_lrr, float *baf, float *lrr)
 {
-    *baf = ((float*)(baf_fmt->p + baf_fmt->size*smpl->idx))[0];
+    *baf = baf_in;
     if ( bcf_float_is_missing(*baf) || isnan(*baf) ) *baf = -0.1;    // arbitrary negative value == missing value
 
-    if ( lrr_fmt )
+    if ( use_lrr )
     {
-        *lrr = ((float*)(lrr_fmt->p + lrr_fmt->size*smpl->idx))[0];
+        *lrr = lrr_in;
         if ( bcf_float_is_missing(*lrr) || isnan(*lrr) ) { *lrr = 0; *baf = -0.1; }
     }
     else
@@ -1120,9 +1240,53 @@ static int parse_lrr_baf(sample_t *smpl, bcf_fmt_t *baf_fmt, bcf_fmt_t *lrr_fmt,
 
     return *baf<0 ? 0 : 1;
 }
+static int parse_lrr_baf(sample_t *smpl, bcf_fmt_t *baf_fmt, bcf_fmt_t *lrr_fmt, float *baf, float *lrr)
+{
+    if ( smpl->idx<0 ) return set_lrr_baf(NAN, 0, 0, baf, lrr);
+    return set_lrr_baf(((float*)(baf_fmt->p + baf_fmt->size*smpl->idx))[0],
+                       lrr_fmt ? ((float*)(lrr_fmt->p + lrr_fmt->size*smpl->idx))[0] : 0,
+                       lrr_fmt ? 1 : 0, baf, lrr);
+}
 
 int read_AF(bcf_sr_regions_t *tgt, bcf1_t *line, double *alt_freq);
 
+// Append the observed values of one site to the buffered chromosome
+static void cnv_add_site(args_t *args, uint32_t pos, float baf1, float lrr1, float baf2, float lrr2)
+{
+    // Realloc buffers needed to store observed data and used by viterbi and fwd-bwd
+    args->nsites++;
+    int m = args->msites;
+    hts_expand(uint32_t,args->nsites,args->msites,args->sites);
+    if ( args->msites!=m )
+    {
+        if ( args->control_sample.name )
+        {
+            args->control_sample.lrr = (float*) realloc(args->control_sample.lrr,sizeof(float)*args->msites);
+            args->control_sample.baf = (float*) realloc(args->control_sample.baf,sizeof(float)*args->msites);
+        }
+        args->query_sample.lrr = (float*) realloc(args->query_sample.lrr,sizeof(float)*args->msites);
+        args->query_sample.baf = (float*) realloc(args->query_sample.baf,sizeof(float)*args->msites);
+        if ( args->af_fname )
+            args->nonref_afs = (float*) realloc(args->nonref_afs,sizeof(float)*args->msites);
+    }
+    args->sites[args->nsites-1] = pos;
+    args->query_sample.lrr[args->nsites-1] = lrr1;
+    args->query_sample.baf[args->nsites-1] = baf1;
+    if ( args->control_sample.name )
+    {
+        args->control_sample.lrr[args->nsites-1] = lrr2;
+        args->control_sample.baf[args->nsites-1] = baf2;
+    }
+
+    if ( baf1>=0 )
+    {
+        if ( baf1<1/5. ) args->nRR++;
+        else if ( baf1>4/5. ) args->nAA++;
+        else args->nRA++;
+    }
+    args->nused++;
+}
+
 static void cnv_next_line(args_t *args, bcf1_t *line)
 {
     if ( !line ) 
@@ -1137,6 +1301,7 @@ static void cnv_next_line(args_t *args, bcf1_t *line)
         // New chromosome
         cnv_flush_viterbi(args);
         args->prev_rid = line->rid;
+        args->chr = bcf_seqname(args->hdr,line);
         args->nsites = 0;
         args->nRR = args->nAA = args->nRA = 0;
     }
@@ -1154,48 +1319,168 @@ static void cnv_next_line(args_t *args, bcf1_t *line)
     ret += parse_lrr_baf(&args->control_sample,baf_fmt,lrr_fmt,&baf2,&lrr2);
     if ( !ret ) return;
 
-    // Realloc buffers needed to store observed data and used by viterbi and fwd-bwd
-    args->nsites++;
-    int m = args->msites;
-    hts_expand(uint32_t,args->nsites,args->msites,args->sites);
-    if ( args->msites!=m )
-    {
-        args->eprob = (double*) realloc(args->eprob,sizeof(double)*args->msites*args->nstates);
-        if ( args->control_sample.name )
-        {
-            args->control_sample.lrr = (float*) realloc(args->control_sample.lrr,sizeof(float)*args->msites);
-            args->control_sample.baf = (float*) realloc(args->control_sample.baf,sizeof(float)*args->msites);
-        }
-        args->query_sample.lrr = (float*) realloc(args->query_sample.lrr,sizeof(float)*args->msites);
-        args->query_sample.baf = (float*) realloc(args->query_sample.baf,sizeof(float)*args->msites);
-        if ( args->af_fname )
-            args->nonref_afs = (float*) realloc(args->nonref_afs,sizeof(float)*args->msites);
-    }
-    args->sites[args->nsites-1] = line->pos;
-    args->query_sample.lrr[args->nsites-1] = lrr1;
-    args->query_sample.baf[args->nsites-1] = baf1;
+    cnv_add_site(args, line->pos, baf1,lrr1, baf2,lrr2);
     if ( args->af_fname )
     {
         double alt_freq;
         args->nonref_afs[args->nsites-1] = read_AF(args->files->targets,line,&alt_freq)<0 ? args->nonref_af_dflt : alt_freq;
     }
-    if ( args->control_sample.name )
+}
+
+// Load one chromosome of the --baf-cache into the run's buffers
+static void cnv_cache_chr(args_t *args, args_t *run, int iseq)
+{
+    int i, nsites = baflrr_get_sites(args->baflrr, iseq, &args->cache_pos, &args->mcache_pos);
+    int use_lrr = args->lrr_bias>0 ? 1 : 0;
+    sample_t *smpl[2] = { &run->query_sample, &run->control_sample };
+    for (i=0; i<2; i++)
+        if ( smpl[i]->idx>=0 )
+            baflrr_get_values(args->baflrr, iseq, smpl[i]->idx, &args->cache_baf[i], use_lrr ? &args->cache_lrr[i] : NULL, &args->mcache[i]);
+
+    run->prev_rid = iseq;
+    run->chr = baflrr_seq_name(args->baflrr, iseq);
+    run->nsites = 0;
+    run->nRR = run->nAA = run->nRA = 0;
+    for (i=0; i<nsites; i++)
     {
-        args->control_sample.lrr[args->nsites-1] = lrr2;
-        args->control_sample.baf[args->nsites-1] = baf2;
-        if ( baf2>=0 )  // skip missing values
-            fprintf(args->control_sample.dat_fh,"%s\t%d\t%.3f\t%.3f\n",bcf_hdr_id2name(args->hdr,args->prev_rid), line->pos+1,baf2,lrr2);
+        run->ntot++;
+        float baf1,lrr1,baf2 = -0.1,lrr2 = 0;
+        int ret = set_lrr_baf(args->cache_baf[0][i], use_lrr ? args->cache_lrr[0][i] : 0, use_lrr, &baf1,&lrr1);
+        if ( run->control_sample.idx>=0 )
+            ret += set_lrr_baf(args->cache_baf[1][i], use_lrr ? args->cache_lrr[1][i] : 0, use_lrr, &baf2,&lrr2);
+        if ( ret ) cnv_add_site(run, args->cache_pos[i], baf1,lrr1, baf2,lrr2);
     }
-    if ( baf1>=0 )  // skip missing values
-        fprintf(args->query_sample.dat_fh,"%s\t%d\t%.3f\t%.3f\n",bcf_hdr_id2name(args->hdr,args->prev_rid), line->pos+1,baf1,lrr1);
+}
 
-    if ( baf1>=0 )
+// HMM and working buffers of one flushing thread, lent to the runs it processes
+typedef struct
+{
+    hmm_t *hmm;
+    double *eprob;
+    float *tmpf;
+    int meprob, mtmpf;
+}
+cnv_worker_t;
+
+typedef struct
+{
+    args_t *args;
+    cnv_worker_t *wrk;
+    pthread_mutex_t *lock;
+    int *next;
+}
+cnv_job_t;
+
+static void flush_run(args_t *run, cnv_worker_t *wrk)
+{
+    run->hmm = wrk->hmm;
+    run->eprob = wrk->eprob; run->meprob = wrk->meprob;
+    run->tmpf  = wrk->tmpf;  run->mtmpf  = wrk->mtmpf;
+    cnv_flush_viterbi(run);
+    wrk->eprob = run->eprob; wrk->meprob = run->meprob;
+    wrk->tmpf  = run->tmpf;  wrk->mtmpf  = run->mtmpf;
+    run->hmm   = NULL;
+    run->eprob = NULL; run->meprob = 0;
+    run->tmpf  = NULL; run->mtmpf  = 0;
+}
+
+static void *flush_worker(void *arg)
+{
+    cnv_job_t *job = (cnv_job_t*) arg;
+    while (1)
     {
-        if ( baf1<1/5. ) args->nRR++;
-        else if ( baf1>4/5. ) args->nAA++;
-        else args->nRA++;
+        pthread_mutex_lock(job->lock);
+        int irun = (*job->next)++;
+        pthread_mutex_unlock(job->lock);
+        if ( irun >= job->args->nruns ) break;
+        flush_run(&job->args->runs[irun], job->wrk);
     }
-    args->nused++;
+    return NULL;
+}
+
+// Run viterbi on the buffered chromosome of all query samples, the samples
+// are processed independently by up to args->nthreads threads
+static void flush_runs(args_t *args, cnv_worker_t *wrk, int nwrk)
+{
+    int i, next = 0;
+    if ( nwrk<=1 )
+    {
+        for (i=0; i<args->nruns; i++) flush_run(&args->runs[i], &wrk[0]);
+        return;
+    }
+    pthread_mutex_t lock;
+    pthread_mutex_init(&lock, NULL);
+    pthread_t *thr = (pthread_t*) malloc(sizeof(pthread_t)*nwrk);
+    cnv_job_t *job = (cnv_job_t*) malloc(sizeof(cnv_job_t)*nwrk);
+    for (i=0; i<nwrk; i++)
+    {
+        job[i].args = args;
+        job[i].wrk  = &wrk[i];
+        job[i].lock = &lock;
+        job[i].next = &next;
+        if ( pthread_create(&thr[i], NULL, flush_worker, &job[i]) ) error("Failed to create a thread\n");
+    }
+    for (i=0; i<nwrk; i++) pthread_join(thr[i], NULL);
+    pthread_mutex_destroy(&lock);
+    free(job);
+    free(thr);
+}
+
+// Multi-sample mode: the record is read once and its BAF/LRR values are
+// appended to the per-sample arrays of each run
+static void cnv_run_all(args_t *args)
+{
+    int i, nwrk = args->nthreads > 1 ? args->nthreads : 1;
+    if ( nwrk > args->nruns ) nwrk = args->nruns;
+    cnv_worker_t *wrk = (cnv_worker_t*) calloc(nwrk, sizeof(cnv_worker_t));
+    for (i=0; i<nwrk; i++)
+    {
+        wrk[i].hmm = hmm_init(args->nstates, args->tprob, 10000);
+        hmm_init_states(wrk[i].hmm, args->iprobs);
+    }
+    if ( args->baflrr )
+    {
+        int iseq, nseq = baflrr_nseqs(args->baflrr);
+        for (iseq=0; iseq<nseq; iseq++)
+        {
+            for (i=0; i<args->nruns; i++) cnv_cache_chr(args, &args->runs[i], iseq);
+            flush_runs(args, wrk, nwrk);
+        }
+    }
+    else while ( bcf_sr_next_line(args->files) )
+    {
+        bcf1_t *line = bcf_sr_get_line(args->files,0);
+        if ( line->rid!=args->prev_rid )
+        {
+            flush_runs(args, wrk, nwrk);
+            args->prev_rid = line->rid;
+            for (i=0; i<args->nruns; i++)
+            {
+                args_t *run = &args->runs[i];
+                run->prev_rid = line->rid;
+                run->chr = bcf_seqname(args->hdr,line);
+                run->nsites = 0;
+                run->nRR = run->nAA = run->nRA = 0;
+            }
+        }
+        for (i=0; i<args->nruns; i++) cnv_next_line(&args->runs[i], line);
+    }
+    flush_runs(args, wrk, nwrk);
+
+    args->ntot  = args->runs[0].ntot;
+    args->nused = 0;
+    for (i=0; i<args->nruns; i++)
+    {
+        create_plots(&args->runs[i]);
+        if ( args->nused < args->runs[i].nused ) args->nused = args->runs[i].nused;
+    }
+    for (i=0; i<nwrk; i++)
+    {
+        hmm_destroy(wrk[i].hmm);
+        free(wrk[i].eprob);
+        free(wrk[i].tmpf);
+    }
+    free(wrk);
 }
 
 static void usage(args_t *args)
@@ -1208,13 +1493,16 @@ static void usage(args_t *args)
     fprintf(stderr, "General Options:\n");
     fprintf(stderr, "    -c, --control-sample <string>      optional control sample name to highlight differences\n");
     fprintf(stderr, "    -f, --AF-file <file>               read allele frequencies from file (CHR\\tPOS\\tREF,ALT\\tAF)\n");
+    fprintf(stderr, "        --baf-cache <file>             read BAF and LRR from a compact cache of the VCF, built on first use\n");
     fprintf(stderr, "    -o, --output-dir <path>            \n");
     fprintf(stderr, "    -p, --plot-threshold <float>       plot aberrant chromosomes with quality at least 'float'\n");
     fprintf(stderr, "    -r, --regions <region>             restrict to comma-separated list of regions\n");
     fprintf(stderr, "    -R, --regions-file <file>          restrict to regions listed in a file\n");
     fprintf(stderr, "    -s, --query-sample <string>        query samply name\n");
+    fprintf(stderr, "    -S, --samples-file <file>          call all query samples listed in the file, output to <path>/<sample>/\n");
     fprintf(stderr, "    -t, --targets <region>             similar to -r but streams rather than index-jumps\n");
     fprintf(stderr, "    -T, --targets-file <file>          similar to -R but streams rather than index-jumps\n");
+    fprintf(stderr, "        --threads <int>                number of threads to use with -S [1]\n");
     fprintf(stderr, "HMM Options:\n");
     fprintf(stderr, "    -a, --aberrant <float[,float]>     fraction of aberrant cells in query and control [1.0,1.0]\n");
     fprintf(stderr, "    -b, --BAF-weight <float>           relative contribution from BAF [1]\n");
@@ -1272,6 +1560,9 @@ int main_vcfcnv(int argc, char *argv[])
         {"same-prob",1,0,'P'},
         {"xy-prob",1,0,'x'},
         {"sample",1,0,'s'},
+        {"samples-file",1,0,'S'},
+        {"threads",1,0,9},
+        {"baf-cache",1,0,10},
         {"control",1,0,'c'},
         {"targets",1,0,'t'},
         {"targets-file",1,0,'T'},
@@ -1282,7 +1573,7 @@ int main_vcfcnv(int argc, char *argv[])
         {0,0,0,0}
     };
     char *tmp = NULL;
-    while ((c = getopt_long(argc, argv, "h?r:R:t:T:s:o:p:l:T:c:b:P:x:e:O:W:f:a:L:d:k:",loptions,NULL)) >= 0) {
+    while ((c = getopt_long(argc, argv, "h?r:R:t:T:s:S:o:p:l:T:c:b:P:x:e:O:W:f:a:L:d:k:",loptions,NULL)) >= 0) {
         switch (c) {
             case 'L': 
                 args->lrr_smooth_win = strtol(optarg,&tmp,10);
@@ -1358,6 +1649,12 @@ int main_vcfcnv(int argc, char *argv[])
                 break;
             case 'o': args->output_dir = optarg; break;
             case 's': args->query_sample.name = strdup(optarg); break;
+            case 'S': args->samples_fname = optarg; break;
+            case 10 : args->cache_fname = optarg; break;
+            case  9 :
+                args->nthreads = strtol(optarg,&tmp,10);
+                if ( *tmp ) error("Could not parse: --threads %s\n", optarg);
+                break;
             case 'c': args->control_sample.name = optarg; break;
             case 't': args->targets_list = optarg; break;
             case 'T': args->targets_list = optarg; targets_is_file = 1; break;
@@ -1393,16 +1690,37 @@ int main_vcfcnv(int argc, char *argv[])
         if ( bcf_sr_set_targets(args->files, args->af_fname, 1, 3)<0 )
             error("Failed to read the targets: %s\n", args->af_fname);
     }
-    if ( !bcf_sr_add_reader(args->files, fname) ) error("Failed to open %s: %s\n", fname,bcf_sr_strerror(args->files->errnum));
+    if ( args->cache_fname )
+    {
+        if ( args->regions_list || args->targets_list || args->af_fname )
+            error("The options -r, -R, -t, -T and -f cannot be combined with --baf-cache\n");
+        if ( !strcmp(fname,"-") ) error("The --baf-cache option requires a file name, cannot read from stdin\n");
+        args->baflrr = baflrr_open(fname, args->cache_fname);
+    }
+    else if ( !bcf_sr_add_reader(args->files, fname) ) error("Failed to open %s: %s\n", fname,bcf_sr_strerror(args->files->errnum));
     
     init_data(args);
-    while ( bcf_sr_next_line(args->files) )
+    if ( args->nruns ) cnv_run_all(args);
+    else if ( args->baflrr )
     {
-        bcf1_t *line = bcf_sr_get_line(args->files,0);
-        cnv_next_line(args, line);
+        int iseq, nseq = baflrr_nseqs(args->baflrr);
+        for (iseq=0; iseq<nseq; iseq++)
+        {
+            cnv_cache_chr(args, args, iseq);
+            cnv_flush_viterbi(args);
+        }
+        create_plots(args);
+    }
+    else
+    {
+        while ( bcf_sr_next_line(args->files) )
+        {
+            bcf1_t *line = bcf_sr_get_line(args->files,0);
+            cnv_next_line(args, line);
+        }
+        cnv_next_line(args, NULL);
+        create_plots(args);
     }
-    cnv_next_line(args, NULL);
-    create_plots(args);
     fprintf(stderr,"Number of lines: total/processed: %d/%d\n", args->ntot,args->nused);
     destroy_data(args);
     free(args);
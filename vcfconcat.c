@@ -28,12 +28,38 @@ THE SOFTWARE.  */
 #include <string.h>
 #include <errno.h>
 #include <math.h>
+#include <pthread.h>
 #include <htslib/vcf.h>
 #include <htslib/synced_bcf_reader.h>
 #include <htslib/kseq.h>
 #include <htslib/bgzf.h>
 #include <htslib/tbx.h> // for hts_get_bgzfp()
 #include "bcftools.h"
+#include "gtedit.h"
+
+// With --ligate-threads, the per-sample phase agreement at the overlap of each
+// chunk with the next one is counted ahead of time by worker threads. The
+// counts are raw, not adjusted for the phase flips of the preceding chunks,
+// which makes the overlaps independent of each other.
+typedef struct
+{
+    int *nmatch, *nmism;    // NULL if the next chunk does not overlap
+    int npairs, ready;
+    uint64_t pos_sum;       // to verify that concat() buffered the same pairs
+}
+ligate_ovl_t;
+
+typedef struct
+{
+    struct _args_t *args;
+    ligate_ovl_t *ovl;          // ovl[i]: the overlap of the i-th file with the next one
+    int inext, iflush, nahead;  // inext: the next overlap to count; iflush: the first one not used yet
+    int nthreads;
+    pthread_t *threads;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+}
+ligate_pool_t;
 
 typedef struct _args_t
 {
@@ -44,18 +70,27 @@ typedef struct _args_t
     int *seen_seq;
 
     // phasing
-    int *start_pos, start_tid, ifname;
-    int *swap_phase, nswap, *nmatch, *nmism;
+    int *start_pos, *start_chr, start_tid, ifname;
+    int nswap, *nmatch, *nmism;
+    uint8_t *swap_phase;
     bcf1_t **buf;
     int nbuf, mbuf, prev_chr, min_PQ, prev_pos_check;
     int32_t *GTa, *GTb, mGTa, mGTb, *phase_qual, *phase_set;
 
     char **argv, *output_fname, *file_list, **fnames, *remove_dups, *regions_list;
     int argc, nfnames, allow_overlaps, phased_concat, regions_is_file;
-    int compact_PS, phase_set_changed, naive_concat;
+    int compact_PS, phase_set_changed, naive_concat, naive_prefetch, write_index;
+    int ligate_threads;
+    ligate_pool_t *ligate_pool;
+    out_idx_t *out_idx;
 }
 args_t;
 
+static ligate_pool_t *ligate_init(args_t *args);
+static ligate_ovl_t *ligate_wait(ligate_pool_t *pool, int ia);
+static void ligate_release(ligate_pool_t *pool, int ia);
+static void ligate_destroy(ligate_pool_t *pool);
+
 static void init_data(args_t *args)
 {
     bcf1_t *line = NULL;
@@ -66,6 +101,7 @@ static void init_data(args_t *args)
     if ( args->phased_concat )
     {
         args->start_pos = (int*) malloc(sizeof(int)*args->nfnames);
+        args->start_chr = (int*) malloc(sizeof(int)*args->nfnames);
         line = bcf_init();
     }
 
@@ -87,11 +123,12 @@ static void init_data(args_t *args)
         if ( args->phased_concat )
         {
             int ret = bcf_read(fp, hdr, line);
-            if ( ret!=0 ) args->start_pos[i] = -2;  // empty file
+            if ( ret!=0 ) args->start_pos[i] = args->start_chr[i] = -2;  // empty file
             else
             {
                 int chrid = bcf_hdr_id2int(args->out_hdr,BCF_DT_CTG,bcf_seqname(hdr,line));
                 args->start_pos[i] = chrid==prev_chrid ? line->pos : -1;
+                args->start_chr[i] = chrid;
                 prev_chrid = chrid;
             }
         }
@@ -114,6 +151,7 @@ static void init_data(args_t *args)
     if ( args->n_threads ) hts_set_threads(args->out_fh, args->n_threads);
 
     bcf_hdr_write(args->out_fh, args->out_hdr);
+    if ( args->write_index ) args->out_idx = out_idx_init(args->out_fh, args->out_hdr, args->output_fname);
 
     if ( args->allow_overlaps )
     {
@@ -151,6 +189,7 @@ static void init_data(args_t *args)
             if ( i==args->nfnames ) break;
 
             int tmp = args->start_pos[nok]; args->start_pos[nok] = args->start_pos[i]; args->start_pos[i] = tmp;
+            tmp = args->start_chr[nok]; args->start_chr[nok] = args->start_chr[i]; args->start_chr[i] = tmp;
             char *str = args->fnames[nok]; args->fnames[nok] = args->fnames[i]; args->fnames[i] = str;
         }
         for (i=nok; i<args->nfnames; i++) free(args->fnames[i]);
@@ -161,7 +200,7 @@ static void init_data(args_t *args)
                 error("The files not in ascending order: %d in %s, %d in %s\n", args->start_pos[i-1]+1,args->fnames[i-1],args->start_pos[i]+1,args->fnames[i]);
 
         args->prev_chr = -1;
-        args->swap_phase = (int*) calloc(bcf_hdr_nsamples(args->out_hdr),sizeof(int));
+        args->swap_phase = (uint8_t*) calloc(bcf_hdr_nsamples(args->out_hdr),sizeof(uint8_t));
         args->nmatch = (int*) calloc(bcf_hdr_nsamples(args->out_hdr),sizeof(int));
         args->nmism  = (int*) calloc(bcf_hdr_nsamples(args->out_hdr),sizeof(int));
         args->phase_qual = (int32_t*) malloc(bcf_hdr_nsamples(args->out_hdr)*sizeof(int32_t));
@@ -169,22 +208,25 @@ static void init_data(args_t *args)
         args->files = bcf_sr_init();
         args->files->require_index = 1;
         args->ifname = 0;
+        if ( args->ligate_threads && args->nfnames>1 ) args->ligate_pool = ligate_init(args);
     }
 }
 
 static void destroy_data(args_t *args)
 {
     int i;
+    if ( args->ligate_pool ) ligate_destroy(args->ligate_pool);
     for (i=0; i<args->nfnames; i++) free(args->fnames[i]);
     free(args->fnames);
     if ( args->files ) bcf_sr_destroy(args->files);
     if ( args->out_fh )
     {
-        if ( hts_close(args->out_fh)!=0 ) error("hts_close error\n");
+        if ( out_idx_close(args->out_idx, args->out_fh)!=0 ) error("hts_close error\n");
     }
     if ( args->out_hdr ) bcf_hdr_destroy(args->out_hdr);
     free(args->seen_seq);
     free(args->start_pos);
+    free(args->start_chr);
     free(args->swap_phase);
     for (i=0; i<args->mbuf; i++) bcf_destroy(args->buf[i]);
     free(args->buf);
@@ -201,9 +243,19 @@ int vcf_write_line(htsFile *fp, kstring_t *line);
 #define SWAP(type_t, a, b) { type_t t = a; a = b; b = t; }
 static void phase_update(args_t *args, bcf_hdr_t *hdr, bcf1_t *rec)
 {
-    int i, nGTs = bcf_get_genotypes(hdr, rec, &args->GTa, &args->mGTa);
+    // Diploid genotypes are swapped in the packed FORMAT/GT block, using
+    // swap_phase as the mask of samples to flip
+    int i, nsmpl = bcf_hdr_nsamples(hdr);
+    bcf_fmt_t *fmt = gtedit_fmt(hdr, rec, 0);
+    if ( fmt && fmt->n==2 )
+    {
+        gtedit_swap(fmt, nsmpl, args->swap_phase);
+        return;
+    }
+
+    int nGTs = bcf_get_genotypes(hdr, rec, &args->GTa, &args->mGTa);
     if ( nGTs <= 0 ) return;    // GT field is not present
-    for (i=0; i<bcf_hdr_nsamples(hdr); i++)
+    for (i=0; i<nsmpl; i++)
     {
         if ( !args->swap_phase[i] ) continue;
         int *gt = &args->GTa[i*2];
@@ -214,6 +266,43 @@ static void phase_update(args_t *args, bcf_hdr_t *hdr, bcf1_t *rec)
     bcf_update_genotypes(hdr,rec,args->GTa,nGTs);
 }
 
+// Count the heterozygous phased genotypes of each sample which agree (nmatch)
+// or disagree (nmism) in a pair of records from two overlapping chunks
+static void phase_count(bcf_hdr_t *ahdr, bcf1_t *arec, bcf_hdr_t *bhdr, bcf1_t *brec, int nsmpl,
+        int32_t **GTa, int *mGTa, int32_t **GTb, int *mGTb, int *nmatch, int *nmism)
+{
+    static int gt_absent_warned = 0;
+
+    int j, nGTs = bcf_get_genotypes(ahdr, arec, GTa, mGTa);
+    if ( nGTs < 0 )
+    {
+        if ( __sync_bool_compare_and_swap(&gt_absent_warned, 0, 1) )
+            fprintf(stderr,"GT is not present at %s:%d. (This warning is printed only once.)\n", bcf_seqname(ahdr,arec), arec->pos+1);
+        return;
+    }
+    if ( nGTs != 2*nsmpl ) return;    // not diploid
+    nGTs = bcf_get_genotypes(bhdr, brec, GTb, mGTb);
+    if ( nGTs < 0 )
+    {
+        if ( __sync_bool_compare_and_swap(&gt_absent_warned, 0, 1) )
+            fprintf(stderr,"GT is not present at %s:%d. (This warning is printed only once.)\n", bcf_seqname(bhdr,brec), brec->pos+1);
+        return;
+    }
+    if ( nGTs != 2*nsmpl ) return;    // not diploid
+
+    for (j=0; j<nsmpl; j++)
+    {
+        int *gta = &(*GTa)[j*2];
+        int *gtb = &(*GTb)[j*2];
+        if ( gta[1]==bcf_int32_vector_end || gtb[1]==bcf_int32_vector_end ) continue;
+        if ( bcf_gt_is_missing(gta[0]) || bcf_gt_is_missing(gta[1]) || bcf_gt_is_missing(gtb[0]) || bcf_gt_is_missing(gtb[1]) ) continue;
+        if ( !bcf_gt_is_phased(gta[1]) || !bcf_gt_is_phased(gtb[1]) ) continue;
+        if ( bcf_gt_allele(gta[0])==bcf_gt_allele(gta[1]) || bcf_gt_allele(gtb[0])==bcf_gt_allele(gtb[1]) ) continue;
+        if ( bcf_gt_allele(gta[0])==bcf_gt_allele(gtb[0]) && bcf_gt_allele(gta[1])==bcf_gt_allele(gtb[1]) ) nmatch[j]++;
+        if ( bcf_gt_allele(gta[0])==bcf_gt_allele(gtb[1]) && bcf_gt_allele(gta[1])==bcf_gt_allele(gtb[0]) ) nmism[j]++;
+    }
+}
+
 static void phased_flush(args_t *args)
 {
     if ( !args->nbuf ) return;
@@ -222,54 +311,26 @@ static void phased_flush(args_t *args)
     bcf_hdr_t *bhdr = args->files->readers[1].header;
 
     int i, j, nsmpl = bcf_hdr_nsamples(args->out_hdr);
-    static int gt_absent_warned = 0;
 
-    for (i=0; i<args->nbuf; i+=2)
+    // Use the counts of the worker threads, unless the pairs buffered here differ
+    // from what they saw, which can happen with more than two chunks overlapping
+    int counted = 0, ia = args->ifname - args->files->nreaders;
+    if ( args->ligate_pool && ia+1 < args->nfnames )
     {
-        bcf1_t *arec = args->buf[i];
-        bcf1_t *brec = args->buf[i+1];
-
-        int nGTs = bcf_get_genotypes(ahdr, arec, &args->GTa, &args->mGTa);
-        if ( nGTs < 0 ) 
+        ligate_ovl_t *ovl = ligate_wait(args->ligate_pool, ia);
+        uint64_t pos_sum = 0;
+        for (i=0; i<args->nbuf; i+=2) pos_sum += args->buf[i]->pos;
+        if ( ovl->nmatch && ovl->npairs==args->nbuf/2 && ovl->pos_sum==pos_sum )
         {
-            if ( !gt_absent_warned )
-            {
-                fprintf(stderr,"GT is not present at %s:%d. (This warning is printed only once.)\n", bcf_seqname(ahdr,arec), arec->pos+1);
-                gt_absent_warned = 1;
-            }
-            continue;
-        }
-        if ( nGTs != 2*nsmpl ) continue;    // not diploid
-        nGTs = bcf_get_genotypes(bhdr, brec, &args->GTb, &args->mGTb);
-        if ( nGTs < 0 )
-        {
-            if ( !gt_absent_warned )
-            {
-                fprintf(stderr,"GT is not present at %s:%d. (This warning is printed only once.)\n", bcf_seqname(bhdr,brec), brec->pos+1);
-                gt_absent_warned = 1;
-            }
-            continue;
-        }
-        if ( nGTs != 2*nsmpl ) continue;    // not diploid
-
-        for (j=0; j<nsmpl; j++)
-        {
-            int *gta = &args->GTa[j*2];
-            int *gtb = &args->GTb[j*2];
-            if ( gta[1]==bcf_int32_vector_end || gtb[1]==bcf_int32_vector_end ) continue;
-            if ( bcf_gt_is_missing(gta[0]) || bcf_gt_is_missing(gta[1]) || bcf_gt_is_missing(gtb[0]) || bcf_gt_is_missing(gtb[1]) ) continue;
-            if ( !bcf_gt_is_phased(gta[1]) || !bcf_gt_is_phased(gtb[1]) ) continue;
-            if ( bcf_gt_allele(gta[0])==bcf_gt_allele(gta[1]) || bcf_gt_allele(gtb[0])==bcf_gt_allele(gtb[1]) ) continue;
-            if ( bcf_gt_allele(gta[0])==bcf_gt_allele(gtb[0]) && bcf_gt_allele(gta[1])==bcf_gt_allele(gtb[1]) )
-            {
-                if ( args->swap_phase[j] ) args->nmism[j]++; else args->nmatch[j]++;
-            }
-            if ( bcf_gt_allele(gta[0])==bcf_gt_allele(gtb[1]) && bcf_gt_allele(gta[1])==bcf_gt_allele(gtb[0]) )
-            {
-                if ( args->swap_phase[j] ) args->nmatch[j]++; else args->nmism[j]++;
-            }
+            memcpy(args->nmatch, ovl->nmatch, sizeof(*args->nmatch)*nsmpl);
+            memcpy(args->nmism, ovl->nmism, sizeof(*args->nmism)*nsmpl);
+            counted = 1;
         }
+        ligate_release(args->ligate_pool, ia);
     }
+    for (i=0; !counted && i<args->nbuf; i+=2)
+        phase_count(ahdr, args->buf[i], bhdr, args->buf[i+1], nsmpl, &args->GTa, &args->mGTa, &args->GTb, &args->mGTb, args->nmatch, args->nmism);
+
     for (i=0; i<args->nbuf/2; i+=2)
     {
         bcf1_t *arec = args->buf[i];
@@ -281,7 +342,7 @@ static void phased_flush(args_t *args)
             bcf_update_format_int32(args->out_hdr,arec,"PS",args->phase_set,nsmpl);
             args->phase_set_changed = 0;
         }
-        bcf_write(args->out_fh, args->out_hdr, arec);
+        out_idx_write(args->out_idx, args->out_fh, args->out_hdr, arec);
 
         if ( arec->pos < args->prev_pos_check ) error("FIXME, disorder: %s:%d vs %d  [1]\n", bcf_seqname(args->files->readers[0].header,arec),arec->pos+1,args->prev_pos_check+1);
         args->prev_pos_check = arec->pos;
@@ -289,6 +350,8 @@ static void phased_flush(args_t *args)
     args->nswap = 0;
     for (j=0; j<nsmpl; j++)
     {
+        // the genotypes were compared as read, before the flips of the first chunk
+        if ( args->swap_phase[j] ) SWAP(int, args->nmatch[j], args->nmism[j]);
         if ( args->nmatch[j] >= args->nmism[j] )
             args->swap_phase[j] = 0;
         else
@@ -331,7 +394,7 @@ static void phased_flush(args_t *args)
             bcf_update_format_int32(args->out_hdr,brec,"PS",args->phase_set,nsmpl);
             args->phase_set_changed = 0;
         }
-        bcf_write(args->out_fh, args->out_hdr, brec);
+        out_idx_write(args->out_idx, args->out_fh, args->out_hdr, brec);
 
         if ( brec->pos < args->prev_pos_check ) error("FIXME, disorder: %s:%d vs %d  [2]\n", bcf_seqname(args->files->readers[1].header,brec),brec->pos+1,args->prev_pos_check+1);
         args->prev_pos_check = brec->pos;
@@ -372,7 +435,7 @@ static void phased_push(args_t *args, bcf1_t *arec, bcf1_t *brec)
             bcf_update_format_int32(args->out_hdr,arec,"PS",args->phase_set,nsmpl);
             args->phase_set_changed = 0;
         }
-        bcf_write(args->out_fh, args->out_hdr, arec);
+        out_idx_write(args->out_idx, args->out_fh, args->out_hdr, arec);
 
         if ( arec->pos < args->prev_pos_check )
             error("FIXME, disorder: %s:%d in %s vs %d written  [3]\n", bcf_seqname(args->files->readers[0].header,arec), arec->pos+1,args->files->readers[0].fname, args->prev_pos_check+1);
@@ -390,6 +453,142 @@ static void phased_push(args_t *args, bcf1_t *arec, bcf1_t *brec)
     SWAP(bcf1_t*, args->files->readers[1].buffer[0], args->buf[args->nbuf-1]);
 }
 
+// Count the phase agreement at the overlap of the ia-th and the next chunk the
+// way concat() reads it: the preceding chunk is opened too, because the pairs
+// are buffered only after reading of the preceding chunk has finished
+static void ligate_count_overlap(args_t *args, int ia, ligate_ovl_t *ovl)
+{
+    int i, iprev = ia>0 && args->start_pos[ia]>=0 ? 1 : 0;
+    bcf_srs_t *files = bcf_sr_init();
+    files->require_index = 1;
+    for (i=ia-iprev; i<=ia+1; i++)
+        if ( !bcf_sr_add_reader(files,args->fnames[i]) ) error("Failed to open %s: %s\n", args->fnames[i],bcf_sr_strerror(files->errnum));
+
+    int ra = iprev, rb = iprev + 1, nsmpl = bcf_hdr_nsamples(args->out_hdr);
+    bcf_hdr_t *ahdr = files->readers[ra].header;
+    bcf_hdr_t *bhdr = files->readers[rb].header;
+    int32_t *GTa = NULL, *GTb = NULL;
+    int mGTa = 0, mGTb = 0;
+    ovl->nmatch = (int*) calloc(nsmpl,sizeof(int));
+    ovl->nmism  = (int*) calloc(nsmpl,sizeof(int));
+
+    int seek_pos = args->start_pos[ia+1];
+    bcf_sr_seek(files, bcf_hdr_id2name(args->out_hdr,args->start_chr[ia+1]), seek_pos);
+    while ( bcf_sr_next_line(files) )
+    {
+        if ( iprev && (bcf_sr_has_line(files,0) || !bcf_sr_region_done(files,0)) ) continue;
+        if ( !bcf_sr_has_line(files,ra) )
+        {
+            if ( bcf_sr_region_done(files,ra) ) break;
+            continue;
+        }
+        bcf1_t *arec = bcf_sr_get_line(files,ra);
+        if ( arec->pos < seek_pos ) continue;   // an indel starting before the overlap
+        if ( !bcf_sr_has_line(files,rb) ) continue;
+        bcf1_t *brec = bcf_sr_get_line(files,rb);
+        if ( arec->errcode ) error("Parse error at %s:%d, cannot proceed: %s\n", bcf_seqname(ahdr,arec),arec->pos+1,files->readers[ra].fname);
+        if ( brec->errcode ) error("Parse error at %s:%d, cannot proceed: %s\n", bcf_seqname(bhdr,brec),brec->pos+1,files->readers[rb].fname);
+
+        phase_count(ahdr, arec, bhdr, brec, nsmpl, &GTa, &mGTa, &GTb, &mGTb, ovl->nmatch, ovl->nmism);
+        ovl->npairs++;
+        ovl->pos_sum += arec->pos;
+    }
+    free(GTa);
+    free(GTb);
+    bcf_sr_destroy(files);
+}
+
+static void *ligate_worker(void *arg)
+{
+    ligate_pool_t *pool = (ligate_pool_t*) arg;
+    args_t *args = pool->args;
+    while (1)
+    {
+        pthread_mutex_lock(&pool->lock);
+        while ( pool->inext < args->nfnames-1 && pool->inext > pool->iflush + pool->nahead )
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        if ( pool->inext >= args->nfnames-1 ) { pthread_mutex_unlock(&pool->lock); break; }
+        int i = pool->inext++;
+        pthread_mutex_unlock(&pool->lock);
+
+        ligate_ovl_t *ovl = &pool->ovl[i];
+        if ( args->start_pos[i+1]>=0 ) ligate_count_overlap(args, i, ovl);
+
+        pthread_mutex_lock(&pool->lock);
+        if ( i < pool->iflush )     // not needed anymore
+        {
+            free(ovl->nmatch); ovl->nmatch = NULL;
+            free(ovl->nmism); ovl->nmism = NULL;
+        }
+        ovl->ready = 1;
+        pthread_cond_broadcast(&pool->cond);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return NULL;
+}
+
+static ligate_pool_t *ligate_init(args_t *args)
+{
+    int i;
+    ligate_pool_t *pool = (ligate_pool_t*) calloc(1,sizeof(ligate_pool_t));
+    pool->args = args;
+    pool->ovl  = (ligate_ovl_t*) calloc(args->nfnames,sizeof(ligate_ovl_t));
+    pool->nthreads = args->ligate_threads;
+    pool->nahead   = 2*args->ligate_threads;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+    pool->threads = (pthread_t*) malloc(sizeof(pthread_t)*pool->nthreads);
+    for (i=0; i<pool->nthreads; i++)
+        if ( pthread_create(&pool->threads[i], NULL, ligate_worker, pool) ) error("Failed to create threads\n");
+    return pool;
+}
+
+static void ligate_free_ovl(ligate_ovl_t *ovl)
+{
+    free(ovl->nmatch); ovl->nmatch = NULL;
+    free(ovl->nmism); ovl->nmism = NULL;
+}
+
+// Wait for the counts of the ia-th overlap, the preceding ones are not needed anymore
+static ligate_ovl_t *ligate_wait(ligate_pool_t *pool, int ia)
+{
+    int i;
+    pthread_mutex_lock(&pool->lock);
+    for (i=pool->iflush; i<ia; i++)
+        if ( pool->ovl[i].ready ) ligate_free_ovl(&pool->ovl[i]);
+    if ( pool->iflush < ia ) pool->iflush = ia;
+    pthread_cond_broadcast(&pool->cond);
+    while ( !pool->ovl[ia].ready ) pthread_cond_wait(&pool->cond, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+    return &pool->ovl[ia];
+}
+
+static void ligate_release(ligate_pool_t *pool, int ia)
+{
+    pthread_mutex_lock(&pool->lock);
+    ligate_free_ovl(&pool->ovl[ia]);
+    pool->iflush = ia + 1;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static void ligate_destroy(ligate_pool_t *pool)
+{
+    int i;
+    pthread_mutex_lock(&pool->lock);
+    pool->inext  = pool->args->nfnames - 1;    // stop the workers
+    pool->iflush = pool->args->nfnames;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+    for (i=0; i<pool->nthreads; i++) pthread_join(pool->threads[i], NULL);
+    for (i=0; i<pool->args->nfnames; i++) ligate_free_ovl(&pool->ovl[i]);
+    free(pool->ovl);
+    free(pool->threads);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->cond);
+    free(pool);
+}
+
 static void concat(args_t *args)
 {
     int i;
@@ -482,7 +681,7 @@ static void concat(args_t *args)
                 bcf1_t *line = bcf_sr_get_line(args->files,i);
                 if ( !line ) continue;
                 bcf_translate(args->out_hdr, args->files->readers[i].header, line);
-                bcf_write1(args->out_fh, args->out_hdr, line);
+                out_idx_write(args->out_idx, args->out_fh, args->out_hdr, line);
                 if ( args->remove_dups ) break;
             }
         }
@@ -544,7 +743,7 @@ static void concat(args_t *args)
                     args->seen_seq[line->rid] = 1;
                     prev_chr_id = line->rid;
 
-                    if ( bcf_write(args->out_fh, args->out_hdr, line)!=0 ) error("Failed to write\n");
+                    if ( out_idx_write(args->out_idx, args->out_fh, args->out_hdr, line)!=0 ) error("Failed to write\n");
                 }
             }
             bcf_hdr_destroy(hdr);
@@ -611,87 +810,201 @@ static int check_header(const uint8_t *header)
             && header[12] == 'B' && header[13] == 'C'
             && unpackInt16((uint8_t*)&header[14]) == 2) ? 0 : -1;
 }
+// An input file of naive_concat(), opened, validated and positioned past the header.
+// With --naive-prefetch this is done ahead of time by I/O threads.
+#define NAIVE_BUF_SIZE (4*1024*1024)    // must fit at least one BGZF_MAX_BLOCK_SIZE block
+typedef struct
+{
+    htsFile *hts_fp;
+    int format, nskip, ready;   // nskip: end of the header in the current uncompressed block
+    kstring_t hdr;              // the BCF header text or the VCF header lines
+    uint8_t *buf;               // raw BGZF data read ahead
+    size_t nbuf;
+}
+naive_file_t;
+
+typedef struct
+{
+    args_t *args;
+    naive_file_t *files;
+    int inext, iwrite, nprefetch;   // inext: the next file to open; iwrite: the file being written
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+}
+naive_pool_t;
+
+static void naive_open(args_t *args, int i, naive_file_t *nf)
+{
+    nf->hts_fp = hts_open(args->fnames[i],"r");
+    if ( !nf->hts_fp ) error("Failed to open: %s\n", args->fnames[i]);
+    htsFormat type = *hts_get_format(nf->hts_fp);
+
+    if ( type.compression!=bgzf )
+        error("The --naive option works only for compressed BCFs or VCFs, sorry :-/\n");
+    nf->format = type.format;
+
+    BGZF *fp = hts_get_bgzfp(nf->hts_fp);
+    if ( !fp || bgzf_read_block(fp) != 0 || !fp->block_length )
+        error("Failed to read %s: %s\n", args->fnames[i], strerror(errno));
+
+    if ( type.format==bcf )
+    {
+        uint8_t magic[5];
+        uint32_t hlen;
+        if ( bgzf_read(fp, magic, 5) != 5 ) error("Failed to read the BCF header in %s\n", args->fnames[i]);
+        if (strncmp((char*)magic, "BCF\2\2", 5) != 0) error("Invalid BCF magic string in %s\n", args->fnames[i]);
+
+        if ( bgzf_read(fp, &hlen, 4) != 4 ) error("Failed to read the BCF header in %s\n", args->fnames[i]);
+        nf->hdr.l = hlen;
+        hts_expand(char,nf->hdr.l,nf->hdr.m,nf->hdr.s);
+        if ( bgzf_read(fp, nf->hdr.s, nf->hdr.l) != nf->hdr.l ) error("Failed to read the BCF header in %s\n", args->fnames[i]);
+        nf->nskip = fp->block_offset;
+    }
+    else
+    {
+        nf->nskip = print_vcf_gz_header(fp, NULL, 0, &nf->hdr);
+        if ( nf->nskip==-1 ) error("Error reading %s\n", args->fnames[i]);
+    }
+
+    // Read ahead the beginning of the body
+    nf->buf  = (uint8_t*) malloc(NAIVE_BUF_SIZE);
+    ssize_t nread = bgzf_raw_read(fp, nf->buf, NAIVE_BUF_SIZE);
+    if ( nread<0 ) error("Failed to read %s\n", args->fnames[i]);
+    nf->nbuf = nread;
+}
+
+static void *naive_prefetch_worker(void *arg)
+{
+    naive_pool_t *pool = (naive_pool_t*) arg;
+    while (1)
+    {
+        pthread_mutex_lock(&pool->lock);
+        while ( pool->inext < pool->args->nfnames && pool->inext > pool->iwrite + pool->nprefetch )
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        if ( pool->inext >= pool->args->nfnames ) { pthread_mutex_unlock(&pool->lock); break; }
+        int i = pool->inext++;
+        pthread_mutex_unlock(&pool->lock);
+
+        naive_open(pool->args, i, &pool->files[i]);
+
+        pthread_mutex_lock(&pool->lock);
+        pool->files[i].ready = 1;
+        pthread_cond_broadcast(&pool->cond);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return NULL;
+}
+
+// Stream the rest of the file as it is, without recompressing, but remove BGZF EOF blocks.
+// The data are copied in large chunks, each spanning many BGZF blocks
+static void naive_copy_blocks(args_t *args, int ifile, naive_file_t *nf, BGZF *bgzf_out)
+{
+    const size_t nheader = 18, neof = 28;
+    const uint8_t *eof = (uint8_t*) "\037\213\010\4\0\0\0\0\0\377\6\0\102\103\2\0\033\0\3\0\0\0\0\0\0\0\0\0";
+    BGZF *fp = hts_get_bgzfp(nf->hts_fp);
+    uint8_t *buf = nf->buf;
+    size_t nbuf = nf->nbuf;
+    while ( nbuf )
+    {
+        size_t i = 0, iwr = 0;     // iwr: the first byte not written yet
+        while ( i + nheader <= nbuf )
+        {
+            if ( check_header(buf+i)!=0 ) error("Could not parse the header of a bgzf block: %s\n",args->fnames[ifile]);
+            size_t nblock = unpackInt16(buf+i+16) + 1;
+            assert( nblock <= BGZF_MAX_BLOCK_SIZE && nblock >= nheader );
+            if ( i + nblock > nbuf ) break;
+            if ( nblock==neof && !memcmp(buf+i,eof,neof) )
+            {
+                if ( i > iwr && bgzf_raw_write(bgzf_out, buf+iwr, i-iwr) != i-iwr ) error("Write failed: %s\n",args->output_fname);
+                iwr = i + nblock;
+            }
+            i += nblock;
+        }
+        if ( i > iwr && bgzf_raw_write(bgzf_out, buf+iwr, i-iwr) != i-iwr ) error("Write failed: %s\n",args->output_fname);
+
+        // keep the incomplete block and refill the buffer
+        nbuf -= i;
+        if ( nbuf ) memmove(buf, buf+i, nbuf);
+        ssize_t nread = bgzf_raw_read(fp, buf+nbuf, NAIVE_BUF_SIZE-nbuf);
+        if ( nread<0 ) error("Failed to read %s\n", args->fnames[ifile]);
+        if ( !nread && nbuf ) error("Could not read %d bytes: %s\n",(int)nbuf,args->fnames[ifile]);
+        nbuf += nread;
+    }
+}
+
 static void naive_concat(args_t *args)
 {
     // only compressed BCF atm
     BGZF *bgzf_out = bgzf_open(args->output_fname,"w");;
 
-    const size_t page_size = BGZF_MAX_BLOCK_SIZE;
-    uint8_t *buf = (uint8_t*) malloc(page_size);
-    kstring_t tmp = {0,0,0};
+    naive_pool_t pool;
+    memset(&pool, 0, sizeof(pool));
+    pool.args  = args;
+    pool.files = (naive_file_t*) calloc(args->nfnames, sizeof(naive_file_t));
+    pool.nprefetch = args->naive_prefetch;
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.cond, NULL);
+
     int i, file_types = 0;
+    pthread_t *threads = NULL;
+    if ( pool.nprefetch )
+    {
+        threads = (pthread_t*) malloc(sizeof(pthread_t)*pool.nprefetch);
+        for (i=0; i<pool.nprefetch; i++)
+            if ( pthread_create(&threads[i], NULL, naive_prefetch_worker, &pool) ) error("Failed to create threads\n");
+    }
     for (i=0; i<args->nfnames; i++)
     {
-        htsFile *hts_fp = hts_open(args->fnames[i],"r");
-        if ( !hts_fp ) error("Failed to open: %s\n", args->fnames[i]);
-        htsFormat type = *hts_get_format(hts_fp);
+        naive_file_t *nf = &pool.files[i];
+        if ( pool.nprefetch )
+        {
+            pthread_mutex_lock(&pool.lock);
+            while ( !nf->ready ) pthread_cond_wait(&pool.cond, &pool.lock);
+            pthread_mutex_unlock(&pool.lock);
+        }
+        else
+            naive_open(args, i, nf);
 
-        if ( type.compression!=bgzf )
-            error("The --naive option works only for compressed BCFs or VCFs, sorry :-/\n");
-        file_types |= type.format==vcf ? 1 : 2;
+        file_types |= nf->format==vcf ? 1 : 2;
         if ( file_types==3 )
             error("The --naive option works only for compressed files of the same type, all BCFs or all VCFs :-/\n");
 
-        BGZF *fp = hts_get_bgzfp(hts_fp);
-        if ( !fp || bgzf_read_block(fp) != 0 || !fp->block_length )
-            error("Failed to read %s: %s\n", args->fnames[i], strerror(errno));
-
-        int nskip;
-        if ( type.format==bcf )
+        // write only the first header
+        if ( i==0 )
         {
-            uint8_t magic[5];
-            if ( bgzf_read(fp, magic, 5) != 5 ) error("Failed to read the BCF header in %s\n", args->fnames[i]);
-            if (strncmp((char*)magic, "BCF\2\2", 5) != 0) error("Invalid BCF magic string in %s\n", args->fnames[i]);
-
-            if ( bgzf_read(fp, &tmp.l, 4) != 4 ) error("Failed to read the BCF header in %s\n", args->fnames[i]);
-            hts_expand(char,tmp.l,tmp.m,tmp.s);
-            if ( bgzf_read(fp, tmp.s, tmp.l) != tmp.l ) error("Failed to read the BCF header in %s\n", args->fnames[i]);
-
-            // write only the first header
-            if ( i==0 )
+            if ( nf->format==bcf )
             {
+                uint32_t hlen = nf->hdr.l;
                 if ( bgzf_write(bgzf_out, "BCF\2\2", 5) !=5 ) error("Failed to write %d bytes to %s\n", 5,args->output_fname);
-                if ( bgzf_write(bgzf_out, &tmp.l, 4) !=4 ) error("Failed to write %d bytes to %s\n", 4,args->output_fname);
-                if ( bgzf_write(bgzf_out, tmp.s, tmp.l) != tmp.l) error("Failed to write %d bytes to %s\n", tmp.l,args->output_fname);
+                if ( bgzf_write(bgzf_out, &hlen, 4) !=4 ) error("Failed to write %d bytes to %s\n", 4,args->output_fname);
             }
-            nskip = fp->block_offset;
-        }
-        else
-        {
-            nskip = print_vcf_gz_header(fp, bgzf_out, i==0?1:0, &tmp);
-            if ( nskip==-1 ) error("Error reading %s\n", args->fnames[i]);
+            if ( bgzf_write(bgzf_out, nf->hdr.s, nf->hdr.l) != nf->hdr.l) error("Failed to write %d bytes to %s\n", (int)nf->hdr.l,args->output_fname);
         }
 
         // Output all non-header data that were read together with the header block
-        if ( fp->block_length - nskip > 0 )
+        BGZF *fp = hts_get_bgzfp(nf->hts_fp);
+        if ( fp->block_length - nf->nskip > 0 )
         {
-            if ( bgzf_write(bgzf_out, (char *)fp->uncompressed_block+nskip, fp->block_length-nskip)<0 ) error("Error: %d\n",fp->errcode);
+            if ( bgzf_write(bgzf_out, (char *)fp->uncompressed_block+nf->nskip, fp->block_length-nf->nskip)<0 ) error("Error: %d\n",fp->errcode);
         }
         if ( bgzf_flush(bgzf_out)<0 ) error("Error: %d\n",bgzf_out->errcode);
 
-
-        // Stream the rest of the file as it is, without recompressing, but remove BGZF EOF blocks
         // The final bgzf eof block will be added by bgzf_close.
-        ssize_t nread, nblock, nwr;
-        const int nheader = 18, neof = 28;
-        const uint8_t *eof = (uint8_t*) "\037\213\010\4\0\0\0\0\0\377\6\0\102\103\2\0\033\0\3\0\0\0\0\0\0\0\0\0";
-        while (1)
-        {
-            nread = bgzf_raw_read(fp, buf, nheader);
-            if ( !nread ) break;
-            if ( nread != nheader || check_header(buf)!=0 ) error("Could not parse the header of a bgzf block: %s\n",args->fnames[i]);
-            nblock = unpackInt16(buf+16) + 1;
-            assert( nblock <= page_size && nblock >= nheader );
-            nread += bgzf_raw_read(fp, buf+nheader, nblock - nheader);
-            if ( nread!=nblock ) error("Could not read %d bytes: %s\n",nblock,args->fnames[i]);
-            if ( nread==neof && !memcmp(buf,eof,neof) ) continue;
-            nwr = bgzf_raw_write(bgzf_out, buf, nread);
-            if ( nwr != nread ) error("Write failed, wrote %d instead of %d bytes.\n", nwr,(int)nread);
-        }
-        if (hts_close(hts_fp)) error("Close failed: %s\n",args->fnames[i]);
+        naive_copy_blocks(args, i, nf, bgzf_out);
+        if (hts_close(nf->hts_fp)) error("Close failed: %s\n",args->fnames[i]);
+        free(nf->buf);
+        free(nf->hdr.s);
+
+        pthread_mutex_lock(&pool.lock);
+        pool.iwrite = i + 1;
+        pthread_cond_broadcast(&pool.cond);
+        pthread_mutex_unlock(&pool.lock);
     }
-    free(buf);
-    free(tmp.s);
+    for (i=0; i<pool.nprefetch; i++) pthread_join(threads[i], NULL);
+    free(threads);
+    free(pool.files);
+    pthread_mutex_destroy(&pool.lock);
+    pthread_cond_destroy(&pool.cond);
     if (bgzf_close(bgzf_out) < 0) error("Error: %d\n",bgzf_out->errcode);
 }
 
@@ -715,14 +1028,17 @@ static void usage(args_t *args)
     fprintf(stderr, "   -D, --remove-duplicates        Alias for -d none\n");
     fprintf(stderr, "   -f, --file-list <file>         Read the list of files from a file.\n");
     fprintf(stderr, "   -l, --ligate                   Ligate phased VCFs by matching phase at overlapping haplotypes\n");
+    fprintf(stderr, "       --ligate-threads <int>     With --ligate, compare the phase at the overlaps on <int> threads [0]\n");
     fprintf(stderr, "       --no-version               Do not append version and command line to the header\n");
     fprintf(stderr, "   -n, --naive                    Concatenate files without recompression (dangerous, use with caution)\n");
+    fprintf(stderr, "       --naive-prefetch <int>     With --naive, open and read ahead up to <int> next files on I/O threads [0]\n");
     fprintf(stderr, "   -o, --output <file>            Write output to a file [standard output]\n");
     fprintf(stderr, "   -O, --output-type <b|u|z|v>    b: compressed BCF, u: uncompressed BCF, z: compressed VCF, v: uncompressed VCF [v]\n");
     fprintf(stderr, "   -q, --min-PQ <int>             Break phase set if phasing quality is lower than <int> [30]\n");
     fprintf(stderr, "   -r, --regions <region>         Restrict to comma-separated list of regions\n");
     fprintf(stderr, "   -R, --regions-file <file>      Restrict to regions listed in a file\n");
     fprintf(stderr, "       --threads <int>            Number of extra output compression threads [0]\n");
+    fprintf(stderr, "       --write-index              Index the compressed output on the fly, the index is written to <file>.csi\n");
     fprintf(stderr, "\n");
     exit(1);
 }
@@ -754,6 +1070,9 @@ int main_vcfconcat(int argc, char *argv[])
         {"file-list",required_argument,NULL,'f'},
         {"min-PQ",required_argument,NULL,'q'},
         {"no-version",no_argument,NULL,8},
+        {"naive-prefetch",required_argument,NULL,10},
+        {"write-index",no_argument,NULL,11},
+        {"ligate-threads",required_argument,NULL,12},
         {NULL,0,NULL,0}
     };
     char *tmp;
@@ -785,6 +1104,15 @@ int main_vcfconcat(int argc, char *argv[])
                 break;
             case  9 : args->n_threads = strtol(optarg, 0, 0); break;
             case  8 : args->record_cmd_line = 0; break;
+            case 10 :
+                args->naive_prefetch = strtol(optarg,&tmp,10);
+                if ( *tmp || args->naive_prefetch<0 ) error("Could not parse argument: --naive-prefetch %s\n", optarg);
+                break;
+            case 11 : args->write_index = 1; break;
+            case 12 :
+                args->ligate_threads = strtol(optarg,&tmp,10);
+                if ( *tmp || args->ligate_threads<0 ) error("Could not parse argument: --ligate-threads %s\n", optarg);
+                break;
             case 'h':
             case '?': usage(args); break;
             default: error("Unknown argument: %s\n", optarg);
@@ -808,10 +1136,13 @@ int main_vcfconcat(int argc, char *argv[])
     if ( !args->nfnames ) usage(args);
     if ( args->remove_dups && !args->allow_overlaps ) error("The -D option is supported only with -a\n");
     if ( args->regions_list && !args->allow_overlaps ) error("The -r/-R option is supported only with -a\n");
+    if ( args->naive_prefetch && !args->naive_concat ) error("The --naive-prefetch option requires --naive\n");
+    if ( args->ligate_threads && !args->phased_concat ) error("The --ligate-threads option requires --ligate\n");
     if ( args->naive_concat )
     {
         if ( args->allow_overlaps ) error("The option --naive cannot be combined with --allow-overlaps\n");
         if ( args->phased_concat ) error("The option --naive cannot be combined with --ligate\n");
+        if ( args->write_index ) error("The option --naive cannot be combined with --write-index\n");
         naive_concat(args);
         destroy_data(args);
         free(args);
@@ -34,6 +34,7 @@ THE SOFTWARE.  */
 #include <htslib/faidx.h>
 #include <htslib/vcf.h>
 #include <htslib/bgzf.h>
+#include <htslib/hfile.h>
 #include <htslib/synced_bcf_reader.h>
 #include <htslib/vcfutils.h>
 #include <htslib/kseq.h>
@@ -41,6 +42,8 @@ THE SOFTWARE.  */
 #include "filter.h"
 #include "convert.h"
 #include "tsv2vcf.h"
+#include "regidx.h"
+#include "batch.h"
 
 // Logic of the filters: include or exclude sites which match the filters?
 #define FLT_INCLUDE 1
@@ -67,9 +70,23 @@ struct _args_t
     int nsamples, *samples, sample_is_file, targets_is_file, regions_is_file, output_type;
     char **argv, *sample_list, *targets_list, *regions_list, *tag, *columns;
     char *outfname, *infname, *ref_fname, *sex_fname;
-    int argc, n_threads, record_cmd_line;
+    int argc, n_threads, record_cmd_line, record_threads;
+    bcf1_t **recs;      // block of records formatted in parallel with --record-threads
+    int nrecs, mrecs;
+    char *ref_seq;      // --tsv2vcf: cached block of the reference
+    int ref_rid, ref_beg, ref_end;
+    int32_t *itmp;      // --gvcf2vcf: INFO/END
+    int nitmp;
+    char *expand_targets;   // --gvcf2vcf: expand only the blocks overlapping these targets
+    regidx_t *expand_idx;
+    regitr_t *expand_itr;
 };
 
+#define CONVERT_BATCH 256
+#define CONVERT_BATCH_BYTES (64<<20)
+#define TSV_BATCH 4096
+#define REF_BLOCK 1048576
+
 static void destroy_data(args_t *args)
 {
     if ( args->ref ) fai_destroy(args->ref);
@@ -77,6 +94,12 @@ static void destroy_data(args_t *args)
     if ( args->filter ) filter_destroy(args->filter);
     free(args->samples);
     if ( args->files ) bcf_sr_destroy(args->files);
+    int i;
+    for (i=0; i<args->mrecs; i++) bcf_destroy(args->recs[i]);
+    free(args->recs);
+    free(args->itmp);
+    if ( args->expand_idx ) regidx_destroy(args->expand_idx);
+    if ( args->expand_itr ) regitr_destroy(args->expand_itr);
 }
 
 static void open_vcf(args_t *args, const char *format_str)
@@ -133,6 +156,34 @@ static void open_vcf(args_t *args, const char *format_str)
     }
     if ( format_str ) args->convert = convert_init(args->header, samples, nsamples, format_str);
     free(samples);
+
+    if ( args->convert && args->record_threads )
+    {
+        // keep the formatted block within tens of MB, the text of a site grows with the number of samples
+        int nsmpl = bcf_hdr_nsamples(args->header) + 1;
+        args->mrecs = CONVERT_BATCH_BYTES / 8 / nsmpl;
+        if ( args->mrecs > CONVERT_BATCH ) args->mrecs = CONVERT_BATCH;
+        if ( args->mrecs < args->record_threads ) args->mrecs = args->record_threads;
+        args->recs = (bcf1_t**) malloc(sizeof(bcf1_t*)*args->mrecs);
+        for (i=0; i<args->mrecs; i++) args->recs[i] = bcf_init();
+        convert_set_option(args->convert, threads, args->record_threads);
+    }
+}
+
+/*
+ *  With --record-threads, records are collected in blocks and the block is
+ *  formatted in parallel by convert_lines(). Returns 1 when the block is full.
+ */
+static int records_push(args_t *args, bcf1_t *line)
+{
+    bcf_copy(args->recs[args->nrecs++], line);
+    return args->nrecs==args->mrecs ? 1 : 0;
+}
+static void records_write(args_t *args, BGZF *fp, const char *fname, kstring_t *str)
+{
+    str->l = 0;
+    convert_lines(args->convert, args->recs, args->nrecs, str);
+    if ( bgzf_write(fp, str->s, str->l)!=str->l ) error("Error writing %s: %s\n", fname, strerror(errno));
 }
 
 static int tsv_setter_chrom_pos_ref_alt(tsv_t *tsv, bcf1_t *rec, void *usr)
@@ -775,6 +826,7 @@ static void vcf_to_gensample(args_t *args)
     int prev_rid = -1, prev_pos = -1;
     int no_alt = 0, non_biallelic = 0, filtered = 0, ndup = 0, nok = 0;
     BGZF *gout = bgzf_open(gen_fname, gen_compressed ? "wg" : "wu");
+    if ( gen_compressed && args->n_threads ) bgzf_thread_pool(gout, args->files->p->pool, args->files->p->qsize);
     while ( bcf_sr_next_line(args->files) )
     {
         bcf1_t *line = bcf_sr_get_line(args->files,0);
@@ -801,6 +853,14 @@ static void vcf_to_gensample(args_t *args)
         prev_rid = line->rid;
         prev_pos = line->pos;
 
+        if ( args->recs )
+        {
+            // the formatted line is never empty, count it now
+            if ( records_push(args, line) ) { records_write(args, gout, gen_fname, &str); args->nrecs = 0; }
+            nok++;
+            continue;
+        }
+
         str.l = 0;
         convert_line(args->convert, line, &str);
         if ( str.l )
@@ -810,6 +870,7 @@ static void vcf_to_gensample(args_t *args)
             nok++;
         }
     }
+    if ( args->nrecs ) { records_write(args, gout, gen_fname, &str); args->nrecs = 0; }
     fprintf(stderr, "%d records written, %d skipped: %d/%d/%d/%d no-ALT/non-biallelic/filtered/duplicated\n", 
         nok, no_alt+non_biallelic+filtered+ndup, no_alt, non_biallelic, filtered, ndup);
 
@@ -818,6 +879,27 @@ static void vcf_to_gensample(args_t *args)
     free(gen_fname);
 }
 
+static void write_legend(args_t *args, bcf1_t *line, BGZF *lout, const char *legend_fname, kstring_t *str)
+{
+    str->l = 0;
+    if ( args->output_vcf_ids && (line->d.id[0]!='.' || line->d.id[1]!=0) )
+        ksprintf(str, "%s %d %s %s\n", line->d.id, line->pos+1, line->d.allele[0], line->d.allele[1]);
+    else
+        ksprintf(str, "%s:%d_%s_%s %d %s %s\n", bcf_seqname(args->header, line), line->pos+1, line->d.allele[0], line->d.allele[1], line->pos+1, line->d.allele[0], line->d.allele[1]);
+
+    // write legend file
+    int ret = bgzf_write(lout, str->s, str->l);
+    if ( ret != str->l ) error("Error writing %s: %s\n", legend_fname, strerror(errno));
+}
+static void write_hap_legend_block(args_t *args, BGZF *hout, const char *hap_fname, BGZF *lout, const char *legend_fname, kstring_t *str)
+{
+    int i;
+    if ( hap_fname ) records_write(args, hout, hap_fname, str);
+    if ( legend_fname )
+        for (i=0; i<args->nrecs; i++) write_legend(args, args->recs[i], lout, legend_fname, str);
+    args->nrecs = 0;
+}
+
 static void vcf_to_haplegendsample(args_t *args)
 {
     kstring_t str = {0,0,0};
@@ -926,6 +1008,14 @@ static void vcf_to_haplegendsample(args_t *args)
             continue;
         }
 
+        if ( args->recs )
+        {
+            // the formatted line is never empty, count it now
+            if ( records_push(args, line) ) write_hap_legend_block(args, hout, hap_fname, lout, legend_fname, &str);
+            nok++;
+            continue;
+        }
+
         str.l = 0;
         convert_line(args->convert, line, &str);
         if ( !str.l ) continue;
@@ -935,19 +1025,10 @@ static void vcf_to_haplegendsample(args_t *args)
             ret = bgzf_write(hout, str.s, str.l); // write hap file
             if ( ret != str.l ) error("Error writing %s: %s\n", hap_fname, strerror(errno));
         }
-        if (legend_fname) {
-            str.l = 0;
-            if ( args->output_vcf_ids && (line->d.id[0]!='.' || line->d.id[1]!=0) )
-                ksprintf(&str, "%s %d %s %s\n", line->d.id, line->pos+1, line->d.allele[0], line->d.allele[1]);
-            else
-                ksprintf(&str, "%s:%d_%s_%s %d %s %s\n", bcf_seqname(args->header, line), line->pos+1, line->d.allele[0], line->d.allele[1], line->pos+1, line->d.allele[0], line->d.allele[1]);
-
-            // write legend file
-            ret = bgzf_write(lout, str.s, str.l);
-            if ( ret != str.l ) error("Error writing %s: %s\n", legend_fname, strerror(errno));
-        }
+        if (legend_fname) write_legend(args, line, lout, legend_fname, &str);
         nok++;
     }
+    if ( args->nrecs ) write_hap_legend_block(args, hout, hap_fname, lout, legend_fname, &str);
     fprintf(stderr, "%d records written, %d skipped: %d/%d/%d no-ALT/non-biallelic/filtered\n", nok,no_alt+non_biallelic+filtered, no_alt, non_biallelic, filtered);
     if ( str.m ) free(str.s);
     if ( hout && bgzf_close(hout)!=0 ) error("Error closing %s: %s\n", hap_fname, strerror(errno));
@@ -1069,6 +1150,14 @@ static void vcf_to_hapsample(args_t *args)
             continue;
         }
 
+        if ( args->recs )
+        {
+            // the formatted line is never empty, count it now
+            if ( records_push(args, line) ) { records_write(args, hout, hap_fname, &str); args->nrecs = 0; }
+            nok++;
+            continue;
+        }
+
         str.l = 0;
         convert_line(args->convert, line, &str);
         if ( !str.l ) continue;
@@ -1080,6 +1169,7 @@ static void vcf_to_hapsample(args_t *args)
         }
         nok++;
     }
+    if ( args->nrecs ) { records_write(args, hout, hap_fname, &str); args->nrecs = 0; }
     fprintf(stderr, "%d records written, %d skipped: %d/%d/%d no-ALT/non-biallelic/filtered\n", nok, no_alt+non_biallelic+filtered, no_alt, non_biallelic, filtered);
     if ( str.m ) free(str.s);
     if ( hout && bgzf_close(hout)!=0 ) error("Error closing %s: %s\n", hap_fname, strerror(errno));
@@ -1135,16 +1225,28 @@ static inline int tsv_setter_aa1(args_t *args, char *ss, char *se, int alleles[]
 
     return 0;
 }
+// The reference base at rec->pos. The sites come sorted, the reference is read in blocks
+static char tsv_ref_base(args_t *args, bcf1_t *rec)
+{
+    if ( rec->rid!=args->ref_rid || rec->pos < args->ref_beg || rec->pos > args->ref_end )
+    {
+        int len;
+        free(args->ref_seq);
+        args->ref_seq = faidx_fetch_seq(args->ref, (char*)bcf_hdr_id2name(args->header,rec->rid), rec->pos, rec->pos+REF_BLOCK-1, &len);
+        if ( !args->ref_seq || len<=0 ) error("faidx_fetch_seq failed at %s:%d\n", bcf_hdr_id2name(args->header,rec->rid), rec->pos+1);
+        args->ref_rid = rec->rid;
+        args->ref_beg = rec->pos;
+        args->ref_end = rec->pos + len - 1;
+    }
+    return toupper(args->ref_seq[rec->pos - args->ref_beg]);
+}
 static int tsv_setter_aa(tsv_t *tsv, bcf1_t *rec, void *usr)
 {
     args_t *args = (args_t*) usr;
 
-    int len;
-    char *ref = faidx_fetch_seq(args->ref, (char*)bcf_hdr_id2name(args->header,rec->rid), rec->pos, rec->pos, &len);
-    if ( !ref ) error("faidx_fetch_seq failed at %s:%d\n", bcf_hdr_id2name(args->header,rec->rid), rec->pos+1);
-
     int nals = 1, alleles[5] = { -1, -1, -1, -1, -1 };    // a,c,g,t,n
-    ref[0] = toupper(ref[0]);
+    char ref[1];
+    ref[0] = tsv_ref_base(args, rec);
     int iref = acgt_to_5(ref[0]);
     alleles[iref] = 0;
 
@@ -1160,12 +1262,7 @@ static int tsv_setter_aa(tsv_t *tsv, bcf1_t *rec, void *usr)
         }
         ret = tsv_setter_aa1(args, tsv->ss, tsv->se, alleles, &nals, iref, args->gts+i*2);
         if ( ret==-1 ) error("Error parsing the site %s:%d, expected two characters\n", bcf_hdr_id2name(args->header,rec->rid), rec->pos+1);
-        if ( ret==-2 ) 
-        {
-            // something else than a SNP
-            free(ref);
-            return -1;
-        }
+        if ( ret==-2 ) return -1;   // something else than a SNP
     }
 
     args->str.l = 0;
@@ -1181,10 +1278,155 @@ static int tsv_setter_aa(tsv_t *tsv, bcf1_t *rec, void *usr)
     bcf_update_alleles_str(args->header, rec, args->str.s);
     if ( bcf_update_genotypes(args->header,rec,args->gts,rec->n_sample*2) ) error("Could not update the GT field\n");
 
-    free(ref);
     return 0;
 }
 
+static tsv_t *tsv_to_vcf_init(args_t *args)
+{
+    tsv_t *tsv = tsv_init(args->columns ? args->columns : "ID,CHROM,POS,AA");
+    if ( tsv_register(tsv, "CHROM", tsv_setter_chrom, args->header) < 0 ) error("Expected CHROM column\n");
+    if ( tsv_register(tsv, "POS", tsv_setter_pos, NULL) < 0 ) error("Expected POS column\n");
+    if ( tsv_register(tsv, "ID", tsv_setter_id, args->header) < 0 && !args->columns ) error("Expected ID column\n");
+    if ( tsv_register(tsv, "AA", tsv_setter_aa, args) < 0 ) error("Expected AA column\n");
+    return tsv;
+}
+
+/*
+ *  With --record-threads, batches of lines are parsed by the workers of a
+ *  batch pool. Each worker has a private copy of args with its own reference
+ *  handle, buffers and counts, and its own parser registered with it. The
+ *  records are written in the original order.
+ */
+typedef struct
+{
+    args_t *args;
+    tsv_t *tsv;
+}
+tsv_worker_t;
+
+typedef struct
+{
+    kstring_t *lines;
+    bcf1_t **recs;
+    int *skip, nlines;
+}
+tsv_batch_t;
+
+typedef struct
+{
+    args_t *args;
+    htsFile *out_fh;
+}
+tsv_out_t;
+
+static void tsv_batch_work(void *worker, void *data)
+{
+    tsv_worker_t *wrk = (tsv_worker_t*) worker;
+    tsv_batch_t *batch = (tsv_batch_t*) data;
+    int i;
+    for (i=0; i<batch->nlines; i++)
+    {
+        bcf_clear(batch->recs[i]);
+        batch->skip[i] = tsv_parse(wrk->tsv, batch->recs[i], batch->lines[i].s) ? 1 : 0;
+    }
+}
+
+static void tsv_batch_write(void *data, void *bdata)
+{
+    tsv_out_t *out = (tsv_out_t*) data;
+    tsv_batch_t *batch = (tsv_batch_t*) bdata;
+    args_t *args = out->args;
+    int i;
+    for (i=0; i<batch->nlines; i++)
+    {
+        args->n.total++;
+        if ( !batch->skip[i] )
+            bcf_write(out->out_fh, args->header, batch->recs[i]);
+        else
+            args->n.skipped++;
+    }
+}
+
+static void tsv_to_vcf_threaded(args_t *args, htsFile *in_fh, htsFile *out_fh)
+{
+    int i, j, nthreads = args->record_threads, nbatch = 2*nthreads, nsmpl = bcf_hdr_nsamples(args->header);
+    tsv_worker_t *wrk = (tsv_worker_t*) calloc(nthreads, sizeof(tsv_worker_t));
+    void **workers = (void**) malloc(sizeof(void*)*nthreads);
+    for (i=0; i<nthreads; i++)
+    {
+        args_t *targs = (args_t*) malloc(sizeof(args_t));
+        *targs = *args;
+        targs->ref = fai_load(args->ref_fname);
+        if ( !targs->ref ) error("Could not load the reference %s\n", args->ref_fname);
+        targs->gts = (int32_t *) malloc(sizeof(int32_t)*nsmpl*2);
+        memset(&targs->str, 0, sizeof(targs->str));
+        memset(&targs->n, 0, sizeof(targs->n));
+        targs->ref_seq = NULL;
+        targs->ref_rid = -1;
+        wrk[i].args = targs;
+        wrk[i].tsv  = tsv_to_vcf_init(targs);
+        workers[i]  = &wrk[i];
+    }
+    tsv_batch_t *batch = (tsv_batch_t*) calloc(nbatch, sizeof(tsv_batch_t));
+    void **batches = (void**) malloc(sizeof(void*)*nbatch);
+    for (i=0; i<nbatch; i++)
+    {
+        batch[i].lines = (kstring_t*) calloc(TSV_BATCH, sizeof(kstring_t));
+        batch[i].recs  = (bcf1_t**) malloc(sizeof(bcf1_t*)*TSV_BATCH);
+        batch[i].skip  = (int*) malloc(sizeof(int)*TSV_BATCH);
+        for (j=0; j<TSV_BATCH; j++) batch[i].recs[j] = bcf_init();
+        batches[i] = &batch[i];
+    }
+
+    tsv_out_t out = { args, out_fh };
+    batch_pool_t *pool = batch_pool_init(nthreads, workers, batches, nbatch, tsv_batch_work, tsv_batch_write, &out);
+    int eof = 0;
+    while ( !eof )
+    {
+        tsv_batch_t *bt = (tsv_batch_t*) batch_pool_get(pool);
+        bt->nlines = 0;
+        while ( bt->nlines < TSV_BATCH )
+        {
+            if ( hts_getline(in_fh, KS_SEP_LINE, &bt->lines[bt->nlines]) <= 0 ) { eof = 1; break; }
+            if ( bt->lines[bt->nlines].s[0]=='#' ) continue;    // skip comments
+            bt->nlines++;
+        }
+        if ( bt->nlines ) batch_pool_submit(pool);
+    }
+    batch_pool_destroy(pool);
+
+    for (i=0; i<nthreads; i++)
+    {
+        args_t *targs = wrk[i].args;
+        args->n.hom_rr += targs->n.hom_rr;
+        args->n.het_ra += targs->n.het_ra;
+        args->n.hom_aa += targs->n.hom_aa;
+        args->n.het_aa += targs->n.het_aa;
+        args->n.missing += targs->n.missing;
+        tsv_destroy(wrk[i].tsv);
+        fai_destroy(targs->ref);
+        free(targs->gts);
+        free(targs->str.s);
+        free(targs->ref_seq);
+        free(targs);
+    }
+    for (i=0; i<nbatch; i++)
+    {
+        for (j=0; j<TSV_BATCH; j++)
+        {
+            free(batch[i].lines[j].s);
+            bcf_destroy(batch[i].recs[j]);
+        }
+        free(batch[i].lines);
+        free(batch[i].recs);
+        free(batch[i].skip);
+    }
+    free(batch);
+    free(batches);
+    free(wrk);
+    free(workers);
+}
+
 static void tsv_to_vcf(args_t *args)
 {
     if ( !args->ref_fname ) error("--tsv2vcf requires the --fasta-ref option\n");
@@ -1215,11 +1457,8 @@ static void tsv_to_vcf(args_t *args)
     if ( args->n_threads ) hts_set_threads(out_fh, args->n_threads);
     bcf_hdr_write(out_fh,args->header);
 
-    tsv_t *tsv = tsv_init(args->columns ? args->columns : "ID,CHROM,POS,AA");
-    if ( tsv_register(tsv, "CHROM", tsv_setter_chrom, args->header) < 0 ) error("Expected CHROM column\n");
-    if ( tsv_register(tsv, "POS", tsv_setter_pos, NULL) < 0 ) error("Expected POS column\n");
-    if ( tsv_register(tsv, "ID", tsv_setter_id, args->header) < 0 && !args->columns ) error("Expected ID column\n");
-    if ( tsv_register(tsv, "AA", tsv_setter_aa, args) < 0 ) error("Expected AA column\n");
+    tsv_t *tsv = tsv_to_vcf_init(args);
+    args->ref_rid = -1;
 
     bcf1_t *rec = bcf_init();
     bcf_float_set_missing(rec->qual);
@@ -1227,16 +1466,21 @@ static void tsv_to_vcf(args_t *args)
     kstring_t line = {0,0,0};
     htsFile *in_fh = hts_open(args->infname, "r");
     if ( !in_fh ) error("Could not read: %s\n", args->infname);
-    while ( hts_getline(in_fh, KS_SEP_LINE, &line) > 0 )
+    if ( args->record_threads > 1 )
+        tsv_to_vcf_threaded(args, in_fh, out_fh);
+    else
     {
-        if ( line.s[0]=='#' ) continue;     // skip comments
-        bcf_clear(rec);
+        while ( hts_getline(in_fh, KS_SEP_LINE, &line) > 0 )
+        {
+            if ( line.s[0]=='#' ) continue;     // skip comments
+            bcf_clear(rec);
 
-        args->n.total++;
-        if ( !tsv_parse(tsv, rec, line.s) )
-            bcf_write(out_fh, args->header, rec);
-        else
-            args->n.skipped++;
+            args->n.total++;
+            if ( !tsv_parse(tsv, rec, line.s) )
+                bcf_write(out_fh, args->header, rec);
+            else
+                args->n.skipped++;
+        }
     }
     if ( hts_close(in_fh) ) error("Close failed: %s\n", args->infname);
     free(line.s);
@@ -1247,6 +1491,7 @@ static void tsv_to_vcf(args_t *args)
     bcf_destroy(rec);
     free(args->str.s);
     free(args->gts);
+    free(args->ref_seq);
 
     fprintf(stderr,"Rows total: \t%d\n", args->n.total);
     fprintf(stderr,"Rows skipped: \t%d\n", args->n.skipped);
@@ -1281,82 +1526,275 @@ static void vcf_to_vcf(args_t *args)
     hts_close(out_fh);
 }
 
+// The reference at beg..end (inclusive), read in blocks of at least REF_BLOCK as the sites come sorted
+static const char *gvcf_ref(args_t *args, int rid, int beg, int end)
+{
+    if ( rid!=args->ref_rid || beg < args->ref_beg || end > args->ref_end )
+    {
+        const char *chr = bcf_hdr_id2name(args->header,rid);
+        int len, wend = end - beg + 1 > REF_BLOCK ? end : beg + REF_BLOCK - 1;
+        free(args->ref_seq);
+        args->ref_seq = faidx_fetch_seq(args->ref, (char*)chr, beg, wend, &len);
+        if ( !args->ref_seq || len<=0 ) error("faidx_fetch_seq failed at %s:%d\n", chr, beg+1);
+        if ( beg + len - 1 < end ) error("faidx_fetch_seq failed at %s:%d\n", chr, beg+len+1);
+        args->ref_rid = rid;
+        args->ref_beg = beg;
+        args->ref_end = beg + len - 1;
+    }
+    return args->ref_seq + beg - args->ref_beg;
+}
+
+/*
+ *  Returns the end of the reference block in the record to expand, with the
+ *  INFO/END tag removed, 0 if the record is to be written unchanged, or -1 if
+ *  it is to be skipped.
+ */
+static int gvcf_block_end(args_t *args, bcf1_t *line)
+{
+    bcf_hdr_t *hdr = args->header;
+    if ( args->filter )
+    {
+        int pass = filter_test(args->filter, line, NULL);
+        if ( args->filter_logic & FLT_EXCLUDE ) pass = pass ? 0 : 1;
+        if ( !pass ) return -1;
+    }
+
+    if ( !bcf_has_filter(hdr,line,"PASS") ) return 0;
+
+    // check if alleles compatible with being a gVCF record
+    int i, gallele = -1;
+    if (line->n_allele==1)
+        gallele = 0; // illumina/bcftools-call gvcf (if INFO/END present)
+    else
+    {
+        if ( line->d.allele[1][0]!='<' ) return -1;
+        for (i=1; i<line->n_allele; i++)
+        {
+            if ( line->d.allele[i][1]=='*' && line->d.allele[i][2]=='>' && line->d.allele[i][3]=='\0' ) { gallele = i; break; } // mpileup/spec compliant gVCF
+            if ( line->d.allele[i][1]=='X' && line->d.allele[i][2]=='>' && line->d.allele[i][3]=='\0' ) { gallele = i; break; } // old mpileup gVCF
+            if ( strcmp(line->d.allele[i],"<NON_REF>")==0 ) { gallele = i; break; }               // GATK gVCF
+        }
+    }
+
+    // no gVCF compatible alleles
+    if (gallele<0) return 0;
+
+    int nend = bcf_get_info_int32(hdr,line,"END",&args->itmp,&args->nitmp);
+    if ( nend!=1 ) return 0;    // No INFO/END => not gVCF record
+    int end = args->itmp[0];
+
+    // --expand-targets: the blocks outside of the targets are left as they are
+    if ( args->expand_idx && (end<=line->pos || !regidx_overlap(args->expand_idx, bcf_seqname(hdr,line), line->pos, end-1, args->expand_itr)) ) return 0;
+
+    bcf_update_info_int32(hdr,line,"END",NULL,0);
+    return end;
+}
+
+/*
+ *  The records of a block differ only in the position and the REF base. The
+ *  block is copied once into a clean template and for each position the base
+ *  is patched in both the unpacked alleles and the packed shared block, so
+ *  that neither the VCF nor the BCF output has to re-encode the record.
+ */
+static void gvcf_init_block(bcf1_t *dst, bcf1_t *src)
+{
+    bcf_copy(dst, src);
+    bcf_unpack(dst, BCF_UN_STR);
+    dst->rlen = strlen(dst->d.allele[0]);
+}
+static inline void gvcf_set_ref(bcf1_t *rec, char base)
+{
+    rec->d.allele[0][0] = base;
+    uint8_t *ptr = (uint8_t*)rec->shared.s + rec->unpack_size[0];
+    if ( !rec->d.shared_dirty && *ptr==(1<<4|BCF_BT_CHAR) ) ptr[1] = base;
+    else rec->d.shared_dirty |= BCF1_DIRTY_ALS;     // REF longer than one base, only the first is replaced
+}
+static void gvcf_expand(args_t *args, htsFile *out_fh, kstring_t *str, bcf1_t *rec, int beg, int end)
+{
+    if ( end<=beg ) return;
+    const char *ref = gvcf_ref(args, rec->rid, beg, end-1);
+    int pos;
+    for (pos=beg; pos<end; pos++)
+    {
+        rec->pos = pos;
+        gvcf_set_ref(rec, ref[pos-beg]);
+        if ( str ) vcf_format1(args->header, rec, str);
+        else bcf_write(out_fh, args->header, rec);
+    }
+}
+
+/*
+ *  With --record-threads and VCF output, the records are collected in batches
+ *  of GVCF_BATCH sites, the long blocks split across batches. The batches are
+ *  expanded and formatted by the workers of a batch pool, each with its own
+ *  reference handle, and the text is written in order.
+ */
+#define GVCF_BATCH 16384
+
+typedef struct
+{
+    bcf1_t *rec;    // the block template or the record to write unchanged
+    int beg, end;   // the sites of the block to expand, end=0 for unchanged records
+}
+gvcf_item_t;
+
+typedef struct
+{
+    gvcf_item_t *items;
+    int nitems, mitems;
+    kstring_t str;
+}
+gvcf_batch_t;
+
+static void gvcf_batch_work(void *worker, void *data)
+{
+    args_t *args = (args_t*) worker;
+    gvcf_batch_t *batch = (gvcf_batch_t*) data;
+    int i;
+    batch->str.l = 0;
+    for (i=0; i<batch->nitems; i++)
+    {
+        gvcf_item_t *item = &batch->items[i];
+        if ( !item->end )
+            vcf_format1(args->header, item->rec, &batch->str);
+        else
+            gvcf_expand(args, NULL, &batch->str, item->rec, item->beg, item->end);
+    }
+}
+
+static void gvcf_batch_write(void *data, void *bdata)
+{
+    htsFile *fh = (htsFile*) data;
+    kstring_t *str = &((gvcf_batch_t*) bdata)->str;
+    if ( !str->l ) return;
+    ssize_t ret = fh->format.compression!=no_compression ? bgzf_write(fh->fp.bgzf, str->s, str->l) : hwrite(fh->fp.hfile, str->s, str->l);
+    if ( ret!=str->l ) error("Failed to write %zu bytes\n", str->l);
+}
+
+static void gvcf_to_vcf_threaded(args_t *args, htsFile *out_fh)
+{
+    int i, j, nthreads = args->record_threads, nbatch = 2*nthreads;
+    args_t *targs = (args_t*) malloc(sizeof(args_t)*nthreads);
+    void **workers = (void**) malloc(sizeof(void*)*nthreads);
+    for (i=0; i<nthreads; i++)
+    {
+        targs[i] = *args;
+        targs[i].ref = fai_load(args->ref_fname);
+        if ( !targs[i].ref ) error("Could not load the fai index for reference %s\n", args->ref_fname);
+        targs[i].ref_seq = NULL;
+        targs[i].ref_rid = -1;
+        workers[i] = &targs[i];
+    }
+    gvcf_batch_t *batch = (gvcf_batch_t*) calloc(nbatch, sizeof(gvcf_batch_t));
+    void **batches = (void**) malloc(sizeof(void*)*nbatch);
+    for (i=0; i<nbatch; i++) batches[i] = &batch[i];
+
+    batch_pool_t *pool = batch_pool_init(nthreads, workers, batches, nbatch, gvcf_batch_work, gvcf_batch_write, out_fh);
+    bcf1_t *line = NULL;
+    int beg = 0, end = 0;   // the part of the current block not yet in a batch
+    int eof = 0;
+    while ( !eof )
+    {
+        gvcf_batch_t *bt = (gvcf_batch_t*) batch_pool_get(pool);
+        int npos = 0;
+        bt->nitems = 0;
+        while ( npos < GVCF_BATCH )
+        {
+            if ( beg >= end )
+            {
+                if ( !bcf_sr_next_line(args->files) ) { eof = 1; break; }
+                line = bcf_sr_get_line(args->files,0);
+                end = gvcf_block_end(args, line);
+                if ( end<0 ) { end = 0; continue; }
+                beg = line->pos;
+                if ( end && end<=beg ) { end = 0; continue; }
+            }
+            if ( bt->nitems==bt->mitems )
+            {
+                bt->mitems += 256;
+                bt->items = (gvcf_item_t*) realloc(bt->items, sizeof(gvcf_item_t)*bt->mitems);
+                for (j=bt->nitems; j<bt->mitems; j++) bt->items[j].rec = bcf_init();
+            }
+            gvcf_item_t *item = &bt->items[bt->nitems++];
+            if ( !end )
+            {
+                bcf_copy(item->rec, line);
+                item->end = 0;
+                npos++;
+                continue;
+            }
+            gvcf_init_block(item->rec, line);
+            item->beg = beg;
+            item->end = end - beg > GVCF_BATCH - npos ? beg + GVCF_BATCH - npos : end;
+            npos += item->end - item->beg;
+            beg = item->end;
+        }
+        if ( bt->nitems ) batch_pool_submit(pool);
+    }
+    batch_pool_destroy(pool);
+
+    for (i=0; i<nthreads; i++)
+    {
+        fai_destroy(targs[i].ref);
+        free(targs[i].ref_seq);
+    }
+    for (i=0; i<nbatch; i++)
+    {
+        for (j=0; j<batch[i].mitems; j++) bcf_destroy(batch[i].items[j].rec);
+        free(batch[i].items);
+        free(batch[i].str.s);
+    }
+    free(batch);
+    free(batches);
+    free(targs);
+    free(workers);
+}
+
 static void gvcf_to_vcf(args_t *args)
 {
     if ( !args->ref_fname ) error("--gvcf2vcf requires the --fasta-ref option\n");
 
     args->ref = fai_load(args->ref_fname);
     if ( !args->ref ) error("Could not load the fai index for reference %s\n", args->ref_fname);
+    args->ref_rid = -1;
+
+    if ( args->expand_targets )
+    {
+        args->expand_idx = regidx_init(args->expand_targets,NULL,NULL,0,NULL);
+        if ( !args->expand_idx ) error("Could not read the targets: %s\n", args->expand_targets);
+        args->expand_itr = regitr_init(args->expand_idx);
+    }
 
     open_vcf(args,NULL);
     htsFile *out_fh = hts_open(args->outfname,hts_bcf_wmode(args->output_type));
     if ( out_fh == NULL ) error("Can't write to \"%s\": %s\n", args->outfname, strerror(errno));
     if ( args->n_threads ) hts_set_threads(out_fh, args->n_threads);
 
-    bcf_hdr_t *hdr = bcf_sr_get_header(args->files,0);
+    bcf_hdr_t *hdr = args->header;
     if (args->record_cmd_line) bcf_hdr_append_version(hdr, args->argc, args->argv, "bcftools_convert");
     bcf_hdr_write(out_fh,hdr);
 
-    int32_t *itmp = NULL, nitmp = 0;
-
-    while ( bcf_sr_next_line(args->files) )
+    if ( args->record_threads > 1 && !(args->output_type & FT_BCF) )
+        gvcf_to_vcf_threaded(args, out_fh);
+    else
     {
-        bcf1_t *line = bcf_sr_get_line(args->files,0);
-        if ( args->filter )
+        bcf1_t *rec = bcf_init();
+        while ( bcf_sr_next_line(args->files) )
         {
-            int pass = filter_test(args->filter, line, NULL);
-            if ( args->filter_logic & FLT_EXCLUDE ) pass = pass ? 0 : 1;
-            if ( !pass ) continue;
-        }
-
-        if (!bcf_has_filter(hdr,line,"PASS"))
-        {
-            bcf_write(out_fh,hdr,line);
-            continue;
-        }
-
-        // check if alleles compatible with being a gVCF record
-        int i, gallele = -1;
-        if (line->n_allele==1)
-            gallele = 0; // illumina/bcftools-call gvcf (if INFO/END present)
-        else
-        {
-            if ( line->d.allele[1][0]!='<' ) continue;
-            for (i=1; i<line->n_allele; i++)
+            bcf1_t *line = bcf_sr_get_line(args->files,0);
+            int end = gvcf_block_end(args, line);
+            if ( end<0 ) continue;
+            if ( !end )
             {
-                if ( line->d.allele[i][1]=='*' && line->d.allele[i][2]=='>' && line->d.allele[i][3]=='\0' ) { gallele = i; break; } // mpileup/spec compliant gVCF
-                if ( line->d.allele[i][1]=='X' && line->d.allele[i][2]=='>' && line->d.allele[i][3]=='\0' ) { gallele = i; break; } // old mpileup gVCF
-                if ( strcmp(line->d.allele[i],"<NON_REF>")==0 ) { gallele = i; break; }               // GATK gVCF
+                bcf_write(out_fh,hdr,line);
+                continue;
             }
+            gvcf_init_block(rec, line);
+            gvcf_expand(args, out_fh, NULL, rec, line->pos, end);
         }
-
-        // no gVCF compatible alleles
-        if (gallele<0)
-        {
-            bcf_write(out_fh,hdr,line);
-            continue;
-        }
-
-        int nend = bcf_get_info_int32(hdr,line,"END",&itmp,&nitmp);
-        if ( nend!=1 )
-        {
-            // No INFO/END => not gVCF record
-            bcf_write(out_fh,hdr,line);
-            continue;
-        }
-        bcf_update_info_int32(hdr,line,"END",NULL,0);
-        int pos, len;
-        for (pos=line->pos; pos<itmp[0]; pos++)
-        {
-            line->pos = pos;
-            char *ref = faidx_fetch_seq(args->ref, (char*)bcf_hdr_id2name(hdr,line->rid), line->pos, line->pos, &len);
-            if ( !ref ) error("faidx_fetch_seq failed at %s:%d\n", bcf_hdr_id2name(hdr,line->rid), line->pos+1);
-            strncpy(line->d.allele[0],ref,len);
-            bcf_write(out_fh,hdr,line);
-            free(ref);
-        }
+        bcf_destroy(rec);
     }
-    free(itmp);
+    free(args->ref_seq);
     hts_close(out_fh);
 }
 
@@ -1389,17 +1827,21 @@ static void usage(void)
     fprintf(stderr, "   -g, --gensample <...>       <prefix>|<gen-file>,<sample-file>\n");
     fprintf(stderr, "       --tag <string>          tag to take values for .gen file: GT,PL,GL,GP [GT]\n");
     fprintf(stderr, "       --chrom                 output chromosome in first column instead of CHROM:POS_REF_ALT\n");
+    fprintf(stderr, "       --record-threads <int>  number of threads to format the genotypes in parallel [0]\n");
     fprintf(stderr, "       --sex <file>            output sex column in the sample-file, input format is: Sample\\t[MF]\n");
     fprintf(stderr, "       --vcf-ids               output VCF IDs in second column instead of CHROM:POS_REF_ALT\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "gVCF conversion:\n");
     fprintf(stderr, "       --gvcf2vcf              expand gVCF reference blocks\n");
+    fprintf(stderr, "       --expand-targets <file> expand only the blocks overlapping the targets, leave the rest as they are\n");
     fprintf(stderr, "   -f, --fasta-ref <file>      reference sequence in fasta format\n");
+    fprintf(stderr, "       --record-threads <int>  number of threads to expand the blocks in parallel, VCF output only [0]\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "HAP/SAMPLE conversion (output from SHAPEIT):\n");
     fprintf(stderr, "       --hapsample2vcf <...>   <prefix>|<haps-file>,<sample-file>\n");
     fprintf(stderr, "       --hapsample <...>       <prefix>|<haps-file>,<sample-file>\n");
     fprintf(stderr, "       --haploid2diploid       convert haploid genotypes to diploid homozygotes\n");
+    fprintf(stderr, "       --record-threads <int>  number of threads to format the genotypes in parallel [0]\n");
     fprintf(stderr, "       --sex <file>            output sex column in the sample-file, input format is: Sample\\t[MF]\n");
     fprintf(stderr, "       --vcf-ids               output VCF IDs instead of CHROM:POS_REF_ALT\n");
     fprintf(stderr, "\n");
@@ -1407,6 +1849,7 @@ static void usage(void)
     fprintf(stderr, "   -H, --haplegendsample2vcf <...>  <prefix>|<hap-file>,<legend-file>,<sample-file>\n");
     fprintf(stderr, "   -h, --haplegendsample <...>      <prefix>|<hap-file>,<legend-file>,<sample-file>\n");
     fprintf(stderr, "       --haploid2diploid            convert haploid genotypes to diploid homozygotes\n");
+    fprintf(stderr, "       --record-threads <int>       number of threads to format the genotypes in parallel [0]\n");
     fprintf(stderr, "       --sex <file>                 output sex column in the sample-file, input format is: Sample\\t[MF]\n");
     fprintf(stderr, "       --vcf-ids                    output VCF IDs instead of CHROM:POS_REF_ALT\n");
     fprintf(stderr, "\n");
@@ -1414,6 +1857,7 @@ static void usage(void)
     fprintf(stderr, "       --tsv2vcf <file>        \n");
     fprintf(stderr, "   -c, --columns <string>      columns of the input tsv file [ID,CHROM,POS,AA]\n");
     fprintf(stderr, "   -f, --fasta-ref <file>      reference sequence in fasta format\n");
+    fprintf(stderr, "       --record-threads <int>  number of threads to parse the lines in parallel [0]\n");
     fprintf(stderr, "   -s, --samples <list>        list of sample names\n");
     fprintf(stderr, "   -S, --samples-file <file>   file of sample names\n");
     fprintf(stderr, "\n");
@@ -1431,6 +1875,7 @@ static void usage(void)
 int main_vcfconvert(int argc, char *argv[])
 {
     int c;
+    char *tmp;
     args_t *args = (args_t*) calloc(1,sizeof(args_t));
     args->argc   = argc; args->argv = argv;
     args->outfname = "-";
@@ -1467,6 +1912,8 @@ int main_vcfconvert(int argc, char *argv[])
         {"columns",required_argument,NULL,'c'},
         {"fasta-ref",required_argument,NULL,'f'},
         {"no-version",no_argument,NULL,10},
+        {"record-threads",required_argument,NULL,12},
+        {"expand-targets",required_argument,NULL,13},
         {NULL,0,NULL,0}
     };
     while ((c = getopt_long(argc, argv, "?h:r:R:s:S:t:T:i:e:g:G:o:O:c:f:H:",loptions,NULL)) >= 0) {
@@ -1506,6 +1953,11 @@ int main_vcfconvert(int argc, char *argv[])
             case  9 : args->n_threads = strtol(optarg, 0, 0); break;
             case 10 : args->record_cmd_line = 0; break;
             case 11 : args->sex_fname = optarg; break;
+            case 12 :
+                args->record_threads = strtol(optarg,&tmp,10);
+                if ( *tmp || args->record_threads<0 ) error("Could not parse argument: --record-threads %s\n", optarg);
+                break;
+            case 13 : args->expand_targets = optarg; break;
             case '?': usage();
             default: error("Unknown argument: %s\n", optarg);
         }
@@ -37,6 +37,7 @@ THE SOFTWARE.  */
 #include "bcftools.h"
 #include "filter.h"
 #include "rbuf.h"
+#include "gtcount.h"
 
 // Logic of the filters: include or exclude sites which match the filters?
 #define FLT_INCLUDE 1
@@ -61,7 +62,8 @@ typedef struct _args_t
     int annot_mode;     // add to existing FILTER annotation or replace? Otherwise reset FILTER to PASS or leave as it is?
     int flt_fail, flt_pass;     // BCF ids of fail and pass filters
     int snp_gap, indel_gap, IndelGap_id, SnpGap_id;
-    int32_t ntmpi, *tmpi, ntmp_ac, *tmp_ac;
+    int32_t ntmpi, *tmpi, ntmp_ac, *tmp_ac, ntmp_flt, *tmp_flt;
+    kstring_t tmp_str;
     rbuf_t rbuf;
     bcf1_t **rbuf_lines;
 
@@ -169,6 +171,63 @@ static void destroy_data(args_t *args)
         filter_destroy(args->filter);
     free(args->tmpi);
     free(args->tmp_ac);
+    free(args->tmp_flt);
+    free(args->tmp_str.s);
+}
+
+/*
+    Set the FILTER column to the given list. With BCF the FILTER vector is
+    normally re-encoded by bcf1_sync() together with the whole shared block.
+    Here it is patched in place, or spliced into the shared block when the
+    encoded size changes and INFO is not unpacked (its pointers would move),
+    and the record is left clean so that the shared block is written as is.
+    Otherwise fall back to bcf_update_filter().
+*/
+static void set_filters(args_t *args, bcf1_t *line, int32_t *flt, int nflt)
+{
+    if ( line->d.shared_dirty || !(line->unpacked & BCF_UN_FLT) )
+    {
+        bcf_update_filter(args->hdr, line, flt, nflt);
+        return;
+    }
+    args->tmp_str.l = 0;
+    bcf_enc_vint(&args->tmp_str, nflt, flt, -1);
+    size_t beg = line->unpack_size[0] + line->unpack_size[1], len = line->unpack_size[2];
+    if ( args->tmp_str.l!=len )
+    {
+        if ( line->unpacked & BCF_UN_INFO )
+        {
+            bcf_update_filter(args->hdr, line, flt, nflt);
+            return;
+        }
+        size_t l = line->shared.l + args->tmp_str.l - len;
+        ks_resize(&line->shared, l);
+        memmove(line->shared.s + beg + args->tmp_str.l, line->shared.s + beg + len, line->shared.l - beg - len);
+        line->shared.l = l;
+        line->unpack_size[2] = args->tmp_str.l;
+    }
+    memcpy(line->shared.s + beg, args->tmp_str.s, args->tmp_str.l);
+
+    hts_expand(int, nflt, line->d.m_flt, line->d.flt);
+    memcpy(line->d.flt, flt, sizeof(*flt)*nflt);
+    line->d.n_flt = nflt;
+}
+
+// The same as bcf_add_filter() but via set_filters()
+static void add_filter(args_t *args, bcf1_t *line, int flt_id)
+{
+    int i;
+    for (i=0; i<line->d.n_flt; i++)
+        if ( line->d.flt[i]==flt_id ) return;   // already set
+    if ( flt_id==0 || (line->d.n_flt==1 && line->d.flt[0]==0) )
+    {
+        set_filters(args, line, &flt_id, 1);    // PASS replaces everything, other filters replace PASS
+        return;
+    }
+    hts_expand(int32_t, line->d.n_flt+1, args->ntmp_flt, args->tmp_flt);
+    memcpy(args->tmp_flt, line->d.flt, sizeof(int32_t)*line->d.n_flt);
+    args->tmp_flt[line->d.n_flt] = flt_id;
+    set_filters(args, line, args->tmp_flt, line->d.n_flt+1);
 }
 
 static void flush_buffer(args_t *args, int n)
@@ -285,7 +344,7 @@ static void buffered_filters(args_t *args, bcf1_t *line)
                 bcf1_t *rec  = args->rbuf_lines[i];
                 if ( !(rec->d.var_type & IndelGap_set) ) continue;
                 hts_expand(int, rec->n_allele, args->ntmpi, args->tmpi);
-                int ret = bcf_calc_ac(args->hdr, rec, args->tmpi, BCF_UN_ALL);
+                int ret = gtcount_calc_ac(args->hdr, rec, args->tmpi, BCF_UN_ALL);
                 if ( imax_ac==-1 || (ret && max_ac < args->tmpi[1]) ) { max_ac = args->tmpi[1]; imax_ac = i; }
             }
 
@@ -546,15 +605,15 @@ int main_vcffilter(int argc, char *argv[])
         }
         if ( args->soft_filter || args->set_gts || pass )
         {
+            bcf_unpack(line,BCF_UN_FLT);
             if ( pass )
             {
-                bcf_unpack(line,BCF_UN_FLT);
-                if ( args->annot_mode & ANNOT_RESET || !line->d.n_flt ) bcf_add_filter(args->hdr, line, args->flt_pass);
+                if ( args->annot_mode & ANNOT_RESET || !line->d.n_flt ) add_filter(args, line, args->flt_pass);
             }
             else if ( args->soft_filter )
             {
-                if ( (args->annot_mode & ANNOT_ADD) ) bcf_add_filter(args->hdr, line, args->flt_fail);
-                else bcf_update_filter(args->hdr, line, &args->flt_fail, 1);
+                if ( (args->annot_mode & ANNOT_ADD) ) add_filter(args, line, args->flt_fail);
+                else if ( line->d.n_flt!=1 || line->d.flt[0]!=args->flt_fail ) set_filters(args, line, &args->flt_fail, 1);
             }
             if ( args->set_gts ) set_genotypes(args, line, pass);
             if ( !args->rbuf_lines )
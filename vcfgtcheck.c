@@ -32,12 +32,60 @@ THE SOFTWARE.  */
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <math.h>
+#include <pthread.h>
 #include <htslib/vcf.h>
 #include <htslib/synced_bcf_reader.h>
 #include <htslib/vcfutils.h>
+#include <htslib/khash_str2int.h>
 #include <inttypes.h>
 #include "bcftools.h"
 #include "hclust.h"
+#include "cache.h"
+
+/*
+    The -g genotypes cache, see cache.h, with the layout:
+        gtx_hdr_t
+        genotypes   .. for each site: 2-bit genotype indexes (0:RR, 1:RA, 2:AA, 3:skip)
+                       of biallelic sites, one byte per sample (0xff:skip) with up
+                       to GTX_MAX_ALLELES alleles, 4-byte aligned int32_t (-1:skip)
+                       otherwise
+        alleles     .. NUL-terminated allele strings
+        sites       .. gtx_site_t, sorted by sequence and position
+        sequences   .. uint64_t index of the first site of each sequence [nseq+1],
+                       followed by NUL-terminated sequence names
+    Only diploid sites are stored, missing and haploid genotypes are skipped.
+    The offsets are from the beginning of the file. The stamp covers the size
+    and mtime of the -g file and the number of its samples.
+*/
+#define GTX_MAGIC "BCFGTX\3"
+#define GTX_MAX_ALLELES 22      // the genotype index fits in a byte
+
+typedef struct
+{
+    uint64_t nsmpl, nseq, nsite;
+    uint64_t als_off, site_off, seq_off;
+}
+gtx_hdr_t;
+
+typedef struct
+{
+    uint32_t pos, nals;
+    uint64_t als, gts;          // file offsets of the alleles and the genotypes
+}
+gtx_site_t;
+
+typedef struct
+{
+    cache_t *cache;
+    uint8_t *map;
+    gtx_hdr_t *hdr;
+    gtx_site_t *site;
+    uint64_t *seq_beg;
+    void *seq2id;
+    char **als;
+    int mals;
+}
+gtx_t;
 
 typedef struct
 {
@@ -47,11 +95,20 @@ typedef struct
     int32_t *tmp_arr, *pl_arr;
     double *lks, *sites, min_inter_err, max_intra_err;
     int *cnts, *dps, hom_only, cross_check, all_sites;
-    char *cwd, **argv, *gt_fname, *plot, *query_sample, *target_sample;
+    char *cwd, **argv, *gt_fname, *plot, *query_sample, *target_sample, *gtx_fname;
+    gtx_t *gtx;                 // the -g genotypes cache, see --gt-cache
     int argc, no_PLs, narr, nsmpl;
+
+    // Cross-check with -G: GTs are packed in bit planes over blocks of sites,
+    // one bit per site and sample for each of: valid GT, has REF, has ALT
+    int pair_threads, npack;
+    uint64_t *pack_val, *pack_ref, *pack_alt;   // [nsmpl*GT_PACK_NWORDS]
 }
 args_t;
 
+#define GT_PACK_NWORDS 64   // number of 64-bit words per sample in a block of packed sites
+#define GT_PACK_TILE   64   // number of samples in a tile of the pairwise comparison
+
 FILE *open_file(char **fname, const char *mode, const char *fmt, ...);
 char *msprintf(const char *fmt, ...);
 void mkdir_p(const char *fmt, ...);
@@ -226,7 +283,7 @@ static void init_data(args_t *args)
 
     if ( !args->cross_check )
     {
-        args->gt_hdr = args->files->readers[1].header;
+        if ( !args->gtx ) args->gt_hdr = args->files->readers[1].header;
         int nsamples = bcf_hdr_nsamples(args->gt_hdr);
         if ( !nsamples ) error("No samples in %s?\n", args->files->readers[1].fname);
         args->lks   = (double*) calloc(nsamples,sizeof(double));
@@ -250,18 +307,18 @@ static int allele_to_int(bcf1_t *line, char *allele)
     return i-1;
 }
 
-static int init_gt2ipl(args_t *args, bcf1_t *gt_line, bcf1_t *sm_line, int *gt2ipl, int n_gt2ipl)
+static int init_gt2ipl(args_t *args, int gt_nals, char **gt_als, bcf1_t *sm_line, int *gt2ipl, int n_gt2ipl)
 {
     int i, j;
     for (i=0; i<n_gt2ipl; i++) gt2ipl[i] = -1;
-    for (i=0; i<gt_line->n_allele; i++)
+    for (i=0; i<gt_nals; i++)
     {
         // find which of the sm_alleles (k) corresponds to the gt_allele (i)
-        int k = allele_to_int(sm_line, gt_line->d.allele[i]);
+        int k = allele_to_int(sm_line, gt_als[i]);
         if ( k<0 ) return 0;
         for (j=0; j<=i; j++)
         {
-            int l = allele_to_int(sm_line, gt_line->d.allele[j]);
+            int l = allele_to_int(sm_line, gt_als[j]);
             if ( l<0 ) return 0;
             gt2ipl[ bcf_ij2G(j,i) ] = k<=l ? bcf_ij2G(k,l) : bcf_ij2G(l,k);
         }
@@ -335,6 +392,206 @@ static int cmp_doubleptr(const void *_a, const void *_b)
     return 1;
 }
 
+static int gt_is_hom(int igt)
+{
+    // inverse of bcf_alleles2gt(a,b) = b*(b+1)/2 + a, with a<=b
+    int b = 0;
+    while ( (b+1)*(b+2)/2 <= igt ) b++;
+    return igt - b*(b+1)/2 == b;
+}
+
+// Read the -g file and write the genotypes cache
+static void gtx_build(args_t *args, uint64_t stamp)
+{
+    htsFile *fp = hts_open(args->gt_fname, "r");
+    if ( !fp ) error("Failed to read %s\n", args->gt_fname);
+    bcf_hdr_t *hdr = bcf_hdr_read(fp);
+    if ( !hdr ) error("Failed to read the header of %s\n", args->gt_fname);
+
+    cache_t *out = cache_create(args->gtx_fname, GTX_MAGIC, stamp);
+    gtx_hdr_t gtx_hdr;
+    memset(&gtx_hdr, 0, sizeof(gtx_hdr));
+    gtx_hdr.nsmpl = bcf_hdr_nsamples(hdr);
+    uint64_t hdr_off = out->off;
+    cache_write(out, &gtx_hdr, sizeof(gtx_hdr));     // rewritten with the counts at the end
+
+    int nsmpl = bcf_hdr_nsamples(hdr), mseen = 0;
+    uint8_t *seen = NULL;
+    uint8_t *gts  = (uint8_t*) malloc(sizeof(int32_t)*nsmpl);
+    int i, ngt_arr = 0, nsite = 0, msite = 0, nseq = 0, mseq = 0, prev_rid = -1, prev_pos = -1;
+    int32_t *gt_arr = NULL;
+    gtx_site_t *site = NULL;
+    uint64_t *seq_beg = NULL;
+    kstring_t als = {0,0,0}, seq_names = {0,0,0};
+    bcf1_t *rec = bcf_init1();
+    while ( bcf_read1(fp, hdr, rec)==0 )
+    {
+        int ngt = bcf_get_genotypes(hdr, rec, &gt_arr, &ngt_arr);
+        if ( ngt<=0 ) error("GT not present at %s:%d?", bcf_seqname(hdr,rec), rec->pos+1);
+        ngt /= nsmpl;
+        if ( ngt!=2 ) continue; // checking only diploid genotypes
+
+        if ( rec->rid!=prev_rid )
+        {
+            if ( cache_seq_seen(&seen, &mseen, rec->rid) ) error("The file is not sorted: %s\n", args->gt_fname);
+            hts_expand(uint64_t, nseq+2, mseq, seq_beg);
+            seq_beg[nseq++] = nsite;
+            kputs(bcf_seqname(hdr,rec), &seq_names);
+            kputc(0, &seq_names);
+            prev_rid = rec->rid;
+            prev_pos = -1;
+        }
+        else if ( rec->pos < prev_pos ) error("The file is not sorted: %s\n", args->gt_fname);
+        prev_pos = rec->pos;
+
+        bcf_unpack(rec, BCF_UN_STR);
+        hts_expand(gtx_site_t, nsite+1, msite, site);
+        gtx_site_t *gs = &site[nsite++];
+        gs->pos  = rec->pos;
+        gs->nals = rec->n_allele;
+        gs->als  = als.l;
+        if ( gs->nals > GTX_MAX_ALLELES ) cache_pad(out, sizeof(int32_t));
+        gs->gts  = out->off;
+        for (i=0; i<rec->n_allele; i++)
+        {
+            kputs(rec->d.allele[i], &als);
+            kputc(0, &als);
+        }
+
+        size_t ngts = gs->nals==2 ? (nsmpl+3)/4 : (gs->nals > GTX_MAX_ALLELES ? sizeof(int32_t)*nsmpl : nsmpl);
+        memset(gts, gs->nals==2 ? 0 : 0xff, ngts);
+        for (i=0; i<nsmpl; i++)
+        {
+            int32_t *gt_ptr = gt_arr + i*2;
+            int32_t igt = -1;   // skip haploid and missing genotypes
+            if ( gt_ptr[1]!=bcf_int32_vector_end && !bcf_gt_is_missing(gt_ptr[0]) && !bcf_gt_is_missing(gt_ptr[1]) )
+                igt = bcf_alleles2gt(bcf_gt_allele(gt_ptr[0]),bcf_gt_allele(gt_ptr[1]));
+            if ( gs->nals==2 ) gts[i/4] |= (igt<0 ? 3 : igt) << ((i%4)*2);
+            else if ( gs->nals > GTX_MAX_ALLELES ) memcpy(gts + i*sizeof(int32_t), &igt, sizeof(int32_t));
+            else if ( igt>=0 ) gts[i] = igt;
+        }
+        cache_write(out, gts, ngts);
+    }
+    if ( nseq ) seq_beg[nseq] = nsite;
+
+    gtx_hdr.nsite    = nsite;
+    gtx_hdr.nseq     = nseq;
+    gtx_hdr.als_off  = out->off;
+    cache_write(out, als.s, als.l);
+    cache_pad(out, 8);
+    gtx_hdr.site_off = out->off;
+    for (i=0; i<nsite; i++) site[i].als += gtx_hdr.als_off;
+    cache_write(out, site, sizeof(*site)*nsite);
+    gtx_hdr.seq_off = out->off;
+    cache_write(out, seq_beg, nseq ? sizeof(*seq_beg)*(nseq+1) : 0);
+    cache_write(out, seq_names.s, seq_names.l);
+    cache_write_at(out, hdr_off, &gtx_hdr, sizeof(gtx_hdr));
+    cache_commit(out);
+
+    bcf_destroy1(rec);
+    bcf_hdr_destroy(hdr);
+    if ( hts_close(fp)!=0 ) error("Close failed: %s\n", args->gt_fname);
+    free(gt_arr);
+    free(gts);
+    free(seen);
+    free(site);
+    free(seq_beg);
+    free(als.s);
+    free(seq_names.s);
+}
+
+// Returns 1 if the cache exists and is up to date with the -g file, 0 otherwise
+static int gtx_load(args_t *args, uint64_t stamp)
+{
+    cache_t *cache = cache_open(args->gtx_fname, GTX_MAGIC, stamp, "genotypes cache");
+    if ( !cache ) return 0;
+
+    gtx_t *gtx = (gtx_t*) calloc(1, sizeof(gtx_t));
+    gtx->cache   = cache;
+    gtx->map     = cache->map;
+    gtx->hdr     = (gtx_hdr_t*) cache_ptr(cache, cache->off, sizeof(gtx_hdr_t));
+    gtx->site    = (gtx_site_t*) cache_ptr(cache, gtx->hdr->site_off, sizeof(gtx_site_t)*gtx->hdr->nsite);
+    gtx->seq_beg = (uint64_t*) cache_ptr(cache, gtx->hdr->seq_off, gtx->hdr->nseq ? sizeof(uint64_t)*(gtx->hdr->nseq+1) : 0);
+    gtx->seq2id  = khash_str2int_init();
+    char *name = (char*) (gtx->seq_beg + gtx->hdr->nseq + 1);
+    uint64_t i;
+    for (i=0; i<gtx->hdr->nseq; i++)
+    {
+        khash_str2int_set(gtx->seq2id, name, i);
+        name += strlen(name) + 1;
+    }
+    args->gtx = gtx;
+    return 1;
+}
+
+static void gtx_destroy(gtx_t *gtx)
+{
+    if ( !gtx ) return;
+    cache_close(gtx->cache);
+    khash_str2int_destroy(gtx->seq2id);
+    free(gtx->als);
+    free(gtx);
+}
+
+/*
+ *  Find the cached site matching the query record by position and alleles and
+ *  initialize the mapping from the target genotype index to the query PLs.
+ *  Returns the site or NULL if there is no such site.
+ */
+static gtx_site_t *gtx_find_site(args_t *args, bcf1_t *sm_line, int **gt2ipl, int *m_gt2ipl)
+{
+    gtx_t *gtx = args->gtx;
+    int id;
+    if ( khash_str2int_get(gtx->seq2id, bcf_seqname(args->sm_hdr,sm_line), &id)!=0 ) return NULL;
+
+    // the first site at the position
+    uint64_t beg = gtx->seq_beg[id], end = gtx->seq_beg[id+1];
+    while ( beg < end )
+    {
+        uint64_t mid = (beg + end) / 2;
+        if ( gtx->site[mid].pos < (uint32_t)sm_line->pos ) beg = mid + 1;
+        else end = mid;
+    }
+    for (; beg < gtx->seq_beg[id+1] && gtx->site[beg].pos==(uint32_t)sm_line->pos; beg++)
+    {
+        gtx_site_t *site = &gtx->site[beg];
+        hts_expand(char*, site->nals, gtx->mals, gtx->als);
+        char *als = (char*) (gtx->map + site->als);
+        uint32_t i;
+        for (i=0; i<site->nals; i++)
+        {
+            gtx->als[i] = als;
+            als += strlen(als) + 1;
+        }
+        int n_gt2ipl = site->nals*(site->nals + 1)/2;
+        hts_expand(int, n_gt2ipl, *m_gt2ipl, *gt2ipl);
+        if ( init_gt2ipl(args, site->nals, gtx->als, sm_line, *gt2ipl, n_gt2ipl) ) return site;
+    }
+    return NULL;
+}
+
+// Genotype indexes of the target samples at the cached site, -1 for skipped genotypes
+static void gtx_get_gts(args_t *args, gtx_site_t *site, int *tgt_gt)
+{
+    uint8_t *gts = args->gtx->map + site->gts;
+    int i, nsmpl = args->gtx->hdr->nsmpl;
+    if ( site->nals==2 )
+    {
+        for (i=0; i<nsmpl; i++)
+        {
+            int igt = (gts[i/4] >> ((i%4)*2)) & 3;
+            tgt_gt[i] = igt==3 ? -1 : igt;
+        }
+    }
+    else if ( site->nals > GTX_MAX_ALLELES )
+    {
+        int32_t *igt = (int32_t*) gts;   // aligned by gtx_build()
+        for (i=0; i<nsmpl; i++) tgt_gt[i] = igt[i];
+    }
+    else
+        for (i=0; i<nsmpl; i++) tgt_gt[i] = gts[i]==0xff ? -1 : gts[i];
+}
+
 static void check_gt(args_t *args)
 {
     int i,ret, *gt2ipl = NULL, m_gt2ipl = 0, *gt_arr = NULL, ngt_arr = 0;
@@ -379,29 +636,48 @@ static void check_gt(args_t *args)
 
     // Main loop
     float prev_lk = 0;
+    int ngt = 0, npl, *tgt_gt = (int*) malloc(sizeof(int)*bcf_hdr_nsamples(args->gt_hdr));
     while ( (ret=bcf_sr_next_line(args->files)) )
     {
-        if ( ret!=2 ) continue;
         bcf1_t *sm_line = args->files->readers[0].buffer[0];    // the query file
-        bcf1_t *gt_line = args->files->readers[1].buffer[0];    // the -g target file
-        bcf_unpack(sm_line, BCF_UN_FMT);
-        bcf_unpack(gt_line, BCF_UN_FMT);
-
-        // Init mapping from target genotype index to the sample's PL fields
-        int n_gt2ipl = gt_line->n_allele*(gt_line->n_allele + 1)/2;
-        if ( n_gt2ipl > m_gt2ipl )
+        bcf1_t *gt_line = NULL;                                 // the -g target file
+        if ( args->gtx )
         {
-            m_gt2ipl = n_gt2ipl;
-            gt2ipl   = (int*) realloc(gt2ipl, sizeof(int)*m_gt2ipl);
+            // Target genotypes from the cache
+            bcf_unpack(sm_line, BCF_UN_FMT);
+            gtx_site_t *site = gtx_find_site(args, sm_line, &gt2ipl, &m_gt2ipl);
+            if ( !site ) continue;
+            gtx_get_gts(args, site, tgt_gt);
         }
-        if ( !init_gt2ipl(args, gt_line, sm_line, gt2ipl, n_gt2ipl) ) continue;
+        else
+        {
+            if ( ret!=2 ) continue;
+            gt_line = args->files->readers[1].buffer[0];
+            bcf_unpack(sm_line, BCF_UN_FMT);
+            bcf_unpack(gt_line, BCF_UN_FMT);
 
-        // Target genotypes
-        int ngt, npl;
-        if ( (ngt=bcf_get_genotypes(args->gt_hdr, gt_line, &gt_arr, &ngt_arr)) <= 0 )
-            error("GT not present at %s:%d?", args->gt_hdr->id[BCF_DT_CTG][gt_line->rid].key, gt_line->pos+1);
-        ngt /= bcf_hdr_nsamples(args->gt_hdr);
-        if ( ngt!=2 ) continue; // checking only diploid genotypes
+            // Init mapping from target genotype index to the sample's PL fields
+            int n_gt2ipl = gt_line->n_allele*(gt_line->n_allele + 1)/2;
+            if ( n_gt2ipl > m_gt2ipl )
+            {
+                m_gt2ipl = n_gt2ipl;
+                gt2ipl   = (int*) realloc(gt2ipl, sizeof(int)*m_gt2ipl);
+            }
+            if ( !init_gt2ipl(args, gt_line->n_allele, gt_line->d.allele, sm_line, gt2ipl, n_gt2ipl) ) continue;
+
+            // Target genotypes
+            if ( (ngt=bcf_get_genotypes(args->gt_hdr, gt_line, &gt_arr, &ngt_arr)) <= 0 )
+                error("GT not present at %s:%d?", args->gt_hdr->id[BCF_DT_CTG][gt_line->rid].key, gt_line->pos+1);
+            ngt /= bcf_hdr_nsamples(args->gt_hdr);
+            if ( ngt!=2 ) continue; // checking only diploid genotypes
+            for (i=0; i<bcf_hdr_nsamples(args->gt_hdr); i++)
+            {
+                int *gt_ptr = gt_arr + i*ngt;
+                if ( gt_ptr[1]==bcf_int32_vector_end ) { tgt_gt[i] = -1; continue; }    // skip haploid genotypes
+                if ( bcf_gt_is_missing(gt_ptr[0]) || bcf_gt_is_missing(gt_ptr[1]) ) { tgt_gt[i] = -1; continue; }
+                tgt_gt[i] = bcf_alleles2gt(bcf_gt_allele(gt_ptr[0]),bcf_gt_allele(gt_ptr[1])); // genotype index in the target file
+            }
+        }
 
         // Sample PLs
         if ( !fake_pls )
@@ -440,13 +716,9 @@ static void check_gt(args_t *args)
         // The main stats: concordance of the query sample with the target -g samples
         for (i=0; i<bcf_hdr_nsamples(args->gt_hdr); i++)
         {
-            int *gt_ptr = gt_arr + i*ngt;
-            if ( gt_ptr[1]==bcf_int32_vector_end ) continue;    // skip haploid genotypes
-            if ( bcf_gt_is_missing(gt_ptr[0]) || bcf_gt_is_missing(gt_ptr[1]) ) continue;
-            int a = bcf_gt_allele(gt_ptr[0]);
-            int b = bcf_gt_allele(gt_ptr[1]);
-            if ( args->hom_only && a!=b ) continue; // heterozygous genotype
-            int igt_tgt = igt_tgt = bcf_alleles2gt(a,b); // genotype index in the target file
+            int igt_tgt = tgt_gt[i];        // genotype index in the target file
+            if ( igt_tgt<0 ) continue;      // haploid or missing
+            if ( args->hom_only && !gt_is_hom(igt_tgt) ) continue; // heterozygous genotype
             int igt_qry = gt2ipl[igt_tgt];  // corresponding genotype in query file
             if ( igt_qry>=max_ipl || pl_ptr[igt_qry]<0 ) continue;   // genotype not present in query sample: haploid or missing
             args->lks[i] += sum_pl<0 ? -pl_ptr[igt_qry] : log(pow(10, -0.1*pl_ptr[igt_qry])/sum_pl);
@@ -475,6 +747,7 @@ static void check_gt(args_t *args)
             fprintf(fp, "\n");
         }
     }
+    free(tgt_gt);
     free(gt2ipl);
     free(gt_arr);
     free(args->pl_arr);
@@ -604,6 +877,137 @@ int process_PL(args_t *args, bcf1_t *line, uint32_t *ntot, uint32_t *ndif)
     return 0;
 }
 
+static inline int popcount64(uint64_t x)
+{
+    return __builtin_popcountll(x);
+}
+
+typedef struct
+{
+    args_t *args;
+    uint32_t *ntot, *ndif;
+    int nwords, ntile, itile;
+    pthread_mutex_t lock;
+}
+gt_pack_job_t;
+
+static void *gt_pack_worker(void *data)
+{
+    gt_pack_job_t *job = (gt_pack_job_t*) data;
+    args_t *args = job->args;
+    int i, j, k, j0, nwords = job->nwords;
+    while (1)
+    {
+        // the tiles with more pairs first for better load balancing
+        pthread_mutex_lock(&job->lock);
+        int itile = job->ntile - 1 - job->itile++;
+        pthread_mutex_unlock(&job->lock);
+        if ( itile<0 ) break;
+
+        int ibeg = itile*GT_PACK_TILE, iend = ibeg + GT_PACK_TILE;
+        if ( iend > args->nsmpl ) iend = args->nsmpl;
+        if ( ibeg < 1 ) ibeg = 1;
+        for (j0=0; j0<iend; j0+=GT_PACK_TILE)
+        {
+            for (i=ibeg; i<iend; i++)
+            {
+                uint64_t *va = args->pack_val + (size_t)i*GT_PACK_NWORDS;
+                uint64_t *ra = args->pack_ref + (size_t)i*GT_PACK_NWORDS;
+                uint64_t *aa = args->pack_alt + (size_t)i*GT_PACK_NWORDS;
+                int jend = j0 + GT_PACK_TILE < i ? j0 + GT_PACK_TILE : i;
+                for (j=j0; j<jend; j++)
+                {
+                    uint64_t *vb = args->pack_val + (size_t)j*GT_PACK_NWORDS;
+                    uint64_t *rb = args->pack_ref + (size_t)j*GT_PACK_NWORDS;
+                    uint64_t *ab = args->pack_alt + (size_t)j*GT_PACK_NWORDS;
+                    uint32_t nt = 0, nd = 0;
+                    for (k=0; k<nwords; k++)
+                    {
+                        uint64_t val = va[k] & vb[k];
+                        nt += popcount64(val);
+                        nd += popcount64(val & ((ra[k]^rb[k]) | (aa[k]^ab[k])));
+                    }
+                    size_t idx = (size_t)i*(i-1)/2 + j;
+                    job->ntot[idx] += nt;
+                    job->ndif[idx] += nd;
+                }
+            }
+        }
+    }
+    return NULL;
+}
+
+/*
+ *  Add the pairwise counts of the packed block of sites to ntot and ndif.
+ *  The sample pairs are split into tiles which are processed in parallel
+ *  with --pair-threads.
+ */
+static void flush_packed_GTs(args_t *args, uint32_t *ntot, uint32_t *ndif)
+{
+    if ( !args->npack ) return;
+
+    gt_pack_job_t job;
+    job.args   = args;
+    job.ntot   = ntot;
+    job.ndif   = ndif;
+    job.nwords = (args->npack + 63) / 64;
+    job.ntile  = (args->nsmpl + GT_PACK_TILE - 1) / GT_PACK_TILE;
+    job.itile  = 0;
+    pthread_mutex_init(&job.lock, NULL);
+
+    int i, nthr = args->pair_threads < job.ntile ? args->pair_threads : job.ntile;
+    pthread_t *thr = nthr > 1 ? (pthread_t*) malloc(sizeof(pthread_t)*nthr) : NULL;
+    for (i=1; i<nthr; i++)
+        if ( pthread_create(&thr[i], NULL, gt_pack_worker, &job)!=0 ) error("Failed to create threads\n");
+    gt_pack_worker(&job);
+    for (i=1; i<nthr; i++) pthread_join(thr[i], NULL);
+    free(thr);
+    pthread_mutex_destroy(&job.lock);
+
+    size_t nmem = sizeof(uint64_t)*args->nsmpl*GT_PACK_NWORDS;
+    memset(args->pack_val, 0, nmem);
+    memset(args->pack_ref, 0, nmem);
+    memset(args->pack_alt, 0, nmem);
+    args->npack = 0;
+}
+
+/*
+ *  Same as process_GT() but the genotypes of biallelic sites are packed and
+ *  compared in blocks, see flush_packed_GTs(). Sites with other alleles are
+ *  compared immediately by process_GT().
+ */
+static int pack_GT(args_t *args, bcf1_t *line, uint32_t *ntot, uint32_t *ndif)
+{
+    int ngt = bcf_get_genotypes(args->sm_hdr, line, &args->tmp_arr, &args->ntmp_arr);
+
+    if ( ngt<=0 ) return 1;                 // GT not present
+    if ( ngt!=args->nsmpl*2 ) return 2;     // not diploid
+
+    int i;
+    for (i=0; i<ngt; i++)
+    {
+        int32_t gt = args->tmp_arr[i];
+        if ( bcf_gt_is_missing(gt) || gt==bcf_int32_vector_end ) continue;
+        if ( bcf_gt_allele(gt) > 1 ) return process_GT(args, line, ntot, ndif);
+    }
+
+    int iword = args->npack / 64;
+    uint64_t bit = (uint64_t)1 << (args->npack % 64);
+    for (i=0; i<args->nsmpl; i++)
+    {
+        int32_t *a = args->tmp_arr + i*2;
+        if ( bcf_gt_is_missing(a[0]) || bcf_gt_is_missing(a[1]) || a[1]==bcf_int32_vector_end ) continue;
+        int agt = 1<<bcf_gt_allele(a[0]) | 1<<bcf_gt_allele(a[1]);
+
+        size_t k = (size_t)i*GT_PACK_NWORDS + iword;
+        args->pack_val[k] |= bit;
+        if ( agt&1 ) args->pack_ref[k] |= bit;
+        if ( agt&2 ) args->pack_alt[k] |= bit;
+    }
+    if ( ++args->npack == GT_PACK_NWORDS*64 ) flush_packed_GTs(args, ntot, ndif);
+    return 0;
+}
+
 static void cross_check_gts(args_t *args)
 {
     // Initialize things: check which tags are defined in the header, sample names etc.
@@ -623,6 +1027,13 @@ static void cross_check_gts(args_t *args)
     uint32_t *ndif = (uint32_t*) calloc(args->narr,4);
     uint32_t *ntot = (uint32_t*) calloc(args->narr,4);
 
+    if ( args->no_PLs )
+    {
+        args->pack_val = (uint64_t*) calloc((size_t)args->nsmpl*GT_PACK_NWORDS,sizeof(uint64_t));
+        args->pack_ref = (uint64_t*) calloc((size_t)args->nsmpl*GT_PACK_NWORDS,sizeof(uint64_t));
+        args->pack_alt = (uint64_t*) calloc((size_t)args->nsmpl*GT_PACK_NWORDS,sizeof(uint64_t));
+    }
+
     while ( bcf_sr_next_line(args->files) )
     {
         bcf1_t *line = bcf_sr_get_line(args->files,0);
@@ -630,10 +1041,11 @@ static void cross_check_gts(args_t *args)
         // use PLs unless no_PLs is set and GT exists
         if ( args->no_PLs )
         {
-            if ( process_GT(args,line,ntot,ndif)==0 ) continue;
+            if ( pack_GT(args,line,ntot,ndif)==0 ) continue;
         }
         process_PL(args,line,ntot,ndif);
     }
+    if ( args->no_PLs ) flush_packed_GTs(args,ntot,ndif);
     
     FILE *fp = stdout;
     print_header(args, fp);
@@ -695,6 +1107,9 @@ static void cross_check_gts(args_t *args)
     free(ndif);
     free(ntot);
     free(args->tmp_arr);
+    free(args->pack_val);
+    free(args->pack_ref);
+    free(args->pack_alt);
 }
 
 static char *init_prefix(char *prefix)
@@ -716,8 +1131,10 @@ static void usage(void)
     fprintf(stderr, "    -c, --cluster <min,max>         min inter- and max intra-sample error [0.23,-0.3]\n");
     fprintf(stderr, "    -g, --genotypes <file>          genotypes to compare against\n");
     fprintf(stderr, "    -G, --GTs-only <int>            use GTs, ignore PLs, using <int> for unseen genotypes [99]\n");
+    fprintf(stderr, "        --gt-cache <file>           build or reuse a memory-mapped cache of the -g genotypes\n");
     fprintf(stderr, "    -H, --homs-only                 homozygous genotypes only (useful for low coverage data)\n");
     fprintf(stderr, "    -p, --plot <prefix>             plot\n");
+    fprintf(stderr, "        --pair-threads <int>        number of threads to compare sample pairs in cross-check mode with -G [0]\n");
     fprintf(stderr, "    -r, --regions <region>          restrict to comma-separated list of regions\n");
     fprintf(stderr, "    -R, --regions-file <file>       restrict to regions listed in a file\n");
     fprintf(stderr, "    -s, --query-sample <string>     query sample (by default the first sample is checked)\n");
@@ -759,6 +1176,8 @@ int main_vcfgtcheck(int argc, char *argv[])
         {"regions-file",1,0,'R'},
         {"targets",1,0,'t'},
         {"targets-file",1,0,'T'},
+        {"pair-threads",1,0,1},
+        {"gt-cache",1,0,2},
         {0,0,0,0}
     };
     char *tmp;
@@ -787,6 +1206,11 @@ int main_vcfgtcheck(int argc, char *argv[])
             case 'R': regions = optarg; regions_is_file = 1; break;
             case 't': targets = optarg; break;
             case 'T': targets = optarg; targets_is_file = 1; break;
+            case  1 :
+                args->pair_threads = strtol(optarg,&tmp,10);
+                if ( *tmp || args->pair_threads<0 ) error("Could not parse argument: --pair-threads %s\n", optarg);
+                break;
+            case  2 : args->gtx_fname = optarg; break;
             case 'h':
             case '?': usage();
             default: error("Unknown argument: %s\n", optarg);
@@ -805,7 +1229,25 @@ int main_vcfgtcheck(int argc, char *argv[])
     if ( regions && bcf_sr_set_regions(args->files, regions, regions_is_file)<0 ) error("Failed to read the regions: %s\n", regions);
     if ( targets && bcf_sr_set_targets(args->files, targets, targets_is_file, 0)<0 ) error("Failed to read the targets: %s\n", targets);
     if ( !bcf_sr_add_reader(args->files, fname) ) error("Failed to open %s: %s\n", fname,bcf_sr_strerror(args->files->errnum));
-    if ( args->gt_fname && !bcf_sr_add_reader(args->files, args->gt_fname) ) error("Failed to open %s: %s\n", args->gt_fname,bcf_sr_strerror(args->files->errnum));
+    if ( args->gtx_fname )
+    {
+        if ( !args->gt_fname ) error("The --gt-cache option requires -g\n");
+        if ( args->all_sites ) error("The options --gt-cache and -a are mutually exclusive\n");
+
+        // only the header of the -g file is read, the genotypes come from the cache
+        htsFile *fp = hts_open(args->gt_fname, "r");
+        if ( !fp || !(args->gt_hdr = bcf_hdr_read(fp)) ) error("Failed to read %s\n", args->gt_fname);
+        hts_close(fp);
+        uint64_t nsmpl = bcf_hdr_nsamples(args->gt_hdr);
+        uint64_t stamp = cache_stamp_file(CACHE_STAMP_INIT, args->gt_fname);
+        stamp = cache_stamp(stamp, &nsmpl, sizeof(nsmpl));
+        if ( !gtx_load(args, stamp) )
+        {
+            gtx_build(args, stamp);
+            if ( !gtx_load(args, stamp) ) error("Failed to load %s\n", args->gtx_fname);
+        }
+    }
+    else if ( args->gt_fname && !bcf_sr_add_reader(args->files, args->gt_fname) ) error("Failed to open %s: %s\n", args->gt_fname,bcf_sr_strerror(args->files->errnum));
     args->files->collapse = COLLAPSE_SNPS|COLLAPSE_INDELS;
     if ( args->plot ) args->plot = init_prefix(args->plot);
     init_data(args);
@@ -814,6 +1256,11 @@ int main_vcfgtcheck(int argc, char *argv[])
     else
         check_gt(args);
     destroy_data(args);
+    if ( args->gtx )
+    {
+        gtx_destroy(args->gtx);
+        bcf_hdr_destroy(args->gt_hdr);
+    }
     bcf_sr_destroy(args->files);
     if (args->plot) free(args->plot);
     free(args);
@@ -24,18 +24,539 @@ DEALINGS IN THE SOFTWARE.  */
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <getopt.h>
+#include <zlib.h>
 #include <htslib/vcf.h>
 #include <htslib/tbx.h>
+#include <htslib/bgzf.h>
 #include <sys/stat.h>
 #define __STDC_FORMAT_MACROS
 #include <inttypes.h>
 #include <htslib/kstring.h>
+#include <htslib/khash_str2int.h>
 #include "bcftools.h"
+#include "profile.h"
+#include "batch.h"
 
 #define BCF_LIDX_SHIFT    14
 
+// The number of CSI levels needed to cover the longest contig, the same as bcf_index_build()
+static int bcf_idx_n_lvls(bcf_hdr_t *hdr, int min_shift)
+{
+    int i, n_lvls, nids = hdr->n[BCF_DT_CTG];
+    int64_t max_len = 0, s;
+    for (i=0; i<nids; i++)
+        if ( max_len < hdr->id[BCF_DT_CTG][i].val->info[0] ) max_len = hdr->id[BCF_DT_CTG][i].val->info[0];
+    max_len += 256;
+    for (n_lvls=0, s=1<<min_shift; max_len > s; ++n_lvls, s <<= 3);
+    return n_lvls;
+}
+
+// The aux data of tabix indexes: the configuration and NUL-terminated sequence names
+static void tbx_idx_set_meta(hts_idx_t *idx, kstring_t *names)
+{
+    uint32_t l_meta = 28 + names->l, l_nm = names->l;
+    uint8_t *meta = (uint8_t*) malloc(l_meta);
+    memcpy(meta, &tbx_conf_vcf, 24);
+    memcpy(meta + 24, &l_nm, 4);
+    if ( l_nm ) memcpy(meta + 28, names->s, l_nm);
+    hts_idx_set_meta(idx, l_meta, meta, 0);
+}
+
+struct _out_idx_t
+{
+    hts_idx_t *idx;
+    BGZF *fp;
+    char *fname;        // the data file, the index is written to fname.csi
+    int is_vcf;
+    int *rid2tid, ntid; // VCF: tids are assigned in the order of appearance, as tabix does
+    kstring_t names;    // VCF: NUL-terminated sequence names in the order of tids
+};
+
+out_idx_t *out_idx_init(htsFile *fh, bcf_hdr_t *hdr, const char *fname)
+{
+    if ( !strcmp(fname,"-") ) error("The --write-index option requires an output file name\n");
+    if ( fh->format.compression!=bgzf ) error("The --write-index option requires compressed output: %s\n", fname);
+    BGZF *fp = hts_get_bgzfp(fh);
+    if ( fp->mt ) error("The --write-index option cannot be combined with --threads\n");
+
+    out_idx_t *oi = (out_idx_t*) calloc(1,sizeof(out_idx_t));
+    oi->fp = fp;
+    oi->fname = strdup(fname);
+    oi->is_vcf = fh->format.format==vcf || fh->format.format==text_format ? 1 : 0;
+
+    int i, n_lvls, nids = hdr->n[BCF_DT_CTG];
+    if ( oi->is_vcf )
+    {
+        oi->rid2tid = (int*) malloc(sizeof(int)*nids);
+        for (i=0; i<nids; i++) oi->rid2tid[i] = -1;
+        n_lvls = (TBX_MAX_SHIFT - BCF_LIDX_SHIFT + 2) / 3;
+    }
+    else
+        n_lvls = bcf_idx_n_lvls(hdr, BCF_LIDX_SHIFT);
+    oi->idx = hts_idx_init(oi->is_vcf ? 0 : nids, HTS_FMT_CSI, bgzf_tell(fp), BCF_LIDX_SHIFT, n_lvls);
+    if ( !oi->idx ) error("Failed to initialize the index for %s\n", fname);
+    return oi;
+}
+
+int out_idx_write(out_idx_t *oi, htsFile *fh, bcf_hdr_t *hdr, bcf1_t *rec)
+{
+    uint64_t t0 = profile_begin();
+    int ret = bcf_write(fh, hdr, rec);
+    profile_end_bytes(PROF_WRITE, t0, profile_rec_size(rec));
+    if ( ret<0 || !oi ) return ret;
+
+    int tid = rec->rid;
+    if ( oi->is_vcf )
+    {
+        if ( oi->rid2tid[tid]<0 )
+        {
+            oi->rid2tid[tid] = oi->ntid++;
+            kputs(bcf_hdr_id2name(hdr,rec->rid), &oi->names);
+            kputc(0, &oi->names);
+        }
+        tid = oi->rid2tid[tid];
+    }
+    if ( hts_idx_push(oi->idx, tid, rec->pos, rec->pos + rec->rlen, bgzf_tell(oi->fp), 1) < 0 )
+        error("Failed to index %s at %s:%d, is the output sorted?\n", oi->fname,bcf_seqname(hdr,rec),rec->pos+1);
+    return ret;
+}
+
+int out_idx_close(out_idx_t *oi, htsFile *fh)
+{
+    if ( !oi ) return hts_close(fh);
+
+    if ( bgzf_flush(oi->fp) < 0 ) error("Failed to write %s\n", oi->fname);
+    hts_idx_finish(oi->idx, bgzf_tell(oi->fp));
+    if ( oi->is_vcf ) tbx_idx_set_meta(oi->idx, &oi->names);
+    // close first so that the index is not older than the data file
+    int ret = hts_close(fh);
+    if ( hts_idx_save(oi->idx, oi->fname, HTS_FMT_CSI) < 0 ) error("Failed to write the index %s.csi\n", oi->fname);
+
+    hts_idx_destroy(oi->idx);
+    free(oi->rid2tid);
+    free(oi->names.s);
+    free(oi->fname);
+    free(oi);
+    return ret;
+}
+
+/*
+    Parallel index build (--threads). The main thread reads raw BGZF blocks in
+    batches, the workers inflate them and, for VCF, parse CHROM, POS, REF and
+    INFO/END of the complete lines, on the workers of a batch pool. The records
+    are added to the index by the main thread in file order, which only needs
+    to stitch the records crossing batch boundaries and walk the BCF record
+    lengths. The result is the same index as created by bcf_index_build3().
+*/
+#define IDX_BATCH_BLOCKS    64
+
+typedef struct
+{
+    int beg, end;
+    uint32_t name, nname;   // VCF: the sequence name in udata, nname=0 for header lines
+    uint32_t uend;          // uncompressed offset of the line end within the batch
+}
+idx_rec_t;
+
+typedef struct
+{
+    uint8_t *cdata, *udata;     // compressed blocks and their inflated data
+    size_t ncdata, mcdata, mudata;
+    uint64_t *coff, next_coff;  // compressed offsets of the blocks and of the block following the batch
+    uint32_t *ustart;           // start of each block in udata, nblock+1 values
+    int nblock, mblock;
+    idx_rec_t *rec;             // VCF: complete lines
+    int nrec, mrec;
+    uint32_t head, tail;        // VCF: udata[0,head) ends the line started in previous batches, udata[tail,..) starts a line
+}
+idx_batch_t;
+
+typedef struct
+{
+    int is_vcf;
+    const char *fname;
+
+    // the state of the main thread
+    int nadded;                 // the number of batches added to the index
+    uint32_t skip;              // BCF: the header bytes in the first batch
+    hts_idx_t *idx;
+    int fmt, min_shift, n_lvls;
+    uint64_t last_off;          // VCF: the offset after the last header line before the first record
+    kstring_t carry;            // the incomplete record from previous batches
+    void *name2tid;             // VCF: tids assigned in the order of appearance, as tabix does
+    kstring_t names, prev_name;
+    int ntid, prev_tid;
+}
+idx_pipeline_t;
+
+typedef struct
+{
+    idx_pipeline_t *pl;
+    z_stream zs;
+}
+idx_worker_t;
+
+static inline uint32_t le_u32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1]<<8 | (uint32_t)p[2]<<16 | (uint32_t)p[3]<<24;
+}
+
+// Read up to IDX_BATCH_BLOCKS raw BGZF blocks, returns 0 at the end of the file
+static int idx_read_batch(FILE *fp, const char *fname, uint64_t *coff, idx_batch_t *batch)
+{
+    batch->nblock = 0;
+    batch->ncdata = 0;
+    while ( batch->nblock < IDX_BATCH_BLOCKS )
+    {
+        hts_expand(uint8_t, batch->ncdata + 18, batch->mcdata, batch->cdata);
+        uint8_t *hdr = batch->cdata + batch->ncdata;
+        size_t n = fread(hdr, 1, 18, fp);
+        if ( !n ) break;
+        if ( n!=18 || hdr[0]!=31 || hdr[1]!=139 || hdr[2]!=8 || !(hdr[3]&4) || hdr[10]!=6 || hdr[11]!=0
+                || hdr[12]!='B' || hdr[13]!='C' || hdr[14]!=2 || hdr[15]!=0 )
+            error("Not a BGZF file or corrupted: %s\n", fname);
+        size_t bsize = (hdr[16] | hdr[17]<<8) + 1;
+        if ( bsize < 26 ) error("Corrupted BGZF block in %s at %"PRIu64"\n", fname, *coff);
+        hts_expand(uint8_t, batch->ncdata + bsize, batch->mcdata, batch->cdata);
+        if ( fread(batch->cdata + batch->ncdata + 18, 1, bsize - 18, fp) != bsize - 18 )
+            error("Truncated BGZF block in %s at %"PRIu64"\n", fname, *coff);
+
+        if ( batch->nblock + 1 >= batch->mblock )
+        {
+            batch->mblock = batch->nblock + 2;
+            batch->coff   = (uint64_t*) realloc(batch->coff, sizeof(uint64_t)*batch->mblock);
+            batch->ustart = (uint32_t*) realloc(batch->ustart, sizeof(uint32_t)*batch->mblock);
+        }
+        if ( !batch->nblock ) batch->ustart[0] = 0;
+        batch->coff[batch->nblock] = *coff;
+        batch->ustart[batch->nblock+1] = batch->ustart[batch->nblock] + le_u32(batch->cdata + batch->ncdata + bsize - 4);
+        batch->nblock++;
+        batch->ncdata += bsize;
+        *coff += bsize;
+    }
+    if ( ferror(fp) ) error("Failed to read %s\n", fname);
+    batch->next_coff = *coff;
+    return batch->nblock;
+}
+
+// Parse the interval of a VCF line the way tabix does, nname=0 for header lines
+static int idx_parse_vcf(char *line, uint32_t off, idx_rec_t *rec)
+{
+    rec->name = off;
+    rec->nname = 0;
+    rec->beg = rec->end = 0;
+    if ( line[0]=='#' ) return 0;
+
+    int id = 0, b = 0, i;
+    char *s;
+    rec->beg = -1;
+    for (i=0; id<8; i++)
+    {
+        if ( line[i]!='\t' && line[i] ) continue;
+        if ( id==0 ) rec->nname = i;
+        else if ( id==1 )
+        {
+            rec->beg = strtol(line+b, &s, 0) - 1;
+            if ( rec->beg < 0 ) rec->beg = 0;
+            rec->end = rec->beg + 1;
+        }
+        else if ( id==3 )
+        {
+            if ( b < i ) rec->end = rec->beg + (i - b);
+        }
+        else if ( id==7 )
+        {
+            int c = line[i];
+            line[i] = 0;
+            s = strstr(line + b, "END=");
+            if ( s==line + b ) s += 4;
+            else if ( s )
+            {
+                s = strstr(line + b, ";END=");
+                if ( s ) s += 5;
+            }
+            if ( s ) rec->end = strtol(s, &s, 0);
+            line[i] = c;
+        }
+        b = i + 1;
+        id++;
+        if ( !line[i] ) break;
+    }
+    if ( !rec->nname || rec->beg < 0 ) return -1;
+    return 0;
+}
+
+static void idx_parse_batch(idx_batch_t *batch)
+{
+    char *beg = (char*) batch->udata, *end = beg + batch->ustart[batch->nblock];
+    char *nl = (char*) memchr(beg, '\n', end - beg);
+    batch->nrec = 0;
+    batch->head = batch->tail = nl ? nl - beg + 1 : 0;
+    if ( !nl ) return;
+
+    char *line = nl + 1;
+    while ( line < end && (nl = (char*) memchr(line, '\n', end - line)) )
+    {
+        *nl = 0;
+        hts_expand(idx_rec_t, batch->nrec+1, batch->mrec, batch->rec);
+        idx_rec_t *rec = &batch->rec[batch->nrec++];
+        if ( idx_parse_vcf(line, line - beg, rec) < 0 ) rec->beg = -1;
+        rec->uend = nl - beg + 1;
+        line = nl + 1;
+    }
+    batch->tail = line - beg;
+}
+
+static void idx_pipeline_work(void *worker, void *data)
+{
+    idx_worker_t *wrk = (idx_worker_t*) worker;
+    idx_batch_t *batch = (idx_batch_t*) data;
+    z_stream *zs = &wrk->zs;
+
+    hts_expand(uint8_t, batch->ustart[batch->nblock] + 1, batch->mudata, batch->udata);
+    int i;
+    for (i=0; i<batch->nblock; i++)
+    {
+        uint8_t *blk = batch->cdata + (batch->coff[i] - batch->coff[0]);
+        size_t bsize = (i+1 < batch->nblock ? batch->coff[i+1] : batch->next_coff) - batch->coff[i];
+        uint32_t len = batch->ustart[i+1] - batch->ustart[i];
+        if ( inflateReset(zs) != Z_OK ) error("inflateReset failed\n");
+        zs->next_in   = blk + 18;
+        zs->avail_in  = bsize - 26;
+        zs->next_out  = batch->udata + batch->ustart[i];
+        zs->avail_out = len;
+        if ( inflate(zs, Z_FINISH) != Z_STREAM_END || zs->avail_out )
+            error("Failed to decompress the BGZF block at %"PRIu64" in %s\n", batch->coff[i], wrk->pl->fname);
+    }
+    if ( wrk->pl->is_vcf ) idx_parse_batch(batch);
+}
+
+// The virtual offset of a record ending at udata[uend-1]. Like bgzf_tell(), point
+// to the next block when the block is exhausted
+static uint64_t idx_voffset(idx_batch_t *batch, uint32_t uend)
+{
+    int lo = 0, hi = batch->nblock - 1;
+    while ( lo < hi )
+    {
+        int mid = (lo + hi + 1) / 2;
+        if ( batch->ustart[mid] < uend ) lo = mid;
+        else hi = mid - 1;
+    }
+    if ( uend == batch->ustart[lo+1] )
+        return (lo+1 < batch->nblock ? batch->coff[lo+1] : batch->next_coff) << 16;
+    return batch->coff[lo] << 16 | (uend - batch->ustart[lo]);
+}
+
+static void idx_push(idx_pipeline_t *pl, int tid, int beg, int end, uint64_t voff)
+{
+    if ( !pl->idx )
+    {
+        pl->idx = hts_idx_init(0, pl->fmt, pl->last_off, pl->min_shift, pl->n_lvls);
+        if ( !pl->idx ) error("Failed to initialize the index for %s\n", pl->fname);
+    }
+    if ( hts_idx_push(pl->idx, tid, beg, end, voff, 1) < 0 )
+        error("Failed to index %s, is the file sorted?\n", pl->fname);
+}
+
+static void idx_push_vcf(idx_pipeline_t *pl, const char *line, idx_rec_t *rec, uint64_t voff)
+{
+    if ( rec->beg < 0 ) error("Failed to parse the line in %s: %s\n", pl->fname, line);
+    if ( !rec->nname )
+    {
+        if ( !pl->idx ) pl->last_off = voff;
+        return;
+    }
+    const char *name = line;
+    if ( rec->nname!=pl->prev_name.l || memcmp(name, pl->prev_name.s, rec->nname) )
+    {
+        pl->prev_name.l = 0;
+        kputsn(name, rec->nname, &pl->prev_name);
+        if ( khash_str2int_get(pl->name2tid, pl->prev_name.s, &pl->prev_tid) < 0 )
+        {
+            pl->prev_tid = pl->ntid++;
+            khash_str2int_set(pl->name2tid, strdup(pl->prev_name.s), pl->prev_tid);
+            kputsn(pl->prev_name.s, pl->prev_name.l + 1, &pl->names);
+        }
+    }
+    idx_push(pl, pl->prev_tid, rec->beg, rec->end, voff);
+}
+
+static void idx_push_bcf(idx_pipeline_t *pl, const uint8_t *rec, uint64_t voff)
+{
+    int32_t pos = le_u32(rec + 12);
+    idx_push(pl, le_u32(rec + 8), pos, pos + (int32_t)le_u32(rec + 16), voff);
+}
+
+static inline size_t idx_bcf_len(idx_pipeline_t *pl, const uint8_t *rec)
+{
+    uint32_t l_shared = le_u32(rec);
+    if ( l_shared < 24 ) error("Corrupted BCF record in %s\n", pl->fname);
+    return 8 + (size_t)l_shared + le_u32(rec + 4);
+}
+
+static void idx_add_batch(idx_pipeline_t *pl, idx_batch_t *batch, uint32_t skip)
+{
+    uint8_t *udata = batch->udata;
+    uint32_t i, n = batch->ustart[batch->nblock];
+    if ( pl->is_vcf )
+    {
+        if ( !batch->head )
+        {
+            kputsn((char*)udata, n, &pl->carry);
+            return;
+        }
+        kputsn((char*)udata, batch->head - 1, &pl->carry);
+        idx_rec_t rec;
+        if ( idx_parse_vcf(pl->carry.s, 0, &rec) < 0 ) rec.beg = -1;
+        idx_push_vcf(pl, pl->carry.s, &rec, idx_voffset(batch, batch->head));
+        for (i=0; i<batch->nrec; i++)
+            idx_push_vcf(pl, (char*)udata + batch->rec[i].name, &batch->rec[i], idx_voffset(batch, batch->rec[i].uend));
+        pl->carry.l = 0;
+        kputsn((char*)udata + batch->tail, n - batch->tail, &pl->carry);
+        return;
+    }
+
+    // BCF: first complete the record started in previous batches
+    i = skip;
+    while ( pl->carry.l && i < n )
+    {
+        size_t need = pl->carry.l < 8 ? 8 : idx_bcf_len(pl, (uint8_t*)pl->carry.s);
+        size_t len  = need - pl->carry.l < n - i ? need - pl->carry.l : n - i;
+        kputsn((char*)udata + i, len, &pl->carry);
+        i += len;
+        if ( pl->carry.l==need && need > 8 )
+        {
+            idx_push_bcf(pl, (uint8_t*)pl->carry.s, idx_voffset(batch, i));
+            pl->carry.l = 0;
+        }
+    }
+    while ( i + 8 <= n )
+    {
+        size_t len = idx_bcf_len(pl, udata + i);
+        if ( i + len > n ) break;
+        idx_push_bcf(pl, udata + i, idx_voffset(batch, i + len));
+        i += len;
+    }
+    if ( i < n ) kputsn((char*)udata + i, n - i, &pl->carry);
+}
+
+// Add the inflated batches to the index in the file order
+static void idx_pipeline_write(void *data, void *batch)
+{
+    idx_pipeline_t *pl = (idx_pipeline_t*) data;
+    idx_add_batch(pl, (idx_batch_t*) batch, pl->nadded++ ? 0 : pl->skip);
+}
+
+static int idx_build_threaded(const char *fname, const char *idx_fname, int min_shift, int n_threads)
+{
+    htsFile *fp = hts_open(fname, "r");
+    if ( !fp ) return -2;
+    const htsFormat *fmt = hts_get_format(fp);
+    if ( fmt->compression!=bgzf || (fmt->format!=vcf && fmt->format!=bcf) ) { hts_close(fp); return -3; }
+
+    idx_pipeline_t pl;
+    memset(&pl, 0, sizeof(pl));
+    pl.fname  = fname;
+    pl.is_vcf = fmt->format==vcf ? 1 : 0;
+    uint64_t voff0 = 0;
+    if ( pl.is_vcf )
+    {
+        // the same as tbx_index()
+        if ( min_shift > 0 ) pl.fmt = HTS_FMT_CSI, pl.min_shift = min_shift, pl.n_lvls = (TBX_MAX_SHIFT - min_shift + 2) / 3;
+        else pl.fmt = HTS_FMT_TBI, pl.min_shift = 14, pl.n_lvls = 5;
+        pl.name2tid = khash_str2int_init();
+        pl.prev_tid = -1;
+    }
+    else
+    {
+        if ( min_shift <= 0 ) { hts_close(fp); error("TBI indices for BCF files are not supported\n"); }
+        bcf_hdr_t *hdr = bcf_hdr_read(fp);
+        if ( !hdr ) { hts_close(fp); return -1; }
+        pl.fmt = HTS_FMT_CSI;
+        pl.min_shift = min_shift;
+        pl.n_lvls = bcf_idx_n_lvls(hdr, min_shift);
+        voff0 = bgzf_tell(hts_get_bgzfp(fp));
+        pl.idx = hts_idx_init(hdr->n[BCF_DT_CTG], HTS_FMT_CSI, voff0, pl.min_shift, pl.n_lvls);
+        if ( !pl.idx ) error("Failed to initialize the index for %s\n", fname);
+        bcf_hdr_destroy(hdr);
+    }
+    hts_close(fp);
+
+    FILE *raw = fopen(fname, "rb");
+    if ( !raw ) return -2;
+    uint64_t coff = voff0 >> 16;
+    if ( coff && fseeko(raw, coff, SEEK_SET) < 0 ) error("Failed to seek in %s\n", fname);
+    pl.skip = voff0 & 0xffff;
+
+    int i, nbatch = 2*n_threads;
+    idx_batch_t *batch = (idx_batch_t*) calloc(nbatch, sizeof(idx_batch_t));
+    void **batches = (void**) malloc(sizeof(void*)*nbatch);
+    for (i=0; i<nbatch; i++) batches[i] = &batch[i];
+    idx_worker_t *wrk = (idx_worker_t*) calloc(n_threads, sizeof(idx_worker_t));
+    void **workers = (void**) malloc(sizeof(void*)*n_threads);
+    for (i=0; i<n_threads; i++)
+    {
+        wrk[i].pl = &pl;
+        if ( inflateInit2(&wrk[i].zs, -15) != Z_OK ) error("inflateInit2 failed\n");
+        workers[i] = &wrk[i];
+    }
+
+    // the final offset as reported by bgzf_tell() at the end of the file
+    uint64_t final_off = coff << 16;
+    batch_pool_t *pool = batch_pool_init(n_threads, workers, batches, nbatch, idx_pipeline_work, idx_pipeline_write, &pl);
+    while ( 1 )
+    {
+        idx_batch_t *bt = (idx_batch_t*) batch_pool_get(pool);
+        if ( !idx_read_batch(raw, fname, &coff, bt) ) break;
+        int last = bt->nblock - 1;
+        final_off = (bt->ustart[last+1]==bt->ustart[last] ? bt->coff[last] : coff) << 16;
+        batch_pool_submit(pool);
+    }
+    batch_pool_destroy(pool);
+    for (i=0; i<n_threads; i++) inflateEnd(&wrk[i].zs);
+    fclose(raw);
+
+    if ( pl.carry.l )
+    {
+        // a truncated BCF record or a VCF line without the trailing newline
+        if ( !pl.is_vcf ) error("Truncated BCF record in %s\n", fname);
+        idx_rec_t rec;
+        kputc(0, &pl.carry); pl.carry.l--;
+        if ( idx_parse_vcf(pl.carry.s, 0, &rec) < 0 ) rec.beg = -1;
+        idx_push_vcf(&pl, pl.carry.s, &rec, final_off);
+    }
+    if ( !pl.idx )
+    {
+        pl.idx = hts_idx_init(0, pl.fmt, pl.last_off, pl.min_shift, pl.n_lvls);
+        if ( !pl.idx ) error("Failed to initialize the index for %s\n", fname);
+    }
+    hts_idx_finish(pl.idx, final_off);
+    if ( pl.is_vcf ) tbx_idx_set_meta(pl.idx, &pl.names);
+    int ret = hts_idx_save_as(pl.idx, fname, idx_fname, pl.fmt);
+
+    hts_idx_destroy(pl.idx);
+    for (i=0; i<nbatch; i++)
+    {
+        free(batch[i].cdata);
+        free(batch[i].udata);
+        free(batch[i].coff);
+        free(batch[i].ustart);
+        free(batch[i].rec);
+    }
+    free(batch);
+    free(batches);
+    free(wrk);
+    free(workers);
+    free(pl.carry.s);
+    free(pl.names.s);
+    free(pl.prev_name.s);
+    if ( pl.name2tid ) khash_str2int_destroy_free(pl.name2tid);
+    return ret < 0 ? -1 : 0;
+}
+
 static void usage(void)
 {
     fprintf(stderr, "\n");
@@ -48,11 +569,13 @@ static void usage(void)
     fprintf(stderr, "    -m, --min-shift INT      set minimal interval size for CSI indices to 2^INT [14]\n");
     fprintf(stderr, "    -o, --output-file FILE   optional output index file name\n");
     fprintf(stderr, "    -t, --tbi                generate TBI-format index for VCF files\n");
-    fprintf(stderr, "        --threads            sets the number of threads [0]\n");
+    fprintf(stderr, "        --threads INT        number of threads decompressing and parsing the input in parallel [0]\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "Stats options:\n");
     fprintf(stderr, "    -n, --nrecords       print number of records based on existing index file\n");
     fprintf(stderr, "    -s, --stats          print per contig stats based on existing index file\n");
+    fprintf(stderr, "        --chunks INT     print INT regions of balanced compressed size based on existing index file\n");
+    fprintf(stderr, "        --snap           move the boundaries of --chunks so that no record overlaps two chunks\n");
     fprintf(stderr, "\n");
     exit(1);
 }
@@ -120,9 +643,271 @@ int vcf_index_stats(char *fname, int stats)
     return 0;
 }
 
+/*
+ *  The --chunks planner. The cumulative compressed size of the file is sampled
+ *  along each contig, up to its length in the header, at the resolution of
+ *  the linear index by querying the index for single positions. Only at the
+ *  start of a region without records is a record read, to skip to the window
+ *  of the next one. The first chunk whose end is beyond the previous sample
+ *  is taken, so that chunks of long records from the top-level bins do not
+ *  hold the estimate back. The file is then cut into chunks of roughly the
+ *  same number of compressed bytes; the chunks are printed one per line as
+ *  comma-separated lists of regions.
+ */
+#define CHUNK_STEP (1<<BCF_LIDX_SHIFT)
+
+typedef struct
+{
+    int tid, pos;
+    uint64_t off;   // the virtual offset of the first record at or after pos
+}
+chunk_probe_t;
+
+typedef struct
+{
+    int tid, beg, end;  // probes [beg,end)
+    uint64_t off;       // the offset of the first probe
+}
+chunk_ctg_t;
+
+typedef struct
+{
+    htsFile *fp;
+    bcf_hdr_t *hdr;
+    tbx_t *tbx;
+    hts_idx_t *idx;
+    bcf1_t *rec;
+    kstring_t str;
+}
+chunk_args_t;
+
+static int chunk_probe(hts_idx_t *idx, int tid, int beg, int end, uint64_t prev, uint64_t *off)
+{
+    hts_itr_t *itr = hts_itr_query(idx, tid, beg, end, NULL);
+    if ( !itr ) return 0;
+    int i, ret = 0;
+    for (i=0; i<itr->n_off; i++)
+    {
+        if ( itr->off[i].v <= prev ) continue;  // the offsets are sorted by the beginning
+        *off = itr->off[i].u > prev ? itr->off[i].u : prev;
+        ret = 1;
+        break;
+    }
+    hts_itr_destroy(itr);
+    return ret;
+}
+
+static int cmp_chunk_ctg(const void *aptr, const void *bptr)
+{
+    uint64_t a = ((chunk_ctg_t*)aptr)->off, b = ((chunk_ctg_t*)bptr)->off;
+    if ( a < b ) return -1;
+    return a > b ? 1 : 0;
+}
+
+// The 0-based position of the first record starting at or after pos, -1 if there is none
+static int chunk_next_pos(chunk_args_t *args, int tid, int pos)
+{
+    hts_itr_t *itr = args->tbx ? tbx_itr_queryi(args->tbx, tid, pos, INT32_MAX) : bcf_itr_queryi(args->idx, tid, pos, INT32_MAX);
+    if ( !itr ) return -1;
+    int next = -1;
+    while (1)
+    {
+        if ( args->tbx )
+        {
+            if ( tbx_itr_next(args->fp, args->tbx, itr, &args->str) < 0 ) break;
+            if ( vcf_parse(&args->str, args->hdr, args->rec) < 0 ) error("Could not parse the line: %s\n", args->str.s);
+        }
+        else if ( bcf_itr_next(args->fp, itr, args->rec) < 0 ) break;
+        if ( args->rec->pos < pos ) continue;    // a record overlapping pos from the left
+        next = args->rec->pos;
+        break;
+    }
+    hts_itr_destroy(itr);
+    return next;
+}
+
+// The length of the contig from the header, INT32_MAX if not given
+static int chunk_ctg_len(chunk_args_t *args, const char *chr)
+{
+    int id = bcf_hdr_name2id(args->hdr, chr);
+    if ( id<0 || !args->hdr->id[BCF_DT_CTG][id].val || args->hdr->id[BCF_DT_CTG][id].val->info[0] <= 0 ) return INT32_MAX;
+    return args->hdr->id[BCF_DT_CTG][id].val->info[0];
+}
+
+// Move the 0-based start of a chunk past the records which would overlap it
+static int chunk_snap(chunk_args_t *args, int tid, int pos)
+{
+    int changed = 1;
+    while ( changed )
+    {
+        changed = 0;
+        hts_itr_t *itr = args->tbx ? tbx_itr_queryi(args->tbx, tid, pos, pos+1) : bcf_itr_queryi(args->idx, tid, pos, pos+1);
+        if ( !itr ) break;
+        while (1)
+        {
+            if ( args->tbx )
+            {
+                if ( tbx_itr_next(args->fp, args->tbx, itr, &args->str) < 0 ) break;
+                if ( vcf_parse(&args->str, args->hdr, args->rec) < 0 ) error("Could not parse the line: %s\n", args->str.s);
+            }
+            else if ( bcf_itr_next(args->fp, itr, args->rec) < 0 ) break;
+            if ( args->rec->pos < pos && args->rec->pos + args->rec->rlen > pos )
+            {
+                pos = args->rec->pos + args->rec->rlen;
+                changed = 1;
+            }
+        }
+        hts_itr_destroy(itr);
+    }
+    return pos;
+}
+
+static void chunk_region(kstring_t *str, const char *chr, int beg, int end)
+{
+    if ( str->l ) kputc(',', str);
+    kputs(chr, str);
+    if ( beg==0 && end<0 ) return;
+    if ( end<0 ) ksprintf(str, ":%d-", beg+1);
+    else ksprintf(str, ":%d-%d", beg+1, end);
+}
+
+int vcf_index_chunks(char *fname, int nchunks, int snap)
+{
+    chunk_args_t args;
+    memset(&args, 0, sizeof(args));
+    args.fp = hts_open(fname,"r");
+    if ( !args.fp ) { fprintf(stderr,"Could not read %s\n", fname); return 1; }
+    args.hdr = bcf_hdr_read(args.fp);
+    if ( !args.hdr ) { fprintf(stderr,"Could not read the header: %s\n", fname); return 1; }
+    if ( hts_get_format(args.fp)->format==vcf )
+    {
+        args.tbx = tbx_index_load(fname);
+        if ( !args.tbx ) { fprintf(stderr,"Could not load index for VCF: %s\n", fname); return 1; }
+    }
+    else if ( hts_get_format(args.fp)->format==bcf )
+    {
+        args.idx = bcf_index_load(fname);
+        if ( !args.idx ) { fprintf(stderr,"Could not load index for BCF file: %s\n", fname); return 1; }
+    }
+    else
+    {
+        fprintf(stderr,"Could not detect the file type as VCF or BCF: %s\n", fname);
+        return 1;
+    }
+    hts_idx_t *idx = args.tbx ? args.tbx->idx : args.idx;
+
+    int i, j, nseq;
+    const char **seq = NULL;
+    if ( args.tbx ) seq = tbx_seqnames(args.tbx, &nseq);
+    else nseq = args.hdr->n[BCF_DT_CTG];
+
+    int nprobes = 0, mprobes = 0, nctg = 0;
+    chunk_probe_t *probes = NULL;
+    chunk_ctg_t *ctg = (chunk_ctg_t*) malloc(sizeof(chunk_ctg_t)*(nseq+1));
+    args.rec = bcf_init();
+    for (i=0; i<nseq; i++)
+    {
+        uint64_t off, prev = 0;
+        int pos, beg = nprobes;
+        int len = chunk_ctg_len(&args, args.tbx ? seq[i] : bcf_hdr_id2name(args.hdr, i));
+        for (pos=0; pos<len && pos>=0; pos+=CHUNK_STEP)
+        {
+            if ( !chunk_probe(idx, i, pos, pos+1, prev, &off) )
+            {
+                // a region without records: jump to the window of the next record,
+                // or stop at the end of the contig
+                int next = chunk_next_pos(&args, i, pos);
+                if ( next<0 ) break;
+                next -= next % CHUNK_STEP;
+                if ( next > pos ) pos = next - CHUNK_STEP;
+                continue;
+            }
+            hts_expand(chunk_probe_t, nprobes+1, mprobes, probes);
+            probes[nprobes].tid = i;
+            probes[nprobes].pos = pos;
+            probes[nprobes].off = off;
+            nprobes++;
+            prev = off;
+        }
+        if ( nprobes==beg ) continue;
+        ctg[nctg].tid = i;
+        ctg[nctg].beg = beg;
+        ctg[nctg].end = nprobes;
+        ctg[nctg].off = probes[beg].off;
+        nctg++;
+    }
+    if ( !nctg ) { fprintf(stderr,"No records in the index of %s\n", fname); return 1; }
+
+    // the contigs in the order of the file, which need not be the order of the header
+    qsort(ctg, nctg, sizeof(*ctg), cmp_chunk_ctg);
+    struct stat st;
+    if ( stat(fname, &st)!=0 ) { fprintf(stderr,"Could not stat %s\n", fname); return 1; }
+    uint64_t file_end = (uint64_t)st.st_size;
+
+    // the compressed bytes from each probe to the next
+    uint64_t total = 0, *nbytes = (uint64_t*) malloc(sizeof(uint64_t)*nprobes);
+    for (i=0; i<nctg; i++)
+        for (j=ctg[i].beg; j<ctg[i].end; j++)
+        {
+            uint64_t next = j+1<ctg[i].end ? probes[j+1].off>>16 : (i+1<nctg ? probes[ctg[i+1].beg].off>>16 : file_end);
+            uint64_t cur  = probes[j].off>>16;
+            nbytes[j] = next > cur ? next - cur : 0;
+            total += nbytes[j];
+        }
+
+    kstring_t str = {0,0,0};
+    uint64_t done = 0, chunk_bytes = 0;   // the bytes of the printed chunks and of the current one
+    int ichunk = 0;
+    for (i=0; i<nctg; i++)
+    {
+        int tid = ctg[i].tid, beg = 0;
+        const char *chr = args.tbx ? seq[tid] : bcf_hdr_id2name(args.hdr, tid);
+        for (j=ctg[i].beg; j<ctg[i].end; j++)
+        {
+            chunk_bytes += nbytes[j];
+            if ( ichunk+1 >= nchunks || chunk_bytes < (double)(total - done)/(nchunks - ichunk) ) continue;
+            if ( j+1 == ctg[i].end ) break;     // cut at the end of the contig
+
+            int pos = probes[j+1].pos;
+            if ( snap ) pos = chunk_snap(&args, tid, pos);
+            if ( pos <= beg ) continue;
+            chunk_region(&str, chr, beg, pos);
+            printf("%s\t%"PRIu64"\n", str.s, chunk_bytes);
+            str.l = 0;
+            done += chunk_bytes;
+            chunk_bytes = 0;
+            beg = pos;
+            ichunk++;
+        }
+        chunk_region(&str, chr, beg, -1);
+        if ( ichunk+1 < nchunks && chunk_bytes >= (double)(total - done)/(nchunks - ichunk) )
+        {
+            printf("%s\t%"PRIu64"\n", str.s, chunk_bytes);
+            str.l = 0;
+            done += chunk_bytes;
+            chunk_bytes = 0;
+            ichunk++;
+        }
+    }
+    if ( str.l ) printf("%s\t%"PRIu64"\n", str.s, chunk_bytes);
+
+    free(str.s);
+    free(args.str.s);
+    bcf_destroy(args.rec);
+    free(nbytes);
+    free(probes);
+    free(ctg);
+    free(seq);
+    hts_close(args.fp);
+    bcf_hdr_destroy(args.hdr);
+    if ( args.tbx ) tbx_destroy(args.tbx);
+    if ( args.idx ) hts_idx_destroy(args.idx);
+    return 0;
+}
+
 int main_vcfindex(int argc, char *argv[])
 {
-    int c, force = 0, tbi = 0, stats = 0, n_threads = 0;
+    int c, force = 0, tbi = 0, stats = 0, n_threads = 0, nchunks = 0, snap = 0;
     int min_shift = BCF_LIDX_SHIFT;
     char *outfn = NULL;
 
@@ -135,6 +920,8 @@ int main_vcfindex(int argc, char *argv[])
         {"stats",no_argument,NULL,'s'},
         {"nrecords",no_argument,NULL,'n'},
         {"threads",required_argument,NULL,9},
+        {"chunks",required_argument,NULL,10},
+        {"snap",no_argument,NULL,11},
         {"output-file",required_argument,NULL,'o'},
         {NULL, 0, NULL, 0}
     };
@@ -157,6 +944,11 @@ int main_vcfindex(int argc, char *argv[])
                 n_threads = strtol(optarg,&tmp,10);
                 if ( *tmp ) error("Could not parse argument: --threads %s\n", optarg);
                 break;
+            case 10:
+                nchunks = strtol(optarg,&tmp,10);
+                if ( *tmp || nchunks<=0 ) error("Could not parse argument: --chunks %s\n", optarg);
+                break;
+            case 11: snap = 1; break;
             case 'o': outfn = optarg; break;
             default: usage();
         }
@@ -185,6 +977,11 @@ int main_vcfindex(int argc, char *argv[])
     }
     else fname = argv[optind];
     if (stats) return vcf_index_stats(fname, stats);
+    if (nchunks)
+    {
+        if (!strcmp(fname, "-")) { fprintf(stderr, "[E::%s] the --chunks option requires an indexed file\n", __func__); return 1; }
+        return vcf_index_chunks(fname, nchunks, snap);
+    }
 
     kstring_t idx_fname = {0,0,0};
     if (outfn)
@@ -210,7 +1007,11 @@ int main_vcfindex(int argc, char *argv[])
         }
     }
 
-    int ret = bcf_index_build3(fname, idx_fname.s, min_shift, n_threads);
+    int ret;
+    if ( n_threads > 0 && strcmp(fname,"-") )
+        ret = idx_build_threaded(fname, idx_fname.s, min_shift, n_threads);
+    else
+        ret = bcf_index_build3(fname, idx_fname.s, min_shift, n_threads);
     free(idx_fname.s);
     if (ret != 0) {
         if (ret == -2)
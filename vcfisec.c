@@ -28,13 +28,19 @@ THE SOFTWARE.  */
 #include <ctype.h>
 #include <string.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <htslib/vcf.h>
 #include <htslib/synced_bcf_reader.h>
 #include <htslib/vcfutils.h>
+#include <htslib/bgzf.h>
+#include <htslib/tbx.h>
+#include <htslib/khash_str2int.h>
 #include "bcftools.h"
 #include "filter.h"
+#include "kheap.h"
+#include "prefetch.h"
 
 #define OP_PLUS 1
 #define OP_MINUS 2
@@ -47,6 +53,40 @@ THE SOFTWARE.  */
 #define FLT_INCLUDE 1
 #define FLT_EXCLUDE 2
 
+// The k-way merge is used instead of the synced reader from this many files
+#define MERGE_MIN_FILES 3
+
+// One input file of the k-way merge, see merge_next_line()
+typedef struct
+{
+    hts_itr_t *itr;
+    int rid;            // header id of the current sequence
+    int full;           // parse complete VCF records, needed when written or filtered by -i/-e
+    bcf1_t *line;       // the record at the current site
+    bcf1_t **buf;       // unused records at the next position, buf[nbuf] is the look-ahead record if set
+    int nbuf, mbuf, ahead;
+    kstring_t tmps, tmpal;
+    prefetch_t *pf;     // with --prefetch, the file is read and parsed on a background thread
+    void *args;         // args_t, for the prefetch callbacks
+    int ireader;
+}
+merge_reader_t;
+
+typedef struct
+{
+    int pos, ireader;
+}
+merge_pos_t;
+
+static inline int merge_pos_lt(merge_pos_t *a, merge_pos_t *b)
+{
+    if ( a->pos < b->pos ) return 1;
+    if ( a->pos==b->pos && a->ireader < b->ireader ) return 1;
+    return 0;
+}
+KHEAP_INIT(mpos, merge_pos_t, merge_pos_lt)
+typedef khp_mpos_t merge_heap_t;
+
 typedef struct
 {
     int isec_op, isec_n, *write, iwrite, nwrite, output_type, n_threads;
@@ -58,7 +98,25 @@ typedef struct
     htsFile **fh_out;
     char **argv, *prefix, *output_fname, **fnames, *write_files, *targets_list, *regions_list;
     char *isec_exact;
-    int argc, record_cmd_line;
+    int argc, record_cmd_line, nexact, prefetch;
+
+    // the current site: only the files which have a record are listed in ihas
+    bcf1_t **line;
+    char *has_line;
+    int *ihas, nhas;
+
+    // k-way merge of many files ordered by position, replaces the synced reader
+    int merge, iseq, nseq;
+    char **seq;
+    merge_reader_t *mrdr;
+    merge_heap_t *heap;
+    kstring_t tmpal;
+
+    // the binary presence matrix, see bitmap_write()
+    char *bitmap_fname;
+    BGZF *fh_bitmap;
+    int bitmap_chr;
+    kstring_t bitmap_str, bitmap_seq;
 }
 args_t;
 
@@ -128,6 +186,520 @@ FILE *open_file(char **fname, const char *mode, const char *fmt, ...)
     return fp;
 }
 
+/*
+    The k-way merge is an alternative to the synced reader for many files.
+    Instead of scanning all files at each step, the files are kept in a heap
+    keyed on the position of their next record and only the files with a
+    record at the current position are touched. The files are processed one
+    sequence at a time in the same order, and records are matched the same
+    way, as the synced reader does with a whole-sequence region.
+*/
+static int prefetch_seq(void *data, int iseq);
+static int prefetch_rec(void *data, bcf1_t *rec);
+
+static void merge_init(args_t *args)
+{
+    bcf_srs_t *files = args->files;
+    void *seqs = khash_str2int_init();
+    int i, j, n;
+    for (i=0; i<files->nreaders; i++)
+    {
+        bcf_sr_t *reader = &files->readers[i];
+        const char **names = reader->tbx_idx ? tbx_seqnames(reader->tbx_idx, &n) : bcf_hdr_seqnames(reader->header, &n);
+        for (j=0; j<n; j++)
+        {
+            if ( khash_str2int_has_key(seqs, names[j]) ) continue;
+            args->seq = (char**) realloc(args->seq, sizeof(char*)*(args->nseq+1));
+            args->seq[args->nseq] = strdup(names[j]);
+            khash_str2int_inc(seqs, args->seq[args->nseq++]);
+        }
+        free(names);
+    }
+    khash_str2int_destroy(seqs);
+
+    args->mrdr = (merge_reader_t*) calloc(files->nreaders, sizeof(merge_reader_t));
+    for (i=0; i<files->nreaders; i++)
+    {
+        merge_reader_t *rdr = &args->mrdr[i];
+        rdr->line = bcf_init();
+        if ( args->nflt && args->flt[i] ) rdr->full = 1;
+        else if ( args->nwrite==1 && !args->prefix ) rdr->full = i==args->iwrite ? 1 : 0;
+        else if ( args->prefix ) rdr->full = (!args->write || args->write[i]) && (args->isec_op!=OP_COMPLEMENT || !i) ? 1 : 0;
+        if ( args->prefetch )
+        {
+            rdr->args = args;
+            rdr->ireader = i;
+            rdr->pf = prefetch_init(args->nseq, args->prefetch, prefetch_seq, prefetch_rec, rdr);
+        }
+    }
+    args->heap  = khp_init(mpos);
+    args->iseq  = -1;
+    args->merge = 1;
+}
+
+static void merge_destroy(args_t *args)
+{
+    int i, j;
+    for (i=0; i<args->files->nreaders; i++)
+    {
+        merge_reader_t *rdr = &args->mrdr[i];
+        if ( rdr->pf ) prefetch_destroy(rdr->pf);
+        if ( rdr->itr ) hts_itr_destroy(rdr->itr);
+        free(rdr->tmps.s);
+        free(rdr->tmpal.s);
+        for (j=0; j<rdr->mbuf; j++) bcf_destroy(rdr->buf[j]);
+        free(rdr->buf);
+        bcf_destroy(rdr->line);
+    }
+    free(args->mrdr);
+    for (i=0; i<args->nseq; i++) free(args->seq[i]);
+    free(args->seq);
+    khp_destroy(mpos, args->heap);
+}
+
+// Set CHROM, POS, REF, ALT and the END-based rlen only, enough for matching and listing the sites
+static int merge_parse_light(merge_reader_t *rdr, bcf_hdr_t *hdr, bcf1_t *rec)
+{
+    char *col[8], *s = rdr->tmps.s;
+    int ncol = 0;
+    while ( ncol<8 )
+    {
+        col[ncol++] = s;
+        while ( *s && *s!='\t' ) s++;
+        if ( !*s ) break;
+        *s++ = 0;
+    }
+    if ( ncol<5 ) error("Could not parse the line: %s\n", rdr->tmps.s);
+
+    bcf_clear(rec);
+    rec->rid = rdr->rid;
+    rec->pos = strtol(col[1], NULL, 10) - 1;
+    rdr->tmpal.l = 0;
+    kputs(col[3], &rdr->tmpal);
+    if ( strcmp(col[4],".") ) { kputc(',', &rdr->tmpal); kputs(col[4], &rdr->tmpal); }
+    bcf_update_alleles_str(hdr, rec, rdr->tmpal.s);
+    rec->rlen = strlen(col[3]);
+    if ( ncol==8 )
+    {
+        char *end = !strncmp(col[7],"END=",4) ? col[7]+4 : strstr(col[7],";END=");
+        if ( end && *end==';' ) end += 5;
+        if ( end ) rec->rlen = strtol(end, NULL, 10) - rec->pos;
+    }
+    rec->d.var_type = -1;
+    return 0;
+}
+
+static int merge_has_filter(bcf_sr_t *reader, bcf1_t *rec)
+{
+    int i, j;
+    if ( !rec->d.n_flt )
+    {
+        for (j=0; j<reader->nfilter_ids; j++)
+            if ( reader->filter_ids[j]<0 ) return 1;
+        return 0;
+    }
+    for (i=0; i<rec->d.n_flt; i++)
+        for (j=0; j<reader->nfilter_ids; j++)
+            if ( rec->d.flt[i]==reader->filter_ids[j] ) return 1;
+    return 0;
+}
+
+// Read the next record of the current sequence passing -f, returns 0 when done.
+// With --prefetch this runs on the background thread of the reader.
+static int merge_read_file(args_t *args, int ireader, bcf1_t *rec)
+{
+    bcf_sr_t *reader = &args->files->readers[ireader];
+    merge_reader_t *rdr = &args->mrdr[ireader];
+    while ( 1 )
+    {
+        int ret;
+        if ( reader->tbx_idx )
+        {
+            ret = tbx_itr_next(reader->file, reader->tbx_idx, rdr->itr, &rdr->tmps);
+            if ( ret < -1 ) error("Failed to read %s\n", reader->fname);
+            if ( ret < 0 ) return 0;
+            if ( rdr->full || reader->nfilter_ids || rdr->rid<0 )
+            {
+                if ( vcf_parse1(&rdr->tmps, reader->header, rec) < 0 ) error("Could not parse the line in %s\n", reader->fname);
+            }
+            else
+                merge_parse_light(rdr, reader->header, rec);
+        }
+        else
+        {
+            ret = bcf_itr_next(reader->file, rdr->itr, rec);
+            if ( ret < -1 ) error("Failed to read %s\n", reader->fname);
+            if ( ret < 0 ) return 0;
+        }
+        if ( !reader->nfilter_ids )
+        {
+            bcf_unpack(rec, BCF_UN_STR);
+            return 1;
+        }
+        bcf_unpack(rec, BCF_UN_STR|BCF_UN_FLT);
+        if ( merge_has_filter(reader, rec) ) return 1;
+    }
+}
+
+// Position the reader at the start of the iseq-th sequence, returns 0 if not present
+static int merge_start_seq(args_t *args, int ireader, int iseq)
+{
+    bcf_sr_t *reader = &args->files->readers[ireader];
+    merge_reader_t *rdr = &args->mrdr[ireader];
+    const char *seq = args->seq[iseq];
+    if ( rdr->itr ) hts_itr_destroy(rdr->itr);
+    rdr->itr = NULL;
+    rdr->rid = bcf_hdr_name2id(reader->header, seq);
+    int tid = reader->tbx_idx ? tbx_name2id(reader->tbx_idx, seq) : rdr->rid;
+    if ( tid < 0 ) return 0;
+    rdr->itr = reader->tbx_idx ? tbx_itr_queryi(reader->tbx_idx, tid, 0, INT_MAX) : bcf_itr_queryi(reader->bcf_idx, tid, 0, INT_MAX);
+    return rdr->itr ? 1 : 0;
+}
+
+static int prefetch_seq(void *data, int iseq)
+{
+    merge_reader_t *rdr = (merge_reader_t*) data;
+    return merge_start_seq((args_t*)rdr->args, rdr->ireader, iseq);
+}
+static int prefetch_rec(void *data, bcf1_t *rec)
+{
+    merge_reader_t *rdr = (merge_reader_t*) data;
+    return merge_read_file((args_t*)rdr->args, rdr->ireader, rec);
+}
+
+// The next record of the current sequence, *rec may be swapped with a prefetched one
+static int merge_read(args_t *args, int ireader, bcf1_t **rec)
+{
+    merge_reader_t *rdr = &args->mrdr[ireader];
+    if ( rdr->pf ) return prefetch_read(rdr->pf, args->iseq, rec);
+    return merge_read_file(args, ireader, *rec);
+}
+
+// Buffer all records at the next position of the reader, returns 0 when the sequence is done
+static int merge_fill(args_t *args, int ireader)
+{
+    merge_reader_t *rdr = &args->mrdr[ireader];
+    while ( 1 )
+    {
+        if ( rdr->nbuf + 1 > rdr->mbuf )
+        {
+            rdr->buf = (bcf1_t**) realloc(rdr->buf, sizeof(bcf1_t*)*(rdr->mbuf+8));
+            for (; rdr->mbuf < rdr->nbuf + 8; rdr->mbuf++) rdr->buf[rdr->mbuf] = bcf_init();
+        }
+        if ( rdr->ahead ) rdr->ahead = 0;
+        else if ( !merge_read(args, ireader, &rdr->buf[rdr->nbuf]) ) break;
+        if ( rdr->nbuf && rdr->buf[rdr->nbuf]->pos != rdr->buf[0]->pos ) { rdr->ahead = 1; break; }
+        rdr->nbuf++;
+    }
+    return rdr->nbuf;
+}
+
+// Move to the next sequence, returns 0 when all sequences are done
+static int merge_next_seq(args_t *args)
+{
+    bcf_srs_t *files = args->files;
+    int i;
+    while ( !args->heap->ndat && ++args->iseq < args->nseq )
+    {
+        for (i=0; i<files->nreaders; i++)
+        {
+            merge_reader_t *rdr = &args->mrdr[i];
+            rdr->nbuf = rdr->ahead = 0;
+            if ( !rdr->pf && !merge_start_seq(args, i, args->iseq) ) continue;
+            if ( !merge_fill(args, i) ) continue;
+            merge_pos_t mp = { rdr->buf[0]->pos, i };
+            khp_insert(mpos, args->heap, &mp);
+        }
+    }
+    return args->heap->ndat;
+}
+
+// The first unused record matching the template, the same rules as the synced reader uses
+static int merge_match(args_t *args, merge_reader_t *rdr, bcf1_t *tmpl)
+{
+    int collapse = args->files->collapse, tmpl_type = bcf_get_variant_types(tmpl);
+    int i, ial, jal;
+    for (i=0; i<rdr->nbuf; i++)
+    {
+        bcf1_t *line = rdr->buf[i];
+        if ( collapse & COLLAPSE_ANY ) return i;
+        int line_type = bcf_get_variant_types(line);
+        if ( collapse&COLLAPSE_SNPS && tmpl_type&VCF_SNP && line_type&VCF_SNP ) return i;
+        if ( collapse&COLLAPSE_INDELS && tmpl_type&VCF_INDEL && line_type&VCF_INDEL ) return i;
+        if ( tmpl->rlen != line->rlen ) continue;
+        if ( strcmp(tmpl->d.allele[0], line->d.allele[0]) ) continue;
+        if ( collapse==COLLAPSE_NONE )
+        {
+            // all alleles must be identical
+            if ( tmpl->n_allele != line->n_allele ) continue;
+            int nmatch = 1;
+            for (ial=1; ial<tmpl->n_allele; ial++)
+                for (jal=1; jal<line->n_allele; jal++)
+                    if ( !strcmp(tmpl->d.allele[ial], line->d.allele[jal]) ) { nmatch++; break; }
+            if ( nmatch>=tmpl->n_allele ) return i;
+            continue;
+        }
+        // some of the ALT alleles must be shared
+        for (ial=1; ial<tmpl->n_allele; ial++)
+            for (jal=1; jal<line->n_allele; jal++)
+                if ( !strcmp(tmpl->d.allele[ial], line->d.allele[jal]) ) return i;
+    }
+    return -1;
+}
+
+// Make buf[i] the current line of the reader, keeping the order of the others
+static void merge_take(merge_reader_t *rdr, int i)
+{
+    bcf1_t *tmp = rdr->line;
+    rdr->line = rdr->buf[i];
+    int n = rdr->nbuf + rdr->ahead;
+    for (; i+1<n; i++) rdr->buf[i] = rdr->buf[i+1];
+    rdr->buf[n-1] = tmp;
+    rdr->nbuf--;
+}
+
+static int merge_next_line(args_t *args)
+{
+    merge_heap_t *heap = args->heap;
+    if ( !heap->ndat && !merge_next_seq(args) ) return 0;
+
+    // the readers come out of the heap ordered by position and the reader index
+    int pos = heap->dat[0].pos, i, n = 0;
+    bcf1_t *tmpl = NULL;
+    while ( heap->ndat && heap->dat[0].pos==pos )
+    {
+        args->ihas[n++] = heap->dat[0].ireader;
+        khp_delete(mpos, heap);
+    }
+    for (i=0; i<n; i++)
+    {
+        int ireader = args->ihas[i];
+        merge_reader_t *rdr = &args->mrdr[ireader];
+        int irec = tmpl ? merge_match(args, rdr, tmpl) : 0;
+        if ( irec>=0 )
+        {
+            merge_take(rdr, irec);
+            args->line[ireader] = rdr->line;
+            args->has_line[ireader] = 1;
+            args->ihas[args->nhas++] = ireader;
+            if ( !tmpl ) tmpl = rdr->line;
+        }
+        if ( rdr->nbuf || merge_fill(args, ireader) )
+        {
+            merge_pos_t mp = { rdr->buf[0]->pos, ireader };
+            khp_insert(mpos, heap, &mp);
+        }
+    }
+    return args->nhas;
+}
+
+// Advance to the next site, filling the list of files which have a record there
+static int isec_next_line(args_t *args)
+{
+    bcf_srs_t *files = args->files;
+    int i;
+    for (i=0; i<args->nhas; i++) args->has_line[args->ihas[i]] = 0;
+    args->nhas = 0;
+    if ( args->merge ) return merge_next_line(args);
+
+    int n = bcf_sr_next_line(files);
+    for (i=0; i<files->nreaders; i++)
+    {
+        if ( !bcf_sr_has_line(files,i) ) continue;
+        args->line[i] = files->readers[i].buffer[0];
+        args->has_line[i] = 1;
+        args->ihas[args->nhas++] = i;
+    }
+    return n;
+}
+
+/*
+    Binary presence matrix written with --sites-bitmap, BGZF compressed. All
+    integers are 32-bit little-endian.
+        magic "ISB\1", nfiles, nfiles x (length, file name)
+        sites: ichr, [length, chr name: only when ichr is new], pos (0-based),
+               length, "REF\tALT", (nfiles+7)/8 bytes with bit (i&7) of byte (i>>3) set
+               when the i-th file has the site
+*/
+#define BITMAP_MAGIC "ISB\1"
+
+static void bitmap_put_int(kstring_t *str, uint32_t val)
+{
+    uint8_t buf[4] = { val, val>>8, val>>16, val>>24 };
+    kputsn((char*)buf, 4, str);
+}
+static void bitmap_put_str(kstring_t *str, const char *s)
+{
+    int len = strlen(s);
+    bitmap_put_int(str, len);
+    kputsn(s, len, str);
+}
+static int bitmap_get_int(BGZF *fp, int32_t *val)
+{
+    uint8_t buf[4];
+    int ret = bgzf_read(fp, buf, 4);
+    if ( !ret ) return 0;
+    if ( ret!=4 ) return -1;
+    *val = (int32_t)((uint32_t)buf[0] | (uint32_t)buf[1]<<8 | (uint32_t)buf[2]<<16 | (uint32_t)buf[3]<<24);
+    return 1;
+}
+static int bitmap_get_str(BGZF *fp, kstring_t *str)
+{
+    int32_t len;
+    if ( bitmap_get_int(fp, &len)!=1 || len<0 ) return -1;
+    str->l = 0;
+    ks_resize(str, len+1);
+    if ( bgzf_read(fp, str->s, len)!=len ) return -1;
+    str->s[len] = 0;
+    str->l = len;
+    return 0;
+}
+
+static void bitmap_init(args_t *args)
+{
+    bcf_srs_t *files = args->files;
+    int i;
+    args->fh_bitmap = bgzf_open(args->bitmap_fname, "w");
+    if ( !args->fh_bitmap ) error("Could not write %s: %s\n", args->bitmap_fname, strerror(errno));
+    args->bitmap_chr = -1;
+    kstring_t str = {0,0,0};
+    kputsn(BITMAP_MAGIC, 4, &str);
+    bitmap_put_int(&str, files->nreaders);
+    for (i=0; i<files->nreaders; i++) bitmap_put_str(&str, files->readers[i].fname);
+    if ( bgzf_write(args->fh_bitmap, str.s, str.l)!=str.l ) error("Failed to write %s\n", args->bitmap_fname);
+    free(str.s);
+}
+
+static void bitmap_write(args_t *args, bcf_hdr_t *hdr, bcf1_t *line)
+{
+    kstring_t *str = &args->bitmap_str;
+    int i, nbytes = (args->files->nreaders + 7)/8;
+    str->l = 0;
+    const char *chr = bcf_hdr_id2name(hdr, line->rid);
+    if ( args->bitmap_chr<0 || strcmp(chr, args->bitmap_seq.s) )
+    {
+        // the sequence ids differ between the headers, compare by name
+        args->bitmap_seq.l = 0;
+        kputs(chr, &args->bitmap_seq);
+        args->bitmap_chr++;
+        bitmap_put_int(str, args->bitmap_chr);
+        bitmap_put_str(str, chr);
+    }
+    else
+        bitmap_put_int(str, args->bitmap_chr);
+    bitmap_put_int(str, line->pos);
+
+    kstring_t *als = &args->tmpal;
+    als->l = 0;
+    if ( line->n_allele > 0 ) kputs(line->d.allele[0], als); else kputc('.', als);
+    kputc('\t', als);
+    if ( line->n_allele > 1 ) kputs(line->d.allele[1], als); else kputc('.', als);
+    for (i=2; i<line->n_allele; i++) { kputc(',', als); kputs(line->d.allele[i], als); }
+    bitmap_put_str(str, als->s);
+
+    ks_resize(str, str->l + nbytes);
+    uint8_t *bits = (uint8_t*)str->s + str->l;
+    memset(bits, 0, nbytes);
+    for (i=0; i<args->nhas; i++) bits[args->ihas[i]>>3] |= 1<<(args->ihas[i]&7);
+    str->l += nbytes;
+    if ( bgzf_write(args->fh_bitmap, str->s, str->l)!=str->l ) error("Failed to write %s\n", args->bitmap_fname);
+}
+
+static void bitmap_destroy(args_t *args)
+{
+    if ( bgzf_close(args->fh_bitmap)!=0 ) error("Failed to close %s\n", args->bitmap_fname);
+    free(args->bitmap_str.s);
+    free(args->bitmap_seq.s);
+}
+
+// Intersection and union counts for subsets of files given as 1-based lists, all files by default
+static void bitmap_query(const char *fname, char **subsets, int nsubsets)
+{
+    BGZF *fp = bgzf_open(fname, "r");
+    if ( !fp ) error("Could not read %s: %s\n", fname, strerror(errno));
+    char magic[4];
+    if ( bgzf_read(fp, magic, 4)!=4 || memcmp(magic, BITMAP_MAGIC, 4) ) error("Not a --sites-bitmap file: %s\n", fname);
+
+    int32_t nfiles, ichr, pos;
+    int i, j, nchr = 0;
+    kstring_t str = {0,0,0};
+    if ( bitmap_get_int(fp, &nfiles)!=1 || nfiles<=0 ) error("Could not parse %s\n", fname);
+    for (i=0; i<nfiles; i++)
+        if ( bitmap_get_str(fp, &str)<0 ) error("Could not parse %s\n", fname);
+
+    int nbytes = (nfiles + 7)/8, nsets = nsubsets ? nsubsets : 1;
+    uint8_t *mask = (uint8_t*) calloc(nsets*nbytes, 1);
+    uint64_t *nisec = (uint64_t*) calloc(nsets, sizeof(uint64_t));
+    uint64_t *nunion = (uint64_t*) calloc(nsets, sizeof(uint64_t));
+    for (j=0; j<nsets; j++)
+    {
+        uint8_t *m = mask + j*nbytes;
+        if ( !nsubsets )
+        {
+            for (i=0; i<nfiles; i++) m[i>>3] |= 1<<(i&7);
+            continue;
+        }
+        char *p = subsets[j], *q;
+        while ( *p )
+        {
+            i = strtol(p, &q, 10);
+            if ( q==p || (*q && *q!=',') ) error("Could not parse --subset %s\n", subsets[j]);
+            if ( i<1 || i>nfiles ) error("The index is out of range: %d (%s)\n", i, subsets[j]);
+            m[(i-1)>>3] |= 1<<((i-1)&7);
+            p = *q ? q+1 : q;
+        }
+    }
+
+    uint8_t *bits = (uint8_t*) malloc(nbytes);
+    uint64_t nsites = 0;
+    while ( (i=bitmap_get_int(fp, &ichr))==1 )
+    {
+        if ( ichr==nchr )
+        {
+            if ( bitmap_get_str(fp, &str)<0 ) error("Could not parse %s\n", fname);
+            nchr++;
+        }
+        else if ( ichr<0 || ichr>nchr ) error("Could not parse %s\n", fname);
+        if ( bitmap_get_int(fp, &pos)!=1 || bitmap_get_str(fp, &str)<0 ) error("Could not parse %s\n", fname);
+        if ( bgzf_read(fp, bits, nbytes)!=nbytes ) error("Could not parse %s\n", fname);
+        nsites++;
+        for (j=0; j<nsets; j++)
+        {
+            uint8_t *m = mask + j*nbytes;
+            int k, all = 1, any = 0;
+            for (k=0; k<nbytes; k++)
+            {
+                if ( (bits[k] & m[k]) != m[k] ) all = 0;
+                if ( bits[k] & m[k] ) any = 1;
+            }
+            nisec[j] += all;
+            nunion[j] += any;
+        }
+    }
+    if ( i<0 ) error("Could not parse %s\n", fname);
+    bgzf_close(fp);
+
+    printf("# Total number of sites: %"PRIu64"\n", nsites);
+    printf("# [1]Files\t[2]Intersection\t[3]Union\n");
+    for (j=0; j<nsets; j++)
+    {
+        uint8_t *m = mask + j*nbytes;
+        str.l = 0;
+        for (i=0; i<nfiles; i++)
+        {
+            if ( !(m[i>>3] & 1<<(i&7)) ) continue;
+            if ( str.l ) kputc(',', &str);
+            kputw(i+1, &str);
+        }
+        printf("%s\t%"PRIu64"\t%"PRIu64"\n", str.s, nisec[j], nunion[j]);
+    }
+    free(str.s);
+    free(bits);
+    free(mask);
+    free(nisec);
+    free(nunion);
+}
+
 void isec_vcf(args_t *args)
 {
     bcf_srs_t *files = args->files;
@@ -149,54 +721,56 @@ void isec_vcf(args_t *args)
     if ( !args->nwrite && !out_std && !args->prefix )
         fprintf(stderr,"Note: -w option not given, printing list of sites...\n");
 
-    int n;
-    while ( (n=bcf_sr_next_line(files)) )
+    while ( isec_next_line(args) )
     {
         bcf_sr_t *reader = NULL;
         bcf1_t *line = NULL;
-        int i, ret = 0;
-        for (i=0; i<files->nreaders; i++)
+        int i, j, ret = 0;
+        for (i=0,j=0; i<args->nhas; i++)
         {
-            if ( !bcf_sr_has_line(files,i) ) continue;
-
-            if ( args->nflt && args->flt[i] )
+            int irdr = args->ihas[i];
+            if ( args->nflt && args->flt[irdr] )
             {
-                bcf1_t *rec = bcf_sr_get_line(files, i);
-                int pass = filter_test(args->flt[i], rec, NULL);
-                if ( args->flt_logic[i] & FLT_EXCLUDE ) pass = pass ? 0 : 1;
+                int pass = filter_test(args->flt[irdr], args->line[irdr], NULL);
+                if ( args->flt_logic[irdr] & FLT_EXCLUDE ) pass = pass ? 0 : 1;
                 if ( !pass )
                 {
-                    files->has_line[i] = 0;
-                    n--;
+                    args->has_line[irdr] = 0;
                     continue;
                 }
             }
+            args->ihas[j++] = irdr;
 
             if ( !line )
             {
-                line = files->readers[i].buffer[0];
-                reader = &files->readers[i];
+                line = args->line[irdr];
+                reader = &files->readers[irdr];
             }
-            ret |= 1<<i;    // this may overflow for many files, but will be used only with two (OP_VENN)
+            ret |= 1<<irdr;    // this may overflow for many files, but will be used only with two (OP_VENN)
         }
+        int n = args->nhas = j;
+        if ( !n ) continue;
 
         switch (args->isec_op)
         {
-            case OP_COMPLEMENT: if ( n!=1 || !bcf_sr_has_line(files,0) ) continue; break;
+            case OP_COMPLEMENT: if ( n!=1 || !args->has_line[0] ) continue; break;
             case OP_EQUAL: if ( n != args->isec_n ) continue; break;
             case OP_PLUS: if ( n < args->isec_n ) continue; break;
             case OP_MINUS: if ( n > args->isec_n ) continue; break;
             case OP_EXACT:
-                for (i=0; i<files->nreaders; i++)
-                    if ( files->has_line[i] != args->isec_exact[i] ) break;
-                if ( i<files->nreaders ) continue;
+                if ( n != args->nexact ) continue;
+                for (i=0; i<n; i++)
+                    if ( !args->isec_exact[args->ihas[i]] ) break;
+                if ( i<n ) continue;
                 break;
         }
 
+        if ( args->fh_bitmap ) bitmap_write(args, reader->header, line);
+
         if ( out_std )
         {
-            if ( bcf_sr_has_line(files,args->iwrite) )
-                bcf_write1(out_fh, files->readers[args->iwrite].header, files->readers[args->iwrite].buffer[0]);
+            if ( args->has_line[args->iwrite] )
+                bcf_write1(out_fh, files->readers[args->iwrite].header, args->line[args->iwrite]);
             continue;
         }
         else if ( args->fh_sites )
@@ -216,7 +790,7 @@ void isec_vcf(args_t *args)
             }
             kputc('\t', &str);
             for (i=0; i<files->nreaders; i++)
-                kputc(bcf_sr_has_line(files,i)?'1':'0', &str);
+                kputc(args->has_line[i]?'1':'0', &str);
             kputc('\n', &str);
             fwrite(str.s,sizeof(char),str.l,args->fh_sites);
         }
@@ -226,17 +800,17 @@ void isec_vcf(args_t *args)
             if ( args->isec_op==OP_VENN && ret==3 )
             {
                 if ( !args->nwrite || args->write[0] )
-                    bcf_write1(args->fh_out[2], bcf_sr_get_header(files,0), bcf_sr_get_line(files,0));
+                    bcf_write1(args->fh_out[2], bcf_sr_get_header(files,0), args->line[0]);
                 if ( !args->nwrite || args->write[1] )
-                    bcf_write1(args->fh_out[3], bcf_sr_get_header(files,1), bcf_sr_get_line(files,1));
+                    bcf_write1(args->fh_out[3], bcf_sr_get_header(files,1), args->line[1]);
             }
             else
             {
-                for (i=0; i<files->nreaders; i++)
+                for (i=0; i<n; i++)
                 {
-                    if ( !bcf_sr_has_line(files,i) ) continue;
-                    if ( args->write && !args->write[i] ) continue;
-                    bcf_write1(args->fh_out[i], files->readers[i].header, files->readers[i].buffer[0]);
+                    int irdr = args->ihas[i];
+                    if ( args->write && !args->write[irdr] ) continue;
+                    bcf_write1(args->fh_out[irdr], files->readers[irdr].header, args->line[irdr]);
                 }
             }
         }
@@ -301,7 +875,10 @@ static void init_data(args_t *args)
         for (i=0; i<args->files->nreaders; i++)
             if ( args->isec_exact[i]!='0' && args->isec_exact[i]!='1' ) error("Unexpected bitmask: %s\n",args->isec_exact);
         for (i=0; i<args->files->nreaders; i++)
+        {
             args->isec_exact[i] -= '0';
+            args->nexact += args->isec_exact[i];
+        }
     }
 
     // Which files to write: parse the string passed with -w
@@ -324,6 +901,13 @@ static void init_data(args_t *args)
         if ( !args->write[0] ) error("Only -w1 makes sense with -C\n");
     }
 
+    args->line     = (bcf1_t**) calloc(args->files->nreaders,sizeof(bcf1_t*));
+    args->has_line = (char*) calloc(args->files->nreaders,sizeof(char));
+    args->ihas     = (int*) calloc(args->files->nreaders,sizeof(int));
+    if ( args->bitmap_fname ) bitmap_init(args);
+    if ( args->files->nreaders >= MERGE_MIN_FILES && !args->targets_list && !args->regions_list && !(args->files->collapse&COLLAPSE_SOME) )
+        merge_init(args);
+
     if ( args->prefix )
     {
         // Init output directory and create the readme file
@@ -407,6 +991,12 @@ static void init_data(args_t *args)
 static void destroy_data(args_t *args)
 {
     int i;
+    if ( args->merge ) merge_destroy(args);
+    if ( args->fh_bitmap ) bitmap_destroy(args);
+    free(args->tmpal.s);
+    free(args->line);
+    free(args->has_line);
+    free(args->ihas);
     if ( args->nflt )
     {
         for (i=0; i<args->nflt; i++)
@@ -461,8 +1051,12 @@ static void usage(void)
     fprintf(stderr, "    -o, --output <file>           write output to a file [standard output]\n");
     fprintf(stderr, "    -O, --output-type <b|u|z|v>   b: compressed BCF, u: uncompressed BCF, z: compressed VCF, v: uncompressed VCF [v]\n");
     fprintf(stderr, "    -p, --prefix <dir>            if given, subset each of the input files accordingly, see also -w\n");
+    fprintf(stderr, "        --prefetch <int>          read and parse up to <int> records ahead on a thread per file, three or more files [0]\n");
+    fprintf(stderr, "        --query-bitmap <file>     print intersection and union counts from a --sites-bitmap file, no VCFs are read\n");
     fprintf(stderr, "    -r, --regions <region>        restrict to comma-separated list of regions\n");
     fprintf(stderr, "    -R, --regions-file <file>     restrict to regions listed in a file\n");
+    fprintf(stderr, "        --sites-bitmap <file>     write a binary matrix of the output sites and the files which have them\n");
+    fprintf(stderr, "        --subset <list>           with --query-bitmap, 1-based indexes of files to count, can be given multiple times [all]\n");
     fprintf(stderr, "    -t, --targets <region>        similar to -r but streams rather than index-jumps\n");
     fprintf(stderr, "    -T, --targets-file <file>     similar to -R but streams rather than index-jumps\n");
     fprintf(stderr, "        --threads <int>           number of extra output compression threads [0]\n");
@@ -481,6 +1075,10 @@ static void usage(void)
     fprintf(stderr, "   # Extract records private to A or B comparing by position only\n");
     fprintf(stderr, "   bcftools isec A.vcf.gz B.vcf.gz -p dir -n -1 -c all\n");
     fprintf(stderr, "\n");
+    fprintf(stderr, "   # Save the presence of all sites once, then count sites shared by different subsets of files\n");
+    fprintf(stderr, "   bcftools isec A.vcf.gz B.vcf.gz C.vcf.gz -n +1 --sites-bitmap sites.bin -o /dev/null\n");
+    fprintf(stderr, "   bcftools isec --query-bitmap sites.bin --subset 1,2 --subset 1,3\n");
+    fprintf(stderr, "\n");
     exit(1);
 }
 
@@ -494,7 +1092,8 @@ int main_vcfisec(int argc, char *argv[])
     args->output_type = FT_VCF;
     args->n_threads = 0;
     args->record_cmd_line = 1;
-    int targets_is_file = 0, regions_is_file = 0;
+    int targets_is_file = 0, regions_is_file = 0, nsubsets = 0;
+    char *bitmap_fname = NULL, **subsets = NULL;
 
     static struct option loptions[] =
     {
@@ -515,6 +1114,10 @@ int main_vcfisec(int argc, char *argv[])
         {"output-type",required_argument,NULL,'O'},
         {"threads",required_argument,NULL,9},
         {"no-version",no_argument,NULL,8},
+        {"sites-bitmap",required_argument,NULL,10},
+        {"query-bitmap",required_argument,NULL,11},
+        {"subset",required_argument,NULL,12},
+        {"prefetch",required_argument,NULL,13},
         {NULL,0,NULL,0}
     };
     while ((c = getopt_long(argc, argv, "hc:r:R:p:n:w:t:T:Cf:o:O:i:e:",loptions,NULL)) >= 0) {
@@ -564,11 +1167,33 @@ int main_vcfisec(int argc, char *argv[])
                 break;
             case  9 : args->n_threads = strtol(optarg, 0, 0); break;
             case  8 : args->record_cmd_line = 0; break;
+            case 10 : args->bitmap_fname = optarg; break;
+            case 11 : bitmap_fname = optarg; break;
+            case 12 :
+                subsets = (char**) realloc(subsets, sizeof(char*)*(nsubsets+1));
+                subsets[nsubsets++] = optarg;
+                break;
+            case 13 :
+            {
+                char *tmp;
+                args->prefetch = strtol(optarg,&tmp,10);
+                if ( *tmp || args->prefetch<0 ) error("Could not parse argument: --prefetch %s\n", optarg);
+                break;
+            }
             case 'h':
             case '?': usage();
             default: error("Unknown argument: %s\n", optarg);
         }
     }
+    if ( bitmap_fname )
+    {
+        bitmap_query(bitmap_fname, subsets, nsubsets);
+        free(subsets);
+        bcf_sr_destroy(args->files);
+        free(args);
+        return 0;
+    }
+    if ( nsubsets ) error("The --subset option requires --query-bitmap\n");
     if ( argc-optind<1 ) usage();   // no file given
     if ( args->targets_list && bcf_sr_set_targets(args->files, args->targets_list, targets_is_file,0)<0 )
         error("Failed to read the targets: %s\n", args->targets_list);
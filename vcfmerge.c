@@ -38,6 +38,9 @@ THE SOFTWARE.  */
 #include "bcftools.h"
 #include "regidx.h"
 #include "vcmp.h"
+#include "gtcount.h"
+#include "profile.h"
+#include "shard.h"
 
 #define DBG 0
 
@@ -128,6 +131,11 @@ typedef struct
     bcf_srs_t *files;
     int gvcf_min, gvcf_break;   // min buffered gvcf END position (NB: gvcf_min is 1-based) or 0 if no active lines are present
     gvcf_aux_t *gvcf;           // buffer of gVCF lines
+    char *als_used;             // used by stage_line() with --max-site-mem
+    int mals_used;
+    int *al_idxs, mal_idxs;     // per-site scratch of merge_chrom2qual(), reused across sites
+    int *out_off, mout_off;
+    kstring_t out_str;          // the output alleles, one block for all
 }
 maux_t;
 
@@ -138,7 +146,7 @@ typedef struct
     regidx_t *regs;    // apply regions only after the blocks are expanded
     regitr_t *regs_itr;
     int header_only, collapse, output_type, force_samples, merge_by_id, do_gvcf, filter_logic, missing_to_ref;
-    char *header_fname, *output_fname, *regions_list, *info_rules, *file_list;
+    char *header_fname, *output_fname, *regions_list, *info_rules, *file_list, *gvcf_fname;
     faidx_t *gvcf_fai;
     info_rule_t *rules;
     int nrules;
@@ -147,9 +155,11 @@ typedef struct
     bcf_srs_t *files;
     bcf1_t *out_line;
     htsFile *out_fh;
+    out_idx_t *out_idx;
     bcf_hdr_t *out_hdr;
     char **argv;
-    int argc, n_threads, record_cmd_line;
+    int argc, n_threads, record_cmd_line, shard_threads, write_index;
+    size_t max_site_mem;    // split sites whose FORMAT fields would exceed this size, 0 for no limit
 }
 args_t;
 
@@ -499,23 +509,22 @@ void merge_headers(bcf_hdr_t *hw, const bcf_hdr_t *hr, const char *clash_prefix,
 
     // samples
     int i;
+    kstring_t name = {0,0,0};
     for (i=0; i<bcf_hdr_nsamples(hr); i++)
     {
-        char *name = hr->samples[i];
-        if ( bcf_hdr_id2int(hw, BCF_DT_SAMPLE, name)!=-1 )
+        if ( bcf_hdr_id2int(hw, BCF_DT_SAMPLE, hr->samples[i])!=-1 )
         {
             // there is a sample with the same name
-            if ( !force_samples ) error("Error: Duplicate sample names (%s), use --force-samples to proceed anyway.\n", name);
+            if ( !force_samples ) error("Error: Duplicate sample names (%s), use --force-samples to proceed anyway.\n", hr->samples[i]);
 
-            int len = strlen(hr->samples[i]) + strlen(clash_prefix) + 1;
-            name = (char*) malloc(sizeof(char)*(len+1));
-            sprintf(name,"%s:%s",clash_prefix,hr->samples[i]);
-            bcf_hdr_add_sample(hw,name);
-            free(name);
+            name.l = 0;
+            ksprintf(&name,"%s:%s",clash_prefix,hr->samples[i]);
+            bcf_hdr_add_sample(hw,name.s);
         }
         else
-            bcf_hdr_add_sample(hw,name);
+            bcf_hdr_add_sample(hw,hr->samples[i]);
     }
+    free(name.s);
 }
 
 void debug_als(char **als, int nals)
@@ -662,8 +671,18 @@ char **merge_alleles(char **a, int na, int *map, char **b, int *nb, int *mb)
         }
         // new allele
         map[i] = *nb;
-        if ( b[*nb] ) free(b[*nb]);
-        b[*nb] = const_ai ? strdup(ai) : ai;
+        if ( const_ai )
+        {
+            // reuse the string left from a previous site
+            size_t len = strlen(ai) + 1;
+            b[*nb] = (char*) realloc(b[*nb], len);
+            memcpy(b[*nb], ai, len);
+        }
+        else
+        {
+            free(b[*nb]);
+            b[*nb] = ai;
+        }
         (*nb)++;
     }
     return b;
@@ -725,6 +744,10 @@ void maux_destroy(maux_t *ma)
     free(ma->smpl_ploidy);
     free(ma->smpl_nGsize);
     free(ma->chr);
+    free(ma->als_used);
+    free(ma->al_idxs);
+    free(ma->out_off);
+    free(ma->out_str.s);
     free(ma);
 }
 void maux_expand1(buffer_t *buf, int size)
@@ -740,11 +763,7 @@ void maux_reset(maux_t *ma)
     int i,j;
     for (i=0; i<ma->n; i++) maux_expand1(&ma->buf[i],ma->files->readers[i].nbuffer+1);
     for (i=0; i<ma->ncnt; i++) ma->cnt[i] = 0;
-    for (i=0; i<ma->mals; i++)
-    {
-        free(ma->als[i]);
-        ma->als[i] = NULL;
-    }
+    // the allele strings are kept and overwritten by maux_set_allele() and merge_alleles()
     const char *chr = NULL;
     ma->nals  = 0;
     ma->pos   = -1;
@@ -785,6 +804,12 @@ void maux_reset(maux_t *ma)
         if ( new_chr && ma->gvcf ) ma->gvcf[i].active = 0;  // make sure to close active gvcf block on new chr
     }
 }
+static inline void maux_set_allele(maux_t *ma, int i, const char *als)
+{
+    size_t len = strlen(als) + 1;
+    ma->als[i] = (char*) realloc(ma->als[i], len);
+    memcpy(ma->als[i], als, len);
+}
 void maux_debug(maux_t *ma, int ir, int ib)
 {
     printf("[%d,%d]\t", ir,ib);
@@ -809,7 +834,9 @@ void merge_chrom2qual(args_t *args, bcf1_t *out)
     tmps->l = 0;
 
     maux_t *ma = args->maux;
-    int *al_idxs = (int*) calloc(ma->nals,sizeof(int));
+    hts_expand(int, ma->nals, ma->mal_idxs, ma->al_idxs);
+    int *al_idxs = ma->al_idxs;
+    memset(al_idxs, 0, sizeof(int)*ma->nals);
     bcf_float_set_missing(out->qual);
 
     // CHROM, POS, ID, QUAL
@@ -884,17 +911,23 @@ void merge_chrom2qual(args_t *args, bcf1_t *out)
             }
         }
     }
-    // Expand the arrays and realloc the alleles string. Note that all alleles are in a single allocated block.
+    // Expand the arrays and copy the alleles to a single block, which is
+    // normalized in place and reused for the next record
     ma->nout_als++;
     hts_expand0(char*, ma->nout_als, ma->mout_als, ma->out_als);
+    hts_expand(int, ma->nout_als, ma->mout_off, ma->out_off);
     int k = 0;
+    ma->out_str.l = 0;
     for (i=0; i<ma->nals; i++)
-        if ( i==0 || al_idxs[i] ) ma->out_als[k++] = strdup(ma->als[i]);
+    {
+        if ( i && !al_idxs[i] ) continue;
+        ma->out_off[k++] = ma->out_str.l;
+        kputsn(ma->als[i], strlen(ma->als[i])+1, &ma->out_str);
+    }
     assert( k==ma->nout_als );
+    for (i=0; i<k; i++) ma->out_als[i] = ma->out_str.s + ma->out_off[i];
     normalize_alleles(ma->out_als, ma->nout_als);
     bcf_update_alleles(out_hdr, out, (const char**) ma->out_als, ma->nout_als);
-    free(al_idxs);
-    for (i=0; i<ma->nout_als; i++) free(ma->out_als[i]);
 }
 
 void merge_filter(args_t *args, bcf1_t *out)
@@ -1271,7 +1304,7 @@ void merge_info(args_t *args, bcf1_t *out)
 void update_AN_AC(bcf_hdr_t *hdr, bcf1_t *line)
 {
     int32_t an = 0, *tmp = (int32_t*) malloc(sizeof(int)*line->n_allele);
-    int ret = bcf_calc_ac(hdr, line, tmp, BCF_UN_FMT);
+    int ret = gtcount_calc_ac(hdr, line, tmp, BCF_UN_FMT);
     if ( ret>0 )
     {
         int i;
@@ -1684,8 +1717,7 @@ void gvcf_set_alleles(args_t *args)
             hts_expand0(int, maux->nals, maux->ncnt, maux->cnt);
             for (k=0; k<maux->nals; k++)
             {
-                if ( maux->als[k] ) free(maux->als[k]);
-                maux->als[k] = strdup(line->d.allele[k]);
+                maux_set_allele(maux, k, line->d.allele[k]);
                 maux->buf[i].rec[irec].map[k] = k;
             }
         }
@@ -1770,7 +1802,7 @@ void gvcf_write_block(args_t *args, int start, int end)
     }
     else
         bcf_update_info_int32(args->out_hdr, out, "END", NULL, 0);
-    bcf_write1(args->out_fh, args->out_hdr, out);
+    out_idx_write(args->out_idx, args->out_fh, args->out_hdr, out);
     bcf_clear1(out);
 
 
@@ -2126,8 +2158,7 @@ int can_merge(args_t *args)
                 hts_expand0(int, maux->nals, maux->ncnt, maux->cnt);
                 for (k=0; k<maux->nals; k++)
                 {
-                    free(maux->als[k]);
-                    maux->als[k] = strdup(line->d.allele[k]);
+                    maux_set_allele(maux, k, line->d.allele[k]);
                     buf->rec[j].map[k] = k;
                     maux->cnt[k] = 1;
                 }
@@ -2145,6 +2176,42 @@ int can_merge(args_t *args)
     return 1;
 }
 
+/*
+    With --max-site-mem, keep staging lines only while a Number=G FORMAT field
+    of the merged record would fit in the budget. The remaining lines stay in
+    the buffer and are output as separate records at the same position. The
+    first line is always staged.
+*/
+static void bound_staged_lines(args_t *args)
+{
+    maux_t *maux = args->maux;
+    size_t nsmpl = bcf_hdr_nsamples(args->out_hdr);
+    hts_expand(char, maux->nals, maux->mals_used, maux->als_used);
+    memset(maux->als_used, 0, maux->nals);
+    maux->als_used[0] = 1;
+
+    int i, k, nals = 1, nstaged = 0;
+    for (i=0; i<args->files->nreaders; i++)
+    {
+        buffer_t *buf = &maux->buf[i];
+        if ( buf->cur<0 ) continue;
+        bcf1_t *line = buf->lines[buf->cur];
+        int *map = buf->rec[buf->cur].map, n = nals;
+        for (k=1; k<line->n_allele; k++)
+            if ( !maux->als_used[map[k]] ) n++;
+        size_t size = nsmpl * n*(n+1)/2 * sizeof(int32_t);
+        if ( nstaged && size > args->max_site_mem )
+        {
+            buf->rec[buf->cur].skip = 0;    // not done, leave for the next record
+            buf->cur = -1;
+            continue;
+        }
+        for (k=1; k<line->n_allele; k++) maux->als_used[map[k]] = 1;
+        nals = n;
+        nstaged++;
+    }
+}
+
 /*
    Select records that have the same alleles; the input ordering of indels
    must not matter. Multiple VCF lines can be emitted from this loop.
@@ -2220,6 +2287,8 @@ void stage_line(args_t *args)
         }
     }
     assert( nout );
+
+    if ( args->max_site_mem ) bound_staged_lines(args);
 }
 
 void merge_line(args_t *args)
@@ -2229,6 +2298,7 @@ void merge_line(args_t *args)
         if ( !regidx_overlap(args->regs,args->maux->chr,args->maux->pos,args->maux->pos,NULL) ) return;
     }
 
+    uint64_t t0 = profile_begin();
     bcf1_t *out = args->out_line;
     merge_chrom2qual(args, out);
     merge_filter(args, out);
@@ -2236,7 +2306,8 @@ void merge_line(args_t *args)
     if ( args->do_gvcf )
         bcf_update_info_int32(args->out_hdr, out, "END", NULL, 0);
     merge_format(args, out);
-    bcf_write1(args->out_fh, args->out_hdr, out);
+    profile_end(PROF_MERGE, t0);
+    out_idx_write(args->out_idx, args->out_fh, args->out_hdr, out);
     bcf_clear1(out);
 }
 
@@ -2265,6 +2336,123 @@ void bcf_hdr_append_version(bcf_hdr_t *hdr, int argc, char **argv, const char *c
     bcf_hdr_sync(hdr);
 }
 
+/*
+    Merge all records available in args->files and write them to args->out_fh
+    using args->out_hdr. The merge context is private to args, which allows to
+    run independent merges on disjoint parts of the genome in parallel.
+*/
+static void merge_records(args_t *args)
+{
+    if ( args->collapse==COLLAPSE_NONE ) args->vcmp = vcmp_init();
+    args->maux = maux_init(args);
+    args->out_line = bcf_init1();
+    args->tmph = kh_init(strdict);
+
+    while ( profile_sr_next_line(args->files) )
+    {
+        // output cached gVCF blocks which end before the new record
+        if ( args->do_gvcf )
+            gvcf_flush(args,0);
+
+        maux_reset(args->maux);
+
+        // determine which of the new records are gvcf blocks
+        if ( args->do_gvcf )
+            gvcf_stage(args, args->maux->pos);
+
+        while ( can_merge(args) )
+        {
+            stage_line(args);
+            merge_line(args);
+        }
+        clean_buffer(args);
+        // debug_state(args);
+
+        // do not keep the buffer of an oversized site for the rest of the run
+        if ( args->max_site_mem && args->maux->ntmp_arr > args->max_site_mem )
+        {
+            free(args->maux->tmp_arr);
+            args->maux->tmp_arr  = NULL;
+            args->maux->ntmp_arr = 0;
+        }
+    }
+    if ( args->do_gvcf )
+        gvcf_flush(args,1);
+
+    maux_destroy(args->maux);
+    bcf_destroy1(args->out_line);
+    kh_destroy(strdict, args->tmph);
+    if ( args->vcmp ) vcmp_destroy(args->vcmp);
+    args->maux = NULL;
+    args->out_line = NULL;
+    args->tmph = NULL;
+    args->vcmp = NULL;
+}
+
+/*
+    Merge one sequence in a private copy of the merge context, writing the
+    result to the shard's temporary BCF. The shards never split a sequence,
+    therefore no gVCF block can cross a shard boundary.
+*/
+static void merge_shard(void *data, shard_t *shard, htsFile *fh)
+{
+    args_t *main_args = (args_t*) data;
+    args_t tmp = *main_args, *args = &tmp;
+    int i;
+
+    args->out_idx = NULL;   // only the final output is indexed
+    args->files = bcf_sr_init();
+    args->files->require_index = 1;
+    args->files->apply_filters = main_args->files->apply_filters;
+    shard_set_regions(args->files, shard, args->regs);
+    if ( args->regs ) args->regs_itr = regitr_init(args->regs);
+
+    for (i=0; i<main_args->files->nreaders; i++)
+    {
+        const char *fname = main_args->files->readers[i].fname;
+        if ( !bcf_sr_add_reader(args->files, fname) ) error("Failed to open %s: %s\n", fname,bcf_sr_strerror(args->files->errnum));
+    }
+    if ( args->gvcf_fname )
+    {
+        args->gvcf_fai = fai_load(args->gvcf_fname);
+        if ( !args->gvcf_fai ) error("Failed to load the fai index: %s\n", args->gvcf_fname);
+    }
+    args->rules  = NULL;
+    args->nrules = 0;
+    info_rules_init(args);
+    memset(&args->tmps, 0, sizeof(args->tmps));
+
+    args->out_fh = fh;
+    merge_records(args);
+
+    info_rules_destroy(args);
+    if ( args->tmps.m ) free(args->tmps.s);
+    if ( args->gvcf_fai ) fai_destroy(args->gvcf_fai);
+    if ( args->regs_itr ) regitr_destroy(args->regs_itr);
+    bcf_sr_destroy(args->files);
+}
+
+static void write_shard_rec(void *data, bcf1_t *rec)
+{
+    args_t *args = (args_t*) data;
+    out_idx_write(args->out_idx, args->out_fh, args->out_hdr, rec);
+}
+
+/*
+    The --shard-threads mode: run independent merges per sequence on worker
+    threads. The sequences are those with any records in at least one of the
+    readers, in the order the synced reader would visit them.
+*/
+static void merge_shards(args_t *args)
+{
+    int i;
+    shards_t *shards = shards_init("merge");
+    for (i=0; i<args->files->nreaders; i++)
+        shards_add_seqs(shards, &args->files->readers[i], args->regs);
+    shards_run(shards, args->shard_threads, args->out_hdr, NULL, merge_shard, NULL, write_shard_rec, args);
+    shards_destroy(shards);
+}
+
 void merge_vcf(args_t *args)
 {
     args->out_fh  = hts_open(args->output_fname, hts_bcf_wmode(args->output_type));
@@ -2297,43 +2485,19 @@ void merge_vcf(args_t *args)
         hts_close(args->out_fh);
         return;
     }
+    if ( args->write_index ) args->out_idx = out_idx_init(args->out_fh, args->out_hdr, args->output_fname);
 
-    if ( args->collapse==COLLAPSE_NONE ) args->vcmp = vcmp_init();
-    args->maux = maux_init(args);
-    args->out_line = bcf_init1();
-    args->tmph = kh_init(strdict);
-
-    while ( bcf_sr_next_line(args->files) )
+    if ( args->shard_threads )
+        merge_shards(args);
+    else
     {
-        // output cached gVCF blocks which end before the new record
-        if ( args->do_gvcf )
-            gvcf_flush(args,0);
-
-        maux_reset(args->maux);
-
-        // determine which of the new records are gvcf blocks
-        if ( args->do_gvcf )
-            gvcf_stage(args, args->maux->pos);
-
-        while ( can_merge(args) )
-        {
-            stage_line(args);
-            merge_line(args);
-        }
-        clean_buffer(args);
-        // debug_state(args);
+        merge_records(args);
+        if ( args->tmps.m ) free(args->tmps.s);
     }
-    if ( args->do_gvcf )
-        gvcf_flush(args,1);
 
     info_rules_destroy(args);
-    maux_destroy(args->maux);
+    out_idx_close(args->out_idx, args->out_fh);
     bcf_hdr_destroy(args->out_hdr);
-    hts_close(args->out_fh);
-    bcf_destroy1(args->out_line);
-    kh_destroy(strdict, args->tmph);
-    if ( args->tmps.m ) free(args->tmps.s);
-    if ( args->vcmp ) vcmp_destroy(args->vcmp);
 }
 
 static void usage(void)
@@ -2355,12 +2519,15 @@ static void usage(void)
     fprintf(stderr, "    -i, --info-rules <tag:method,..>   rules for merging INFO fields (method is one of sum,avg,min,max,join) or \"-\" to turn off the default [DP:sum,DP4:sum]\n");
     fprintf(stderr, "    -l, --file-list <file>             read file names from the file\n");
     fprintf(stderr, "    -m, --merge <string>               allow multiallelic records for <snps|indels|both|all|none|id>, see man page for details [both]\n");
+    fprintf(stderr, "        --max-site-mem <int[kMG]>      split sites whose merged FORMAT fields would exceed the size into several records [no limit]\n");
     fprintf(stderr, "        --no-version                   do not append version and command line to the header\n");
     fprintf(stderr, "    -o, --output <file>                write output to a file [standard output]\n");
     fprintf(stderr, "    -O, --output-type <b|u|z|v>        'b' compressed BCF; 'u' uncompressed BCF; 'z' compressed VCF; 'v' uncompressed VCF [v]\n");
     fprintf(stderr, "    -r, --regions <region>             restrict to comma-separated list of regions\n");
     fprintf(stderr, "    -R, --regions-file <file>          restrict to regions listed in a file\n");
+    fprintf(stderr, "        --shard-threads <int>          merge sequences independently in <int> worker threads [0]\n");
     fprintf(stderr, "        --threads <int>                number of extra output compression threads [0]\n");
+    fprintf(stderr, "        --write-index                  index the compressed output on the fly, the index is written to <file>.csi\n");
     fprintf(stderr, "\n");
     exit(1);
 }
@@ -2377,6 +2544,7 @@ int main_vcfmerge(int argc, char *argv[])
     args->record_cmd_line = 1;
     args->collapse = COLLAPSE_BOTH;
     int regions_is_file = 0;
+    char *tmp;
 
     static struct option loptions[] =
     {
@@ -2392,6 +2560,9 @@ int main_vcfmerge(int argc, char *argv[])
         {"output",required_argument,NULL,'o'},
         {"output-type",required_argument,NULL,'O'},
         {"threads",required_argument,NULL,9},
+        {"shard-threads",required_argument,NULL,10},
+        {"write-index",no_argument,NULL,11},
+        {"max-site-mem",required_argument,NULL,12},
         {"regions",required_argument,NULL,'r'},
         {"regions-file",required_argument,NULL,'R'},
         {"info-rules",required_argument,NULL,'i'},
@@ -2411,6 +2582,7 @@ int main_vcfmerge(int argc, char *argv[])
                 args->do_gvcf = 1;
                 if ( strcmp("-",optarg) )
                 {
+                    args->gvcf_fname = optarg;
                     args->gvcf_fai = fai_load(optarg);
                     if ( !args->gvcf_fai ) error("Failed to load the fai index: %s\n", optarg);
                 }
@@ -2445,6 +2617,21 @@ int main_vcfmerge(int argc, char *argv[])
             case  2 : args->header_only = 1; break;
             case  3 : args->force_samples = 1; break;
             case  9 : args->n_threads = strtol(optarg, 0, 0); break;
+            case 10 :
+                args->shard_threads = strtol(optarg, &tmp, 10);
+                if ( *tmp || args->shard_threads<0 ) error("Could not parse argument: --shard-threads %s\n", optarg);
+                break;
+            case 11 : args->write_index = 1; break;
+            case 12 :
+                {
+                    double mem = strtod(optarg, &tmp);
+                    if ( *tmp=='k' || *tmp=='K' ) mem *= 1<<10, tmp++;
+                    else if ( *tmp=='m' || *tmp=='M' ) mem *= 1<<20, tmp++;
+                    else if ( *tmp=='g' || *tmp=='G' ) mem *= 1<<30, tmp++;
+                    if ( tmp==optarg || *tmp || mem<=0 ) error("Could not parse argument: --max-site-mem %s\n", optarg);
+                    args->max_site_mem = mem;
+                }
+                break;
             case  8 : args->record_cmd_line = 0; break;
             case 'h':
             case '?': usage();
@@ -34,8 +34,13 @@ THE SOFTWARE.  */
 #include <htslib/vcf.h>
 #include <htslib/synced_bcf_reader.h>
 #include <htslib/faidx.h>
+#include <htslib/khash_str2int.h>
 #include "bcftools.h"
 #include "rbuf.h"
+#include "refwin.h"
+#include "shard.h"
+#include "regidx.h"
+#include "profile.h"
 
 #define CHECK_REF_EXIT 0
 #define CHECK_REF_WARN 1
@@ -66,6 +71,9 @@ typedef struct
     int ntmp_arr1, ntmp_arr2;
     kstring_t *tmp_str;
     kstring_t *tmp_als, tmp_als_str;
+    int *split_idx, msplit_idx;     // -m-: per-ALT source indexes, see split_format_numeric()
+    void *als_hash;         // -m+: uppercase ALT alleles merged so far, see merge_alleles_hash()
+    kstring_t als_key;
     int ntmp_als;
     rbuf_t rbuf;
     int buf_win;            // maximum distance between two records to consider
@@ -74,10 +82,14 @@ typedef struct
     bcf_hdr_t *hdr;
     faidx_t *fai;
     struct { int tot, set, swap; } nref;
+    refwin_t *refwin;       // sequential reads of the reference, see fetch_ref()
+    kstring_t ref_str;
     char **argv, *output_fname, *ref_fname, *vcf_fname, *region, *targets;
     int argc, rmdup, output_type, n_threads, check_ref, strict_filter, do_indels;
     int nchanged, nskipped, nsplit, ntotal, mrows_op, mrows_collapse, parsimonious;
-    int record_cmd_line;
+    int record_cmd_line, shard_threads, targets_is_file, write_index;
+    out_idx_t *out_idx;     // --write-index, NULL in the --shard-threads workers
+    regidx_t *regs;         // the -r/-R regions, used to set up the --shard-threads shards
 }
 args_t;
 
@@ -92,6 +104,27 @@ static inline int replace_iupac_codes(char *seq, int nseq)
     }
     return n;
 }
+// Size of the reference window loaded on a cache miss: a little before the requested
+// position for the realign() left padding, the rest ahead as the stream moves forward
+#define REF_WIN_BEFORE 1000
+#define REF_WIN_AFTER  100000
+
+/*
+    Returns a NUL-terminated reference sequence beg..end (0-based, inclusive) with
+    ambiguity codes replaced by N, clipped to the sequence end the same way as
+    faidx_fetch_seq. The returned buffer is owned by args and is valid until the
+    next call; the sequence is served from the window of refwin_fetch().
+*/
+static char *fetch_ref(args_t *args, int rid, int beg, int end, int *len)
+{
+    const char *chr = args->hdr->id[BCF_DT_CTG][rid].key;
+    const char *seq = refwin_fetch(args->refwin, chr, beg, end, len);
+    if ( !seq ) error("faidx_fetch_seq failed at %s:%d\n", chr,beg+1);
+    args->ref_str.l = 0;
+    kputsn(seq, *len, &args->ref_str);
+    replace_iupac_codes(args->ref_str.s,*len);  // any non-ACGT character in fasta ref is replaced with N
+    return args->ref_str.s;
+}
 static inline int has_non_acgtn(char *seq, int nseq)
 {
     char *end = nseq ? seq + nseq : seq + UINT32_MAX;   // arbitrary large number
@@ -114,21 +147,18 @@ static void fix_ref(args_t *args, bcf1_t *line)
         if ( maxlen < len ) maxlen = len;
     }
 
-    char *ref = faidx_fetch_seq(args->fai, (char*)bcf_seqname(args->hdr,line), line->pos, line->pos+maxlen-1, &len);
-    if ( !ref ) error("faidx_fetch_seq failed at %s:%d\n", bcf_seqname(args->hdr,line),line->pos+1);
-    replace_iupac_codes(ref,len);
+    char *ref = fetch_ref(args, line->rid, line->pos, line->pos+maxlen-1, &len);
 
     args->nref.tot++;
 
     // is the REF different?
-    if ( !strncasecmp(line->d.allele[0],ref,reflen) ) { free(ref); return; }
+    if ( !strncasecmp(line->d.allele[0],ref,reflen) ) return;
 
     // is the REF allele missing or N?
     if ( reflen==1 && (line->d.allele[0][0]=='.' || line->d.allele[0][0]=='N' || line->d.allele[0][0]=='n') ) 
     { 
         line->d.allele[0][0] = ref[0]; 
         args->nref.set++; 
-        free(ref);
         bcf_update_alleles(args->hdr,line,(const char**)line->d.allele,line->n_allele);
         return;
     }
@@ -138,7 +168,7 @@ static void fix_ref(args_t *args, bcf1_t *line)
     {
         args->nref.set++;
         bcf_update_alleles(args->hdr,line,(const char**)line->d.allele,line->n_allele);
-        if ( !strncasecmp(line->d.allele[0],ref,reflen) ) { free(ref); return; }
+        if ( !strncasecmp(line->d.allele[0],ref,reflen) ) return;
     }
 
     // is it swapped?
@@ -170,7 +200,6 @@ static void fix_ref(args_t *args, bcf1_t *line)
     }
     else
         args->nref.swap++;
-    free(ref);
 
     // swap the alleles
     int j;
@@ -272,9 +301,7 @@ static int realign(args_t *args, bcf1_t *line)
 
     // Sanity check REF
     int i, nref, reflen = strlen(line->d.allele[0]);
-    char *ref = faidx_fetch_seq(args->fai, (char*)args->hdr->id[BCF_DT_CTG][line->rid].key, line->pos, line->pos+reflen-1, &nref);
-    if ( !ref ) error("faidx_fetch_seq failed at %s:%d\n", args->hdr->id[BCF_DT_CTG][line->rid].key, line->pos+1);
-    replace_iupac_codes(ref,nref);  // any non-ACGT character in fasta ref is replaced with N
+    char *ref = fetch_ref(args, line->rid, line->pos, line->pos+reflen-1, &nref);
 
     // does VCF REF contain non-standard bases?
     if ( has_non_acgtn(line->d.allele[0],reflen) )
@@ -283,7 +310,6 @@ static int realign(args_t *args, bcf1_t *line)
             error("Non-ACGTN reference allele at %s:%d .. REF_SEQ:'%s' vs VCF:'%s'\n", bcf_seqname(args->hdr,line),line->pos+1,ref,line->d.allele[0]);
         if ( args->check_ref & CHECK_REF_WARN )
             fprintf(stderr,"NON_ACGTN_REF\t%s\t%d\t%s\n", bcf_seqname(args->hdr,line),line->pos+1,line->d.allele[0]);
-        free(ref);
         return ERR_REF_MISMATCH;
     }
     if ( strcasecmp(ref,line->d.allele[0]) )
@@ -292,10 +318,8 @@ static int realign(args_t *args, bcf1_t *line)
             error("Reference allele mismatch at %s:%d .. REF_SEQ:'%s' vs VCF:'%s'\n", bcf_seqname(args->hdr,line),line->pos+1,ref,line->d.allele[0]);
         if ( args->check_ref & CHECK_REF_WARN )
             fprintf(stderr,"REF_MISMATCH\t%s\t%d\t%s\n", bcf_seqname(args->hdr,line),line->pos+1,line->d.allele[0]);
-        free(ref);
         return ERR_REF_MISMATCH;
     }
-    free(ref);
     ref = NULL;
 
     if ( line->n_allele == 1 ) return ERR_OK;    // a REF
@@ -346,10 +370,7 @@ static int realign(args_t *args, bcf1_t *line)
         if ( pad_from_left )
         {
             int npad = line->pos >= args->aln_win ? args->aln_win : line->pos;
-            free(ref);
-            ref = faidx_fetch_seq(args->fai, (char*)args->hdr->id[BCF_DT_CTG][line->rid].key, line->pos-npad, line->pos-1, &nref);
-            if ( !ref ) error("faidx_fetch_seq failed at %s:%d\n", args->hdr->id[BCF_DT_CTG][line->rid].key, line->pos-npad+1);
-            replace_iupac_codes(ref,nref);
+            ref = fetch_ref(args, line->rid, line->pos-npad, line->pos-1, &nref);
             for (i=0; i<line->n_allele; i++)
             {
                 ks_resize(&als[i], als[i].l + npad);
@@ -360,7 +381,6 @@ static int realign(args_t *args, bcf1_t *line)
             line->pos -= npad;
         }
     }
-    free(ref);
 
     // trim from left
     int ntrim_left = 0;
@@ -534,32 +554,47 @@ static void split_info_flag(args_t *args, bcf1_t *src, bcf_info_t *info, int ial
     bcf_update_info_flag(args->hdr,dst,tag,NULL,ret);
 }
 
-static void split_format_genotype(args_t *args, bcf1_t *src, bcf_fmt_t *fmt, int ialt, bcf1_t *dst)
+/*
+ *  The FORMAT/GT and numeric fields are split into all the biallelic
+ *  records at once: the values are decoded only once per site rather than
+ *  once per ALT allele, and each sample's values are gathered into all
+ *  outputs in a single pass, using per-ALT indexes precomputed for the site.
+ */
+static void split_format_genotype(args_t *args, bcf1_t *src, bcf_fmt_t *fmt, bcf1_t **dst, int ndst)
 {
     int ntmp = args->ntmp_arr1 / 4;
     int ngts = bcf_get_genotypes(args->hdr,src,&args->tmp_arr1,&ntmp);
     args->ntmp_arr1 = ntmp * 4;
     assert( ngts >0 );
 
-    int32_t *gt = (int32_t*) args->tmp_arr1;
-    int i, j, nsmpl = bcf_hdr_nsamples(args->hdr);
+    int i, j, ialt, nsmpl = bcf_hdr_nsamples(args->hdr);
+    size_t stride = ngts;
+    hts_expand(uint8_t,sizeof(int32_t)*ndst*stride,args->ntmp_arr2,args->tmp_arr2);
+    int32_t *gt = (int32_t*) args->tmp_arr1, *out = (int32_t*) args->tmp_arr2;
     ngts /= nsmpl;
     for (i=0; i<nsmpl; i++)
     {
-        for (j=0; j<ngts; j++)
+        for (j=0; j<ngts; j++,gt++,out++)
         {
-            if ( gt[j]==bcf_int32_vector_end ) break;
-            if ( bcf_gt_is_missing(gt[j]) || bcf_gt_allele(gt[j])==0 ) continue; // missing allele or ref: leave as is
-            if ( bcf_gt_allele(gt[j])==ialt+1 )
-                gt[j] = bcf_gt_unphased(1) | bcf_gt_is_phased(gt[j]); // set to first ALT
-            else
-                gt[j] = bcf_gt_unphased(0) | bcf_gt_is_phased(gt[j]); // set to REF
+            if ( *gt==bcf_int32_vector_end ) break;
+            if ( bcf_gt_is_missing(*gt) || bcf_gt_allele(*gt)==0 ) // missing allele or ref: leave as is
+            {
+                for (ialt=0; ialt<ndst; ialt++) out[ialt*stride] = *gt;
+                continue;
+            }
+            int32_t ref = bcf_gt_unphased(0) | bcf_gt_is_phased(*gt);    // set to REF
+            for (ialt=0; ialt<ndst; ialt++) out[ialt*stride] = ref;
+            int ial = bcf_gt_allele(*gt);
+            if ( ial>0 && ial<=ndst ) out[(ial-1)*stride] = bcf_gt_unphased(1) | bcf_gt_is_phased(*gt);    // set to first ALT
         }
-        gt += ngts;
+        for (; j<ngts; j++,gt++,out++)
+            for (ialt=0; ialt<ndst; ialt++) out[ialt*stride] = *gt;
     }
-    bcf_update_genotypes(args->hdr,dst,args->tmp_arr1,ngts*nsmpl);
+    out = (int32_t*) args->tmp_arr2;
+    for (ialt=0; ialt<ndst; ialt++)
+        bcf_update_genotypes(args->hdr,dst[ialt],out + ialt*stride,stride);
 }
-static void split_format_numeric(args_t *args, bcf1_t *src, bcf_fmt_t *fmt, int ialt, bcf1_t *dst)
+static void split_format_numeric(args_t *args, bcf1_t *src, bcf_fmt_t *fmt, bcf1_t **dst, int ndst)
 {
     #define BRANCH_NUMERIC(type,type_t,is_vector_end,set_vector_end) \
     { \
@@ -570,83 +605,81 @@ static void split_format_numeric(args_t *args, bcf1_t *src, bcf_fmt_t *fmt, int
         assert( nvals>0 ); \
         type_t *vals = (type_t *) args->tmp_arr1; \
         int len = bcf_hdr_id2length(args->hdr,BCF_HL_FMT,fmt->id); \
-        int i, nsmpl = bcf_hdr_nsamples(args->hdr); \
-        if ( nvals==nsmpl ) /* all values are missing */ \
+        int i, j, ialt, nsmpl = bcf_hdr_nsamples(args->hdr); \
+        if ( nvals==nsmpl || (len!=BCF_VL_A && len!=BCF_VL_R && len!=BCF_VL_G) ) /* all values are missing or not per-allele */ \
         { \
-            bcf_update_format_##type(args->hdr,dst,tag,vals,nsmpl); \
+            for (ialt=0; ialt<ndst; ialt++) bcf_update_format_##type(args->hdr,dst[ialt],tag,vals,nvals); \
             return; \
         } \
+        /* the source indexes of each ALT, diploid or A,R values first, then haploid */ \
+        hts_expand(int,6*ndst,args->msplit_idx,args->split_idx); \
+        int *idx = args->split_idx, nout, all_haploid = 0; \
         if ( len==BCF_VL_A ) \
         { \
             if ( nvals!=(src->n_allele-1)*nsmpl ) \
                 error("Error: wrong number of fields in FMT/%s at %s:%d, expected %d, found %d\n", \
                     tag,bcf_seqname(args->hdr,src),src->pos+1,(src->n_allele-1)*nsmpl,nvals); \
-            nvals /= nsmpl; \
-            type_t *src_vals = vals, *dst_vals = vals; \
-            for (i=0; i<nsmpl; i++) \
-            { \
-                dst_vals[0] = src_vals[ialt]; \
-                dst_vals += 1; \
-                src_vals += nvals; \
-            } \
-            bcf_update_format_##type(args->hdr,dst,tag,vals,nsmpl); \
+            nout = 1; \
+            for (ialt=0; ialt<ndst; ialt++) idx[6*ialt] = ialt; \
         } \
         else if ( len==BCF_VL_R ) \
         { \
             if ( nvals!=src->n_allele*nsmpl ) \
                 error("Error: wrong number of fields in FMT/%s at %s:%d, expected %d, found %d\n", \
                     tag,bcf_seqname(args->hdr,src),src->pos+1,src->n_allele*nsmpl,nvals); \
-            nvals /= nsmpl; \
-            type_t *src_vals = vals, *dst_vals = vals; \
-            for (i=0; i<nsmpl; i++) \
-            { \
-                dst_vals[0] = src_vals[0]; \
-                dst_vals[1] = src_vals[ialt+1]; \
-                dst_vals += 2; \
-                src_vals += nvals; \
-            } \
-            bcf_update_format_##type(args->hdr,dst,tag,vals,nsmpl*2); \
+            nout = 2; \
+            for (ialt=0; ialt<ndst; ialt++) { idx[6*ialt] = 0; idx[6*ialt+1] = ialt+1; } \
         } \
-        else if ( len==BCF_VL_G ) \
+        else \
         { \
             if ( nvals!=src->n_allele*(src->n_allele+1)/2*nsmpl && nvals!=src->n_allele*nsmpl ) \
                 error("Error at %s:%d, the tag %s has wrong number of fields\n", bcf_seqname(args->hdr,src),src->pos+1,bcf_hdr_int2id(args->hdr,BCF_DT_ID,fmt->id)); \
-            nvals /= nsmpl; \
-            int all_haploid = nvals==src->n_allele ? 1 : 0; \
-            type_t *src_vals = vals, *dst_vals = vals; \
-            for (i=0; i<nsmpl; i++) \
+            all_haploid = nvals==src->n_allele*nsmpl ? 1 : 0; \
+            nout = all_haploid ? 2 : 3; \
+            for (ialt=0; ialt<ndst; ialt++) \
             { \
-                int haploid = all_haploid; \
-                if ( !haploid ) \
-                { \
-                    int j; \
-                    for (j=0; j<nvals; j++) if ( is_vector_end ) break; \
-                    if ( j!=nvals ) haploid = 1; \
-                } \
-                dst_vals[0] = src_vals[0]; \
-                if ( haploid ) \
-                { \
-                    dst_vals[1] = src_vals[ialt+1]; \
-                    if ( !all_haploid ) set_vector_end; \
-                } \
-                else \
-                { \
-                    dst_vals[1] = src_vals[bcf_alleles2gt(0,ialt+1)]; \
-                    dst_vals[2] = src_vals[bcf_alleles2gt(ialt+1,ialt+1)]; \
-                } \
-                dst_vals += all_haploid ? 2 : 3; \
-                src_vals += nvals; \
+                idx[6*ialt]   = 0; \
+                idx[6*ialt+1] = bcf_alleles2gt(0,ialt+1); \
+                idx[6*ialt+2] = bcf_alleles2gt(ialt+1,ialt+1); \
+                idx[6*ialt+3] = 0; \
+                idx[6*ialt+4] = ialt+1; \
             } \
-            bcf_update_format_##type(args->hdr,dst,tag,vals,all_haploid ? nsmpl*2 : nsmpl*3); \
         } \
-        else \
-            bcf_update_format_##type(args->hdr,dst,tag,vals,nvals); \
+        nvals /= nsmpl; \
+        size_t stride = (size_t)nsmpl*nout; \
+        hts_expand(uint8_t,sizeof(type_t)*ndst*stride,args->ntmp_arr2,args->tmp_arr2); \
+        type_t *out = (type_t*) args->tmp_arr2, *src_vals = vals; \
+        for (i=0; i<nsmpl; i++) \
+        { \
+            int haploid = all_haploid, ngather = nout; \
+            if ( len==BCF_VL_G && !haploid ) \
+            { \
+                for (j=0; j<nvals; j++) if ( is_vector_end(src_vals[j]) ) break; \
+                if ( j!=nvals ) { haploid = 1; ngather = 2; } \
+            } \
+            const int *map = idx + (haploid ? 3 : 0); \
+            type_t *dst_vals = out + i*nout; \
+            for (ialt=0; ialt<ndst; ialt++) \
+            { \
+                for (j=0; j<ngather; j++) dst_vals[j] = src_vals[map[j]]; \
+                if ( haploid && !all_haploid ) set_vector_end(dst_vals[2]); \
+                dst_vals += stride; \
+                map += 6; \
+            } \
+            src_vals += nvals; \
+        } \
+        for (ialt=0; ialt<ndst; ialt++) \
+            bcf_update_format_##type(args->hdr,dst[ialt],tag,out + ialt*stride,stride); \
     }
+    #define INT32_IS_VECTOR_END(x) ((x)==bcf_int32_vector_end)
+    #define INT32_SET_VECTOR_END(x) ((x)=bcf_int32_vector_end)
     switch (bcf_hdr_id2type(args->hdr,BCF_HL_FMT,fmt->id))
     {
-        case BCF_HT_INT:  BRANCH_NUMERIC(int32, int32_t, src_vals[j]==bcf_int32_vector_end, dst_vals[2]=bcf_int32_vector_end); break;
-        case BCF_HT_REAL: BRANCH_NUMERIC(float, float, bcf_float_is_vector_end(src_vals[j]), bcf_float_set_vector_end(dst_vals[2])); break;
+        case BCF_HT_INT:  BRANCH_NUMERIC(int32, int32_t, INT32_IS_VECTOR_END, INT32_SET_VECTOR_END); break;
+        case BCF_HT_REAL: BRANCH_NUMERIC(float, float, bcf_float_is_vector_end, bcf_float_set_vector_end); break;
     }
+    #undef INT32_IS_VECTOR_END
+    #undef INT32_SET_VECTOR_END
     #undef BRANCH_NUMERIC
 }
 static void squeeze_format_char(char *str, int src_blen, int dst_blen, int n)
@@ -805,16 +838,19 @@ static void split_multiallelic_to_biallelics(args_t *args, bcf1_t *line)
         }
 
         dst->n_sample = line->n_sample;
-        for (j=0; j<line->n_fmt; j++)
-        {
-            bcf_fmt_t *fmt = &line->d.fmt[j];
-            int type = bcf_hdr_id2type(args->hdr,BCF_HL_FMT,fmt->id);
-            if ( fmt->id==gt_id ) split_format_genotype(args, line, fmt, i, dst);
-            else if ( type==BCF_HT_INT || type==BCF_HT_REAL ) split_format_numeric(args, line, fmt, i, dst);
-            else split_format_string(args, line, fmt, i, dst);
-        }
     }
     free(tmp.s);
+
+    // the FORMAT fields are added in the same order to all records
+    for (i=0; i<line->n_fmt; i++)
+    {
+        bcf_fmt_t *fmt = &line->d.fmt[i];
+        int j, type = bcf_hdr_id2type(args->hdr,BCF_HL_FMT,fmt->id);
+        if ( fmt->id==gt_id ) split_format_genotype(args, line, fmt, args->tmp_lines, args->ntmp_lines);
+        else if ( type==BCF_HT_INT || type==BCF_HT_REAL ) split_format_numeric(args, line, fmt, args->tmp_lines, args->ntmp_lines);
+        else
+            for (j=0; j<args->ntmp_lines; j++) split_format_string(args, line, fmt, j, args->tmp_lines[j]);
+    }
 }
 
 // Enlarge FORMAT array containing nsmpl samples each with nals_ori values
@@ -1337,6 +1373,182 @@ static void merge_format_string(args_t *args, bcf1_t **lines, int nlines, bcf_fm
     bcf_update_format_char(args->hdr,dst,tag,str.s,str.l);
 }
 
+/*
+ *  Merge FORMAT/GT and the numeric Number=A,R,G fields directly from the
+ *  packed values of the records: each value is converted and written to its
+ *  final place in a single output array, which is then set in one go. The
+ *  result is the same as with merge_format_genotype() and
+ *  merge_format_numeric(). Returns -1 without touching dst if the field
+ *  must be merged by those, i.e. for other lengths, haploid or mixed ploidy
+ *  Number=G fields, or records which lack GT.
+ */
+static int merge_format_direct(args_t *args, bcf1_t **lines, int nlines, bcf_fmt_t *fmt, bcf1_t *dst, int is_gt)
+{
+    int type = bcf_hdr_id2type(args->hdr,BCF_HL_FMT,fmt->id);
+    int len  = bcf_hdr_id2length(args->hdr,BCF_HL_FMT,fmt->id);
+    if ( !is_gt && ((type!=BCF_HT_INT && type!=BCF_HT_REAL) || (len!=BCF_VL_A && len!=BCF_VL_R && len!=BCF_VL_G)) ) return -1;
+
+    int i, j, k, nsmpl = bcf_hdr_nsamples(args->hdr), nvals;
+    if ( is_gt ) nvals = fmt->n;
+    else if ( len==BCF_VL_A ) nvals = dst->n_allele - 1;
+    else if ( len==BCF_VL_R ) nvals = dst->n_allele;
+    else nvals = dst->n_allele*(dst->n_allele+1)/2;
+
+    // check the lengths first, the generic functions error out or handle ploidy
+    for (i=0; i<nlines; i++)
+    {
+        bcf_fmt_t *src = i ? bcf_get_fmt_id(lines[i], fmt->id) : fmt;
+        if ( !src ) { if ( is_gt ) return -1; continue; }
+        int nals = lines[i]->n_allele;
+        int nexp = is_gt ? fmt->n : (len==BCF_VL_A ? nals - 1 : (len==BCF_VL_R ? nals : nals*(nals+1)/2));
+        if ( src->n!=nexp ) return -1;
+        if ( !is_gt && (src->type==BCF_BT_FLOAT)!=(type==BCF_HT_REAL) ) return -1;
+    }
+    int32_t vector_end = type==BCF_HT_REAL && !is_gt ? (int32_t)bcf_float_vector_end : bcf_int32_vector_end;
+
+    int nbytes = sizeof(int32_t)*nsmpl*nvals;
+    hts_expand(uint8_t,nbytes,args->ntmp_arr1,args->tmp_arr1);
+    int32_t *out = (int32_t*) args->tmp_arr1;
+    if ( type==BCF_HT_REAL && !is_gt )
+        for (j=0; j<nsmpl*nvals; j++) bcf_float_set_missing(((float*)out)[j]);
+    else if ( !is_gt )
+        for (j=0; j<nsmpl*nvals; j++) out[j] = bcf_int32_missing;
+
+    // the values converted to int32, the floats are copied bitwise
+    #define GET_VAL(dst_val, type_t, src_missing, src_vector_end) \
+    { \
+        type_t v; memcpy(&v, p + sizeof(type_t)*k, sizeof(type_t)); \
+        dst_val = v==src_missing ? bcf_int32_missing : (v==src_vector_end ? bcf_int32_vector_end : v); \
+    }
+    #define READ_VAL(dst_val) \
+    { \
+        switch (src->type) \
+        { \
+            case BCF_BT_INT8:  GET_VAL(dst_val, int8_t, bcf_int8_missing, bcf_int8_vector_end); break; \
+            case BCF_BT_INT16: GET_VAL(dst_val, int16_t, bcf_int16_missing, bcf_int16_vector_end); break; \
+            default: memcpy(&dst_val, p + 4*k, 4); break; \
+        } \
+    }
+    for (i=0; i<nlines; i++)
+    {
+        bcf_fmt_t *src = i ? bcf_get_fmt_id(lines[i], fmt->id) : fmt;
+        if ( !src ) continue;
+        int *map = args->maps[i].map, nals = lines[i]->n_allele;
+        for (j=0; j<nsmpl; j++)
+        {
+            const uint8_t *p = src->p + j*src->size;
+            int32_t *dst_vals = out + j*nvals, val;
+            if ( !i )
+            {
+                // the first record's alleles keep their indexes, the values are copied as they are
+                for (k=0; k<src->n; k++) READ_VAL(dst_vals[k]);
+                continue;
+            }
+            if ( is_gt )
+            {
+                for (k=0; k<src->n; k++)
+                {
+                    READ_VAL(val);
+                    if ( val==vector_end ) break;
+                    if ( val<0 || bcf_gt_is_missing(val) || bcf_gt_allele(val)==0 ) continue;
+                    int ial = bcf_gt_allele(val);
+                    if ( ial>=nals ) error("Error at %s:%d: incorrect allele index %d\n",bcf_seqname(args->hdr,lines[i]),lines[i]->pos+1,ial);
+                    dst_vals[k] = bcf_gt_unphased(map[ial]) | bcf_gt_is_phased(dst_vals[k]);
+                }
+            }
+            else if ( len==BCF_VL_A )
+            {
+                for (k=0; k<src->n; k++)
+                {
+                    READ_VAL(val);
+                    if ( val==vector_end ) break;
+                    dst_vals[ map[k+1] - 1 ] = val;
+                }
+            }
+            else if ( len==BCF_VL_R )
+            {
+                for (k=0; k<src->n; k++)
+                {
+                    READ_VAL(val);
+                    if ( val==vector_end ) break;
+                    dst_vals[ map[k] ] = val;
+                }
+            }
+            else
+            {
+                int ia, ib;
+                k = 0;
+                for (ia=0; ia<nals; ia++)
+                    for (ib=0; ib<=ia; ib++)
+                    {
+                        READ_VAL(val);
+                        if ( val==vector_end ) return -1;     // haploid sample
+                        dst_vals[ bcf_alleles2gt(map[ia],map[ib]) ] = val;
+                        k++;
+                    }
+            }
+        }
+    }
+    #undef READ_VAL
+    #undef GET_VAL
+
+    // a haploid sample in the first record
+    if ( !is_gt && len==BCF_VL_G )
+        for (j=0; j<nsmpl*nvals; j++)
+            if ( out[j]==vector_end ) return -1;
+
+    const char *tag = bcf_hdr_int2id(args->hdr,BCF_DT_ID,fmt->id);
+    if ( is_gt ) bcf_update_genotypes(args->hdr,dst,out,nvals*nsmpl);
+    else if ( type==BCF_HT_INT ) bcf_update_format_int32(args->hdr,dst,tag,out,nvals*nsmpl);
+    else bcf_update_format_float(args->hdr,dst,tag,(float*)out,nvals*nsmpl);
+    return 0;
+}
+
+/*
+ *  When all records share the same REF, which is the common case of split
+ *  biallelic records, the ALT alleles are deduplicated by a hash of their
+ *  uppercase strings rather than by comparing each with all alleles merged
+ *  so far. The alleles are not copied. Returns -1 if the REFs differ.
+ */
+static int merge_alleles_hash(args_t *args, bcf1_t **lines, int nlines)
+{
+    int i, j;
+    for (i=1; i<nlines; i++)
+        if ( strcmp(lines[i]->d.allele[0],lines[0]->d.allele[0]) ) return -1;
+
+    khash_str2int_clear_free(args->als_hash);
+    args->nals = 0;
+    for (i=0; i<nlines; i++)
+    {
+        int *map;
+        args->maps[i].nals = lines[i]->n_allele;
+        hts_expand(int,args->maps[i].nals,args->maps[i].mals,args->maps[i].map);
+        map = args->maps[i].map;
+        map[0] = 0;
+        if ( !i )
+        {
+            hts_expand(char*,1,args->mals,args->als);
+            args->als[args->nals++] = lines[0]->d.allele[0];
+        }
+        for (j=1; j<lines[i]->n_allele; j++)
+        {
+            char *p, *al = lines[i]->d.allele[j];
+            args->als_key.l = 0;
+            kputs(al, &args->als_key);
+            for (p=args->als_key.s; *p; p++) *p = toupper(*p);
+
+            int idx;
+            if ( i && khash_str2int_get(args->als_hash, args->als_key.s, &idx)==0 ) { map[j] = idx; continue; }
+            map[j] = args->nals;
+            if ( !khash_str2int_has_key(args->als_hash, args->als_key.s) )
+                khash_str2int_set(args->als_hash, strdup(args->als_key.s), args->nals);
+            hts_expand(char*,args->nals+1,args->mals,args->als);
+            args->als[args->nals++] = al;
+        }
+    }
+    return 0;
+}
+
 char **merge_alleles(char **a, int na, int *map, char **b, int *nb, int *mb);   // see vcfmerge.c
 static void merge_biallelics_to_multiallelic(args_t *args, bcf1_t *dst, bcf1_t **lines, int nlines)
 {
@@ -1359,27 +1571,37 @@ static void merge_biallelics_to_multiallelic(args_t *args, bcf1_t *dst, bcf1_t *
 
     // Merge and set the alleles, create a mapping from source allele indexes to dst idxs
     hts_expand0(map_t,nlines,args->mmaps,args->maps);   // a mapping for each line
-    args->nals = args->maps[0].nals = lines[0]->n_allele;
-    hts_expand(int,args->maps[0].nals,args->maps[0].mals,args->maps[0].map);
-    hts_expand(char*,args->nals,args->mals,args->als);
-    for (i=0; i<args->maps[0].nals; i++)
+    if ( merge_alleles_hash(args, lines, nlines)==0 )
     {
-        args->maps[0].map[i] = i;
-        args->als[i] = strdup(lines[0]->d.allele[i]);
+        for (i=1; i<nlines; i++)
+            if (lines[i]->d.id[0]!='.' || lines[i]->d.id[1]) bcf_add_id(args->hdr, dst, lines[i]->d.id);
+        bcf_update_alleles(args->hdr, dst, (const char**)args->als, args->nals);
+        for (i=0; i<args->nals; i++) args->als[i] = NULL;
     }
-    for (i=1; i<nlines; i++)
-    {
-        if (lines[i]->d.id[0]!='.' || lines[i]->d.id[1]) bcf_add_id(args->hdr, dst, lines[i]->d.id);
-        args->maps[i].nals = lines[i]->n_allele;
-        hts_expand(int,args->maps[i].nals,args->maps[i].mals,args->maps[i].map);
-        args->als = merge_alleles(lines[i]->d.allele, lines[i]->n_allele, args->maps[i].map, args->als, &args->nals, &args->mals);
-        if ( !args->als ) error("Failed to merge alleles at %s:%d\n", bcf_seqname(args->hdr,dst),dst->pos+1);
-    }
-    bcf_update_alleles(args->hdr, dst, (const char**)args->als, args->nals);
-    for (i=0; i<args->nals; i++)
+    else
     {
-        free(args->als[i]);
-        args->als[i] = NULL;
+        args->nals = args->maps[0].nals = lines[0]->n_allele;
+        hts_expand(int,args->maps[0].nals,args->maps[0].mals,args->maps[0].map);
+        hts_expand(char*,args->nals,args->mals,args->als);
+        for (i=0; i<args->maps[0].nals; i++)
+        {
+            args->maps[0].map[i] = i;
+            args->als[i] = strdup(lines[0]->d.allele[i]);
+        }
+        for (i=1; i<nlines; i++)
+        {
+            if (lines[i]->d.id[0]!='.' || lines[i]->d.id[1]) bcf_add_id(args->hdr, dst, lines[i]->d.id);
+            args->maps[i].nals = lines[i]->n_allele;
+            hts_expand(int,args->maps[i].nals,args->maps[i].mals,args->maps[i].map);
+            args->als = merge_alleles(lines[i]->d.allele, lines[i]->n_allele, args->maps[i].map, args->als, &args->nals, &args->mals);
+            if ( !args->als ) error("Failed to merge alleles at %s:%d\n", bcf_seqname(args->hdr,dst),dst->pos+1);
+        }
+        bcf_update_alleles(args->hdr, dst, (const char**)args->als, args->nals);
+        for (i=0; i<args->nals; i++)
+        {
+            free(args->als[i]);
+            args->als[i] = NULL;
+        }
     }
 
     if ( lines[0]->d.n_flt ) bcf_update_filter(args->hdr, dst, lines[0]->d.flt, lines[0]->d.n_flt);
@@ -1417,6 +1639,7 @@ static void merge_biallelics_to_multiallelic(args_t *args, bcf1_t *dst, bcf1_t *
     {
         bcf_fmt_t *fmt = &lines[0]->d.fmt[i];
         int type = bcf_hdr_id2type(args->hdr,BCF_HL_FMT,fmt->id);
+        if ( merge_format_direct(args, lines, nlines, fmt, dst, fmt->id==gt_id)==0 ) continue;
         if ( fmt->id==gt_id ) merge_format_genotype(args, lines, nlines, fmt, dst);
         else if ( type==BCF_HT_INT || type==BCF_HT_REAL ) merge_format_numeric(args, lines, nlines, fmt, dst);
         else merge_format_string(args, lines, nlines, fmt, dst);
@@ -1502,7 +1725,7 @@ static void flush_buffer(args_t *args, htsFile *file, int n)
         {
             if ( mrows_ready_to_flush(args, args->lines[k]) )
             {
-                while ( (line=mrows_flush(args)) ) bcf_write1(file, args->hdr, line);
+                while ( (line=mrows_flush(args)) ) out_idx_write(args->out_idx, file, args->hdr, line);
             }
             int merge = 1;
             if ( args->mrows_collapse!=COLLAPSE_BOTH && args->mrows_collapse!=COLLAPSE_ANY )
@@ -1515,11 +1738,11 @@ static void flush_buffer(args_t *args, htsFile *file, int n)
                 continue;
             }
         }
-        bcf_write1(file, args->hdr, args->lines[k]);
+        out_idx_write(args->out_idx, file, args->hdr, args->lines[k]);
     }
     if ( args->mrows_op==MROWS_MERGE && !args->rbuf.n )
     {
-        while ( (line=mrows_flush(args)) ) bcf_write1(file, args->hdr, line);
+        while ( (line=mrows_flush(args)) ) out_idx_write(args->out_idx, file, args->hdr, line);
     }
 }
 
@@ -1532,12 +1755,14 @@ static void init_data(args_t *args)
     {
         args->fai = fai_load(args->ref_fname);
         if ( !args->fai ) error("Failed to load the fai index: %s\n", args->ref_fname);
+        args->refwin = refwin_init(args->fai, REF_WIN_BEFORE, REF_WIN_AFTER);
     }
     if ( args->mrows_op==MROWS_MERGE )
     {
         args->mrow_out = bcf_init1();
         args->tmp_str = (kstring_t*) calloc(bcf_hdr_nsamples(args->hdr),sizeof(kstring_t));
         args->diploid = (uint8_t*) malloc(bcf_hdr_nsamples(args->hdr));
+        args->als_hash = khash_str2int_init();
     }
 }
 
@@ -1562,6 +1787,9 @@ static void destroy_data(args_t *args)
         free(args->tmp_als[i].s);
     free(args->tmp_als);
     free(args->tmp_als_str.s);
+    if ( args->als_hash ) khash_str2int_destroy_free(args->als_hash);
+    free(args->als_key.s);
+    free(args->split_idx);
     if ( args->tmp_str )
     {
         for (i=0; i<bcf_hdr_nsamples(args->hdr); i++) free(args->tmp_str[i].s);
@@ -1574,6 +1802,8 @@ static void destroy_data(args_t *args)
     free(args->diploid);
     if ( args->mrow_out ) bcf_destroy1(args->mrow_out);
     if ( args->fai ) fai_destroy(args->fai);
+    refwin_destroy(args->refwin);
+    free(args->ref_str.s);
     if ( args->mseq ) free(args->seq);
 }
 
@@ -1619,17 +1849,10 @@ static void normalize_line(args_t *args, bcf1_t **line_ptr)
     }
 }
 
-static void normalize_vcf(args_t *args)
+static void normalize_records(args_t *args, htsFile *out)
 {
-    htsFile *out = hts_open(args->output_fname, hts_bcf_wmode(args->output_type));
-    if ( out == NULL ) error("Can't write to \"%s\": %s\n", args->output_fname, strerror(errno));
-    if ( args->n_threads )
-        hts_set_opt(out, HTS_OPT_THREAD_POOL, args->files->p);
-    if (args->record_cmd_line) bcf_hdr_append_version(args->hdr, args->argc, args->argv, "bcftools_norm");
-    bcf_hdr_write(out, args->hdr);
-
     int prev_rid = -1, prev_pos = -1, prev_type = 0;
-    while ( bcf_sr_next_line(args->files) )
+    while ( profile_sr_next_line(args->files) )
     {
         args->ntotal++;
 
@@ -1656,6 +1879,7 @@ static void normalize_vcf(args_t *args)
         int i,j,ilast = rbuf_last(&args->rbuf);
         if ( ilast>=0 && line->rid != args->lines[ilast]->rid ) flush_buffer(args, out, args->rbuf.n); // new chromosome
 
+        uint64_t t0 = profile_begin();
         int split = 0;
         if ( args->mrows_op==MROWS_SPLIT )
         {
@@ -1676,6 +1900,7 @@ static void normalize_vcf(args_t *args)
         }
         if ( !split )
             normalize_line(args, &args->files->readers[0].buffer[0]);
+        profile_end(PROF_NORM, t0);
 
         // find out how many sites to flush
         ilast = rbuf_last(&args->rbuf);
@@ -1688,7 +1913,95 @@ static void normalize_vcf(args_t *args)
         if ( j>0 ) flush_buffer(args, out, j);
     }
     flush_buffer(args, out, args->rbuf.n);
-    hts_close(out);
+}
+
+/*
+    Normalize one sequence with a private reader, faidx handle and record
+    buffers, writing the result to the shard's temporary BCF. The counts
+    are added to the main context when done.
+*/
+static void normalize_shard(void *data, shard_t *shard, htsFile *out)
+{
+    args_t *main_args = (args_t*) data;
+    args_t tmp, *args = &tmp;
+    memset(args, 0, sizeof(*args));
+    args->ref_fname      = main_args->ref_fname;
+    args->buf_win        = main_args->buf_win;
+    args->aln_win        = main_args->aln_win;
+    args->rmdup          = main_args->rmdup;
+    args->check_ref      = main_args->check_ref;
+    args->strict_filter  = main_args->strict_filter;
+    args->do_indels      = main_args->do_indels;
+    args->mrows_op       = main_args->mrows_op;
+    args->mrows_collapse = main_args->mrows_collapse;
+    args->parsimonious   = main_args->parsimonious;
+
+    args->files = bcf_sr_init();
+    args->files->require_index = 1;
+    shard_set_regions(args->files, shard, main_args->regs);
+    if ( main_args->targets && bcf_sr_set_targets(args->files, main_args->targets, main_args->targets_is_file, 0)<0 )
+        error("Failed to read the targets: %s\n", main_args->targets);
+    if ( !bcf_sr_add_reader(args->files, main_args->vcf_fname) )
+        error("Failed to open %s: %s\n", main_args->vcf_fname,bcf_sr_strerror(args->files->errnum));
+    init_data(args);
+    normalize_records(args, out);
+
+    __sync_fetch_and_add(&main_args->ntotal, args->ntotal);
+    __sync_fetch_and_add(&main_args->nsplit, args->nsplit);
+    __sync_fetch_and_add(&main_args->nchanged, args->nchanged);
+    __sync_fetch_and_add(&main_args->nskipped, args->nskipped);
+    __sync_fetch_and_add(&main_args->nref.tot, args->nref.tot);
+    __sync_fetch_and_add(&main_args->nref.set, args->nref.set);
+    __sync_fetch_and_add(&main_args->nref.swap, args->nref.swap);
+
+    destroy_data(args);
+    bcf_sr_destroy(args->files);
+}
+
+typedef struct
+{
+    args_t *args;
+    htsFile *out;
+}
+shard_out_t;
+
+static void write_shard_rec(void *data, bcf1_t *rec)
+{
+    shard_out_t *so = (shard_out_t*) data;
+    out_idx_write(so->args->out_idx, so->out, so->args->hdr, rec);
+}
+
+/*
+    The --shard-threads mode: normalize sequences independently on worker
+    threads. The sequences are those with records in the input file, in the
+    order of the index. Records are buffered, deduplicated and merged only
+    within a sequence, therefore processing the sequences independently
+    gives the same output as the single-threaded run.
+*/
+static void normalize_shards(args_t *args, htsFile *out)
+{
+    shards_t *shards = shards_init("norm");
+    shards_add_seqs(shards, &args->files->readers[0], args->regs);
+    shard_out_t so = { args, out };
+    shards_run(shards, args->shard_threads, args->hdr, NULL, normalize_shard, NULL, write_shard_rec, &so);
+    shards_destroy(shards);
+}
+
+static void normalize_vcf(args_t *args)
+{
+    htsFile *out = hts_open(args->output_fname, hts_bcf_wmode(args->output_type));
+    if ( out == NULL ) error("Can't write to \"%s\": %s\n", args->output_fname, strerror(errno));
+    if ( args->n_threads )
+        hts_set_opt(out, HTS_OPT_THREAD_POOL, args->files->p);
+    if (args->record_cmd_line) bcf_hdr_append_version(args->hdr, args->argc, args->argv, "bcftools_norm");
+    bcf_hdr_write(out, args->hdr);
+    if ( args->write_index ) args->out_idx = out_idx_init(out, args->hdr, args->output_fname);
+
+    if ( args->shard_threads )
+        normalize_shards(args, out);
+    else
+        normalize_records(args, out);
+    out_idx_close(args->out_idx, out);
 
     fprintf(stderr,"Lines   total/split/realigned/skipped:\t%d/%d/%d/%d\n", args->ntotal,args->nsplit,args->nchanged,args->nskipped);
     if ( args->check_ref & CHECK_REF_FIX )
@@ -1715,10 +2028,12 @@ static void usage(void)
     fprintf(stderr, "    -O, --output-type <type>          'b' compressed BCF; 'u' uncompressed BCF; 'z' compressed VCF; 'v' uncompressed VCF [v]\n");
     fprintf(stderr, "    -r, --regions <region>            restrict to comma-separated list of regions\n");
     fprintf(stderr, "    -R, --regions-file <file>         restrict to regions listed in a file\n");
+    fprintf(stderr, "        --shard-threads <int>         normalize sequences independently in <int> worker threads [0]\n");
     fprintf(stderr, "    -s, --strict-filter               when merging (-m+), merged site is PASS only if all sites being merged PASS\n");
     fprintf(stderr, "    -t, --targets <region>            similar to -r but streams rather than index-jumps\n");
     fprintf(stderr, "    -T, --targets-file <file>         similar to -R but streams rather than index-jumps\n");
     fprintf(stderr, "        --threads <int>               number of extra (de)compression threads [0]\n");
+    fprintf(stderr, "        --write-index                 index the compressed output on the fly, the index is written to <file>.csi\n");
     fprintf(stderr, "    -w, --site-win <int>              buffer for sorting lines which changed position during realignment [1000]\n");
     fprintf(stderr, "\n");
     exit(1);
@@ -1760,6 +2075,8 @@ int main_vcfnorm(int argc, char *argv[])
         {"check-ref",required_argument,NULL,'c'},
         {"strict-filter",no_argument,NULL,'s'},
         {"no-version",no_argument,NULL,8},
+        {"shard-threads",required_argument,NULL,10},
+        {"write-index",no_argument,NULL,11},
         {NULL,0,NULL,0}
     };
     char *tmp;
@@ -1818,6 +2135,11 @@ int main_vcfnorm(int argc, char *argv[])
                 break;
             case  9 : args->n_threads = strtol(optarg, 0, 0); break;
             case  8 : args->record_cmd_line = 0; break;
+            case 10 :
+                args->shard_threads = strtol(optarg, &tmp, 10);
+                if ( *tmp || args->shard_threads<0 ) error("Could not parse argument: --shard-threads %s\n", optarg);
+                break;
+            case 11 : args->write_index = 1; break;
             case 'h':
             case '?': usage();
             default: error("Unknown argument: %s\n", optarg);
@@ -1838,6 +2160,17 @@ int main_vcfnorm(int argc, char *argv[])
     {
         if ( bcf_sr_set_regions(args->files, args->region,region_is_file)<0 )
             error("Failed to read the regions: %s\n", args->region);
+        if ( args->shard_threads )
+        {
+            if ( region_is_file )
+                args->regs = regidx_init(args->region,NULL,NULL,0,NULL);
+            else
+            {
+                args->regs = regidx_init(NULL,regidx_parse_reg,NULL,0,NULL);
+                if ( args->regs && regidx_insert_list(args->regs,args->region,',')!=0 ) error("Could not parse the regions: %s\n", args->region);
+            }
+            if ( !args->regs ) error("Could not parse the regions: %s\n", args->region);
+        }
     }
     if ( args->targets )
     {
@@ -1845,6 +2178,9 @@ int main_vcfnorm(int argc, char *argv[])
             error("Failed to read the targets: %s\n", args->targets);
     }
 
+    args->targets_is_file = targets_is_file;
+    args->vcf_fname = fname;
+    if ( args->shard_threads ) args->files->require_index = 1;
     if ( bcf_sr_set_threads(args->files, args->n_threads)<0 ) error("Failed to create threads\n");
     if ( !bcf_sr_add_reader(args->files, fname) ) error("Failed to open %s: %s\n", fname,bcf_sr_strerror(args->files->errnum));
     if ( args->mrows_op&MROWS_SPLIT && args->rmdup ) error("Cannot combine -D and -m-\n");
@@ -1852,6 +2188,7 @@ int main_vcfnorm(int argc, char *argv[])
     normalize_vcf(args);
     destroy_data(args);
     bcf_sr_destroy(args->files);
+    if ( args->regs ) regidx_destroy(args->regs);
     free(args);
     return 0;
 }
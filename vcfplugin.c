@@ -41,6 +41,7 @@ THE SOFTWARE.  */
 #include "bcftools.h"
 #include "vcmp.h"
 #include "filter.h"
+#include "batch.h"
 
 typedef struct _plugin_t plugin_t;
 
@@ -61,13 +62,32 @@ typedef struct _plugin_t plugin_t;
  *   int init(int argc, char **argv, bcf_hdr_t *in_hdr, bcf_hdr_t *out_hdr)
  *      - called once at startup, allows to initialize local variables.
  *      Return 1 to suppress normal VCF/BCF header output, -1 on critical
- *      errors, 0 otherwise.
+ *      errors, 0 otherwise. A plugin which returns 1 is a collector: in a
+ *      chain, the records are passed on unchanged to the next plugin,
+ *      whatever its process() returns.
  *
  *   bcf1_t *process(bcf1_t *rec)
  *      - called for each VCF record, return NULL for no output
  *
  *   void destroy(void)
  *      - called after all lines have been processed to clean up
+ *
+ *   Optional batch API, used with --record-threads when the plugin exports
+ *   all of init_thread, process_batch and reduce:
+ *
+ *   void *init_thread(int ithread)
+ *      - called after init() once for each worker thread, returns a private
+ *      context. All state modified by process_batch() must live in it.
+ *
+ *   int process_batch(void *ctx, bcf1_t **recs, int nrecs)
+ *      - called from the worker threads for consecutive blocks of records.
+ *      The records can be modified in place; set recs[i] to NULL for no
+ *      output. Return 0 on success, negative value on critical errors.
+ *
+ *   void reduce(void *ctx)
+ *      - called from the main thread once for each context, in the order of
+ *      ithread, after all records have been processed. Merges the results
+ *      into the global state and frees the context; destroy() follows.
  */
 typedef void (*dl_version_f) (const char **, const char **);
 typedef int (*dl_run_f) (int, char **);
@@ -76,6 +96,9 @@ typedef char* (*dl_about_f) (void);
 typedef char* (*dl_usage_f) (void);
 typedef bcf1_t* (*dl_process_f) (bcf1_t *);
 typedef void (*dl_destroy_f) (void);
+typedef void* (*dl_init_thread_f) (int);
+typedef int (*dl_process_batch_f) (void *, bcf1_t **, int);
+typedef void (*dl_reduce_f) (void *);
 
 struct _plugin_t
 {
@@ -88,7 +111,12 @@ struct _plugin_t
     dl_usage_f usage;
     dl_process_f process;
     dl_destroy_f destroy;
+    dl_init_thread_f init_thread;
+    dl_process_batch_f process_batch;
+    dl_reduce_f reduce;
     void *handle;
+    bcf_hdr_t *hdr;     // input header of a chained plugin, NULL for the first one
+    int collector;      // init() returned 1, the records pass through unchanged
 };
 
 
@@ -137,11 +165,13 @@ typedef struct _args_t
     int filter_logic;   // include or exclude sites which match the filters? One of FLT_INCLUDE/FLT_EXCLUDE
 
     plugin_t plugin;
+    plugin_t **chain;   // all plugins in the order of processing, chain[0] is &plugin
+    int nchain;
     int nplugin_paths;
     char **plugin_paths;
 
     char **argv, *output_fname, *regions_list, *targets_list;
-    int argc, drop_header, verbose, record_cmd_line;
+    int argc, drop_header, verbose, record_cmd_line, record_threads;
 }
 args_t;
 
@@ -323,28 +353,84 @@ static int load_plugin(args_t *args, const char *fname, int exit_on_error, plugi
         return -1;
     }
 
+    // the batch API is optional and used only when complete
+    plugin->init_thread = (dl_init_thread_f) dlsym(plugin->handle, "init_thread");
+    plugin->process_batch = (dl_process_batch_f) dlsym(plugin->handle, "process_batch");
+    plugin->reduce = (dl_reduce_f) dlsym(plugin->handle, "reduce");
+    dlerror();
+    if ( !plugin->init_thread || !plugin->process_batch || !plugin->reduce )
+    {
+        plugin->init_thread = NULL;
+        plugin->process_batch = NULL;
+        plugin->reduce = NULL;
+    }
+    else if ( args->verbose > 1 ) fprintf(stderr,"\tbatch    .. ok\n");
+
     return 0;
 }
 
-static void init_plugin(args_t *args)
+static void init_plugin(args_t *args, plugin_t *plugin, bcf_hdr_t *in_hdr)
 {
     static int warned_bcftools = 0, warned_htslib = 0;
 
-    int ret = args->plugin.init(args->plugin.argc,args->plugin.argv,args->hdr,args->hdr_out);
+    optind = 0;
+    int ret = plugin->init(plugin->argc,plugin->argv,in_hdr,args->hdr_out);
     if ( ret<0 ) error("The plugin exited with an error.\n");
     const char *bver, *hver;
-    args->plugin.version(&bver, &hver);
+    plugin->version(&bver, &hver);
     if ( strcmp(bver,bcftools_version()) && !warned_bcftools )
     {
-        fprintf(stderr,"WARNING: bcftools version mismatch .. bcftools at %s, the plugin \"%s\" at %s\n", bcftools_version(),args->plugin.name,bver);
+        fprintf(stderr,"WARNING: bcftools version mismatch .. bcftools at %s, the plugin \"%s\" at %s\n", bcftools_version(),plugin->name,bver);
         warned_bcftools = 1;
     }
     if ( strcmp(hver,hts_version()) && !warned_htslib )
     {
-        fprintf(stderr,"WARNING: htslib version mismatch .. bcftools at %s, the plugin \"%s\" at %s\n", hts_version(),args->plugin.name,hver);
+        fprintf(stderr,"WARNING: htslib version mismatch .. bcftools at %s, the plugin \"%s\" at %s\n", hts_version(),plugin->name,hver);
         warned_htslib = 1;
     }
     args->drop_header += ret;
+    plugin->collector = ret==1 ? 1 : 0;
+}
+
+/*
+    Split the plugin arguments into a chain of plugins. A "+name" argument
+    given first or after "--" starts the next plugin, which takes the
+    arguments up to the next such "+name", optionally separated by "--":
+        bcftools +A [OPTIONS] in.vcf -- [A OPTIONS] -- +B [B OPTIONS] -- +C -- [C OPTIONS]
+*/
+static void init_chain(args_t *args)
+{
+    plugin_t *plugin = &args->plugin;
+    char **argv = plugin->argv;
+    int argc = plugin->argc, i, j, beg = 0;
+
+    args->nchain = 1;
+    args->chain = (plugin_t**) malloc(sizeof(plugin_t*));
+    args->chain[0] = plugin;
+    for (i=1; i<argc; i++)
+    {
+        if ( argv[i][0]!='+' || !argv[i][1] ) continue;
+        if ( i-beg>1 && strcmp(argv[i-1],"--") ) continue;
+        plugin->argc = (i-beg>1 ? i-1 : i) - beg;
+
+        plugin = (plugin_t*) calloc(1,sizeof(plugin_t));
+        load_plugin(args, argv[i]+1, 1, plugin);
+        if ( plugin->run ) error("The plugin \"%s\" cannot be chained with other plugins\n", plugin->name);
+        for (j=0; j<args->nchain; j++)
+            if ( args->chain[j]->handle==plugin->handle ) error("The plugin \"%s\" can be used only once\n", plugin->name);
+        args->chain = (plugin_t**) realloc(args->chain, sizeof(plugin_t*)*(args->nchain+1));
+        args->chain[args->nchain++] = plugin;
+
+        // skip the optional "--" separator, the plugin name becomes argv[0]
+        beg = i;
+        if ( i+1<argc && !strcmp(argv[i+1],"--") )
+        {
+            argv[i+1] = argv[i];
+            beg = ++i;
+        }
+        plugin->argv = argv + beg;
+        plugin->argc = argc - beg;
+    }
 }
 
 static int cmp_plugin_name(const void *p1, const void *p2)
@@ -412,7 +498,15 @@ static void init_data(args_t *args)
     args->hdr = args->files->readers[0].header;
     args->hdr_out = bcf_hdr_dup(args->hdr);
 
-    init_plugin(args);
+    // the records are passed between the plugins directly, each reads them
+    // with the output header as left by the previous plugins
+    int i;
+    init_plugin(args, &args->plugin, args->hdr);
+    for (i=1; i<args->nchain; i++)
+    {
+        args->chain[i]->hdr = bcf_hdr_dup(args->hdr_out);
+        init_plugin(args, args->chain[i], args->chain[i]->hdr);
+    }
 
     if ( args->filter_str )
         args->filter = filter_init(args->hdr, args->filter_str);
@@ -429,13 +523,23 @@ static void init_data(args_t *args)
 
 static void destroy_data(args_t *args)
 {
+    int i;
+    for (i=1; i<args->nchain; i++)
+    {
+        plugin_t *plugin = args->chain[i];
+        free(plugin->name);
+        if ( plugin->destroy ) plugin->destroy();
+        dlclose(plugin->handle);
+        bcf_hdr_destroy(plugin->hdr);
+        free(plugin);
+    }
+    free(args->chain);
     free(args->plugin.name);
     if ( args->plugin.destroy ) args->plugin.destroy();
     dlclose(args->plugin.handle);
     if ( args->hdr_out ) bcf_hdr_destroy(args->hdr_out);
     if ( args->nplugin_paths>0 )
     {
-        int i;
         for (i=0; i<args->nplugin_paths; i++) free(args->plugin_paths[i]);
         free(args->plugin_paths);
     }
@@ -444,12 +548,158 @@ static void destroy_data(args_t *args)
     if (args->out_fh) hts_close(args->out_fh);
 }
 
+static void process_records(args_t *args)
+{
+    while ( bcf_sr_next_line(args->files) )
+    {
+        bcf1_t *line = bcf_sr_get_line(args->files,0);
+        if ( args->filter )
+        {
+            int pass = filter_test(args->filter, line, NULL);
+            if ( args->filter_logic & FLT_EXCLUDE ) pass = pass ? 0 : 1;
+            if ( !pass ) continue;
+        }
+        int i;
+        for (i=0; i<args->nchain && line; i++)
+        {
+            bcf1_t *out = args->chain[i]->process(line);
+            if ( !args->chain[i]->collector || i+1==args->nchain ) line = out;
+        }
+        if ( line ) bcf_write1(args->out_fh, args->hdr_out, line);
+    }
+}
+
+// Multi-threaded record processing (--record-threads) with the batch API: the
+// main thread reads and filters batches of records, the workers of a batch
+// pool run process_batch() on them, each with its own plugin context, and the
+// batches are written in the original order.
+#define BATCH_SIZE      64
+
+typedef struct
+{
+    bcf1_t **rec, **out, **in;  // out: the records passed through the plugins, the first nout are written
+    int nrec, nout;
+}
+batch_t;
+
+typedef struct
+{
+    args_t *args;
+    void **ctx;     // one context per plugin in the chain
+}
+worker_t;
+
+static void batch_work(void *wdata, void *data)
+{
+    worker_t *worker = (worker_t*) wdata;
+    batch_t *batch = (batch_t*) data;
+    args_t *args = worker->args;
+    int i, j, k;
+    memcpy(batch->out, batch->rec, sizeof(bcf1_t*)*batch->nrec);
+    batch->nout = batch->nrec;
+    for (i=0; i<args->nchain && batch->nout; i++)
+    {
+        plugin_t *plugin = args->chain[i];
+        memcpy(batch->in, batch->out, sizeof(bcf1_t*)*batch->nout);
+        if ( plugin->process_batch(worker->ctx[i], batch->out, batch->nout) < 0 ) error("The plugin exited with an error.\n");
+        if ( plugin->collector && i+1<args->nchain )
+        {
+            memcpy(batch->out, batch->in, sizeof(bcf1_t*)*batch->nout);
+            continue;
+        }
+
+        // drop the removed records before passing the batch on
+        for (j=0,k=0; j<batch->nout; j++)
+        {
+            if ( !batch->out[j] ) continue;
+            if ( batch->out[j]!=batch->in[j] ) error("The plugin %s replaced a record in process_batch()\n", plugin->name);
+            batch->out[k++] = batch->out[j];
+        }
+        batch->nout = k;
+    }
+}
+
+static void batch_write(void *data, void *bdata)
+{
+    args_t *args = (args_t*) data;
+    batch_t *batch = (batch_t*) bdata;
+    int i;
+    if ( args->out_fh )
+        for (i=0; i<batch->nout; i++) bcf_write1(args->out_fh, args->hdr_out, batch->out[i]);
+}
+
+static void process_records_threaded(args_t *args)
+{
+    int i, j, nthreads = args->record_threads, nbatch = 2*nthreads;
+    worker_t *worker = (worker_t*) calloc(nthreads, sizeof(worker_t));
+    void **workers = (void**) malloc(sizeof(void*)*nthreads);
+    for (i=0; i<nthreads; i++)
+    {
+        worker[i].args = args;
+        worker[i].ctx  = (void**) malloc(sizeof(void*)*args->nchain);
+        for (j=0; j<args->nchain; j++)
+        {
+            worker[i].ctx[j] = args->chain[j]->init_thread(i);
+            if ( !worker[i].ctx[j] ) error("The plugin %s could not create a thread context\n", args->chain[j]->name);
+        }
+        workers[i] = &worker[i];
+    }
+    batch_t *batch = (batch_t*) calloc(nbatch, sizeof(batch_t));
+    void **batches = (void**) malloc(sizeof(void*)*nbatch);
+    for (i=0; i<nbatch; i++)
+    {
+        batch[i].rec = (bcf1_t**) malloc(sizeof(bcf1_t*)*BATCH_SIZE);
+        batch[i].out = (bcf1_t**) malloc(sizeof(bcf1_t*)*BATCH_SIZE);
+        batch[i].in  = (bcf1_t**) malloc(sizeof(bcf1_t*)*BATCH_SIZE);
+        for (j=0; j<BATCH_SIZE; j++) batch[i].rec[j] = bcf_init();
+        batches[i] = &batch[i];
+    }
+
+    batch_pool_t *pool = batch_pool_init(nthreads, workers, batches, nbatch, batch_work, batch_write, args);
+    int eof = 0;
+    while ( !eof )
+    {
+        batch_t *bt = (batch_t*) batch_pool_get(pool);
+        bt->nrec = 0;
+        while ( bt->nrec < BATCH_SIZE )
+        {
+            if ( !bcf_sr_next_line(args->files) ) { eof = 1; break; }
+            bcf1_t *line = bcf_sr_get_line(args->files,0);
+            if ( args->filter )
+            {
+                int pass = filter_test(args->filter, line, NULL);
+                if ( args->filter_logic & FLT_EXCLUDE ) pass = pass ? 0 : 1;
+                if ( !pass ) continue;
+            }
+            bcf_copy(bt->rec[bt->nrec++], line);
+        }
+        if ( bt->nrec ) batch_pool_submit(pool);
+    }
+    batch_pool_destroy(pool);
+
+    for (j=0; j<args->nchain; j++)
+        for (i=0; i<nthreads; i++) args->chain[j]->reduce(worker[i].ctx[j]);
+    for (i=0; i<nthreads; i++) free(worker[i].ctx);
+    for (i=0; i<nbatch; i++)
+    {
+        for (j=0; j<BATCH_SIZE; j++) bcf_destroy(batch[i].rec[j]);
+        free(batch[i].rec);
+        free(batch[i].out);
+        free(batch[i].in);
+    }
+    free(batch);
+    free(batches);
+    free(worker);
+    free(workers);
+}
+
 static void usage(args_t *args)
 {
     fprintf(stderr, "\n");
     fprintf(stderr, "About:   Run user defined plugin\n");
     fprintf(stderr, "Usage:   bcftools plugin <name> [OPTIONS] <file> [-- PLUGIN_OPTIONS]\n");
     fprintf(stderr, "         bcftools +name [OPTIONS] <file>  [-- PLUGIN_OPTIONS]\n");
+    fprintf(stderr, "         bcftools +name [OPTIONS] <file>  [-- PLUGIN_OPTIONS] [-- +name2 [-- PLUGIN2_OPTIONS] ...]\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "VCF input options:\n");
     fprintf(stderr, "   -e, --exclude <expr>        exclude sites for which the expression is true\n");
@@ -464,6 +714,7 @@ static void usage(args_t *args)
     fprintf(stderr, "   -O, --output-type <type>    'b' compressed BCF; 'u' uncompressed BCF; 'z' compressed VCF; 'v' uncompressed VCF [v]\n");
     fprintf(stderr, "       --threads <int>         number of extra output compression threads [0]\n");
     fprintf(stderr, "Plugin options:\n");
+    fprintf(stderr, "       --record-threads <int>  process records in parallel, if supported by the plugin [0]\n");
     fprintf(stderr, "   -h, --help                  list plugin's options\n");
     fprintf(stderr, "   -l, --list-plugins          list available plugins. See BCFTOOLS_PLUGINS environment variable and man page for details\n");
     fprintf(stderr, "   -v, --verbose               print verbose information, -vv increases verbosity\n");
@@ -540,8 +791,10 @@ int main_plugin(int argc, char *argv[])
         {"targets",required_argument,NULL,'t'},
         {"targets-file",required_argument,NULL,'T'},
         {"no-version",no_argument,NULL,8},
+        {"record-threads",required_argument,NULL,10},
         {NULL,0,NULL,0}
     };
+    char *tmp;
     while ((c = getopt_long(argc, argv, "h?o:O:r:R:t:T:li:e:vV",loptions,NULL)) >= 0)
     {
         switch (c) {
@@ -566,6 +819,10 @@ int main_plugin(int argc, char *argv[])
             case 'l': plist_only = 1; break;
             case  9 : args->n_threads = strtol(optarg, 0, 0); break;
             case  8 : args->record_cmd_line = 0; break;
+            case 10 :
+                args->record_threads = strtol(optarg,&tmp,10);
+                if ( *tmp || args->record_threads<0 ) error("Could not parse argument: --record-threads %s\n", optarg);
+                break;
             case '?':
             case 'h': usage_only = 1; break;
             default: error("Unknown argument: %s\n", optarg);
@@ -622,19 +879,20 @@ int main_plugin(int argc, char *argv[])
     }
     if ( !bcf_sr_add_reader(args->files, fname) ) error("Failed to open %s: %s\n", fname,bcf_sr_strerror(args->files->errnum));
 
+    init_chain(args);
     init_data(args);
-    while ( bcf_sr_next_line(args->files) )
+    int i, batch_api = 1;
+    for (i=0; i<args->nchain; i++)
     {
-        bcf1_t *line = bcf_sr_get_line(args->files,0);
-        if ( args->filter )
-        {
-            int pass = filter_test(args->filter, line, NULL);
-            if ( args->filter_logic & FLT_EXCLUDE ) pass = pass ? 0 : 1;
-            if ( !pass ) continue;
-        }
-        line = args->plugin.process(line);
-        if ( line ) bcf_write1(args->out_fh, args->hdr_out, line);
+        if ( args->chain[i]->process_batch ) continue;
+        if ( args->record_threads )
+            fprintf(stderr,"Note: the plugin \"%s\" does not support --record-threads, processing records in a single thread.\n", args->chain[i]->name);
+        batch_api = 0;
     }
+    if ( args->record_threads && batch_api )
+        process_records_threaded(args);
+    else
+        process_records(args);
     destroy_data(args);
     bcf_sr_destroy(args->files);
     free(args);
@@ -33,9 +33,12 @@ THE SOFTWARE.  */
 #include <htslib/vcf.h>
 #include <htslib/synced_bcf_reader.h>
 #include <htslib/vcfutils.h>
+#include <htslib/tbx.h>
+#include <pthread.h>
 #include "bcftools.h"
 #include "filter.h"
 #include "convert.h"
+#include "profile.h"
 
 
 // Logic of the filters: include or exclude sites which match the filters?
@@ -52,7 +55,8 @@ typedef struct
     bcf_hdr_t *header;
     int nsamples, *samples, sample_is_file;
     char **argv, *format_str, *sample_list, *targets_list, *regions_list, *vcf_list, *fn_out;
-    int argc, list_columns, print_header, allow_undef_tags;
+    int argc, list_columns, print_header, allow_undef_tags, record_threads;
+    int server, server_threads, columnar, columnar_header;
     FILE *out;
 }
 args_t;
@@ -65,6 +69,36 @@ static void destroy_list(char **list, int n)
     free(list);
 }
 
+static void set_samples(args_t *args, bcf_hdr_t *hdr)
+{
+    int ret = bcf_hdr_set_samples(hdr,args->sample_list,args->sample_is_file);
+    if ( ret<0 ) error("Error parsing the sample list\n");
+    else if ( ret>0 ) error("Sample name mismatch: sample #%d not found in the header\n", ret);
+}
+
+// The output order of the samples given by -s, NULL if it is the order of the header
+static int *sample_order(args_t *args, bcf_hdr_t *hdr, int *nsamples)
+{
+    *nsamples = 0;
+    if ( args->sample_list[0]=='^' ) return NULL;
+
+    // the sample ordering may be different if not negated
+    int i, n;
+    char **smpls = hts_readlist(args->sample_list, args->sample_is_file, &n);
+    if ( !smpls ) error("Could not parse %s\n", args->sample_list);
+    if ( n!=bcf_hdr_nsamples(hdr) )
+        error("The number of samples does not match, perhaps some are present multiple times?\n");
+    *nsamples = bcf_hdr_nsamples(hdr);
+    int *samples = (int*) malloc(sizeof(int)*(*nsamples));
+    for (i=0; i<n; i++)
+    {
+        samples[i] = bcf_hdr_id2int(hdr, BCF_DT_SAMPLE,smpls[i]);
+        free(smpls[i]);
+    }
+    free(smpls);
+    return samples;
+}
+
 static void init_data(args_t *args)
 {
     args->header = args->files->readers[0].header;
@@ -73,32 +107,12 @@ static void init_data(args_t *args)
     if ( args->sample_list && strcmp("-",args->sample_list) )
     {
         for (i=0; i<args->files->nreaders; i++)
-        {
-            int ret = bcf_hdr_set_samples(args->files->readers[i].header,args->sample_list,args->sample_is_file);
-            if ( ret<0 ) error("Error parsing the sample list\n");
-            else if ( ret>0 ) error("Sample name mismatch: sample #%d not found in the header\n", ret);
-        }
-
-        if ( args->sample_list[0]!='^' )
-        {
-            // the sample ordering may be different if not negated
-            int n;
-            char **smpls = hts_readlist(args->sample_list, args->sample_is_file, &n);
-            if ( !smpls ) error("Could not parse %s\n", args->sample_list);
-            if ( n!=bcf_hdr_nsamples(args->files->readers[0].header) )
-                error("The number of samples does not match, perhaps some are present multiple times?\n");
-            nsamples = bcf_hdr_nsamples(args->files->readers[0].header);
-            samples = (int*) malloc(sizeof(int)*nsamples);
-            for (i=0; i<n; i++)
-            {
-                samples[i] = bcf_hdr_id2int(args->files->readers[0].header, BCF_DT_SAMPLE,smpls[i]);
-                free(smpls[i]);
-            }
-            free(smpls);
-        }
+            set_samples(args, args->files->readers[i].header);
+        samples = sample_order(args, args->header, &nsamples);
     }
     args->convert = convert_init(args->header, samples, nsamples, args->format_str);
     if ( args->allow_undef_tags ) convert_set_option(args->convert, allow_undef_tags, 1);
+    if ( args->record_threads ) convert_set_option(args->convert, threads, args->record_threads);
     free(samples);
 
     int max_unpack = convert_max_unpack(args->convert);
@@ -118,22 +132,47 @@ static void destroy_data(args_t *args)
     free(args->samples);
 }
 
+#define QUERY_BATCH 256
+#define QUERY_COL_CELLS (1<<22)     // the target number of cells in a --columnar chunk
+#define QUERY_COL_MAX_ROWS 65536
+
 static void query_vcf(args_t *args)
 {
     kstring_t str = {0,0,0};
+    int i, nrecs = 0, batch = QUERY_BATCH;
+    if ( args->columnar )
+    {
+        batch = QUERY_COL_CELLS / (bcf_hdr_nsamples(args->header) + 1);
+        if ( batch > QUERY_COL_MAX_ROWS ) batch = QUERY_COL_MAX_ROWS;
+        if ( batch < 1 ) batch = 1;
+        if ( args->record_threads > 1 ) batch *= args->record_threads;
+    }
+    bcf1_t **recs = (bcf1_t**) calloc(batch, sizeof(bcf1_t*));
 
-    if ( args->print_header )
+    if ( args->columnar )
+    {
+        // the header is written once, also with multiple files of --vcf-list
+        if ( !args->columnar_header )
+        {
+            convert_columns_header(args->convert,&str);
+            fwrite(str.s, str.l, 1, args->out);
+            args->columnar_header = 1;
+        }
+    }
+    else if ( args->print_header )
     {
         convert_header(args->convert,&str);
         fwrite(str.s, str.l, 1, args->out);
     }
 
-    while ( bcf_sr_next_line(args->files) )
+    while ( profile_sr_next_line(args->files) )
     {
         if ( !bcf_sr_has_line(args->files,0) ) continue;
         bcf1_t *line = args->files->readers[0].buffer[0];
-        bcf_unpack(line, args->files->max_unpack);
 
+        // Unpack lazily: filter_test() unpacks only what the expression needs and
+        // convert_line() the rest, so records which fail the filter never have
+        // their FORMAT fields unpacked unless the filter itself refers to them
         if ( args->filter )
         {
             int pass = filter_test(args->filter, line, NULL);
@@ -141,14 +180,271 @@ static void query_vcf(args_t *args)
             if ( !pass ) continue;
         }
 
+        if ( args->record_threads || args->columnar )
+        {
+            // collect a block of records to be formatted in parallel
+            if ( !recs[nrecs] ) recs[nrecs] = bcf_init();
+            bcf_copy(recs[nrecs++], line);
+            if ( nrecs < batch ) continue;
+            str.l = 0;
+            if ( args->columnar ) convert_columns(args->convert, recs, nrecs, &str);
+            else convert_lines(args->convert, recs, nrecs, &str);
+            if ( str.l )
+                fwrite(str.s, str.l, 1, args->out);
+            nrecs = 0;
+            continue;
+        }
+
         str.l = 0;
         convert_line(args->convert, line, &str);
         if ( str.l )
             fwrite(str.s, str.l, 1, args->out);
     }
+    if ( nrecs )
+    {
+        str.l = 0;
+        if ( args->columnar ) convert_columns(args->convert, recs, nrecs, &str);
+        else convert_lines(args->convert, recs, nrecs, &str);
+        if ( str.l )
+            fwrite(str.s, str.l, 1, args->out);
+    }
+    for (i=0; i<batch; i++)
+        if ( recs[i] ) bcf_destroy(recs[i]);
+    free(recs);
     if ( str.m ) free(str.s);
 }
 
+/*
+ *  The --server mode. The header and the index are read once and region
+ *  requests, one per line in the -r syntax, are read from stdin and answered
+ *  by a pool of workers. Each worker has its own file handle, a copy of the
+ *  header, and its own convert_t and filter_t, so that the requests do not
+ *  wait for each other; only the index is shared, it is read-only. The answer
+ *  to a request is written in one piece once it is complete, and is
+ *  terminated by the line "#END<tab>request" so that the client can match
+ *  the answers, which can come in a different order than the requests.
+ */
+typedef struct _server_req_t
+{
+    char *reg;
+    struct _server_req_t *next;
+}
+server_req_t;
+
+typedef struct
+{
+    char *fname;
+    hts_idx_t *idx;     // BCF
+    tbx_t *tbx;         // bgzipped VCF
+    int *samples, nsamples;
+    server_req_t *head, *tail;
+    int done;
+    pthread_mutex_t lock, out_lock;
+    pthread_cond_t cond;
+    args_t *args;
+}
+server_t;
+
+typedef struct
+{
+    server_t *srv;
+    htsFile *fp;
+    bcf_hdr_t *hdr;
+    convert_t *convert;
+    filter_t *filter;
+    bcf1_t *rec;
+    kstring_t line, tmp, out;
+}
+server_worker_t;
+
+static void server_worker_init(server_t *srv, server_worker_t *w, bcf_hdr_t *hdr)
+{
+    args_t *args = srv->args;
+    w->srv = srv;
+    w->fp  = hts_open(srv->fname, "r");
+    if ( !w->fp ) error("Failed to open %s\n", srv->fname);
+    w->hdr = bcf_hdr_dup(hdr);
+    if ( args->sample_list && strcmp("-",args->sample_list) ) set_samples(args, w->hdr);
+    w->convert = convert_init(w->hdr, srv->samples, srv->nsamples, args->format_str);
+    if ( args->allow_undef_tags ) convert_set_option(w->convert, allow_undef_tags, 1);
+    if ( args->filter_str ) w->filter = filter_init(w->hdr, args->filter_str);
+    w->rec = bcf_init();
+}
+
+static void server_worker_destroy(server_worker_t *w)
+{
+    convert_destroy(w->convert);
+    if ( w->filter ) filter_destroy(w->filter);
+    bcf_destroy(w->rec);
+    bcf_hdr_destroy(w->hdr);
+    hts_close(w->fp);
+    free(w->line.s);
+    free(w->tmp.s);
+    free(w->out.s);
+}
+
+static int server_next(server_worker_t *w, hts_itr_t *itr)
+{
+    server_t *srv = w->srv;
+    if ( srv->tbx )
+    {
+        if ( tbx_itr_next(w->fp, srv->tbx, itr, &w->line) < 0 ) return 0;
+        if ( vcf_parse(&w->line, w->hdr, w->rec) < 0 ) error("Could not parse the line: %s\n", w->line.s);
+        return 1;
+    }
+    int ret = bcf_itr_next(w->fp, itr, w->rec);
+    if ( ret < -1 ) error("Failed to read from %s\n", srv->fname);
+    if ( ret < 0 ) return 0;
+    if ( w->hdr->keep_samples ) bcf_subset_format(w->hdr, w->rec);
+    return 1;
+}
+
+static void server_query(server_worker_t *w, char *req)
+{
+    server_t *srv  = w->srv;
+    args_t   *args = srv->args;
+    w->out.l = 0;
+
+    // comma-separated regions are answered in the order given
+    char *reg = req;
+    while ( *reg )
+    {
+        char *end = reg;
+        while ( *end && *end!=',' ) end++;
+        char tmp = *end;
+        *end = 0;
+        hts_itr_t *itr = srv->tbx ? tbx_itr_querys(srv->tbx, reg) : bcf_itr_querys(srv->idx, w->hdr, reg);
+        if ( !itr ) ksprintf(&w->out, "#ERROR\tNo such region or sequence not indexed: %s\n", reg);
+        while ( itr && server_next(w, itr) )
+        {
+            if ( w->filter )
+            {
+                int pass = filter_test(w->filter, w->rec, NULL);
+                if ( args->filter_logic & FLT_EXCLUDE ) pass = pass ? 0 : 1;
+                if ( !pass ) continue;
+            }
+            if ( convert_line(w->convert, w->rec, &w->tmp) > 0 )
+                kputsn(w->tmp.s, w->tmp.l, &w->out);
+        }
+        if ( itr ) hts_itr_destroy(itr);
+        *end = tmp;
+        reg = *end ? end + 1 : end;
+    }
+    ksprintf(&w->out, "#END\t%s\n", req);
+
+    pthread_mutex_lock(&srv->out_lock);
+    fwrite(w->out.s, w->out.l, 1, args->out);
+    fflush(args->out);
+    pthread_mutex_unlock(&srv->out_lock);
+}
+
+static void *server_worker(void *arg)
+{
+    server_worker_t *w = (server_worker_t*) arg;
+    server_t *srv = w->srv;
+    while (1)
+    {
+        pthread_mutex_lock(&srv->lock);
+        while ( !srv->head && !srv->done ) pthread_cond_wait(&srv->cond, &srv->lock);
+        server_req_t *req = srv->head;
+        if ( req )
+        {
+            srv->head = req->next;
+            if ( !srv->head ) srv->tail = NULL;
+        }
+        pthread_mutex_unlock(&srv->lock);
+        if ( !req ) break;
+        server_query(w, req->reg);
+        free(req->reg);
+        free(req);
+    }
+    return NULL;
+}
+
+static void query_server(args_t *args, char *fname)
+{
+    server_t srv;
+    memset(&srv, 0, sizeof(srv));
+    srv.args  = args;
+    srv.fname = fname;
+
+    htsFile *fp = hts_open(fname, "r");
+    if ( !fp ) error("Failed to open %s\n", fname);
+    bcf_hdr_t *hdr = bcf_hdr_read(fp);
+    if ( !hdr ) error("Failed to read the header of %s\n", fname);
+    const htsFormat *fmt = hts_get_format(fp);
+    if ( fmt->format==bcf ) srv.idx = bcf_index_load(fname);
+    else if ( fmt->format==vcf && fmt->compression==bgzf ) srv.tbx = tbx_index_load(fname);
+    if ( !srv.idx && !srv.tbx ) error("Failed to load the index of %s, --server requires an indexed BCF or bgzipped VCF\n", fname);
+    hts_close(fp);
+
+    if ( args->sample_list && strcmp("-",args->sample_list) )
+    {
+        bcf_hdr_t *tmp = bcf_hdr_dup(hdr);
+        set_samples(args, tmp);
+        srv.samples = sample_order(args, tmp, &srv.nsamples);
+        bcf_hdr_destroy(tmp);
+    }
+
+    int i, nthreads = args->server_threads ? args->server_threads : 1;
+    server_worker_t *workers = (server_worker_t*) calloc(nthreads, sizeof(server_worker_t));
+    for (i=0; i<nthreads; i++) server_worker_init(&srv, &workers[i], hdr);
+    bcf_hdr_destroy(hdr);
+
+    if ( args->print_header )
+    {
+        kstring_t str = {0,0,0};
+        convert_header(workers[0].convert, &str);
+        fwrite(str.s, str.l, 1, args->out);
+        fflush(args->out);
+        free(str.s);
+    }
+
+    pthread_mutex_init(&srv.lock, NULL);
+    pthread_mutex_init(&srv.out_lock, NULL);
+    pthread_cond_init(&srv.cond, NULL);
+    pthread_t *tid = (pthread_t*) malloc(sizeof(pthread_t)*nthreads);
+    for (i=0; i<nthreads; i++)
+        if ( pthread_create(&tid[i], NULL, server_worker, &workers[i]) ) error("Failed to create threads\n");
+
+    // stdio rather than hts_getline(): the requests must be answered as soon
+    // as each line arrives, without waiting for more input to fill a buffer
+    char *line = NULL;
+    size_t mline = 0;
+    ssize_t len;
+    while ( (len = getline(&line, &mline, stdin)) >= 0 )
+    {
+        while ( len>0 && isspace(line[len-1]) ) line[--len] = 0;
+        if ( !len ) continue;
+        server_req_t *req = (server_req_t*) malloc(sizeof(server_req_t));
+        req->reg  = strdup(line);
+        req->next = NULL;
+        pthread_mutex_lock(&srv.lock);
+        if ( srv.tail ) srv.tail->next = req;
+        else srv.head = req;
+        srv.tail = req;
+        pthread_cond_signal(&srv.cond);
+        pthread_mutex_unlock(&srv.lock);
+    }
+    free(line);
+
+    pthread_mutex_lock(&srv.lock);
+    srv.done = 1;
+    pthread_cond_broadcast(&srv.cond);
+    pthread_mutex_unlock(&srv.lock);
+    for (i=0; i<nthreads; i++) pthread_join(tid[i], NULL);
+    free(tid);
+
+    for (i=0; i<nthreads; i++) server_worker_destroy(&workers[i]);
+    free(workers);
+    pthread_mutex_destroy(&srv.lock);
+    pthread_mutex_destroy(&srv.out_lock);
+    pthread_cond_destroy(&srv.cond);
+    if ( srv.idx ) hts_idx_destroy(srv.idx);
+    if ( srv.tbx ) tbx_destroy(srv.tbx);
+    free(srv.samples);
+}
+
 static void list_columns(args_t *args)
 {
     int i;
@@ -182,6 +478,7 @@ static void usage(void)
     fprintf(stderr, "\n");
     fprintf(stderr, "Options:\n");
     fprintf(stderr, "    -c, --collapse <string>           collapse lines with duplicate positions for <snps|indels|both|all|some|none>, see man page [none]\n");
+    fprintf(stderr, "        --columnar                    write typed columns in binary chunks rather than text, see man page\n");
     fprintf(stderr, "    -e, --exclude <expr>              exclude sites for which the expression is true (see man page for details)\n");
     fprintf(stderr, "    -f, --format <string>             see man page for details\n");
     fprintf(stderr, "    -H, --print-header                print header\n");
@@ -190,7 +487,10 @@ static void usage(void)
     fprintf(stderr, "    -o, --output-file <file>          output file name [stdout]\n");
     fprintf(stderr, "    -r, --regions <region>            restrict to comma-separated list of regions\n");
     fprintf(stderr, "    -R, --regions-file <file>         restrict to regions listed in a file\n");
+    fprintf(stderr, "        --record-threads <int>        number of threads formatting the output [0]\n");
     fprintf(stderr, "    -s, --samples <list>              list of samples to include\n");
+    fprintf(stderr, "        --server                      answer region queries read from stdin, one per line\n");
+    fprintf(stderr, "        --server-threads <int>        number of threads answering the queries with --server [1]\n");
     fprintf(stderr, "    -S, --samples-file <file>         file of samples to include\n");
     fprintf(stderr, "    -t, --targets <region>            similar to -r but streams rather than index-jumps\n");
     fprintf(stderr, "    -T, --targets-file <file>         similar to -R but streams rather than index-jumps\n");
@@ -206,6 +506,7 @@ static void usage(void)
 int main_vcfquery(int argc, char *argv[])
 {
     int c, collapse = 0;
+    char *tmp;
     args_t *args = (args_t*) calloc(1,sizeof(args_t));
     args->argc   = argc; args->argv = argv;
     int regions_is_file = 0, targets_is_file = 0;
@@ -229,6 +530,10 @@ int main_vcfquery(int argc, char *argv[])
         {"collapse",1,0,'c'},
         {"vcf-list",1,0,'v'},
         {"allow-undef-tags",0,0,'u'},
+        {"record-threads",1,0,1},
+        {"server",0,0,2},
+        {"server-threads",1,0,3},
+        {"columnar",0,0,4},
         {0,0,0,0}
     };
     while ((c = getopt_long(argc, argv, "hlr:R:f:a:s:S:Ht:T:c:v:i:e:o:u",loptions,NULL)) >= 0) {
@@ -273,6 +578,16 @@ int main_vcfquery(int argc, char *argv[])
             case 'u': args->allow_undef_tags = 1; break;
             case 's': args->sample_list = optarg; break;
             case 'S': args->sample_list = optarg; args->sample_is_file = 1; break;
+            case  1 :
+                args->record_threads = strtol(optarg,&tmp,10);
+                if ( *tmp || args->record_threads<0 ) error("Could not parse argument: --record-threads %s\n", optarg);
+                break;
+            case  2 : args->server = 1; break;
+            case  4 : args->columnar = 1; break;
+            case  3 :
+                args->server_threads = strtol(optarg,&tmp,10);
+                if ( *tmp || args->server_threads<=0 ) error("Could not parse argument: --server-threads %s\n", optarg);
+                break;
             case 'h':
             case '?': usage();
             default: error("Unknown argument: %s\n", optarg);
@@ -301,6 +616,19 @@ int main_vcfquery(int argc, char *argv[])
     args->out = args->fn_out ? fopen(args->fn_out, "w") : stdout;
     if ( !args->out ) error("%s: %s\n", args->fn_out,strerror(errno));
 
+    if ( args->server )
+    {
+        if ( !fname || !strcmp("-",fname) ) error("The --server mode requires an indexed file\n");
+        if ( optind+1 < argc || args->vcf_list ) error("The --server mode works with a single file\n");
+        if ( args->regions_list || args->targets_list ) error("The regions are read from stdin in the --server mode\n");
+        if ( args->columnar ) error("The --columnar output is not supported in the --server mode\n");
+        query_server(args, fname);
+        free(args->format_str);
+        fclose(args->out);
+        free(args);
+        return 0;
+    }
+
     if ( !args->vcf_list )
     {
         if ( !fname ) usage();
@@ -32,9 +32,12 @@ THE SOFTWARE.  */
 #include <htslib/kseq.h>
 #include <htslib/bgzf.h>
 #include <errno.h>
+#include <pthread.h>
 #include "bcftools.h"
 #include "HMM.h"
 #include "smpl_ilist.h"
+#include "genmap.h"
+#include "cache.h"
 
 #define STATE_HW 0        // normal state, follows Hardy-Weinberg allele frequencies
 #define STATE_AZ 1        // autozygous state
@@ -43,13 +46,43 @@ THE SOFTWARE.  */
 #define OUTPUT_RG (1<<2)
 #define OUTPUT_GZ (1<<3)
 
-/** Genetic map */
+/**
+ *  The --AF-cache file, see cache.h: af_cache_hdr_t followed by af_site_t [nsites]
+ *  in the order of the VCF. The cache is valid only for the same VCF and the
+ *  same AF options, see af_cache_stamp(). The sites are identified by the
+ *  position and a hash of the alleles, records at the same position, such as
+ *  split multiallelics, have each their own entry.
+ */
+#define AF_CACHE_MAGIC "BCFROHA\3"
+
 typedef struct
 {
-    int pos;
-    double rate;
+    uint64_t nsites;
 }
-genmap_t;
+af_cache_hdr_t;
+
+typedef struct
+{
+    int32_t rid, pos;
+    uint64_t als;       // hash of the alleles and of the ALT allele used, see af_site_als()
+    double af;          // NAN if not available
+}
+af_site_t;
+
+typedef struct
+{
+    // reading: the memory-mapped cache and the current position in it
+    cache_t *cache;
+    af_site_t *sites;
+    int64_t nsites, isite, *rid_beg;
+    int nrid, rid;
+
+    // writing: the sites are written as they come, the header at the end
+    cache_t *out;
+    uint64_t hdr_off;
+    af_cache_hdr_t hdr;
+}
+af_cache_t;
 
 /** HMM data for each sample */
 typedef struct
@@ -61,6 +94,7 @@ typedef struct
     int nused;          // some stats to detect if things didn't go wrong
     int nrid, *rid, *rid_off;   // for viterbi training, keep all chromosomes
     void *snapshot;             // hmm snapshot
+    kstring_t out;              // buffered output with --sample-threads
     struct {
         uint32_t beg,end,nqual;
         double qual;
@@ -76,9 +110,9 @@ typedef struct _args_t
     double t2AZ, t2HW;      // P(AZ|HW) and P(HW|AZ) parameters
     double unseen_PL, dflt_AF;
 
-    char *genmap_fname;
+    char *genmap_fname, *genmap_index;
     genmap_t *genmap;
-    int ngenmap, mgenmap, igenmap;
+    int igenmap;            // cursor in the genetic map
     double rec_rate;        // constant recombination rate if > 0
 
     hmm_t *hmm;
@@ -99,15 +133,33 @@ typedef struct _args_t
     smpl_ilist_t *roh_smpl;     // list of samples to analyze (--samples, --samples-file)
     char *estimate_AF;          // list of samples for AF estimate and query sample
     int af_from_PL;             // estimate AF from FMT/PL rather than FMT/GT
+    char *af_cache_fname;       // --AF-cache: AF of the sites, reused across runs
+    af_cache_t *af_cache;
     char **argv, *targets_list, *regions_list, *af_fname, *af_tag, *samples, *buffer_size, *output_fname;
     int argc, fake_PLs, snps_only, vi_training, samples_is_file, output_type, skip_homref, n_threads;
     BGZF *out;
     kstring_t str;
+
+    // --sample-threads: samples waiting to be flushed are processed in parallel,
+    // each worker runs its own HMM on a private copy of args_t
+    int sample_threads, buffered;
+    int *flush_smpl, nflush, iflush;
+    struct _roh_worker_t *workers;
+    struct _args_t *parent;
+    pthread_mutex_t flush_lock;
 }
 args_t;
 
+typedef struct _roh_worker_t
+{
+    args_t args;
+    pthread_t thread;
+}
+roh_worker_t;
+
 void set_tprob_genmap(hmm_t *hmm, uint32_t prev_pos, uint32_t pos, void *data, double *tprob);
 void set_tprob_rrate(hmm_t *hmm, uint32_t prev_pos, uint32_t pos, void *data, double *tprob);
+static void af_cache_destroy(af_cache_t *afc);
 
 void *smalloc(size_t size)
 {
@@ -116,6 +168,26 @@ void *smalloc(size_t size)
     return mem;
 }
 
+/*
+ *  Init transition matrix and HMM, the callback data of the transition
+ *  probability setters is the args_t the HMM is used with
+ */
+static hmm_t *init_hmm(args_t *args, args_t *data)
+{
+    double tprob[4];
+    MAT(tprob,2,STATE_HW,STATE_HW) = 1 - args->t2AZ;
+    MAT(tprob,2,STATE_HW,STATE_AZ) = args->t2HW;
+    MAT(tprob,2,STATE_AZ,STATE_HW) = args->t2AZ;
+    MAT(tprob,2,STATE_AZ,STATE_AZ) = 1 - args->t2HW; 
+
+    hmm_t *hmm = hmm_init(2, tprob, 10000);
+    if ( args->genmap_fname ) 
+        hmm_set_tprob_func(hmm, set_tprob_genmap, data);
+    else if ( args->rec_rate > 0 )
+        hmm_set_tprob_func(hmm, set_tprob_rrate, data);
+    return hmm;
+}
+
 static void init_data(args_t *args)
 {
     int i;
@@ -125,6 +197,14 @@ static void init_data(args_t *args)
 
     if ( !bcf_hdr_nsamples(args->hdr) ) error("No samples in the VCF?\n");
 
+    if ( args->genmap_fname )
+    {
+        int nseqs;
+        const char **seqs = bcf_hdr_seqnames(args->hdr, &nseqs);
+        args->genmap = genmap_init(args->genmap_fname, args->genmap_index, seqs, nseqs);
+        free(seqs);
+    }
+
     if ( !args->fake_PLs )
     {
         args->pl_hdr_id = bcf_hdr_id2int(args->hdr, BCF_DT_ID, "PL");
@@ -251,18 +331,15 @@ static void init_data(args_t *args)
 
     for (i=0; i<256; i++) args->pl2p[i] = pow(10., -i/10.);
 
-    // Init transition matrix and HMM
-    double tprob[4];
-    MAT(tprob,2,STATE_HW,STATE_HW) = 1 - args->t2AZ;
-    MAT(tprob,2,STATE_HW,STATE_AZ) = args->t2HW;
-    MAT(tprob,2,STATE_AZ,STATE_HW) = args->t2AZ;
-    MAT(tprob,2,STATE_AZ,STATE_AZ) = 1 - args->t2HW; 
-
-    args->hmm = hmm_init(2, tprob, 10000);
-    if ( args->genmap_fname ) 
-        hmm_set_tprob_func(args->hmm, set_tprob_genmap, args);
-    else if ( args->rec_rate > 0 )
-        hmm_set_tprob_func(args->hmm, set_tprob_rrate, args);
+    args->hmm = init_hmm(args, args);
+    args->flush_smpl = (int*) malloc(sizeof(int)*args->roh_smpl->n);
+    if ( args->sample_threads )
+    {
+        args->workers = (roh_worker_t*) calloc(args->sample_threads, sizeof(roh_worker_t));
+        for (i=0; i<args->sample_threads; i++)
+            args->workers[i].args.hmm = init_hmm(args, &args->workers[i].args);
+        pthread_mutex_init(&args->flush_lock, NULL);
+    }
 
     args->out = bgzf_open(strcmp("stdout",args->output_fname)?args->output_fname:"-", args->output_type&OUTPUT_GZ ? "wg" : "wu"); 
     if ( !args->out ) error("Failed to open %s: %s\n", args->output_fname, strerror(errno));
@@ -327,7 +404,19 @@ static void destroy_data(args_t *args)
         free(args->smpl[i].rid);
         free(args->smpl[i].rid_off);
         free(args->smpl[i].snapshot);
+        free(args->smpl[i].out.s);
     }
+    if ( args->sample_threads )
+    {
+        for (i=0; i<args->sample_threads; i++)
+        {
+            hmm_destroy(args->workers[i].args.hmm);
+            free(args->workers[i].args.str.s);
+        }
+        free(args->workers);
+        pthread_mutex_destroy(&args->flush_lock);
+    }
+    free(args->flush_smpl);
     free(args->str.s);
     free(args->smpl);
     if ( args->af_smpl ) smpl_ilist_destroy(args->af_smpl);
@@ -337,98 +426,23 @@ static void destroy_data(args_t *args)
     hmm_destroy(args->hmm);
     bcf_sr_destroy(args->files);
     free(args->AFs); free(args->pdg);
-    free(args->genmap);
+    genmap_destroy(args->genmap);
+    af_cache_destroy(args->af_cache);
     free(args->itmp);
     free(args->samples);
 }
 
 static int load_genmap(args_t *args, const char *chr)
 {
-    if ( !args->genmap_fname ) { args->ngenmap = 0; return 0; }
-
-    kstring_t str = {0,0,0};
-    char *fname = strstr(args->genmap_fname,"{CHROM}");
-    if ( fname )
-    {
-        kputsn(args->genmap_fname, fname - args->genmap_fname, &str);
-        kputs(chr, &str);
-        kputs(fname+7,&str);
-        fname = str.s;
-    }
-    else
-        fname = args->genmap_fname;
-
-    htsFile *fp = hts_open(fname, "rb");
-    if ( !fp )
-    {
-        args->ngenmap = 0;
-        return -1;
-    }
-
-    hts_getline(fp, KS_SEP_LINE, &str);
-    if ( strcmp(str.s,"position COMBINED_rate(cM/Mb) Genetic_Map(cM)") )
-        error("Unexpected header, found:\n\t[%s], but expected:\n\t[position COMBINED_rate(cM/Mb) Genetic_Map(cM)]\n", fname, str.s);
-
-    args->ngenmap = args->igenmap = 0;
-    while ( hts_getline(fp, KS_SEP_LINE, &str) > 0 )
-    {
-        args->ngenmap++;
-        hts_expand(genmap_t,args->ngenmap,args->mgenmap,args->genmap);
-        genmap_t *gm = &args->genmap[args->ngenmap-1];
-
-        // position, convert to 0-based
-        char *tmp, *end;
-        gm->pos = strtol(str.s, &tmp, 10);
-        if ( str.s==tmp ) error("Could not parse %s: %s\n", fname, str.s);
-        gm->pos -= 1;
-
-        // skip second column
-        tmp++;
-        while ( *tmp && !isspace(*tmp) ) tmp++;
-
-        // read the genetic map in cM, scale from % to likelihood
-        gm->rate = strtod(tmp+1, &end);
-        if ( tmp+1==end ) error("Could not parse %s: %s\n", fname, str.s);
-        gm->rate *= 0.01;
-    }
-    if ( !args->ngenmap ) error("Genetic map empty?\n");
-    if ( hts_close(fp) ) error("Close failed\n");
-    free(str.s);
-    return 0;
-}
-
-static double get_genmap_rate(args_t *args, int start, int end)
-{
-    // position i to be equal to or smaller than start
-    int i = args->igenmap;
-    if ( args->genmap[i].pos > start )
-    {
-        while ( i>0 && args->genmap[i].pos > start ) i--;
-    }
-    else
-    {
-        while ( i+1<args->ngenmap && args->genmap[i+1].pos < start ) i++;
-    }
-    // position j to be equal or larger than end
-    int j = i;
-    while ( j+1<args->ngenmap && args->genmap[j].pos < end ) j++;
-    if ( i==j )
-    {
-        args->igenmap = i;
-        return 0;
-    }
-
-    if ( start <  args->genmap[i].pos ) start = args->genmap[i].pos;
-    if ( end >  args->genmap[j].pos ) end = args->genmap[j].pos;
-    double rate = (args->genmap[j].rate - args->genmap[i].rate)/(args->genmap[j].pos - args->genmap[i].pos) * (end-start);
-    args->igenmap = j;
-    return rate;
+    if ( !args->genmap ) return 0;
+    args->igenmap = 0;
+    return genmap_set_seq(args->genmap, chr);
 }
 
 void set_tprob_genmap(hmm_t *hmm, uint32_t prev_pos, uint32_t pos, void *data, double *tprob)
 {
     args_t *args = (args_t*) data;
-    double ci = get_genmap_rate(args, prev_pos, pos);
+    double ci = genmap_rate(args->genmap, &args->igenmap, prev_pos, pos);
     if ( args->rec_rate ) ci *= args->rec_rate;
     if ( ci > 1 ) ci = 1;
     MAT(tprob,2,STATE_HW,STATE_AZ) *= ci;
@@ -474,6 +488,14 @@ void set_tprob_rrate(hmm_t *hmm, uint32_t prev_pos, uint32_t pos, void *data, do
  *
  */
 
+static inline void write_str(args_t *args, smpl_t *smpl)
+{
+    if ( args->buffered )
+        kputsn(args->str.s, args->str.l, &smpl->out);
+    else if ( bgzf_write(args->out, args->str.s, args->str.l) != args->str.l )
+        error("Error writing %s: %s\n", args->output_fname, strerror(errno));
+}
+
 static void flush_viterbi(args_t *args, int ismpl)
 {
     smpl_t *smpl = &args->smpl[ismpl];
@@ -506,7 +528,7 @@ static void flush_viterbi(args_t *args, int ismpl)
             {
                 args->str.l = 0;
                 ksprintf(&args->str, "ST\t%s\t%s\t%d\t%d\t%.1f\n", name,chr,smpl->sites[i]+1, state, qual);
-                if ( bgzf_write(args->out, args->str.s, args->str.l) != args->str.l ) error("Error writing %s: %s\n", args->output_fname, strerror(errno));
+                write_str(args, smpl);
             }
 
             if ( args->output_type & OUTPUT_RG )
@@ -518,7 +540,7 @@ static void flush_viterbi(args_t *args, int ismpl)
                         args->str.l = 0;
                         ksprintf(&args->str, "RG\t%s\t%s\t%d\t%d\t%d\t%d\t%.1f\n",name,bcf_hdr_id2name(args->hdr,smpl->rg.rid),
                                 smpl->rg.beg+1,smpl->rg.end+1,smpl->rg.end-smpl->rg.beg+1,smpl->rg.nqual,smpl->rg.qual/smpl->rg.nqual);
-                        if ( bgzf_write(args->out, args->str.s, args->str.l) != args->str.l ) error("Error writing %s: %s\n", args->output_fname, strerror(errno));
+                        write_str(args, smpl);
                         smpl->rg.state = 0;
                     }
                     else
@@ -555,7 +577,7 @@ static void flush_viterbi(args_t *args, int ismpl)
                 args->str.l = 0;
                 ksprintf(&args->str, "RG\t%s\t%s\t%d\t%d\t%d\t%d\t%.1f\n",name,bcf_hdr_id2name(args->hdr,smpl->rg.rid),
                         smpl->rg.beg+1,smpl->rg.end+1,smpl->rg.end-smpl->rg.beg+1,smpl->rg.nqual,smpl->rg.qual/smpl->rg.nqual);
-                if ( bgzf_write(args->out, args->str.s, args->str.l) != args->str.l ) error("Error writing %s: %s\n", args->output_fname, strerror(errno));
+                write_str(args, smpl);
                 smpl->rg.state = 0;
             }
         }
@@ -604,7 +626,7 @@ static void flush_viterbi(args_t *args, int ismpl)
             name,niter,deltaz,delthw,
             1-MAT(tprob_new,2,STATE_HW,STATE_HW),MAT(tprob_new,2,STATE_AZ,STATE_HW),
             1-MAT(tprob_new,2,STATE_AZ,STATE_AZ),MAT(tprob_new,2,STATE_HW,STATE_AZ));
-        if ( bgzf_write(args->out, args->str.s, args->str.l) != args->str.l ) error("Error writing %s: %s\n", args->output_fname, strerror(errno));
+        write_str(args, smpl);
     }
     while ( deltaz > args->baum_welch_th || delthw > args->baum_welch_th );
     
@@ -626,11 +648,188 @@ static void flush_viterbi(args_t *args, int ismpl)
             double *pval = fwd + j*2;
             args->str.l = 0;
             ksprintf(&args->str, "ROH\t%s\t%s\t%d\t%d\t%.1f\n", name,chr,smpl->sites[ioff+j]+1, state, phred_score(1.0-pval[state]));
-            if ( bgzf_write(args->out, args->str.s, args->str.l) != args->str.l ) error("Error writing %s: %s\n", args->output_fname, strerror(errno));
+            write_str(args, smpl);
         }
     }
 }
 
+static void *roh_worker(void *data)
+{
+    roh_worker_t *worker = (roh_worker_t*) data;
+    args_t *args = worker->args.parent;
+    while (1)
+    {
+        pthread_mutex_lock(&args->flush_lock);
+        int i = args->iflush++;
+        pthread_mutex_unlock(&args->flush_lock);
+        if ( i >= args->nflush ) break;
+        flush_viterbi(&worker->args, args->flush_smpl[i]);
+    }
+    return NULL;
+}
+
+/*
+ *  Flush the samples queued in args->flush_smpl. With --sample-threads the
+ *  samples are distributed between the workers, the main thread being one of
+ *  them, and the buffered output is written in the original order.
+ */
+static void flush_samples(args_t *args)
+{
+    int i, nthr = args->sample_threads < args->nflush ? args->sample_threads : args->nflush;
+    if ( nthr<=1 )
+    {
+        for (i=0; i<args->nflush; i++) flush_viterbi(args, args->flush_smpl[i]);
+        args->nflush = 0;
+        return;
+    }
+
+    args->iflush = 0;
+    for (i=0; i<nthr; i++)
+    {
+        args_t *wargs = &args->workers[i].args;
+        hmm_t *hmm = wargs->hmm;
+        kstring_t str = wargs->str;
+        *wargs = *args;
+        wargs->hmm = hmm;
+        wargs->str = str;
+        wargs->parent = args;
+        wargs->buffered = 1;
+    }
+    for (i=1; i<nthr; i++)
+        if ( pthread_create(&args->workers[i].thread, NULL, roh_worker, &args->workers[i])!=0 ) error("Failed to create threads\n");
+    roh_worker(&args->workers[0]);
+    for (i=1; i<nthr; i++) pthread_join(args->workers[i].thread, NULL);
+
+    for (i=0; i<args->nflush; i++)
+    {
+        smpl_t *smpl = &args->smpl[ args->flush_smpl[i] ];
+        if ( !smpl->out.l ) continue;
+        if ( bgzf_write(args->out, smpl->out.s, smpl->out.l) != smpl->out.l ) error("Error writing %s: %s\n", args->output_fname, strerror(errno));
+        smpl->out.l = 0;
+    }
+    args->nflush = 0;
+}
+
+/*
+ *  The cache is tied to the VCF and to everything the AFs are computed from:
+ *  the AF options, the files they name and the subset of samples. The regions
+ *  and targets are not included, the sites missing from the cache are computed.
+ */
+static uint64_t af_cache_stamp(args_t *args, const char *vcf_fname)
+{
+    uint64_t stamp = CACHE_STAMP_INIT;
+    const char *strs[] = { vcf_fname, args->af_tag, args->af_fname, args->estimate_AF, args->samples };
+    int i;
+    for (i=0; i<sizeof(strs)/sizeof(*strs); i++) stamp = cache_stamp_str(stamp, strs[i]);
+    stamp = cache_stamp(stamp, &args->dflt_AF, sizeof(args->dflt_AF));
+
+    const char *af_smpl_fname = args->estimate_AF;
+    if ( af_smpl_fname && (!strncmp("GT,",af_smpl_fname,3) || !strncmp("PL,",af_smpl_fname,3)) ) af_smpl_fname += 3;
+    const char *fnames[] = { vcf_fname, args->af_fname, af_smpl_fname, args->samples_is_file ? args->samples : NULL };
+    for (i=0; i<sizeof(fnames)/sizeof(*fnames); i++) stamp = cache_stamp_file(stamp, fnames[i]);
+    return stamp;
+}
+
+static af_cache_t *af_cache_init(args_t *args, const char *vcf_fname)
+{
+    if ( !strcmp("-",vcf_fname) ) error("Error: --AF-cache cannot be used with the standard input\n");
+    af_cache_t *afc = (af_cache_t*) calloc(1, sizeof(af_cache_t));
+    afc->rid = -1;
+    uint64_t stamp = af_cache_stamp(args, vcf_fname);
+
+    afc->cache = cache_open(args->af_cache_fname, AF_CACHE_MAGIC, stamp, "AF cache");
+    if ( afc->cache )
+    {
+        af_cache_hdr_t hdr;
+        cache_read(afc->cache, &hdr, sizeof(hdr));
+        afc->sites  = (af_site_t*) cache_ptr(afc->cache, afc->cache->off, sizeof(af_site_t)*hdr.nsites);
+        afc->nsites = hdr.nsites;
+
+        // the first site of each sequence
+        int64_t i;
+        for (i=0; i<afc->nsites; i++)
+        {
+            int rid = afc->sites[i].rid;
+            if ( rid < afc->nrid && afc->rid_beg[rid]>=0 ) continue;
+            if ( rid >= afc->nrid )
+            {
+                afc->rid_beg = (int64_t*) realloc(afc->rid_beg, sizeof(*afc->rid_beg)*(rid+1));
+                while ( afc->nrid <= rid ) afc->rid_beg[afc->nrid++] = -1;
+            }
+            afc->rid_beg[rid] = i;
+        }
+        return afc;
+    }
+
+    afc->out = cache_create(args->af_cache_fname, AF_CACHE_MAGIC, stamp);
+    afc->hdr_off = afc->out->off;
+    cache_write(afc->out, &afc->hdr, sizeof(afc->hdr));
+    return afc;
+}
+
+// Finish writing the cache
+static void af_cache_destroy(af_cache_t *afc)
+{
+    if ( !afc ) return;
+    if ( afc->out )
+    {
+        cache_write_at(afc->out, afc->hdr_off, &afc->hdr, sizeof(afc->hdr));
+        cache_commit(afc->out);
+    }
+    cache_close(afc->cache);
+    free(afc->rid_beg);
+    free(afc);
+}
+static uint64_t af_site_als(bcf1_t *line, int ial)
+{
+    uint64_t als = cache_stamp(CACHE_STAMP_INIT, &ial, sizeof(ial));
+    int i;
+    for (i=0; i<line->n_allele; i++) als = cache_stamp_str(als, line->d.allele[i]);
+    return als;
+}
+
+/*
+ *  Look up the AF of the site, the sites come in the order of the cache so
+ *  the cursor only advances within a sequence. Of the entries at the same
+ *  position, the first one with matching alleles is taken. Returns 1 if the
+ *  site is in the cache, with af set to NAN if no AF was available, and 0
+ *  otherwise.
+ */
+static int af_cache_get(af_cache_t *afc, bcf1_t *line, int ial, double *af)
+{
+    if ( line->rid!=afc->rid )
+    {
+        afc->rid   = line->rid;
+        afc->isite = line->rid < afc->nrid ? afc->rid_beg[line->rid] : -1;
+    }
+    if ( afc->isite<0 ) return 0;
+    while ( afc->isite < afc->nsites && afc->sites[afc->isite].rid==line->rid && afc->sites[afc->isite].pos < line->pos ) afc->isite++;
+
+    uint64_t als = af_site_als(line, ial);
+    int64_t i;
+    for (i=afc->isite; i<afc->nsites; i++)
+    {
+        if ( afc->sites[i].rid!=line->rid || afc->sites[i].pos!=line->pos ) return 0;
+        if ( afc->sites[i].als==als ) break;
+    }
+    if ( i==afc->nsites ) return 0;
+    afc->isite = i;
+    *af = afc->sites[i].af;
+    return 1;
+}
+
+static void af_cache_put(af_cache_t *afc, bcf1_t *line, int ial, double af)
+{
+    af_site_t site;
+    memset(&site, 0, sizeof(site));
+    site.rid = line->rid;
+    site.pos = line->pos;
+    site.als = af_site_als(line, ial);
+    site.af  = af;
+    cache_write(afc->out, &site, sizeof(site));
+    afc->hdr.nsites++;
+}
+
 int read_AF(bcf_sr_regions_t *tgt, bcf1_t *line, double *alt_freq)
 {
     if ( tgt->nals != line->n_allele ) return -1;    // number of alleles does not match
@@ -799,8 +998,13 @@ int process_line(args_t *args, bcf1_t *line, int ial)
     bcf_fmt_t *fmt_pl = NULL;
 
     // Set allele frequency
-    int ret = 0, i,j;
-    if ( args->af_tag )
+    int ret = 0, i,j, cached = 0;
+    if ( args->af_cache && args->af_cache->cache && af_cache_get(args->af_cache, line, ial, &alt_freq) )
+    {
+        cached = 1;
+        if ( isnan(alt_freq) ) ret = -1;
+    }
+    else if ( args->af_tag )
     {
         // Use an INFO tag provided by the user
         ret = bcf_get_info_float(args->hdr, line, args->af_tag, &args->AFs, &args->mAFs);
@@ -852,6 +1056,7 @@ int process_line(args_t *args, bcf1_t *line, int ial)
             alt_freq = (double) AC/AN;
     }
 
+    if ( args->af_cache && !cached && args->af_cache->out ) af_cache_put(args->af_cache, line, ial, ret<0 ? NAN : alt_freq);
     if ( ret<0 ) return ret;
     if ( alt_freq==0.0 ) return -1;
 
@@ -952,8 +1157,9 @@ int process_line(args_t *args, bcf1_t *line, int ial)
                 smpl->rid_off[smpl->nrid-1] = smpl->nsites - 1;
             }
         }
-        else if ( args->nbuf_max && smpl->nsites >= args->nbuf_max ) flush_viterbi(args, i);
+        else if ( args->nbuf_max && smpl->nsites >= args->nbuf_max ) args->flush_smpl[args->nflush++] = i;
     }
+    if ( args->nflush ) flush_samples(args);
 
     return 0;
 }
@@ -965,7 +1171,8 @@ static void vcfroh(args_t *args, bcf1_t *line)
     // Are we done?
     if ( !line )
     { 
-        for (i=0; i<args->roh_smpl->n; i++) flush_viterbi(args, i);
+        for (i=0; i<args->roh_smpl->n; i++) args->flush_smpl[args->nflush++] = i;
+        flush_samples(args);
         return; 
     }
     args->ntot++;
@@ -1005,11 +1212,10 @@ static void vcfroh(args_t *args, bcf1_t *line)
     {
         if ( !args->vi_training )
         {
+            for (i=0; i<args->roh_smpl->n; i++) args->flush_smpl[args->nflush++] = i;
+            flush_samples(args);
             for (i=0; i<args->roh_smpl->n; i++)
-            {
-                flush_viterbi(args, i);
                 hmm_reset(args->hmm, args->smpl[i].snapshot);
-            }
         }
         args->prev_rid = line->rid;
         args->prev_pos = line->pos;
@@ -1043,6 +1249,7 @@ static void usage(args_t *args)
     fprintf(stderr, "        --AF-dflt <float>              if AF is not known, use this allele frequency [skip]\n");
     fprintf(stderr, "        --AF-tag <TAG>                 use TAG for allele frequency\n");
     fprintf(stderr, "        --AF-file <file>               read allele frequencies from file (CHR\\tPOS\\tREF,ALT\\tAF)\n");
+    fprintf(stderr, "        --AF-cache <file>              binary cache of the allele frequencies, reused if valid, created otherwise\n");
     fprintf(stderr, "    -b  --buffer-size <int[,int]>      buffer size and the number of overlapping sites, 0 for unlimited [0]\n");
     fprintf(stderr, "                                           If the first number is negative, it is interpreted as the maximum memory to\n");
     fprintf(stderr, "                                           use, in MB. The default overlap is set to roughly 1%% of the buffer size.\n");
@@ -1053,7 +1260,8 @@ static void usage(args_t *args)
     fprintf(stderr, "    -i, --ignore-homref                skip hom-ref genotypes (0/0)\n");
     fprintf(stderr, "    -I, --skip-indels                  skip indels as their genotypes are enriched for errors\n");
     fprintf(stderr, "    -m, --genetic-map <file>           genetic map in IMPUTE2 format, single file or mask, where string \"{CHROM}\"\n");
-    fprintf(stderr, "                                           is replaced with chromosome name\n");
+    fprintf(stderr, "                                           is replaced with chromosome name, or a binary index of the map\n");
+    fprintf(stderr, "        --genetic-map-index <file>     binary index of the -m map, built if it does not exist or is outdated\n");
     fprintf(stderr, "    -M, --rec-rate <float>             constant recombination rate per bp\n");
     fprintf(stderr, "    -o, --output <file>                write output to a file [standard output]\n");
     fprintf(stderr, "    -O, --output-type [srz]            output s:per-site, r:regions, z:compressed [sr]\n");
@@ -1063,6 +1271,7 @@ static void usage(args_t *args)
     fprintf(stderr, "    -S, --samples-file <file>          file of samples to analyze [all samples]\n");
     fprintf(stderr, "    -t, --targets <region>             similar to -r but streams rather than index-jumps\n");
     fprintf(stderr, "    -T, --targets-file <file>          similar to -R but streams rather than index-jumps\n");
+    fprintf(stderr, "        --sample-threads <int>         number of threads to run the HMM for different samples in parallel [0]\n");
     fprintf(stderr, "        --threads <int>                number of extra decompression threads [0]\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "HMM Options:\n");
@@ -1108,6 +1317,9 @@ int main_vcfroh(int argc, char *argv[])
         {"rec-rate",1,0,'M'},
         {"skip-indels",0,0,'I'},
         {"threads",1,0,9},
+        {"sample-threads",1,0,10},
+        {"genetic-map-index",1,0,11},
+        {"AF-cache",1,0,12},
         {0,0,0,0}
     };
 
@@ -1138,6 +1350,8 @@ int main_vcfroh(int argc, char *argv[])
                 args->unseen_PL = pow(10,-args->unseen_PL/10.); 
                 break;
             case 'm': args->genmap_fname = optarg; break;
+            case 11: args->genmap_index = optarg; break;
+            case 12: args->af_cache_fname = optarg; break;
             case 'M':
                 args->rec_rate = strtod(optarg,&tmp);
                 if ( *tmp ) error("Could not parse: -M %s\n", optarg);
@@ -1157,6 +1371,10 @@ int main_vcfroh(int argc, char *argv[])
             case 'r': args->regions_list = optarg; break;
             case 'R': args->regions_list = optarg; regions_is_file = 1; break;
             case  9 : args->n_threads = strtol(optarg, 0, 0); break;
+            case 10 :
+                args->sample_threads = strtol(optarg, &tmp, 10);
+                if ( *tmp || args->sample_threads<0 ) error("Could not parse argument: --sample-threads %s\n", optarg);
+                break;
             case 'V': 
                 args->vi_training = 1; 
                 args->baum_welch_th = strtod(optarg,&tmp); 
@@ -1178,6 +1396,7 @@ int main_vcfroh(int argc, char *argv[])
     else fname = argv[optind];
 
     if ( args->vi_training && args->buffer_size ) error("Error: cannot use -b with -V\n");
+    if ( args->genmap_index && !args->genmap_fname ) error("Error: --genetic-map-index requires -m\n");
     if ( args->t2AZ<0 || args->t2AZ>1 ) error("Error: The parameter --hw-to-az is not in [0,1]\n", args->t2AZ);
     if ( args->t2HW<0 || args->t2HW>1 ) error("Error: The parameter --az-to-hw is not in [0,1]\n", args->t2HW);
     if ( naf_opts>1 ) error("Error: The options --AF-tag, --AF-file and -e are mutually exclusive\n");
@@ -1201,6 +1420,7 @@ int main_vcfroh(int argc, char *argv[])
         error("Failed to create threads\n");
     if ( !bcf_sr_add_reader(args->files, fname) ) error("Failed to open %s: %s\n", fname,bcf_sr_strerror(args->files->errnum));
 
+    if ( args->af_cache_fname ) args->af_cache = af_cache_init(args, fname);
     init_data(args);
     while ( bcf_sr_next_line(args->files) )
     {
@@ -36,6 +36,7 @@ THE SOFTWARE.  */
 #include <htslib/synced_bcf_reader.h>
 #include <htslib/vcfutils.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include "bcftools.h"
 
 #define SOM_TRAIN    1
@@ -53,6 +54,7 @@ typedef struct
     double bmu_th;  // best-matching unit threshold
     int *a_idx, *b_idx; // temp arrays for traversing variable number of nested loops
     double *div;        // dtto
+    int *node_idx;      // precomputed k-dimensional indexes of all nodes, size*ndim
 }
 som_t;
 
@@ -76,7 +78,7 @@ typedef struct
 
     int rand_seed, good_class, bad_class;
     char **argv, *fname, *prefix;
-    int argc, action, train_bad, merge;
+    int argc, action, train_bad, merge, nthreads;
 }
 args_t;
 
@@ -245,11 +247,12 @@ static inline int som_find_bmu(som_t *som, double *vec, double *dist)
     double min_dist = HUGE_VAL;
     int min_idx = 0;
 
+    // the partial sum can only grow, stop as soon as it cannot beat the best node
     int i, k;
     for (i=0; i<som->size; i++)
     {
         double dist = 0;
-        for (k=0; k<som->kdim; k++)
+        for (k=0; k<som->kdim && dist < min_dist; k++)
             dist += (vec[k] - ptr[k]) * (vec[k] - ptr[k]);
         if ( dist < min_dist )
         {
@@ -273,7 +276,7 @@ static inline double som_get_score(som_t *som, double *vec, double bmu_th)
         if ( som->c[i] >= bmu_th )
         {
             double dist = 0;
-            for (k=0; k<som->kdim; k++)
+            for (k=0; k<som->kdim && dist < min_dist; k++)
                 dist += (vec[k] - ptr[k]) * (vec[k] - ptr[k]);
             if ( dist < min_dist ) min_dist = dist;
         }
@@ -304,7 +307,7 @@ static void som_train_site(som_t *som, double *vec, int update_counts)
 
     // find the best matching unit and its indexes
     int min_idx = som_find_bmu(som, vec, NULL);
-    som_idx_to_ndim(som, min_idx, som->a_idx);
+    int *a_idx  = som->node_idx + min_idx*som->ndim;
 
     // update the weights: traverse the map and make all nodes within the
     // radius more similar to the input vector
@@ -313,10 +316,10 @@ static void som_train_site(som_t *som, double *vec, int update_counts)
     int i, j, k;
     for (i=0; i<som->size; i++)
     {
-        som_idx_to_ndim(som, i, som->b_idx);
+        int *b_idx = som->node_idx + i*som->ndim;
         double dist = 0;
         for (j=0; j<som->ndim; j++)
-            dist += (som->a_idx[j] - som->b_idx[j]) * (som->a_idx[j] - som->b_idx[j]);
+            dist += (a_idx[j] - b_idx[j]) * (a_idx[j] - b_idx[j]);
         if ( dist <= radius )
         {
             double influence = exp(-dist*dist*0.5/radius) * learning_rate;
@@ -362,11 +365,14 @@ static som_t *som_init(args_t *args)
     som->div   = (double*) malloc(sizeof(double)*som->ndim);
     for (i=0; i<som->ndim; i++)
         som->div[i] = pow(som->nbin,som->ndim-i-1);
+    som->node_idx = (int*) malloc(sizeof(int)*som->size*som->ndim);
+    for (i=0; i<som->size; i++)
+        som_idx_to_ndim(som, i, som->node_idx + i*som->ndim);
     return som;
 }
 static void som_destroy(som_t *som)
 {
-    free(som->a_idx); free(som->b_idx); free(som->div);
+    free(som->a_idx); free(som->b_idx); free(som->div); free(som->node_idx);
     free(som->w); free(som->c);
     free(som);
 }
@@ -397,42 +403,152 @@ static void destroy_data(args_t *args)
 #define MERGE_MIN 0
 #define MERGE_MAX 1
 #define MERGE_AVG 2
-static double get_min_score(args_t *args, int iskip)
+static double get_min_score(args_t *args, double *vals, int iskip)
 {
     int i;
     double score, min_score = HUGE_VAL;
     for (i=0; i<args->nfold; i++)
     {
         if ( i==iskip ) continue;
-        score = som_get_score(args->som[i], args->vals, args->bmu_th);
+        score = som_get_score(args->som[i], vals, args->bmu_th);
         if ( i==0 || score < min_score ) min_score = score;
     }
     return min_score;
 }
-static double get_max_score(args_t *args, int iskip)
+static double get_max_score(args_t *args, double *vals, int iskip)
 {
     int i;
     double score, max_score = -HUGE_VAL;
     for (i=0; i<args->nfold; i++)
     {
         if ( i==iskip ) continue;
-        score = som_get_score(args->som[i], args->vals, args->bmu_th);
+        score = som_get_score(args->som[i], vals, args->bmu_th);
         if ( i==0 || max_score < score ) max_score = score;
     }
     return max_score;
 }
-static double get_avg_score(args_t *args, int iskip)
+static double get_avg_score(args_t *args, double *vals, int iskip)
 {
     int i, n = 0;
     double score = 0;
     for (i=0; i<args->nfold; i++)
     {
         if ( i==iskip ) continue;
-        score += som_get_score(args->som[i], args->vals, args->bmu_th);
+        score += som_get_score(args->som[i], vals, args->bmu_th);
         n++;
     }
     return score/n;
 }
+static double get_score(args_t *args, double *vals, int iskip)
+{
+    switch (args->merge)
+    {
+        case MERGE_MIN: return get_min_score(args, vals, iskip);
+        case MERGE_MAX: return get_max_score(args, vals, iskip);
+        case MERGE_AVG: return get_avg_score(args, vals, iskip);
+    }
+    return 0;
+}
+
+// The maps are read-only when scoring, the vectors can be split among threads
+typedef struct
+{
+    args_t *args;
+    double *dat, *score;
+    int *iskip, beg, end;
+}
+score_job_t;
+
+static void *score_worker(void *arg)
+{
+    score_job_t *job = (score_job_t*) arg;
+    int i;
+    for (i=job->beg; i<job->end; i++)
+        job->score[i] = get_score(job->args, job->dat + i*job->args->mvals, job->iskip ? job->iskip[i] : -1);
+    return NULL;
+}
+
+/*
+ *  score_sites() - score n vectors stored consecutively in dat, skipping
+ *  the iskip[i]-th map for i-th vector (iskip can be NULL)
+ */
+static void score_sites(args_t *args, double *dat, int *iskip, double *score, int n)
+{
+    int i, nthr = args->nthreads > 1 ? args->nthreads : 1;
+    if ( nthr > n ) nthr = n;
+    if ( nthr <= 1 )
+    {
+        score_job_t job = { args, dat, score, iskip, 0, n };
+        score_worker(&job);
+        return;
+    }
+    pthread_t *tid = (pthread_t*) malloc(sizeof(pthread_t)*nthr);
+    score_job_t *job = (score_job_t*) malloc(sizeof(score_job_t)*nthr);
+    for (i=0; i<nthr; i++)
+    {
+        job[i].args  = args;
+        job[i].dat   = dat;
+        job[i].score = score;
+        job[i].iskip = iskip;
+        job[i].beg   = (int64_t)n*i/nthr;
+        job[i].end   = (int64_t)n*(i+1)/nthr;
+        if ( pthread_create(&tid[i], NULL, score_worker, &job[i]) ) error("Could not create a thread\n");
+    }
+    for (i=0; i<nthr; i++) pthread_join(tid[i], NULL);
+    free(job);
+    free(tid);
+}
+
+// Each of the n-fold maps is trained on its own subset of sites, the maps
+// are independent and can be trained concurrently
+typedef struct
+{
+    args_t *args;
+    int ntrain, ithr, nthr;
+}
+train_job_t;
+
+static void *train_worker(void *arg)
+{
+    train_job_t *job = (train_job_t*) arg;
+    args_t *args = job->args;
+    int i;
+    for (i=0; i<job->ntrain; i++)
+    {
+        int is_good = args->train_class[i] & 1;
+        int isom    = args->train_class[i] >> 1;
+        if ( isom % job->nthr != job->ithr ) continue;
+        if ( is_good || args->train_bad )
+            som_train_site(args->som[isom], args->train_dat+i*args->mvals, is_good);
+    }
+    return NULL;
+}
+
+static void train_maps(args_t *args, int ntrain)
+{
+    int i, nthr = args->nthreads > 1 ? args->nthreads : 1;
+    if ( nthr > args->nfold ) nthr = args->nfold;
+    if ( nthr <= 1 )
+    {
+        train_job_t job = { args, ntrain, 0, 1 };
+        train_worker(&job);
+        return;
+    }
+    pthread_t *tid = (pthread_t*) malloc(sizeof(pthread_t)*nthr);
+    train_job_t *job = (train_job_t*) malloc(sizeof(train_job_t)*nthr);
+    for (i=0; i<nthr; i++)
+    {
+        job[i].args   = args;
+        job[i].ntrain = ntrain;
+        job[i].ithr   = i;
+        job[i].nthr   = nthr;
+        if ( pthread_create(&tid[i], NULL, train_worker, &job[i]) ) error("Could not create a thread\n");
+    }
+    for (i=0; i<nthr; i++) pthread_join(tid[i], NULL);
+    free(job);
+    free(tid);
+}
+
 static int cmpfloat_desc(const void *a, const void *b)
 {
     float fa = *((float*)a);
@@ -512,13 +628,7 @@ static void do_train(args_t *args)
     for (i=0; i<args->nfold; i++) args->som[i] = som_init(args);
 
     // train
-    for (i=0; i<ntrain; i++)
-    {
-        int is_good = args->train_class[i] & 1;
-        int isom    = args->train_class[i] >> 1;
-        if ( is_good || args->train_bad )
-            som_train_site(args->som[isom], args->train_dat+i*args->mvals, is_good);
-    }
+    train_maps(args, ntrain);
 
     // norm and create plots
     for (i=0; i<args->nfold; i++)
@@ -537,25 +647,21 @@ static void do_train(args_t *args)
     float *bad  = (float*) malloc(sizeof(float)*nbad); assert(bad);
     igood = ibad = 0;
     double max_score = sqrt(args->som[0]->kdim);
+    int *iskip = (int*) malloc(sizeof(int)*ntrain);
+    double *scores = (double*) malloc(sizeof(double)*ntrain);
+    for (i=0; i<ntrain; i++)
+        iskip[i] = args->nfold==1 ? -1 : args->train_class[i] >> 1;    // this vector was used for training isom-th SOM, skip
+    score_sites(args, args->train_dat, iskip, scores, ntrain);
     for (i=0; i<ntrain; i++)
     {
-        double score = 0;
-        int is_good = args->train_class[i] & 1;
-        int isom    = args->train_class[i] >> 1;    // this vector was used for training isom-th SOM, skip
-        if ( args->nfold==1 ) isom = -1;
-        memcpy(args->vals, args->train_dat+i*args->mvals, args->mvals*sizeof(double));
-        switch (args->merge)
-        {
-            case MERGE_MIN: score = get_min_score(args, isom); break;
-            case MERGE_MAX: score = get_max_score(args, isom); break;
-            case MERGE_AVG: score = get_avg_score(args, isom); break;
-        }
-        score = 1.0 - score/max_score;
-        if ( is_good )
+        double score = 1.0 - scores[i]/max_score;
+        if ( args->train_class[i] & 1 )
             good[igood++] = score;
         else
             bad[ibad++] = score;
     }
+    free(scores);
+    free(iskip);
     qsort(good, ngood, sizeof(float), cmpfloat_desc);
     qsort(bad, nbad, sizeof(float), cmpfloat_desc);
     FILE *fp = NULL;
@@ -596,17 +702,22 @@ static void do_classify(args_t *args)
 {
     annots_reader_reset(args);
     double max_score = sqrt(args->som[0]->kdim);
-    while ( annots_reader_next(args) )
+
+    // read the sites in batches so that they can be scored in parallel
+    int i, n, nbatch = args->nthreads > 1 ? 10000*args->nthreads : 1;
+    double *dat = (double*) malloc(sizeof(double)*nbatch*args->mvals);
+    double *scores = (double*) malloc(sizeof(double)*nbatch);
+    do
     {
-        double score = 0;
-        switch (args->merge)
-        {
-            case MERGE_MIN: score = get_min_score(args, -1); break;
-            case MERGE_MAX: score = get_max_score(args, -1); break;
-            case MERGE_AVG: score = get_avg_score(args, -1); break;
-        }
-        printf("%e\n", 1.0 - score/max_score);
+        for (n=0; n<nbatch && annots_reader_next(args); n++)
+            memcpy(dat + n*args->mvals, args->vals, args->mvals*sizeof(double));
+        score_sites(args, dat, NULL, scores, n);
+        for (i=0; i<n; i++)
+            printf("%e\n", 1.0 - scores[i]/max_score);
     }
+    while ( n==nbatch );
+    free(scores);
+    free(dat);
     annots_reader_close(args);
 }
 
@@ -622,6 +733,7 @@ static void usage(void)
     fprintf(stderr, "    -p, --prefix <string>              prefix of output files\n");
     fprintf(stderr, "    -s, --size <int>                   map size [20]\n");
     fprintf(stderr, "    -t, --train                        \n");
+    fprintf(stderr, "        --threads <int>                train the n-fold maps and score sites in parallel [0]\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "Classifying options:\n");
     fprintf(stderr, "    -c, --classify                     \n");
@@ -641,6 +753,7 @@ static void usage(void)
 int main_vcfsom(int argc, char *argv[])
 {
     int c;
+    char *tmp;
     args_t *args     = (args_t*) calloc(1,sizeof(args_t));
     args->argc       = argc; args->argv = argv;
     args->nbin       = 20;
@@ -669,6 +782,7 @@ int main_vcfsom(int argc, char *argv[])
         {"merge",1,0,'m'},
         {"train",0,0,'t'},
         {"classify",0,0,'c'},
+        {"threads",1,0,9},
         {0,0,0,0}
     };
     while ((c = getopt_long(argc, argv, "htcp:n:r:b:l:s:f:d:m:e",loptions,NULL)) >= 0) {
@@ -694,6 +808,10 @@ int main_vcfsom(int argc, char *argv[])
                 break;
             case 't': args->action = SOM_TRAIN; break;
             case 'c': args->action = SOM_CLASSIFY; break;
+            case  9 :
+                args->nthreads = strtol(optarg,&tmp,10);
+                if ( *tmp || args->nthreads<0 ) error("Could not parse argument: --threads %s\n", optarg);
+                break;
             case 'h':
             case '?': usage();
             default: error("Unknown argument: %s\n", optarg);
@@ -0,0 +1,431 @@
+/*  vcfsort.c -- sort VCF/BCF files which do not fit in memory.
+
+    Copyright (C) 2017 Genome Research Ltd.
+
+    Author: Petr Danecek <pd3@sanger.ac.uk>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+DEALINGS IN THE SOFTWARE.  */
+
+/*
+    The records are read into a buffer until the memory limit is reached. The
+    buffer is then cut into chunks which are sorted on --sort-threads threads,
+    the chunks are merged and written to a temporary uncompressed BCF file,
+    a "run", and the buffer is reused. At the end the runs and the chunks
+    still in memory are merged into the output.
+
+    The runs are kept in a stack ordered by their level: whenever MAX_FANIN
+    runs of the same level accumulate at the top, they are merged into one run
+    of the next level. This bounds the number of simultaneously open files by
+    MAX_FANIN per level and each record is rewritten only log_{MAX_FANIN}(nruns)
+    times.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <htslib/vcf.h>
+#include <htslib/kstring.h>
+#include "bcftools.h"
+#include "profile.h"
+#include "kheap.h"
+
+#define MAX_FANIN 64
+
+typedef struct
+{
+    char *fname;
+    int level;
+}
+run_t;
+
+// One input of the k-way merge, either a run or a sorted chunk of the buffer
+typedef struct
+{
+    htsFile *fh;            // NULL for chunks in memory
+    bcf1_t *rec;            // the current record
+    bcf1_t **recs;          // chunks: the records and the next one to use
+    size_t irec, nrec;
+    int idx;                // the order of the input, for ties
+}
+blk_t;
+
+typedef struct
+{
+    bcf1_t **recs;
+    size_t nrecs;
+}
+chunk_t;
+
+typedef struct _args_t
+{
+    bcf_hdr_t *hdr;
+    htsFile *out_fh;
+    out_idx_t *out_idx;
+    char **argv, *fname, *output_fname, *tmp_prefix, *tmp_dir;
+    int argc, output_type, n_threads, sort_threads, record_cmd_line, write_index;
+    size_t max_mem, mem;
+    bcf1_t **buf;           // the records are allocated once and reused after each run
+    size_t nbuf, mbuf;
+    run_t *runs;
+    int nruns, mruns, irun;
+    chunk_t *chunks;
+    int nchunks;
+}
+args_t;
+
+static int cmp_bcf_pos(const void *aptr, const void *bptr)
+{
+    bcf1_t *a = *((bcf1_t**)aptr);
+    bcf1_t *b = *((bcf1_t**)bptr);
+    if ( a->rid < b->rid ) return -1;
+    if ( a->rid > b->rid ) return 1;
+    if ( a->pos < b->pos ) return -1;
+    if ( a->pos > b->pos ) return 1;
+
+    // Ties are rare, the alleles are unpacked only when needed. Each record is
+    // touched by one thread only, as the chunks are sorted independently.
+    bcf_unpack(a, BCF_UN_STR);
+    bcf_unpack(b, BCF_UN_STR);
+    int i, n = a->n_allele < b->n_allele ? a->n_allele : b->n_allele;
+    for (i=0; i<n; i++)
+    {
+        int ret = strcmp(a->d.allele[i], b->d.allele[i]);
+        if ( ret ) return ret;
+    }
+    if ( a->n_allele < b->n_allele ) return -1;
+    if ( a->n_allele > b->n_allele ) return 1;
+    return 0;
+}
+
+static inline int blk_is_smaller(blk_t **aptr, blk_t **bptr)
+{
+    int ret = cmp_bcf_pos(&(*aptr)->rec, &(*bptr)->rec);
+    if ( ret ) return ret < 0 ? 1 : 0;
+    return (*aptr)->idx < (*bptr)->idx ? 1 : 0;
+}
+KHEAP_INIT(blk, blk_t*, blk_is_smaller)
+typedef khp_blk_t blk_heap_t;
+
+static int blk_next(args_t *args, blk_t *blk)
+{
+    if ( !blk->fh )
+    {
+        if ( blk->irec >= blk->nrec ) return 0;
+        blk->rec = blk->recs[blk->irec++];
+        return 1;
+    }
+    int ret = bcf_read(blk->fh, args->hdr, blk->rec);
+    if ( ret < -1 ) error("Error reading the temporary file\n");
+    return ret==0 ? 1 : 0;
+}
+
+static void *sort_chunk(void *arg)
+{
+    chunk_t *chunk = (chunk_t*) arg;
+    qsort(chunk->recs, chunk->nrecs, sizeof(*chunk->recs), cmp_bcf_pos);
+    return NULL;
+}
+
+// Cut the buffer into chunks and sort them, on threads when requested. Small
+// buffers are not worth the threads.
+static void sort_buffer(args_t *args)
+{
+    int i, nchunks = args->sort_threads > 1 ? args->sort_threads : 1;
+    if ( args->nbuf < 1000*(size_t)nchunks ) nchunks = 1;
+    if ( nchunks > args->nchunks ) args->chunks = (chunk_t*) realloc(args->chunks, sizeof(chunk_t)*nchunks);
+    args->nchunks = nchunks;
+
+    size_t ibeg = 0;
+    for (i=0; i<nchunks; i++)
+    {
+        size_t iend = args->nbuf*(i+1)/nchunks;
+        args->chunks[i].recs  = args->buf + ibeg;
+        args->chunks[i].nrecs = iend - ibeg;
+        ibeg = iend;
+    }
+    if ( nchunks==1 ) { sort_chunk(&args->chunks[0]); return; }
+
+    pthread_t *threads = (pthread_t*) malloc(sizeof(pthread_t)*nchunks);
+    for (i=0; i<nchunks; i++)
+        if ( pthread_create(&threads[i], NULL, sort_chunk, &args->chunks[i]) ) error("Failed to create a sorting thread\n");
+    for (i=0; i<nchunks; i++) pthread_join(threads[i], NULL);
+    free(threads);
+}
+
+// The k-way merge of the runs irun,..,jrun-1 and of the sorted chunks of the
+// buffer, if with_chunks is set. The merged runs are deleted.
+static void merge_blocks(args_t *args, int irun, int jrun, int with_chunks, htsFile *out_fh, out_idx_t *out_idx)
+{
+    int i, nblk = jrun - irun + (with_chunks ? args->nchunks : 0);
+    blk_t *blks = (blk_t*) calloc(nblk, sizeof(blk_t));
+    blk_heap_t *heap = khp_init(blk);
+    for (i=0; i<nblk; i++)
+    {
+        blk_t *blk = &blks[i];
+        blk->idx = i;
+        if ( i < jrun - irun )
+        {
+            run_t *run = &args->runs[irun+i];
+            blk->fh = hts_open(run->fname, "r");
+            if ( !blk->fh ) error("Could not read the temporary file %s: %s\n", run->fname, strerror(errno));
+            bcf_hdr_t *hdr = bcf_hdr_read(blk->fh);
+            if ( !hdr ) error("Could not read the header of the temporary file %s\n", run->fname);
+            bcf_hdr_destroy(hdr);
+            blk->rec = bcf_init();
+        }
+        else
+        {
+            chunk_t *chunk = &args->chunks[i - (jrun - irun)];
+            blk->recs = chunk->recs;
+            blk->nrec = chunk->nrecs;
+        }
+        blk_t *ptr = blk;
+        if ( blk_next(args, blk) ) khp_insert(blk, heap, &ptr);
+    }
+    while ( heap->ndat )
+    {
+        blk_t *blk = heap->dat[0];
+        if ( out_idx_write(out_idx, out_fh, args->hdr, blk->rec)!=0 ) error("Failed to write the output\n");
+        if ( blk_next(args, blk) ) khp_heapify_blk(heap, 0);
+        else khp_delete(blk, heap);
+    }
+    for (i=0; i<nblk; i++)
+    {
+        if ( !blks[i].fh ) continue;
+        bcf_destroy(blks[i].rec);
+        if ( hts_close(blks[i].fh)!=0 ) error("Error closing the temporary file %s\n", args->runs[irun+i].fname);
+        unlink(args->runs[irun+i].fname);
+        free(args->runs[irun+i].fname);
+    }
+    khp_destroy(blk, heap);
+    free(blks);
+}
+
+static htsFile *open_run(args_t *args, int level)
+{
+    if ( !args->tmp_dir )
+    {
+        kstring_t str = {0,0,0};
+        ksprintf(&str, "%s.XXXXXX", args->tmp_prefix);
+        if ( !mkdtemp(str.s) ) error("Could not create the temporary directory %s: %s\n", str.s, strerror(errno));
+        args->tmp_dir = str.s;
+    }
+    hts_expand0(run_t, args->nruns+1, args->mruns, args->runs);
+    run_t *run = &args->runs[args->nruns++];
+    kstring_t str = {0,0,0};
+    ksprintf(&str, "%s/%05d.bcf", args->tmp_dir, args->irun++);
+    run->fname = str.s;
+    run->level = level;
+
+    htsFile *fh = hts_open(run->fname, "wbu");
+    if ( !fh ) error("Could not write the temporary file %s: %s\n", run->fname, strerror(errno));
+    if ( bcf_hdr_write(fh, args->hdr)!=0 ) error("Failed to write to the temporary file %s\n", run->fname);
+    return fh;
+}
+
+static void close_run(args_t *args, htsFile *fh)
+{
+    if ( hts_close(fh)!=0 ) error("Error closing the temporary file %s\n", args->runs[args->nruns-1].fname);
+}
+
+// Sort the buffer, write it out as a new run and merge the runs at the top of
+// the stack while there are MAX_FANIN of the same level
+static void flush_buffer(args_t *args)
+{
+    if ( !args->nbuf ) return;
+    sort_buffer(args);
+
+    htsFile *fh = open_run(args, 0);
+    merge_blocks(args, 0, 0, 1, fh, NULL);
+    close_run(args, fh);
+    args->nbuf = 0;
+    args->mem  = 0;
+
+    while ( args->nruns >= MAX_FANIN )
+    {
+        int level = args->runs[args->nruns-1].level;
+        int irun  = args->nruns - MAX_FANIN;
+        if ( args->runs[irun].level != level ) break;
+
+        // the new run is pushed after the merged ones and then moved in their place
+        fh = open_run(args, level+1);
+        merge_blocks(args, irun, args->nruns-1, 0, fh, NULL);
+        close_run(args, fh);
+        args->runs[irun] = args->runs[args->nruns-1];
+        args->nruns = irun + 1;
+    }
+}
+
+static void sort_file(args_t *args)
+{
+    htsFile *fh = hts_open(args->fname, "r");
+    if ( !fh ) error("Could not read %s: %s\n", args->fname, strerror(errno));
+    args->hdr = bcf_hdr_read(fh);
+    if ( !args->hdr ) error("Could not read the header: %s\n", args->fname);
+
+    while ( 1 )
+    {
+        hts_expand0(bcf1_t*, args->nbuf+1, args->mbuf, args->buf);
+        if ( !args->buf[args->nbuf] ) args->buf[args->nbuf] = bcf_init();
+        bcf1_t *rec = args->buf[args->nbuf];
+
+        uint64_t t0 = profile_begin();
+        int ret = bcf_read(fh, args->hdr, rec);
+        if ( ret < -1 ) error("Error encountered while parsing the input at %s:%d\n", bcf_seqname(args->hdr,rec), rec->pos+1);
+        if ( ret == -1 ) break;
+        profile_end_bytes(PROF_READ, t0, profile_rec_size(rec));
+
+        args->nbuf++;
+        args->mem += sizeof(bcf1_t) + sizeof(bcf1_t*) + rec->shared.l + rec->indiv.l;
+        if ( args->mem >= args->max_mem ) flush_buffer(args);
+    }
+    if ( hts_close(fh)!=0 ) error("Close failed: %s\n", args->fname);
+
+    // The header is written only now, VCF input can add contigs to it on the fly
+    sort_buffer(args);
+    args->out_fh = hts_open(args->output_fname, hts_bcf_wmode(args->output_type));
+    if ( !args->out_fh ) error("Cannot write to \"%s\": %s\n", args->output_fname, strerror(errno));
+    if ( args->n_threads ) hts_set_threads(args->out_fh, args->n_threads);
+    if ( args->record_cmd_line ) bcf_hdr_append_version(args->hdr, args->argc, args->argv, "bcftools_sort");
+    if ( bcf_hdr_write(args->out_fh, args->hdr)!=0 ) error("Failed to write the header to %s\n", args->output_fname);
+    if ( args->write_index ) args->out_idx = out_idx_init(args->out_fh, args->hdr, args->output_fname);
+    merge_blocks(args, 0, args->nruns, 1, args->out_fh, args->out_idx);
+    args->nruns = 0;
+    if ( out_idx_close(args->out_idx, args->out_fh)!=0 ) error("Close failed: %s\n", args->output_fname);
+}
+
+static void destroy_data(args_t *args)
+{
+    size_t i;
+    for (i=0; i<args->mbuf; i++)
+        if ( args->buf[i] ) bcf_destroy(args->buf[i]);
+    free(args->buf);
+    free(args->runs);
+    free(args->chunks);
+    if ( args->tmp_dir )
+    {
+        rmdir(args->tmp_dir);
+        free(args->tmp_dir);
+    }
+    if ( args->hdr ) bcf_hdr_destroy(args->hdr);
+}
+
+static size_t parse_mem(char *str)
+{
+    char *tmp;
+    double mem = strtod(str, &tmp);
+    if ( tmp==str || mem<=0 ) error("Could not parse the memory limit: %s\n", str);
+    if ( !strcasecmp(tmp,"k") ) mem *= 1000;
+    else if ( !strcasecmp(tmp,"m") ) mem *= 1e6;
+    else if ( !strcasecmp(tmp,"g") ) mem *= 1e9;
+    else if ( *tmp ) error("Could not parse the memory limit: %s\n", str);
+    return mem;
+}
+
+static void usage(args_t *args)
+{
+    fprintf(stderr, "\n");
+    fprintf(stderr, "About:   Sort VCF/BCF file by chromosome, position and alleles. Files larger than\n");
+    fprintf(stderr, "         the memory limit are sorted in parts which are merged at the end.\n");
+    fprintf(stderr, "Usage:   bcftools sort [OPTIONS] <FILE.vcf>\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "   -m, --max-mem <float>[kMG]     Maximum memory to use [768M]\n");
+    fprintf(stderr, "       --no-version               Do not append version and command line to the header\n");
+    fprintf(stderr, "   -o, --output <file>            Write output to a file [standard output]\n");
+    fprintf(stderr, "   -O, --output-type <b|u|z|v>    b: compressed BCF, u: uncompressed BCF, z: compressed VCF, v: uncompressed VCF [v]\n");
+    fprintf(stderr, "       --sort-threads <int>       Sort the buffered records on <int> threads [0]\n");
+    fprintf(stderr, "   -T, --temp-dir <dir>           Prefix of the temporary directory [/tmp/bcftools-sort.XXXXXX]\n");
+    fprintf(stderr, "       --threads <int>            Number of extra output compression threads [0]\n");
+    fprintf(stderr, "       --write-index              Index the compressed output on the fly, the index is written to <file>.csi\n");
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+int main_vcfsort(int argc, char *argv[])
+{
+    int c;
+    args_t *args  = (args_t*) calloc(1,sizeof(args_t));
+    args->argc    = argc; args->argv = argv;
+    args->output_fname = "-";
+    args->output_type = FT_VCF;
+    args->record_cmd_line = 1;
+    args->max_mem = 768e6;
+    args->tmp_prefix = "/tmp/bcftools-sort";
+
+    static struct option loptions[] =
+    {
+        {"max-mem",required_argument,NULL,'m'},
+        {"temp-dir",required_argument,NULL,'T'},
+        {"output",required_argument,NULL,'o'},
+        {"output-type",required_argument,NULL,'O'},
+        {"no-version",no_argument,NULL,8},
+        {"threads",required_argument,NULL,9},
+        {"sort-threads",required_argument,NULL,10},
+        {"write-index",no_argument,NULL,11},
+        {"help",no_argument,NULL,'h'},
+        {NULL,0,NULL,0}
+    };
+    char *tmp;
+    while ((c = getopt_long(argc, argv, "h?m:T:o:O:",loptions,NULL)) >= 0)
+    {
+        switch (c) {
+            case 'm': args->max_mem = parse_mem(optarg); break;
+            case 'T': args->tmp_prefix = optarg; break;
+            case 'o': args->output_fname = optarg; break;
+            case 'O':
+                switch (optarg[0]) {
+                    case 'b': args->output_type = FT_BCF_GZ; break;
+                    case 'u': args->output_type = FT_BCF; break;
+                    case 'z': args->output_type = FT_VCF_GZ; break;
+                    case 'v': args->output_type = FT_VCF; break;
+                    default: error("The output type \"%s\" not recognised\n", optarg);
+                };
+                break;
+            case  8 : args->record_cmd_line = 0; break;
+            case  9 : args->n_threads = strtol(optarg, 0, 0); break;
+            case 10 :
+                args->sort_threads = strtol(optarg,&tmp,10);
+                if ( *tmp || args->sort_threads<0 ) error("Could not parse argument: --sort-threads %s\n", optarg);
+                break;
+            case 11 : args->write_index = 1; break;
+            case 'h':
+            case '?': usage(args); break;
+            default: error("Unknown argument: %s\n", optarg);
+        }
+    }
+
+    if ( optind>=argc )
+    {
+        if ( !isatty(fileno((FILE *)stdin)) ) args->fname = "-";  // reading from stdin
+        else usage(args);
+    }
+    else args->fname = argv[optind];
+
+    sort_file(args);
+    destroy_data(args);
+    free(args);
+    return 0;
+}
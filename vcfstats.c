@@ -32,14 +32,20 @@ THE SOFTWARE.  */
 #include <unistd.h>
 #include <getopt.h>
 #include <math.h>
+#include <errno.h>
+#include <string.h>
 #include <htslib/vcf.h>
 #include <htslib/synced_bcf_reader.h>
 #include <htslib/vcfutils.h>
 #include <htslib/faidx.h>
+#include <htslib/bgzf.h>
+#include <htslib/kstring.h>
 #include <inttypes.h>
 #include "bcftools.h"
 #include "filter.h"
 #include "bin.h"
+#include "gtcount.h"
+#include "batch.h"
 
 // Logic of the filters: include or exclude sites which match the filters?
 #define FLT_INCLUDE 1
@@ -51,6 +57,9 @@ THE SOFTWARE.  */
 #define IRC_RLEN 10
 #define NA_STRING "0"
 
+// With --record-threads, the number of records in one batch
+#define STATS_BATCH 1024
+
 typedef struct
 {
     char *tag;
@@ -109,21 +118,18 @@ typedef struct
 }
 gtcmp_t;
 
-typedef struct
-{
-    char *seq;
-    int pos, cnt, len;
-}
-_idc1_t;
+// Reference blocks for indel context are fetched in this size
+#define IC_BLOCK 1048576
+
 typedef struct
 {
     faidx_t *ref;
-    _idc1_t *dat;
-    int ndat, mdat;
+    char *chr, *seq;    // the cached reference block
+    int beg, nseq;      // 0-based start and length of the block
 }
 indel_ctx_t;
 
-typedef struct
+typedef struct _args_t
 {
     // stats
     stats_t stats[3];
@@ -155,9 +161,32 @@ typedef struct
     char *filter_str;
     int filter_logic;   // include or exclude sites which match the filters? One of FLT_INCLUDE/FLT_EXCLUDE
     int n_threads;
+
+    // --record-threads: workers with private copies of args_t, their stats are merged at the end
+    int record_threads;
+    struct _args_t **workers;
+
+    // description of the input sets, taken from the readers or from the --merge dumps
+    int nreaders, nsmpl_rdr[2], n_smpl;
+    char *fnames[2], **samples;
+
+    // --dump and --merge
+    char *dump_fname;
+    int merge;
 }
 args_t;
 
+// Settings which must match for the --dump files to be merged
+typedef struct
+{
+    int nreaders, nstats, split_by_id, n_smpl, nsmpl_rdr[2];
+    int m_af, naf_bins, m_qual, naf_hwe, m_indel;
+    int dp_min, dp_max, dp_step, nusr, has_gts, has_exons, has_ref;
+}
+stats_dump_t;
+
+#define STATS_DUMP_MAGIC "BCFSTS\1"
+
 static int type2dosage[6], type2ploidy[6], type2stats[7];
 
 static void idist_init(idist_t *d, int min, int max, int step)
@@ -190,74 +219,6 @@ static inline int clip_nonnegative(float x, int limit)
     else return (int) x;
 }
 
-#define IC_DBG 0
-#if IC_DBG
-static void _indel_ctx_print1(_idc1_t *idc)
-{
-    int i;
-    fprintf(stdout, "%d\t", idc->cnt);
-    for (i=0; i<idc->len; i++)
-        fputc(idc->seq[i], stdout);
-    fputc('\n', stdout);
-}
-static void _indel_ctx_print(indel_ctx_t *ctx)
-{
-    int i;
-    for (i=0; i<ctx->ndat; i++)
-        _indel_ctx_print1(&ctx->dat[i]);
-    fputc('\n',stdout);
-}
-#endif
-static int _indel_ctx_lookup(indel_ctx_t *ctx, char *seq, int seq_len, int *hit)
-{
-    // binary search
-    int min = 0, max = ctx->ndat - 1;
-    while ( min<=max )
-    {
-        int i = (min+max)/2;
-        int cmp = strncmp(seq, ctx->dat[i].seq, seq_len);
-        if ( cmp<0 ) max = i - 1;
-        else if ( cmp>0 ) min = i + 1;
-        else
-        {
-            if ( seq_len==ctx->dat[i].len )
-            {
-                *hit = 1;
-                return i;
-            }
-            else if ( seq_len<ctx->dat[i].len ) max = i - 1;
-            else min = i + 1;
-        }
-    }
-    *hit = 0;
-    return max;
-}
-static void _indel_ctx_insert(indel_ctx_t *ctx, char *seq, int seq_len, int pos)
-{
-    int idat, hit, i;
-    idat = _indel_ctx_lookup(ctx, seq, seq_len, &hit);
-    if ( !hit )
-    {
-        if ( pos>0 ) return;
-        idat++;
-        ctx->ndat++;
-        hts_expand(_idc1_t, ctx->ndat+1, ctx->mdat, ctx->dat);
-        if ( idat<ctx->ndat && ctx->ndat>1 )
-            memmove(&ctx->dat[idat+1], &ctx->dat[idat], (ctx->ndat - idat - 1)*sizeof(_idc1_t));
-        ctx->dat[idat].len = seq_len;
-        ctx->dat[idat].cnt = 1;
-        ctx->dat[idat].pos = pos;
-        ctx->dat[idat].seq = (char*) malloc(sizeof(char)*(seq_len+1));
-        for (i=0; i<seq_len; i++) ctx->dat[idat].seq[i] = seq[i];
-        ctx->dat[idat].seq[i] = 0;
-        return;
-    }
-    if ( ctx->dat[idat].pos + seq_len == pos )
-    {
-        ctx->dat[idat].cnt++;
-        ctx->dat[idat].pos = pos;
-    }
-}
 indel_ctx_t *indel_ctx_init(char *fa_ref_fname)
 {
     indel_ctx_t *ctx = (indel_ctx_t *) calloc(1,sizeof(indel_ctx_t));
@@ -272,9 +233,44 @@ indel_ctx_t *indel_ctx_init(char *fa_ref_fname)
 void indel_ctx_destroy(indel_ctx_t *ctx)
 {
     fai_destroy(ctx->ref);
-    if ( ctx->mdat ) free(ctx->dat);
+    free(ctx->chr);
+    free(ctx->seq);
     free(ctx);
 }
+/*
+ *  Returns the reference sequence starting at the 0-based position @pos,
+ *  reading from the cached block if possible. Sorted input is served by
+ *  one faidx_fetch_seq() call per IC_BLOCK bases.
+ */
+static char *indel_ctx_fetch(indel_ctx_t *ctx, char *chr, int pos, int len, int *nseq)
+{
+    int is_cached = ctx->seq && !strcmp(chr,ctx->chr) && pos>=ctx->beg;
+    if ( is_cached )
+    {
+        // the end of the block is either large enough or the end of the chromosome
+        int end = ctx->beg + ctx->nseq;
+        if ( pos+len > end && ctx->nseq==IC_BLOCK ) is_cached = 0;
+        if ( pos>=end ) is_cached = 0;
+    }
+    if ( !is_cached )
+    {
+        free(ctx->seq);
+        if ( !ctx->chr || strcmp(chr,ctx->chr) )
+        {
+            free(ctx->chr);
+            ctx->chr = strdup(chr);
+        }
+        ctx->beg = pos;
+        ctx->seq = faidx_fetch_seq(ctx->ref, chr, pos, pos+IC_BLOCK-1, &ctx->nseq);
+        if ( !ctx->seq || ctx->nseq<=0 ) error("Failed to fetch the reference sequence at %s:%d\n", chr,pos+1);
+        int i;
+        for (i=0; i<ctx->nseq; i++)
+            if ( (int)ctx->seq[i]>96 ) ctx->seq[i] -= 32;
+    }
+    *nseq = ctx->beg + ctx->nseq - pos;
+    if ( *nseq > len ) *nseq = len;
+    return ctx->seq + pos - ctx->beg;
+}
 /**
  * indel_ctx_type() - determine indel context type
  * @ctx:
@@ -298,42 +294,30 @@ int indel_ctx_type(indel_ctx_t *ctx, char *chr, int pos, char *ref, char *alt, i
     while ( alt[alt_len] && alt[alt_len]!=',' ) alt_len++;
 
     int i, fai_ref_len;
-    char *fai_ref = faidx_fetch_seq(ctx->ref, chr, pos-1, pos+win_size, &fai_ref_len);
-    for (i=0; i<fai_ref_len; i++)
-        if ( (int)fai_ref[i]>96 ) fai_ref[i] -= 32;
+    char *fai_ref = indel_ctx_fetch(ctx, chr, pos-1, win_size+1, &fai_ref_len);
 
     // Sanity check: the reference sequence must match the REF allele
     for (i=0; i<fai_ref_len && i<ref_len; i++)
         if ( ref[i] != fai_ref[i] && ref[i] - 32 != fai_ref[i] )
             error("\nSanity check failed, the reference sequence differs: %s:%d+%d .. %c vs %c\n", chr, pos, i, ref[i],fai_ref[i]);
 
-    // Count occurrences of all possible kmers
-    ctx->ndat = 0;
-    for (i=0; i<win_size; i++)
-    {
-        int k, kmax = rep_len <= i ? rep_len : i+1;
-        for (k=0; k<kmax; k++)
-            _indel_ctx_insert(ctx, &fai_ref[i-k+1], k+1, i-k);
-    }
-
-    #if IC_DBG
-    fprintf(stdout,"ref: %s\n", ref);
-    fprintf(stdout,"alt: %s\n", alt);
-    fprintf(stdout,"ctx: %s\n", fai_ref);
-    _indel_ctx_print(ctx);
-    #endif
-
+    // For each unit length, count the tandem copies of the sequence following
+    // the anchor base which fit into the window. The most frequent unit wins,
+    // the longer on ties.
+    char *seq = fai_ref + 1;
+    int nseq = fai_ref_len - 1;
+    if ( nseq > win_size ) nseq = win_size;
     int max_cnt = 0, max_len = 0;
-    for (i=0; i<ctx->ndat; i++)
+    for (i=1; i<=rep_len && i<=nseq; i++)
     {
-        if ( max_cnt < ctx->dat[i].cnt || (max_cnt==ctx->dat[i].cnt && max_len < ctx->dat[i].len) )
+        int cnt = 1;
+        while ( (cnt+1)*i <= nseq && !memcmp(seq, seq + cnt*i, i) ) cnt++;
+        if ( max_cnt < cnt || (max_cnt==cnt && max_len < i) )
         {
-            max_cnt = ctx->dat[i].cnt;
-            max_len = ctx->dat[i].len;
+            max_cnt = cnt;
+            max_len = i;
         }
-        free(ctx->dat[i].seq);
     }
-    free(fai_ref);
 
     *nrep = max_cnt;
     *nlen = max_len;
@@ -388,12 +372,52 @@ static void init_user_stats(args_t *args, bcf_hdr_t *hdr, stats_t *stats)
         user_stats_t *usr = &stats->usr[i];
         usr->vals_ts = (uint64_t*)calloc(usr->nbins,sizeof(uint64_t));
         usr->vals_tv = (uint64_t*)calloc(usr->nbins,sizeof(uint64_t));
+        if ( !hdr ) continue;   // restored from a --dump file, the type is known
         int id = bcf_hdr_id2int(hdr,BCF_DT_ID,usr->tag);
         if ( !bcf_hdr_idinfo_exists(hdr,BCF_HL_INFO,id) ) error("The INFO tag \"%s\" is not defined in the header\n", usr->tag);
         usr->type = bcf_hdr_id2type(hdr,BCF_HL_INFO,id);
         if ( usr->type!=BCF_HT_REAL && usr->type!=BCF_HT_INT ) error("The INFO tag \"%s\" is not of Float or Integer type (%d)\n", usr->type);
     }
 }
+static void init_stats_arrays(args_t *args, stats_t *stats, bcf_hdr_t *hdr)
+{
+    stats->m_indel     = 60;
+    stats->insertions  = (int*) calloc(stats->m_indel,sizeof(int));
+    stats->deletions   = (int*) calloc(stats->m_indel,sizeof(int));
+    stats->af_ts       = (int*) calloc(args->m_af,sizeof(int));
+    stats->af_tv       = (int*) calloc(args->m_af,sizeof(int));
+    stats->af_snps     = (int*) calloc(args->m_af,sizeof(int));
+    int j;
+    for (j=0; j<3; j++) stats->af_repeats[j] = (int*) calloc(args->m_af,sizeof(int));
+    #if QUAL_STATS
+        stats->qual_ts     = (int*) calloc(args->m_qual,sizeof(int));
+        stats->qual_tv     = (int*) calloc(args->m_qual,sizeof(int));
+        stats->qual_snps   = (int*) calloc(args->m_qual,sizeof(int));
+        stats->qual_indels = (int*) calloc(args->m_qual,sizeof(int));
+    #endif
+    if ( args->n_smpl )
+    {
+        stats->smpl_hets   = (int *) calloc(args->n_smpl,sizeof(int));
+        stats->smpl_homAA  = (int *) calloc(args->n_smpl,sizeof(int));
+        stats->smpl_homRR  = (int *) calloc(args->n_smpl,sizeof(int));
+        stats->smpl_indel_hets = (int *) calloc(args->n_smpl,sizeof(int));
+        stats->smpl_indel_homs = (int *) calloc(args->n_smpl,sizeof(int));
+        stats->smpl_ts     = (int *) calloc(args->n_smpl,sizeof(int));
+        stats->smpl_tv     = (int *) calloc(args->n_smpl,sizeof(int));
+        stats->smpl_indels = (int *) calloc(args->n_smpl,sizeof(int));
+        stats->smpl_dp     = (unsigned long int *) calloc(args->n_smpl,sizeof(unsigned long int));
+        stats->smpl_ndp    = (int *) calloc(args->n_smpl,sizeof(int));
+        stats->smpl_sngl   = (int *) calloc(args->n_smpl,sizeof(int));
+        #if HWE_STATS
+            stats->af_hwe  = (int*) calloc(args->m_af*args->naf_hwe,sizeof(int));
+        #endif
+        if ( args->exons_fname )
+            stats->smpl_frm_shifts = (int*) calloc(args->n_smpl*3,sizeof(int));
+    }
+    idist_init(&stats->dp, args->dp_min,args->dp_max,args->dp_step);
+    idist_init(&stats->dp_sites, args->dp_min,args->dp_max,args->dp_step);
+    init_user_stats(args, hdr, stats);
+}
 static void init_stats(args_t *args)
 {
     int i;
@@ -450,46 +474,16 @@ static void init_stats(args_t *args)
         args->smpl_gts_snps   = (gtcmp_t *) calloc(args->files->n_smpl,sizeof(gtcmp_t));
         args->smpl_gts_indels = (gtcmp_t *) calloc(args->files->n_smpl,sizeof(gtcmp_t));
     }
-    for (i=0; i<args->nstats; i++)
+    args->nreaders = args->files->nreaders;
+    for (i=0; i<args->nreaders; i++)
     {
-        stats_t *stats = &args->stats[i];
-        stats->m_indel     = 60;
-        stats->insertions  = (int*) calloc(stats->m_indel,sizeof(int));
-        stats->deletions   = (int*) calloc(stats->m_indel,sizeof(int));
-        stats->af_ts       = (int*) calloc(args->m_af,sizeof(int));
-        stats->af_tv       = (int*) calloc(args->m_af,sizeof(int));
-        stats->af_snps     = (int*) calloc(args->m_af,sizeof(int));
-        int j;
-        for (j=0; j<3; j++) stats->af_repeats[j] = (int*) calloc(args->m_af,sizeof(int));
-        #if QUAL_STATS
-            stats->qual_ts     = (int*) calloc(args->m_qual,sizeof(int));
-            stats->qual_tv     = (int*) calloc(args->m_qual,sizeof(int));
-            stats->qual_snps   = (int*) calloc(args->m_qual,sizeof(int));
-            stats->qual_indels = (int*) calloc(args->m_qual,sizeof(int));
-        #endif
-        if ( args->files->n_smpl )
-        {
-            stats->smpl_hets   = (int *) calloc(args->files->n_smpl,sizeof(int));
-            stats->smpl_homAA  = (int *) calloc(args->files->n_smpl,sizeof(int));
-            stats->smpl_homRR  = (int *) calloc(args->files->n_smpl,sizeof(int));
-            stats->smpl_indel_hets = (int *) calloc(args->files->n_smpl,sizeof(int));
-            stats->smpl_indel_homs = (int *) calloc(args->files->n_smpl,sizeof(int));
-            stats->smpl_ts     = (int *) calloc(args->files->n_smpl,sizeof(int));
-            stats->smpl_tv     = (int *) calloc(args->files->n_smpl,sizeof(int));
-            stats->smpl_indels = (int *) calloc(args->files->n_smpl,sizeof(int));
-            stats->smpl_dp     = (unsigned long int *) calloc(args->files->n_smpl,sizeof(unsigned long int));
-            stats->smpl_ndp    = (int *) calloc(args->files->n_smpl,sizeof(int));
-            stats->smpl_sngl   = (int *) calloc(args->files->n_smpl,sizeof(int));
-            #if HWE_STATS
-                stats->af_hwe  = (int*) calloc(args->m_af*args->naf_hwe,sizeof(int));
-            #endif
-            if ( args->exons_fname )
-                stats->smpl_frm_shifts = (int*) calloc(args->files->n_smpl*3,sizeof(int));
-        }
-        idist_init(&stats->dp, args->dp_min,args->dp_max,args->dp_step);
-        idist_init(&stats->dp_sites, args->dp_min,args->dp_max,args->dp_step);
-        init_user_stats(args, i!=1 ? args->files->readers[0].header : args->files->readers[1].header, stats);
+        args->fnames[i]    = args->files->readers[i].fname;
+        args->nsmpl_rdr[i] = bcf_hdr_nsamples(args->files->readers[i].header);
     }
+    args->n_smpl  = args->files->n_smpl;
+    args->samples = args->files->samples;
+    for (i=0; i<args->nstats; i++)
+        init_stats_arrays(args, &args->stats[i], i!=1 ? args->files->readers[0].header : args->files->readers[1].header);
 
     if ( args->exons_fname )
     {
@@ -526,50 +520,132 @@ static void init_stats(args_t *args)
     type2stats[GT_UNKN]   = 4;
 
 }
-static void destroy_stats(args_t *args)
+static void destroy_stats_arrays(args_t *args, stats_t *stats)
 {
-    int id, j;
-    for (id=0; id<args->nstats; id++)
+    int j;
+    if (stats->af_ts) free(stats->af_ts);
+    if (stats->af_tv) free(stats->af_tv);
+    if (stats->af_snps) free(stats->af_snps);
+    for (j=0; j<3; j++)
+        if (stats->af_repeats[j]) free(stats->af_repeats[j]);
+    #if QUAL_STATS
+        if (stats->qual_ts) free(stats->qual_ts);
+        if (stats->qual_tv) free(stats->qual_tv);
+        if (stats->qual_snps) free(stats->qual_snps);
+        if (stats->qual_indels) free(stats->qual_indels);
+    #endif
+    #if HWE_STATS
+        free(stats->af_hwe);
+    #endif
+    free(stats->insertions);
+    free(stats->deletions);
+    if (stats->smpl_hets) free(stats->smpl_hets);
+    if (stats->smpl_homAA) free(stats->smpl_homAA);
+    if (stats->smpl_homRR) free(stats->smpl_homRR);
+    if (stats->smpl_indel_homs) free(stats->smpl_indel_homs);
+    if (stats->smpl_indel_hets) free(stats->smpl_indel_hets);
+    if (stats->smpl_ts) free(stats->smpl_ts);
+    if (stats->smpl_tv) free(stats->smpl_tv);
+    if (stats->smpl_indels) free(stats->smpl_indels);
+    if (stats->smpl_dp) free(stats->smpl_dp);
+    if (stats->smpl_ndp) free(stats->smpl_ndp);
+    if (stats->smpl_sngl) free(stats->smpl_sngl);
+    idist_destroy(&stats->dp);
+    idist_destroy(&stats->dp_sites);
+    for (j=0; j<stats->nusr; j++)
     {
-        stats_t *stats = &args->stats[id];
-        if (stats->af_ts) free(stats->af_ts);
-        if (stats->af_tv) free(stats->af_tv);
-        if (stats->af_snps) free(stats->af_snps);
+        free(stats->usr[j].vals_ts);
+        free(stats->usr[j].vals_tv);
+        free(stats->usr[j].val);
+    }
+    free(stats->usr);
+    free(stats->smpl_frm_shifts);
+}
+static void merge_stats(args_t *args, stats_t *dst, stats_t *src)
+{
+    int i, j, n_smpl = args->n_smpl;
+    dst->n_snps     += src->n_snps;
+    dst->n_indels   += src->n_indels;
+    dst->n_mnps     += src->n_mnps;
+    dst->n_others   += src->n_others;
+    dst->n_mals     += src->n_mals;
+    dst->n_snp_mals += src->n_snp_mals;
+    dst->n_records  += src->n_records;
+    dst->n_noalts   += src->n_noalts;
+    dst->ts_alt1    += src->ts_alt1;
+    dst->tv_alt1    += src->tv_alt1;
+    dst->in_frame   += src->in_frame;
+    dst->out_frame  += src->out_frame;
+    dst->na_frame   += src->na_frame;
+    dst->in_frame_alt1  += src->in_frame_alt1;
+    dst->out_frame_alt1 += src->out_frame_alt1;
+    dst->na_frame_alt1  += src->na_frame_alt1;
+    for (i=0; i<15; i++) dst->subst[i] += src->subst[i];
+    for (i=0; i<args->m_af; i++)
+    {
+        dst->af_ts[i]   += src->af_ts[i];
+        dst->af_tv[i]   += src->af_tv[i];
+        dst->af_snps[i] += src->af_snps[i];
+    }
+    #if IRC_STATS
+        for (i=0; i<IRC_RLEN; i++)
+            for (j=0; j<4; j++) dst->n_repeat[i][j] += src->n_repeat[i][j];
+        dst->n_repeat_na += src->n_repeat_na;
         for (j=0; j<3; j++)
-            if (stats->af_repeats[j]) free(stats->af_repeats[j]);
-        #if QUAL_STATS
-            if (stats->qual_ts) free(stats->qual_ts);
-            if (stats->qual_tv) free(stats->qual_tv);
-            if (stats->qual_snps) free(stats->qual_snps);
-            if (stats->qual_indels) free(stats->qual_indels);
-        #endif
+            for (i=0; i<args->m_af; i++) dst->af_repeats[j][i] += src->af_repeats[j][i];
+    #endif
+    #if QUAL_STATS
+        for (i=0; i<args->m_qual; i++)
+        {
+            dst->qual_ts[i]     += src->qual_ts[i];
+            dst->qual_tv[i]     += src->qual_tv[i];
+            dst->qual_snps[i]   += src->qual_snps[i];
+            dst->qual_indels[i] += src->qual_indels[i];
+        }
+    #endif
+    for (i=0; i<dst->m_indel; i++)
+    {
+        dst->insertions[i] += src->insertions[i];
+        dst->deletions[i]  += src->deletions[i];
+    }
+    if ( n_smpl )
+    {
+        for (i=0; i<n_smpl; i++)
+        {
+            dst->smpl_hets[i]   += src->smpl_hets[i];
+            dst->smpl_homAA[i]  += src->smpl_homAA[i];
+            dst->smpl_homRR[i]  += src->smpl_homRR[i];
+            dst->smpl_indel_hets[i] += src->smpl_indel_hets[i];
+            dst->smpl_indel_homs[i] += src->smpl_indel_homs[i];
+            dst->smpl_ts[i]     += src->smpl_ts[i];
+            dst->smpl_tv[i]     += src->smpl_tv[i];
+            dst->smpl_indels[i] += src->smpl_indels[i];
+            dst->smpl_dp[i]     += src->smpl_dp[i];
+            dst->smpl_ndp[i]    += src->smpl_ndp[i];
+            dst->smpl_sngl[i]   += src->smpl_sngl[i];
+        }
         #if HWE_STATS
-            free(stats->af_hwe);
+            for (i=0; i<args->m_af*args->naf_hwe; i++) dst->af_hwe[i] += src->af_hwe[i];
         #endif
-        free(stats->insertions);
-        free(stats->deletions);
-        if (stats->smpl_hets) free(stats->smpl_hets);
-        if (stats->smpl_homAA) free(stats->smpl_homAA);
-        if (stats->smpl_homRR) free(stats->smpl_homRR);
-        if (stats->smpl_indel_homs) free(stats->smpl_indel_homs);
-        if (stats->smpl_indel_hets) free(stats->smpl_indel_hets);
-        if (stats->smpl_ts) free(stats->smpl_ts);
-        if (stats->smpl_tv) free(stats->smpl_tv);
-        if (stats->smpl_indels) free(stats->smpl_indels);
-        if (stats->smpl_dp) free(stats->smpl_dp);
-        if (stats->smpl_ndp) free(stats->smpl_ndp);
-        if (stats->smpl_sngl) free(stats->smpl_sngl);
-        idist_destroy(&stats->dp);
-        idist_destroy(&stats->dp_sites);
-        for (j=0; j<stats->nusr; j++)
+        if ( dst->smpl_frm_shifts )
+            for (i=0; i<n_smpl*3; i++) dst->smpl_frm_shifts[i] += src->smpl_frm_shifts[i];
+    }
+    for (i=0; i<dst->dp.m_vals; i++) dst->dp.vals[i] += src->dp.vals[i];
+    for (i=0; i<dst->dp_sites.m_vals; i++) dst->dp_sites.vals[i] += src->dp_sites.vals[i];
+    for (j=0; j<dst->nusr; j++)
+    {
+        for (i=0; i<dst->usr[j].nbins; i++)
         {
-            free(stats->usr[j].vals_ts);
-            free(stats->usr[j].vals_tv);
-            free(stats->usr[j].val);
+            dst->usr[j].vals_ts[i] += src->usr[j].vals_ts[i];
+            dst->usr[j].vals_tv[i] += src->usr[j].vals_tv[i];
         }
-        free(stats->usr);
-        if ( args->exons ) free(stats->smpl_frm_shifts);
     }
+}
+static void destroy_stats(args_t *args)
+{
+    int id, j;
+    for (id=0; id<args->nstats; id++)
+        destroy_stats_arrays(args, &args->stats[id]);
     for (j=0; j<args->nusr; j++) free(args->usr[j].tag);
     if ( args->af_bins ) bin_destroy(args->af_bins);
     free(args->farr);
@@ -615,7 +691,7 @@ static void init_iaf(args_t *args, bcf_sr_t *reader)
 
     // tmp_iaf is first filled with AC counts in calc_ac and then transformed to
     //  an index to af_gts_snps
-    ret = bcf_calc_ac(reader->header, line, args->tmp_iaf, args->samples_list ? BCF_UN_INFO|BCF_UN_FMT : BCF_UN_INFO);
+    ret = gtcount_calc_ac(reader->header, line, args->tmp_iaf, args->samples_list ? BCF_UN_INFO|BCF_UN_FMT : BCF_UN_INFO);
     if ( !ret )
     {
         for (i=0; i<line->n_allele; i++) args->tmp_iaf[i] = 0;      // singletons/unknown bin
@@ -1017,6 +1093,42 @@ static void do_sample_stats(args_t *args, stats_t *stats, bcf_sr_t *reader, int
     }
 }
 
+static void do_record_stats(args_t *args, bcf_sr_t *reader, bcf1_t *line, int ret)
+{
+    bcf_srs_t *files = args->files;
+    int line_type = bcf_get_variant_types(line);
+    init_iaf(args, reader);
+
+    stats_t *stats = &args->stats[ret-1];
+    if ( args->split_by_id && line->d.id[0]=='.' && !line->d.id[1] )
+        stats = &args->stats[1];
+
+    stats->n_records++;
+
+    if ( line_type==VCF_REF )
+        stats->n_noalts++;
+    if ( line_type&VCF_SNP )
+        do_snp_stats(args, stats, reader);
+    if ( line_type&VCF_INDEL )
+        do_indel_stats(args, stats, reader);
+    if ( line_type&VCF_MNP )
+        do_mnp_stats(args, stats, reader);
+    if ( line_type&VCF_OTHER )
+        do_other_stats(args, stats, reader);
+
+    if ( line->n_allele>2 )
+    {
+        stats->n_mals++;
+        if ( line_type == VCF_SNP ) stats->n_snp_mals++;
+    }
+
+    if ( files->n_smpl )
+        do_sample_stats(args, stats, reader, ret);
+
+    if ( bcf_get_info_int32(reader->header,line,"DP",&args->tmp_iaf,&args->ntmp_iaf)==1 )
+        (*idist(&stats->dp_sites, args->tmp_iaf[0]))++;    
+}
+
 static void do_vcf_stats(args_t *args)
 {
     bcf_srs_t *files = args->files;
@@ -1045,38 +1157,478 @@ static void do_vcf_stats(args_t *args)
         }
         if ( !pass ) continue;
 
-        int line_type = bcf_get_variant_types(line);
-        init_iaf(args, reader);
+        do_record_stats(args, reader, line, ret);
+    }
+}
 
-        stats_t *stats = &args->stats[ret-1];
-        if ( args->split_by_id && line->d.id[0]=='.' && !line->d.id[1] )
-            stats = &args->stats[1];
+/*
+    With --record-threads, the records which pass the filters are copied into
+    batches which are processed by the workers of a batch pool. Each worker has
+    a private copy of args_t with its own stats_t accumulators, temporary
+    buffers, exons and indel context, so that no locking is needed. The stats
+    are merged before print_stats(). Only a single file is supported: the
+    comparison of two files needs both readers and all-sample stats shared
+    across records.
+*/
+typedef struct
+{
+    args_t *args;
+    bcf_sr_t reader;    // shallow copy of the reader, the buffer replaced by the record being processed
+}
+stats_worker_t;
 
-        stats->n_records++;
+typedef struct
+{
+    bcf1_t **recs;
+    int nrecs;
+}
+stats_batch_t;
 
-        if ( line_type==VCF_REF )
-            stats->n_noalts++;
-        if ( line_type&VCF_SNP )
-            do_snp_stats(args, stats, reader);
-        if ( line_type&VCF_INDEL )
-            do_indel_stats(args, stats, reader);
-        if ( line_type&VCF_MNP )
-            do_mnp_stats(args, stats, reader);
-        if ( line_type&VCF_OTHER )
-            do_other_stats(args, stats, reader);
+static void init_record_threads(args_t *args)
+{
+    int i, j;
+    args->workers = (args_t**) malloc(sizeof(args_t*)*args->record_threads);
+    for (i=0; i<args->record_threads; i++)
+    {
+        args_t *wargs = args->workers[i] = (args_t*) malloc(sizeof(args_t));
+        memcpy(wargs, args, sizeof(args_t));
+        wargs->tmp_iaf = NULL; wargs->ntmp_iaf = 0;
+        wargs->tmp_frm = NULL; wargs->mtmp_frm = 0;
+        wargs->farr = NULL; wargs->mfarr = 0;
+        wargs->filter[0] = wargs->filter[1] = NULL;
+        wargs->workers = NULL;
+        for (j=0; j<args->nstats; j++)
+        {
+            memset(&wargs->stats[j], 0, sizeof(stats_t));
+            init_stats_arrays(wargs, &wargs->stats[j], args->files->readers[0].header);
+        }
+        if ( args->exons_fname )
+        {
+            wargs->exons = bcf_sr_regions_init(args->exons_fname,1,0,1,2);
+            if ( !wargs->exons )
+                error("Error occurred while reading, was the file compressed with bgzip: %s?\n", args->exons_fname);
+        }
+        #if IRC_STATS
+        if ( args->ref_fname )
+            wargs->indel_ctx = indel_ctx_init(args->ref_fname);
+        #endif
+    }
+}
+static void destroy_record_threads(args_t *args)
+{
+    int i, j;
+    for (i=0; i<args->record_threads; i++)
+    {
+        args_t *wargs = args->workers[i];
+        for (j=0; j<args->nstats; j++)
+        {
+            merge_stats(args, &args->stats[j], &wargs->stats[j]);
+            destroy_stats_arrays(wargs, &wargs->stats[j]);
+        }
+        free(wargs->farr);
+        free(wargs->tmp_frm);
+        free(wargs->tmp_iaf);
+        if ( wargs->exons ) bcf_sr_regions_destroy(wargs->exons);
+        if ( wargs->indel_ctx ) indel_ctx_destroy(wargs->indel_ctx);
+        free(wargs);
+    }
+    free(args->workers);
+    args->workers = NULL;
+}
+static void stats_batch_work(void *worker, void *data)
+{
+    stats_worker_t *wrk = (stats_worker_t*) worker;
+    stats_batch_t *batch = (stats_batch_t*) data;
+    int i;
+    for (i=0; i<batch->nrecs; i++)
+    {
+        bcf1_t *line = batch->recs[i];
+        bcf_unpack(line, BCF_UN_ALL);
+        wrk->reader.buffer = &batch->recs[i];
+        do_record_stats(wrk->args, &wrk->reader, line, 1);
+    }
+}
+static void stats_batch_write(void *data, void *batch)
+{
+    // nothing to output, the stats are accumulated by the workers
+}
+static void do_vcf_stats_threaded(args_t *args)
+{
+    bcf_srs_t *files = args->files;
+    int i, j, nthreads = args->record_threads, nbatch = 2*nthreads;
+
+    init_record_threads(args);
+    stats_worker_t *wrk = (stats_worker_t*) malloc(sizeof(stats_worker_t)*nthreads);
+    void **workers = (void**) malloc(sizeof(void*)*nthreads);
+    for (i=0; i<nthreads; i++)
+    {
+        wrk[i].args   = args->workers[i];
+        wrk[i].reader = files->readers[0];
+        workers[i] = &wrk[i];
+    }
+    stats_batch_t *batch = (stats_batch_t*) calloc(nbatch, sizeof(stats_batch_t));
+    void **batches = (void**) malloc(sizeof(void*)*nbatch);
+    for (i=0; i<nbatch; i++)
+    {
+        batch[i].recs = (bcf1_t**) malloc(sizeof(bcf1_t*)*STATS_BATCH);
+        for (j=0; j<STATS_BATCH; j++) batch[i].recs[j] = bcf_init1();
+        batches[i] = &batch[i];
+    }
 
-        if ( line->n_allele>2 )
+    batch_pool_t *pool = batch_pool_init(nthreads, workers, batches, nbatch, stats_batch_work, stats_batch_write, NULL);
+    int eof = 0;
+    while ( !eof )
+    {
+        stats_batch_t *bt = (stats_batch_t*) batch_pool_get(pool);
+        bt->nrecs = 0;
+        while ( bt->nrecs < STATS_BATCH )
         {
-            stats->n_mals++;
-            if ( line_type == VCF_SNP ) stats->n_snp_mals++;
+            if ( !bcf_sr_next_line(files) ) { eof = 1; break; }
+            bcf1_t *line = bcf_sr_get_line(files,0);
+            if ( args->filter[0] )
+            {
+                int is_ok = filter_test(args->filter[0], line, NULL);
+                if ( args->filter_logic & FLT_EXCLUDE ) is_ok = is_ok ? 0 : 1;
+                if ( !is_ok ) continue;
+            }
+            bcf_copy(bt->recs[bt->nrecs++], line);
         }
+        if ( bt->nrecs ) batch_pool_submit(pool);
+    }
+    batch_pool_destroy(pool);
+    destroy_record_threads(args);
 
-        if ( files->n_smpl )
-            do_sample_stats(args, stats, reader, ret);
+    for (i=0; i<nbatch; i++)
+    {
+        for (j=0; j<STATS_BATCH; j++) bcf_destroy(batch[i].recs[j]);
+        free(batch[i].recs);
+    }
+    free(batch);
+    free(batches);
+    free(wrk);
+    free(workers);
+}
 
-        if ( bcf_get_info_int32(reader->header,line,"DP",&args->tmp_iaf,&args->ntmp_iaf)==1 )
-            (*idist(&stats->dp_sites, args->tmp_iaf[0]))++;    
+static void dump_io(BGZF *fp, const char *fname, void *data, size_t size, int is_write)
+{
+    if ( !size ) return;
+    if ( is_write )
+    {
+        if ( bgzf_write(fp, data, size)!=(ssize_t)size ) error("Failed to write to %s\n", fname);
     }
+    else if ( bgzf_read(fp, data, size)!=(ssize_t)size )
+        error("Failed to read %s: the file is truncated or not a stats dump\n", fname);
+}
+#define DUMP_IO(ptr,n) dump_io(fp, fname, (ptr), sizeof(*(ptr))*(n), is_write)
+
+static void dump_write_str(BGZF *fp, const char *fname, const char *str)
+{
+    int is_write = 1, len = str ? strlen(str) : -1;
+    DUMP_IO(&len,1);
+    if ( len>0 ) dump_io(fp, fname, (void*)str, len, is_write);
+}
+static char *dump_read_str(BGZF *fp, const char *fname)
+{
+    int is_write = 0, len;
+    DUMP_IO(&len,1);
+    if ( len<0 ) return NULL;
+    char *str = (char*) malloc(len+1);
+    dump_io(fp, fname, str, len, is_write);
+    str[len] = 0;
+    return str;
+}
+
+// Reads or writes the counts of one stats_t; the arrays must be allocated by init_stats_arrays()
+static void dump_stats_io(args_t *args, BGZF *fp, const char *fname, stats_t *stats, int is_write)
+{
+    int j;
+    DUMP_IO(&stats->n_snps,1);
+    DUMP_IO(&stats->n_indels,1);
+    DUMP_IO(&stats->n_mnps,1);
+    DUMP_IO(&stats->n_others,1);
+    DUMP_IO(&stats->n_mals,1);
+    DUMP_IO(&stats->n_snp_mals,1);
+    DUMP_IO(&stats->n_records,1);
+    DUMP_IO(&stats->n_noalts,1);
+    DUMP_IO(&stats->ts_alt1,1);
+    DUMP_IO(&stats->tv_alt1,1);
+    DUMP_IO(&stats->in_frame,1);
+    DUMP_IO(&stats->out_frame,1);
+    DUMP_IO(&stats->na_frame,1);
+    DUMP_IO(&stats->in_frame_alt1,1);
+    DUMP_IO(&stats->out_frame_alt1,1);
+    DUMP_IO(&stats->na_frame_alt1,1);
+    DUMP_IO(stats->subst,15);
+    DUMP_IO(stats->af_ts,args->m_af);
+    DUMP_IO(stats->af_tv,args->m_af);
+    DUMP_IO(stats->af_snps,args->m_af);
+    #if IRC_STATS
+        DUMP_IO(&stats->n_repeat[0][0],IRC_RLEN*4);
+        DUMP_IO(&stats->n_repeat_na,1);
+        for (j=0; j<3; j++) DUMP_IO(stats->af_repeats[j],args->m_af);
+    #endif
+    #if QUAL_STATS
+        DUMP_IO(stats->qual_ts,args->m_qual);
+        DUMP_IO(stats->qual_tv,args->m_qual);
+        DUMP_IO(stats->qual_snps,args->m_qual);
+        DUMP_IO(stats->qual_indels,args->m_qual);
+    #endif
+    DUMP_IO(stats->insertions,stats->m_indel);
+    DUMP_IO(stats->deletions,stats->m_indel);
+    if ( args->n_smpl )
+    {
+        DUMP_IO(stats->smpl_hets,args->n_smpl);
+        DUMP_IO(stats->smpl_homAA,args->n_smpl);
+        DUMP_IO(stats->smpl_homRR,args->n_smpl);
+        DUMP_IO(stats->smpl_indel_hets,args->n_smpl);
+        DUMP_IO(stats->smpl_indel_homs,args->n_smpl);
+        DUMP_IO(stats->smpl_ts,args->n_smpl);
+        DUMP_IO(stats->smpl_tv,args->n_smpl);
+        DUMP_IO(stats->smpl_indels,args->n_smpl);
+        DUMP_IO(stats->smpl_dp,args->n_smpl);
+        DUMP_IO(stats->smpl_ndp,args->n_smpl);
+        DUMP_IO(stats->smpl_sngl,args->n_smpl);
+        #if HWE_STATS
+            DUMP_IO(stats->af_hwe,args->m_af*args->naf_hwe);
+        #endif
+        if ( stats->smpl_frm_shifts ) DUMP_IO(stats->smpl_frm_shifts,args->n_smpl*3);
+    }
+    DUMP_IO(stats->dp.vals,stats->dp.m_vals);
+    DUMP_IO(stats->dp_sites.vals,stats->dp_sites.m_vals);
+    for (j=0; j<stats->nusr; j++)
+    {
+        DUMP_IO(stats->usr[j].vals_ts,stats->usr[j].nbins);
+        DUMP_IO(stats->usr[j].vals_tv,stats->usr[j].nbins);
+    }
+}
+static void dump_gts_io(args_t *args, BGZF *fp, const char *fname, gtcmp_t *af_snps, gtcmp_t *af_indels, gtcmp_t *smpl_snps, gtcmp_t *smpl_indels, int is_write)
+{
+    DUMP_IO(af_snps,args->m_af);
+    DUMP_IO(af_indels,args->m_af);
+    DUMP_IO(smpl_snps,args->n_smpl);
+    DUMP_IO(smpl_indels,args->n_smpl);
+}
+static void merge_gtcmp(gtcmp_t *dst, gtcmp_t *src, int n)
+{
+    int i, j, k;
+    for (i=0; i<n; i++)
+    {
+        for (j=0; j<5; j++)
+            for (k=0; k<5; k++) dst[i].gt2gt[j][k] += src[i].gt2gt[j][k];
+        dst[i].y  += src[i].y;
+        dst[i].yy += src[i].yy;
+        dst[i].x  += src[i].x;
+        dst[i].xx += src[i].xx;
+        dst[i].yx += src[i].yx;
+        dst[i].n  += src[i].n;
+    }
+}
+static void init_dump_hdr(args_t *args, stats_dump_t *hdr)
+{
+    int i;
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->nreaders    = args->nreaders;
+    hdr->nstats      = args->nstats;
+    hdr->split_by_id = args->split_by_id;
+    hdr->n_smpl      = args->n_smpl;
+    for (i=0; i<args->nreaders; i++) hdr->nsmpl_rdr[i] = args->nsmpl_rdr[i];
+    hdr->m_af        = args->m_af;
+    hdr->naf_bins    = args->af_bins ? bin_get_size(args->af_bins) : 0;
+    hdr->m_qual      = args->m_qual;
+    hdr->naf_hwe     = args->naf_hwe;
+    hdr->m_indel     = args->stats[0].m_indel;
+    hdr->dp_min      = args->dp_min;
+    hdr->dp_max      = args->dp_max;
+    hdr->dp_step     = args->dp_step;
+    hdr->nusr        = args->nusr;
+    hdr->has_gts     = args->af_gts_snps ? 1 : 0;
+    hdr->has_exons   = args->exons_fname ? 1 : 0;
+    hdr->has_ref     = args->ref_fname ? 1 : 0;
+}
+static void write_dump(args_t *args)
+{
+    const char *fname = args->dump_fname;
+    BGZF *fp = bgzf_open(fname, "wg");
+    if ( !fp ) error("Failed to open %s: %s\n", fname, strerror(errno));
+
+    int i, is_write = 1;
+    stats_dump_t hdr;
+    init_dump_hdr(args, &hdr);
+    dump_io(fp, fname, STATS_DUMP_MAGIC, 8, is_write);
+    DUMP_IO(&hdr,1);
+    for (i=0; i<args->nreaders; i++) dump_write_str(fp, fname, args->fnames[i]);
+    for (i=0; i<args->n_smpl; i++) dump_write_str(fp, fname, args->samples[i]);
+    dump_write_str(fp, fname, args->exons_fname);
+    dump_write_str(fp, fname, args->ref_fname);
+    for (i=0; i<hdr.naf_bins; i++)
+    {
+        float val = bin_get_value(args->af_bins, i);
+        DUMP_IO(&val,1);
+    }
+    for (i=0; i<args->nusr; i++)
+    {
+        user_stats_t *usr = &args->stats[0].usr[i];
+        dump_write_str(fp, fname, usr->tag);
+        DUMP_IO(&usr->min,1);
+        DUMP_IO(&usr->max,1);
+        DUMP_IO(&usr->nbins,1);
+        DUMP_IO(&usr->type,1);
+    }
+    for (i=0; i<args->nstats; i++)
+        dump_stats_io(args, fp, fname, &args->stats[i], is_write);
+    if ( hdr.has_gts )
+        dump_gts_io(args, fp, fname, args->af_gts_snps, args->af_gts_indels, args->smpl_gts_snps, args->smpl_gts_indels, is_write);
+    if ( bgzf_close(fp)!=0 ) error("Failed to close %s\n", fname);
+}
+
+// The first dump initializes the settings and allocates the arrays, the next ones are checked against it
+static void init_from_dump(args_t *args, BGZF *fp, const char *fname, stats_dump_t *hdr)
+{
+    int i;
+    args->nreaders    = hdr->nreaders;
+    args->nstats      = hdr->nstats;
+    args->split_by_id = hdr->split_by_id;
+    args->n_smpl      = hdr->n_smpl;
+    for (i=0; i<args->nreaders; i++) args->nsmpl_rdr[i] = hdr->nsmpl_rdr[i];
+    args->m_af        = hdr->m_af;
+    args->m_qual      = hdr->m_qual;
+    args->naf_hwe     = hdr->naf_hwe;
+    args->dp_min      = hdr->dp_min;
+    args->dp_max      = hdr->dp_max;
+    args->dp_step     = hdr->dp_step;
+    if ( args->nreaders<1 || args->nreaders>2 || args->nstats<1 || args->nstats>3 || args->m_af<=0 || args->n_smpl<0
+            || args->dp_step<=0 || args->dp_max<args->dp_min || hdr->nusr<0 )
+        error("Could not parse %s, not a stats dump?\n", fname);
+
+    for (i=0; i<args->nreaders; i++) args->fnames[i] = dump_read_str(fp, fname);
+    args->samples = (char**) malloc(sizeof(char*)*args->n_smpl);
+    for (i=0; i<args->n_smpl; i++) args->samples[i] = dump_read_str(fp, fname);
+    args->exons_fname = dump_read_str(fp, fname);
+    args->ref_fname   = dump_read_str(fp, fname);
+    if ( hdr->naf_bins )
+    {
+        int is_write = 0;
+        kstring_t str = {0,0,0};
+        for (i=0; i<hdr->naf_bins; i++)
+        {
+            float val;
+            DUMP_IO(&val,1);
+            ksprintf(&str, "%s%.9g", i ? "," : "", val);
+        }
+        args->af_bins = bin_init(str.s,0,1);
+        free(str.s);
+    }
+    for (i=0; i<hdr->nusr; i++)
+    {
+        int is_write = 0;
+        args->nusr++;
+        args->usr = (user_stats_t*) realloc(args->usr,sizeof(user_stats_t)*args->nusr);
+        user_stats_t *usr = &args->usr[args->nusr-1];
+        memset(usr,0,sizeof(*usr));
+        usr->tag = dump_read_str(fp, fname);
+        DUMP_IO(&usr->min,1);
+        DUMP_IO(&usr->max,1);
+        DUMP_IO(&usr->nbins,1);
+        DUMP_IO(&usr->type,1);
+        if ( !usr->tag || usr->nbins<=0 ) error("Could not parse %s, not a stats dump?\n", fname);
+    }
+    for (i=0; i<args->nstats; i++)
+        init_stats_arrays(args, &args->stats[i], NULL);
+    if ( hdr->m_indel!=args->stats[0].m_indel ) error("Could not parse %s, not a stats dump?\n", fname);
+    if ( hdr->has_gts )
+    {
+        args->af_gts_snps     = (gtcmp_t *) calloc(args->m_af,sizeof(gtcmp_t));
+        args->af_gts_indels   = (gtcmp_t *) calloc(args->m_af,sizeof(gtcmp_t));
+        args->smpl_gts_snps   = (gtcmp_t *) calloc(args->n_smpl,sizeof(gtcmp_t));
+        args->smpl_gts_indels = (gtcmp_t *) calloc(args->n_smpl,sizeof(gtcmp_t));
+    }
+}
+static void check_dump(args_t *args, BGZF *fp, const char *fname, stats_dump_t *hdr)
+{
+    stats_dump_t ref;
+    init_dump_hdr(args, &ref);
+    if ( memcmp(&ref, hdr, sizeof(ref)) )
+        error("The stats in %s were collected with different options or samples than in the first dump\n", fname);
+
+    int i, is_write = 0;
+    for (i=0; i<args->nreaders; i++) free(dump_read_str(fp, fname));     // the names of the first dump are kept
+    for (i=0; i<args->n_smpl; i++)
+    {
+        char *smpl = dump_read_str(fp, fname);
+        if ( !smpl || strcmp(smpl,args->samples[i]) )
+            error("The samples in %s differ from those in the first dump: %s vs %s\n", fname, smpl ? smpl : "", args->samples[i]);
+        free(smpl);
+    }
+    free(dump_read_str(fp, fname));
+    free(dump_read_str(fp, fname));
+    for (i=0; i<hdr->naf_bins; i++)
+    {
+        float val;
+        DUMP_IO(&val,1);
+        if ( val!=bin_get_value(args->af_bins,i) ) error("The --af-bins in %s differ from the first dump\n", fname);
+    }
+    for (i=0; i<hdr->nusr; i++)
+    {
+        user_stats_t usr, *ref_usr = &args->usr[i];
+        usr.tag = dump_read_str(fp, fname);
+        DUMP_IO(&usr.min,1);
+        DUMP_IO(&usr.max,1);
+        DUMP_IO(&usr.nbins,1);
+        DUMP_IO(&usr.type,1);
+        if ( !usr.tag || strcmp(usr.tag,ref_usr->tag) || usr.min!=ref_usr->min || usr.max!=ref_usr->max || usr.nbins!=ref_usr->nbins || usr.type!=ref_usr->type )
+            error("The --user-tstv settings in %s differ from the first dump\n", fname);
+        free(usr.tag);
+    }
+}
+static void merge_dump(args_t *args, const char *fname, int is_first)
+{
+    BGZF *fp = bgzf_open(fname, "r");
+    if ( !fp ) error("Failed to open %s: %s\n", fname, strerror(errno));
+
+    int i, is_write = 0;
+    char magic[8];
+    stats_dump_t hdr;
+    dump_io(fp, fname, magic, 8, is_write);
+    if ( memcmp(magic, STATS_DUMP_MAGIC, 8) ) error("The file is not a bcftools stats dump: %s\n", fname);
+    DUMP_IO(&hdr,1);
+    if ( is_first ) init_from_dump(args, fp, fname, &hdr);
+    else check_dump(args, fp, fname, &hdr);
+
+    stats_t tmp;
+    for (i=0; i<args->nstats; i++)
+    {
+        memset(&tmp, 0, sizeof(tmp));
+        init_stats_arrays(args, &tmp, NULL);
+        dump_stats_io(args, fp, fname, &tmp, is_write);
+        merge_stats(args, &args->stats[i], &tmp);
+        destroy_stats_arrays(args, &tmp);
+    }
+    if ( hdr.has_gts )
+    {
+        gtcmp_t *af_snps     = (gtcmp_t *) calloc(args->m_af,sizeof(gtcmp_t));
+        gtcmp_t *af_indels   = (gtcmp_t *) calloc(args->m_af,sizeof(gtcmp_t));
+        gtcmp_t *smpl_snps   = (gtcmp_t *) calloc(args->n_smpl,sizeof(gtcmp_t));
+        gtcmp_t *smpl_indels = (gtcmp_t *) calloc(args->n_smpl,sizeof(gtcmp_t));
+        dump_gts_io(args, fp, fname, af_snps, af_indels, smpl_snps, smpl_indels, is_write);
+        merge_gtcmp(args->af_gts_snps, af_snps, args->m_af);
+        merge_gtcmp(args->af_gts_indels, af_indels, args->m_af);
+        merge_gtcmp(args->smpl_gts_snps, smpl_snps, args->n_smpl);
+        merge_gtcmp(args->smpl_gts_indels, smpl_indels, args->n_smpl);
+        free(af_snps);
+        free(af_indels);
+        free(smpl_snps);
+        free(smpl_indels);
+    }
+    if ( bgzf_close(fp)!=0 ) error("Failed to close %s\n", fname);
+}
+static void destroy_merge(args_t *args)
+{
+    int i;
+    for (i=0; i<args->nreaders; i++) free(args->fnames[i]);
+    for (i=0; i<args->n_smpl; i++) free(args->samples[i]);
+    free(args->samples);
+    free(args->exons_fname);
+    free(args->ref_fname);
 }
 
 static void print_header(args_t *args)
@@ -1089,9 +1641,9 @@ static void print_header(args_t *args)
     printf("\n#\n");
 
     printf("# Definition of sets:\n# ID\t[2]id\t[3]tab-separated file names\n");
-    if ( args->files->nreaders==1 )
+    if ( args->nreaders==1 )
     {
-        const char *fname = strcmp("-",args->files->readers[0].fname) ? args->files->readers[0].fname : "<STDIN>";
+        const char *fname = strcmp("-",args->fnames[0]) ? args->fnames[0] : "<STDIN>";
         if ( args->split_by_id )
         {
             printf("ID\t0\t%s:known (sites with ID different from \".\")\n", fname);
@@ -1102,8 +1654,8 @@ static void print_header(args_t *args)
     }
     else
     {
-        const char *fname0 = strcmp("-",args->files->readers[0].fname) ? args->files->readers[0].fname : "<STDIN>";
-        const char *fname1 = strcmp("-",args->files->readers[1].fname) ? args->files->readers[1].fname : "<STDIN>";
+        const char *fname0 = strcmp("-",args->fnames[0]) ? args->fnames[0] : "<STDIN>";
+        const char *fname1 = strcmp("-",args->fnames[1]) ? args->fnames[1] : "<STDIN>";
         printf("ID\t0\t%s\n", fname0);
         printf("ID\t1\t%s\n", fname1);
         printf("ID\t2\t%s\t%s\n", fname0,fname1);
@@ -1126,8 +1678,8 @@ static void print_stats(args_t *args)
 {
     int i, j,k, id;
     printf("# SN, Summary numbers:\n# SN\t[2]id\t[3]key\t[4]value\n");
-    for (id=0; id<args->files->nreaders; id++)
-        printf("SN\t%d\tnumber of samples:\t%d\n", id, bcf_hdr_nsamples(args->files->readers[id].header));
+    for (id=0; id<args->nreaders; id++)
+        printf("SN\t%d\tnumber of samples:\t%d\n", id, args->nsmpl_rdr[id]);
     for (id=0; id<args->nstats; id++)
     {
         stats_t *stats = &args->stats[id];
@@ -1158,7 +1710,7 @@ static void print_stats(args_t *args)
             printf("FS\t%d\t%d\t%d\t%d\t%.2f\t%d\t%d\t%d\t%.2f\n", id, in,out,na,out?(float)out/(in+out):0,in1,out1,na1,out1?(float)out1/(in1+out1):0);
         }
     }
-    if ( args->indel_ctx )
+    if ( args->ref_fname )
     {
         printf("# ICS, Indel context summary:\n# ICS\t[2]id\t[3]repeat-consistent\t[4]repeat-inconsistent\t[5]not applicable\t[6]c/(c+i) ratio\n");
         for (id=0; id<args->nstats; id++)
@@ -1275,9 +1827,9 @@ static void print_stats(args_t *args)
             printf("ST\t%d\t%c>%c\t%d\n", id, bcf_int2acgt(t>>2),bcf_int2acgt(t&3),args->stats[id].subst[t]);
         }
     }
-    if ( args->files->nreaders>1 && args->files->n_smpl )
+    if ( args->nreaders>1 && args->n_smpl )
     {
-        printf("SN\t%d\tnumber of samples:\t%d\n", 2, args->files->n_smpl);
+        printf("SN\t%d\tnumber of samples:\t%d\n", 2, args->n_smpl);
 
         int x;
         for (x=0; x<2; x++)     // x=0: snps, x=1: indels
@@ -1368,7 +1920,7 @@ static void print_stats(args_t *args)
                 printf("# GCiS, Genotype concordance by sample (indels)\n# GCiS\t[2]id\t[3]sample\t[4]non-reference discordance rate\t[5]RR Hom matches\t[6]RA Het matches\t[7]AA Hom matches\t[8]RR Hom mismatches\t[9]RA Het mismatches\t[10]AA Hom mismatches\t[11]dosage r-squared\n");
                 stats = args->smpl_gts_indels;
             }
-            for (i=0; i<args->files->n_smpl; i++)
+            for (i=0; i<args->n_smpl; i++)
             {
                 uint64_t mm = 0, m = stats[i].gt2gt[T2S(GT_HET_RA)][T2S(GT_HET_RA)] + stats[i].gt2gt[T2S(GT_HOM_AA)][T2S(GT_HOM_AA)];
                 for (j=0; j<3; j++)
@@ -1383,7 +1935,7 @@ static void print_stats(args_t *args)
                     r2 /= sqrt((stats[i].xx - stats[i].x*stats[i].x/stats[i].n) * (stats[i].yy - stats[i].y*stats[i].y/stats[i].n));
                     r2 *= r2;
                 }
-                printf("GC%cS\t2\t%s\t%.3f",  x==0 ? 's' : 'i', args->files->samples[i], m+mm ? mm*100.0/(m+mm) : 0);
+                printf("GC%cS\t2\t%s\t%.3f",  x==0 ? 's' : 'i', args->samples[i], m+mm ? mm*100.0/(m+mm) : 0);
                 printf("\t%"PRId64"\t%"PRId64"\t%"PRId64"", 
                     stats[i].gt2gt[T2S(GT_HOM_RR)][T2S(GT_HOM_RR)],
                     stats[i].gt2gt[T2S(GT_HET_RA)][T2S(GT_HET_RA)],
@@ -1439,9 +1991,9 @@ static void print_stats(args_t *args)
             printf("\t[%d]missing -> AA Het", ++i);
             printf("\t[%d]missing -> missing\n", ++i);
 
-            for (i=0; i<args->files->n_smpl; i++)
+            for (i=0; i<args->n_smpl; i++)
             {
-                printf("GCT%c\t%s",  x==0 ? 's' : 'i', args->files->samples[i]);
+                printf("GCT%c\t%s",  x==0 ? 's' : 'i', args->samples[i]);
                 for (j=0; j<5; j++)
                     for (k=0; k<5; k++)
                         printf("\t%"PRId64, stats[i].gt2gt[j][k]);
@@ -1468,16 +2020,16 @@ static void print_stats(args_t *args)
         }
     }
 
-    if ( args->files->n_smpl )
+    if ( args->n_smpl )
     {
         printf("# PSC, Per-sample counts\n# PSC\t[2]id\t[3]sample\t[4]nRefHom\t[5]nNonRefHom\t[6]nHets\t[7]nTransitions\t[8]nTransversions\t[9]nIndels\t[10]average depth\t[11]nSingletons\n");
         for (id=0; id<args->nstats; id++)
         {
             stats_t *stats = &args->stats[id];
-            for (i=0; i<args->files->n_smpl; i++)
+            for (i=0; i<args->n_smpl; i++)
             {
                 float dp = stats->smpl_ndp[i] ? stats->smpl_dp[i]/(float)stats->smpl_ndp[i] : 0;
-                printf("PSC\t%d\t%s\t%d\t%d\t%d\t%d\t%d\t%d\t%.1f\t%d\n", id,args->files->samples[i],
+                printf("PSC\t%d\t%s\t%d\t%d\t%d\t%d\t%d\t%d\t%.1f\t%d\n", id,args->samples[i],
                     stats->smpl_homRR[i], stats->smpl_homAA[i], stats->smpl_hets[i], stats->smpl_ts[i],
                     stats->smpl_tv[i], stats->smpl_indels[i],dp, stats->smpl_sngl[i]);
             }
@@ -1488,10 +2040,10 @@ static void print_stats(args_t *args)
         for (id=0; id<args->nstats; id++)
         {
             stats_t *stats = &args->stats[id];
-            for (i=0; i<args->files->n_smpl; i++)
+            for (i=0; i<args->n_smpl; i++)
             {
                 int na = 0, in = 0, out = 0;
-                if ( args->exons )
+                if ( args->exons_fname )
                 {
                     na  = stats->smpl_frm_shifts[i*3 + 0];
                     in  = stats->smpl_frm_shifts[i*3 + 1];
@@ -1499,7 +2051,7 @@ static void print_stats(args_t *args)
                 }
                 int nhom = stats->smpl_indel_homs[i];
                 int nhet = stats->smpl_indel_hets[i];
-                printf("PSI\t%d\t%s\t%d\t%d\t%d\t%.2f\t%d\t%d\n", id,args->files->samples[i], in,out,na,in+out?1.0*out/(in+out):0,nhet,nhom);
+                printf("PSI\t%d\t%s\t%d\t%d\t%d\t%.2f\t%d\t%d\n", id,args->samples[i], in,out,na,in+out?1.0*out/(in+out):0,nhet,nhom);
             }
         }
 
@@ -1555,6 +2107,7 @@ static void usage(void)
     fprintf(stderr, "         and the complements. By default only sites are compared, -s/-S must given to include\n");
     fprintf(stderr, "         also sample columns.\n");
     fprintf(stderr, "Usage:   bcftools stats [options] <A.vcf.gz> [<B.vcf.gz>]\n");
+    fprintf(stderr, "         bcftools stats --merge [--dump <file>] <A.dump> [...]\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "Options:\n");
     fprintf(stderr, "        --af-bins <list>               allele frequency bins, a list (0.1,0.5,1) or a file (0.1\\n0.5\\n1)\n");
@@ -1562,12 +2115,14 @@ static void usage(void)
     fprintf(stderr, "    -1, --1st-allele-only              include only 1st allele at multiallelic sites\n");
     fprintf(stderr, "    -c, --collapse <string>            treat as identical records with <snps|indels|both|all|some|none>, see man page for details [none]\n");
     fprintf(stderr, "    -d, --depth <int,int,int>          depth distribution: min,max,bin size [0,500,1]\n");
+    fprintf(stderr, "        --dump <file>                  save the stats also in a binary form which can be combined with --merge\n");
     fprintf(stderr, "    -e, --exclude <expr>               exclude sites for which the expression is true (see man page for details)\n");
     fprintf(stderr, "    -E, --exons <file.gz>              tab-delimited file with exons for indel frameshifts (chr,from,to; 1-based, inclusive, bgzip compressed)\n");
     fprintf(stderr, "    -f, --apply-filters <list>         require at least one of the listed FILTER strings (e.g. \"PASS,.\")\n");
     fprintf(stderr, "    -F, --fasta-ref <file>             faidx indexed reference sequence file to determine INDEL context\n");
     fprintf(stderr, "    -i, --include <expr>               select sites for which the expression is true (see man page for details)\n");
     fprintf(stderr, "    -I, --split-by-ID                  collect stats for sites with ID separately (known vs novel)\n");
+    fprintf(stderr, "        --merge                        combine --dump files created with the same options, e.g. per chunk\n");
     fprintf(stderr, "    -r, --regions <region>             restrict to comma-separated list of regions\n");
     fprintf(stderr, "    -R, --regions-file <file>          restrict to regions listed in a file\n");
     fprintf(stderr, "    -s, --samples <list>               list of samples for sample stats, \"-\" to include all samples\n");
@@ -1575,6 +2130,7 @@ static void usage(void)
     fprintf(stderr, "    -t, --targets <region>             similar to -r but streams rather than index-jumps\n");
     fprintf(stderr, "    -T, --targets-file <file>          similar to -R but streams rather than index-jumps\n");
     fprintf(stderr, "    -u, --user-tstv <TAG[:min:max:n]>  collect Ts/Tv stats for any tag using the given binning [0:1:100]\n");
+    fprintf(stderr, "        --record-threads <int>         number of threads to collect the stats in parallel, single file only [0]\n");
     fprintf(stderr, "        --threads <int>                number of extra decompression threads [0]\n");
     fprintf(stderr, "    -v, --verbose                      produce verbose per-site and per-sample output\n");
     fprintf(stderr, "\n");
@@ -1589,6 +2145,7 @@ int main_vcfstats(int argc, char *argv[])
     args->argc   = argc; args->argv = argv;
     args->dp_min = 0; args->dp_max = 500; args->dp_step = 1;
     int regions_is_file = 0, targets_is_file = 0;
+    char *tmp;
 
     static struct option loptions[] =
     {
@@ -1613,6 +2170,9 @@ int main_vcfstats(int argc, char *argv[])
         {"fasta-ref",1,0,'F'},
         {"user-tstv",1,0,'u'},
         {"threads",1,0,9},
+        {"record-threads",1,0,10},
+        {"dump",1,0,11},
+        {"merge",0,0,12},
         {0,0,0,0}
     };
     while ((c = getopt_long(argc, argv, "hc:r:R:e:s:S:d:i:t:T:F:f:1u:vIE:",loptions,NULL)) >= 0) {
@@ -1651,11 +2211,32 @@ int main_vcfstats(int argc, char *argv[])
             case 'e': args->filter_str = optarg; args->filter_logic |= FLT_EXCLUDE; break;
             case 'i': args->filter_str = optarg; args->filter_logic |= FLT_INCLUDE; break;
             case  9 : args->n_threads = strtol(optarg, 0, 0); break;
+            case 10 :
+                args->record_threads = strtol(optarg,&tmp,10);
+                if ( *tmp || args->record_threads<0 ) error("Could not parse argument: --record-threads %s\n", optarg);
+                break;
+            case 11 : args->dump_fname = optarg; break;
+            case 12 : args->merge = 1; break;
             case 'h':
             case '?': usage();
             default: error("Unknown argument: %s\n", optarg);
         }
     }
+    if ( args->merge )
+    {
+        if ( optind==argc ) usage();
+        int is_first = 1;
+        for (; optind<argc; optind++, is_first=0) merge_dump(args, argv[optind], is_first);
+        print_header(args);
+        print_stats(args);
+        if ( args->dump_fname ) write_dump(args);
+        destroy_stats(args);
+        destroy_merge(args);
+        bcf_sr_destroy(args->files);
+        free(args);
+        return 0;
+    }
+
     char *fname = NULL;
     if ( optind==argc )
     {
@@ -1685,10 +2266,16 @@ int main_vcfstats(int argc, char *argv[])
         fname = ++optind < argc ? argv[optind] : NULL;
     }
 
+    if ( args->record_threads > 1 && args->files->nreaders > 1 ) error("The --record-threads option can be used with a single file only\n");
+
     init_stats(args);
     print_header(args);
-    do_vcf_stats(args);
+    if ( args->record_threads > 1 )
+        do_vcf_stats_threaded(args);
+    else
+        do_vcf_stats(args);
     print_stats(args);
+    if ( args->dump_fname ) write_dump(args);
     destroy_stats(args);
     bcf_sr_destroy(args->files);
     free(args);
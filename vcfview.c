@@ -37,6 +37,9 @@ THE SOFTWARE.  */
 #include <htslib/vcfutils.h>
 #include "bcftools.h"
 #include "filter.h"
+#include "gtcount.h"
+#include "profile.h"
+#include "batch.h"
 #include "htslib/khash_str2int.h"
 
 #define FLT_INCLUDE 1
@@ -73,8 +76,10 @@ typedef struct _args_t
     int sample_is_file, force_samples;
     char *include_types, *exclude_types;
     int include, exclude;
-    int record_cmd_line;
+    int record_cmd_line, record_threads, write_index;
+    kstring_t indiv;    // the subset FORMAT block being built, swapped with the record's by subset_indiv()
     htsFile *out;
+    out_idx_t *out_idx;
 }
 args_t;
 
@@ -94,10 +99,7 @@ static void init_data(args_t *args)
     // setup sample data
     if (args->sample_names)
     {
-        void *hdr_samples = khash_str2int_init();
-        for (i=0; i<bcf_hdr_nsamples(args->hdr); i++)
-            khash_str2int_inc(hdr_samples, bcf_hdr_int2id(args->hdr,BCF_DT_SAMPLE,i));
-
+        // sample names are looked up in the header's own hash, no need to build another one
         void *exclude = (args->sample_names[0]=='^') ? khash_str2int_init() : NULL;
         int nsmpl;
         char **smpl = NULL;
@@ -107,11 +109,12 @@ static void init_data(args_t *args)
         {
             error("Could not read the list: \"%s\"\n", exclude ? &args->sample_names[1] : args->sample_names);
         }
+        args->samples = (char**) malloc(sizeof(char*)*(exclude ? bcf_hdr_nsamples(args->hdr) : nsmpl));
 
         if ( exclude )
         {
             for (i=0; i<nsmpl; i++) {
-                if (!khash_str2int_has_key(hdr_samples,smpl[i])) {
+                if (bcf_hdr_id2int(args->hdr,BCF_DT_SAMPLE,smpl[i])<0) {
                     if (args->force_samples) {
                         fprintf(stderr, "Warn: exclude called for sample that does not exist in header: \"%s\"... skipping\n", smpl[i]);
                     } else {
@@ -124,7 +127,6 @@ static void init_data(args_t *args)
             for (i=0; i<bcf_hdr_nsamples(args->hdr); i++)
             {
                 if ( exclude && khash_str2int_has_key(exclude,bcf_hdr_int2id(args->hdr,BCF_DT_SAMPLE,i))  ) continue;
-                args->samples = (char**) realloc(args->samples, (args->n_samples+1)*sizeof(const char*));
                 args->samples[args->n_samples++] = strdup(bcf_hdr_int2id(args->hdr,BCF_DT_SAMPLE,i));
             }
             khash_str2int_destroy(exclude);
@@ -132,7 +134,7 @@ static void init_data(args_t *args)
         else
         {
             for (i=0; i<nsmpl; i++) {
-                if (!khash_str2int_has_key(hdr_samples,smpl[i])) {
+                if (bcf_hdr_id2int(args->hdr,BCF_DT_SAMPLE,smpl[i])<0) {
                     if (args->force_samples) {
                         fprintf(stderr, "Warn: subset called for sample that does not exist in header: \"%s\"... skipping\n", smpl[i]);
                         continue;
@@ -140,13 +142,11 @@ static void init_data(args_t *args)
                         error("Error: subset called for sample that does not exist in header: \"%s\". Use \"--force-samples\" to ignore this error.\n", smpl[i]);
                     }
                 }
-                args->samples = (char**) realloc(args->samples, (args->n_samples+1)*sizeof(const char*));
                 args->samples[args->n_samples++] = strdup(smpl[i]);
             }
         }
         for (i=0; i<nsmpl; i++) free(smpl[i]);
         free(smpl);
-        khash_str2int_destroy(hdr_samples);
         if (args->n_samples == 0) {
             fprintf(stderr, "Warn: subsetting has removed all samples\n");
             args->sites_only = 1;
@@ -252,17 +252,16 @@ static void init_data(args_t *args)
 static void destroy_data(args_t *args)
 {
     int i;
-    if ( args->imap ) {
-        for (i = 0; i < args->n_samples; ++i)
-            free(args->samples[i]);
-        free(args->samples);
-        free(args->imap);
-    }
+    for (i = 0; i < args->n_samples; ++i)
+        free(args->samples[i]);
+    free(args->samples);
+    free(args->imap);
     if (args->hnull) bcf_hdr_destroy(args->hnull);
     if (args->hsub) bcf_hdr_destroy(args->hsub);
     if ( args->filter )
         filter_destroy(args->filter);
     free(args->ac);
+    free(args->indiv.s);
 }
 
 // true if all samples are phased.
@@ -270,7 +269,9 @@ static void destroy_data(args_t *args)
 // ./. => not phased, .|. => phased
 int bcf_all_phased(const bcf_hdr_t *header, bcf1_t *line)
 {
+    uint64_t t0 = profile_begin();
     bcf_unpack(line, BCF_UN_FMT);
+    profile_end(PROF_UNPACK, t0);
     bcf_fmt_t *fmt_ptr = bcf_get_fmt(header, line, "GT");
     int all_phased = 1;
     if ( fmt_ptr )
@@ -308,6 +309,52 @@ int bcf_all_phased(const bcf_hdr_t *header, bcf1_t *line)
     return all_phased;
 }
 
+// Subset the samples directly in the packed FORMAT block: the key and the type
+// of each field are copied as they are, followed by the byte ranges of the
+// selected samples, no values are decoded. Unlike bcf_subset(), which frees
+// the old block, the two buffers are swapped and kept for the next records,
+// with many samples their reallocation would cost more than the copying.
+static void subset_indiv(args_t *args, bcf1_t *line)
+{
+    if ( line->d.indiv_dirty )  // the packed block is not up to date
+    {
+        bcf_subset(args->hdr, line, args->n_samples, args->imap);
+        return;
+    }
+    kstring_t *tmp = &args->indiv;
+    tmp->l = 0;
+    int i, j;
+    uint8_t *ptr = (uint8_t*) line->indiv.s;
+    for (i=0; i<line->n_fmt; i++)
+    {
+        uint8_t *beg = ptr;
+        int type;
+        bcf_dec_typed_int1(ptr, &ptr);          // the key
+        int n = bcf_dec_size(ptr, &ptr, &type);
+        size_t size = (size_t)n << bcf_type_shift[type];
+        kputsn((char*)beg, ptr - beg, tmp);
+        ks_resize(tmp, tmp->l + size*args->n_samples + 1);
+        for (j=0; j<args->n_samples; j++)
+        {
+            memcpy(tmp->s + tmp->l, ptr + args->imap[j]*size, size);
+            tmp->l += size;
+        }
+        ptr += size*line->n_sample;
+    }
+    kstring_t swap = line->indiv; line->indiv = *tmp; *tmp = swap;
+    line->n_sample = args->n_samples;
+    line->unpacked &= ~BCF_UN_FMT;
+}
+
+// Drop the FORMAT block for -G, keeping the buffer allocated for the next records
+static void drop_indiv(bcf1_t *line)
+{
+    line->indiv.l  = 0;
+    line->n_sample = 0;
+    line->n_fmt    = 0;
+    line->unpacked &= ~BCF_UN_FMT;
+}
+
 int subset_vcf(args_t *args, bcf1_t *line)
 {
     if ( args->min_alleles && line->n_allele < args->min_alleles ) return 0; // min alleles
@@ -335,7 +382,7 @@ int subset_vcf(args_t *args, bcf1_t *line)
     hts_expand(int, line->n_allele, args->mac, args->ac);
     int i, an = 0, non_ref_ac = 0;
     if (args->calc_ac) {
-        bcf_calc_ac(args->hdr, line, args->ac, BCF_UN_INFO|BCF_UN_FMT); // get original AC and AN values from INFO field if available, otherwise calculate
+        gtcount_calc_ac(args->hdr, line, args->ac, BCF_UN_INFO|BCF_UN_FMT); // get original AC and AN values from INFO field if available, otherwise calculate
         for (i=1; i<line->n_allele; i++)
             non_ref_ac += args->ac[i];
         for (i=0; i<line->n_allele; i++)
@@ -345,9 +392,9 @@ int subset_vcf(args_t *args, bcf1_t *line)
     if (args->n_samples)
     {
         int non_ref_ac_sub = 0, *ac_sub = (int*) calloc(line->n_allele,sizeof(int));
-        bcf_subset(args->hdr, line, args->n_samples, args->imap);
+        subset_indiv(args, line);
         if (args->calc_ac) {
-            bcf_calc_ac(args->hsub, line, ac_sub, BCF_UN_FMT); // recalculate AC and AN
+            gtcount_calc_ac(args->hsub, line, ac_sub, BCF_UN_FMT); // recalculate AC and AN
             an = 0;
             for (i=0; i<line->n_allele; i++) {
                 args->ac[i] = ac_sub[i];
@@ -456,7 +503,7 @@ int subset_vcf(args_t *args, bcf1_t *line)
         if (args->phased == FLT_INCLUDE && !phased) { return 0; } // skip unphased
         if (args->phased == FLT_EXCLUDE && phased) { return 0; } // skip phased
     }
-    if (args->sites_only) bcf_subset(args->hsub ? args->hsub : args->hdr, line, 0, 0);
+    if (args->sites_only) drop_indiv(line);
     return 1;
 }
 
@@ -483,6 +530,105 @@ void set_allele_type (int *atype, char *atype_string)
     }
 }
 
+// Multi-threaded record processing (--record-threads): the main thread reads
+// batches of records, the workers of a batch pool run subset_vcf() on them,
+// each with a private copy of args_t, and the batches are written in the
+// original order.
+#define BATCH_SIZE      64
+
+typedef struct
+{
+    bcf1_t **rec;
+    uint8_t *pass;
+    int nrec;
+}
+batch_t;
+
+typedef struct
+{
+    args_t *args;
+    bcf_hdr_t *out_hdr;
+}
+batch_out_t;
+
+static void batch_work(void *worker, void *data)
+{
+    args_t *wargs  = (args_t*) worker;
+    batch_t *batch = (batch_t*) data;
+    int i;
+    for (i=0; i<batch->nrec; i++)
+        batch->pass[i] = subset_vcf(wargs, batch->rec[i]);
+}
+
+static void batch_write(void *data, void *bdata)
+{
+    batch_out_t *out = (batch_out_t*) data;
+    batch_t *batch = (batch_t*) bdata;
+    int i;
+    for (i=0; i<batch->nrec; i++)
+        if ( batch->pass[i] ) out_idx_write(out->args->out_idx, out->args->out, out->out_hdr, batch->rec[i]);
+}
+
+static void view_records_threaded(args_t *args, bcf_hdr_t *out_hdr)
+{
+    int i, j, nthreads = args->record_threads, nbatch = 2*nthreads;
+    args_t *wargs = (args_t*) malloc(sizeof(args_t)*nthreads);
+    void **workers = (void**) malloc(sizeof(void*)*nthreads);
+    for (i=0; i<nthreads; i++)
+    {
+        wargs[i] = *args;
+        wargs[i].ac  = NULL;
+        wargs[i].mac = 0;
+        memset(&wargs[i].indiv, 0, sizeof(wargs[i].indiv));
+        if ( wargs[i].filter_str ) wargs[i].filter = filter_init(wargs[i].hdr, wargs[i].filter_str);
+        workers[i] = &wargs[i];
+    }
+    batch_t *batch = (batch_t*) calloc(nbatch, sizeof(batch_t));
+    void **batches = (void**) malloc(sizeof(void*)*nbatch);
+    for (i=0; i<nbatch; i++)
+    {
+        batch[i].rec  = (bcf1_t**) malloc(sizeof(bcf1_t*)*BATCH_SIZE);
+        batch[i].pass = (uint8_t*) malloc(BATCH_SIZE);
+        for (j=0; j<BATCH_SIZE; j++) batch[i].rec[j] = bcf_init();
+        batches[i] = &batch[i];
+    }
+
+    batch_out_t out = { args, out_hdr };
+    batch_pool_t *pool = batch_pool_init(nthreads, workers, batches, nbatch, batch_work, batch_write, &out);
+    int eof = 0;
+    while ( !eof )
+    {
+        batch_t *bt = (batch_t*) batch_pool_get(pool);
+        bt->nrec = 0;
+        while ( bt->nrec < BATCH_SIZE )
+        {
+            if ( !profile_sr_next_line(args->files) ) { eof = 1; break; }
+            bcf1_t *line = args->files->readers[0].buffer[0];
+            if ( line->errcode && out_hdr!=args->hdr ) error("Undefined tags in the header, cannot proceed in the sample subset mode.\n");
+            bcf_copy(bt->rec[bt->nrec++], line);
+        }
+        if ( bt->nrec ) batch_pool_submit(pool);
+    }
+    batch_pool_destroy(pool);
+
+    for (i=0; i<nthreads; i++)
+    {
+        if ( wargs[i].filter ) filter_destroy(wargs[i].filter);
+        free(wargs[i].ac);
+        free(wargs[i].indiv.s);
+    }
+    for (i=0; i<nbatch; i++)
+    {
+        for (j=0; j<BATCH_SIZE; j++) bcf_destroy(batch[i].rec[j]);
+        free(batch[i].rec);
+        free(batch[i].pass);
+    }
+    free(batch);
+    free(batches);
+    free(wargs);
+    free(workers);
+}
+
 static void usage(args_t *args)
 {
     fprintf(stderr, "\n");
@@ -500,7 +646,9 @@ static void usage(args_t *args)
     fprintf(stderr, "    -R, --regions-file <file>           restrict to regions listed in a file\n");
     fprintf(stderr, "    -t, --targets [^]<region>           similar to -r but streams rather than index-jumps. Exclude regions with \"^\" prefix\n");
     fprintf(stderr, "    -T, --targets-file [^]<file>        similar to -R but streams rather than index-jumps. Exclude regions with \"^\" prefix\n");
+    fprintf(stderr, "        --record-threads <int>          number of threads subsetting and filtering records [0]\n");
     fprintf(stderr, "        --threads <int>                 number of extra (de)compression threads [0]\n");
+    fprintf(stderr, "        --write-index                   index the compressed output on the fly, the index is written to <file>.csi\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "Subset options:\n");
     fprintf(stderr, "    -a, --trim-alt-alleles        trim alternate alleles not seen in the subset\n");
@@ -547,6 +695,8 @@ int main_vcfview(int argc, char *argv[])
         {"genotype",required_argument,NULL,'g'},
         {"compression-level",required_argument,NULL,'l'},
         {"threads",required_argument,NULL,9},
+        {"record-threads",required_argument,NULL,10},
+        {"write-index",no_argument,NULL,11},
         {"header-only",no_argument,NULL,'h'},
         {"no-header",no_argument,NULL,'H'},
         {"exclude",required_argument,NULL,'e'},
@@ -690,6 +840,11 @@ int main_vcfview(int argc, char *argv[])
                 break;
             }
             case  9 : args->n_threads = strtol(optarg, 0, 0); break;
+            case 10 :
+                args->record_threads = strtol(optarg,&tmp,10);
+                if ( *tmp || args->record_threads<0 ) error("Could not parse argument: --record-threads %s\n", optarg);
+                break;
+            case 11 : args->write_index = 1; break;
             case  8 : args->record_cmd_line = 0; break;
             case '?': usage(args);
             default: error("Unknown argument: %s\n", optarg);
@@ -742,21 +897,27 @@ int main_vcfview(int argc, char *argv[])
         bcf_hdr_write(args->out, out_hdr);
     else if ( args->output_type & FT_BCF )
         error("BCF output requires header, cannot proceed with -H\n");
+    if ( args->write_index ) args->out_idx = out_idx_init(args->out, out_hdr, args->fn_out ? args->fn_out : "-");
 
     int ret = 0;
     if (!args->header_only)
     {
-        while ( bcf_sr_next_line(args->files) )
+        if ( args->record_threads )
+            view_records_threaded(args, out_hdr);
+        else
         {
-            bcf1_t *line = args->files->readers[0].buffer[0];
-            if ( line->errcode && out_hdr!=args->hdr ) error("Undefined tags in the header, cannot proceed in the sample subset mode.\n");
-            if ( subset_vcf(args, line) )
-                bcf_write1(args->out, out_hdr, line);
+            while ( profile_sr_next_line(args->files) )
+            {
+                bcf1_t *line = args->files->readers[0].buffer[0];
+                if ( line->errcode && out_hdr!=args->hdr ) error("Undefined tags in the header, cannot proceed in the sample subset mode.\n");
+                if ( subset_vcf(args, line) )
+                    out_idx_write(args->out_idx, args->out, out_hdr, line);
+            }
         }
         ret = args->files->errnum;
         if ( ret ) fprintf(stderr,"Error: %s\n", bcf_sr_strerror(args->files->errnum));
     }
-    hts_close(args->out);
+    out_idx_close(args->out_idx, args->out);
     destroy_data(args);
     bcf_sr_destroy(args->files);
     free(args);